@@ -0,0 +1,339 @@
+// Crypto micro-benchmark.
+//
+// Times the cryptographic primitives on the storage server's hot paths: onion request and response
+// encryption for each encryption type, client request signature verification (including
+// subaccount tokens), message hashing, base64 conversion, and key conversions.  Prints one JSON
+// object per line for each operation, payload size and thread count (throughput, and latency
+// percentiles in microseconds) so that results can be collected and compared between versions.
+//
+// Build via the `crypto-bench` target from a build directory (it is not built by default).
+
+#include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/keys.h>
+#include <oxenss/crypto/subaccount.h>
+#include <oxenss/rpc/request_handler.h>
+#include <oxenss/utils/base64.hpp>
+
+#include <fmt/format.h>
+#include <oxenc/base64.h>
+#include <oxenc/hex.h>
+#include <sodium.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+using namespace oxenss;
+
+using bench_clock = std::chrono::steady_clock;
+
+int usage(std::string_view argv0, std::string_view err = "") {
+    if (!err.empty())
+        std::cerr << "\x1b[31;1mError: " << err << "\x1b[0m\n\n";
+    std::cerr << "Usage: " << argv0 << R"( [OPTIONS]
+
+Benchmarks the storage server's crypto primitives, printing one JSON result object per line to
+stdout.  The operations timed are:
+
+- encrypt-TYPE/decrypt-TYPE -- onion request/response encryption, for each of the aes-cbc,
+  aes-gcm and xchacha20 encryption types (including the x25519 key exchange),
+- message_hash -- computing a message's hash (as for each stored message),
+- to_base64/from_base64 -- base64 conversion of message data, with both oxenc's and our own
+  (SIMD) implementations,
+- verify-ed25519, verify-session and verify-subaccount[-cached] -- client request signature
+  verification for an account with an Ed25519 pubkey, a Session ID (which also has to check the
+  Ed25519 to X25519 pubkey conversion), and via a subaccount token (with and without the
+  subaccount cache),
+- ed_pk_to_x25519, ed_sk_to_x25519, x25519_dh -- key conversions and the x25519 key exchange.
+
+Options:
+    --sizes N[,N...]    Payload sizes, in bytes, for the operations that take a payload
+                        [100,1000,10000,76800]
+    --threads N[,N...]  Numbers of threads to run each operation with concurrently [1,)"
+              << std::max(1u, std::thread::hardware_concurrency()) << R"(]
+    --ops N             Number of operations to time for each operation, size and thread count
+                        [10000]
+    --filter STR        Only run operations whose name contains STR
+)";
+    return 1;
+}
+
+struct bench_config {
+    std::vector<size_t> sizes{100, 1000, 10'000, 76'800};
+    std::vector<int> threads{
+            1, static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))};
+    size_t ops = 10'000;
+    std::string filter;
+};
+
+struct bench_result {
+    int threads;
+    size_t count;
+    bench_clock::duration elapsed;
+    std::vector<int64_t> latencies_ns;
+};
+
+// Calls `op(i)` for each i in [0, count), spread over `threads` threads, timing each call.
+bench_result run(int threads, size_t count, const std::function<void(size_t)>& op) {
+    std::vector<std::vector<int64_t>> latencies(threads);
+    std::vector<std::thread> workers;
+    auto started = bench_clock::now();
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back([&, t] {
+            auto& lat = latencies[t];
+            lat.reserve(count / threads + 1);
+            for (size_t i = t; i < count; i += threads) {
+                auto start = bench_clock::now();
+                op(i);
+                lat.push_back((bench_clock::now() - start) / 1ns);
+            }
+        });
+    for (auto& w : workers)
+        w.join();
+
+    bench_result result{threads, count, bench_clock::now() - started, {}};
+    for (auto& lat : latencies)
+        result.latencies_ns.insert(result.latencies_ns.end(), lat.begin(), lat.end());
+    std::sort(result.latencies_ns.begin(), result.latencies_ns.end());
+    return result;
+}
+
+void print(std::string_view name, size_t size, const bench_result& r) {
+    auto pct = [&](double p) {
+        if (r.latencies_ns.empty())
+            return 0.0;
+        auto n = r.latencies_ns.size();
+        return r.latencies_ns[std::min(n - 1, static_cast<size_t>(p * n))] / 1000.0;
+    };
+    double seconds = std::chrono::duration<double>(r.elapsed).count();
+    double ops_per_sec = seconds > 0 ? r.count / seconds : 0.0;
+    fmt::print(
+            "{{\"op\":\"{}\",\"size\":{},\"threads\":{},\"count\":{},\"seconds\":{:.6f},"
+            "\"ops_per_sec\":{:.1f},\"mb_per_sec\":{:.1f},\"p50_us\":{:.2f},\"p99_us\":{:.2f},"
+            "\"max_us\":{:.2f}}}\n",
+            name,
+            size,
+            r.threads,
+            r.count,
+            seconds,
+            ops_per_sec,
+            ops_per_sec * size / 1e6,
+            pct(0.5),
+            pct(0.99),
+            pct(1.0));
+    std::fflush(stdout);
+}
+
+template <typename T>
+bool parse_int(std::string_view s, T& val) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), val);
+    return ec == std::errc{} && end == s.data() + s.size() && val > 0;
+}
+
+template <typename T>
+bool parse_list(std::string_view arg, std::vector<T>& out) {
+    out.clear();
+    while (!arg.empty()) {
+        auto comma = arg.find(',');
+        T val;
+        if (!parse_int(arg.substr(0, comma), val))
+            return false;
+        out.push_back(val);
+        arg = comma == std::string_view::npos ? ""sv : arg.substr(comma + 1);
+    }
+    return !out.empty();
+}
+
+std::string random_bytes(size_t size) {
+    std::string data;
+    data.resize(size);
+    randombytes_buf(data.data(), data.size());
+    return data;
+}
+
+// An Ed25519 keypair, along with its Session ID (i.e. 05-prefixed X25519) user pubkey.
+struct ed_keys {
+    std::array<unsigned char, 32> pk;
+    std::array<unsigned char, 64> sk;
+    user_pubkey session_id;
+
+    ed_keys() {
+        crypto_sign_keypair(pk.data(), sk.data());
+        std::array<unsigned char, 32> x;
+        crypto_sign_ed25519_pk_to_curve25519(x.data(), pk.data());
+        session_id.load("05" + oxenc::to_hex(x.begin(), x.end()));
+    }
+
+    std::array<unsigned char, 64> sign(std::string_view msg) const {
+        std::array<unsigned char, 64> sig;
+        crypto_sign_detached(
+                sig.data(),
+                nullptr,
+                reinterpret_cast<const unsigned char*>(msg.data()),
+                msg.size(),
+                sk.data());
+        return sig;
+    }
+};
+
+bool verify(
+        const std::array<unsigned char, 64>& sig, std::string_view msg, const unsigned char* pk) {
+    return 0 == crypto_sign_verify_detached(
+                        sig.data(),
+                        reinterpret_cast<const unsigned char*>(msg.data()),
+                        msg.size(),
+                        pk);
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg{argv[i]};
+        if (arg == "--help"sv || arg == "-h"sv)
+            return usage(argv[0]);
+        if (i + 1 >= argc)
+            return usage(argv[0], fmt::format("Invalid or incomplete argument '{}'", arg));
+        std::string_view val{argv[++i]};
+        bool ok = false;
+        if (arg == "--sizes"sv)
+            ok = parse_list(val, cfg.sizes);
+        else if (arg == "--threads"sv)
+            ok = parse_list(val, cfg.threads);
+        else if (arg == "--ops"sv)
+            ok = parse_int(val, cfg.ops);
+        else if (arg == "--filter"sv) {
+            cfg.filter = val;
+            ok = true;
+        }
+        if (!ok)
+            return usage(argv[0], fmt::format("Invalid argument '{} {}'", arg, val));
+    }
+
+    if (sodium_init() < 0) {
+        std::cerr << "Failed to initialize libsodium\n";
+        return 2;
+    }
+
+    // Runs `op` (which gets the operation index) with each thread count, if selected by --filter
+    auto bench = [&](std::string_view name, size_t size, const std::function<void(size_t)>& op) {
+        if (name.find(cfg.filter) == std::string_view::npos)
+            return;
+        for (auto threads : cfg.threads)
+            print(name, size, run(threads, cfg.ops, op));
+    };
+
+    // Onion encryption between a client and a server (as done by every hop of an onion request,
+    // and in reverse, for the response):
+    crypto::x25519_pubkey server_pk, client_pk;
+    crypto::x25519_seckey server_sk, client_sk;
+    crypto_box_keypair(server_pk.data(), server_sk.data());
+    crypto_box_keypair(client_pk.data(), client_sk.data());
+    const crypto::ChannelEncryption client{client_sk, client_pk, false};
+    const crypto::ChannelEncryption server{server_sk, server_pk, true};
+
+    for (auto type :
+         {crypto::EncryptType::aes_cbc,
+          crypto::EncryptType::aes_gcm,
+          crypto::EncryptType::xchacha20}) {
+        for (auto size : cfg.sizes) {
+            auto plaintext = random_bytes(size);
+            auto ciphertext = client.encrypt(type, plaintext, server_pk);
+            bench(fmt::format("encrypt-{}", to_string(type)), size, [&](size_t) {
+                client.encrypt(type, plaintext, server_pk);
+            });
+            bench(fmt::format("decrypt-{}", to_string(type)), size, [&](size_t) {
+                server.decrypt(type, ciphertext, client_pk);
+            });
+        }
+    }
+
+    ed_keys owner;
+    for (auto size : cfg.sizes) {
+        auto data = random_bytes(size);
+        bench("message_hash", size, [&](size_t) {
+            rpc::computeMessageHash(owner.session_id, namespace_id::Default, data);
+        });
+
+        auto b64 = oxenc::to_base64(data);
+        bench("to_base64-oxenc", size, [&](size_t) { oxenc::to_base64(data); });
+        bench("to_base64-util", size, [&](size_t) { util::to_base64(data); });
+        bench("from_base64-oxenc", size, [&](size_t) { oxenc::from_base64(b64); });
+        bench("from_base64-util", size, [&](size_t) { util::from_base64(b64); });
+    }
+
+    // Signature verification of a typical (retrieve) request; the signed value doesn't depend on
+    // the payload size.
+    const auto sig_msg = fmt::format(
+            "retrieve{}",
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count());
+    auto owner_sig = owner.sign(sig_msg);
+
+    bench("verify-ed25519", 0, [&](size_t) {
+        if (!verify(owner_sig, sig_msg, owner.pk.data()))
+            throw std::runtime_error{"signature verification failed"};
+    });
+
+    // A Session ID request also has to check that the given ed25519 pubkey is the one the Session
+    // ID was derived from:
+    bench("verify-session", 0, [&](size_t) {
+        std::array<unsigned char, 32> x;
+        if (crypto_sign_ed25519_pk_to_curve25519(x.data(), owner.pk.data()) != 0 ||
+            std::memcmp(x.data(), owner.session_id.raw().data(), x.size()) != 0 ||
+            !verify(owner_sig, sig_msg, owner.pk.data()))
+            throw std::runtime_error{"signature verification failed"};
+    });
+
+    // A subaccount request verifies the owner's signature of the token, then the request
+    // signature by the subaccount's key:
+    ed_keys sub;
+    signed_subaccount_token sa;
+    sa.token.token[SUBACCOUNT_TOKEN_PREFIX_INDEX] = 0x05;
+    sa.token.set_flags(subaccount_access::Read);
+    std::copy(sub.pk.begin(), sub.pk.end(), sa.token.token.begin() + SUBACCOUNT_TOKEN_PUBKEY_INDEX);
+    crypto_sign_detached(
+            sa.signature.data(),
+            nullptr,
+            sa.token.token.data(),
+            sa.token.token.size(),
+            owner.sk.data());
+    auto sub_sig = sub.sign(sig_msg);
+
+    bench("verify-subaccount", 0, [&](size_t) {
+        sa.verify(owner.session_id, subaccount_access::Read, owner.pk.data());
+        if (!verify(sub_sig, sig_msg, sa.token.pubkey().data()))
+            throw std::runtime_error{"signature verification failed"};
+    });
+
+    SubaccountCache sa_cache;
+    bench("verify-subaccount-cached", 0, [&](size_t) {
+        sa_cache.verify(sa, owner.session_id, subaccount_access::Read, owner.pk.data());
+        if (!verify(sub_sig, sig_msg, sa.token.pubkey().data()))
+            throw std::runtime_error{"signature verification failed"};
+    });
+
+    bench("ed_pk_to_x25519", 0, [&](size_t) {
+        std::array<unsigned char, 32> x;
+        crypto_sign_ed25519_pk_to_curve25519(x.data(), owner.pk.data());
+    });
+    bench("ed_sk_to_x25519", 0, [&](size_t) {
+        std::array<unsigned char, 32> x;
+        crypto_sign_ed25519_sk_to_curve25519(x.data(), owner.sk.data());
+    });
+    bench("x25519_dh", 0, [&](size_t) {
+        std::array<unsigned char, 32> shared;
+        if (crypto_scalarmult(shared.data(), server_sk.data(), client_pk.data()) != 0)
+            throw std::runtime_error{"x25519 key exchange failed"};
+    });
+
+    return 0;
+}
@@ -0,0 +1,319 @@
+// Storage database micro-benchmark.
+//
+// Populates a fresh database with OWNERS x MESSAGES messages and then times each of the main
+// database operations, printing one JSON object per line for each (throughput, and latency
+// percentiles in microseconds) so that results can be collected and compared between versions.
+//
+// Build via the `db-bench` target from a build directory (it is not built by default).
+
+#include <oxenss/storage/database.hpp>
+#include <oxenss/utils/random.hpp>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+using namespace oxenss;
+
+using bench_clock = std::chrono::steady_clock;
+
+int usage(std::string_view argv0, std::string_view err = "") {
+    if (!err.empty())
+        std::cerr << "\x1b[31;1mError: " << err << "\x1b[0m\n\n";
+    std::cerr << "Usage: " << argv0 << R"( [OPTIONS]
+
+Benchmarks storage server database operations against a freshly populated database, printing
+one JSON result object per line to stdout.
+
+Options:
+    --dir DIR          Directory in which to create the database [db-bench]; *any existing
+                       contents are deleted*
+    --owners N         Number of distinct owners to populate [1000]
+    --messages N       Number of messages to populate per owner [100]
+    --size N           Message data size, in bytes [500]
+    --ops N            Number of operations to time for each operation type [10000]
+    --readers N        Number of concurrent threads used for read operations [4]
+    --writers N        Number of concurrent threads used for write operations [1]
+    --shards N         Number of database shards [1]
+    --group-commit     Enable group commit for stores
+    --keep             Don't delete the database when done
+)";
+    return 1;
+}
+
+struct bench_config {
+    std::filesystem::path dir = "db-bench";
+    size_t owners = 1000;
+    size_t messages = 100;
+    size_t data_size = 500;
+    size_t ops = 10'000;
+    int readers = 4;
+    int writers = 1;
+    int shards = 1;
+    bool group_commit = false;
+    bool keep = false;
+};
+
+struct bench_result {
+    int threads;
+    size_t count;
+    bench_clock::duration elapsed;
+    std::vector<int64_t> latencies_ns;
+};
+
+// Calls `op(i)` for each i in [0, count), spread over `threads` threads, timing each call.
+bench_result run(int threads, size_t count, const std::function<void(size_t)>& op) {
+    std::vector<std::vector<int64_t>> latencies(threads);
+    std::vector<std::thread> workers;
+    auto started = bench_clock::now();
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back([&, t] {
+            auto& lat = latencies[t];
+            lat.reserve(count / threads + 1);
+            for (size_t i = t; i < count; i += threads) {
+                auto start = bench_clock::now();
+                op(i);
+                lat.push_back((bench_clock::now() - start) / 1ns);
+            }
+        });
+    for (auto& w : workers)
+        w.join();
+
+    bench_result result{threads, count, bench_clock::now() - started, {}};
+    for (auto& lat : latencies)
+        result.latencies_ns.insert(result.latencies_ns.end(), lat.begin(), lat.end());
+    std::sort(result.latencies_ns.begin(), result.latencies_ns.end());
+    return result;
+}
+
+void print(std::string_view name, const bench_result& r, size_t items_per_op = 1) {
+    auto pct = [&](double p) {
+        if (r.latencies_ns.empty())
+            return 0.0;
+        auto n = r.latencies_ns.size();
+        return r.latencies_ns[std::min(n - 1, static_cast<size_t>(p * n))] / 1000.0;
+    };
+    double seconds = std::chrono::duration<double>(r.elapsed).count();
+    fmt::print(
+            "{{\"op\":\"{}\",\"threads\":{},\"count\":{},\"items_per_op\":{},\"seconds\":{:.6f},"
+            "\"ops_per_sec\":{:.1f},\"p50_us\":{:.1f},\"p99_us\":{:.1f},\"max_us\":{:.1f}}}\n",
+            name,
+            r.threads,
+            r.count,
+            items_per_op,
+            seconds,
+            seconds > 0 ? r.count / seconds : 0.0,
+            pct(0.5),
+            pct(0.99),
+            pct(1.0));
+    std::fflush(stdout);
+}
+
+template <typename T>
+bool parse_int(std::string_view s, T& val) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), val);
+    return ec == std::errc{} && end == s.data() + s.size() && val > 0;
+}
+
+std::string hash_for(size_t owner, size_t i) {
+    return fmt::format("{:020d}{:023d}", owner, i);
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg{argv[i]};
+        if (arg == "--help"sv || arg == "-h"sv)
+            return usage(argv[0]);
+        if (arg == "--group-commit"sv) {
+            cfg.group_commit = true;
+            continue;
+        }
+        if (arg == "--keep"sv) {
+            cfg.keep = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return usage(argv[0], fmt::format("Invalid or incomplete argument '{}'", arg));
+        std::string_view val{argv[++i]};
+        bool ok = false;
+        if (arg == "--dir"sv) {
+            cfg.dir = val;
+            ok = !val.empty();
+        } else if (arg == "--owners"sv)
+            ok = parse_int(val, cfg.owners);
+        else if (arg == "--messages"sv)
+            ok = parse_int(val, cfg.messages);
+        else if (arg == "--size"sv)
+            ok = parse_int(val, cfg.data_size);
+        else if (arg == "--ops"sv)
+            ok = parse_int(val, cfg.ops);
+        else if (arg == "--readers"sv)
+            ok = parse_int(val, cfg.readers);
+        else if (arg == "--writers"sv)
+            ok = parse_int(val, cfg.writers);
+        else if (arg == "--shards"sv)
+            ok = parse_int(val, cfg.shards);
+        if (!ok)
+            return usage(argv[0], fmt::format("Invalid argument '{} {}'", arg, val));
+    }
+
+    std::filesystem::remove_all(cfg.dir);
+    std::filesystem::create_directories(cfg.dir);
+
+    database_options opts;
+    opts.group_commit = cfg.group_commit;
+    opts.shards = cfg.shards;
+
+    {
+        Database db{cfg.dir, opts};
+
+        std::vector<user_pubkey> pubkeys(cfg.owners);
+        for (auto& pk : pubkeys) {
+            std::string raw(USER_PUBKEY_SIZE_BYTES, '\x05');
+            for (size_t j = 1; j < raw.size(); j++)
+                raw[j] = static_cast<char>(util::rng()());
+            pk.load(raw);
+        }
+        const std::string data(cfg.data_size, 'x');
+        const auto now = std::chrono::system_clock::now();
+        const auto expiry = now + 14 * 24h;
+
+        auto random_owner = [&] {
+            return util::uniform_distribution_portable(util::rng(), cfg.owners);
+        };
+
+        // Populate via bulk_store, interleaving owners as real traffic would.
+        constexpr size_t BULK_CHUNK = 1000;
+        const size_t total = cfg.owners * cfg.messages;
+        auto populated = run(1, (total + BULK_CHUNK - 1) / BULK_CHUNK, [&](size_t chunk) {
+            std::vector<message> msgs;
+            for (size_t n = chunk * BULK_CHUNK; n < std::min(total, (chunk + 1) * BULK_CHUNK);
+                 n++) {
+                size_t owner = n % cfg.owners, i = n / cfg.owners;
+                msgs.emplace_back(
+                        pubkeys[owner],
+                        hash_for(owner, i),
+                        namespace_id::Default,
+                        now - 1ms * (cfg.messages - i),
+                        expiry,
+                        data);
+            }
+            db.bulk_store(msgs);
+        });
+        print("bulk_store", populated, BULK_CHUNK);
+
+        print("store", run(cfg.writers, cfg.ops, [&](size_t i) {
+                  db.store(
+                          {pubkeys[random_owner()],
+                           fmt::format("store{:038d}", i),
+                           namespace_id::Default,
+                           now,
+                           expiry,
+                           data});
+              }));
+
+        print("retrieve", run(cfg.readers, cfg.ops, [&](size_t) {
+                  db.retrieve(pubkeys[random_owner()], namespace_id::Default, "");
+              }));
+
+        // This mimics the typical polling request that just retrieves the last few new messages:
+        const size_t back = std::min<size_t>(cfg.messages, 10);
+        print("retrieve_last_hash", run(cfg.readers, cfg.ops, [&](size_t) {
+                  auto owner = random_owner();
+                  auto last_hash = hash_for(owner, cfg.messages - back);
+                  db.retrieve(pubkeys[owner], namespace_id::Default, last_hash);
+              }));
+
+        print("retrieve_random",
+              run(cfg.readers, cfg.ops, [&](size_t) { db.retrieve_random(); }));
+
+        // Readers and writers at the same time:
+        bench_result mixed_reads, mixed_writes;
+        {
+            std::thread reader{[&] {
+                mixed_reads = run(cfg.readers, cfg.ops, [&](size_t) {
+                    db.retrieve(pubkeys[random_owner()], namespace_id::Default, "");
+                });
+            }};
+            mixed_writes = run(cfg.writers, cfg.ops, [&](size_t i) {
+                db.store(
+                        {pubkeys[random_owner()],
+                         fmt::format("mixed{:038d}", i),
+                         namespace_id::Default,
+                         now,
+                         expiry,
+                         data});
+            });
+            reader.join();
+        }
+        print("mixed_retrieve", mixed_reads);
+        print("mixed_store", mixed_writes);
+
+        constexpr size_t HASHES_PER_OP = 10;
+        auto some_hashes = [&](size_t owner, size_t start) {
+            std::vector<std::string> hashes;
+            for (size_t i = start; i < std::min(cfg.messages, start + HASHES_PER_OP); i++)
+                hashes.push_back(hash_for(owner, i));
+            return hashes;
+        };
+
+        print("update_expiry",
+              run(cfg.writers,
+                  cfg.ops,
+                  [&](size_t i) {
+                      auto owner = random_owner();
+                      db.update_expiry(pubkeys[owner], some_hashes(owner, 0), {expiry + 1ms * i});
+                  }),
+              HASHES_PER_OP);
+
+        // Each op deletes a distinct set of (previously populated) hashes:
+        const size_t delete_ops = std::min(
+                cfg.ops, cfg.owners * ((cfg.messages + HASHES_PER_OP - 1) / HASHES_PER_OP));
+        print("delete_by_hash",
+              run(cfg.writers,
+                  delete_ops,
+                  [&](size_t i) {
+                      auto owner = i % cfg.owners;
+                      db.delete_by_hash(
+                              pubkeys[owner], some_hashes(owner, i / cfg.owners * HASHES_PER_OP));
+                  }),
+              HASHES_PER_OP);
+
+        // Each clean_expired call has `ops` freshly expired messages to remove:
+        constexpr size_t CLEAN_ROUNDS = 5;
+        bench_result cleaned{1, 0, {}, {}};
+        for (size_t round = 0; round < CLEAN_ROUNDS; round++) {
+            std::vector<message> expired;
+            for (size_t i = 0; i < cfg.ops; i++)
+                expired.emplace_back(
+                        pubkeys[i % cfg.owners],
+                        fmt::format("exp{:02d}{:038d}", round, i),
+                        namespace_id::Default,
+                        now - 1h,
+                        now - 1s,
+                        data);
+            db.bulk_store(expired);
+            auto r = run(1, 1, [&](size_t) { db.clean_expired(); });
+            cleaned.count++;
+            cleaned.elapsed += r.elapsed;
+            cleaned.latencies_ns.push_back(r.latencies_ns.front());
+        }
+        std::sort(cleaned.latencies_ns.begin(), cleaned.latencies_ns.end());
+        print("clean_expired", cleaned, cfg.ops);
+    }
+
+    if (!cfg.keep)
+        std::filesystem::remove_all(cfg.dir);
+    return 0;
+}
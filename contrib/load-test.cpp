@@ -0,0 +1,952 @@
+// Storage server client load generator.
+//
+// Simulates a set of client accounts making signed store, retrieve, expire, delete and batch
+// requests to a storage server over HTTPS, OxenMQ and QUIC at a fixed target request rate, with
+// some of the accounts also subscribed to new message notifications via monitor.messages.  Prints
+// one JSON result object per line for each transport and endpoint (throughput, errors, and latency
+// percentiles in milliseconds) so that results can be collected and compared between versions.
+//
+// Requests are sent on a fixed schedule (an open-loop load, rather than each worker sending its
+// next request whenever its last one completes) and each request's latency is measured from the
+// time it was *scheduled* to be sent.  A server that stalls is thus charged for all the requests
+// that should have been sent during the stall, rather than for just the one that was in flight
+// (i.e. the timings do not suffer from coordinated omission).
+//
+// Build via the `load-test` target from a build directory (it is not built by default).
+
+#include <oxenss/crypto/keys.h>
+#include <cpr/cpr.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <sodium.h>
+#include <fmt/format.h>
+#include <oxenc/base64.h>
+#include <oxenc/bt_serialize.h>
+#include <oxenc/hex.h>
+#include <oxenmq/oxenmq.h>
+#include <nlohmann/json.hpp>
+#include <oxen/quic.hpp>
+
+using namespace std::literals;
+
+using namespace oxenss::crypto;
+
+using bench_clock = std::chrono::steady_clock;
+
+int usage(std::string_view argv0, std::string_view err = "") {
+    if (!err.empty())
+        std::cerr << "\x1b[31;1mError: " << err << "\x1b[0m\n\n";
+    std::cerr << "Usage: " << argv0 << R"( [OPTIONS] SNODE_PK
+
+Generates client load against the storage server of the given service node, printing one JSON
+result object per line (per transport and endpoint) to stdout.
+
+SNODE_PK is the primary (legacy) pubkey of the service node, whose address and keys are looked up
+from oxend.
+
+Each of the simulated accounts is a Session ID that belongs to the service node's swarm (accounts
+belonging to other swarms are generated and discarded until there are enough).  Requests are sent
+at a fixed overall rate, split evenly across the selected transports, to a random account and
+endpoint, where the endpoints are:
+
+- store -- stores a new message of random data
+- retrieve -- retrieves the account's messages newer than the last one it has retrieved
+- expire -- updates the expiry of some of the account's stored messages
+- delete -- deletes some of the account's stored messages
+- batch -- a batch request of a store and a retrieve
+
+Expire and delete requests for an account without any stored messages are sent as a store instead.
+
+Options:
+    --mainnet          SNODE_PK is a mainnet service node (the default is testnet)
+    --oxend ADDR       OxenMQ address of the oxend to look up SNODE_PK from [a public oxend]
+    --accounts N       Number of accounts to simulate [100]
+    --rate N           Target total number of requests per second [100]
+    --duration N       Number of seconds to measure for [30]
+    --warmup N         Number of seconds to send requests for before measuring [5]
+    --connections N    Number of requests each transport can have in flight at once [16]; if
+                       this is too low to sustain --rate then latencies will grow over the run
+                       (and the "max_lag_ms" of the transport will be large)
+    --transports LIST  Comma-separated transports to use, of https, omq, quic [https,omq,quic]
+    --mix LIST         Comma-separated relative frequencies of store, retrieve, expire, delete and
+                       batch requests [40,40,5,5,10]
+    --size N           Size of stored messages, in bytes [200]
+    --ttl N            TTL of stored messages, in seconds [3600]
+    --monitors N       Number of accounts to subscribe to new message notifications with
+                       monitor.messages over each of the OxenMQ and QUIC transports (HTTPS has no
+                       monitor support) [10]; the reported latency is from the time the message was
+                       stored to the time the notification arrived.
+)";
+    return 1;
+}
+
+const oxenmq::address TESTNET_OMQ{"tcp://public.loki.foundation:9999"};
+const oxenmq::address MAINNET_OMQ{"tcp://public.loki.foundation:22029"};
+
+enum class transport { https, omq, quic };
+
+std::string_view to_string(transport t) {
+    return t == transport::quic ? "quic"sv : t == transport::omq ? "omq"sv : "https"sv;
+}
+
+enum class endpoint { store, retrieve, expire, delete_msgs, batch };
+constexpr size_t NUM_ENDPOINTS = 5;
+
+// The rpc method name of the endpoint
+std::string_view to_string(endpoint e) {
+    switch (e) {
+        case endpoint::store: return "store"sv;
+        case endpoint::retrieve: return "retrieve"sv;
+        case endpoint::expire: return "expire"sv;
+        case endpoint::delete_msgs: return "delete"sv;
+        case endpoint::batch: return "batch"sv;
+    }
+    return ""sv;
+}
+
+struct snode_info {
+    ed25519_pubkey ed;
+    x25519_pubkey x;
+    std::string ip;
+    uint16_t https_port = 0;
+    uint16_t omq_port = 0;  // Also the QUIC (UDP) port
+};
+
+struct load_config {
+    size_t accounts = 100;
+    double rate = 100;
+    std::chrono::seconds duration = 30s;
+    std::chrono::seconds warmup = 5s;
+    int connections = 16;
+    std::vector<transport> transports{transport::https, transport::omq, transport::quic};
+    std::array<unsigned, NUM_ENDPOINTS> mix{40, 40, 5, 5, 10};
+    size_t data_size = 200;
+    std::chrono::seconds ttl = 1h;
+    size_t monitors = 10;
+};
+
+template <typename T>
+bool parse_count(std::string_view arg, T& out) {
+    auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), out);
+    return ec == std::errc{} && end == arg.data() + arg.size();
+}
+
+// Splits a comma-separated list, calling `f` on each value; returns false if `f` does.
+template <typename F>
+bool parse_list(std::string_view arg, F&& f) {
+    while (!arg.empty()) {
+        auto comma = arg.find(',');
+        if (!f(arg.substr(0, comma)))
+            return false;
+        arg = comma == std::string_view::npos ? ""sv : arg.substr(comma + 1);
+    }
+    return true;
+}
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+}
+
+thread_local std::mt19937_64 rng{std::random_device{}()};
+
+struct account {
+    std::array<unsigned char, 32> ed_pk;
+    std::array<unsigned char, 64> ed_sk;
+    std::string pubkey_hex;  // The Session ID (05 + x25519 pubkey)
+    std::string ed_hex;
+
+    // Messages we have stored (newest last) and not yet deleted, and the hash of the last message
+    // retrieved:
+    std::mutex mutex;
+    std::deque<std::string> hashes;
+    std::string last_hash;
+
+    static constexpr size_t MAX_HASHES = 100;
+
+    account() {
+        crypto_sign_ed25519_keypair(ed_pk.data(), ed_sk.data());
+        std::array<unsigned char, 32> x_pk;
+        crypto_sign_ed25519_pk_to_curve25519(x_pk.data(), ed_pk.data());
+        pubkey_hex = "05" + oxenc::to_hex(x_pk.begin(), x_pk.end());
+        ed_hex = oxenc::to_hex(ed_pk.begin(), ed_pk.end());
+    }
+
+    std::string sign(std::string_view msg) const {
+        std::array<unsigned char, 64> sig;
+        crypto_sign_ed25519_detached(
+                sig.data(),
+                nullptr,
+                reinterpret_cast<const unsigned char*>(msg.data()),
+                msg.size(),
+                ed_sk.data());
+        return std::string{reinterpret_cast<const char*>(sig.data()), sig.size()};
+    }
+
+    // The pubkey parameters common to all requests
+    nlohmann::json params() const { return {{"pubkey", pubkey_hex}, {"pubkey_ed25519", ed_hex}}; }
+};
+
+struct rpc_reply {
+    int status = 0;  // HTTP status code, or 0 if the request failed without one (e.g. a timeout)
+    nlohmann::json body;
+};
+
+// Makes client rpc requests (as `method` plus json `params`) over some transport; each one is
+// used by only one thread at a time.
+class rpc_client {
+  public:
+    virtual ~rpc_client() = default;
+    virtual rpc_reply call(std::string_view method, const nlohmann::json& params) = 0;
+};
+
+nlohmann::json parse_json(std::string_view body) {
+    return nlohmann::json::parse(body, nullptr, false);
+}
+
+// Requests via HTTPS POSTs to /storage_rpc/v1, over a keep-alive session.
+class https_client : public rpc_client {
+    cpr::Session sess;
+
+  public:
+    explicit https_client(const snode_info& sn) {
+        sess.SetUrl(cpr::Url{fmt::format("https://{}:{}/storage_rpc/v1", sn.ip, sn.https_port)});
+        sess.SetVerifySsl(cpr::VerifySsl{false});
+        sess.SetTimeout(cpr::Timeout{30s});
+    }
+
+    rpc_reply call(std::string_view method, const nlohmann::json& params) override {
+        sess.SetBody(cpr::Body{nlohmann::json{{"method", method}, {"params", params}}.dump()});
+        auto res = sess.Post();
+        rpc_reply r;
+        if (res.error.code != cpr::ErrorCode::OK)
+            return r;
+        r.status = res.status_code;
+        if (r.status == 200)
+            r.body = parse_json(res.text);
+        return r;
+    }
+};
+
+// Requests via `storage.METHOD` OxenMQ requests, which reply with [BODY] on success and
+// [CODE, BODY] on failure.
+class omq_client : public rpc_client {
+    oxenmq::OxenMQ& omq;
+    oxenmq::ConnectionID conn;
+
+  public:
+    omq_client(oxenmq::OxenMQ& omq, oxenmq::ConnectionID conn) : omq{omq}, conn{std::move(conn)} {}
+
+    rpc_reply call(std::string_view method, const nlohmann::json& params) override {
+        std::promise<rpc_reply> done;
+        omq.request(
+                conn,
+                fmt::format("storage.{}", method),
+                [&done](bool success, std::vector<std::string> data) {
+                    rpc_reply r;
+                    if (success && data.size() == 1) {
+                        r.status = 200;
+                        r.body = parse_json(data[0]);
+                    } else if (success && data.size() >= 2 && !parse_count(data[0], r.status)) {
+                        r.status = 0;
+                    }
+                    done.set_value(std::move(r));
+                },
+                params.dump(),
+                oxenmq::send_option::request_timeout{30s});
+        return done.get_future().get();
+    }
+};
+
+// Requests via QUIC `METHOD` commands on a stream of a shared connection.  Successful responses
+// are a [CODE, BODY] list; failures are error responses of "CODE Reason\n\nBODY".
+class quic_client : public rpc_client {
+    std::shared_ptr<oxen::quic::connection_interface> conn;
+    std::shared_ptr<oxen::quic::BTRequestStream> str;
+
+  public:
+    explicit quic_client(std::shared_ptr<oxen::quic::connection_interface> conn) :
+            conn{std::move(conn)} {}
+
+    rpc_reply call(std::string_view method, const nlohmann::json& params) override {
+        // Each client gets its own stream (as a real client with several requests in flight
+        // should), so that our requests don't queue behind each other's responses.
+        if (!str)
+            str = conn->open_stream<oxen::quic::BTRequestStream>();
+        std::promise<rpc_reply> done;
+        str->command(std::string{method}, params.dump(), [&done](oxen::quic::message m) {
+            rpc_reply r;
+            if (m) {
+                auto res = parse_json(m.body());
+                if (res.is_array() && res.size() == 2 && res[0].is_number_integer()) {
+                    r.status = res[0].get<int>();
+                    r.body = std::move(res[1]);
+                }
+            } else if (!m.timed_out) {
+                auto body = m.body();
+                if (!parse_count(body.substr(0, body.find(' ')), r.status))
+                    r.status = 0;
+            }
+            done.set_value(std::move(r));
+        });
+        return done.get_future().get();
+    }
+};
+
+std::string random_data(size_t size) {
+    std::string data;
+    data.resize(size);
+    for (size_t i = 0; i < size; i += 8) {
+        auto r = rng();
+        std::memcpy(data.data() + i, &r, std::min<size_t>(8, size - i));
+    }
+    return data;
+}
+
+nlohmann::json store_params(const account& a, const load_config& conf) {
+    auto ts = now_ms();
+    auto params = a.params();
+    params["timestamp"] = ts;
+    params["ttl"] = conf.ttl / 1ms;
+    params["data"] = oxenc::to_base64(random_data(conf.data_size));
+    params["signature"] = oxenc::to_base64(a.sign(fmt::format("store{}", ts)));
+    return params;
+}
+
+nlohmann::json retrieve_params(account& a) {
+    auto ts = now_ms();
+    auto params = a.params();
+    params["timestamp"] = ts;
+    params["signature"] = oxenc::to_base64(a.sign(fmt::format("retrieve{}", ts)));
+    std::lock_guard lock{a.mutex};
+    if (!a.last_hash.empty())
+        params["last_hash"] = a.last_hash;
+    return params;
+}
+
+// Takes the hashes of up to `count` of the account's oldest stored messages, removing them from
+// the account if `remove` is true.
+std::vector<std::string> take_hashes(account& a, size_t count, bool remove) {
+    std::lock_guard lock{a.mutex};
+    count = std::min(count, a.hashes.size());
+    std::vector<std::string> hashes{a.hashes.begin(), a.hashes.begin() + count};
+    if (remove)
+        a.hashes.erase(a.hashes.begin(), a.hashes.begin() + count);
+    return hashes;
+}
+
+void stored(account& a, const nlohmann::json& body) {
+    // The hash is at the top level for a request made directly to a swarm member, and also in each
+    // of the swarm members' results:
+    std::string hash;
+    if (auto it = body.find("hash"); it != body.end() && it->is_string())
+        hash = it->get<std::string>();
+    else if (auto sw = body.find("swarm"); sw != body.end() && sw->is_object())
+        for (auto& [pk, res] : sw->items())
+            if (auto h = res.find("hash"); h != res.end() && h->is_string()) {
+                hash = h->get<std::string>();
+                break;
+            }
+    if (hash.empty())
+        return;
+    std::lock_guard lock{a.mutex};
+    a.hashes.push_back(std::move(hash));
+    if (a.hashes.size() > account::MAX_HASHES)
+        a.hashes.pop_front();
+}
+
+void retrieved(account& a, const nlohmann::json& body) {
+    auto msgs = body.find("messages");
+    if (msgs == body.end() || !msgs->is_array() || msgs->empty())
+        return;
+    if (auto h = msgs->back().find("hash"); h != msgs->back().end() && h->is_string()) {
+        std::lock_guard lock{a.mutex};
+        a.last_hash = h->get<std::string>();
+    }
+}
+
+struct op_result {
+    endpoint ep;
+    int status;
+};
+
+// Makes request `ep` for account `a`, returning the endpoint actually requested (expire and delete
+// become a store if the account has no messages) and the response status.
+op_result run_op(endpoint ep, account& a, rpc_client& client, const load_config& conf) {
+    std::vector<std::string> hashes;
+    if (ep == endpoint::expire || ep == endpoint::delete_msgs) {
+        hashes = take_hashes(a, 5, ep == endpoint::delete_msgs);
+        if (hashes.empty())
+            ep = endpoint::store;
+    }
+
+    nlohmann::json params;
+    switch (ep) {
+        case endpoint::store: params = store_params(a, conf); break;
+        case endpoint::retrieve: params = retrieve_params(a); break;
+        case endpoint::expire: {
+            auto expiry = now_ms() + conf.ttl / 1ms;
+            params = a.params();
+            params["messages"] = hashes;
+            params["expiry"] = expiry;
+            params["signature"] = oxenc::to_base64(
+                    a.sign(fmt::format("expire{}{}", expiry, fmt::join(hashes, ""))));
+            break;
+        }
+        case endpoint::delete_msgs:
+            params = a.params();
+            params["messages"] = hashes;
+            params["signature"] =
+                    oxenc::to_base64(a.sign(fmt::format("delete{}", fmt::join(hashes, ""))));
+            break;
+        case endpoint::batch:
+            params["requests"] = {
+                    {{"method", "store"}, {"params", store_params(a, conf)}},
+                    {{"method", "retrieve"}, {"params", retrieve_params(a)}}};
+            break;
+    }
+
+    auto res = client.call(to_string(ep), params);
+    if (res.status != 200)
+        return {ep, res.status};
+
+    if (ep == endpoint::store)
+        stored(a, res.body);
+    else if (ep == endpoint::retrieve)
+        retrieved(a, res.body);
+    else if (ep == endpoint::batch) {
+        // The batch succeeds if all of its subrequests do
+        auto results = res.body.find("results");
+        if (results == res.body.end() || !results->is_array() || results->size() != 2)
+            return {ep, 0};
+        for (auto& r : *results)
+            if (auto code = r.value("code", 0); code != 200)
+                return {ep, code};
+        stored(a, (*results)[0]["body"]);
+        retrieved(a, (*results)[1]["body"]);
+    }
+    return {ep, 200};
+}
+
+snode_info lookup_snode(const oxenmq::address& oxend, std::string_view pubkey_hex) {
+    oxenmq::OxenMQ omq{};
+    omq.start();
+    std::promise<snode_info> got;
+    auto rpc = omq.connect_remote(
+            oxend, [](auto) {}, [&got, &oxend](auto, auto err) {
+                try {
+                    throw std::runtime_error{fmt::format(
+                            "Failed to connect to oxend @ {}: {}", oxend.full_address(), err)};
+                } catch (...) {
+                    got.set_exception(std::current_exception());
+                }
+            });
+    omq.request(
+            rpc,
+            "rpc.get_service_nodes",
+            [&](bool success, std::vector<std::string> data) {
+                try {
+                    if (!success || data.size() < 2 || data[0] != "200")
+                        throw std::runtime_error{"get_service_nodes request failed"};
+                    auto sns = nlohmann::json::parse(data[1]).at("service_node_states");
+                    if (sns.empty())
+                        throw std::runtime_error{
+                                fmt::format("{} is not an active service node", pubkey_hex)};
+                    auto& sn = sns.front();
+                    got.set_value(snode_info{
+                            ed25519_pubkey::from_hex(sn.at("pubkey_ed25519").get<std::string>()),
+                            x25519_pubkey::from_hex(sn.at("pubkey_x25519").get<std::string>()),
+                            sn.at("public_ip").get<std::string>(),
+                            sn.at("storage_port").get<uint16_t>(),
+                            sn.at("storage_lmq_port").get<uint16_t>()});
+                } catch (...) {
+                    got.set_exception(std::current_exception());
+                }
+            },
+            nlohmann::json{
+                    {"service_node_pubkeys", {pubkey_hex}},
+                    {"fields",
+                     {{"pubkey_x25519", true},
+                      {"pubkey_ed25519", true},
+                      {"public_ip", true},
+                      {"storage_port", true},
+                      {"storage_lmq_port", true}}},
+                    {"active_only", true}}
+                    .dump());
+    return got.get_future().get();
+}
+
+// Generates accounts until we have `count` of them that belong to the service node's swarm,
+// checking each with a retrieve request (which returns a 421 for an account in another swarm).
+std::deque<account> make_accounts(size_t count, rpc_client& client, const load_config& conf) {
+    std::deque<account> accounts;
+    size_t misplaced = 0, failures = 0;
+    while (accounts.size() < count) {
+        auto& a = accounts.emplace_back();
+        auto status = run_op(endpoint::retrieve, a, client, conf).status;
+        if (status == 200)
+            continue;
+        accounts.pop_back();
+        if (status == 421)
+            misplaced++;
+        else if (++failures >= 10)
+            throw std::runtime_error{
+                    fmt::format("account check requests failed (last status: {})", status)};
+    }
+    std::cerr << "Generated " << count << " accounts (and discarded " << misplaced
+              << " belonging to other swarms)\n";
+    return accounts;
+}
+
+struct op_stats {
+    size_t ok = 0;
+    std::map<int, size_t> errors;  // status code -> count
+    std::vector<int64_t> latencies_us;
+
+    void add(const op_stats& s) {
+        ok += s.ok;
+        for (auto& [code, n] : s.errors)
+            errors[code] += n;
+        latencies_us.insert(latencies_us.end(), s.latencies_us.begin(), s.latencies_us.end());
+    }
+};
+
+struct transport_stats {
+    std::array<op_stats, NUM_ENDPOINTS> ops;
+    bench_clock::duration max_lag{0};  // How far behind schedule we were sending a request
+};
+
+// Sends this transport's share of the requests (every request of the schedule, which is spaced
+// `interval` apart starting at `start`, until `end`) using `conf.connections` threads, each with
+// its own client from `make_client`.  Only requests scheduled at or after `measure_from` count
+// towards the returned statistics.
+transport_stats run_transport(
+        const load_config& conf,
+        std::deque<account>& accounts,
+        const std::function<std::unique_ptr<rpc_client>()>& make_client,
+        bench_clock::time_point start,
+        std::chrono::duration<double> interval,
+        bench_clock::time_point measure_from,
+        bench_clock::time_point end) {
+    std::atomic<size_t> next = 0;
+    std::vector<transport_stats> results(conf.connections);
+    std::vector<std::thread> threads;
+    for (auto& r : results)
+        threads.emplace_back([&, &r = r, client = make_client()] {
+            std::discrete_distribution<size_t> pick_op{conf.mix.begin(), conf.mix.end()};
+            std::uniform_int_distribution<size_t> pick_account{0, accounts.size() - 1};
+            for (size_t i = next++;; i = next++) {
+                auto scheduled =
+                        start + std::chrono::duration_cast<bench_clock::duration>(interval * i);
+                if (scheduled >= end)
+                    break;
+                std::this_thread::sleep_until(scheduled);
+                bool measured = scheduled >= measure_from;
+                if (measured)
+                    r.max_lag = std::max(r.max_lag, bench_clock::now() - scheduled);
+
+                auto [ep, status] = run_op(
+                        static_cast<endpoint>(pick_op(rng)),
+                        accounts[pick_account(rng)],
+                        *client,
+                        conf);
+                if (!measured)
+                    continue;
+                auto& s = r.ops[static_cast<size_t>(ep)];
+                s.latencies_us.push_back((bench_clock::now() - scheduled) / 1us);
+                if (status == 200)
+                    s.ok++;
+                else
+                    s.errors[status]++;
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+
+    transport_stats result;
+    for (auto& r : results) {
+        for (size_t i = 0; i < NUM_ENDPOINTS; i++)
+            result.ops[i].add(r.ops[i]);
+        result.max_lag = std::max(result.max_lag, r.max_lag);
+    }
+    return result;
+}
+
+// Notification deliveries to one transport's monitor subscriptions.
+struct monitor_stats {
+    std::atomic<bool> recording = false;
+    std::atomic<size_t> subscribed = 0;
+    std::mutex mutex;
+    std::vector<int64_t> latencies_us;
+
+    void notified(std::string_view notification) {
+        if (!recording)
+            return;
+        try {
+            oxenc::bt_dict_consumer d{notification};
+            if (!d.skip_until("t"))
+                return;
+            auto latency = (now_ms() - d.consume_integer<int64_t>()) * 1000;
+            std::lock_guard lock{mutex};
+            latencies_us.push_back(latency);
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid notification: " << e.what() << "\n";
+        }
+    }
+
+    // Parses a monitor response (a list of results, one per subscription)
+    void subscribe_response(std::string_view response) {
+        try {
+            oxenc::bt_list_consumer results{response};
+            while (!results.is_finished())
+                if (results.consume_dict_consumer().skip_until("success"))
+                    subscribed++;
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid monitor response: " << e.what() << "\n";
+        }
+    }
+};
+
+// Builds a monitor.messages request subscribing (with data) to the default namespace of each of
+// the given accounts.
+std::string monitor_request(const std::deque<account>& accounts, size_t count) {
+    oxenc::bt_list subs;
+    auto ts = std::chrono::duration_cast<std::chrono::seconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    for (size_t i = 0; i < count && i < accounts.size(); i++) {
+        auto& a = accounts[i];
+        subs.push_back(oxenc::bt_dict{
+                {"P", std::string{reinterpret_cast<const char*>(a.ed_pk.data()), a.ed_pk.size()}},
+                {"d", 1},
+                {"n", oxenc::bt_list{0}},
+                {"s", a.sign(fmt::format("MONITOR{}{}10", a.pubkey_hex, ts))},
+                {"t", ts}});
+    }
+    return oxenc::bt_serialize(subs);
+}
+
+double to_ms(int64_t us) {
+    return std::round(us / 10.0) / 100.0;
+}
+
+// Adds latency percentile fields to `out`
+void add_percentiles(nlohmann::json& out, std::vector<int64_t>& latencies_us) {
+    std::sort(latencies_us.begin(), latencies_us.end());
+    auto pct = [&](double p) {
+        if (latencies_us.empty())
+            return 0.0;
+        auto n = latencies_us.size();
+        return to_ms(latencies_us[std::min(n - 1, static_cast<size_t>(p * n))]);
+    };
+    out["p50_ms"] = pct(0.5);
+    out["p90_ms"] = pct(0.9);
+    out["p99_ms"] = pct(0.99);
+    out["p999_ms"] = pct(0.999);
+    out["max_ms"] = pct(1.0);
+}
+
+double per_sec(size_t count, std::chrono::seconds duration) {
+    return std::round(count * 10.0 / duration.count()) / 10.0;
+}
+
+// Adds throughput, error, and latency percentile fields to `out`
+void add_results(nlohmann::json& out, op_stats& s, std::chrono::seconds duration) {
+    size_t failed = 0;
+    auto errors = nlohmann::json::object();
+    for (auto& [code, n] : s.errors) {
+        failed += n;
+        errors[std::to_string(code)] = n;
+    }
+    out["ok"] = s.ok;
+    out["failed"] = failed;
+    out["errors"] = std::move(errors);
+    out["req_per_sec"] = per_sec(s.ok + failed, duration);
+    add_percentiles(out, s.latencies_us);
+}
+
+int main(int argc, char** argv) {
+    load_config conf;
+    auto oxend = TESTNET_OMQ;
+    bool custom_oxend = false;
+    std::string_view pubkey_hex;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg{argv[i]};
+        if (arg == "--mainnet"sv) {
+            if (!custom_oxend)
+                oxend = MAINNET_OMQ;
+            continue;
+        }
+        if (arg.substr(0, 2) != "--"sv) {
+            if (!pubkey_hex.empty())
+                return usage(argv[0], "Only one SNODE_PK may be given");
+            if (!(arg.size() == 64 && oxenc::is_hex(arg)))
+                return usage(argv[0], "Invalid pubkey '" + std::string{arg} + "'");
+            pubkey_hex = arg;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return usage(argv[0], "Unknown option or missing value for " + std::string{arg});
+        std::string_view val{argv[++i]};
+        int secs;
+        if (arg == "--oxend"sv) {
+            try {
+                oxend = oxenmq::address{val};
+            } catch (const std::exception& e) {
+                return usage(argv[0], "Invalid --oxend value: "s + e.what());
+            }
+            custom_oxend = true;
+        } else if (arg == "--accounts"sv) {
+            if (!parse_count(val, conf.accounts) || conf.accounts == 0)
+                return usage(argv[0], "Invalid --accounts value");
+        } else if (arg == "--rate"sv) {
+            try {
+                conf.rate = std::stod(std::string{val});
+            } catch (...) {
+                conf.rate = 0;
+            }
+            if (!(conf.rate > 0))
+                return usage(argv[0], "Invalid --rate value");
+        } else if (arg == "--duration"sv) {
+            if (!parse_count(val, secs) || secs <= 0)
+                return usage(argv[0], "Invalid --duration value");
+            conf.duration = std::chrono::seconds{secs};
+        } else if (arg == "--warmup"sv) {
+            if (!parse_count(val, secs) || secs < 0)
+                return usage(argv[0], "Invalid --warmup value");
+            conf.warmup = std::chrono::seconds{secs};
+        } else if (arg == "--connections"sv) {
+            if (!parse_count(val, conf.connections) || conf.connections <= 0)
+                return usage(argv[0], "Invalid --connections value");
+        } else if (arg == "--transports"sv) {
+            conf.transports.clear();
+            if (!parse_list(
+                        val,
+                        [&](std::string_view t) {
+                            for (auto tr : {transport::https, transport::omq, transport::quic})
+                                if (t == to_string(tr) &&
+                                    std::find(
+                                            conf.transports.begin(), conf.transports.end(), tr) ==
+                                            conf.transports.end()) {
+                                    conf.transports.push_back(tr);
+                                    return true;
+                                }
+                            return false;
+                        }) ||
+                conf.transports.empty())
+                return usage(argv[0], "Invalid --transports value");
+        } else if (arg == "--mix"sv) {
+            size_t n = 0;
+            if (!parse_list(
+                        val,
+                        [&](std::string_view w) {
+                            return n < NUM_ENDPOINTS && parse_count(w, conf.mix[n++]);
+                        }) ||
+                n != NUM_ENDPOINTS ||
+                std::all_of(conf.mix.begin(), conf.mix.end(), [](auto w) { return w == 0; }))
+                return usage(argv[0], "Invalid --mix value");
+        } else if (arg == "--size"sv) {
+            if (!parse_count(val, conf.data_size) || conf.data_size == 0)
+                return usage(argv[0], "Invalid --size value");
+        } else if (arg == "--ttl"sv) {
+            if (!parse_count(val, secs) || secs <= 0)
+                return usage(argv[0], "Invalid --ttl value");
+            conf.ttl = std::chrono::seconds{secs};
+        } else if (arg == "--monitors"sv) {
+            if (!parse_count(val, conf.monitors))
+                return usage(argv[0], "Invalid --monitors value");
+        } else {
+            return usage(argv[0], "Unknown option " + std::string{arg});
+        }
+    }
+    if (pubkey_hex.empty())
+        return usage(argv[0]);
+
+    if (sodium_init() < 0) {
+        std::cerr << "Error: failed to initialize libsodium\n";
+        return 2;
+    }
+
+    try {
+        auto sn = lookup_snode(oxend, pubkey_hex);
+        if (sn.ip.empty() || !sn.https_port || !sn.omq_port)
+            throw std::runtime_error{"missing IP/ports of service node"};
+        auto has = [&](transport t) {
+            return std::find(conf.transports.begin(), conf.transports.end(), t) !=
+                   conf.transports.end();
+        };
+
+        std::array<monitor_stats, 2> monitors;  // OxenMQ, QUIC
+        auto& omq_monitor = monitors[0];
+        auto& quic_monitor = monitors[1];
+
+        std::optional<oxenmq::OxenMQ> omq;
+        oxenmq::ConnectionID omq_conn;
+        if (has(transport::omq)) {
+            omq.emplace();
+            omq->add_category("notify", oxenmq::AuthLevel::none)
+                    .add_command("message", [&omq_monitor](oxenmq::Message& m) {
+                        for (auto& part : m.data)
+                            omq_monitor.notified(part);
+                    });
+            omq->start();
+            omq_conn = omq->connect_remote(
+                    oxenmq::address{
+                            fmt::format("curve://{}:{}/{}", sn.ip, sn.omq_port, sn.x.hex())},
+                    [](auto) {},
+                    [](auto, auto err) {
+                        std::cerr << "Failed to connect to storage server OxenMQ: " << err << "\n";
+                    });
+        }
+
+        std::optional<oxen::quic::Network> net;
+        std::shared_ptr<oxen::quic::Endpoint> ep;
+        std::shared_ptr<oxen::quic::GNUTLSCreds> creds;
+        std::shared_ptr<oxen::quic::connection_interface> quic_conn, quic_monitor_conn;
+        std::shared_ptr<oxen::quic::BTRequestStream> quic_monitor_stream;
+        if (has(transport::quic)) {
+            using namespace oxen::quic;
+            static constexpr auto ALPN = "oxenstorage"sv;
+            static const ustring uALPN{
+                    reinterpret_cast<const unsigned char*>(ALPN.data()), ALPN.size()};
+
+            net.emplace();
+            ep = net->endpoint(Address{}, opt::outbound_alpns{{uALPN}});
+            std::string sk;
+            sk.resize(64);
+            std::array<unsigned char, 32> pk;
+            crypto_sign_ed25519_keypair(pk.data(), reinterpret_cast<unsigned char*>(sk.data()));
+            creds = GNUTLSCreds::make_from_ed_seckey(std::move(sk));
+            quic_conn = ep->connect(RemoteAddress{sn.ed.view(), sn.ip, sn.omq_port}, creds);
+
+            // Notifications are sent on the first stream of the subscribing connection, so
+            // subscriptions get a connection of their own.
+            quic_monitor_conn = ep->connect(RemoteAddress{sn.ed.view(), sn.ip, sn.omq_port}, creds);
+            quic_monitor_stream = quic_monitor_conn->open_stream<BTRequestStream>(
+                    [&quic_monitor](message m) { quic_monitor.notified(m.body()); });
+        }
+
+        std::array<std::function<std::unique_ptr<rpc_client>()>, 3> make_client;
+        make_client[static_cast<size_t>(transport::https)] = [&] {
+            return std::make_unique<https_client>(sn);
+        };
+        make_client[static_cast<size_t>(transport::omq)] = [&] {
+            return std::make_unique<omq_client>(*omq, omq_conn);
+        };
+        make_client[static_cast<size_t>(transport::quic)] = [&] {
+            return std::make_unique<quic_client>(quic_conn);
+        };
+
+        auto accounts = make_accounts(
+                conf.accounts,
+                *make_client[static_cast<size_t>(conf.transports.front())](),
+                conf);
+
+        if (conf.monitors > 0) {
+            auto req = monitor_request(accounts, conf.monitors);
+            if (omq) {
+                std::promise<void> done;
+                omq->request(
+                        omq_conn,
+                        "monitor.messages",
+                        [&](bool success, std::vector<std::string> data) {
+                            if (success && !data.empty())
+                                omq_monitor.subscribe_response(data[0]);
+                            done.set_value();
+                        },
+                        req);
+                done.get_future().wait();
+            }
+            if (quic_monitor_stream) {
+                std::promise<void> done;
+                quic_monitor_stream->command("monitor", req, [&](oxen::quic::message m) {
+                    if (m)
+                        quic_monitor.subscribe_response(m.body());
+                    done.set_value();
+                });
+                done.get_future().wait();
+            }
+        }
+
+        std::cerr << "Sending " << conf.rate << " requests/s for " << conf.warmup.count() << "s + "
+                  << conf.duration.count() << "s...\n";
+
+        // Each transport sends every n-th request of the overall schedule
+        auto n = conf.transports.size();
+        auto start = bench_clock::now() + 100ms;
+        auto measure_from = start + conf.warmup;
+        auto end = measure_from + conf.duration;
+        std::chrono::duration<double> interval{n / conf.rate};
+        std::vector<transport_stats> results(n);
+        std::vector<std::thread> runners;
+        for (size_t t = 0; t < n; t++)
+            runners.emplace_back([&, t] {
+                results[t] = run_transport(
+                        conf,
+                        accounts,
+                        make_client[static_cast<size_t>(conf.transports[t])],
+                        start + std::chrono::duration_cast<bench_clock::duration>(interval * t / n),
+                        interval,
+                        measure_from,
+                        end);
+            });
+        std::this_thread::sleep_until(measure_from);
+        for (auto& m : monitors)
+            m.recording = true;
+        for (auto& r : runners)
+            r.join();
+        for (auto& m : monitors)
+            m.recording = false;
+
+        for (size_t t = 0; t < n; t++) {
+            op_stats all;
+            for (size_t e = 0; e < NUM_ENDPOINTS; e++) {
+                auto& s = results[t].ops[e];
+                all.add(s);
+                nlohmann::json out{
+                        {"transport", to_string(conf.transports[t])},
+                        {"endpoint", to_string(static_cast<endpoint>(e))}};
+                add_results(out, s, conf.duration);
+                std::cout << out.dump() << "\n";
+            }
+            nlohmann::json out{
+                    {"transport", to_string(conf.transports[t])},
+                    {"endpoint", "all"},
+                    {"target_per_sec", conf.rate / n},
+                    {"connections", conf.connections},
+                    {"max_lag_ms", to_ms(results[t].max_lag / 1us)}};
+            add_results(out, all, conf.duration);
+            std::cout << out.dump() << "\n";
+        }
+        for (auto [t, m] : {std::pair{transport::omq, &omq_monitor},
+                            std::pair{transport::quic, &quic_monitor}}) {
+            if (!has(t) || conf.monitors == 0)
+                continue;
+            nlohmann::json out{
+                    {"transport", to_string(t)},
+                    {"endpoint", "monitor.messages"},
+                    {"subscribed", m->subscribed.load()},
+                    {"notifications", m->latencies_us.size()},
+                    {"notify_per_sec", per_sec(m->latencies_us.size(), conf.duration)}};
+            add_percentiles(out, m->latencies_us);
+            std::cout << out.dump() << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,521 @@
+#!/usr/bin/env python3
+
+"""
+Local storage server cluster harness.
+
+Starts N storage servers as local processes, each talking to its own endpoint of an in-process mock
+oxend, so that a realistic (if small) network of swarms can be run and measured on one machine
+without a synced oxend or any real service nodes.
+
+The mock oxend serves everything a storage server needs from oxend:
+
+- admin.get_service_node_privkey -- a distinct, generated set of keys for each node
+- rpc.get_service_nodes -- the simulated service node list (including `poll_block_hash` and
+  `service_node_pubkeys` requests, so that contrib/load-test can look up nodes from it too)
+- rpc.get_block_hash -- hashes of the simulated blocks, for storage tests
+- sub.block -- block subscriptions, which get a notify.block for every new block
+- admin.storage_server_ping, admin.report_peer_status -- pings and reachability reports, which are
+  recorded and included in the summary printed at the end
+
+A new block is produced every --block-time seconds.  A --script file can change the network on
+given blocks, one action per line as `SECONDS ACTION [ARGS...]` (SECONDS since the cluster became
+ready, `#` starts a comment), with the change published in a new block right away:
+
+    60 decommission 3     # node 3 becomes decommissioned (it stays running)
+    120 recommission 3    # and then active again, in the swarm it was in before
+    150 add 2             # registers and starts 2 new nodes
+    180 deregister 0      # removes node 0 from the service node list and stops it
+    200 swarms 3          # reassigns the active nodes to 3 swarms
+    240 stop 1            # kills node 1's process (without changing the service node list)
+    270 start 1           # and restarts it
+    300 hardfork 19 5     # changes the network hardfork/revision
+
+With --load-test the given load-test binary is run against one of the nodes (--load-target) once
+the cluster is ready, with its JSON result lines saved in the output directory.  Otherwise the
+cluster runs for --duration seconds (or until interrupted).  Each node's `get_stats` is saved to
+stats.jsonl in the output directory every --stats-interval seconds and at the end.
+
+Requires the oxenmq Python module (see network-tests/README.md) and PyNaCl.
+"""
+
+import argparse
+import json
+import os
+import secrets
+import shutil
+import signal
+import subprocess
+import sys
+import threading
+import time
+
+import nacl.bindings as sodium
+from oxenmq import OxenMQ, Address, AuthLevel
+
+SWARM_ID_SPACE = 2**64
+INVALID_SWARM_ID = 2**64 - 1
+
+
+def bt_decode(data, i=0):
+    """Decodes bt-encoded `data` starting at `i`; returns (value, next index)."""
+    c = data[i : i + 1]
+    if c == b'i':
+        end = data.index(b'e', i)
+        return int(data[i + 1 : end]), end + 1
+    if c in (b'l', b'd'):
+        i += 1
+        items = []
+        while data[i : i + 1] != b'e':
+            v, i = bt_decode(data, i)
+            items.append(v)
+        if c == b'l':
+            return items, i + 1
+        return dict(zip(items[::2], items[1::2])), i + 1
+    colon = data.index(b':', i)
+    length = int(data[i:colon])
+    return data[colon + 1 : colon + 1 + length], colon + 1 + length
+
+
+def parse_params(data):
+    """Parses a request's json or bt-encoded parameters into a dict with str keys."""
+    if not data:
+        return {}
+    if data[0:1] == b'd':
+        d = bt_decode(data)[0]
+
+        def to_str(v):
+            if isinstance(v, bytes):
+                try:
+                    return v.decode()
+                except UnicodeDecodeError:
+                    return v.hex()
+            if isinstance(v, list):
+                return [to_str(x) for x in v]
+            if isinstance(v, dict):
+                return {to_str(k): to_str(x) for k, x in v.items()}
+            return v
+
+        return to_str(d)
+    return json.loads(data)
+
+
+class Node:
+    def __init__(self, index, oxend_port, https_port, omq_port):
+        self.index = index
+        self.oxend_port = oxend_port
+        self.https_port = https_port
+        self.omq_port = omq_port
+
+        # The legacy key is a plain (reduced) scalar, as oxend uses:
+        self.legacy_sk = sodium.crypto_core_ed25519_scalar_reduce(secrets.token_bytes(64))
+        self.legacy_pk = sodium.crypto_scalarmult_ed25519_base_noclamp(self.legacy_sk)
+        self.ed_pk, self.ed_sk = sodium.crypto_sign_keypair()
+        self.x_sk = sodium.crypto_sign_ed25519_sk_to_curve25519(self.ed_sk)
+        self.x_pk = sodium.crypto_sign_ed25519_pk_to_curve25519(self.ed_pk)
+
+        self.registered = True
+        self.decommissioned = False
+        self.swarm_id = INVALID_SWARM_ID
+        self.proc = None
+        self.omq = None
+
+        self.pings = 0
+        self.last_ping = None
+        self.version = None
+        self.reports = {}  # target index -> [passed, failed]
+
+    def record(self, public_ip):
+        return {
+            "service_node_pubkey": self.legacy_pk.hex(),
+            "pubkey_ed25519": self.ed_pk.hex(),
+            "pubkey_x25519": self.x_pk.hex(),
+            "public_ip": public_ip,
+            "storage_port": self.https_port,
+            "storage_lmq_port": self.omq_port,
+            "swarm_id": INVALID_SWARM_ID if self.decommissioned else self.swarm_id,
+            "active": not self.decommissioned,
+            "funded": True,
+        }
+
+
+class MockOxend:
+    def __init__(self, args):
+        self.args = args
+        self.lock = threading.RLock()
+        self.nodes = []
+        self.height = 1000
+        self.block_hashes = {}
+        self.hardfork, self.snode_revision = args.hardfork
+        self.subscribers = []  # [(omq, conn)]
+        self.next_port = args.base_port
+
+        # The key we query the nodes' stats with:
+        self.stats_sk = secrets.token_bytes(32)
+        self.stats_pk = sodium.crypto_scalarmult_base(self.stats_sk)
+        self.stats_omq = OxenMQ(pubkey=self.stats_pk, privkey=self.stats_sk)
+        self.stats_omq.start()
+
+        for h in range(self.height - 100, self.height + 1):
+            self.block_hashes[h] = secrets.token_hex(32)
+
+    def block_hash(self):
+        return self.block_hashes[self.height]
+
+    def add_node(self):
+        with self.lock:
+            port = self.next_port
+            self.next_port += 3
+            node = Node(len(self.nodes), port, port + 1, port + 2)
+            self.nodes.append(node)
+        self.start_oxend(node)
+        return node
+
+    def start_oxend(self, node):
+        omq = OxenMQ()
+        rpc = omq.add_category("rpc", AuthLevel.none)
+        rpc.add_request_command("get_service_nodes", lambda m: self.get_service_nodes(m))
+        rpc.add_request_command("get_block_hash", lambda m: self.get_block_hash(m))
+        admin = omq.add_category("admin", AuthLevel.admin)
+        admin.add_request_command("get_service_node_privkey", lambda m: self.privkey(node))
+        admin.add_request_command("storage_server_ping", lambda m: self.ping(node, m))
+        admin.add_request_command("report_peer_status", lambda m: self.report(node, m))
+        sub = omq.add_category("sub", AuthLevel.admin)
+        sub.add_request_command("block", lambda m: self.subscribe(omq, m))
+        # Local connections get admin access, just as they do on oxend's ipc socket:
+        omq.listen(
+            "tcp://127.0.0.1:{}".format(node.oxend_port),
+            False,
+            allow_connection=lambda addr, pk, sn: AuthLevel.admin,
+        )
+        omq.start()
+        node.omq = omq
+
+    @staticmethod
+    def reply(body):
+        return [b"200", json.dumps(body).encode()]
+
+    def get_service_nodes(self, m):
+        data = m.data()
+        params = parse_params(data[0] if data else b'')
+        with self.lock:
+            header = {
+                "height": self.height,
+                "block_hash": self.block_hash(),
+                "hardfork": self.hardfork,
+                "snode_revision": self.snode_revision,
+            }
+            if params.get("poll_block_hash") == self.block_hash():
+                return self.reply({**header, "unchanged": True})
+            wanted = params.get("service_node_pubkeys")
+            states = []
+            for n in self.nodes:
+                if not n.registered or (params.get("active_only") and n.decommissioned):
+                    continue
+                if wanted and n.legacy_pk.hex() not in wanted:
+                    continue
+                states.append(n.record(self.args.public_ip))
+        return self.reply({**header, "service_node_states": states})
+
+    def get_block_hash(self, m):
+        data = m.data()
+        heights = parse_params(data[0] if data else b'').get("height", [])
+        with self.lock:
+            hashes = [self.block_hashes.get(h) for h in heights]
+        if len(hashes) != 1 or hashes[0] is None:
+            return self.reply({h: x for h, x in zip(heights, hashes) if x})
+        return self.reply(hashes[0])
+
+    def privkey(self, node):
+        return self.reply(
+            {
+                "service_node_privkey": node.legacy_sk.hex(),
+                "service_node_ed25519_privkey": node.ed_sk.hex(),
+                "service_node_x25519_privkey": node.x_sk.hex(),
+            }
+        )
+
+    def ping(self, node, m):
+        data = m.data()
+        params = parse_params(data[0] if data else b'')
+        with self.lock:
+            node.pings += 1
+            node.last_ping = time.time()
+            node.version = params.get("version")
+        return self.reply({"status": "OK"})
+
+    def report(self, node, m):
+        data = m.data()
+        params = parse_params(data[0] if data else b'')
+        with self.lock:
+            target = next(
+                (n.index for n in self.nodes if n.legacy_pk.hex() == params.get("pubkey")), None
+            )
+            if target is not None:
+                counts = node.reports.setdefault(target, [0, 0])
+                counts[0 if params.get("passed") else 1] += 1
+        return self.reply({"status": "OK"})
+
+    def subscribe(self, omq, m):
+        with self.lock:
+            if any(o is omq and c == m.conn for o, c in self.subscribers):
+                return [b"ALREADY"]
+            self.subscribers.append((omq, m.conn))
+        return [b"OK"]
+
+    def assign_swarms(self, count):
+        """Spreads the registered nodes evenly across `count` swarms."""
+        with self.lock:
+            count = max(count, 1)
+            nodes = [n for n in self.nodes if n.registered]
+            for i, n in enumerate(nodes):
+                n.swarm_id = (i % count) * (SWARM_ID_SPACE // count)
+
+    def new_block(self):
+        with self.lock:
+            self.height += 1
+            self.block_hashes[self.height] = secrets.token_hex(32)
+            self.block_hashes.pop(self.height - 1000, None)
+            subscribers = list(self.subscribers)
+        for omq, conn in subscribers:
+            omq.send(conn, "notify.block")
+
+    def start_node(self, node):
+        args = self.args
+        data_dir = os.path.join(args.out_dir, "node{}".format(node.index))
+        os.makedirs(data_dir, exist_ok=True)
+        cmd = [
+            args.binary,
+            "--testnet",
+            "--no-bootstrap",
+            "--data-dir",
+            data_dir,
+            "--oxend-rpc",
+            "tcp://127.0.0.1:{}".format(node.oxend_port),
+            "--https-port",
+            str(node.https_port),
+            "--omq-port",
+            str(node.omq_port),
+            "--log-level",
+            args.log_level,
+            "--stats-access-key",
+            self.stats_pk.hex(),
+        ] + args.node_args
+        log = open(os.path.join(data_dir, "stdout.log"), "ab")
+        node.proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+
+    def stop_node(self, node):
+        if node.proc and node.proc.poll() is None:
+            node.proc.send_signal(signal.SIGTERM)
+            try:
+                node.proc.wait(timeout=30)
+            except subprocess.TimeoutExpired:
+                node.proc.kill()
+                node.proc.wait()
+        node.proc = None
+
+    def get_stats(self, node):
+        conn = self.stats_omq.connect_remote(
+            Address("curve://127.0.0.1:{}/{}".format(node.omq_port, node.x_pk.hex()))
+        )
+        try:
+            r = self.stats_omq.request_future(conn, "service.get_stats").get()
+            return json.loads(r[0])
+        finally:
+            self.stats_omq.disconnect(conn)
+
+    def save_stats(self, elapsed):
+        with open(os.path.join(self.args.out_dir, "stats.jsonl"), "a") as f:
+            for n in self.nodes:
+                if not n.proc:
+                    continue
+                try:
+                    stats = self.get_stats(n)
+                except Exception as e:
+                    stats = {"error": str(e)}
+                line = {"t": round(elapsed, 1), "node": n.index, "height": self.height}
+                f.write(json.dumps({**line, "stats": stats}) + "\n")
+
+    def ready(self):
+        with self.lock:
+            return all(n.pings > 0 for n in self.nodes if n.proc)
+
+    def summary(self):
+        with self.lock:
+            print("Height {}; {} node(s):".format(self.height, len(self.nodes)))
+            for n in self.nodes:
+                state = (
+                    "deregistered"
+                    if not n.registered
+                    else "decommissioned" if n.decommissioned else "active"
+                )
+                print(
+                    "- node {} ({}, swarm {:016x}, {}): {} ping(s), version {}".format(
+                        n.index,
+                        n.legacy_pk.hex(),
+                        n.swarm_id,
+                        state if n.proc else state + ", stopped",
+                        n.pings,
+                        n.version,
+                    )
+                )
+                for target, (passed, failed) in sorted(n.reports.items()):
+                    print(
+                        "    reachability of node {}: {} passed, {} failed".format(
+                            target, passed, failed
+                        )
+                    )
+
+
+def parse_script(path):
+    actions = []
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            words = line.split('#', 1)[0].split()
+            if not words:
+                continue
+            if len(words) < 2:
+                sys.exit("{}:{}: expected SECONDS ACTION [ARGS...]".format(path, lineno))
+            actions.append((float(words[0]), words[1], [int(x) for x in words[2:]]))
+    return sorted(actions, key=lambda a: a[0])
+
+
+def run_action(oxend, action, params):
+    nodes = oxend.nodes
+    print("Running action: {} {}".format(action, " ".join(str(p) for p in params)))
+    if action in ("decommission", "recommission"):
+        nodes[params[0]].decommissioned = action == "decommission"
+    elif action == "deregister":
+        nodes[params[0]].registered = False
+        oxend.stop_node(nodes[params[0]])
+    elif action == "add":
+        swarms = len({n.swarm_id for n in nodes if n.registered}) or 1
+        new = [oxend.add_node() for _ in range(params[0])]
+        oxend.assign_swarms(swarms)
+        for n in new:
+            oxend.start_node(n)
+    elif action == "swarms":
+        oxend.assign_swarms(params[0])
+    elif action == "stop":
+        oxend.stop_node(nodes[params[0]])
+        return
+    elif action == "start":
+        oxend.start_node(nodes[params[0]])
+        return
+    elif action == "hardfork":
+        oxend.hardfork, oxend.snode_revision = params[0], params[1]
+    else:
+        sys.exit("Unknown script action '{}'".format(action))
+    oxend.new_block()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog="Any arguments after `--` are passed on to every storage server.",
+    )
+    parser.add_argument("--binary", default="./build/oxenss/daemon/oxen-storage")
+    parser.add_argument("--nodes", type=int, default=5, help="number of storage servers [5]")
+    parser.add_argument("--swarms", type=int, default=1, help="number of swarms [1]")
+    parser.add_argument("--out-dir", default="local-cluster", help="data, logs and results")
+    parser.add_argument("--base-port", type=int, default=40000, help="first port to use")
+    parser.add_argument("--public-ip", default="127.0.0.1", help="IP to advertise for the nodes")
+    parser.add_argument("--block-time", type=float, default=30, help="seconds per block [30]")
+    parser.add_argument(
+        "--hardfork",
+        type=int,
+        nargs=2,
+        default=[19, 4],
+        metavar=("HF", "REV"),
+        help="network hardfork and snode revision [19 4]",
+    )
+    parser.add_argument("--script", help="file of scripted network changes (see above)")
+    parser.add_argument("--duration", type=float, default=0, help="seconds to run for, 0 = forever")
+    parser.add_argument("--stats-interval", type=float, default=60, help="seconds between stats")
+    parser.add_argument("--log-level", default="info", help="storage server log level")
+    parser.add_argument("--load-test", help="path to the load-test binary to run once ready")
+    parser.add_argument("--load-target", type=int, default=0, help="node to send the load to [0]")
+    parser.add_argument(
+        "--load-args", default="", help="extra load-test arguments, e.g. '--rate 500'"
+    )
+    parser.add_argument("--keep", action="store_true", help="keep data from a previous run")
+    args, rest = parser.parse_known_args()
+    if rest and rest[0] == "--":
+        rest = rest[1:]
+    args.node_args = rest
+
+    if not args.keep and os.path.exists(args.out_dir):
+        shutil.rmtree(args.out_dir)
+    os.makedirs(args.out_dir, exist_ok=True)
+    script = parse_script(args.script) if args.script else []
+
+    oxend = MockOxend(args)
+    for _ in range(args.nodes):
+        oxend.add_node()
+    oxend.assign_swarms(args.swarms)
+    for n in oxend.nodes:
+        oxend.start_node(n)
+
+    stopping = threading.Event()
+    signal.signal(signal.SIGINT, lambda *_: stopping.set())
+    signal.signal(signal.SIGTERM, lambda *_: stopping.set())
+
+    print("Waiting for {} node(s) to start...".format(len(oxend.nodes)), flush=True)
+    start = time.time()
+    while not oxend.ready() and not stopping.wait(1):
+        for n in oxend.nodes:
+            if n.proc and n.proc.poll() is not None:
+                sys.exit(
+                    "node {} exited with status {}; see {}/node{}/".format(
+                        n.index, n.proc.returncode, args.out_dir, n.index
+                    )
+                )
+    ready_at = time.time()
+    print("Cluster ready in {:.1f}s".format(ready_at - start), flush=True)
+    oxend.summary()
+
+    load = None
+    if args.load_test and not stopping.is_set():
+        target = oxend.nodes[args.load_target]
+        cmd = [
+            args.load_test,
+            "--oxend",
+            "tcp://127.0.0.1:{}".format(target.oxend_port),
+        ] + args.load_args.split() + [target.legacy_pk.hex()]
+        print("Starting load: {}".format(" ".join(cmd)), flush=True)
+        load = subprocess.Popen(
+            cmd, stdout=open(os.path.join(args.out_dir, "load-test.jsonl"), "w")
+        )
+
+    next_block = ready_at + args.block_time
+    next_stats = ready_at + args.stats_interval
+    while not stopping.wait(0.2):
+        now = time.time()
+        elapsed = now - ready_at
+        while script and script[0][0] <= elapsed:
+            _, action, params = script.pop(0)
+            with oxend.lock:
+                run_action(oxend, action, params)
+        if now >= next_block:
+            oxend.new_block()
+            next_block += args.block_time
+        if now >= next_stats:
+            oxend.save_stats(elapsed)
+            next_stats += args.stats_interval
+        if load and load.poll() is not None:
+            print("Load test finished with status {}".format(load.returncode))
+            break
+        if args.duration and elapsed >= args.duration:
+            break
+
+    oxend.save_stats(time.time() - ready_at)
+    oxend.summary()
+    if load and load.poll() is None:
+        load.terminate()
+    for n in oxend.nodes:
+        oxend.stop_node(n)
+    print("Results are in {}/ (stats.jsonl, load-test.jsonl, node*/)".format(args.out_dir))
+
+
+if __name__ == '__main__':
+    main()
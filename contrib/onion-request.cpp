@@ -1,19 +1,30 @@
 // C++ backwards engineered command-line onion routing test tool.
 //
-// This makes onion requests via storage servers.
+// This makes onion requests via storage servers, either a single request (printing the response)
+// or, with --bench, a load test that measures onion request throughput and latency.
 //
 // Build via the `onion-request` target from a build directory (it is not built by default).
 
 #include <oxenss/crypto/channel_encryption.hpp>
 #include <oxenss/crypto/keys.h>
 #include <cpr/cpr.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
 #include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <random>
+#include <thread>
+#include <unordered_map>
 #include <sodium.h>
+#include <fmt/format.h>
 #include <oxenc/hex.h>
 #include <oxenc/base64.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenmq/oxenmq.h>
 #include <nlohmann/json.hpp>
 #include <oxen/quic.hpp>
@@ -33,8 +44,10 @@ int usage(std::string_view argv0, std::string_view err = "") {
     std::cerr
             << "Usage: " << argv0
             << R"( [--mainnet] [--quic] [--xchacha20|--aes-gcm|--aes-cbc|--random] SNODE_PK [SNODE_PK ...] PAYLOAD CONTROL
+       )" << argv0 << R"( --bench [OPTIONS] SNODE_PK [SNODE_PK ...]
 
-Sends an onion request via the given path
+Sends an onion request via the given path, or (with --bench) benchmarks onion requests over random
+paths through the given service nodes.
 
 SNODE_PK should be primary (legacy) pubkey(s) on test (or mainnet if --mainnet is given).
 
@@ -71,6 +84,29 @@ the connection details such as:
 Both PAYLOAD and CONTROL may be passed filenames to read prefixed with `@` (for example:
 @payload.data, @/path/to/control.json)
 
+Benchmark mode:
+
+--bench builds onion requests over random paths through the given SNODE_PKs (which must include at
+        least as many nodes as the longest path) and sends them with a fixed number of requests in
+        flight, printing one JSON result line (throughput, and latency percentiles in
+        milliseconds) per path length to stdout.  All requests are built before any are sent, so
+        that the client-side encryption does not count against the measured throughput.
+
+--hops N[,N...]     path lengths (i.e. number of service nodes in the path) to test [1,2,3]
+--concurrency N     number of requests to keep in flight [16]
+--requests N        number of requests to time for each path length [1000]
+--warmup N          number of untimed requests to send first, to establish connections [100]
+--payload PAYLOAD   request payload [{"method":"info","params":{}}]
+--control CONTROL   request control data [{"headers":[]}]
+--all-enc           run each path length once for each encryption type, rather than just the one
+                    selected by --xchacha20/--aes-gcm/--aes-cbc/--random
+--omq               sends requests to the first hop via OxenMQ (sn.onion_request); this is an
+                    endpoint for service nodes only and so also requires:
+--omq-key SECKEY    the x25519 secret key (in hex) of a registered service node to connect as,
+                    for example on a local devnet.
+
+--quic (or --omq) selects the transport for the first hop; the default is HTTPS.
+
 )";
     return 1;
 }
@@ -78,6 +114,30 @@ Both PAYLOAD and CONTROL may be passed filenames to read prefixed with `@` (for
 const oxenmq::address TESTNET_OMQ{"tcp://public.loki.foundation:9999"};
 const oxenmq::address MAINNET_OMQ{"tcp://public.loki.foundation:22029"};
 
+enum class transport { https, quic, omq };
+
+std::string_view to_string(transport t) {
+    return t == transport::quic ? "quic"sv : t == transport::omq ? "omq"sv : "https"sv;
+}
+
+struct snode_info {
+    ed25519_pubkey ed;
+    x25519_pubkey x;
+    std::string ip;
+    uint16_t https_port = 0;
+    uint16_t omq_port = 0;  // Also the QUIC (UDP) port
+};
+
+struct bench_config {
+    std::vector<size_t> hops{1, 2, 3};
+    int concurrency = 16;
+    size_t requests = 1000;
+    size_t warmup = 100;
+    bool all_enc = false;
+    transport via = transport::https;
+    std::optional<x25519_seckey> omq_key;
+};
+
 void onion_request(
         std::string ip,
         uint16_t port,
@@ -87,6 +147,43 @@ void onion_request(
         std::string_view control,
         bool quic);
 
+int bench(
+        const bench_config& conf,
+        const std::vector<const snode_info*>& nodes,
+        std::optional<EncryptType> enc_type,
+        std::string_view payload,
+        std::string_view control);
+
+template <typename T>
+bool parse_count(std::string_view arg, T& out) {
+    auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), out);
+    return ec == std::errc{} && end == arg.data() + arg.size();
+}
+
+template <typename T>
+bool parse_list(std::string_view arg, std::vector<T>& out) {
+    out.clear();
+    while (!arg.empty()) {
+        auto comma = arg.find(',');
+        T val;
+        if (!parse_count(arg.substr(0, comma), val) || val <= 0)
+            return false;
+        out.push_back(val);
+        arg = comma == std::string_view::npos ? ""sv : arg.substr(comma + 1);
+    }
+    return !out.empty();
+}
+
+void read_value(std::string& var) {
+    if (!var.empty() && var.front() == '@') {
+        std::ifstream f;
+        f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        f.open(var.data()+1, std::ios::in | std::ios::binary);
+        var.clear();
+        var.append(std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{});
+    }
+}
+
 int main(int argc, char** argv) {
     std::vector<std::string_view> pubkeys_hex;
     std::vector<legacy_pubkey> pubkeys;
@@ -94,18 +191,60 @@ int main(int argc, char** argv) {
     std::optional<EncryptType> enc_type = EncryptType::xchacha20;
     std::string payload, control;
     bool quic = false;
+    bool bench_mode = false;
+    bench_config conf;
+    for (int i = 1; i < argc; i++)
+        if (argv[i] == "--bench"sv)
+            bench_mode = true;
+    if (bench_mode) {
+        payload = R"({"method":"info","params":{}})";
+        control = R"({"headers":[]})";
+    }
     for (int i = 1; i < argc; i++) {
         std::string_view arg{argv[i]};
+        if (arg == "--bench"sv) continue;
+        if (bench_mode && i + 1 < argc) {
+            std::string_view val{argv[i + 1]};
+            bool used = true;
+            if (arg == "--hops"sv) {
+                if (!parse_list(val, conf.hops))
+                    return usage(argv[0], "Invalid --hops value");
+            } else if (arg == "--concurrency"sv) {
+                if (!parse_count(val, conf.concurrency) || conf.concurrency <= 0)
+                    return usage(argv[0], "Invalid --concurrency value");
+            } else if (arg == "--requests"sv) {
+                if (!parse_count(val, conf.requests) || conf.requests == 0)
+                    return usage(argv[0], "Invalid --requests value");
+            } else if (arg == "--warmup"sv) {
+                if (!parse_count(val, conf.warmup))
+                    return usage(argv[0], "Invalid --warmup value");
+            } else if (arg == "--payload"sv) {
+                payload = val;
+                read_value(payload);
+            } else if (arg == "--control"sv) {
+                control = val;
+                read_value(control);
+            } else if (arg == "--omq-key"sv) {
+                if (!(val.size() == 64 && oxenc::is_hex(val)))
+                    return usage(argv[0], "Invalid --omq-key value");
+                conf.omq_key = x25519_seckey::from_hex(val);
+            } else {
+                used = false;
+            }
+            if (used) { i++; continue; }
+        }
+        if (bench_mode && arg == "--all-enc"sv) { conf.all_enc = true; continue; }
+        if (bench_mode && arg == "--omq"sv) { conf.via = transport::omq; continue; }
         if (arg == "--mainnet"sv) { omq_addr = MAINNET_OMQ; continue; }
         if (arg == "--testnet"sv) { omq_addr = TESTNET_OMQ; continue; }
         if (arg == "--xchacha20"sv) { enc_type = EncryptType::xchacha20; continue; }
         if (arg == "--aes-gcm"sv) { enc_type = EncryptType::aes_gcm; continue; }
         if (arg == "--aes-cbc"sv) { enc_type = EncryptType::aes_cbc; continue; }
         if (arg == "--random"sv) { enc_type = std::nullopt; continue; }
-        if (arg == "--quic"sv) { quic = true; continue; }
+        if (arg == "--quic"sv) { quic = true; conf.via = transport::quic; continue; }
 
         bool hex = arg.size() > 0 && oxenc::is_hex(arg);
-        if (i >= argc - 2) {
+        if (!bench_mode && i >= argc - 2) {
             if (hex)
                 return usage(argv[0], "Missing PAYLOAD and CONTROL values");
 
@@ -113,13 +252,7 @@ int main(int argc, char** argv) {
             // deliberate send invalid json for testing purposes to see how the remote handles it.
             auto& var = (i == argc - 2 ? payload : control);
             var = arg;
-            if (!var.empty() && var.front() == '@') {
-                std::ifstream f;
-                f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-                f.open(var.data()+1, std::ios::in | std::ios::binary);
-                var.clear();
-                var.append(std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{});
-            }
+            read_value(var);
         } else {
             if (!(hex && arg.size() == 64))
                 return usage(argv[0], "Invalid pubkey '" + std::string{arg} + "'");
@@ -128,6 +261,8 @@ int main(int argc, char** argv) {
         }
     }
     if (pubkeys.empty()) return usage(argv[0]);
+    if (bench_mode && conf.via == transport::omq && !conf.omq_key)
+        return usage(argv[0], "--omq requires --omq-key");
 
     oxenmq::OxenMQ omq{};
     omq.start();
@@ -139,9 +274,7 @@ int main(int argc, char** argv) {
                 try { throw std::runtime_error{"Failed to connect to oxend @ " + omq_addr.full_address() + ": " + std::string{err}}; }
                 catch (...) { got.set_exception(std::current_exception()); }
             });
-    std::string first_ip;
-    uint16_t first_port = 0;
-    std::unordered_map<legacy_pubkey, std::pair<ed25519_pubkey, x25519_pubkey>> aux_keys;
+    std::unordered_map<legacy_pubkey, snode_info> aux_keys;
     omq.request(rpc, "rpc.get_service_nodes", [&](bool success, std::vector<std::string> data) {
         try {
             if (!success || data[0] != "200")
@@ -155,12 +288,12 @@ int main(int argc, char** argv) {
                 auto& x = sn.at("pubkey_x25519").get_ref<const std::string&>();
                 if (e.size() != 64 || x.size() != 64 || !oxenc::is_hex(x) || !oxenc::is_hex(e))
                     throw std::runtime_error{sn.at("service_node_pubkey").get<std::string>() + " is missing ed/x25519 pubkeys"};
-                aux_keys.emplace(legacy_pubkey::from_hex(pk),
-                        std::make_pair(ed25519_pubkey::from_hex(e), x25519_pubkey::from_hex(x)));
-                if (pk == pubkeys_hex.front()) {
-                    first_ip = sn.at("public_ip").get<std::string>();
-                    first_port = sn.at(quic ? "storage_lmq_port" : "storage_port").get<uint16_t>();
-                }
+                aux_keys.emplace(legacy_pubkey::from_hex(pk), snode_info{
+                        ed25519_pubkey::from_hex(e),
+                        x25519_pubkey::from_hex(x),
+                        sn.at("public_ip").get<std::string>(),
+                        sn.at("storage_port").get<uint16_t>(),
+                        sn.at("storage_lmq_port").get<uint16_t>()});
             }
             got.set_value();
         }
@@ -181,16 +314,24 @@ int main(int argc, char** argv) {
 
     try {
         got_fut.get();
-        std::vector<std::pair<ed25519_pubkey, x25519_pubkey>> chain;
+        std::vector<const snode_info*> nodes;
         for (auto& pk : pubkeys) {
             if (auto it = aux_keys.find(pk); it != aux_keys.end())
-                chain.push_back(it->second);
+                nodes.push_back(&it->second);
             else
                 std::cerr << pk.hex() << " is not an active SN\n";
         }
-        if (chain.size() != pubkeys.size()) throw std::runtime_error{"Missing x25519 pubkeys"};
-        if (chain.empty()) throw std::runtime_error{"Need at least one SN pubkey"};
+        if (nodes.size() != pubkeys.size()) throw std::runtime_error{"Missing x25519 pubkeys"};
+        if (nodes.empty()) throw std::runtime_error{"Need at least one SN pubkey"};
+
+        if (bench_mode)
+            return bench(conf, nodes, enc_type, payload, control);
 
+        std::vector<std::pair<ed25519_pubkey, x25519_pubkey>> chain;
+        for (auto* sn : nodes)
+            chain.emplace_back(sn->ed, sn->x);
+        auto& first_ip = nodes.front()->ip;
+        auto first_port = quic ? nodes.front()->omq_port : nodes.front()->https_port;
         if (first_ip.empty() || !first_port)
             throw std::runtime_error{"Missing IP/port of first hop"};
 
@@ -202,6 +343,25 @@ int main(int argc, char** argv) {
     }
 }
 
+// An onion request, encrypted for the first hop of its path.
+struct onion {
+    std::string blob;
+    x25519_pubkey ephemeral_key;
+    EncryptType enc_type;
+
+    // Our ephemeral key and the encryption type used for the final hop, which we need to decrypt
+    // the response:
+    x25519_pubkey final_pubkey;
+    x25519_seckey final_seckey;
+    EncryptType final_etype;
+
+    // The request body for the HTTPS `/onion_req/v2` or QUIC `onion_req` endpoints.
+    std::string wrapped() const;
+
+    // The request body for the OxenMQ `sn.onion_request` endpoint.
+    std::string omq_data() const;
+};
+
 std::string encode_size(uint32_t s) {
     std::string str{reinterpret_cast<const char*>(&s), 4};
 #if __BYTE_ORDER == __BIG_ENDIAN
@@ -222,11 +382,12 @@ EncryptType random_etype() {
         EncryptType::xchacha20;
 }
 
-void onion_request(std::string ip, uint16_t port, std::vector<std::pair<ed25519_pubkey, x25519_pubkey>> keys,
-        std::optional<EncryptType> enc_type, std::string_view payload, std::string_view control, bool quic) {
-    std::string blob;
-
-    std::cerr << "Building " << (keys.size()-1) << "-hop onion request\n";
+onion build_onion(
+        const std::vector<std::pair<ed25519_pubkey, x25519_pubkey>>& keys,
+        std::optional<EncryptType> enc_type,
+        std::string_view payload,
+        std::string_view control,
+        [[maybe_unused]] bool verbose) {
     // First hop:
     //
     // [N][ENCRYPTED]{json}
@@ -264,13 +425,13 @@ void onion_request(std::string ip, uint16_t port, std::vector<std::pair<ed25519_
     // derived key from the pubkey given to the final hop, base64-encoded, then passed back without
     // any onion encryption at all all the way back to the client.
 
+    onion o;
+    std::string& blob = o.blob;
+
     // Ephemeral keypair:
     x25519_pubkey A;
     x25519_seckey a;
-    x25519_pubkey final_pubkey;
-    x25519_seckey final_seckey;
     EncryptType last_etype;
-    EncryptType final_etype;
 
     auto it = keys.rbegin();
     {
@@ -281,14 +442,15 @@ void onion_request(std::string ip, uint16_t port, std::vector<std::pair<ed25519_
         data += payload;
         data += control;
 
-        last_etype = final_etype = enc_type.value_or(random_etype());
+        last_etype = o.final_etype = enc_type.value_or(random_etype());
 #ifndef NDEBUG
-        std::cerr << "Encrypting for final hop using " << to_string(last_etype) << "/" << A << "\n";
+        if (verbose)
+            std::cerr << "Encrypting for final hop using " << to_string(last_etype) << "/" << A << "\n";
 #endif
         blob = e.encrypt(last_etype, data, keys.back().second);
         // Save these because we need them again to decrypt the final response:
-        final_seckey = a;
-        final_pubkey = A;
+        o.final_seckey = a;
+        o.final_pubkey = A;
     }
 
     for (it++; it != keys.rend(); it++) {
@@ -307,15 +469,42 @@ void onion_request(std::string ip, uint16_t port, std::vector<std::pair<ed25519_
         last_etype = enc_type.value_or(random_etype());
 
 #ifndef NDEBUG
-        std::cerr << "Encrypting for next-last hop using " << to_string(last_etype) << "/" << A << "\n";
+        if (verbose)
+            std::cerr << "Encrypting for next-last hop using " << to_string(last_etype) << "/" << A << "\n";
 #endif
         blob = e.encrypt(last_etype, blob, it->second);
     }
 
+    o.ephemeral_key = A;
+    o.enc_type = last_etype;
+    return o;
+}
+
+std::string onion::wrapped() const {
     // The data going to the first hop needs to be wrapped in one more layer to tell the first hop
     // how to decrypt the initial payload:
-    blob = encode_size(blob.size()) + blob + nlohmann::json{
-        {"ephemeral_key", A.hex()}, {"enc_type", to_string(last_etype)}}.dump();
+    return encode_size(blob.size()) + blob + nlohmann::json{
+        {"ephemeral_key", ephemeral_key.hex()}, {"enc_type", to_string(enc_type)}}.dump();
+}
+
+std::string onion::omq_data() const {
+    // This is what a previous hop would send to the next one; unlike the HTTPS and QUIC endpoints
+    // the key and encryption type are passed alongside the blob rather than wrapped with it:
+    return oxenc::bt_serialize(oxenc::bt_dict{
+            {"data", blob},
+            {"enc_type", std::string{to_string(enc_type)}},
+            {"ephemeral_key", std::string{ephemeral_key.view()}},
+            {"hop_no", 0}});
+}
+
+void onion_request(std::string ip, uint16_t port, std::vector<std::pair<ed25519_pubkey, x25519_pubkey>> keys,
+        std::optional<EncryptType> enc_type, std::string_view payload, std::string_view control, bool quic) {
+    std::cerr << "Building " << (keys.size()-1) << "-hop onion request\n";
+    auto o = build_onion(keys, enc_type, payload, control, true);
+    auto blob = o.wrapped();
+    auto& final_seckey = o.final_seckey;
+    auto& final_pubkey = o.final_pubkey;
+    auto final_etype = o.final_etype;
 
     auto started = std::chrono::steady_clock::now();
     std::string body;
@@ -410,3 +599,230 @@ void onion_request(std::string ip, uint16_t port, std::vector<std::pair<ed25519_
     if (!body.empty() && body.back() != '\n')
         std::cout << '\n';
 }
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_result {
+    size_t ok = 0;
+    size_t failed = 0;
+    bench_clock::duration elapsed{};
+    std::vector<int64_t> latencies_us;
+};
+
+// Sends requests [begin, end) using `concurrency` threads, each of which keeps one request in
+// flight at a time.  `make_sender` is called once per thread to get a (thread-specific) function
+// that sends request `i`, blocks until it completes, and returns whether it succeeded.
+bench_result run_requests(
+        size_t begin,
+        size_t end,
+        int concurrency,
+        const std::function<std::function<bool(size_t)>()>& make_sender) {
+    std::atomic<size_t> next = begin;
+    std::vector<bench_result> results(concurrency);
+    std::vector<std::thread> threads;
+    auto started = bench_clock::now();
+    for (auto& r : results)
+        threads.emplace_back([&, &r = r, send = make_sender()] {
+            for (size_t i = next++; i < end; i = next++) {
+                auto start = bench_clock::now();
+                (send(i) ? r.ok : r.failed)++;
+                r.latencies_us.push_back((bench_clock::now() - start) / 1us);
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+
+    bench_result result;
+    result.elapsed = bench_clock::now() - started;
+    for (auto& r : results) {
+        result.ok += r.ok;
+        result.failed += r.failed;
+        result.latencies_us.insert(
+                result.latencies_us.end(), r.latencies_us.begin(), r.latencies_us.end());
+    }
+    std::sort(result.latencies_us.begin(), result.latencies_us.end());
+    return result;
+}
+
+void print_result(
+        const bench_config& conf,
+        size_t hops,
+        std::optional<EncryptType> enc_type,
+        const bench_result& r) {
+    auto pct = [&](double p) {
+        if (r.latencies_us.empty())
+            return 0.0;
+        auto n = r.latencies_us.size();
+        return r.latencies_us[std::min(n - 1, static_cast<size_t>(p * n))] / 1000.0;
+    };
+    double seconds = std::chrono::duration<double>(r.elapsed).count();
+    fmt::print(
+            "{{\"transport\":\"{}\",\"enc_type\":\"{}\",\"hops\":{},\"concurrency\":{},"
+            "\"ok\":{},\"failed\":{},\"seconds\":{:.3f},\"req_per_sec\":{:.1f},"
+            "\"p50_ms\":{:.2f},\"p90_ms\":{:.2f},\"p99_ms\":{:.2f},\"max_ms\":{:.2f}}}\n",
+            to_string(conf.via),
+            enc_type ? to_string(*enc_type) : "random"sv,
+            hops,
+            conf.concurrency,
+            r.ok,
+            r.failed,
+            seconds,
+            seconds > 0 ? (r.ok + r.failed) / seconds : 0.0,
+            pct(0.5),
+            pct(0.9),
+            pct(0.99),
+            pct(1.0));
+    std::fflush(stdout);
+}
+
+int bench(
+        const bench_config& conf,
+        const std::vector<const snode_info*>& nodes,
+        std::optional<EncryptType> enc_type,
+        std::string_view payload,
+        std::string_view control) {
+    auto max_hops = *std::max_element(conf.hops.begin(), conf.hops.end());
+    if (max_hops > nodes.size()) {
+        std::cerr << "Error: " << max_hops << "-node paths require at least " << max_hops
+                  << " distinct SNODE_PKs\n";
+        return 1;
+    }
+    for (auto* sn : nodes)
+        if (sn->ip.empty() || !(conf.via == transport::https ? sn->https_port : sn->omq_port)) {
+            std::cerr << "Error: missing IP/port of " << sn->ed << "\n";
+            return 1;
+        }
+
+    // Connections to each potential first hop, set up once and reused across all requests.
+    std::unordered_map<const snode_info*, std::shared_ptr<oxen::quic::connection_interface>>
+            quic_conns;
+    std::unordered_map<const snode_info*, oxenmq::ConnectionID> omq_conns;
+    std::optional<oxen::quic::Network> net;
+    std::shared_ptr<oxen::quic::Endpoint> ep;
+    std::optional<oxenmq::OxenMQ> omq;
+
+    if (conf.via == transport::quic) {
+        using namespace oxen::quic;
+        static constexpr auto ALPN = "oxenstorage"sv;
+        static const ustring uALPN{
+                reinterpret_cast<const unsigned char*>(ALPN.data()), ALPN.size()};
+
+        net.emplace();
+        ep = net->endpoint(Address{}, opt::outbound_alpns{{uALPN}});
+        std::string sk;
+        sk.resize(64);
+        std::array<unsigned char, 32> pk;
+        crypto_sign_ed25519_keypair(pk.data(), reinterpret_cast<unsigned char*>(sk.data()));
+        auto creds = GNUTLSCreds::make_from_ed_seckey(std::move(sk));
+        for (auto* sn : nodes) {
+            quic_conns.emplace(
+                    sn, ep->connect(RemoteAddress{sn->ed.view(), sn->ip, sn->omq_port}, creds));
+        }
+    } else if (conf.via == transport::omq) {
+        x25519_pubkey pubkey;
+        crypto_scalarmult_base(pubkey.data(), conf.omq_key->data());
+        omq.emplace(
+                pubkey.str(),
+                conf.omq_key->str(),
+                false /*not a service node*/,
+                nullptr);
+        omq->start();
+        for (auto* sn : nodes) {
+            oxenmq::address addr{
+                    fmt::format("curve://{}:{}/{}", sn->ip, sn->omq_port, sn->x.hex())};
+            auto conn = omq->connect_remote(
+                    addr, [](auto) {}, [sn](auto, auto err) {
+                        std::cerr << "Failed to connect to " << sn->ed << ": " << err << "\n";
+                    });
+            omq_conns.emplace(sn, conn);
+        }
+    }
+
+    std::vector<std::optional<EncryptType>> enc_types;
+    if (conf.all_enc)
+        enc_types = {EncryptType::xchacha20, EncryptType::aes_gcm, EncryptType::aes_cbc};
+    else
+        enc_types = {enc_type};
+
+    std::vector<const snode_info*> pool = nodes;
+    for (auto hops : conf.hops) {
+        for (auto& etype : enc_types) {
+            size_t total = conf.warmup + conf.requests;
+            std::cerr << "Building " << total << " onion requests over " << hops
+                      << "-node paths...\n";
+
+            // Each request gets its own random path (and ephemeral keys), so that we exercise (and
+            // spread the load across) all of the given nodes.
+            std::vector<std::pair<const snode_info*, std::string>> reqs;
+            reqs.reserve(total);
+            std::vector<std::pair<ed25519_pubkey, x25519_pubkey>> keys;
+            for (size_t i = 0; i < total; i++) {
+                std::shuffle(pool.begin(), pool.end(), rng);
+                keys.clear();
+                for (size_t h = 0; h < hops; h++)
+                    keys.emplace_back(pool[h]->ed, pool[h]->x);
+                auto o = build_onion(keys, etype, payload, control, false);
+                reqs.emplace_back(
+                        pool[0], conf.via == transport::omq ? o.omq_data() : o.wrapped());
+            }
+
+            std::function<std::function<bool(size_t)>()> make_sender;
+            if (conf.via == transport::https) {
+                make_sender = [&] {
+                    auto sess = std::make_shared<cpr::Session>();
+                    sess->SetVerifySsl(cpr::VerifySsl{false});
+                    return [&, sess](size_t i) {
+                        auto& [sn, body] = reqs[i];
+                        sess->SetUrl(cpr::Url{
+                                fmt::format("https://{}:{}/onion_req/v2", sn->ip, sn->https_port)});
+                        sess->SetBody(cpr::Body{body});
+                        auto res = sess->Post();
+                        return res.error.code == cpr::ErrorCode::OK && res.status_code == 200;
+                    };
+                };
+            } else if (conf.via == transport::quic) {
+                // Each sender gets its own stream on each connection (as a real client with
+                // several requests in flight should), so that our requests don't queue behind each
+                // other's responses.
+                make_sender = [&]() -> std::function<bool(size_t)> {
+                    using streams_t = std::unordered_map<
+                            const snode_info*,
+                            std::shared_ptr<oxen::quic::BTRequestStream>>;
+                    return [&, streams = std::make_shared<streams_t>()](size_t i) {
+                        auto& [sn, body] = reqs[i];
+                        auto& str = (*streams)[sn];
+                        if (!str)
+                            str = quic_conns.at(sn)->open_stream<oxen::quic::BTRequestStream>();
+                        std::promise<bool> done;
+                        str->command("onion_req", body, [&done](oxen::quic::message m) {
+                            done.set_value(static_cast<bool>(m));
+                        });
+                        return done.get_future().get();
+                    };
+                };
+            } else {
+                make_sender = [&]() -> std::function<bool(size_t)> {
+                    return [&](size_t i) {
+                        auto& [sn, body] = reqs[i];
+                        std::promise<bool> done;
+                        omq->request(
+                                omq_conns.at(sn),
+                                "sn.onion_request",
+                                [&done](bool success, std::vector<std::string> data) {
+                                    done.set_value(success && !data.empty() && data[0] == "200");
+                                },
+                                body,
+                                oxenmq::send_option::request_timeout{30s});
+                        return done.get_future().get();
+                    };
+                };
+            }
+
+            if (conf.warmup > 0)
+                run_requests(0, conf.warmup, conf.concurrency, make_sender);
+            auto result = run_requests(conf.warmup, total, conf.concurrency, make_sender);
+            print_result(conf, hops, etype, result);
+        }
+    }
+    return 0;
+}
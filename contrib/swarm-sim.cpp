@@ -0,0 +1,507 @@
+// Swarm churn simulator.
+//
+// Replays a sequence of swarm updates -- either synthetic churn, or updates recorded from oxend --
+// over a modelled network of storage servers, each of which tracks the swarms with the real
+// `Swarm` class (derive_swarm_events/update_state).  Each update then moves data the same way
+// ServiceNode::on_swarm_update does:
+//
+// - new members of a swarm are sent the swarm's data by each existing member;
+// - every member of an existing swarm pushes its data belonging to a new swarm to that swarm;
+// - the members of a dissolved swarm push all of their data to whichever swarms now own it.
+//
+// For each update it prints one JSON object per line with the swarm events, the messages and bytes
+// sent (and how much of that was data the receiver actually lacked), the peak per-node upload and
+// download, how long the transfers take to drain at a given per-node bandwidth, and how many
+// account replicas are still missing afterwards; a final summary line has the totals.
+//
+// Build via the `swarm-sim` target from a build directory (it is not built by default).
+
+#include <oxenss/snode/swarm.h>
+
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::literals;
+using namespace oxenss;
+using namespace oxenss::snode;
+
+int usage(std::string_view argv0, std::string_view err = "") {
+    if (!err.empty())
+        std::cerr << "\x1b[31;1mError: " << err << "\x1b[0m\n\n";
+    std::cerr << "Usage: " << argv0 << R"( [OPTIONS]
+
+Simulates the data redistribution caused by swarm changes, printing one JSON result object per
+swarm update to stdout.
+
+Swarm updates are either synthetic (the default), or read from a file of recorded oxend
+get_service_nodes results (one JSON result per line, with at least the "height" and
+"service_node_states" fields, and "service_node_pubkey", "swarm_id" and "funded" for each node;
+for example as returned for the storage server's `get_service_nodes` request to oxend).
+
+Options:
+    --updates FILE     Replay the swarm updates recorded in FILE
+    --nodes N          Initial number of (synthetic) nodes [500]
+    --blocks N         Number of (synthetic) blocks to simulate [100]
+    --joins N          Number of nodes that join in each synthetic block [1]
+    --leaves N         Number of nodes that leave in each synthetic block [1]
+    --accounts N       Number of accounts storing messages [100000]
+    --messages N       Mean number of stored messages per account [20]
+    --size N           Mean stored message size, in bytes [500]
+    --bandwidth N      Per-node upload and download bandwidth for redistribution, in MB/s [10]
+    --block-time N     Seconds between swarm updates [120]
+    --seed N           Random seed, for reproducible runs [random]
+)";
+    return 1;
+}
+
+struct sim_config {
+    std::string updates_file;
+    size_t nodes = 500;
+    size_t blocks = 100;
+    size_t joins = 1;
+    size_t leaves = 1;
+    size_t accounts = 100'000;
+    size_t messages = 20;
+    size_t data_size = 500;
+    double bandwidth = 10e6;
+    double block_time = 120;
+    uint64_t seed = std::random_device{}();
+};
+
+template <typename T>
+bool parse_int(std::string_view s, T& val) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), val);
+    return ec == std::errc{} && end == s.data() + s.size();
+}
+
+std::mt19937_64 rng;
+
+template <typename Key>
+Key random_key() {
+    Key k;
+    for (auto& c : k)
+        c = static_cast<unsigned char>(rng());
+    return k;
+}
+
+// A made-up service node with random keys, and with ip/port info (so that count_missing_data
+// doesn't count it).
+sn_record random_node() {
+    return {"10.0.0.1",
+            22021,
+            22020,
+            random_key<crypto::legacy_pubkey>(),
+            random_key<crypto::ed25519_pubkey>(),
+            random_key<crypto::x25519_pubkey>()};
+}
+
+// Simplified version of oxend's swarm assignment: new nodes join the smallest swarm; excess nodes
+// above the ideal swarm size are split off into a new swarm once there are enough of them; swarms
+// that drop below the minimum size take a node from the largest swarm, if it has one to spare, or
+// are otherwise dissolved with their nodes going to the smallest remaining swarms.
+class synthetic_network {
+    static constexpr size_t MIN_SWARM_SIZE = 5;
+    static constexpr size_t IDEAL_SWARM_SIZE = 7;
+    static constexpr size_t NEW_SWARM_SIZE = IDEAL_SWARM_SIZE;
+    static constexpr size_t EXCESS_BASE = MIN_SWARM_SIZE;
+
+    std::map<swarm_id_t, std::vector<sn_record>> swarms_;
+    uint64_t height_ = 0;
+
+    std::vector<sn_record>& smallest() {
+        return std::min_element(
+                       swarms_.begin(),
+                       swarms_.end(),
+                       [](auto& a, auto& b) { return a.second.size() < b.second.size(); })
+                ->second;
+    }
+    std::vector<sn_record>& largest() {
+        return std::max_element(
+                       swarms_.begin(),
+                       swarms_.end(),
+                       [](auto& a, auto& b) { return a.second.size() < b.second.size(); })
+                ->second;
+    }
+
+    swarm_id_t new_swarm_id() {
+        swarm_id_t id;
+        do {
+            id = rng();
+        } while (id == INVALID_SWARM_ID || swarms_.count(id));
+        return id;
+    }
+
+    void add(sn_record sn) {
+        if (swarms_.empty())
+            swarms_[new_swarm_id()];
+        smallest().push_back(std::move(sn));
+    }
+
+    void rebalance() {
+        // Swarms below the minimum size borrow a node or dissolve:
+        for (auto it = swarms_.begin(); it != swarms_.end();) {
+            if (it->second.size() >= MIN_SWARM_SIZE || swarms_.size() == 1) {
+                ++it;
+                continue;
+            }
+            if (auto& big = largest(); big.size() > IDEAL_SWARM_SIZE) {
+                it->second.push_back(std::move(big.back()));
+                big.pop_back();
+                continue;
+            }
+            auto orphans = std::move(it->second);
+            it = swarms_.erase(it);
+            for (auto& sn : orphans)
+                smallest().push_back(std::move(sn));
+        }
+
+        // Enough excess nodes make a new swarm:
+        size_t excess = 0;
+        for (auto& [id, snodes] : swarms_)
+            excess += snodes.size() > IDEAL_SWARM_SIZE ? snodes.size() - IDEAL_SWARM_SIZE : 0;
+        while (excess >= EXCESS_BASE + NEW_SWARM_SIZE) {
+            std::vector<sn_record> snodes;
+            while (snodes.size() < NEW_SWARM_SIZE) {
+                auto& big = largest();
+                snodes.push_back(std::move(big.back()));
+                big.pop_back();
+            }
+            swarms_[new_swarm_id()] = std::move(snodes);
+            excess -= NEW_SWARM_SIZE;
+        }
+    }
+
+  public:
+    explicit synthetic_network(size_t nodes) {
+        for (size_t i = 0; i < nodes; i++) {
+            add(random_node());
+            rebalance();
+        }
+    }
+
+    block_update next(size_t joins, size_t leaves) {
+        if (height_ > 0) {
+            for (size_t i = 0; i < leaves && !swarms_.empty(); i++) {
+                auto it = std::next(swarms_.begin(), rng() % swarms_.size());
+                auto& snodes = it->second;
+                snodes.erase(snodes.begin() + rng() % snodes.size());
+                if (snodes.empty())
+                    swarms_.erase(it);
+            }
+            for (size_t i = 0; i < joins; i++)
+                add(random_node());
+            rebalance();
+        }
+
+        block_update bu;
+        bu.height = height_++;
+        for (auto& [id, snodes] : swarms_)
+            bu.swarms.push_back({id, snodes});
+        return bu;
+    }
+};
+
+// Parses a recorded oxend get_service_nodes result; nodes get random ed25519/x25519 keys (the
+// same ones each time) since those don't affect the swarm logic.
+block_update parse_update(
+        const std::string& line, std::unordered_map<std::string, sn_record>& known) {
+    auto result = nlohmann::json::parse(line);
+    std::map<swarm_id_t, std::vector<sn_record>> swarms;
+    block_update bu;
+    bu.height = result.at("height").get<uint64_t>();
+    for (const auto& sn_json : result.at("service_node_states")) {
+        if (!sn_json.value("funded", true))
+            continue;
+        auto pk = sn_json.at("service_node_pubkey").get<std::string>();
+        auto it = known.find(pk);
+        if (it == known.end()) {
+            auto sn = random_node();
+            sn.pubkey_legacy = crypto::legacy_pubkey::from_hex(pk);
+            it = known.emplace(pk, sn).first;
+        }
+        auto swarm_id = sn_json.at("swarm_id").get<swarm_id_t>();
+        if (swarm_id == INVALID_SWARM_ID)
+            bu.decommissioned_nodes.push_back(it->second);
+        else
+            swarms[swarm_id].push_back(it->second);
+    }
+    for (auto& [id, snodes] : swarms)
+        bu.swarms.push_back({id, std::move(snodes)});
+    return bu;
+}
+
+struct sim_node {
+    explicit sim_node(const sn_record& sn) : swarm{sn} {}
+
+    Swarm swarm;
+    std::vector<bool> has;  // Indexed by account: whether we have that account's messages
+    double backlog = 0;     // Bytes still queued to send when the update arrives
+    double recv_backlog = 0;
+};
+
+struct transfer {
+    size_t from, to, account;
+    bool operator<(const transfer& o) const {
+        return std::tie(to, account, from) < std::tie(o.to, o.account, o.from);
+    }
+};
+
+int main(int argc, char** argv) {
+    sim_config cfg;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg{argv[i]};
+        if (arg == "--help"sv || arg == "-h"sv)
+            return usage(argv[0]);
+        if (i + 1 >= argc)
+            return usage(argv[0], fmt::format("Invalid or incomplete argument '{}'", arg));
+        std::string_view val{argv[++i]};
+        bool ok = false;
+        double mbps = 0;
+        if (arg == "--updates"sv) {
+            cfg.updates_file = val;
+            ok = !val.empty();
+        } else if (arg == "--nodes"sv)
+            ok = parse_int(val, cfg.nodes) && cfg.nodes > 0;
+        else if (arg == "--blocks"sv)
+            ok = parse_int(val, cfg.blocks) && cfg.blocks > 0;
+        else if (arg == "--joins"sv)
+            ok = parse_int(val, cfg.joins);
+        else if (arg == "--leaves"sv)
+            ok = parse_int(val, cfg.leaves);
+        else if (arg == "--accounts"sv)
+            ok = parse_int(val, cfg.accounts) && cfg.accounts > 0;
+        else if (arg == "--messages"sv)
+            ok = parse_int(val, cfg.messages) && cfg.messages > 0;
+        else if (arg == "--size"sv)
+            ok = parse_int(val, cfg.data_size) && cfg.data_size > 0;
+        else if (arg == "--bandwidth"sv) {
+            ok = parse_int(val, mbps) && mbps > 0;
+            cfg.bandwidth = mbps * 1e6;
+        } else if (arg == "--block-time"sv)
+            ok = parse_int(val, cfg.block_time) && cfg.block_time > 0;
+        else if (arg == "--seed"sv)
+            ok = parse_int(val, cfg.seed);
+        if (!ok)
+            return usage(argv[0], fmt::format("Invalid argument '{} {}'", arg, val));
+    }
+    rng.seed(cfg.seed);
+
+    std::optional<synthetic_network> synthetic;
+    std::ifstream recorded;
+    std::unordered_map<std::string, sn_record> recorded_nodes;
+    if (cfg.updates_file.empty())
+        synthetic.emplace(cfg.nodes);
+    else {
+        recorded.open(cfg.updates_file);
+        if (!recorded)
+            return usage(argv[0], fmt::format("Unable to open {}", cfg.updates_file));
+    }
+    auto next_update = [&]() -> std::optional<block_update> {
+        if (synthetic) {
+            if (cfg.blocks-- == 0)
+                return std::nullopt;
+            return synthetic->next(cfg.joins, cfg.leaves);
+        }
+        for (std::string line; std::getline(recorded, line);)
+            if (!line.empty())
+                return parse_update(line, recorded_nodes);
+        return std::nullopt;
+    };
+
+    // Each account's position in swarm space, number of messages and total message size:
+    std::vector<uint64_t> space(cfg.accounts);
+    std::vector<uint32_t> msgs(cfg.accounts);
+    std::vector<uint64_t> bytes(cfg.accounts);
+    std::geometric_distribution<uint32_t> msg_count{1.0 / cfg.messages};
+    std::exponential_distribution<double> msg_size{1.0 / cfg.data_size};
+    for (size_t a = 0; a < cfg.accounts; a++) {
+        space[a] = rng();
+        msgs[a] = 1 + msg_count(rng);
+        for (uint32_t m = 0; m < msgs[a]; m++)
+            bytes[a] += 1 + static_cast<uint64_t>(msg_size(rng));
+    }
+
+    std::vector<sim_node> nodes;
+    std::unordered_map<crypto::legacy_pubkey, size_t> node_index;
+    auto get_node = [&](const sn_record& sn) {
+        auto [it, inserted] = node_index.emplace(sn.pubkey_legacy, nodes.size());
+        if (inserted) {
+            nodes.emplace_back(sn);
+            nodes.back().has.resize(cfg.accounts);
+        }
+        return it->second;
+    };
+
+    uint64_t total_msgs = 0, total_bytes = 0, total_needed_bytes = 0;
+    double max_converge = 0;
+    size_t updates = 0;
+    std::vector<size_t> owner(cfg.accounts);
+    std::vector<transfer> transfers;
+
+    while (auto bu = next_update()) {
+        if (bu->swarms.empty())
+            continue;
+        auto [missing_aux, total_nodes] = count_missing_data(*bu);
+        std::sort(bu->swarms.begin(), bu->swarms.end());
+        const auto& swarms = bu->swarms;
+        swarm_lookup lookup{swarms};
+        for (size_t a = 0; a < cfg.accounts; a++)
+            owner[a] = lookup.index(space[a]);
+        std::vector<std::vector<size_t>> members(swarms.size());
+        for (size_t s = 0; s < swarms.size(); s++)
+            for (auto& sn : swarms[s].snodes)
+                members[s].push_back(get_node(sn));
+
+        // The first update just gives each swarm its data
+        if (updates++ == 0)
+            for (size_t a = 0; a < cfg.accounts; a++)
+                for (auto n : members[owner[a]])
+                    nodes[n].has[a] = true;
+
+        // Pushes node n's data for the accounts selected by `want` to each member of the swarm
+        // owning the account (or just to `only`, if given) that doesn't already have it.  Transfers
+        // are all worked out against the state before this update, which is what happens when
+        // nodes push their data at the same time.
+        transfers.clear();
+        auto push = [&](size_t n, auto&& want, const std::vector<size_t>* only = nullptr) {
+            for (size_t a = 0; a < cfg.accounts; a++) {
+                if (!nodes[n].has[a] || !want(a))
+                    continue;
+                for (auto r : only ? *only : members[owner[a]])
+                    if (r != n && !nodes[r].has[a])
+                        transfers.push_back({n, r, a});
+            }
+        };
+
+        size_t dissolved = 0;
+        std::vector<swarm_id_t> new_swarms;
+        std::vector<size_t> new_members;
+        for (auto& node : nodes) {
+            size_t n = &node - nodes.data();
+            auto events = node.swarm.derive_swarm_events(swarms);
+            node.swarm.set_swarm_id(events.our_swarm_id);
+            node.swarm.update_state(
+                    std::vector<SwarmInfo>{swarms}, bu->decommissioned_nodes, events, true);
+            if (events.our_swarm_id == INVALID_SWARM_ID)
+                continue;
+
+            size_t ours = std::lower_bound(
+                                  swarms.begin(),
+                                  swarms.end(),
+                                  SwarmInfo{events.our_swarm_id, {}}) -
+                          swarms.begin();
+            if (!events.new_snodes.empty()) {
+                std::vector<size_t> to;
+                for (auto& sn : events.new_snodes)
+                    to.push_back(get_node(sn));
+                new_members.insert(new_members.end(), to.begin(), to.end());
+                push(n, [&](size_t a) { return owner[a] == ours; }, &to);
+            }
+            if (!events.new_swarms.empty()) {
+                std::vector<bool> is_new(swarms.size());
+                for (auto id : events.new_swarms) {
+                    auto it = std::lower_bound(swarms.begin(), swarms.end(), SwarmInfo{id, {}});
+                    is_new[it - swarms.begin()] = true;
+                    new_swarms.push_back(id);
+                }
+                push(n, [&](size_t a) { return is_new[owner[a]]; });
+            }
+            if (events.dissolved) {
+                dissolved++;
+                push(n, [](size_t) { return true; });
+            }
+        }
+        std::sort(new_swarms.begin(), new_swarms.end());
+        new_swarms.erase(std::unique(new_swarms.begin(), new_swarms.end()), new_swarms.end());
+        std::sort(new_members.begin(), new_members.end());
+        new_members.erase(
+                std::unique(new_members.begin(), new_members.end()), new_members.end());
+
+        // Tally up and apply the transfers
+        uint64_t sent_msgs = 0, sent_bytes = 0, needed_bytes = 0;
+        std::vector<uint64_t> node_sent(nodes.size()), node_recv(nodes.size());
+        std::sort(transfers.begin(), transfers.end());
+        for (size_t i = 0; i < transfers.size(); i++) {
+            auto& t = transfers[i];
+            sent_msgs += msgs[t.account];
+            sent_bytes += bytes[t.account];
+            node_sent[t.from] += bytes[t.account];
+            node_recv[t.to] += bytes[t.account];
+            if (i == 0 || transfers[i - 1].to != t.to || transfers[i - 1].account != t.account)
+                needed_bytes += bytes[t.account];
+            nodes[t.to].has[t.account] = true;
+        }
+
+        // Anything not sent during the last update period is still queued:
+        double converge = 0;
+        const double per_update = cfg.block_time * cfg.bandwidth;
+        for (size_t n = 0; n < nodes.size(); n++) {
+            auto& node = nodes[n];
+            node.backlog = std::max(0.0, node.backlog - per_update) + node_sent[n];
+            node.recv_backlog = std::max(0.0, node.recv_backlog - per_update) + node_recv[n];
+            converge = std::max({converge, node.backlog, node.recv_backlog});
+        }
+        converge /= cfg.bandwidth;
+
+        // Replicas that swarm members still don't have (e.g. because no one who had the data was
+        // told to push it to them):
+        size_t missing_replicas = 0, lost_accounts = 0;
+        for (size_t a = 0; a < cfg.accounts; a++) {
+            size_t missing = 0;
+            for (auto n : members[owner[a]])
+                missing += !nodes[n].has[a];
+            missing_replicas += missing;
+            lost_accounts += missing == members[owner[a]].size();
+        }
+
+        total_msgs += sent_msgs;
+        total_bytes += sent_bytes;
+        total_needed_bytes += needed_bytes;
+        max_converge = std::max(max_converge, converge);
+
+        fmt::print(
+                "{{\"height\":{},\"nodes\":{},\"swarms\":{},\"missing_aux\":{},"
+                "\"new_swarms\":{},\"dissolved_nodes\":{},\"new_members\":{},"
+                "\"messages_sent\":{},\"bytes_sent\":{},\"bytes_needed\":{},"
+                "\"peak_node_sent\":{},\"peak_node_recv\":{},\"converge_seconds\":{:.1f},"
+                "\"missing_replicas\":{},\"unreplicated_accounts\":{}}}\n",
+                bu->height,
+                total_nodes,
+                swarms.size(),
+                missing_aux,
+                new_swarms.size(),
+                dissolved,
+                new_members.size(),
+                sent_msgs,
+                sent_bytes,
+                needed_bytes,
+                *std::max_element(node_sent.begin(), node_sent.end()),
+                *std::max_element(node_recv.begin(), node_recv.end()),
+                converge,
+                missing_replicas,
+                lost_accounts);
+    }
+
+    fmt::print(
+            "{{\"summary\":true,\"updates\":{},\"messages_sent\":{},\"bytes_sent\":{},"
+            "\"bytes_needed\":{},\"max_converge_seconds\":{:.1f}}}\n",
+            updates,
+            total_msgs,
+            total_bytes,
+            total_needed_bytes,
+            max_converge);
+    return 0;
+}
@@ -4,6 +4,9 @@
 #include "pubkey.h"
 
 #include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace oxenss {
 
@@ -43,4 +46,35 @@ struct message {
             data{std::move(data)} {}
 };
 
+/// Non-owning view of a stored message, used when iterating over database results without
+/// copying them into `message`s.  The string_views are only valid for the duration of the callback
+/// that receives the view.
+struct message_view {
+    std::string_view hash;
+    namespace_id msg_namespace;
+    std::chrono::system_clock::time_point timestamp;
+    std::chrono::system_clock::time_point expiry;
+    std::string_view data;
+};
+
+/// A message_view together with its owner, for storing messages (see `Database::bulk_store`)
+/// straight out of a buffer that holds them, such as a received SN-to-SN batch.  The owner and
+/// everything the view references must outlive the store call.
+struct message_ref {
+    const user_pubkey* pubkey;
+    message_view msg;
+};
+
+/// A change to messages that were already stored: either their deletion, or an update of their
+/// expiry.  Used to notify monitoring connections that asked for such events.
+struct message_change {
+    enum class type { deleted, expiry };
+
+    type what;
+    user_pubkey pubkey;
+    namespace_id msg_namespace;
+    std::vector<std::string> hashes;
+    std::chrono::system_clock::time_point expiry;  // the new expiry (for type::expiry only)
+};
+
 }  // namespace oxenss
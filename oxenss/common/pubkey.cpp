@@ -1,8 +1,10 @@
 #include "pubkey.h"
 #include "mainnet.h"
+#include <oxenc/endian.h>
 #include <oxenc/hex.h>
 #include <charconv>
 #include <cassert>
+#include <cstring>
 
 namespace oxenss {
 
@@ -54,4 +56,19 @@ std::string user_pubkey::prefixed_raw() const {
     return bytes;
 }
 
+uint64_t pubkey_to_swarm_space(const user_pubkey& pk) {
+    const auto bytes = pk.raw();
+    assert(bytes.size() == 32);
+
+    uint64_t res = 0;
+    for (size_t i = 0; i < 4; i++) {
+        uint64_t buf;
+        std::memcpy(&buf, bytes.data() + i * 8, 8);
+        res ^= buf;
+    }
+    oxenc::big_to_host_inplace(res);
+
+    return res;
+}
+
 }  // namespace oxenss
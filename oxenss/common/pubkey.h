@@ -1,6 +1,10 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <string_view>
 
 namespace oxenss {
 
@@ -9,6 +13,53 @@ namespace oxenss {
 inline constexpr size_t USER_PUBKEY_SIZE_BYTES = 33;
 inline constexpr size_t USER_PUBKEY_SIZE_HEX = USER_PUBKEY_SIZE_BYTES * 2;
 
+// Fixed-size form of a user pubkey: the network byte followed by the 32 pubkey bytes (i.e. the
+// same bytes as `user_pubkey::prefixed_raw()`).  It is trivially copyable and cheap to hash, so
+// unlike a `user_pubkey` or a prefixed string, building, copying, or looking one up in a hash table
+// never allocates; use it as the key of the maps that get hit for every stored message.  An invalid
+// pubkey gives the all-zero key.
+class prefixed_pubkey {
+    std::array<char, USER_PUBKEY_SIZE_BYTES> bytes_{};
+
+  public:
+    // Constructs the all-zero key.
+    prefixed_pubkey() = default;
+
+    // Constructs from 33 bytes of network byte + pubkey; anything else gives the all-zero key.
+    explicit prefixed_pubkey(std::string_view prefixed_raw) {
+        if (prefixed_raw.size() == bytes_.size())
+            std::memcpy(bytes_.data(), prefixed_raw.data(), bytes_.size());
+    }
+
+    // Constructs from a network byte and 32-byte raw pubkey.
+    prefixed_pubkey(uint8_t network, std::string_view raw) {
+        if (raw.size() + 1 == bytes_.size()) {
+            bytes_[0] = static_cast<char>(network);
+            std::memcpy(bytes_.data() + 1, raw.data(), raw.size());
+        }
+    }
+
+    bool operator==(const prefixed_pubkey& other) const = default;
+
+    // The 33 bytes, including the network byte
+    std::string_view view() const { return {bytes_.data(), bytes_.size()}; }
+
+    // The 32 pubkey bytes, without the network byte
+    std::string_view raw() const { return view().substr(1); }
+
+    int type() const { return static_cast<uint8_t>(bytes_[0]); }
+
+    // Pubkeys are (effectively) uniformly random, so a few of their bytes make a perfectly good
+    // hash; we mix two words of them anyway so that the network byte and both halves count.
+    size_t hash() const {
+        uint64_t a, b;
+        std::memcpy(&a, bytes_.data() + 1, sizeof(a));
+        std::memcpy(&b, bytes_.data() + 17, sizeof(b));
+        return static_cast<size_t>(
+                (a ^ (b * 0x9e3779b97f4a7c15ULL)) + static_cast<uint8_t>(bytes_[0]));
+    }
+};
+
 class user_pubkey {
     int network_ = -1;
     std::string pubkey_;
@@ -55,12 +106,26 @@ class user_pubkey {
     // Returns the raw bytes that makes up the pubkey, including the type/network prefix byte.
     // Returns an empty string for an invalid (default constructed) pubkey.
     std::string prefixed_raw() const;
+
+    // Returns the same bytes as prefixed_raw(), as a (non-allocating) fixed-size key.
+    prefixed_pubkey key() const {
+        return pubkey_.empty() ? prefixed_pubkey{}
+                               : prefixed_pubkey{static_cast<uint8_t>(network_), pubkey_};
+    }
 };
 
+/// Maps a pubkey into a 64-bit "swarm space" value; the swarm you belong to is whichever one
+/// has a swarm id closest to this pubkey-derived value.
+uint64_t pubkey_to_swarm_space(const user_pubkey& pk);
+
 }  // namespace oxenss
 
 namespace std {
 template <>
+struct hash<oxenss::prefixed_pubkey> {
+    size_t operator()(const oxenss::prefixed_pubkey& pk) const { return pk.hash(); }
+};
+template <>
 struct hash<oxenss::user_pubkey> {
     size_t operator()(const oxenss::user_pubkey& pk) const {
         return static_cast<size_t>(pk.type()) ^ hash<std::string>{}(pk.raw());
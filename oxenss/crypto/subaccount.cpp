@@ -1,24 +1,33 @@
 #include "subaccount.h"
 #include <sodium/crypto_sign_ed25519.h>
 #include <cassert>
+#include <cstring>
 
 namespace oxenss {
 
-void signed_subaccount_token::verify(
-        uint8_t net_prefix, const unsigned char* ed_pk, subaccount_access required_access) const {
-
+void signed_subaccount_token::verify_access(
+        uint8_t net_prefix, subaccount_access required_access) const {
     if (!token.prefix_allowed(net_prefix))
         throw subaccount_verification_bad_network{};
 
     // Check that this token allows whatever access flag(s) are needed for this endpoint
     if ((token.flags() & required_access) != required_access)
         throw subaccount_verification_bad_permissions{};
+}
 
+bool signed_subaccount_token::signature_valid(const unsigned char* ed_pk) const {
     assert(ed_pk);
+    return 0 == crypto_sign_ed25519_verify_detached(
+                        signature.data(), token.token.data(), token.token.size(), ed_pk);
+}
+
+void signed_subaccount_token::verify(
+        uint8_t net_prefix, const unsigned char* ed_pk, subaccount_access required_access) const {
+
+    verify_access(net_prefix, required_access);
 
     // Verify that the subaccount token has been signed by the main account owner
-    if (0 != crypto_sign_ed25519_verify_detached(
-                     signature.data(), token.token.data(), token.token.size(), ed_pk))
+    if (!signature_valid(ed_pk))
         throw subaccount_verification_bad_signature{};
 }
 
@@ -36,4 +45,69 @@ void signed_subaccount_token::verify(
     return verify(pubkey.type(), pk, required_access);
 }
 
+void SubaccountCache::verify(
+        const signed_subaccount_token& sa,
+        const user_pubkey& pubkey,
+        subaccount_access required_access,
+        const unsigned char* ed_pk) {
+    sa.verify_access(pubkey.type(), required_access);
+
+    if (!ed_pk) {
+        assert(pubkey.raw().size() == 32);
+        ed_pk = reinterpret_cast<const unsigned char*>(pubkey.raw().data());
+    }
+
+    auto matches = [&](const entry& e) {
+        return std::memcmp(e.owner.data(), ed_pk, e.owner.size()) == 0 &&
+               e.signature == sa.signature;
+    };
+    std::string key{sa.token.sview()};
+    {
+        std::lock_guard lock{mutex_};
+        if (auto it = current_.find(key); it != current_.end() && matches(it->second)) {
+            hits_++;
+            return;
+        }
+        if (auto it = previous_.find(key); it != previous_.end() && matches(it->second)) {
+            hits_++;
+            current_.insert_or_assign(std::move(key), it->second);
+            previous_.erase(it);
+            rotate();
+            return;
+        }
+        misses_++;
+    }
+
+    if (!sa.signature_valid(ed_pk))
+        throw subaccount_verification_bad_signature{};
+
+    entry e;
+    std::memcpy(e.owner.data(), ed_pk, e.owner.size());
+    e.signature = sa.signature;
+    std::lock_guard lock{mutex_};
+    current_.insert_or_assign(std::move(key), e);
+    rotate();
+}
+
+void SubaccountCache::rotate() {
+    if (current_.size() < MAX_ENTRIES)
+        return;
+    previous_ = std::move(current_);
+    current_.clear();
+}
+
+void SubaccountCache::forget(const std::vector<subaccount_token>& tokens) {
+    std::lock_guard lock{mutex_};
+    for (const auto& t : tokens) {
+        std::string key{t.sview()};
+        current_.erase(key);
+        previous_.erase(key);
+    }
+}
+
+SubaccountCache::cache_stats SubaccountCache::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return {current_.size() + previous_.size(), hits_, misses_};
+}
+
 }  // namespace oxenss
@@ -1,6 +1,13 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "../common/subaccount_token.h"
 #include "../common/pubkey.h"
 
@@ -48,6 +55,66 @@ struct signed_subaccount_token {
     // Same as above, but works on more raw values
     void verify(uint8_t net_prefix, const unsigned char* ed_pk, subaccount_access required_access)
             const;
+
+    // Same as above, but only checks the network prefix and permissions (i.e. everything except
+    // the signature).
+    void verify_access(uint8_t net_prefix, subaccount_access required_access) const;
+
+    // Returns true if `signature` is a valid signature of the token by the given 32-byte binary
+    // ed25519 pubkey.
+    bool signature_valid(const unsigned char* ed_pk) const;
+};
+
+// Remembers subaccount tokens whose owner signature we have already verified, so that the (many)
+// requests that reuse the same token don't each have to verify the owner signature again: a hit
+// here saves one ed25519 verification per subaccount request.  The network prefix and permission
+// checks are cheap and are still done for every request.
+//
+// Only successful verifications are remembered, so filling the cache requires tokens actually
+// signed by their owners.  It holds up to about 2*MAX_ENTRIES tokens: once MAX_ENTRIES tokens
+// have been added since the last rotation, the older generation is dropped, and the current one
+// becomes the older one.  A token found in the older generation is moved into the current one.
+//
+// Revoked tokens are still refused by the separate revocation check; forget() takes them out of
+// the cache too when they are revoked.
+class SubaccountCache {
+  public:
+    static constexpr size_t MAX_ENTRIES = 10'000;
+
+    // Same as `sa.verify(pubkey, required_access, ed_pk)`, but skips the owner signature check if
+    // we have already verified the same token and signature with the same owner key.
+    void verify(
+            const signed_subaccount_token& sa,
+            const user_pubkey& pubkey,
+            subaccount_access required_access,
+            const unsigned char* ed_pk = nullptr);
+
+    // Removes the given tokens (of any owner) from the cache.
+    void forget(const std::vector<subaccount_token>& tokens);
+
+    struct cache_stats {
+        size_t size;
+        uint64_t hits;
+        uint64_t misses;
+    };
+    cache_stats get_stats() const;
+
+  private:
+    struct entry {
+        std::array<unsigned char, 32> owner;
+        std::array<unsigned char, 64> signature;
+    };
+    // Keyed by the binary token value
+    using generation = std::unordered_map<std::string, entry>;
+
+    mutable std::mutex mutex_;
+    generation current_;
+    generation previous_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+
+    // Starts a new generation if the current one is full.  Called with the mutex held.
+    void rotate();
 };
 
 }  // namespace oxenss
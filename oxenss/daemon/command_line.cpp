@@ -2,6 +2,7 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/version.h>
 #include <oxenss/common/format.h>
+#include <oxenss/server/omq_queues.h>
 #include <oxenss/utils/string_utils.hpp>
 
 #include <CLI/CLI.hpp>
@@ -183,6 +184,182 @@ parse_result parse_cli_args(int argc, char* argv[]) {
             "--force-start",
             options.force_start,
             "Ignore the initialisation ready check (primarily for debugging).");
+    cli.add_flag(
+            "--no-bootstrap",
+            options.no_bootstrap,
+            "Never ask the public bootstrap nodes for service node data, even if oxend's list looks "
+            "incomplete (e.g. for a local test network of a few nodes).");
+    cli.add_flag(
+            "--db-group-commit",
+            options.db_group_commit,
+            "Coalesce concurrent message stores into shared database transactions; this can "
+            "substantially increase store throughput on busy nodes.");
+    cli.add_option(
+               "--db-shards",
+               options.db_shards,
+               "Split stored messages across this many database files, each with its own writer; "
+               "an existing unsharded database is imported on first startup.")
+            ->check(CLI::Range(1, 64))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-eviction",
+               options.db_eviction,
+               "What to do as the database nears its size limit: 'none' rejects new messages once "
+               "full; 'soonest-expiry' or 'oldest' evict messages of the largest accounts (those "
+               "expiring soonest, or the oldest ones) to keep accepting new messages.")
+            ->check(CLI::IsMember({"none", "soonest-expiry", "oldest"}))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-slow-query-ms",
+               options.db_slow_query_ms,
+               "Log database statements that take at least this many milliseconds to execute; 0 "
+               "disables the slow query log.")
+            ->check(CLI::Range(0, 600000))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-expiry-partition-minutes",
+               options.db_expiry_partition_minutes,
+               "Store messages in a ring of tables by expiry windows of this many minutes, so that "
+               "expired messages are removed by dropping a whole table at a time; 0 stores all "
+               "messages in one table.  Changing this converts existing messages on startup.")
+            ->check(CLI::Range(0, 44640))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-cache-mb",
+               options.db_cache_mb,
+               "Size of the page cache of each database connection, in MiB; 0 uses SQLite's "
+               "default (2MiB), and -1 sizes it from the system memory.")
+            ->check(CLI::Range(-1, 4096))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-mmap-mb",
+               options.db_mmap_mb,
+               "Memory-map up to this many MiB of the database for reads; 0 disables memory "
+               "mapping, and -1 sizes it from the system memory.")
+            ->check(CLI::Range(-1, 1024 * 1024))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-pool-min",
+               options.db_pool_min,
+               "Open this many database connections (per shard) at startup, rather than opening "
+               "them as requests first need them.")
+            ->check(CLI::Range(1, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-pool-max",
+               options.db_pool_max,
+               "Limit the number of database connections (per shard) that are kept open; requests "
+               "that find them all in use briefly wait for one.  0 means no limit.")
+            ->check(CLI::Range(0, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-owner-quota-mb",
+               options.db_owner_quota_mb,
+               "Refuse client stores of new messages for an account once it has this many MiB of "
+               "message data stored here.  0 means no limit.")
+            ->check(CLI::Range(0, 1024 * 1024))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-owner-max-jobs",
+               options.db_owner_max_jobs,
+               "Refuse (with a retryable error) database requests for an account that already has "
+               "this many requests waiting for the database.  0 means no limit.")
+            ->check(CLI::Range(0, 1000000))
+            ->capture_default_str();
+    cli.add_option(
+               "--onion-threads",
+               options.onion_threads,
+               "Number of threads for decrypting onion requests and encrypting their responses; 0 "
+               "does this work directly on the threads receiving the requests.")
+            ->check(CLI::Range(0, 64))
+            ->capture_default_str();
+    cli.add_option(
+               "--https-threads",
+               options.https_threads,
+               "Number of HTTPS event loop threads; with more than one the threads share the HTTPS "
+               "port (via SO_REUSEPORT) and handle separate connections, spreading TLS work "
+               "across cores.")
+            ->check(CLI::Range(1, 64))
+            ->capture_default_str();
+    cli.add_option(
+               "--quic-threads",
+               options.quic_threads,
+               "Number of QUIC event loop threads.  The first handles all incoming QUIC traffic; "
+               "any others handle our outgoing QUIC reachability tests and HTTP client "
+               "requests, leaving the first to incoming connections.")
+            ->check(CLI::Range(1, 64))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-threads",
+               options.omq_threads,
+               "Number of general OxenMQ worker threads, shared by all request categories; 0 "
+               "sizes the pool adaptively, starting threads (up to the number of cores) only as "
+               "the request queues back up.")
+            ->check(CLI::Range(0, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-category",
+               options.omq_categories,
+               "Overrides the reserved worker threads and the max queued requests of an OxenMQ "
+               "request category, as NAME=THREADS,QUEUE (e.g. storage=4,1000).  The categories "
+               "are sn, storage, monitor, https and quic.  May be given more than once.")
+            ->type_name("SPEC")
+            ->check([](const std::string& spec) -> std::string {
+                try {
+                    server::parse_category_limits(spec);
+                } catch (const std::exception& e) {
+                    return "invalid category spec '{}': {}"_format(spec, e.what());
+                }
+                return "";
+            });
+    cli.add_option(
+               "--shed-target-ms",
+               options.shed_target_ms,
+               "Queue delay (in milliseconds) beyond which we start refusing onion requests, and "
+               "then (at 2x and 4x it) client reads and writes, to keep capacity for service node "
+               "traffic such as storage tests and pings; 0 never refuses requests.")
+            ->check(CLI::Range(0, 60000))
+            ->capture_default_str();
+    cli.add_option(
+               "--trace-sample-rate",
+               options.trace_sample_rate,
+               "Fraction (from 0 to 1) of client requests for which to record the time of each "
+               "processing phase; the recent traces are available from the admin OMQ endpoint "
+               "service.get_traces.")
+            ->check(CLI::Range(0.0, 1.0))
+            ->capture_default_str();
+    cli.add_option(
+               "--trace-slow-ms",
+               options.trace_slow_ms,
+               "Client requests taking at least this many milliseconds are always traced (whether "
+               "or not they were sampled); 0 to only trace sampled requests.")
+            ->check(CLI::Range(0, 600000))
+            ->capture_default_str();
+    cli.add_flag(
+            "--lock-profiling",
+            options.lock_profiling,
+            "Record acquisition counts, contention and wait times, and the longest hold time of "
+            "the main internal locks, included in the stats and metrics.");
+    cli.add_option(
+               "--client-rate-limit",
+               options.client_rate_limit,
+               "Sustained requests per second allowed from a single client (IPv4 address, or IPv6 "
+               "/64 network) over HTTPS, OxenMQ and QUIC.")
+            ->check(CLI::Range(1, 1000000))
+            ->capture_default_str();
+    cli.add_option(
+               "--client-burst",
+               options.client_burst,
+               "Requests a single client may make in a burst beyond --client-rate-limit.")
+            ->check(CLI::Range(1, 1000000))
+            ->capture_default_str();
+    cli.add_option(
+               "--max-rate-limited-clients",
+               options.max_rate_limited_clients,
+               "The most clients we track for rate limiting at once; beyond it, requests from new "
+               "clients are refused until some of the tracked ones go idle.")
+            ->check(CLI::Range(1, 100000000))
+            ->capture_default_str();
     cli.add_option(
                "--stats-access-key",
                options.stats_access_keys,
@@ -13,6 +13,30 @@ struct command_line_options {
     uint16_t omq_quic_port = 22020;
     std::string oxend_omq_rpc;  // Defaults to ipc://$HOME/.oxen/[testnet/]oxend.sock
     bool force_start = false;
+    bool no_bootstrap = false;
+    bool db_group_commit = false;
+    int db_shards = 1;
+    std::string db_eviction = "none";
+    int db_slow_query_ms = 500;
+    int db_expiry_partition_minutes = 0;
+    int db_cache_mb = -1;  // -1 = sized from physical memory
+    int db_mmap_mb = -1;   // -1 = sized from physical memory
+    int db_pool_min = 4;
+    int db_pool_max = 0;        // 0 = no limit
+    int db_owner_quota_mb = 0;  // 0 = no limit
+    int db_owner_max_jobs = 0;  // 0 = no limit
+    int onion_threads = 4;
+    int https_threads = 1;
+    int quic_threads = 1;
+    int omq_threads = 0;                      // 0 = adaptive
+    std::vector<std::string> omq_categories;  // NAME=THREADS,QUEUE overrides
+    int shed_target_ms = 100;
+    double trace_sample_rate = 0;  // fraction of client requests to trace
+    int trace_slow_ms = 1000;      // always trace requests at least this slow; 0 = don't
+    bool lock_profiling = false;
+    int client_rate_limit = 300;  // requests per second per client IPv4 address or IPv6 /64
+    int client_burst = 600;
+    int max_rate_limited_clients = 10000;
     bool testnet = false;
     std::string log_level = "info";
     std::filesystem::path data_dir;
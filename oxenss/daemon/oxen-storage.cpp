@@ -11,12 +11,14 @@
 #include <oxenss/server/server_certificates.h>
 #include <oxenss/snode/service_node.h>
 #include <oxenss/snode/swarm.h>
+#include <oxenss/utils/lock_profiler.hpp>
 #include <oxenss/version.h>
 
 #include <oxenmq/oxenmq.h>
 #include <sodium/core.h>
 #include <fmt/std.h>
 
+#include <algorithm>
 #include <csignal>
 #include <cstdlib>
 #include <filesystem>
@@ -143,18 +145,76 @@ int main(int argc, char* argv[]) {
         if (!exists(ssl_dh))
             generate_dh_pem(ssl_dh);
 
+        util::set_lock_profiling(options.lock_profiling);
+
         // Set up oxenmq now, but don't actually start it until after we set up the ServiceNode
         // instance (because ServiceNode and OxenmqServer reference each other).
-        auto oxenmq_server_ptr =
-                std::make_unique<server::OMQ>(me, private_key_x25519, stats_access_keys);
+        server::omq_queue_options omq_queues;
+        omq_queues.general_threads = options.omq_threads;
+        for (const auto& spec : options.omq_categories) {
+            auto [name, limits] = server::parse_category_limits(spec);
+            omq_queues.categories.insert_or_assign(std::move(name), limits);
+        }
+        auto oxenmq_server_ptr = std::make_unique<server::OMQ>(
+                me, private_key_x25519, stats_access_keys, std::move(omq_queues));
         auto& oxenmq_server = *oxenmq_server_ptr;
 
-        snode::ServiceNode service_node{
-                me, private_key, oxenmq_server, options.data_dir, options.force_start};
-
-        rpc::RequestHandler request_handler{service_node, channel_encryption, private_key_ed25519};
+        database_options db_options;
+        db_options.group_commit = options.db_group_commit;
+        db_options.shards = options.db_shards;
+        if (options.db_eviction == "soonest-expiry")
+            db_options.eviction = eviction_policy::soonest_expiry;
+        else if (options.db_eviction == "oldest")
+            db_options.eviction = eviction_policy::oldest;
+        db_options.slow_query = std::chrono::milliseconds{options.db_slow_query_ms};
+        db_options.expiry_partition = std::chrono::minutes{options.db_expiry_partition_minutes};
+        db_options.pool_min = options.db_pool_min;
+        db_options.pool_max = options.db_pool_max;
+        db_options.owner_max_jobs = options.db_owner_max_jobs;
+
+        // Auto-sized caches: a per-connection page cache of 1/512th of the memory (between 2MiB
+        // and 64MiB), and a memory map of up to a quarter of it (which is shared by all the
+        // connections, and only uses memory as the OS page cache does).
+        constexpr int64_t MiB = 1024 * 1024;
+        int64_t phys_pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGE_SIZE);
+        int64_t memory = phys_pages > 0 && page_size > 0 ? phys_pages * page_size : 0;
+        if (options.db_cache_mb >= 0)
+            db_options.cache_size = options.db_cache_mb * MiB;
+        else if (memory > 0)
+            db_options.cache_size = std::clamp(memory / 512, 2 * MiB, 64 * MiB);
+        db_options.mmap_size = options.db_mmap_mb >= 0 ? options.db_mmap_mb * MiB : memory / 4;
+        db_options.owner_quota = options.db_owner_quota_mb * MiB;
+        log::info(
+                logcat,
+                "Database page cache: {}MiB per connection; memory map: {}MiB",
+                db_options.cache_size / MiB,
+                db_options.mmap_size / MiB);
 
-        rpc::RateLimiter rate_limiter{*oxenmq_server};
+        snode::ServiceNode service_node{
+                me,
+                private_key,
+                oxenmq_server,
+                options.data_dir,
+                options.force_start,
+                db_options,
+                !options.no_bootstrap};
+
+        rpc::RequestHandler request_handler{
+                service_node,
+                channel_encryption,
+                private_key_ed25519,
+                static_cast<unsigned>(options.onion_threads),
+                std::chrono::milliseconds{options.shed_target_ms},
+                options.trace_sample_rate,
+                std::chrono::milliseconds{options.trace_slow_ms}};
+
+        rpc::RateLimiter rate_limiter{
+                *oxenmq_server,
+                {static_cast<uint32_t>(options.client_burst),
+                 static_cast<uint32_t>(options.client_rate_limit),
+                 rpc::RateLimiter::BUCKET_SIZE,
+                 rpc::RateLimiter::TOKEN_RATE_SN,
+                 static_cast<uint32_t>(options.max_rate_limited_clients)}};
 
         server::HTTPS https_server{
                 service_node,
@@ -164,26 +224,38 @@ int main(int argc, char* argv[]) {
                 ssl_cert,
                 ssl_key,
                 ssl_dh,
-                {me.pubkey_legacy, private_key}};
+                {me.pubkey_legacy, private_key},
+                static_cast<unsigned>(options.https_threads)};
 
         auto quic = std::make_unique<server::QUIC>(
                 service_node,
                 request_handler,
                 rate_limiter,
                 oxen::quic::Address{options.ip, options.omq_quic_port},
-                private_key_ed25519);
+                private_key_ed25519,
+                static_cast<unsigned>(options.quic_threads));
         service_node.register_mq_server(quic.get());
 
         auto http_client = std::make_shared<http::Client>(&quic->net());
         service_node.set_http_client(http_client);
         request_handler.set_http_client(http_client);
 
+        // Restore the monitor subscriptions we had before restarting (so that subscribers don't
+        // all have to be re-verified at once), and keep the saved copy reasonably fresh in case we
+        // don't get to shut down cleanly:
+        const auto monitors_file = options.data_dir / "monitors.bt";
+        oxenmq_server.load_monitors(monitors_file);
+
         oxenmq_server.init(
                 &service_node,
                 &request_handler,
                 &rate_limiter,
                 oxenmq::address{options.oxend_omq_rpc});
 
+        oxenmq_server->add_timer(
+                [&oxenmq_server, &monitors_file] { oxenmq_server.save_monitors(monitors_file); },
+                10min);
+
         quic->startup_endpoint();
 
         https_server.start();
@@ -207,7 +279,9 @@ int main(int argc, char* argv[]) {
 
         log::warning(logcat, "Received signal {}; shutting down...", signalled.load());
         http_client.reset();  // Kills outgoing requests and prevents new ones
+        request_handler.shutdown();
         service_node.shutdown();
+        oxenmq_server.save_monitors(monitors_file);
         log::info(logcat, "Stopping https server");
         https_server.shutdown(true);
         log::info(logcat, "Stopping quic server");
@@ -1,5 +1,6 @@
 #include "http_client.h"
 #include <curl/curl.h>
+#include <algorithm>
 #include <chrono>
 #include <oxen/log.hpp>
 #include <cpr/ssl_options.h>
@@ -112,6 +113,40 @@ int Client::handle_socket_c(
     return 0;
 }
 
+void Client::record_stats(CURL* easy, CURLcode result) {
+    stat_requests++;
+    long connects = 0, version = 0;
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &version);
+    if (version == CURL_HTTP_VERSION_2_0)
+        stat_http2++;
+    if (connects == 0) {
+        if (result == CURLE_OK)
+            stat_reused++;
+        return;
+    }
+    stat_new_conns += connects;
+
+    // Both of these are measured from the start of the request (including DNS resolution);
+    // appconnect is when the TLS handshake finished, and is 0 for plain http.
+    curl_off_t connect = 0, appconnect = 0;
+    curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+    int64_t us = std::max(connect, appconnect);
+    stat_connect_us += us;
+    auto max = stat_connect_max_us.load();
+    while (us > max && !stat_connect_max_us.compare_exchange_weak(max, us)) {}
+}
+
+Client::stats Client::get_stats() const {
+    return {stat_requests.load(),
+            stat_new_conns.load(),
+            stat_reused.load(),
+            stat_http2.load(),
+            stat_connect_us.load(),
+            stat_connect_max_us.load()};
+}
+
 void Client::check_multi_info() {
     int pending;
     while (CURLMsg* message = curl_multi_info_read(curl_multi, &pending)) {
@@ -119,14 +154,15 @@ void Client::check_multi_info() {
             cpr::Session* raw_sess;
             curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &raw_sess);
             assert(raw_sess);
+            record_stats(message->easy_handle, message->data.result);
             auto session = raw_sess->shared_from_this();
             assert(session);
             auto resp = session->Complete(message->data.result);
             auto it = active_reqs.find(session);
             assert(it != active_reqs.end());
-            if (it->second) {
+            if (it->second.cb) {
                 try {
-                    it->second(std::move(resp));
+                    it->second.cb(std::move(resp));
                 } catch (const std::exception& e) {
                     log::error(logcat, "HTTP response handler raised exception: {}", e.what());
                 }
@@ -152,12 +188,19 @@ Client::Client(oxen::quic::Network* loop_) :
     curl_multi_setopt(curl_multi, CURLMOPT_SOCKETFUNCTION, Client::handle_socket_c);
     curl_multi_setopt(curl_multi, CURLMOPT_TIMERDATA, this);
     curl_multi_setopt(curl_multi, CURLMOPT_TIMERFUNCTION, Client::start_timeout_c);
+
+    // The multi handle owns the connection cache, so completed requests leave their connections
+    // here for reuse by later requests to the same host.  (curl's default cache size scales with
+    // the number of active requests, which for us is usually small, so we set it explicitly).
+    curl_multi_setopt(curl_multi, CURLMOPT_MAXCONNECTS, MAX_CONNECTIONS);
+    curl_multi_setopt(curl_multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS);
+    curl_multi_setopt(curl_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
 }
 
 Client::~Client() {
     loop->call_get([this] {
         alive.reset();
-        for (auto& [session, cb] : active_reqs)
+        for (auto& [session, req] : active_reqs)
             curl_multi_remove_handle(curl_multi, session->GetCurlHolder()->handle);
         active_reqs.clear();
         curl_multi_cleanup(curl_multi);
@@ -171,7 +214,8 @@ void Client::post(
         std::string payload,
         std::chrono::milliseconds timeout,
         std::optional<std::string> host_override,
-        bool https_disable_validation) {
+        bool https_disable_validation,
+        bool keep_alive) {
     auto sess = std::make_shared<cpr::Session>();
     sess->SetUrl(std::move(url));
     cpr::Header header{
@@ -189,17 +233,34 @@ void Client::post(
     }
     sess->SetSslOptions(std::move(ssl_opts));
     sess->SetRedirect(cpr::Redirect{0L});
+    int64_t bytes = payload.size();
     sess->SetBody(std::move(payload));
-    curl_easy_setopt(sess->GetCurlHolder()->handle, CURLOPT_PRIVATE, sess.get());
     sess->PreparePost();
+    auto* easy = sess->GetCurlHolder()->handle;
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, sess.get());
+    // Use HTTP/2 if the remote offers it during the TLS handshake (falling back to 1.1 otherwise);
+    // with PIPEWAIT concurrent requests to a host still connecting wait to see if they can share
+    // its connection rather than immediately opening another one.
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    if (keep_alive) {
+        curl_easy_setopt(easy, CURLOPT_MAXAGE_CONN, static_cast<long>(IDLE_TIMEOUT.count()));
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    } else {
+        curl_easy_setopt(easy, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 1L);
+    }
     loop->call([this,
                 alive = std::weak_ptr{alive},
                 sess = std::move(sess),
-                cb = std::move(cb)]() mutable {
+                cb = std::move(cb),
+                bytes]() mutable {
         if (alive.expired())
             return;  // this got destroyed before we got into the call
+        static auto& payload_memory = util::get_memory_counter("http_client");
         curl_multi_add_handle(curl_multi, sess->GetCurlHolder()->handle);
-        active_reqs.emplace(std::move(sess), std::move(cb));
+        active_reqs.emplace(
+                std::move(sess), active_request{std::move(cb), {payload_memory, bytes}});
     });
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
@@ -10,14 +12,30 @@
 #include <cpr/session.h>
 #include <curl/curl.h>
 #include <oxen/quic/network.hpp>
+#include <oxenss/utils/memory.hpp>
 
 namespace oxenss::http {
 
 /// Async client for making outbound storage server HTTP post requests.
+///
+/// Connections are kept open after a request completes and reused by later requests to the same
+/// host (and, when the remote supports HTTP/2, shared by concurrent requests), which saves the TCP
+/// and TLS handshakes when relaying to the same few onion request destinations.
 class Client {
   public:
     using response_callback = std::function<void(cpr::Response r)>;
 
+    // Maximum number of connections we keep open (idle or not) across all hosts; beyond this the
+    // least recently used idle connection gets closed.
+    static constexpr long MAX_CONNECTIONS = 64;
+
+    // Maximum number of simultaneous connections to any single host; further requests to the host
+    // wait for (or, with HTTP/2, are multiplexed onto) an existing connection.
+    static constexpr long MAX_HOST_CONNECTIONS = 8;
+
+    // How long an idle connection remains eligible for reuse.
+    static constexpr std::chrono::seconds IDLE_TIMEOUT{60};
+
     // Starts a new client, attaching itself to the event loop and ready for requests.
     explicit Client(oxen::quic::Network* loop);
 
@@ -33,13 +51,30 @@ class Client {
     // Initiates a new POST request.  When the request complete (or times out) `cb` will be invoked
     // with the cpr::Response object.  Note that cb is invoked inside the event loop context, so it
     // should try to be fast and definitely not do anything blocking.
+    //
+    // If `keep_alive` is false the request always uses a new connection, and closes it when done,
+    // rather than using (and taking up space in) the connection pool; this is for requests, such as
+    // reachability tests, that go to many different hosts or need to test opening a connection.
     void post(
             response_callback cb,
             std::string url,
             std::string payload,
             std::chrono::milliseconds timeout,
             std::optional<std::string> host_override = std::nullopt,
-            bool https_disable_validation = false);
+            bool https_disable_validation = false,
+            bool keep_alive = true);
+
+    struct stats {
+        int64_t requests;         // completed (successfully or not) requests
+        int64_t new_connections;  // requests that had to establish a new connection
+        int64_t reused;           // successful requests that reused an already-open connection
+        int64_t http2;            // requests made over HTTP/2
+        int64_t connect_us;       // total TCP+TLS connection setup time of new connections
+        int64_t connect_max_us;   // slowest connection setup
+    };
+
+    // Returns the connection reuse statistics.  May be called from any thread.
+    stats get_stats() const;
 
   private:
     // FIXME: in future (dev, as of writing) versions of libquic we should a shared_ptr<Loop>
@@ -52,7 +87,21 @@ class Client {
     event* ev_timeout;
     std::shared_ptr<const bool> alive = std::make_shared<bool>(true);
     CURLM* curl_multi;
-    std::unordered_map<std::shared_ptr<cpr::Session>, response_callback> active_reqs;
+    struct active_request {
+        response_callback cb;
+        util::tracked_memory payload;  // the request body, counted while the request is active
+    };
+    std::unordered_map<std::shared_ptr<cpr::Session>, active_request> active_reqs;
+
+    std::atomic<int64_t> stat_requests = 0;
+    std::atomic<int64_t> stat_new_conns = 0;
+    std::atomic<int64_t> stat_reused = 0;
+    std::atomic<int64_t> stat_http2 = 0;
+    std::atomic<int64_t> stat_connect_us = 0;
+    std::atomic<int64_t> stat_connect_max_us = 0;
+
+    // Updates the connection stats with the details of a completed request
+    void record_stats(CURL* easy, CURLcode result);
 
     friend struct curl_context;
 
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <filesystem>
+#include <type_traits>
+#include <utility>
 
+#include <fmt/format.h>
 #include <oxen/log.hpp>
 
 namespace oxenss {
@@ -12,4 +15,37 @@ namespace oxenss::logging {
 
 void init(const std::filesystem::path& data_dir, oxen::log::Level log_level);
 
+// Returns true if log statements of the given level are enabled for the category, for guarding
+// log statements (or groups of them) that need extra work to produce their arguments.
+template <typename Category>
+bool enabled(const Category& cat, oxen::log::Level level) {
+    return cat->level() <= level;
+}
+
+// Log arguments are evaluated before the log call gets to check whether the category is enabled,
+// so expensive arguments (encoding a message body, dumping json, etc.) on hot paths should be
+// wrapped with lazy(), which defers calling `f` until (and unless) the statement is formatted:
+//
+//     log::trace(logcat, "Storing message: {}", logging::lazy([&] { return to_base64(data); }));
+template <typename F>
+struct lazy_arg {
+    F f;
+};
+
+template <typename F>
+lazy_arg<std::decay_t<F>> lazy(F&& f) {
+    return {std::forward<F>(f)};
+}
+
 }  // namespace oxenss::logging
+
+namespace fmt {
+template <typename F>
+struct formatter<oxenss::logging::lazy_arg<F>>
+        : formatter<std::decay_t<std::invoke_result_t<const F&>>> {
+    template <typename FormatContext>
+    auto format(const oxenss::logging::lazy_arg<F>& arg, FormatContext& ctx) const {
+        return formatter<std::decay_t<std::invoke_result_t<const F&>>>::format(arg.f(), ctx);
+    }
+};
+}  // namespace fmt
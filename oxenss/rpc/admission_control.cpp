@@ -0,0 +1,68 @@
+#include "admission_control.h"
+
+#include <oxenss/logging/oxen_logger.h>
+
+namespace oxenss::rpc {
+
+static auto logcat = log::Cat("rpc");
+
+std::string_view to_string(request_class c) {
+    switch (c) {
+        case request_class::sn_critical: return "sn";
+        case request_class::client_write: return "write";
+        case request_class::client_read: return "read";
+        case request_class::onion: return "onion";
+    }
+    return "unknown";
+}
+
+AdmissionControl::AdmissionControl(std::chrono::milliseconds target) :
+        target_us_{std::chrono::microseconds{target}.count()} {}
+
+request_class AdmissionControl::classify(std::string_view endpoint) {
+    for (auto write :
+         {"store"sv,
+          "delete"sv,
+          "delete_all"sv,
+          "delete_before"sv,
+          "expire"sv,
+          "expire_all"sv,
+          "revoke_subaccount"sv,
+          "unrevoke_subaccount"sv,
+          "batch"sv,
+          "sequence"sv,
+          "ifelse"sv})
+        if (endpoint == write)
+            return request_class::client_write;
+    return request_class::client_read;
+}
+
+void AdmissionControl::observe_wait(std::chrono::microseconds wait) {
+    // Exponentially weighted moving average, weighting each new observation at 1/8
+    auto delay = delay_us_.load(std::memory_order_relaxed);
+    while (!delay_us_.compare_exchange_weak(
+            delay, delay + (wait.count() - delay) / 8, std::memory_order_relaxed))
+        ;
+}
+
+bool AdmissionControl::admit(request_class c) {
+    if (c == request_class::sn_critical || target_us_ == 0)
+        return true;
+    int64_t limit = target_us_;
+    if (c == request_class::client_write)
+        limit *= 4;
+    else if (c == request_class::client_read)
+        limit *= 2;
+    auto delay = delay_us_.load(std::memory_order_relaxed);
+    if (delay <= limit)
+        return true;
+    if (shed_[static_cast<size_t>(c)].fetch_add(1, std::memory_order_relaxed) % 1000 == 0)
+        log::warning(
+                logcat,
+                "Overloaded (queue delay {}ms): shedding {} requests",
+                delay / 1000,
+                to_string(c));
+    return false;
+}
+
+}  // namespace oxenss::rpc
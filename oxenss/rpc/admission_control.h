@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace oxenss::rpc {
+
+using namespace std::literals;
+
+// The priority classes of incoming requests, from most to least important.
+enum class request_class {
+    sn_critical,   // other service nodes' requests: storage tests, pings, replication
+    client_write,  // client requests that change stored data (store, delete, expire, ...)
+    client_read,   // other client requests (retrieve, info, get_swarm, ...)
+    onion,         // onion requests (both relayed and for us)
+};
+
+inline constexpr size_t NUM_REQUEST_CLASSES = 4;
+
+// Returns the name of the class as used in stats ("sn", "write", "read", "onion").
+std::string_view to_string(request_class c);
+
+// Admission control for incoming requests.  Failing storage tests and reachability checks gets us
+// decommissioned, so being swamped by client and onion traffic must not hold up the service node
+// traffic that shares our threads with it.  SN-critical requests therefore get capacity of their
+// own (they are handled in OxenMQ's "sn" category, which client requests never use), and when
+// requests start queueing for longer than the target delay we shed the lowest priority work at
+// the door, with a 503 telling the client when to retry, rather than letting it queue.
+//
+// The queue delay is a moving average of how long requests (and the OMQ queue probes) waited
+// before a thread started on them.  Onion requests are shed once it exceeds the target, client
+// reads at twice the target, and client writes at four times it; SN-critical requests are never
+// shed.
+class AdmissionControl {
+  public:
+    static constexpr auto DEFAULT_TARGET = 100ms;
+
+    // How long shed clients are told to wait before retrying.
+    static constexpr auto RETRY_AFTER = 5s;
+
+    // A target of 0 disables shedding.
+    explicit AdmissionControl(std::chrono::milliseconds target = DEFAULT_TARGET);
+
+    // Returns the class of a client rpc request by endpoint name (e.g. "store" is a client write).
+    // Batch requests count as writes, as they can contain writes.
+    static request_class classify(std::string_view endpoint);
+
+    // Records how long a request waited in a queue before we started handling it.
+    void observe_wait(std::chrono::microseconds wait);
+
+    // Returns true if a request of the given class should be handled, false (counting it as shed)
+    // if it should be refused instead.
+    bool admit(request_class c);
+
+    // Returns the current (smoothed) queue delay.
+    std::chrono::microseconds queue_delay() const {
+        return std::chrono::microseconds{delay_us_.load(std::memory_order_relaxed)};
+    }
+
+    // Returns the number of requests of the given class shed so far.
+    int64_t shed(request_class c) const {
+        return shed_[static_cast<size_t>(c)].load(std::memory_order_relaxed);
+    }
+
+  private:
+    const int64_t target_us_;
+    std::atomic<int64_t> delay_us_ = 0;
+    std::array<std::atomic<int64_t>, NUM_REQUEST_CLASSES> shed_{};
+};
+
+}  // namespace oxenss::rpc
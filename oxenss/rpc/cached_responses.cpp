@@ -0,0 +1,131 @@
+#include "cached_responses.h"
+
+#include <oxenss/server/utils.h>
+#include <oxenss/utils/string_utils.hpp>
+#include <oxenss/version.h>
+
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+#include <oxenc/base32z.h>
+#include <oxenc/bt_serialize.h>
+
+namespace oxenss::rpc {
+
+using nlohmann::json;
+
+json swarm_to_json(const snode::SwarmInfo* swarm) {
+    if (!swarm)
+        return json{
+                {"snodes", json::array()},
+                {"swarm", util::int_to_string(snode::INVALID_SWARM_ID, 16)},
+        };
+    json snodes_json = json::array();
+    for (const auto& sn : swarm->snodes) {
+        snodes_json.push_back(
+                json{{"address",  // Deprecated, use pubkey_legacy instead
+                      oxenc::to_base32z(sn.pubkey_legacy.view()) + ".snode"},
+                     {"pubkey_legacy", sn.pubkey_legacy.hex()},
+                     {"pubkey_x25519", sn.pubkey_x25519.hex()},
+                     {"pubkey_ed25519", sn.pubkey_ed25519.hex()},
+                     {"port",  // Deprecated string port for backwards compat; prefer https_port
+                      std::to_string(sn.port)},
+                     {"port_https", sn.port},
+                     {"port_omq", sn.omq_quic_port},
+                     {"port_quic", sn.omq_quic_port},
+                     {"ip", sn.ip}});
+    }
+
+    return json{
+            {"snodes", std::move(snodes_json)},
+            {"swarm", util::int_to_string(swarm->swarm_id, 16)},
+    };
+}
+
+namespace {
+
+    void append_hf(std::string& out, bool bt, std::pair<int, int> hf) {
+        if (bt)
+            fmt::format_to(std::back_inserter(out), "2:hfli{}ei{}ee", hf.first, hf.second);
+        else
+            fmt::format_to(std::back_inserter(out), "\"hf\":[{},{}],", hf.first, hf.second);
+    }
+
+}  // namespace
+
+CachedResponses::encoded CachedResponses::encode_fields(json j) {
+    encoded e;
+    e.json = j.dump();
+    e.bt = oxenc::bt_serialize(json_to_bt(std::move(j)));
+    // Strip off the outer `{...}` or `d...e`, to be replaced by `wrap()`:
+    e.json = e.json.substr(1, e.json.size() - 2);
+    e.bt = e.bt.substr(1, e.bt.size() - 2);
+    return e;
+}
+
+CachedResponses::CachedResponses() {
+    version_ = encode_fields(json{{"version", STORAGE_SERVER_VERSION}});
+    update_swarms(nullptr);
+}
+
+void CachedResponses::update_swarms(std::shared_ptr<const snode::Swarm> swarm) {
+    auto table = std::make_shared<swarm_table>();
+    table->none = encode_fields(swarm_to_json(nullptr));
+    if (swarm)
+        for (auto& s : swarm->all_valid_swarms())
+            table->swarms.emplace(s.swarm_id, encode_fields(swarm_to_json(&s)));
+    table->swarm = std::move(swarm);
+
+    std::shared_ptr<const swarm_table> ctable = std::move(table);
+#ifdef __cpp_lib_atomic_shared_ptr
+    swarms_.store(std::move(ctable));
+#else
+    std::atomic_store(&swarms_, std::move(ctable));
+#endif
+}
+
+std::string CachedResponses::wrap(
+        const encoded& fields, bool bt, std::pair<int, int> hf, int64_t t) {
+    const auto& f = bt ? fields.bt : fields.json;
+    std::string out;
+    out.reserve(f.size() + 48);
+    out += bt ? 'd' : '{';
+    append_hf(out, bt, hf);
+    out += f;
+    if (bt)
+        fmt::format_to(std::back_inserter(out), "1:ti{}ee", t);
+    else
+        fmt::format_to(std::back_inserter(out), ",\"t\":{}}}", t);
+    return out;
+}
+
+std::string CachedResponses::get_swarm(
+        const user_pubkey& pk, bool bt, std::pair<int, int> hf, int64_t t) const {
+#ifdef __cpp_lib_atomic_shared_ptr
+    auto table = swarms_.load();
+#else
+    auto table = std::atomic_load(&swarms_);
+#endif
+    const encoded* fields = &table->none;
+    if (table->swarm)
+        if (auto* info = table->swarm->get_swarm(pk))
+            if (auto it = table->swarms.find(info->swarm_id); it != table->swarms.end())
+                fields = &it->second;
+    return wrap(*fields, bt, hf, t);
+}
+
+std::string CachedResponses::info(bool bt, std::pair<int, int> hf, int64_t t) const {
+    const auto& v = bt ? version_.bt : version_.json;
+    std::string out;
+    out.reserve(v.size() + 80);
+    out += bt ? 'd' : '{';
+    append_hf(out, bt, hf);
+    if (bt)
+        fmt::format_to(std::back_inserter(out), "1:ti{}e9:timestampi{}e", t, t);
+    else
+        fmt::format_to(std::back_inserter(out), "\"t\":{},\"timestamp\":{},", t, t);
+    out += v;
+    out += bt ? 'e' : '}';
+    return out;
+}
+
+}  // namespace oxenss::rpc
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <oxenss/crypto/keys.h>
+#include <oxenss/snode/swarm.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace oxenss::rpc {
+
+// Returns the json `get_swarm` details (i.e. "snodes" and "swarm") of the given swarm, or of an
+// invalid, empty swarm if `swarm` is nullptr.
+nlohmann::json swarm_to_json(const snode::SwarmInfo* swarm);
+
+// Pre-encoded response bodies for `get_swarm` and `info`.  These are both very frequently called
+// (clients call get_swarm on every path refresh) but their answers only change with a swarm
+// update, so we encode the swarm details of every swarm (as both json and bt) once per swarm
+// update, and serving a request then only has to splice the current time and hardfork in around
+// them.  The output is byte-for-byte the same as dumping (or `bt_serialize(json_to_bt(...))`-ing)
+// the json responses would produce.
+class CachedResponses {
+  public:
+    CachedResponses();
+
+    // Rebuilds the cached swarm responses from a new swarm snapshot.
+    void update_swarms(std::shared_ptr<const snode::Swarm> swarm);
+
+    // Returns the encoded `get_swarm` response for `pk`, as of the last update_swarms().
+    std::string get_swarm(const user_pubkey& pk, bool bt, std::pair<int, int> hf, int64_t t) const;
+
+    // Returns the encoded `info` response.
+    std::string info(bool bt, std::pair<int, int> hf, int64_t t) const;
+
+  private:
+    // The encoded response fields that don't change between requests, without the enclosing
+    // `{...}` (json) or `d...e` (bt).
+    struct encoded {
+        std::string json;
+        std::string bt;
+    };
+
+    struct swarm_table {
+        std::shared_ptr<const snode::Swarm> swarm;
+        std::unordered_map<snode::swarm_id_t, encoded> swarms;
+        encoded none;  // for when there are no swarms at all
+    };
+
+#ifdef __cpp_lib_atomic_shared_ptr
+    std::atomic<std::shared_ptr<const swarm_table>> swarms_;
+#else
+    std::shared_ptr<const swarm_table> swarms_;
+#endif
+
+    // The "version" field of the info response
+    encoded version_;
+
+    // Encodes a json object as both json and bt, without its outer braces.
+    static encoded encode_fields(nlohmann::json j);
+
+    // Wraps swarm `fields` in the alphabetically surrounding "hf" and "t" fields.
+    static std::string wrap(const encoded& fields, bool bt, std::pair<int, int> hf, int64_t t);
+};
+
+}  // namespace oxenss::rpc
@@ -1,6 +1,7 @@
 #include "client_rpc_endpoints.h"
 #include "request_handler.h"
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/base64.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/version.h>
@@ -493,7 +494,7 @@ static void load(store& s, Dict& d) {
             throw parse_error{fmt::format(
                     "Message body exceeds maximum allowed length of {} bytes",
                     store::MAX_MESSAGE_BODY)};
-        s.data = oxenc::from_base64(*data);
+        s.data = util::from_base64(*data);
     } else {
         // Otherwise (i.e. bencoded) then we take data as bytes
         if (data->size() > store::MAX_MESSAGE_BODY)
@@ -534,8 +535,9 @@ static void load(retrieve& r, Dict& d) {
           sig,
           subacc,
           subacc_sig,
-          ts] =
-            load_fields<Str, Str, int, int, namespace_id, Str, Str, SV, SV, SV, SV, TP>(
+          ts,
+          wait] =
+            load_fields<Str, Str, int, int, namespace_id, Str, Str, SV, SV, SV, SV, TP, int>(
                     d,
                     "lastHash",
                     "last_hash",
@@ -548,7 +550,8 @@ static void load(retrieve& r, Dict& d) {
                     "signature",
                     "subaccount",
                     "subaccount_sig",
-                    "timestamp");
+                    "timestamp",
+                    "wait");
 
     require_exactly_one_of("pubkey", pubkey, "pubKey", pubKey, true);
     auto& pk = pubkey ? pubkey : pubKey;
@@ -581,6 +584,12 @@ static void load(retrieve& r, Dict& d) {
 
     r.max_count = max_count;
     r.max_size = max_size;
+
+    if (wait) {
+        if (*wait < 0)
+            throw parse_error{"Invalid wait: must not be negative"};
+        r.wait = std::chrono::milliseconds{*wait};
+    }
 }
 void retrieve::load_from(json params) {
     load(*this, params);
@@ -589,6 +598,50 @@ void retrieve::load_from(bt_dict_consumer params) {
     load(*this, params);
 }
 
+template <typename Dict>
+static void load(poll& p, Dict& d) {
+    auto [last_hashes, namespaces, pubkey, pk_ed25519, sig, subacc, subacc_sig, timestamp] =
+            load_fields<Vec<Str>, Vec<int>, Str, SV, SV, SV, SV, TP>(
+                    d,
+                    "last_hashes",
+                    "namespaces",
+                    "pubkey",
+                    "pubkey_ed25519",
+                    "signature",
+                    "subaccount",
+                    "subaccount_sig",
+                    "timestamp");
+
+    load_pk_signature(p, d, pubkey, pk_ed25519, sig);
+    load_subaccount(p, d, subacc, subacc_sig);
+    require("timestamp", timestamp);
+    p.timestamp = *timestamp;
+    require("namespaces", namespaces);
+    require("last_hashes", last_hashes);
+    if (namespaces->empty())
+        throw parse_error{"namespaces must contain at least one namespace"};
+    if (namespaces->size() > POLL_MAX_NAMESPACES)
+        throw parse_error{fmt::format(
+                "too many namespaces: at most {} may be polled at once", POLL_MAX_NAMESPACES)};
+    if (last_hashes->size() != namespaces->size())
+        throw parse_error{"last_hashes must be the same length as namespaces"};
+    for (auto ns : *namespaces) {
+        if (ns < NAMESPACE_MIN || ns > NAMESPACE_MAX)
+            throw parse_error{"Invalid namespace: value out of range"};
+        p.namespaces.push_back(static_cast<namespace_id>(ns));
+    }
+    for (auto& h : *last_hashes)
+        if (!h.empty() && !(h.size() == 43 && oxenc::is_base64(h)))
+            throw parse_error{"Invalid last hash: expected base64 (43 chars)"};
+    p.last_hashes = std::move(*last_hashes);
+}
+void poll::load_from(json params) {
+    load(*this, params);
+}
+void poll::load_from(bt_dict_consumer params) {
+    load(*this, params);
+}
+
 static bool is_valid_message_hash(std::string_view hash) {
     return (hash.size() == 43 && oxenc::is_base64(hash));
 }
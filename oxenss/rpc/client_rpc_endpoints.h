@@ -3,6 +3,7 @@
 #include <array>
 #include <chrono>
 #include <cstddef>
+#include <memory>
 #include <optional>
 #include <stdexcept>
 #include <string>
@@ -34,6 +35,8 @@ struct parse_error : std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+class RequestTrace;
+
 // Common base type decorator of all client rpc endpoint types.
 struct endpoint {
     // Loads the rpc request from json.  Throws on error (missing keys, bad values, etc.).
@@ -43,6 +46,16 @@ struct endpoint {
     bool b64 = true;  // True if we need to base64-encode values (i.e. for json); false if we
                       // can deal with binary (i.e. bt-encoded)
 
+    // True if the handler may return its response already serialized (as an `encoded_body`: json
+    // if `b64` is set, bt-encoded otherwise) for the transport to send back as-is.  This is set
+    // for top-level requests, but not for subrequests, whose results get embedded into the
+    // containing request's json response.
+    bool encoded_response = false;
+
+    // The phase trace of the request, if it is being traced (see RequestTracer).  Only set for
+    // top-level requests.
+    std::shared_ptr<RequestTrace> trace;
+
     virtual ~endpoint() = default;
 };
 
@@ -63,6 +76,10 @@ struct no_args : endpoint {
 /// - "reason": a reason string, e.g. propagating a thrown exception messages
 /// - "bad_peer_response": true if the peer returned an unparsable response
 /// - "query_failure": true if the database failed to perform the query
+/// - "too_busy": true if the swarm member already had too many queued database jobs for the
+///   account; the request can be retried later
+/// - "quota_exceeded": true if a store was refused because the account is at the swarm member's
+///   per-account storage quota
 struct recursive : endpoint {
     // True on the initial client request, false on forwarded requests
     bool recurse;
@@ -207,6 +224,10 @@ struct store final : recursive {
 ///   fractions that add up to <= 1.  For example, -2 on a large mailbox (for 1/2 the limit) and
 ///   -10 on five smaller mailboxes so that that maximum returned data is 1/2 + 5*(1/10) = 1.
 ///
+///   Retrieves for the same pubkey within a single batch are processed together and their combined
+///   size is also capped at the network maximum: if the fractions add up to more than 1 then the
+///   later retrieves in the batch get truncated (with "more" set to true).
+///
 ///   When both `max_count` and `max_size` are specified then the returned message count will not
 ///   exceed either limit.
 ///
@@ -217,6 +238,17 @@ struct store final : recursive {
 ///   Note that regardless of the two values the response will always include at least one message,
 ///   even if it would exceed the given maximum size.
 ///
+/// - `wait` (optional) if there are no messages newer than `last_hash`, wait up to this long (in
+///   milliseconds) for one to arrive before replying, rather than replying immediately with an
+///   empty message list.  Waits longer than 30 seconds are capped to 30 seconds.  The request is
+///   answered as soon as a new message for the account and namespace is stored, or with an empty
+///   message list once the wait expires.  When the node is already holding the maximum number of
+///   waiting requests (or the account's share of it) the request is answered immediately, and so
+///   clients must be prepared for empty responses before the wait is over.  This is only honoured
+///   for top-level requests, and is ignored inside `batch`/`sequence` subrequests.  Note that when
+///   making the request through an onion request the wait must be kept short enough to complete
+///   within the onion request timeout.
+///
 /// Authentication parameters: these are optional during a transition period, up until Oxen
 /// hard-fork 19, and become required starting there.  During the transition period, *if* provided
 /// then the request will be denied if the signature does not match.  If omitted, during the
@@ -253,6 +285,7 @@ struct retrieve final : endpoint {
     std::optional<std::string> last_hash;
     std::optional<int> max_count;
     std::optional<int> max_size;
+    std::chrono::milliseconds wait{0};
 
     bool check_signature = false;  // For transition; delete this once we require sigs always
     std::optional<std::array<unsigned char, 32>> pubkey_ed25519;
@@ -263,6 +296,43 @@ struct retrieve final : endpoint {
     void load_from(oxenc::bt_dict_consumer params) override;
 };
 
+/// Checks which of several namespaces have messages newer than a given last hash, without
+/// retrieving them.  This is much cheaper than a retrieve (it doesn't load any message data), and
+/// is intended for clients that poll many namespaces to find out which ones need a retrieve.
+///
+/// Takes parameters of:
+/// - `pubkey` -- the account, in hex (66) or bytes (33).
+/// - `pubkey_ed25519` -- see `retrieve`.
+/// - `subaccount`/`subaccount_sig` (optional) see description in `store`.  Only subaccount tokens
+///   with the read bit set may invoke this method.
+/// - `namespaces` -- list of the integral namespaces to check (at most 32).
+/// - `last_hashes` -- list of the same length as `namespaces` of the last hash the client has for
+///   each of them, as for the `last_hash` value of a `retrieve`.  An empty string means the client
+///   has no messages from that namespace.
+/// - `timestamp` -- the timestamp at which this request was initiated, in milliseconds since unix
+///   epoch; must be within ±60s of the current time.
+/// - `signature` -- Ed25519 signature of ("poll" || timestamp || NAMESPACES), where NAMESPACES is
+///   the comma-separated list of requested namespaces, in request order (e.g. "0,5,-10").  Must be
+///   base64 encoded for json requests; binary for OMQ requests.
+///
+/// Returns a dict containing key "counts" with a list, in the same order as `namespaces`, of the
+/// number of messages that a `retrieve` from that namespace with the given last hash would return
+/// (if it were not limited in size or count).
+struct poll final : endpoint {
+    static constexpr auto names() { return NAMES("poll"); }
+
+    user_pubkey pubkey;
+    std::optional<std::array<unsigned char, 32>> pubkey_ed25519;
+    std::optional<signed_subaccount_token> subaccount;
+    std::vector<namespace_id> namespaces;
+    std::vector<std::string> last_hashes;
+    std::chrono::system_clock::time_point timestamp;
+    std::array<unsigned char, 64> signature;
+
+    void load_from(nlohmann::json params) override;
+    void load_from(oxenc::bt_dict_consumer params) override;
+};
+
 /// Retrieves status information about this storage server.  Takes no parameters.
 ///
 /// Returns:
@@ -731,6 +801,7 @@ using client_rpc_subrequests = type_list<
         unrevoke_subaccount,
         store,
         retrieve,
+        poll,
         delete_msgs,
         delete_all,
         delete_before,
@@ -0,0 +1,114 @@
+#include "onion_crypto_pool.h"
+
+#include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/memory.hpp>
+
+#include <algorithm>
+#include <exception>
+
+namespace oxenss::rpc {
+
+static auto logcat = log::Cat("rpc");
+
+OnionCryptoPool::OnionCryptoPool(unsigned threads, size_t max_queue) : max_queue_{max_queue} {
+    if (threads > 0)
+        threads = std::clamp(std::thread::hardware_concurrency(), 1u, threads);
+    threads_.reserve(threads);
+    for (unsigned i = 0; i < threads; i++)
+        threads_.emplace_back([this] { run(); });
+}
+
+OnionCryptoPool::~OnionCryptoPool() {
+    shutdown();
+}
+
+void OnionCryptoPool::submit(stage s, std::function<void()> job, std::function<void()> shed) {
+    {
+        std::lock_guard lock{mutex_};
+        if (!stopping_ && !threads_.empty()) {
+            if (jobs_.size() < max_queue_) {
+                jobs_.push_back({s, std::chrono::steady_clock::now(), std::move(job)});
+                cv_.notify_one();
+                return;
+            }
+            if (shed) {
+                stats_[static_cast<size_t>(s)].shed++;
+                job = nullptr;
+            }
+        }
+    }
+    if (job)
+        run_job(s, job, std::chrono::microseconds{0});
+    else
+        shed();
+}
+
+void OnionCryptoPool::shutdown() {
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_)
+        if (t.joinable())
+            t.join();
+    threads_.clear();
+}
+
+void OnionCryptoPool::run_job(
+        stage s, const std::function<void()>& f, std::chrono::microseconds waited) {
+    auto& st = stats_[static_cast<size_t>(s)];
+    st.jobs++;
+    st.wait_us += waited.count();
+    auto max = st.max_wait_us.load();
+    while (waited.count() > max && !st.max_wait_us.compare_exchange_weak(max, waited.count())) {}
+
+    auto started = std::chrono::steady_clock::now();
+    try {
+        f();
+    } catch (const std::exception& e) {
+        log::error(
+                logcat,
+                "Uncaught exception in onion {} job: {}",
+                s == stage::decrypt ? "decrypt" : "encrypt",
+                e.what());
+    }
+    st.run_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - started)
+                         .count();
+}
+
+void OnionCryptoPool::run() {
+    // Onion payloads (and their decrypted copies) come in bursts, and are short-lived.
+    util::use_memory_arena("onion");
+    std::unique_lock lock{mutex_};
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty())
+            return;  // Stopping, and we've finished off the queue
+        auto j = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+        run_job(j.s,
+                j.f,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - j.queued));
+        lock.lock();
+    }
+}
+
+OnionCryptoPool::stage_stats OnionCryptoPool::get_stats(stage s) const {
+    auto& st = stats_[static_cast<size_t>(s)];
+    return {st.jobs.load(),
+            st.shed.load(),
+            st.wait_us.load(),
+            st.max_wait_us.load(),
+            st.run_us.load()};
+}
+
+size_t OnionCryptoPool::queued() const {
+    std::lock_guard lock{mutex_};
+    return jobs_.size();
+}
+
+}  // namespace oxenss::rpc
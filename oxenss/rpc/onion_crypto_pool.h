@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace oxenss::rpc {
+
+// Threads for the cryptographic work of onion requests: decrypting incoming onion layers (an
+// x25519 key exchange plus a symmetric decryption of the whole payload) and encrypting the
+// responses to onion requests for which we are the final destination.  This is the heaviest CPU
+// work we do, and doing it directly on the thread that received the request (an oxenmq worker, or
+// an https or quic handler) lets heavy onion traffic starve everything else handled there.
+//
+// Both stages share one queue and set of threads.  Once `max_queue` jobs are waiting new decrypt
+// jobs are shed (i.e. refused, so that the request gets an immediate error instead of queueing
+// indefinitely), while encrypt jobs, for requests we have already done the work for, run on the
+// calling thread instead.
+class OnionCryptoPool {
+  public:
+    // Default (and maximum) number of threads; we use fewer on machines with fewer cores.
+    static constexpr unsigned DEFAULT_THREADS = 4;
+
+    // Default queue depth beyond which we start shedding decrypt jobs.
+    static constexpr size_t DEFAULT_MAX_QUEUE = 2000;
+
+    enum class stage { decrypt, encrypt };
+
+    // Starts the pool.  With 0 threads everything is run directly on the submitting thread.
+    explicit OnionCryptoPool(
+            unsigned threads = DEFAULT_THREADS, size_t max_queue = DEFAULT_MAX_QUEUE);
+
+    // Calls shutdown().
+    ~OnionCryptoPool();
+
+    OnionCryptoPool(const OnionCryptoPool&) = delete;
+    OnionCryptoPool& operator=(const OnionCryptoPool&) = delete;
+
+    // Queues a job for one of the pool threads.  If the queue is full and `shed` is given then the
+    // job is dropped and `shed` is invoked (on the calling thread) instead; without `shed` the job
+    // is run on the calling thread.  Jobs are also run on the calling thread after shutdown(), or
+    // if the pool has no threads.
+    void submit(stage s, std::function<void()> job, std::function<void()> shed = nullptr);
+
+    // Runs whatever jobs are still queued, then stops and joins the pool threads.
+    void shutdown();
+
+    struct stage_stats {
+        int64_t jobs;         // jobs run so far (including any run on the calling thread)
+        int64_t shed;         // jobs refused because the queue was full
+        int64_t wait_us;      // total time that queued jobs spent waiting, in microseconds
+        int64_t max_wait_us;  // longest time any job spent waiting, in microseconds
+        int64_t run_us;       // total time spent running jobs, in microseconds
+    };
+
+    stage_stats get_stats(stage s) const;
+
+    // Returns the number of jobs currently waiting for a thread.
+    size_t queued() const;
+
+  private:
+    struct job {
+        stage s;
+        std::chrono::steady_clock::time_point queued;
+        std::function<void()> f;
+    };
+
+    struct stage_counters {
+        std::atomic<int64_t> jobs = 0;
+        std::atomic<int64_t> shed = 0;
+        std::atomic<int64_t> wait_us = 0;
+        std::atomic<int64_t> max_wait_us = 0;
+        std::atomic<int64_t> run_us = 0;
+    };
+
+    const size_t max_queue_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<job> jobs_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+    std::array<stage_counters, 2> stats_;
+
+    // Runs a job, updating the stage's stats.
+    void run_job(stage s, const std::function<void()>& f, std::chrono::microseconds waited);
+
+    void run();
+};
+
+}  // namespace oxenss::rpc
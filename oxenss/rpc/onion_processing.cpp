@@ -13,6 +13,16 @@ namespace oxenss::rpc {
 
 static auto logcat = log::Cat("rpc");
 
+namespace {
+    // Extracts the (size `n`) ciphertext from a combined payload by trimming it in place, which
+    // reuses the payload's buffer rather than allocating and copying into a new string.
+    std::string take_ciphertext(std::string payload, size_t n) {
+        payload.erase(0, 4);
+        payload.resize(n);
+        return payload;
+    }
+}  // namespace
+
 ParsedInfo process_inner_request(std::string plaintext) {
 
     ParsedInfo ret;
@@ -24,12 +34,14 @@ ParsedInfo process_inner_request(std::string plaintext) {
         /// to identify we are the final destination...
         if (inner_json.count("headers")) {
             log::trace(logcat, "Found body: <{}>", ciphertext);
-            auto& [body, json, b64] = ret.emplace<FinalDestinationInfo>();
-            body = std::move(ciphertext);
+            auto& [body, json, b64, bt] = ret.emplace<FinalDestinationInfo>();
+            body = take_ciphertext(std::move(plaintext), ciphertext.size());
             if (auto it = inner_json.find("json"); it != inner_json.end())
                 json = it->get<bool>();
             if (auto it = inner_json.find("base64"); it != inner_json.end())
                 b64 = it->get<bool>();
+            if (auto it = inner_json.find("bt"); it != inner_json.end())
+                bt = it->get<bool>();
         } else if (auto it = inner_json.find("host"); it != inner_json.end()) {
             auto& [payload, host, port, protocol, target] = ret.emplace<RelayToServerInfo>();
 
@@ -78,7 +90,7 @@ ParsedInfo process_inner_request(std::string plaintext) {
                 protocol = "https";
         } else {
             auto& [ctext, eph_key, enc_type, next] = ret.emplace<RelayToNodeInfo>();
-            ctext = std::move(ciphertext);
+            ctext = take_ciphertext(std::move(plaintext), ciphertext.size());
             next = crypto::ed25519_pubkey::from_hex(
                     inner_json.at("destination").get_ref<const std::string&>());
             eph_key = crypto::x25519_pubkey::from_hex(
@@ -163,11 +175,17 @@ CiphertextPlusJson parse_combined_payload(std::string_view payload) {
 }
 
 std::ostream& operator<<(std::ostream& os, const FinalDestinationInfo& d) {
-    return os << fmt::format("[\"body\": {}]", d.body);
+    return os << fmt::format(
+                   "[\"body\": {}, \"json\": {}, \"base64\": {}, \"bt\": {}]",
+                   d.body,
+                   d.json,
+                   d.base64,
+                   d.bt);
 }
 
 bool operator==(const FinalDestinationInfo& lhs, const FinalDestinationInfo& rhs) {
-    return lhs.body == rhs.body;
+    return lhs.body == rhs.body && lhs.json == rhs.json && lhs.base64 == rhs.base64 &&
+           lhs.bt == rhs.bt;
 }
 
 std::ostream& operator<<(std::ostream& os, const RelayToServerInfo& d) {
@@ -13,7 +13,9 @@ namespace oxenss::rpc {
 // starting at somewhere higher than 0.
 inline constexpr int MAX_ONION_HOPS = 15;
 
-using CiphertextPlusJson = std::pair<std::string, nlohmann::json>;
+// The ciphertext is a view into the payload given to parse_combined_payload, so that the (often
+// large) ciphertext doesn't get copied just to be handed on.
+using CiphertextPlusJson = std::pair<std::string_view, nlohmann::json>;
 
 /// The request is to be forwarded to another SS node
 struct RelayToNodeInfo {
@@ -70,6 +72,12 @@ struct FinalDestinationInfo {
     // If true (which is the default for backwards compatibility) then encode the encrypted
     // response as base64; if false return the encrypted response as-is.
     bool base64 = true;
+
+    // If true then the response is a bt-encoded dict of the status code ("s") and the raw body
+    // bytes ("b") rather than a json object, which avoids escaping (and, with json=false,
+    // double-encoding) the body.  The encrypted response is always returned as-is (i.e. `base64`
+    // is ignored) in this mode.
+    bool bt = false;
 };
 
 std::ostream& operator<<(std::ostream& os, const FinalDestinationInfo& p);
@@ -4,6 +4,7 @@
 #include <oxenmq/oxenmq.h>
 
 #include <algorithm>
+#include <cstring>
 
 extern "C" {
 #include <arpa/inet.h>
@@ -11,102 +12,166 @@ extern "C" {
 
 namespace oxenss::rpc {
 
-namespace {
+using namespace std::chrono;
 
-    using namespace std::chrono;
+// How often the background cleanup runs; each run cleans one shard of each of the client and snode
+// buckets, so every bucket gets looked at every SHARDS seconds.
+static constexpr auto CLEANUP_INTERVAL = 1s;
 
-    // Time between to consecutive tokens for clients
-    constexpr microseconds TOKEN_PERIOD_US = 1'000'000us / RateLimiter::TOKEN_RATE;
-
-    // Time between to consecutive tokens for snodes
-    constexpr microseconds TOKEN_PERIOD_SN_US = 1'000'000us / RateLimiter::TOKEN_RATE_SN;
-
-    constexpr microseconds FILL_EMPTY_BUCKET_US = TOKEN_PERIOD_US * RateLimiter::BUCKET_SIZE;
-
-}  // namespace
-
-RateLimiter::RateLimiter(oxenmq::OxenMQ& omq) {
-    omq.add_timer(
-            [this] {
-                std::lock_guard lock{mutex_};
-                clean_buckets(steady_clock::now());
-            },
-            10s);
+RateLimiter::RateLimiter(oxenmq::OxenMQ& omq, const rate_limit_config& config) :
+        config_{config},
+        token_period_{1'000'000us / std::max<uint32_t>(config.token_rate, 1)},
+        token_period_sn_{1'000'000us / std::max<uint32_t>(config.token_rate_sn, 1)} {
+    omq.add_timer([this] { clean_buckets(steady_clock::now()); }, CLEANUP_INTERVAL);
 }
 
-template <typename TokenBucket>
-static bool fill_bucket(
-        TokenBucket& bucket, steady_clock::time_point now, bool service_node = false) {
-    auto elapsed_us = duration_cast<microseconds>(now - bucket.last_time_point);
+uint32_t RateLimiter::tokens(
+        const TokenBucket& bucket, steady_clock::time_point now, bool sn) const {
+    const auto token_period = sn ? token_period_sn_ : token_period_;
+    const auto bucket_size = sn ? config_.bucket_size_sn : config_.bucket_size;
     // clamp elapsed time to how long it takes to fill up the whole bucket
     // (simplifies overflow checking)
-    elapsed_us = std::min(elapsed_us, FILL_EMPTY_BUCKET_US);
-
-    const auto token_period = service_node ? TOKEN_PERIOD_SN_US : TOKEN_PERIOD_US;
+    auto elapsed_us = std::min(
+            duration_cast<microseconds>(now - bucket.last_time_point),
+            token_period * bucket_size);
 
     const uint32_t token_added = elapsed_us.count() / token_period.count();
-    bucket.num_tokens += token_added;
-    if (bucket.num_tokens >= RateLimiter::BUCKET_SIZE) {
-        bucket.num_tokens = RateLimiter::BUCKET_SIZE;
-        return true;
-    }
-    return false;
+    return std::min(bucket.num_tokens + token_added, bucket_size);
 }
 
-template <typename TokenBucket>
-static bool remove_token(TokenBucket& b, steady_clock::time_point now, bool sn = false) {
-    fill_bucket(b, now, sn);
-    if (b.num_tokens == 0)
+bool RateLimiter::remove_token(TokenBucket& b, steady_clock::time_point now, bool sn) const {
+    auto t = tokens(b, now, sn);
+    if (t == 0)
         return false;
-    b.num_tokens--;
+    b.num_tokens = t - 1;
     b.last_time_point = now;
     return true;
 }
 
+template <typename Shard>
+size_t RateLimiter::clean_shard(
+        Shard& s, steady_clock::time_point now, bool sn, size_t max) const {
+    const auto full = sn ? config_.bucket_size_sn : config_.bucket_size;
+    size_t removed = 0;
+    if (!max) {
+        for (auto it = s.buckets.begin(); it != s.buckets.end();) {
+            if (tokens(it->second, now, sn) >= full) {
+                it = s.buckets.erase(it);
+                removed++;
+            } else
+                ++it;
+        }
+        s.clean_next.reset();
+        return removed;
+    }
+
+    // Otherwise we go around the shard, starting where we left off (erasing doesn't reorder the
+    // rest), so that a run of busy buckets can't keep every limited cleanup from finding the idle
+    // ones after it.
+    max = std::min(max, s.buckets.size());
+    auto it = s.clean_next ? s.buckets.find(*s.clean_next) : s.buckets.end();
+    for (size_t checked = 0; checked < max; checked++) {
+        if (it == s.buckets.end())
+            it = s.buckets.begin();
+        if (tokens(it->second, now, sn) >= full) {
+            it = s.buckets.erase(it);
+            removed++;
+        } else
+            ++it;
+    }
+    if (it == s.buckets.end())
+        s.clean_next.reset();
+    else
+        s.clean_next = it->first;
+    return removed;
+}
+
 bool RateLimiter::should_rate_limit(
         const crypto::legacy_pubkey& pubkey, steady_clock::time_point now) {
-    std::lock_guard lock{mutex_};
-    if (auto [it, ins] = snode_buckets_.emplace(pubkey, TokenBucket{BUCKET_SIZE - 1, now}); ins)
+    auto& s = snode_shards_[std::hash<crypto::legacy_pubkey>{}(pubkey) % SHARDS];
+    std::lock_guard lock{s.mutex};
+    if (auto [it, ins] = s.buckets.emplace(pubkey, TokenBucket{config_.bucket_size_sn - 1, now});
+        ins)
         return false;
     else
         return !remove_token(it->second, now, true);
 }
 
-bool RateLimiter::should_rate_limit_client(uint32_t ip, steady_clock::time_point now) {
-    std::lock_guard lock{mutex_};
+bool RateLimiter::should_rate_limit_client(client_addr addr, steady_clock::time_point now) {
+    auto& s = client_shards_[client_addr_hash{}(addr) % SHARDS];
+    std::lock_guard lock{s.mutex};
 
-    if (auto it = client_buckets_.find(ip); it != client_buckets_.end())
-        return !remove_token(it->second, now);
+    if (auto it = s.buckets.find(addr); it != s.buckets.end())
+        return !remove_token(it->second, now, false);
 
-    if (client_buckets_.size() >= MAX_CLIENTS) {
-        clean_buckets(now);
-        if (client_buckets_.size() >= MAX_CLIENTS)
+    if (client_count_.load(std::memory_order_relaxed) >= config_.max_clients) {
+        // Only look at a few buckets of this shard: a full scan of everything (under the lock)
+        // is exactly the wrong thing to do when we're getting hammered by new clients.
+        if (auto removed = clean_shard(s, now, false, MAX_INLINE_CLEANUP))
+            client_count_.fetch_sub(removed, std::memory_order_relaxed);
+        if (client_count_.load(std::memory_order_relaxed) >= config_.max_clients)
             return true;
     }
-    client_buckets_.emplace(ip, TokenBucket{BUCKET_SIZE - 1, now});
+    s.buckets.emplace(addr, TokenBucket{config_.bucket_size - 1, now});
+    client_count_.fetch_add(1, std::memory_order_relaxed);
     return false;
 }
 
-bool RateLimiter::should_rate_limit_client(
-        const std::string& ip_dotted_quad, steady_clock::time_point now) {
-    struct in_addr ip;
-    int res = inet_pton(AF_INET, ip_dotted_quad.c_str(), &ip);
-    return res == 1 ? should_rate_limit_client(ip.s_addr, now) : false;
+bool RateLimiter::should_rate_limit_client(uint32_t ip, steady_clock::time_point now) {
+    return should_rate_limit_client(client_addr{ip, false}, now);
 }
 
-void RateLimiter::clean_buckets(steady_clock::time_point now) {
-    for (auto it = client_buckets_.begin(); it != client_buckets_.end();) {
-        if (fill_bucket(it->second, now))
-            it = client_buckets_.erase(it);
-        else
-            ++it;
+bool RateLimiter::should_rate_limit_client_addr(
+        std::string_view packed_addr, steady_clock::time_point now) {
+    static constexpr unsigned char v4_mapped_prefix[12] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (packed_addr.size() == 16 && std::memcmp(packed_addr.data(), v4_mapped_prefix, 12) == 0)
+        packed_addr.remove_prefix(12);
+
+    if (packed_addr.size() == 4) {
+        uint32_t ip;
+        std::memcpy(&ip, packed_addr.data(), 4);
+        return should_rate_limit_client(ntohl(ip), now);
     }
+    if (packed_addr.size() == 16) {
+        // Clients generally get (at least) a whole /64, so that's what we limit
+        uint64_t prefix = 0;
+        for (int i = 0; i < 8; i++)
+            prefix = prefix << 8 | static_cast<unsigned char>(packed_addr[i]);
+        return should_rate_limit_client(client_addr{prefix, true}, now);
+    }
+    return true;
+}
 
-    for (auto it = snode_buckets_.begin(); it != snode_buckets_.end();) {
-        if (fill_bucket(it->second, now, true))
-            it = snode_buckets_.erase(it);
-        else
-            ++it;
+bool RateLimiter::should_rate_limit_client(const std::string& ip, steady_clock::time_point now) {
+    std::string_view addr{ip};
+    if (addr.size() >= 2 && addr.front() == '[' && addr.back() == ']')
+        addr = addr.substr(1, addr.size() - 2);
+    std::string host{addr};
+
+    if (struct in_addr ip4; inet_pton(AF_INET, host.c_str(), &ip4) == 1)
+        return should_rate_limit_client_addr(
+                std::string_view{reinterpret_cast<const char*>(&ip4), sizeof(ip4)}, now);
+    if (struct in6_addr ip6; inet_pton(AF_INET6, host.c_str(), &ip6) == 1)
+        return should_rate_limit_client_addr(
+                std::string_view{reinterpret_cast<const char*>(&ip6), sizeof(ip6)}, now);
+    return false;
+}
+
+void RateLimiter::clean_buckets(steady_clock::time_point now) {
+    // Only called from the timer, so next_clean_ needs no locking of its own
+    auto i = next_clean_;
+    next_clean_ = (next_clean_ + 1) % SHARDS;
+    {
+        auto& s = client_shards_[i];
+        std::lock_guard lock{s.mutex};
+        if (auto removed = clean_shard(s, now, false))
+            client_count_.fetch_sub(removed, std::memory_order_relaxed);
+    }
+    {
+        auto& s = snode_shards_[i];
+        std::lock_guard lock{s.mutex};
+        clean_shard(s, now, true);
     }
 }
 
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 
 #include <oxenss/crypto/keys.h>
+#include <oxenss/utils/lock_profiler.hpp>
 
 namespace oxenmq {
 class OxenMQ;
@@ -15,9 +21,26 @@ class OxenMQ;
 
 namespace oxenss::rpc {
 
+// Rate limiting parameters; see RateLimiter for the defaults.
+struct rate_limit_config {
+    uint32_t bucket_size;     // the most client requests allowed in a burst
+    uint32_t token_rate;      // sustained client requests per second
+    uint32_t bucket_size_sn;  // the most service node requests allowed in a burst
+    uint32_t token_rate_sn;   // sustained service node requests per second
+    uint32_t max_clients;     // the most clients we track at once
+};
+
+// Per service node and per client address token bucket rate limits.  Clients are limited per IPv4
+// address and per IPv6 /64 (so that a client can't get around the limit just by using more of the
+// addresses it has been allocated).
+//
+// The buckets are split across SHARDS independently locked maps so that concurrent requests
+// (from every transport's threads) rarely contend.  Full (i.e. idle) buckets are expired in the
+// background, one shard at a time; when we're at `max_clients` a new client only triggers a small,
+// bounded cleanup of its own shard rather than a scan of everything.
 class RateLimiter {
   public:
-    // TODO: make those two constants command line parameters?
+    // Defaults of the configurable parameters:
     inline constexpr static uint32_t BUCKET_SIZE = 600;
 
     // Tokens (requests) per second
@@ -25,33 +48,97 @@ class RateLimiter {
     inline constexpr static uint32_t TOKEN_RATE_SN = 600;
     inline constexpr static uint32_t MAX_CLIENTS = 10000;
 
+    inline constexpr static size_t SHARDS = 16;
+
+    // The most buckets a new client's cleanup of its shard looks at; each such cleanup carries on
+    // from where the previous one of the shard stopped.
+    inline constexpr static size_t MAX_INLINE_CLEANUP = 32;
+
+    static constexpr rate_limit_config DEFAULT_CONFIG{
+            BUCKET_SIZE, TOKEN_RATE, BUCKET_SIZE, TOKEN_RATE_SN, MAX_CLIENTS};
+
     RateLimiter() = delete;
-    RateLimiter(oxenmq::OxenMQ& omq);
+    explicit RateLimiter(oxenmq::OxenMQ& omq, const rate_limit_config& config = DEFAULT_CONFIG);
 
     bool should_rate_limit(
             const crypto::legacy_pubkey& pubkey,
             std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Takes an IPv4 address in host byte order.
     bool should_rate_limit_client(
             uint32_t ip,
             std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
 
-    // Same as above, but takes a "a.b.c.d" string.  Returns false (i.e. don't rate limit) if
-    // the given address isn't parseable as an IPv4 address at all.
+    // Same as above, but takes a packed (network byte order) 4-byte IPv4 or 16-byte IPv6 address.
+    // IPv4-mapped IPv6 addresses are treated as the IPv4 address.  Returns true (i.e. rate limit)
+    // for anything else.
+    bool should_rate_limit_client_addr(
+            std::string_view packed_addr,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Same as above, but takes an "a.b.c.d" or IPv6 string (optionally in [brackets]).  Returns
+    // false (i.e. don't rate limit) if the given address isn't parseable as an IP address at all.
     bool should_rate_limit_client(
-            const std::string& ip_dotted_quad,
+            const std::string& ip,
             std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
 
+    // Returns the number of clients we currently have buckets for.
+    size_t client_count() const { return client_count_.load(std::memory_order_relaxed); }
+
   private:
     struct TokenBucket {
         uint32_t num_tokens;
         std::chrono::steady_clock::time_point last_time_point;
     };
 
-    std::mutex mutex_;
+    // An IPv4 address, or the /64 prefix of an IPv6 address
+    struct client_addr {
+        uint64_t addr;
+        bool v6;
+        bool operator==(const client_addr& o) const { return addr == o.addr && v6 == o.v6; }
+    };
+    struct client_addr_hash {
+        size_t operator()(const client_addr& a) const {
+            return std::hash<uint64_t>{}(a.addr) ^ (a.v6 ? 0x9e3779b97f4a7c15ULL : 0);
+        }
+    };
+
+    template <typename Key, typename Hash = std::hash<Key>>
+    struct shard {
+        util::profiled_mutex<std::mutex, "rate_limiter"> mutex;
+        std::unordered_map<Key, TokenBucket, Hash> buckets;
+        // The bucket that the next limited cleanup of the shard starts at (if it still exists).
+        std::optional<Key> clean_next;
+    };
+
+    const rate_limit_config config_;
+    const std::chrono::microseconds token_period_, token_period_sn_;
+
+    std::array<shard<crypto::legacy_pubkey>, SHARDS> snode_shards_;
+    std::array<shard<client_addr, client_addr_hash>, SHARDS> client_shards_;
+    std::atomic<size_t> client_count_ = 0;
+
+    // The next shard for the background cleanup
+    size_t next_clean_ = 0;
+
+    bool should_rate_limit_client(client_addr addr, std::chrono::steady_clock::time_point now);
+
+    // Returns the tokens in the bucket, including those added since it was last used.  A bucket
+    // with a full bucket's worth of tokens is the same as no bucket at all, and so can be dropped.
+    uint32_t tokens(
+            const TokenBucket& bucket, std::chrono::steady_clock::time_point now, bool sn) const;
+
+    // Takes a token from the bucket; returns false if it has none.
+    bool remove_token(TokenBucket& b, std::chrono::steady_clock::time_point now, bool sn) const;
 
-    std::unordered_map<crypto::legacy_pubkey, TokenBucket> snode_buckets_;
-    std::unordered_map<uint32_t, TokenBucket> client_buckets_;
+    // Drops the full buckets from the given shard, or from the (at most) `max` buckets following
+    // those looked at by the previous limited call, if `max` is non-zero.  Must be called with the
+    // shard's lock held.  Returns the number of buckets dropped.
+    template <typename Shard>
+    size_t clean_shard(
+            Shard& s, std::chrono::steady_clock::time_point now, bool sn, size_t max = 0) const;
 
+    // Drops full buckets from the next shard of each of the client and snode buckets.
     void clean_buckets(std::chrono::steady_clock::time_point now);
 };
 
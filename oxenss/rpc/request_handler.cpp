@@ -1,10 +1,15 @@
 #include "request_handler.h"
+#include "cached_responses.h"
 #include "client_rpc_endpoints.h"
+#include "retrieve_encoder.h"
 #include <oxen/log.hpp>
 #include <oxenss/server/utils.h>
 #include <oxenss/server/omq.h>
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/utils/base64.hpp>
+#include <oxenss/utils/lock_profiler.hpp>
+#include <oxenss/utils/memory.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/version.h>
@@ -13,11 +18,14 @@
 #include <oxenss/crypto/subaccount.h>
 #include <oxenss/crypto/channel_encryption.hpp>
 
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <mutex>
 
 #include <nlohmann/json.hpp>
-#include <oxenc/base32z.h>
 #include <oxenc/base64.h>
+#include <oxenc/bt_producer.h>
 #include <oxenc/hex.h>
 #include <oxenmq/oxenmq.h>
 #include <sodium/crypto_core_ed25519.h>
@@ -26,6 +34,7 @@
 #include <sodium/crypto_scalarmult_ed25519.h>
 #include <sodium/crypto_sign.h>
 #include <type_traits>
+#include <unordered_map>
 #include <variant>
 
 using nlohmann::json;
@@ -52,34 +61,6 @@ std::string to_string(const Response& res) {
 }
 
 namespace {
-    json swarm_to_json(const std::optional<snode::SwarmInfo>& swarm) {
-        if (!swarm)
-            return json{
-                    {"snodes", json::array()},
-                    {"swarm", util::int_to_string(snode::INVALID_SWARM_ID, 16)},
-            };
-        json snodes_json = json::array();
-        for (const auto& sn : swarm->snodes) {
-            snodes_json.push_back(
-                    json{{"address",  // Deprecated, use pubkey_legacy instead
-                          oxenc::to_base32z(sn.pubkey_legacy.view()) + ".snode"},
-                         {"pubkey_legacy", sn.pubkey_legacy.hex()},
-                         {"pubkey_x25519", sn.pubkey_x25519.hex()},
-                         {"pubkey_ed25519", sn.pubkey_ed25519.hex()},
-                         {"port",  // Deprecated string port for backwards compat; prefer https_port
-                          std::to_string(sn.port)},
-                         {"port_https", sn.port},
-                         {"port_omq", sn.omq_quic_port},
-                         {"port_quic", sn.omq_quic_port},
-                         {"ip", sn.ip}});
-        }
-
-        return json{
-                {"snodes", std::move(snodes_json)},
-                {"swarm", util::int_to_string(swarm->swarm_id, 16)},
-        };
-    }
-
     void add_misc_response_fields(
             json& j,
             snode::ServiceNode& sn,
@@ -96,6 +77,12 @@ namespace {
                oxenc::to_hex(std::prev(pk_raw.end()), pk_raw.end());
     }
 
+    // Log argument version of obfuscate_pubkey(), which only does the work if the log statement
+    // is enabled.
+    auto obfuscated(const user_pubkey& pk) {
+        return logging::lazy([&pk] { return obfuscate_pubkey(pk); });
+    }
+
     template <typename RPC, typename Params>
     RPC load_request(Params&& params) {
         RPC req;
@@ -115,13 +102,20 @@ namespace {
                     [](auto&& params) { return load_request<RPC>(std::move(params)); },
                     std::move(params));
         };
-        calls.http_json = [](RequestHandler& h, json params, std::function<void(Response)> cb) {
+        calls.http_json = [](RequestHandler& h,
+                             json params,
+                             std::shared_ptr<RequestTrace> trace,
+                             std::function<void(Response)> cb) {
             auto req = load_request<RPC>(std::move(params));
+            req.encoded_response = true;
+            req.trace = std::move(trace);
+            trace_mark(req.trace, trace_phase::parsed);
             h.process_client_req(std::move(req), std::move(cb));
         };
         calls.mq = [](rpc::RequestHandler& h,
                       std::string_view params,
                       [[maybe_unused]] bool forwarded,
+                      std::shared_ptr<RequestTrace> trace,
                       std::function<void(rpc::Response)> cb) {
             RPC req;
             if (params.empty())
@@ -138,6 +132,7 @@ namespace {
                 }
                 req.load_from(std::move(body));
             }
+            req.encoded_response = true;
             if constexpr (std::is_base_of_v<rpc::recursive, RPC>) {
                 req.recurse = !forwarded;
             } else if (forwarded) {
@@ -145,6 +140,8 @@ namespace {
                         http::BAD_REQUEST,
                         "invalid request: received invalid forwarded non-forwardable request"sv});
             }
+            req.trace = std::move(trace);
+            trace_mark(req.trace, trace_phase::parsed);
 
             h.process_client_req(std::move(req), std::move(cb));
         };
@@ -269,6 +266,7 @@ namespace {
     template <typename... T>
     bool verify_signature(
             oxenss::Database& db,
+            SubaccountCache& subaccount_cache,
             const user_pubkey& pubkey,
             const std::optional<std::array<unsigned char, 32>>& pk_ed25519,
             const std::optional<signed_subaccount_token>& subaccount,
@@ -304,7 +302,7 @@ namespace {
 
             // Check that it has the required flags and is signed:
             try {
-                subaccount->verify(pubkey, required_access, pk);
+                subaccount_cache.verify(*subaccount, pubkey, required_access, pk);
             } catch (const subaccount_verification_error& e) {
                 log::warning(logcat, "Signature verification failed: {}", e.what());
                 return false;
@@ -343,51 +341,141 @@ namespace {
 const RequestHandler::rpc_map RequestHandler::client_rpc_endpoints =
         register_client_rpc_endpoints(rpc::client_rpc_types{});
 
+static std::vector<std::string_view> client_rpc_endpoint_names() {
+    std::vector<std::string_view> names;
+    names.reserve(RequestHandler::client_rpc_endpoints.size());
+    for (auto& [name, handler] : RequestHandler::client_rpc_endpoints)
+        names.push_back(name);
+    return names;
+}
+
+std::string_view message_hash_b64(
+        const message_hash& hash, std::array<char, MESSAGE_HASH_B64_SIZE + 1>& out) {
+    // 32 bytes encode to 43 base64 characters plus one padding character, which we drop:
+    oxenc::to_base64(hash.begin(), hash.end(), out.begin());
+    return {out.data(), MESSAGE_HASH_B64_SIZE};
+}
+
 std::string compute_hash_blake2b_b64(std::vector<std::string_view> parts) {
-    constexpr size_t HASH_SIZE = 32;
-    crypto_generichash_state state;
-    crypto_generichash_init(&state, nullptr, 0, HASH_SIZE);
+    blake2b_hasher hasher;
     for (const auto& s : parts)
-        crypto_generichash_update(
-                &state, reinterpret_cast<const unsigned char*>(s.data()), s.size());
-    std::array<unsigned char, HASH_SIZE> hash;
-    crypto_generichash_final(&state, hash.data(), HASH_SIZE);
-
-    std::string b64hash = oxenc::to_base64(hash.begin(), hash.end());
-    // Trim padding:
-    while (!b64hash.empty() && b64hash.back() == '=')
-        b64hash.pop_back();
-    return b64hash;
+        hasher.update(s);
+    std::array<char, MESSAGE_HASH_B64_SIZE + 1> b64;
+    return std::string{message_hash_b64(hasher.finalize(), b64)};
 }
 
-std::string computeMessageHash(const user_pubkey& pubkey, namespace_id ns, std::string_view data) {
+message_hash compute_message_hash(
+        const user_pubkey& pubkey, namespace_id ns, std::string_view data) {
     char netid = static_cast<char>(pubkey.type());
-    std::array<char, 20> ns_buf;
-    char* ns_buf_ptr = ns_buf.data();
-    std::string_view ns_for_hash =
-            ns != namespace_id::Default ? detail::to_hashable(to_int(ns), ns_buf_ptr) : ""sv;
-    return compute_hash(
-            compute_hash_blake2b_b64, std::string_view{&netid, 1}, pubkey.raw(), ns_for_hash, data);
+    blake2b_hasher hasher;
+    hasher.update(std::string_view{&netid, 1}, pubkey.raw());
+    if (ns != namespace_id::Default)
+        hasher.update(to_int(ns));
+    hasher.update(data);
+    return hasher.finalize();
+}
+
+std::string computeMessageHash(const user_pubkey& pubkey, namespace_id ns, std::string_view data) {
+    std::array<char, MESSAGE_HASH_B64_SIZE + 1> b64;
+    return std::string{message_hash_b64(compute_message_hash(pubkey, ns, data), b64)};
 }
 
 RequestHandler::RequestHandler(
-        snode::ServiceNode& sn, const crypto::ChannelEncryption& ce, crypto::ed25519_seckey edsk) :
-        service_node_{sn}, channel_cipher_(ce), ed25519_sk_{std::move(edsk)} {}
+        snode::ServiceNode& sn,
+        const crypto::ChannelEncryption& ce,
+        crypto::ed25519_seckey edsk,
+        unsigned onion_threads,
+        std::chrono::milliseconds shed_target,
+        double trace_sample_rate,
+        std::chrono::milliseconds trace_slow) :
+        service_node_{sn},
+        channel_cipher_(ce),
+        ed25519_sk_{std::move(edsk)},
+        admission_{shed_target},
+        metrics_{client_rpc_endpoint_names()},
+        tracer_{trace_sample_rate, trace_slow},
+        onion_crypto_{onion_threads} {
+    service_node_.set_swarm_listener(
+            [this](const auto& swarm) { cached_responses_.update_swarms(swarm); });
+    service_node_.set_stats_provider("rpc", [this](nlohmann::json& val) {
+        val["onion_crypto_queue"] = onion_crypto_.queued();
+        for (auto [prefix, st] :
+             {std::pair{"onion_decrypt", onion_crypto_.get_stats(OnionCryptoPool::stage::decrypt)},
+              std::pair{
+                      "onion_encrypt", onion_crypto_.get_stats(OnionCryptoPool::stage::encrypt)}}) {
+            val[fmt::format("{}_jobs", prefix)] = st.jobs;
+            val[fmt::format("{}_shed", prefix)] = st.shed;
+            val[fmt::format("{}_wait_us", prefix)] = st.wait_us;
+            val[fmt::format("{}_wait_max_us", prefix)] = st.max_wait_us;
+            val[fmt::format("{}_run_us", prefix)] = st.run_us;
+        }
+        for (auto e : {encoding::zstd, encoding::brotli}) {
+            if (!ResponseCompressor::supported(e))
+                continue;
+            auto st = compressor_.get_stats(e);
+            auto prefix = fmt::format("compress_{}", to_string(e));
+            val[prefix + "_responses"] = st.responses;
+            val[prefix + "_skipped"] = st.skipped;
+            val[prefix + "_bytes_in"] = st.bytes_in;
+            val[prefix + "_bytes_out"] = st.bytes_out;
+            val[prefix + "_ratio"] =
+                    st.bytes_out > 0 ? static_cast<double>(st.bytes_in) / st.bytes_out : 0.0;
+            val[prefix + "_cpu_us"] = st.cpu_us;
+        }
+        val["queue_delay_us"] = admission_.queue_delay().count();
+        val["traces_kept"] = tracer_.kept();
+        for (auto c :
+             {request_class::sn_critical,
+              request_class::client_write,
+              request_class::client_read,
+              request_class::onion})
+            val[fmt::format("shed_{}", to_string(c))] = admission_.shed(c);
+    });
+}
+
+Response RequestHandler::shed_response() {
+    return Response{
+            http::SERVICE_UNAVAILABLE,
+            "Snode overloaded, try again later"sv,
+            {{"Retry-After",
+              std::to_string(std::chrono::seconds{AdmissionControl::RETRY_AFTER}.count())}}};
+}
+
+Response RequestHandler::owner_busy_response() {
+    return Response{
+            http::TOO_MANY_REQUESTS,
+            "Too many pending requests for this account, try again later"sv,
+            {{"Retry-After",
+              std::to_string(std::chrono::seconds{AdmissionControl::RETRY_AFTER}.count())}}};
+}
+
+RequestHandler::~RequestHandler() {
+    service_node_.set_stats_provider("rpc", nullptr);
+    service_node_.set_swarm_listener(nullptr);
+}
+
+void RequestHandler::shutdown() {
+    onion_crypto_.shutdown();
+    subrequest_pool_.shutdown();
+}
 
 Response RequestHandler::handle_wrong_swarm(const user_pubkey& pubKey) {
     log::trace(logcat, "Got client request to a wrong swarm");
 
-    json swarm = swarm_to_json(service_node_.get_swarm(pubKey));
+    const auto info = service_node_.get_swarm(pubKey);
+    json swarm = swarm_to_json(info ? &*info : nullptr);
     add_misc_response_fields(swarm, service_node_);
     return {http::MISDIRECTED_REQUEST, std::move(swarm)};
 }
 
 struct swarm_response {
-    std::mutex mutex;
+    util::profiled_mutex<std::mutex, "swarm_response"> mutex;
     int pending;
     bool b64;
+    std::shared_ptr<RequestTrace> trace;
     nlohmann::json result;
     std::function<void(rpc::Response)> cb;
+    prefixed_pubkey owner;  // the account the request is for, to fair queue its database job
 };
 
 // Replies to a recursive swarm request via its callback; sends an http::OK unless all of the
@@ -412,85 +500,146 @@ static void distribute_command(
     auto peers = sn.get_swarm_peers();
     res->pending += peers.size();
 
+    auto body = bt_serialize(req.to_bt());
+    bool batching = sn.hf_at_least(snode::FORWARD_BATCHING);
     for (auto& peer : peers) {
-        sn.omq_server()->request(
-                peer.pubkey_x25519.view(),
-                "sn.storage_cc",
-                [res, peer, cmd](bool success, auto parts) {
-                    json peer_result;
-                    if (!success)
-                        log::warning(
-                                logcat,
-                                "Response timeout from {} for forwarded command {}",
-                                peer.pubkey_legacy,
-                                cmd);
-                    bool good_result = success && parts.size() == 1;
-                    if (good_result) {
-                        try {
-                            peer_result = bt_to_json(oxenc::bt_dict_consumer{parts[0]});
-                        } catch (const std::exception& e) {
-                            log::warning(
-                                    logcat,
-                                    "Received unparsable response to {} from {}: {}",
-                                    cmd,
-                                    peer.pubkey_legacy,
-                                    e.what());
-                            good_result = false;
-                        }
-                    }
+        auto on_reply = [res, peer, cmd](bool success, std::vector<std::string> parts) {
+            json peer_result;
+            if (!success)
+                log::warning(
+                        logcat,
+                        "Response timeout from {} for forwarded command {}",
+                        peer.pubkey_legacy,
+                        cmd);
+            bool good_result = success && parts.size() == 1;
+            if (good_result) {
+                try {
+                    peer_result = bt_to_json(oxenc::bt_dict_consumer{parts[0]});
+                } catch (const std::exception& e) {
+                    log::warning(
+                            logcat,
+                            "Received unparsable response to {} from {}: {}",
+                            cmd,
+                            peer.pubkey_legacy,
+                            e.what());
+                    good_result = false;
+                }
+            }
 
-                    std::lock_guard lock{res->mutex};
-
-                    // If we're the last response then we reply:
-                    bool send_reply = --res->pending == 0;
-
-                    if (!good_result) {
-                        peer_result = json{{"failed", true}};
-                        if (!success)
-                            peer_result["timeout"] = true;
-                        else if (parts.size() == 2) {
-                            peer_result["code"] = parts[0];
-                            peer_result["reason"] = parts[1];
-                        } else
-                            peer_result["bad_peer_response"] = true;
-                    } else if (res->b64) {
-                        if (auto it = peer_result.find("signature");
-                            it != peer_result.end() && it->is_string())
-                            *it = oxenc::to_base64(it->get_ref<const std::string&>());
-                    }
+            std::lock_guard lock{res->mutex};
+
+            // If we're the last response then we reply:
+            bool send_reply = --res->pending == 0;
+
+            if (!good_result) {
+                peer_result = json{{"failed", true}};
+                if (!success)
+                    peer_result["timeout"] = true;
+                else if (parts.size() == 2) {
+                    peer_result["code"] = parts[0];
+                    peer_result["reason"] = parts[1];
+                } else
+                    peer_result["bad_peer_response"] = true;
+            } else if (res->b64) {
+                if (auto it = peer_result.find("signature");
+                    it != peer_result.end() && it->is_string())
+                    *it = util::to_base64(it->get_ref<const std::string&>());
+            }
 
-                    res->result["swarm"][peer.pubkey_ed25519.hex()] = std::move(peer_result);
+            res->result["swarm"][peer.pubkey_ed25519.hex()] = std::move(peer_result);
 
-                    if (send_reply)
-                        reply_or_fail(res);
-                },
-                cmd,
-                bt_serialize(req.to_bt()),
-                oxenmq::send_option::request_timeout{5s});
+            if (send_reply)
+                reply_or_fail(res);
+        };
+        if (batching)
+            sn.forward_queue().push(peer.pubkey_x25519, cmd, body, std::move(on_reply));
+        else
+            sn.omq_server()->request(
+                    peer.pubkey_x25519.view(),
+                    "sn.storage_cc",
+                    std::move(on_reply),
+                    cmd,
+                    body,
+                    oxenmq::send_option::request_timeout{5s});
     }
 }
 
 template <typename RPC, typename = std::enable_if_t<std::is_base_of_v<rpc::recursive, RPC>>>
-std::pair<std::shared_ptr<swarm_response>, std::unique_lock<std::mutex>> static setup_recursive_request(
+static std::shared_ptr<swarm_response> setup_recursive_request(
         snode::ServiceNode& sn, RPC& req, std::function<void(Response)> cb) {
     auto res = std::make_shared<swarm_response>();
     res->cb = std::move(cb);
     res->pending = 1;
     res->b64 = req.b64;
+    res->trace = req.trace;
+    res->owner = req.pubkey.key();
 
-    std::unique_lock<std::mutex> lock{res->mutex, std::defer_lock};
     if (req.recurse) {
         // Send it off to our peers right away, before we process it ourselves
         distribute_command(sn, res, RPC::names()[0], req);
-        lock.lock();
+        trace_mark(req.trace, trace_phase::forwarded);
+    }
+    return res;
+}
+
+// Merges our own result (`mine`) of a recursive request, and any fields to add to the top level
+// of the response (`top`), into the response, which gets sent if all the peers have already
+// replied.
+static void finish_local_request(
+        snode::ServiceNode& sn,
+        const std::shared_ptr<swarm_response>& res,
+        bool recurse,
+        json mine,
+        const json& top) {
+    std::unique_lock lock{res->mutex};
+    if (recurse)
+        res->result["swarm"][sn.own_address().pubkey_ed25519.hex()] = std::move(mine);
+    else
+        res->result = std::move(mine);
+    res->result.update(top);
+    bool send_reply = --res->pending == 0;
+    lock.unlock();
+
+    if (send_reply)
+        reply_or_fail(res);
+}
+
+// Queues the local part of a recursive request as a database job.  `local` is called from the
+// database thread to fill in our own result and any top level fields; these are built up without
+// holding the response lock, and then get merged into the response by finish_local_request().
+static void queue_local_request(
+        snode::ServiceNode& sn,
+        bool write,
+        std::shared_ptr<swarm_response> res,
+        bool recurse,
+        std::function<void(Database& db, json& mine, json& top)> local) {
+    auto job = [&sn, res, recurse, local = std::move(local)](Database& db) {
+        json mine = json::object(), top = json::object();
+        trace_mark(res->trace, trace_phase::db_start);
+        try {
+            local(db, mine, top);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Internal Server Error processing request: {}", e.what());
+            mine["failed"] = true;
+            mine["query_failure"] = true;
+        }
+        trace_mark(res->trace, trace_phase::db_done);
+        finish_local_request(sn, res, recurse, std::move(mine), top);
+    };
+    auto& executor = sn.db_executor();
+    if (!(write ? executor.write(std::move(job), res->owner)
+                : executor.read(std::move(job), res->owner))) {
+        log::debug(logcat, "Refusing request: its account has too many database jobs waiting");
+        finish_local_request(
+                sn, res, recurse, json{{"failed", true}, {"too_busy", true}}, json::object());
     }
-    return {std::move(res), std::move(lock)};
 }
 
 void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Response)> cb) {
-#ifndef NDEBUG
-    log::trace(logcat, "Storing message: {}", oxenc::to_base64(req.data));
-#endif
+    log::trace(
+            logcat,
+            "Storing message: {}",
+            logging::lazy([&req] { return oxenc::to_base64(req.data); }));
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
         return cb(handle_wrong_swarm(req.pubkey));
@@ -534,6 +683,7 @@ void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Res
 
         if (!verify_signature(
                     service_node_.get_db(),
+                    subaccount_cache_,
                     req.pubkey,
                     req.pubkey_ed25519,
                     req.subaccount,
@@ -547,72 +697,81 @@ void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Res
             return cb(Response{http::UNAUTHORIZED, "store signature verification failed"sv});
         }
     }
+    trace_mark(req.trace, trace_phase::verified);
 
     bool entry_router = req.recurse == true;
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req), entry_router, now](
+                    Database&, json& mine, json& top) mutable {
+                std::string message_hash =
+                        computeMessageHash(req.pubkey, req.msg_namespace, req.data);
+
+                std::chrono::system_clock::time_point expiry;
+                std::optional<StoreResult> result;
+                try {
+                    result = service_node_.process_store(
+                            message{req.pubkey,
+                                    message_hash,
+                                    req.msg_namespace,
+                                    req.timestamp,
+                                    req.expiry,
+                                    std::move(req.data)},
+                            &expiry);
+                } catch (const std::exception& e) {
+                    log::error(
+                            logcat,
+                            "Internal Server Error. Could not store message for {}: {}",
+                            obfuscate_pubkey(req.pubkey),
+                            e.what());
+                    mine["reason"] = e.what();
+                }
+                if (result == StoreResult::OverQuota) {
+                    mine["failed"] = true;
+                    mine["quota_exceeded"] = true;
+                } else if (result && *result != StoreResult::Full) {
+                    mine["hash"] = message_hash;
+                    auto sig = create_signature(ed25519_sk_, message_hash);
+                    mine["signature"] = req.b64 ? util::to_base64(util::view_guts(sig))
+                                                : util::view_guts(sig);
+                    if (*result != StoreResult::New)
+                        mine["already"] = true;
+                    mine["expiry"] = to_epoch_ms(expiry);
+
+                    if (entry_router)
+                        // Backwards compat: put the hash at top level, too.  TODO: remove
+                        // eventually
+                        top["hash"] = message_hash;
+                } else {
+                    mine["failed"] = true;
+                    mine["query_failure"] = true;
+                }
+                if (entry_router) {
+                    // Deprecated: we accidentally set this one inside the entry router's "swarm"
+                    // instead of in the outer response, so keep it here for now in case something
+                    // is relying on that:
+                    mine["t"] = to_epoch_ms(now);
 
-    std::string message_hash = computeMessageHash(req.pubkey, req.msg_namespace, req.data);
+                    add_misc_response_fields(top, service_node_, now);
+                }
 
-    bool new_msg;
-    std::chrono::system_clock::time_point expiry;
-    bool success = false;
-    try {
-        success = service_node_.process_store(
-                message{req.pubkey,
+                log::trace(
+                        logcat,
+                        "Successfully stored message {}{} for {}",
                         message_hash,
-                        req.msg_namespace,
-                        req.timestamp,
-                        req.expiry,
-                        std::move(req.data)},
-                &new_msg,
-                &expiry);
-    } catch (const std::exception& e) {
-        log::error(
-                logcat,
-                "Internal Server Error. Could not store message for {}: {}",
-                obfuscate_pubkey(req.pubkey),
-                e.what());
-        mine["reason"] = e.what();
-    }
-    if (success) {
-        mine["hash"] = message_hash;
-        auto sig = create_signature(ed25519_sk_, message_hash);
-        mine["signature"] =
-                req.b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
-        if (!new_msg)
-            mine["already"] = true;
-        mine["expiry"] = to_epoch_ms(expiry);
-
-        if (entry_router)
-            // Backwards compat: put the hash at top level, too.  TODO: remove eventually
-            res->result["hash"] = message_hash;
-    } else {
-        mine["failed"] = true;
-        mine["query_failure"] = true;
-    }
-    if (entry_router) {
-        // Deprecated: we accidentally set this one inside the entry router's "swarm" instead of in
-        // the outer response, so keep it here for now in case something is relying on that:
-        mine["t"] = to_epoch_ms(now);
-
-        add_misc_response_fields(res->result, service_node_, now);
-    }
-
-    log::trace(
-            logcat,
-            "Successfully stored message {}{} for {}",
-            message_hash,
-            req.msg_namespace != namespace_id::Default
-                    ? fmt::format("[{}]", to_int(req.msg_namespace))
-                    : "",
-            obfuscate_pubkey(req.pubkey));
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+                        logging::lazy([&req] {
+                            return req.msg_namespace != namespace_id::Default
+                                         ? fmt::format("[{}]", to_int(req.msg_namespace))
+                                         : "";
+                        }),
+                        obfuscated(req.pubkey));
+            });
 }
 
 void RequestHandler::process_client_req(
@@ -652,34 +811,46 @@ void RequestHandler::process_client_req(
 
 void RequestHandler::process_client_req(
         rpc::get_swarm&& req, std::function<void(rpc::Response)> cb) {
+    if (req.encoded_response) {
+        // Served from the pre-encoded swarm responses, without copying the swarm details out
+        log::debug(logcat, "get swarm for {}", obfuscated(req.pubkey));
+        auto now = to_epoch_ms(system_clock::now());
+        return cb(Response{
+                http::OK,
+                encoded_body{
+                        cached_responses_.get_swarm(
+                                req.pubkey, !req.b64, service_node_.hf(), now),
+                        !req.b64}});
+    }
+
     const auto swarm = service_node_.get_swarm(req.pubkey);
 
     log::debug(
             logcat,
             "get swarm for {}, swarm size: {}",
-            obfuscate_pubkey(req.pubkey),
+            obfuscated(req.pubkey),
             swarm ? swarm->snodes.size() : 0);
 
-    auto body = swarm_to_json(swarm);
+    auto body = swarm_to_json(swarm ? &*swarm : nullptr);
     add_misc_response_fields(body, service_node_);
 
-#ifndef NDEBUG
-    log::trace(logcat, "swarm details for pk {}: {}", obfuscate_pubkey(req.pubkey), body.dump());
-#endif
+    log::trace(
+            logcat,
+            "swarm details for pk {}: {}",
+            obfuscated(req.pubkey),
+            logging::lazy([&body] { return body.dump(); }));
 
     cb(Response{http::OK, std::move(body)});
 }
 
-void RequestHandler::process_client_req(
-        rpc::retrieve&& req, std::function<void(rpc::Response)> cb) {
+std::optional<Response> RequestHandler::check_retrieve(
+        rpc::retrieve& req, system_clock::time_point now) {
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
-
-    auto now = system_clock::now();
+        return handle_wrong_swarm(req.pubkey);
 
     if (!is_noauth_retrieve_namespace(req.msg_namespace) && !req.check_signature) {
         log::debug(logcat, "retrieve: request signature required");
-        return cb(Response{http::UNAUTHORIZED, "retrieve: request signature required"sv});
+        return Response{http::UNAUTHORIZED, "retrieve: request signature required"sv};
     }
 
     if (req.check_signature) {
@@ -689,12 +860,13 @@ void RequestHandler::process_client_req(
                     logcat,
                     "retrieve: invalid timestamp ({}s from now)",
                     duration_cast<seconds>(req.timestamp - now).count());
-            return cb(Response{
-                    http::NOT_ACCEPTABLE, "retrieve timestamp too far from current time"sv});
+            return Response{
+                    http::NOT_ACCEPTABLE, "retrieve timestamp too far from current time"sv};
         }
 
         if (!verify_signature(
                     service_node_.get_db(),
+                    subaccount_cache_,
                     req.pubkey,
                     req.pubkey_ed25519,
                     req.subaccount,
@@ -707,7 +879,7 @@ void RequestHandler::process_client_req(
                             : ""s,
                     req.timestamp)) {
             log::debug(logcat, "retrieve: signature verification failed");
-            return cb(Response{http::UNAUTHORIZED, "retrieve signature verification failed"sv});
+            return Response{http::UNAUTHORIZED, "retrieve signature verification failed"sv};
         }
     }
 
@@ -728,43 +900,272 @@ void RequestHandler::process_client_req(
     } else if (!req.max_size || *req.max_size > RETRIEVE_MAX_SIZE)
         req.max_size = RETRIEVE_MAX_SIZE;
 
-    std::vector<message> msgs;
-    bool more = false;
-    try {
-        std::tie(msgs, more) = service_node_.get_db().retrieve(
-                req.pubkey,
+    if (req.wait > RETRIEVE_MAX_WAIT)
+        req.wait = RETRIEVE_MAX_WAIT;
+
+    trace_mark(req.trace, trace_phase::verified);
+    return std::nullopt;
+}
+
+static json retrieved_message(const message_view& msg, bool b64) {
+    return json{
+            {"hash", std::string{msg.hash}},
+            {"timestamp", to_epoch_ms(msg.timestamp)},
+            {"expiration", to_epoch_ms(msg.expiry)},
+            {"data", b64 ? util::to_base64(msg.data) : std::string{msg.data}},
+    };
+}
+
+void RequestHandler::process_client_req(
+        rpc::retrieve&& req, std::function<void(rpc::Response)> cb) {
+    auto now = system_clock::now();
+    if (auto error = check_retrieve(req, now))
+        return cb(std::move(*error));
+
+    if (req.encoded_response)
+        return process_encoded_retrieve(std::move(req), std::move(cb), now);
+
+    auto owner = req.pubkey.key();
+    bool queued = service_node_.db_executor().read(
+            [this, req = std::move(req), cb, now](Database& db) {
+                // We build the response directly from the database rows to avoid copying each
+                // message body into an intermediate `message` first.
+                json messages = json::array();
+                bool more = false;
+                trace_mark(req.trace, trace_phase::db_start);
+                try {
+                    more = db.retrieve_each(
+                            req.pubkey,
+                            req.msg_namespace,
+                            req.last_hash.value_or(""),
+                            [&messages, b64 = req.b64](const message_view& msg) {
+                                messages.push_back(retrieved_message(msg, b64));
+                            },
+                            req.max_count,
+                            req.max_size);
+                    service_node_.record_retrieve_request();
+                } catch (const std::exception& e) {
+                    auto msg = fmt::format(
+                            "Internal Server Error. Could not retrieve messages for {}",
+                            obfuscate_pubkey(req.pubkey));
+                    log::critical(logcat, "{}", msg);
+                    return cb(Response{http::INTERNAL_SERVER_ERROR, std::move(msg)});
+                }
+
+                trace_mark(req.trace, trace_phase::db_done);
+                log::trace(
+                        logcat,
+                        "Retrieved {} messages for {}",
+                        messages.size(),
+                        obfuscated(req.pubkey));
+
+                json res{{"messages", std::move(messages)}, {"more", more}};
+                add_misc_response_fields(res, service_node_, now);
+
+                cb(Response{http::OK, std::move(res)});
+            },
+            owner);
+    if (!queued)
+        cb(owner_busy_response());
+}
+
+void RequestHandler::process_encoded_retrieve(
+        rpc::retrieve&& req, std::function<void(Response)> cb, system_clock::time_point now) {
+    // For a long-polling retrieve we park the request *before* querying, so that a message that
+    // gets stored while we are querying still wakes it.  Whichever of the query (if it finds
+    // something) or the wakeup gets there first replies; `replied` makes sure only one does.
+    uint64_t wait_id = 0;
+    std::shared_ptr<std::atomic<bool>> replied;
+    if (req.wait > 0ms) {
+        replied = std::make_shared<std::atomic<bool>>(false);
+        auto retry = req;
+        retry.wait = 0ms;
+        wait_id = service_node_.retrieve_waiters().add(
+                req.pubkey.key(),
                 req.msg_namespace,
-                req.last_hash.value_or(""),
-                req.max_count,
-                req.max_size);
-        service_node_.record_retrieve_request();
-    } catch (const std::exception& e) {
-        auto msg = fmt::format(
-                "Internal Server Error. Could not retrieve messages for {}",
-                obfuscate_pubkey(req.pubkey));
-        log::critical(logcat, "{}", msg);
-        return cb(Response{http::INTERNAL_SERVER_ERROR, std::move(msg)});
+                steady_clock::now() + req.wait,
+                [this, replied, retry = std::move(retry), cb]() mutable {
+                    if (!replied->exchange(true))
+                        process_encoded_retrieve(
+                                std::move(retry), std::move(cb), system_clock::now());
+                });
+        if (!wait_id)
+            log::debug(logcat, "Too many waiting retrieves; replying immediately");
     }
 
-    log::trace(logcat, "Retrieved {} messages for {}", msgs.size(), obfuscate_pubkey(req.pubkey));
+    auto owner = req.pubkey.key();
+    bool queued = service_node_.db_executor().read(
+            [this, req = std::move(req), cb, now, wait_id, replied](Database& db) {
+                // Same as the json version above, but written straight into the serialized
+                // response.
+                RetrieveEncoder encoder{
+                        !req.b64, service_node_.hf(), static_cast<size_t>(*req.max_size)};
+                bool more = false;
+                trace_mark(req.trace, trace_phase::db_start);
+                try {
+                    more = db.retrieve_each(
+                            req.pubkey,
+                            req.msg_namespace,
+                            req.last_hash.value_or(""),
+                            [&encoder](const message_view& msg) { encoder.add(msg); },
+                            req.max_count,
+                            req.max_size);
+                    service_node_.record_retrieve_request();
+                } catch (const std::exception& e) {
+                    auto msg = fmt::format(
+                            "Internal Server Error. Could not retrieve messages for {}",
+                            obfuscate_pubkey(req.pubkey));
+                    log::critical(logcat, "{}", msg);
+                    if (wait_id) {
+                        service_node_.retrieve_waiters().cancel(wait_id);
+                        if (replied->exchange(true))
+                            return;
+                    }
+                    return cb(Response{http::INTERNAL_SERVER_ERROR, std::move(msg)});
+                }
 
-    json messages = json::array();
-    for (const auto& msg : msgs) {
-        messages.push_back(json{
-                {"hash", msg.hash},
-                {"timestamp", to_epoch_ms(msg.timestamp)},
-                {"expiration", to_epoch_ms(msg.expiry)},
-                {"data", req.b64 ? oxenc::to_base64(msg.data) : std::move(msg.data)},
-        });
+                trace_mark(req.trace, trace_phase::db_done);
+                log::trace(
+                        logcat,
+                        "Retrieved {} messages for {}",
+                        encoder.count(),
+                        obfuscated(req.pubkey));
+
+                if (wait_id) {
+                    // Nothing yet: leave it to the waiter to reply once something arrives (or the
+                    // wait times out).
+                    if (encoder.count() == 0)
+                        return;
+                    service_node_.retrieve_waiters().cancel(wait_id);
+                    if (replied->exchange(true))
+                        return;
+                }
+
+                cb(Response{
+                        http::OK,
+                        encoded_body{encoder.finish(more, to_epoch_ms(now)), !req.b64}});
+            },
+            owner);
+    if (!queued) {
+        if (wait_id) {
+            service_node_.retrieve_waiters().cancel(wait_id);
+            if (replied->exchange(true))
+                return;
+        }
+        cb(owner_busy_response());
     }
+}
 
-    json res{{"messages", std::move(messages)}, {"more", more}};
-    add_misc_response_fields(res, service_node_, now);
+void RequestHandler::process_owner_reads(owner_reads&& reads) {
+    assert(reads.size() > 0);
+    assert(reads.retrieves.size() == reads.retrieve_cbs.size());
+    assert(reads.expiries.size() == reads.expiry_cbs.size());
+    auto now = system_clock::now();
 
-    return cb(Response{http::OK, std::move(res)});
+    std::vector<size_t> valid, valid_exp;
+    std::vector<Database::retrieve_request> db_reqs;
+    for (size_t i = 0; i < reads.retrieves.size(); i++) {
+        auto& req = reads.retrieves[i];
+        if (auto error = check_retrieve(req, now)) {
+            reads.retrieve_cbs[i](std::move(*error));
+            continue;
+        }
+        valid.push_back(i);
+        auto& r = db_reqs.emplace_back();
+        r.ns = req.msg_namespace;
+        r.last_hash = req.last_hash.value_or("");
+        if (req.max_count)
+            r.max_results = *req.max_count;
+        r.max_size = *req.max_size;
+        r.size_b64 = req.b64;
+    }
+    std::vector<std::vector<std::string>> exp_hashes;
+    for (size_t i = 0; i < reads.expiries.size(); i++) {
+        auto& req = reads.expiries[i];
+        if (auto error = check_get_expiries(req, now)) {
+            reads.expiry_cbs[i](std::move(*error));
+            continue;
+        }
+        valid_exp.push_back(i);
+        exp_hashes.push_back(std::move(req.messages));
+    }
+    if (valid.empty() && valid_exp.empty())
+        return;
+
+    // Shared so that we still have the callbacks if the job gets refused:
+    auto shared_reads = std::make_shared<owner_reads>(std::move(reads));
+    auto owner = (valid.empty() ? shared_reads->expiries[valid_exp.front()].pubkey
+                                : shared_reads->retrieves[valid.front()].pubkey)
+                         .key();
+    auto job = [this,
+                shared_reads,
+                valid,
+                valid_exp,
+                db_reqs = std::move(db_reqs),
+                exp_hashes = std::move(exp_hashes),
+                now](Database& db) {
+        auto& reads = *shared_reads;
+        const auto& pubkey =
+                valid.empty() ? reads.expiries[valid_exp.front()].pubkey
+                              : reads.retrieves[valid.front()].pubkey;
+        std::vector<json> messages(valid.size(), json::array());
+        Database::owner_read_results results;
+        try {
+            // The combined response also has to fit within the maximum size, no matter what the
+            // individual requests asked for (each counting its messages in its own encoding):
+            results = db.read_owner(
+                    pubkey,
+                    db_reqs,
+                    [&](size_t i, const message_view& msg) {
+                        messages[i].push_back(
+                                retrieved_message(msg, reads.retrieves[valid[i]].b64));
+                    },
+                    exp_hashes,
+                    RETRIEVE_MAX_SIZE);
+            for (size_t i = 0; i < valid.size(); i++)
+                service_node_.record_retrieve_request();
+        } catch (const std::exception& e) {
+            auto msg = fmt::format(
+                    "Internal Server Error. Could not read messages for {}",
+                    obfuscate_pubkey(pubkey));
+            log::critical(logcat, "{}: {}", msg, e.what());
+            for (auto i : valid)
+                reads.retrieve_cbs[i](Response{http::INTERNAL_SERVER_ERROR, msg});
+            for (auto i : valid_exp)
+                reads.expiry_cbs[i](Response{http::INTERNAL_SERVER_ERROR, msg});
+            return;
+        }
+
+        for (size_t i = 0; i < valid.size(); i++) {
+            log::trace(
+                    logcat,
+                    "Retrieved {} messages for {} (namespace {})",
+                    messages[i].size(),
+                    obfuscated(pubkey),
+                    db_reqs[i].ns);
+            json res{{"messages", std::move(messages[i])}, {"more", results.more[i]}};
+            add_misc_response_fields(res, service_node_, now);
+            reads.retrieve_cbs[valid[i]](Response{http::OK, std::move(res)});
+        }
+        for (size_t i = 0; i < valid_exp.size(); i++)
+            reads.expiry_cbs[valid_exp[i]](
+                    Response{http::OK, json{{"expiries", std::move(results.expiries[i])}}});
+    };
+    if (!service_node_.db_executor().read(std::move(job), owner)) {
+        for (auto i : valid)
+            shared_reads->retrieve_cbs[i](owner_busy_response());
+        for (auto i : valid_exp)
+            shared_reads->expiry_cbs[i](owner_busy_response());
+    }
 }
 
-void RequestHandler::process_client_req(rpc::info&&, std::function<void(rpc::Response)> cb) {
+void RequestHandler::process_client_req(rpc::info&& req, std::function<void(rpc::Response)> cb) {
+    if (req.encoded_response) {
+        auto now = to_epoch_ms(system_clock::now());
+        return cb(Response{
+                http::OK,
+                encoded_body{cached_responses_.info(!req.b64, service_node_.hf(), now), !req.b64}});
+    }
     auto res = json{
             {"version", STORAGE_SERVER_VERSION}, {"timestamp", to_epoch_ms(system_clock::now())}};
     add_misc_response_fields(res, service_node_);
@@ -789,7 +1190,7 @@ namespace {
             sorted_hashes.emplace_back(hash);
 
         auto sig = create_signature(std::forward<SigArgs>(signature_args)..., sorted_hashes);
-        mine["signature"] = b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
+        mine["signature"] = b64 ? util::to_base64(util::view_guts(sig)) : util::view_guts(sig);
 
         // We've totally sorted by hash (for the signature, above), so this loop below will be
         // appending to the sublists in sorted order:
@@ -808,7 +1209,7 @@ namespace {
 
         std::sort(affected.begin(), affected.end());
         auto sig = create_signature(std::forward<SigArgs>(signature_args)..., affected);
-        mine["signature"] = b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
+        mine["signature"] = b64 ? util::to_base64(util::view_guts(sig)) : util::view_guts(sig);
         mine[mine_key] = std::move(affected);
     }
 }  // namespace
@@ -832,6 +1233,7 @@ void RequestHandler::process_client_req(
     }
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 req.subaccount,
@@ -845,41 +1247,47 @@ void RequestHandler::process_client_req(
         return cb(Response{http::UNAUTHORIZED, "delete_all signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-
-    // If we're recursive then put our stuff inside "swarm" alongside all the other results,
-    // otherwise keep it top-level
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
-
-    if (is_all(req.msg_namespace)) {
-        handle_action_all_ns(
-                mine,
-                "deleted",
-                service_node_.get_db().delete_all(req.pubkey),
-                req.b64,
-                ed25519_sk_,
-                req.pubkey.prefixed_hex(),
-                req.timestamp);
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    // If we're recursive then our stuff goes inside "swarm" alongside all the other results,
+    // otherwise it stays top-level
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req), now](Database& db, json& mine, json& top) {
+                if (is_all(req.msg_namespace)) {
+                    auto deleted = db.delete_all(req.pubkey);
+                    service_node_.send_change_notifies(
+                            message_change::type::deleted, req.pubkey, deleted);
+                    handle_action_all_ns(
+                            mine,
+                            "deleted",
+                            std::move(deleted),
+                            req.b64,
+                            ed25519_sk_,
+                            req.pubkey.prefixed_hex(),
+                            req.timestamp);
+
+                } else {
+                    auto ns = var::get<namespace_id>(req.msg_namespace);
+                    auto deleted = db.delete_all(req.pubkey, ns);
+                    service_node_.send_change_notifies(
+                            {message_change::type::deleted, req.pubkey, ns, deleted});
+                    handle_action_one_ns(
+                            mine,
+                            "deleted",
+                            std::move(deleted),
+                            req.b64,
+                            ed25519_sk_,
+                            req.pubkey.prefixed_hex(),
+                            req.timestamp);
+                }
 
-    } else {
-        handle_action_one_ns(
-                mine,
-                "deleted",
-                service_node_.get_db().delete_all(
-                        req.pubkey, var::get<namespace_id>(req.msg_namespace)),
-                req.b64,
-                ed25519_sk_,
-                req.pubkey.prefixed_hex(),
-                req.timestamp);
-    }
-
-    if (req.recurse)
-        add_misc_response_fields(res->result, service_node_, now);
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+                if (req.recurse)
+                    add_misc_response_fields(top, service_node_, now);
+            });
 }
 
 void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<void(Response)> cb) {
@@ -890,6 +1298,7 @@ void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<vo
 
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 req.subaccount,
@@ -924,24 +1333,32 @@ void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<vo
         };
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-
-    // If we're recursive then put our stuff inside "swarm" alongside all the other results,
-    // otherwise keep it top-level
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
-
-    auto deleted = service_node_.get_db().delete_by_hash(req.pubkey, req.messages);
-    std::sort(deleted.begin(), deleted.end());
-    auto sig = create_signature(ed25519_sk_, req.pubkey.prefixed_hex(), req.messages, deleted);
-    mine["deleted"] = std::move(deleted);
-    mine["signature"] = req.b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
-    if (req.recurse)
-        add_misc_response_fields(res->result, service_node_);
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    // If we're recursive then our stuff goes inside "swarm" alongside all the other results,
+    // otherwise it stays top-level
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req)](Database& db, json& mine, json& top) {
+                auto deleted_ns = db.delete_by_hash(req.pubkey, req.messages);
+                service_node_.send_change_notifies(
+                        message_change::type::deleted, req.pubkey, deleted_ns);
+                std::vector<std::string> deleted;
+                deleted.reserve(deleted_ns.size());
+                for (auto& [ns, hash] : deleted_ns)
+                    deleted.push_back(std::move(hash));
+                std::sort(deleted.begin(), deleted.end());
+                auto sig = create_signature(
+                        ed25519_sk_, req.pubkey.prefixed_hex(), req.messages, deleted);
+                mine["deleted"] = std::move(deleted);
+                mine["signature"] = req.b64 ? util::to_base64(util::view_guts(sig))
+                                            : util::view_guts(sig);
+                if (req.recurse)
+                    add_misc_response_fields(top, service_node_);
+            });
 }
 
 void RequestHandler::process_client_req(
@@ -964,6 +1381,7 @@ void RequestHandler::process_client_req(
 
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 std::nullopt,  // no subaccount allowed
@@ -978,21 +1396,25 @@ void RequestHandler::process_client_req(
                 Response{http::UNAUTHORIZED, "revoke_subaccount signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-
-    // Put our stuff inside "swarm" alongside all the other results
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
-
-    service_node_.get_db().revoke_subaccounts(req.pubkey, req.revoke);
-    auto sig = create_signature(ed25519_sk_, req.pubkey.prefixed_hex(), req.timestamp, req.revoke);
-    mine["signature"] = req.b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
-    if (req.recurse)
-        add_misc_response_fields(res->result, service_node_);
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    // If we're recursive then our stuff goes inside "swarm" alongside all the other results,
+    // otherwise it stays top-level
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req)](Database& db, json& mine, json& top) {
+                db.revoke_subaccounts(req.pubkey, req.revoke);
+                subaccount_cache_.forget(req.revoke);
+                auto sig = create_signature(
+                        ed25519_sk_, req.pubkey.prefixed_hex(), req.timestamp, req.revoke);
+                mine["signature"] = req.b64 ? util::to_base64(util::view_guts(sig))
+                                            : util::view_guts(sig);
+                if (req.recurse)
+                    add_misc_response_fields(top, service_node_);
+            });
 }
 
 void RequestHandler::process_client_req(
@@ -1017,6 +1439,7 @@ void RequestHandler::process_client_req(
 
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 std::nullopt,  // no subaccount allowed
@@ -1031,22 +1454,24 @@ void RequestHandler::process_client_req(
                 http::UNAUTHORIZED, "unrevoke_subaccount signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-
-    // Put our stuff inside "swarm" alongside all the other results
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
-
-    mine["count"] = service_node_.get_db().unrevoke_subaccounts(req.pubkey, req.unrevoke);
-    auto sig =
-            create_signature(ed25519_sk_, req.pubkey.prefixed_hex(), req.timestamp, req.unrevoke);
-    mine["signature"] = req.b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
-    if (req.recurse)
-        add_misc_response_fields(res->result, service_node_);
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    // If we're recursive then our stuff goes inside "swarm" alongside all the other results,
+    // otherwise it stays top-level
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req)](Database& db, json& mine, json& top) {
+                mine["count"] = db.unrevoke_subaccounts(req.pubkey, req.unrevoke);
+                auto sig = create_signature(
+                        ed25519_sk_, req.pubkey.prefixed_hex(), req.timestamp, req.unrevoke);
+                mine["signature"] = req.b64 ? util::to_base64(util::view_guts(sig))
+                                            : util::view_guts(sig);
+                if (req.recurse)
+                    add_misc_response_fields(top, service_node_);
+            });
 }
 
 void RequestHandler::process_client_req(
@@ -1067,6 +1492,7 @@ void RequestHandler::process_client_req(
 
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 req.subaccount,
@@ -1080,40 +1506,46 @@ void RequestHandler::process_client_req(
         return cb(Response{http::UNAUTHORIZED, "delete_before signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-
-    // If we're recursive then put our stuff inside "swarm" alongside all the other results,
-    // otherwise keep it top-level
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
-
-    if (is_all(req.msg_namespace)) {
-        handle_action_all_ns(
-                mine,
-                "deleted",
-                service_node_.get_db().delete_by_timestamp(req.pubkey, req.before),
-                req.b64,
-                ed25519_sk_,
-                req.pubkey.prefixed_hex(),
-                req.before);
-
-    } else {
-        handle_action_one_ns(
-                mine,
-                "deleted",
-                service_node_.get_db().delete_by_timestamp(
-                        req.pubkey, var::get<namespace_id>(req.msg_namespace), req.before),
-                req.b64,
-                ed25519_sk_,
-                req.pubkey.prefixed_hex(),
-                req.before);
-    }
-    if (req.recurse)
-        add_misc_response_fields(res->result, service_node_, now);
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    // If we're recursive then our stuff goes inside "swarm" alongside all the other results,
+    // otherwise it stays top-level
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req), now](Database& db, json& mine, json& top) {
+                if (is_all(req.msg_namespace)) {
+                    auto deleted = db.delete_by_timestamp(req.pubkey, req.before);
+                    service_node_.send_change_notifies(
+                            message_change::type::deleted, req.pubkey, deleted);
+                    handle_action_all_ns(
+                            mine,
+                            "deleted",
+                            std::move(deleted),
+                            req.b64,
+                            ed25519_sk_,
+                            req.pubkey.prefixed_hex(),
+                            req.before);
+
+                } else {
+                    auto ns = var::get<namespace_id>(req.msg_namespace);
+                    auto deleted = db.delete_by_timestamp(req.pubkey, ns, req.before);
+                    service_node_.send_change_notifies(
+                            {message_change::type::deleted, req.pubkey, ns, deleted});
+                    handle_action_one_ns(
+                            mine,
+                            "deleted",
+                            std::move(deleted),
+                            req.b64,
+                            ed25519_sk_,
+                            req.pubkey.prefixed_hex(),
+                            req.before);
+                }
+                if (req.recurse)
+                    add_misc_response_fields(top, service_node_, now);
+            });
 }
 
 void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<void(Response)> cb) {
@@ -1134,6 +1566,7 @@ void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<voi
 
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 req.subaccount,
@@ -1147,39 +1580,45 @@ void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<voi
         return cb(Response{http::UNAUTHORIZED, "expire_all signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-
-    // If we're recursive then put our stuff inside "swarm" alongside all the other results,
-    // otherwise keep it top-level
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
-
-    if (is_all(req.msg_namespace)) {
-        handle_action_all_ns(
-                mine,
-                "updated",
-                service_node_.get_db().update_all_expiries(req.pubkey, req.expiry),
-                req.b64,
-                ed25519_sk_,
-                req.pubkey.prefixed_hex(),
-                req.expiry);
-    } else {
-        handle_action_one_ns(
-                mine,
-                "updated",
-                service_node_.get_db().update_all_expiries(
-                        req.pubkey, var::get<namespace_id>(req.msg_namespace), req.expiry),
-                req.b64,
-                ed25519_sk_,
-                req.pubkey.prefixed_hex(),
-                req.expiry);
-    }
-    if (req.recurse)
-        add_misc_response_fields(res->result, service_node_, now);
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    // If we're recursive then our stuff goes inside "swarm" alongside all the other results,
+    // otherwise it stays top-level
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req), now](Database& db, json& mine, json& top) {
+                if (is_all(req.msg_namespace)) {
+                    auto updated = db.update_all_expiries(req.pubkey, req.expiry);
+                    service_node_.send_change_notifies(
+                            message_change::type::expiry, req.pubkey, updated, req.expiry);
+                    handle_action_all_ns(
+                            mine,
+                            "updated",
+                            std::move(updated),
+                            req.b64,
+                            ed25519_sk_,
+                            req.pubkey.prefixed_hex(),
+                            req.expiry);
+                } else {
+                    auto ns = var::get<namespace_id>(req.msg_namespace);
+                    auto updated = db.update_all_expiries(req.pubkey, ns, req.expiry);
+                    service_node_.send_change_notifies(
+                            {message_change::type::expiry, req.pubkey, ns, updated, req.expiry});
+                    handle_action_one_ns(
+                            mine,
+                            "updated",
+                            std::move(updated),
+                            req.b64,
+                            ed25519_sk_,
+                            req.pubkey.prefixed_hex(),
+                            req.expiry);
+                }
+                if (req.recurse)
+                    add_misc_response_fields(top, service_node_, now);
+            });
 }
 
 void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<void(Response)> cb) {
@@ -1216,6 +1655,7 @@ void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<vo
 
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 req.subaccount,
@@ -1250,102 +1690,117 @@ void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<vo
         }
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-
-    // If we're recursive then put our stuff inside "swarm" alongside all the other results,
-    // otherwise keep it top-level
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
-
-    auto updated = service_node_.get_db().update_expiry(
-            req.pubkey,
-            req.messages,
-            expiry,
-            extend_only,
-            /*shorten_only=*/req.shorten);
+    auto res = setup_recursive_request(service_node_, req, std::move(cb));
+
+    // If we're recursive then our stuff goes inside "swarm" alongside all the other results,
+    // otherwise it stays top-level
+    queue_local_request(
+            service_node_,
+            true,
+            std::move(res),
+            req.recurse,
+            [this, req = std::move(req), expiry = std::move(expiry), extend_only, now](
+                    Database& db, json& mine, json& top) {
+                auto updated = db.update_expiry(
+                        req.pubkey,
+                        req.messages,
+                        expiry,
+                        extend_only,
+                        /*shorten_only=*/req.shorten);
+
+                std::sort(updated.begin(), updated.end(), [](const auto& a, const auto& b) {
+                    return a.hash < b.hash;
+                });
+
+                // One change event per namespace and new expiry:
+                std::map<namespace_id, std::map<system_clock::time_point, std::vector<std::string>>>
+                        changes;
+                for (auto& u : updated)
+                    changes[u.ns][u.expiry].push_back(u.hash);
+                for (auto& [ns, by_expiry] : changes)
+                    for (auto& [exp, hashes] : by_expiry)
+                        service_node_.send_change_notifies(
+                                {message_change::type::expiry,
+                                 req.pubkey,
+                                 ns,
+                                 std::move(hashes),
+                                 exp});
+
+                std::map<std::string, int64_t> unchanged;
+                if (req.extend || req.shorten) {
+                    std::unordered_set<std::string_view> updated_hashes;
+                    for (auto& u : updated)
+                        updated_hashes.emplace(u.hash);
+                    std::vector<std::string> unchanged_hashes;
+                    for (const auto& m : req.messages)
+                        if (!updated_hashes.count(m))
+                            unchanged_hashes.push_back(m);
+                    if (!unchanged_hashes.empty())
+                        unchanged = db.get_expiries(req.pubkey, unchanged_hashes);
+                }
 
-    std::sort(updated.begin(), updated.end(), [](const auto& a, const auto& b) {
-        return a.first < b.first;
-    });
+                std::vector<std::string> updated_hash;
+                updated_hash.reserve(updated.size());
+                for (auto& u : updated)
+                    updated_hash.push_back(std::move(u.hash));
+
+                // The signature is a little complex: if given a single expiry in the request then
+                // we always include the expiry we attempted to use in the signature, and as a
+                // single value in the returned dict, even if we updated nothing.  If given
+                // *multiple* expiries, on the other hand, then "expiry" becomes the ones that
+                // actually got applied (corresponding to the same element in the "updated"
+                // hashes), and our *signature* over expiries is those returned expiry values
+                // concatenated together.
+                std::vector<system_clock::time_point> updated_exp;
+                if (req.expiry.size() > 1) {
+                    updated_exp.reserve(updated.size());
+                    for (auto& u : updated)
+                        updated_exp.push_back(u.expiry);
+                } else {
+                    updated_exp.push_back(expiry[0]);
+                }
 
-    std::map<std::string, int64_t> unchanged;
-    if (req.extend || req.shorten) {
-        std::unordered_set<std::string_view> updated_hashes;
-        for (auto& [hash, exp] : updated)
-            updated_hashes.emplace(hash);
-        std::vector<std::string> unchanged_hashes;
-        for (const auto& m : req.messages)
-            if (!updated_hashes.count(m))
-                unchanged_hashes.push_back(m);
-        if (!unchanged_hashes.empty())
-            unchanged = service_node_.get_db().get_expiries(req.pubkey, unchanged_hashes);
-    }
-
-    std::vector<std::string> updated_hash;
-    updated_hash.reserve(updated.size());
-    for (auto& [hash, exp] : updated)
-        updated_hash.push_back(std::move(hash));
-
-    // The signature is a little complex: if given a single expiry in the request then we always
-    // include the expiry we attempted to use in the signature, and as a single value in the
-    // returned dict, even if we updated nothing.  If given *multiple* expiries, on the other hand,
-    // then "expiry" becomes the ones that actually got applied (corresponding to the same element
-    // in the "updated" hashes), and our *signature* over expiries is those returned expiry values
-    // concatenated together.
-    std::vector<system_clock::time_point> updated_exp;
-    if (req.expiry.size() > 1) {
-        updated_exp.reserve(updated.size());
-        for (auto& [hash, exp] : updated)
-            updated_exp.push_back(exp);
-    } else {
-        updated_exp.push_back(expiry[0]);
-    }
-
-    auto sig = create_signature(
-            ed25519_sk_,
-            req.pubkey.prefixed_hex(),
-            updated_exp,
-            req.messages,
-            updated_hash,
-            unchanged);
-
-    if (req.expiry.size() > 1) {
-        auto json_exp = json::array();
-        for (auto& e : updated_exp)
-            json_exp.push_back(to_epoch_ms(e));
-        mine["expiry"] = std::move(json_exp);
-    } else
-        mine["expiry"] = to_epoch_ms(expiry[0]);
-    mine["updated"] = std::move(updated_hash);
-    if (req.shorten || req.extend)
-        mine["unchanged"] = std::move(unchanged);
-    mine["signature"] = req.b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
-    if (req.recurse)
-        add_misc_response_fields(res->result, service_node_, now);
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+                auto sig = create_signature(
+                        ed25519_sk_,
+                        req.pubkey.prefixed_hex(),
+                        updated_exp,
+                        req.messages,
+                        updated_hash,
+                        unchanged);
+
+                if (req.expiry.size() > 1) {
+                    auto json_exp = json::array();
+                    for (auto& e : updated_exp)
+                        json_exp.push_back(to_epoch_ms(e));
+                    mine["expiry"] = std::move(json_exp);
+                } else
+                    mine["expiry"] = to_epoch_ms(expiry[0]);
+                mine["updated"] = std::move(updated_hash);
+                if (req.shorten || req.extend)
+                    mine["unchanged"] = std::move(unchanged);
+                mine["signature"] = req.b64 ? util::to_base64(util::view_guts(sig))
+                                            : util::view_guts(sig);
+                if (req.recurse)
+                    add_misc_response_fields(top, service_node_, now);
+            });
 }
 
-void RequestHandler::process_client_req(rpc::get_expiries&& req, std::function<void(Response)> cb) {
-    log::debug(logcat, "processing get_expiries request");
-
+std::optional<Response> RequestHandler::check_get_expiries(
+        const rpc::get_expiries& req, system_clock::time_point now) {
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return handle_wrong_swarm(req.pubkey);
 
-    auto now = system_clock::now();
     if (req.sig_ts < now - SIGNATURE_TOLERANCE || req.sig_ts > now + SIGNATURE_TOLERANCE) {
         log::debug(
                 logcat,
                 "get_expiries: invalid timestamp ({}s from now)",
                 duration_cast<seconds>(req.sig_ts - now).count());
-        return cb(Response{
-                http::NOT_ACCEPTABLE, "get_expiries timestamp too far from current time"sv});
+        return Response{http::NOT_ACCEPTABLE, "get_expiries timestamp too far from current time"sv};
     }
 
     if (!verify_signature(
                 service_node_.get_db(),
+                subaccount_cache_,
                 req.pubkey,
                 req.pubkey_ed25519,
                 req.subaccount,
@@ -1356,12 +1811,104 @@ void RequestHandler::process_client_req(rpc::get_expiries&& req, std::function<v
                 req.sig_ts,
                 req.messages)) {
         log::debug(logcat, "get_expiries: signature verification failed");
-        return cb(Response{http::UNAUTHORIZED, "get_expiries signature verification failed"sv});
+        return Response{http::UNAUTHORIZED, "get_expiries signature verification failed"sv};
     }
 
-    json res = json::object();
-    res["expiries"] = service_node_.get_db().get_expiries(req.pubkey, req.messages);
-    return cb(Response{http::OK, std::move(res)});
+    return std::nullopt;
+}
+
+void RequestHandler::process_client_req(rpc::get_expiries&& req, std::function<void(Response)> cb) {
+    log::debug(logcat, "processing get_expiries request");
+
+    if (auto error = check_get_expiries(req, system_clock::now()))
+        return cb(std::move(*error));
+
+    auto owner = req.pubkey.key();
+    bool queued = service_node_.db_executor().read(
+            [req = std::move(req), cb](Database& db) {
+                json res = json::object();
+                try {
+                    res["expiries"] = db.get_expiries(req.pubkey, req.messages);
+                } catch (const std::exception& e) {
+                    log::critical(logcat, "Could not retrieve expiries: {}", e.what());
+                    return cb(Response{
+                            http::INTERNAL_SERVER_ERROR,
+                            "Internal Server Error. Could not retrieve expiries"sv});
+                }
+                cb(Response{http::OK, std::move(res)});
+            },
+            owner);
+    if (!queued)
+        cb(owner_busy_response());
+}
+
+void RequestHandler::process_client_req(rpc::poll&& req, std::function<void(Response)> cb) {
+    log::debug(logcat, "processing poll request");
+
+    if (!service_node_.is_pubkey_for_us(req.pubkey))
+        return cb(handle_wrong_swarm(req.pubkey));
+
+    auto now = system_clock::now();
+    if (req.timestamp < now - SIGNATURE_TOLERANCE || req.timestamp > now + SIGNATURE_TOLERANCE) {
+        log::debug(
+                logcat,
+                "poll: invalid timestamp ({}s from now)",
+                duration_cast<seconds>(req.timestamp - now).count());
+        return cb(Response{http::NOT_ACCEPTABLE, "poll timestamp too far from current time"sv});
+    }
+
+    std::string namespaces;
+    bool unrevocable = true;
+    for (auto ns : req.namespaces) {
+        if (!namespaces.empty())
+            namespaces += ',';
+        namespaces += std::to_string(to_int(ns));
+        unrevocable = unrevocable && is_unrevocable_namespace(ns);
+    }
+
+    if (!verify_signature(
+                service_node_.get_db(),
+                subaccount_cache_,
+                req.pubkey,
+                req.pubkey_ed25519,
+                req.subaccount,
+                subaccount_access::Read,
+                unrevocable,
+                req.signature,
+                "poll",
+                req.timestamp,
+                namespaces)) {
+        log::debug(logcat, "poll: signature verification failed");
+        return cb(Response{http::UNAUTHORIZED, "poll signature verification failed"sv});
+    }
+
+    std::vector<Database::retrieve_request> db_reqs;
+    db_reqs.reserve(req.namespaces.size());
+    for (size_t i = 0; i < req.namespaces.size(); i++) {
+        auto& r = db_reqs.emplace_back();
+        r.ns = req.namespaces[i];
+        r.last_hash = std::move(req.last_hashes[i]);
+    }
+
+    auto owner = req.pubkey.key();
+    auto job = [this,
+                pubkey = std::move(req.pubkey),
+                db_reqs = std::move(db_reqs),
+                cb](Database& db) {
+        json res;
+        try {
+            res["counts"] = db.count_new(pubkey, db_reqs);
+        } catch (const std::exception& e) {
+            log::critical(logcat, "Could not count new messages: {}", e.what());
+            return cb(Response{
+                    http::INTERNAL_SERVER_ERROR,
+                    "Internal Server Error. Could not count new messages"sv});
+        }
+        add_misc_response_fields(res, service_node_);
+        cb(Response{http::OK, std::move(res)});
+    };
+    if (!service_node_.db_executor().read(std::move(job), owner))
+        cb(owner_busy_response());
 }
 
 void RequestHandler::process_client_req(rpc::batch&& req, std::function<void(rpc::Response)> cb) {
@@ -1374,33 +1921,116 @@ void RequestHandler::process_client_req(rpc::batch&& req, std::function<void(rpc
     // our subresults initially (with nulls) them fill in the values as they arrive.  Once we get a
     // full set of non-null values, we can then pass the final response back to `cb`.
 
-    auto subresults = std::make_shared<json>(json::array());
+    // Subresponses can arrive concurrently (from different database threads or peer replies), so
+    // the collected results need their own lock.  `remaining` counts the results still to come,
+    // so that we know when we're done without having to rescan the results each time.
+    struct batch_results {
+        std::mutex mutex;
+        json results = json::array();
+        size_t remaining;
+    };
+    auto subresults = std::make_shared<batch_results>();
     for (size_t i = 0; i < req.subreqs.size(); i++)
-        subresults->emplace_back();
+        subresults->results.emplace_back();
+    subresults->remaining = req.subreqs.size();
+
+    // Reads (retrieves and get_expiries) for the same pubkey, such as a client syncing several
+    // namespaces and checking its messages' expiries, get handled together by a single database
+    // job.  Only subrequests that are purely local database reads get merged this way: anything
+    // recursive still goes (and gets forwarded to the swarm) on its own.
+    std::unordered_map<prefixed_pubkey, std::vector<size_t>> by_owner;
+    for (size_t i = 0; i < req.subreqs.size(); i++) {
+        if (auto* r = std::get_if<rpc::retrieve>(&req.subreqs[i]))
+            by_owner[r->pubkey.key()].push_back(i);
+        else if (auto* e = std::get_if<rpc::get_expiries>(&req.subreqs[i]))
+            by_owner[e->pubkey.key()].push_back(i);
+    }
+    std::vector<bool> grouped(req.subreqs.size(), false);
+    for (auto it = by_owner.begin(); it != by_owner.end();) {
+        if (it->second.size() < 2)
+            it = by_owner.erase(it);
+        else {
+            for (auto i : it->second)
+                grouped[i] = true;
+            ++it;
+        }
+    }
 
+    auto started = steady_clock::now();
+    size_t count = req.subreqs.size();
+    std::vector<std::function<void(Response)>> handlers;
     for (size_t i = 0; i < req.subreqs.size(); i++) {
-        auto handler = [subresults, i, cb](Response r) {
-            json& subres = (*subresults)[i];
+        handlers.push_back([subresults, i, cb, started, count](Response r) {
+            std::unique_lock lock{subresults->mutex};
+            json& subres = subresults->results[i];
             subres["code"] = r.status.first;
             if (auto* j = std::get_if<json>(&r.body))
                 subres["body"] = std::move(*j);
             else
                 subres["body"] = std::string{view_body(r)};
-            bool done = true;
-            for (auto& sr : *subresults)
-                if (sr.is_null()) {
-                    done = false;
-                    break;
-                }
-            if (done)
-                cb(Response{http::OK, json({{"results", std::move(*subresults)}})});
-        };
-        var::visit(
-                [this, handler = std::move(handler)](auto&& s) {
-                    process_client_req(std::move(s), std::move(handler));
-                },
-                req.subreqs[i]);
+            if (--subresults->remaining == 0) {
+                json results{{"results", std::move(subresults->results)}};
+                lock.unlock();
+                log::debug(
+                        logcat,
+                        "Batch of {} subrequests handled in {}",
+                        count,
+                        logging::lazy([&started] {
+                            return util::friendly_duration(steady_clock::now() - started);
+                        }));
+                cb(Response{http::OK, std::move(results)});
+            }
+        });
     }
+
+    // Each subrequest (or group of reads) starts by verifying its signature, which is most of the
+    // work of getting it going, so for larger batches we hand them off to the subrequest pool to
+    // have those verifications run in parallel rather than one after another here.  The
+    // subrequests are independent of each other (each gets its own result, even when another
+    // fails authentication), so there is no ordering to preserve.
+    std::vector<std::function<void()>> jobs;
+    for (auto& [pubkey, indices] : by_owner) {
+        owner_reads reads;
+        for (auto i : indices) {
+            if (auto* r = std::get_if<rpc::retrieve>(&req.subreqs[i])) {
+                reads.retrieves.push_back(std::move(*r));
+                reads.retrieve_cbs.push_back(std::move(handlers[i]));
+            } else {
+                reads.expiries.push_back(std::move(var::get<rpc::get_expiries>(req.subreqs[i])));
+                reads.expiry_cbs.push_back(std::move(handlers[i]));
+            }
+        }
+        jobs.push_back([this, reads = std::move(reads)]() mutable {
+            process_owner_reads(std::move(reads));
+        });
+    }
+
+    for (size_t i = 0; i < req.subreqs.size(); i++) {
+        if (grouped[i])
+            continue;
+        jobs.push_back([this,
+                        subreq = std::move(req.subreqs[i]),
+                        handler = std::move(handlers[i])]() mutable {
+            var::visit(
+                    [&](auto&& s) {
+                        try {
+                            process_client_req(std::move(s), handler);
+                        } catch (const std::exception& e) {
+                            handler(Response{
+                                    http::INTERNAL_SERVER_ERROR,
+                                    "Exception caught processing subrequest: "s + e.what()});
+                        }
+                    },
+                    std::move(subreq));
+        });
+    }
+
+    if (jobs.size() < SubrequestPool::MIN_PARALLEL)
+        for (auto& job : jobs)
+            job();
+    else
+        for (auto& job : jobs)
+            subrequest_pool_.submit(std::move(job));
 }
 
 namespace {
@@ -1495,8 +2125,9 @@ void RequestHandler::process_client_req(rpc::ifelse&& req, std::function<void(rp
 }
 
 void RequestHandler::process_client_req(
-        std::string_view req_json, std::function<void(Response)> cb) {
+        std::string_view req_json, std::function<void(Response)> cb, transport via) {
     log::trace(logcat, "process_client_req str <{}>", req_json);
+    auto started = std::chrono::steady_clock::now();
 
     json body = json::parse(req_json, nullptr, false);
     if (body.is_discarded()) {
@@ -1504,9 +2135,10 @@ void RequestHandler::process_client_req(
         return cb(Response{http::BAD_REQUEST, "invalid json"sv});
     }
 
-#ifndef NDEBUG
-    log::trace(logcat, "process_client_req json <{}>", body.dump(2));
-#endif
+    log::trace(
+            logcat,
+            "process_client_req json <{}>",
+            logging::lazy([&body] { return body.dump(2); }));
 
     const auto method_it = body.find("method");
     if (method_it == body.end() || !method_it->is_string()) {
@@ -1518,21 +2150,40 @@ void RequestHandler::process_client_req(
 
     log::trace(logcat, "  - method name: {}", method_name);
 
+    std::shared_ptr<RequestTrace> trace;
+    if (auto it = client_rpc_endpoints.find(method_name); it != client_rpc_endpoints.end()) {
+        trace = tracer_.start(it->first, via);
+        cb = [this, name = it->first, via, started, trace, cb = std::move(cb)](Response res) {
+            auto status = res.status.first;
+            metrics_.record(name, via, std::chrono::steady_clock::now() - started, status);
+            cb(std::move(res));
+            // The transport serializes the response in the callback, before sending it
+            trace_mark(trace, trace_phase::encoded);
+            tracer_.finish(trace, status);
+        };
+    }
+
+    if (!admission_.admit(AdmissionControl::classify(method_name)))
+        return cb(shed_response());
+
     auto params_it = body.find("params");
     if (params_it == body.end() || !params_it->is_object()) {
         log::debug(logcat, "Bad client request: no params field");
         return cb(Response{http::BAD_REQUEST, "invalid json: no `params` field"sv});
     }
 
-    process_client_req(method_name, std::move(*params_it), std::move(cb));
+    process_client_req(method_name, std::move(*params_it), std::move(cb), std::move(trace));
 }
 
 void RequestHandler::process_client_req(
-        std::string_view method_name, json params, std::function<void(Response)> cb) {
+        std::string_view method_name,
+        json params,
+        std::function<void(Response)> cb,
+        std::shared_ptr<RequestTrace> trace) {
     if (auto it = client_rpc_endpoints.find(method_name); it != client_rpc_endpoints.end()) {
         log::debug(logcat, "Process client request: {}", method_name);
         try {
-            return it->second.http_json(*this, std::move(params), cb);
+            return it->second.http_json(*this, std::move(params), std::move(trace), cb);
         } catch (const rpc::parse_error& e) {
             // These exceptions carry a failure message to send back to the client
             log::debug(logcat, "Invalid request: {}", e.what());
@@ -1550,12 +2201,17 @@ void RequestHandler::process_client_req(
 }
 
 Response RequestHandler::process_retrieve_all() {
+    static auto& retrieve_all_memory = util::get_memory_counter("retrieve_all");
     std::vector<message> msgs;
     try {
         msgs = service_node_.get_db().retrieve_all();
     } catch (const std::exception& e) {
         return {http::INTERNAL_SERVER_ERROR, "could not retrieve all messages"s};
     }
+    int64_t bytes = 0;
+    for (const auto& m : msgs)
+        bytes += m.data.size();
+    util::tracked_memory held{retrieve_all_memory, bytes};
 
     json messages = json::array();
     for (auto& m : msgs)
@@ -1614,27 +2270,47 @@ void RequestHandler::process_storage_test_req(
     }
 }
 
-Response RequestHandler::wrap_proxy_response(
+Response wrap_proxy_response(
         Response res,
+        const crypto::ChannelEncryption& cipher,
         const crypto::x25519_pubkey& client_key,
         crypto::EncryptType enc_type,
         bool embed_json,
-        bool base64) const {
+        bool base64,
+        bool bt) {
     int status = res.status.first;
     std::string body;
+    if (bt) {
+        // The body goes in as raw bytes: no json escaping, no double encoding, and no base64 of
+        // the encrypted result.
+        oxenc::bt_dict_producer out;
+        if (auto* j = std::get_if<json>(&res.body))
+            out.append("b", j->dump());
+        else
+            out.append("b", view_body(res));
+        out.append("s", status);
+        return Response{
+                http::OK, cipher.encrypt(enc_type, std::move(out).str(), client_key)};
+    }
     if (std::holds_alternative<std::string>(res.body))
         body = json{{"status", status}, {"body", std::move(std::get<std::string>(res.body))}}
                        .dump();
     else if (std::holds_alternative<std::string_view>(res.body))
         body = json{{"status", status}, {"body", std::get<std::string_view>(res.body)}}.dump();
+    else if (auto* e = std::get_if<encoded_body>(&res.body)) {
+        if (embed_json && !e->bt)
+            body = R"({{"body":{},"status":{}}})"_format(e->data, status);
+        else
+            body = json{{"status", status}, {"body", std::move(e->data)}}.dump();
+    }
     else if (embed_json)
         body = json{{"status", status}, {"body", std::move(std::get<json>(res.body))}}.dump();
     else  // Yuck: double-encoded json
         body = json{{"status", status}, {"body", std::get<json>(res.body).dump()}}.dump();
 
-    std::string ciphertext = channel_cipher_.encrypt(enc_type, body, client_key);
+    std::string ciphertext = cipher.encrypt(enc_type, body, client_key);
     if (base64)
-        ciphertext = oxenc::to_base64(std::move(ciphertext));
+        ciphertext = util::to_base64(ciphertext);
 
     return Response{http::OK, std::move(ciphertext)};
 }
@@ -1649,9 +2325,26 @@ void RequestHandler::process_onion_req(std::string_view ciphertext, OnionRequest
 
     service_node_.record_onion_request();
 
-    var::visit(
-            [&](auto&& x) { process_onion_req(std::move(x), std::move(data)); },
-            process_ciphertext_v2(channel_cipher_, ciphertext, data.ephem_key, data.enc_type));
+    if (!admission_.admit(request_class::onion))
+        return data.cb(shed_response());
+
+    // If we're too far behind on decryptions already then refuse the request outright, rather than
+    // queuing it to be answered after the client has likely given up on it.
+    auto shed = [cb = data.cb] {
+        log::debug(logcat, "Onion request shed: crypto queue is full");
+        cb({http::SERVICE_UNAVAILABLE, "Snode overloaded"sv});
+    };
+    static auto& onion_memory = util::get_memory_counter("onion_queue");
+    auto held = std::make_shared<util::tracked_memory>(onion_memory, ciphertext.size());
+    onion_crypto_.submit(
+            OnionCryptoPool::stage::decrypt,
+            [this, ciphertext = std::string{ciphertext}, data = std::move(data), held]() mutable {
+                var::visit(
+                        [&](auto&& x) { process_onion_req(std::move(x), std::move(data)); },
+                        process_ciphertext_v2(
+                                channel_cipher_, ciphertext, data.ephem_key, data.enc_type));
+            },
+            std::move(shed));
 }
 
 void RequestHandler::process_onion_req(FinalDestinationInfo&& info, OnionRequestMetadata&& data) {
@@ -1660,17 +2353,36 @@ void RequestHandler::process_onion_req(FinalDestinationInfo&& info, OnionRequest
     if (!service_node_.snode_ready())
         return data.cb(wrap_proxy_response(
                 {http::SERVICE_UNAVAILABLE, "Snode not ready"s},
+                channel_cipher_,
                 data.ephem_key,
                 data.enc_type,
                 info.json,
-                info.base64));
+                info.base64,
+                info.bt));
 
     process_client_req(
             info.body,
-            [this, data = std::move(data), json = info.json, b64 = info.base64](rpc::Response res) {
-                data.cb(wrap_proxy_response(
-                        std::move(res), data.ephem_key, data.enc_type, json, b64));
-            });
+            [this, data = std::move(data), json = info.json, b64 = info.base64, bt = info.bt](
+                    rpc::Response res) mutable {
+                onion_crypto_.submit(
+                        OnionCryptoPool::stage::encrypt,
+                        [this,
+                         data = std::move(data),
+                         json,
+                         b64,
+                         bt,
+                         res = std::move(res)]() mutable {
+                            data.cb(wrap_proxy_response(
+                                    std::move(res),
+                                    channel_cipher_,
+                                    data.ephem_key,
+                                    data.enc_type,
+                                    json,
+                                    b64,
+                                    bt));
+                        });
+            },
+            transport::onion);
 }
 
 void RequestHandler::process_onion_req(RelayToNodeInfo&& info, OnionRequestMetadata&& data) {
@@ -1726,7 +2438,10 @@ void RequestHandler::process_onion_req(RelayToServerInfo&& info, OnionRequestMet
     if (!(info.protocol == "http" || info.protocol == "https") ||
         !is_onion_url_target_allowed(info.target))
         return data.cb(wrap_proxy_response(
-                {http::BAD_REQUEST, "Invalid url"s}, data.ephem_key, data.enc_type));
+                {http::BAD_REQUEST, "Invalid url"s},
+                channel_cipher_,
+                data.ephem_key,
+                data.enc_type));
 
     std::string urlstr;
     urlstr.reserve(
@@ -1784,7 +2499,10 @@ void RequestHandler::process_onion_req(
             return data.cb({http::BAD_REQUEST, "Invalid ciphertext"s});
         case ProcessCiphertextError::INVALID_JSON:
             return data.cb(wrap_proxy_response(
-                    {http::BAD_REQUEST, "Invalid json"s}, data.ephem_key, data.enc_type));
+                    {http::BAD_REQUEST, "Invalid json"s},
+                    channel_cipher_,
+                    data.ephem_key,
+                    data.enc_type));
     }
 }
 
@@ -1,23 +1,34 @@
 #pragma once
 
 #include <oxenss/crypto/channel_encryption.hpp>
+#include "cached_responses.h"
 #include "client_rpc_endpoints.h"
+#include "onion_crypto_pool.h"
 #include "onion_processing.h"
+#include "admission_control.h"
+#include "request_metrics.h"
+#include "request_trace.h"
+#include "response_compressor.h"
+#include "subrequest_pool.h"
 #include <oxenc/bt_serialize.h>
 #include <oxenss/crypto/keys.h>
+#include <oxenss/crypto/subaccount.h>
 #include <oxenss/snode/service_node.h>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/server/utils.h>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/http/http_client.h>
 
+#include <array>
 #include <chrono>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <type_traits>
 #include <variant>
 
 #include <nlohmann/json_fwd.hpp>
+#include <sodium/crypto_generichash.h>
 
 namespace oxenss::rpc {
 
@@ -57,34 +68,56 @@ inline constexpr auto SIGNATURE_TOLERANCE_FORWARDED = 70s;
 // (7864320).  We allow for some response overhead, which lands us on this effective maximum:
 inline constexpr int RETRIEVE_MAX_SIZE = 7'800'000;
 
+// Maximum time a long-polling retrieve (i.e. one with `wait` set) is held for new messages.
+inline constexpr auto RETRIEVE_MAX_WAIT = 30s;
+
+// Maximum number of namespaces that can be checked in a single `poll` request
+inline constexpr size_t POLL_MAX_NAMESPACES = 32;
+
 // Maximum subrequests that can be stuffed into a single batch request
 inline constexpr size_t BATCH_REQUEST_MAX = 20;
 
+// A response body that the handler has already serialized, as json or as bt-encoded data; this is
+// only returned for requests with `encoded_response` set.
+struct encoded_body {
+    std::string data;
+    bool bt = false;
+};
+
 // Simpler wrapper that works for most of our responses
 struct Response {
     http::response_code status = http::OK;
-    std::variant<std::string, std::string_view, nlohmann::json> body;
+    std::variant<std::string, std::string_view, nlohmann::json, encoded_body> body;
     std::vector<std::pair<std::string, std::string>> headers;
 
     Response() = default;
     Response(
             http::response_code status,
-            std::variant<std::string, std::string_view, nlohmann::json> body = ""sv,
+            std::variant<std::string, std::string_view, nlohmann::json, encoded_body> body = ""sv,
             std::vector<std::pair<std::string, std::string>> headers = {}) :
             status{status}, body{std::move(body)}, headers{std::move(headers)} {}
 };
 
-// Views the string or string_view body inside a Response.  Should only be called when the body
-// has already been verified to not contain a json object.
+// Views the string, string_view, or encoded body inside a Response.  Should only be called when
+// the body has already been verified to not contain a json object.
 inline std::string_view view_body(const Response& r) {
     assert(!std::holds_alternative<nlohmann::json>(r.body));
     if (auto* sv = std::get_if<std::string_view>(&r.body))
         return *sv;
     if (auto* s = std::get_if<std::string>(&r.body))
         return *s;
+    if (auto* e = std::get_if<encoded_body>(&r.body))
+        return e->data;
     return "(internal error)"sv;
 }
 
+// Returns true if the Response body is json, either as a json object or as already-encoded json.
+inline bool is_json_body(const Response& r) {
+    if (auto* e = std::get_if<encoded_body>(&r.body))
+        return !e->bt;
+    return std::holds_alternative<nlohmann::json>(r.body);
+}
+
 std::string to_string(const Response& res);
 
 namespace detail {
@@ -134,9 +167,74 @@ std::string compute_hash(Func hasher, const T&... args) {
     return hasher({detail::to_hashable(args, b)...});
 }
 
-/// Computes a message hash using blake2b hash of various messages attributes.
+/// Size of a raw message hash, and of its (unpadded) base64 encoding.
+inline constexpr size_t MESSAGE_HASH_SIZE = 32;
+inline constexpr size_t MESSAGE_HASH_B64_SIZE = 43;
+
+/// A raw (binary) message hash.
+using message_hash = std::array<unsigned char, MESSAGE_HASH_SIZE>;
+
+/// Incremental blake2b hasher producing a message_hash.  `update()` takes the same argument types
+/// as `compute_hash` (strings, integers, and clock values), converting any integer values into
+/// a stack buffer sized at compile time, so hashing never allocates.
+class blake2b_hasher {
+    crypto_generichash_state state_;
+
+  public:
+    blake2b_hasher() { crypto_generichash_init(&state_, nullptr, 0, MESSAGE_HASH_SIZE); }
+
+    template <typename... T>
+    blake2b_hasher& update(const T&... parts) {
+        std::array<
+                char,
+                (0 + ... +
+                 (std::is_integral_v<T> || std::is_same_v<T, std::chrono::system_clock::time_point>
+                          ? 20
+                          : 0))>
+                buffer;
+        [[maybe_unused]] auto* b = buffer.data();
+        (append(detail::to_hashable(parts, b)), ...);
+        return *this;
+    }
+
+    // Returns the final hash.  The hasher must not be used after calling this.
+    message_hash finalize() {
+        message_hash hash;
+        crypto_generichash_final(&state_, hash.data(), hash.size());
+        return hash;
+    }
+
+  private:
+    void append(std::string_view part) {
+        crypto_generichash_update(
+                &state_, reinterpret_cast<const unsigned char*>(part.data()), part.size());
+    }
+};
+
+/// Writes the unpadded base64 encoding of `hash` into `out`, and returns a view of it.
+std::string_view message_hash_b64(
+        const message_hash& hash, std::array<char, MESSAGE_HASH_B64_SIZE + 1>& out);
+
+/// Computes the raw blake2b message hash of a message's attributes.
+message_hash compute_message_hash(
+        const user_pubkey& pubkey, namespace_id ns, std::string_view data);
+
+/// Computes a message hash using blake2b hash of various messages attributes, returning it in
+/// unpadded base64.
 std::string computeMessageHash(const user_pubkey& pubkey, namespace_id ns, std::string_view data);
 
+/// Wraps response `res` to an onion request for the intermediate node, encrypted with `cipher` for
+/// the client's `client_key`.  `json`, `base64` and `bt` are the response format options requested
+/// by the client (see FinalDestinationInfo).
+Response wrap_proxy_response(
+        Response res,
+        const crypto::ChannelEncryption& cipher,
+        const crypto::x25519_pubkey& client_key,
+        crypto::EncryptType enc_type,
+        bool json = false,
+        bool base64 = true,
+        bool bt = false);
+
 struct OnionRequestMetadata {
     crypto::x25519_pubkey ephem_key;
     std::function<void(Response)> cb;
@@ -151,17 +249,68 @@ class RequestHandler {
     const crypto::ed25519_seckey ed25519_sk_;
     std::weak_ptr<http::Client> http_;
 
-    // Wrap response `res` to an intermediate node
-    Response wrap_proxy_response(
-            Response res,
-            const crypto::x25519_pubkey& client_key,
-            crypto::EncryptType enc_type,
-            bool json = false,
-            bool base64 = true) const;
+    // Subaccount tokens whose owner signatures we have already verified.
+    SubaccountCache subaccount_cache_;
+
+    // Pre-encoded get_swarm and info responses, rebuilt on each swarm update.
+    CachedResponses cached_responses_;
+
+    // Compresses large client responses for clients that ask for it.
+    ResponseCompressor compressor_;
+
+    // Decides which requests to shed when we are overloaded.
+    AdmissionControl admission_;
+
+    // Latencies and results of client requests, by endpoint and transport.
+    RequestMetrics metrics_;
+
+    // Sampled (and slow) client request phase traces.
+    RequestTracer tracer_;
+
+    // Handles the subrequests of larger batch requests (and so verifies their signatures)
+    // concurrently.  Declared after everything that the subrequests use, so that its threads are
+    // stopped before those are destroyed.
+    SubrequestPool subrequest_pool_;
+
+    // Decrypts incoming onion requests, and encrypts the responses to them, off of the receiving
+    // threads.  Declared last so that its threads are stopped first on destruction.
+    OnionCryptoPool onion_crypto_;
 
     // Return the correct swarm for `pubKey`
     Response handle_wrong_swarm(const user_pubkey& pubKey);
 
+    // Checks that a retrieve request is for our swarm and properly authenticated, and normalizes
+    // its count and size limits.  Returns an error response if the request should be refused.
+    std::optional<Response> check_retrieve(
+            rpc::retrieve& req, std::chrono::system_clock::time_point now);
+
+    // Handles a retrieve request whose response can be returned pre-encoded (i.e. with
+    // `encoded_response` set), serializing the retrieved messages straight into the response.
+    void process_encoded_retrieve(
+            rpc::retrieve&& req,
+            std::function<void(Response)> cb,
+            std::chrono::system_clock::time_point now);
+
+    // Checks that a get_expiries request is for our swarm and properly authenticated.  Returns an
+    // error response if the request should be refused.
+    std::optional<Response> check_get_expiries(
+            const rpc::get_expiries& req, std::chrono::system_clock::time_point now);
+
+    // The retrieve and get_expiries subrequests of a batch that all target the same pubkey, along
+    // with the callbacks to invoke with their individual responses.
+    struct owner_reads {
+        std::vector<rpc::retrieve> retrieves;
+        std::vector<std::function<void(Response)>> retrieve_cbs;
+        std::vector<rpc::get_expiries> expiries;
+        std::vector<std::function<void(Response)>> expiry_cbs;
+
+        size_t size() const { return retrieves.size() + expiries.size(); }
+    };
+
+    // Handles several read requests for the same pubkey (e.g. from a batch request) with a single
+    // database job: one connection, transaction, and owner lookup for all of them.
+    void process_owner_reads(owner_reads&& reads);
+
     // ===== Session Client Requests =====
 
     // Similar to `handle_wrong_swarm`; but used when the swarm is requested
@@ -180,12 +329,48 @@ class RequestHandler {
     RequestHandler(
             snode::ServiceNode& sn,
             const crypto::ChannelEncryption& ce,
-            crypto::ed25519_seckey ed_sk);
+            crypto::ed25519_seckey ed_sk,
+            unsigned onion_threads = OnionCryptoPool::DEFAULT_THREADS,
+            std::chrono::milliseconds shed_target = AdmissionControl::DEFAULT_TARGET,
+            double trace_sample_rate = 0,
+            std::chrono::milliseconds trace_slow = RequestTracer::DEFAULT_SLOW);
+
+    ~RequestHandler();
+
+    // Finishes any queued onion request and batch subrequest work and stops the threads doing it;
+    // requests received after this are handled on the receiving thread.  This should be called
+    // before shutting down the servers that the onion responses get sent back through.
+    void shutdown();
 
     // Sets the http client needed to perform proxied onion requests.  This must be set up before
     // incoming requests are accepted.
     void set_http_client(std::weak_ptr<http::Client> client) { http_ = std::move(client); }
 
+    // The compressor the servers use for client responses (so that its stats cover them all).
+    ResponseCompressor& compressor() { return compressor_; }
+
+    // The admission control for incoming requests.  Client rpc and onion requests are checked
+    // against it here; the servers also check it before queuing requests (so that requests that
+    // would be shed anyway don't take up queue space), and report their queue waits to it.
+    AdmissionControl& admission() { return admission_; }
+
+    // The response to send for a request refused by admission(): a 503 with a Retry-After.
+    static Response shed_response();
+
+    // The response to send for a request refused because its account already has as many database
+    // jobs waiting as we allow one account (see `database_options::owner_max_jobs`): a 429.
+    static Response owner_busy_response();
+
+    // The client request metrics.  Requests that come through process_client_req(req_json, ...)
+    // are recorded here; the OMQ and QUIC servers, which call the endpoint handlers directly,
+    // record their own.
+    RequestMetrics& metrics() { return metrics_; }
+
+    // The client request tracer.  As with metrics(), requests through process_client_req(req_json,
+    // ...) are traced here, and the OMQ and QUIC servers trace their own; the trace is then passed
+    // to the endpoint handler to mark the phases it reaches.
+    RequestTracer& tracer() { return tracer_; }
+
     // Handlers for parsed client requests
     void process_client_req(rpc::store&& req, std::function<void(Response)> cb);
     void process_client_req(rpc::retrieve&& req, std::function<void(Response)> cb);
@@ -198,6 +383,7 @@ class RequestHandler {
     void process_client_req(rpc::expire_all&&, std::function<void(Response)> cb);
     void process_client_req(rpc::expire_msgs&&, std::function<void(Response)> cb);
     void process_client_req(rpc::get_expiries&&, std::function<void(Response)> cb);
+    void process_client_req(rpc::poll&&, std::function<void(Response)> cb);
     void process_client_req(rpc::batch&&, std::function<void(Response)> cb);
     void process_client_req(rpc::sequence&&, std::function<void(Response)> cb);
     void process_client_req(rpc::ifelse&&, std::function<void(Response)> cb);
@@ -207,12 +393,17 @@ class RequestHandler {
     struct rpc_handler {
         std::function<client_request(std::variant<nlohmann::json, oxenc::bt_dict_consumer> params)>
                 load_req;
-        std::function<void(RequestHandler&, nlohmann::json, std::function<void(Response)>)>
+        std::function<void(
+                RequestHandler&,
+                nlohmann::json,
+                std::shared_ptr<RequestTrace> trace,
+                std::function<void(Response)>)>
                 http_json;
         std::function<void(
                 RequestHandler&,
                 std::string_view params,
                 bool recurse,
+                std::shared_ptr<RequestTrace> trace,
                 std::function<void(Response)>)>
                 mq;
     };
@@ -223,13 +414,19 @@ class RequestHandler {
 
     // Process a client request taking encoded json to be parsed containing something like
     // `{"method": "abc", "params": {"some_arg": 1}}`, dispatching to the appropriate request
-    // handler.
-    void process_client_req(std::string_view req_json, std::function<void(Response)> cb);
+    // handler.  `via` is the transport the request arrived on, for metrics().
+    void process_client_req(
+            std::string_view req_json,
+            std::function<void(Response)> cb,
+            transport via = transport::https);
 
     // Processes a pre-parsed client request taking the method name ("store", "retrieve", etc.)
-    // and the json params object.
+    // and the json params object.  `trace`, if given, is the trace of the request.
     void process_client_req(
-            std::string_view method, nlohmann::json params, std::function<void(Response)> cb);
+            std::string_view method,
+            nlohmann::json params,
+            std::function<void(Response)> cb,
+            std::shared_ptr<RequestTrace> trace = nullptr);
 
     // Processes a swarm test request; if it succeeds the callback is immediately invoked,
     // otherwise the test is scheduled for retries for some time until it succeeds, fails, or
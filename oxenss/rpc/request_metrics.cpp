@@ -0,0 +1,242 @@
+#include "request_metrics.h"
+
+#include <oxenss/utils/lock_profiler.hpp>
+
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+
+#include <iterator>
+
+namespace oxenss::rpc {
+
+std::string_view to_string(transport t) {
+    switch (t) {
+        case transport::https: return "https";
+        case transport::omq: return "omq";
+        case transport::quic: return "quic";
+        case transport::onion: return "onion";
+    }
+    return "unknown";
+}
+
+static std::string_view to_string(RequestMetrics::result r) {
+    switch (r) {
+        case RequestMetrics::result::ok: return "ok";
+        case RequestMetrics::result::client_error: return "client_error";
+        case RequestMetrics::result::server_error: return "server_error";
+    }
+    return "unknown";
+}
+
+void request_histogram::add(std::chrono::steady_clock::duration d) {
+    size_t i = 0;
+    while (i < BOUNDS.size() && d > BOUNDS[i])
+        i++;
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us.fetch_add(
+            std::chrono::duration_cast<std::chrono::microseconds>(d).count(),
+            std::memory_order_relaxed);
+}
+
+uint64_t request_histogram::count() const {
+    uint64_t n = 0;
+    for (auto& c : counts)
+        n += c.load(std::memory_order_relaxed);
+    return n;
+}
+
+RequestMetrics::RequestMetrics(const std::vector<std::string_view>& endpoints) {
+    endpoints_.reserve(endpoints.size());
+    for (auto name : endpoints)
+        endpoints_.try_emplace(name);
+}
+
+void RequestMetrics::record(
+        std::string_view endpoint,
+        transport via,
+        std::chrono::steady_clock::duration elapsed,
+        int status) {
+    auto it = endpoints_.find(endpoint);
+    if (it == endpoints_.end())
+        return;
+    auto t = static_cast<size_t>(via);
+    it->second.latency[t].add(elapsed);
+    auto r = status >= 500 ? result::server_error
+           : status >= 400 ? result::client_error
+                           : result::ok;
+    it->second.results[t][static_cast<size_t>(r)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void RequestMetrics::write_prometheus(std::string& out) const {
+    auto o = std::back_inserter(out);
+
+    fmt::format_to(
+            o,
+            "# HELP oxenss_rpc_request_duration_seconds Time from receipt to response of client "
+            "RPC requests\n"
+            "# TYPE oxenss_rpc_request_duration_seconds histogram\n");
+    for (auto& [name, m] : endpoints_) {
+        for (size_t t = 0; t < NUM_TRANSPORTS; t++) {
+            auto& h = m.latency[t];
+            auto total = h.count();
+            if (total == 0)
+                continue;
+            auto labels = fmt::format(
+                    "endpoint=\"{}\",transport=\"{}\"", name, to_string(static_cast<transport>(t)));
+            // Prometheus histogram buckets are cumulative
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < request_histogram::BOUNDS.size(); i++) {
+                cumulative += h.counts[i].load(std::memory_order_relaxed);
+                fmt::format_to(
+                        o,
+                        "oxenss_rpc_request_duration_seconds_bucket{{{},le=\"{}\"}} {}\n",
+                        labels,
+                        request_histogram::BOUNDS[i].count() / 1e6,
+                        cumulative);
+            }
+            cumulative += h.counts.back().load(std::memory_order_relaxed);
+            fmt::format_to(
+                    o,
+                    "oxenss_rpc_request_duration_seconds_bucket{{{},le=\"+Inf\"}} {}\n"
+                    "oxenss_rpc_request_duration_seconds_sum{{{}}} {}\n"
+                    "oxenss_rpc_request_duration_seconds_count{{{}}} {}\n",
+                    labels,
+                    cumulative,
+                    labels,
+                    h.sum_us.load(std::memory_order_relaxed) / 1e6,
+                    labels,
+                    cumulative);
+        }
+    }
+
+    fmt::format_to(
+            o,
+            "# HELP oxenss_rpc_responses_total Client RPC responses, by result\n"
+            "# TYPE oxenss_rpc_responses_total counter\n");
+    for (auto& [name, m] : endpoints_) {
+        for (size_t t = 0; t < NUM_TRANSPORTS; t++) {
+            if (m.latency[t].count() == 0)
+                continue;
+            for (size_t r = 0; r < NUM_RESULTS; r++)
+                fmt::format_to(
+                        o,
+                        "oxenss_rpc_responses_total"
+                        "{{endpoint=\"{}\",transport=\"{}\",result=\"{}\"}} {}\n",
+                        name,
+                        to_string(static_cast<transport>(t)),
+                        to_string(static_cast<result>(r)),
+                        m.results[t][r].load(std::memory_order_relaxed));
+        }
+    }
+}
+
+namespace {
+
+    // Replaces anything not allowed in a Prometheus metric name with _
+    std::string metric_name(std::string_view key) {
+        std::string name{"oxenss_"};
+        for (char c : key)
+            name += (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                          ? c
+                          : '_';
+        return name;
+    }
+
+    // Escapes a Prometheus label value
+    std::string label_value(std::string_view val) {
+        std::string escaped;
+        escaped.reserve(val.size());
+        for (char c : val) {
+            if (c == '\\' || c == '"')
+                escaped += '\\';
+            if (c == '\n')
+                escaped += "\\n";
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+
+    bool is_metric(const nlohmann::json& val) {
+        return val.is_number() || val.is_boolean();
+    }
+
+    double metric_value(const nlohmann::json& val) {
+        return val.is_boolean() ? val.get<bool>() : val.get<double>();
+    }
+
+}  // namespace
+
+void write_prometheus_stats(std::string& out, const nlohmann::json& stats) {
+    if (!stats.is_object())
+        return;
+    auto o = std::back_inserter(out);
+    for (auto& [key, val] : stats.items()) {
+        if (is_metric(val)) {
+            auto name = metric_name(key);
+            fmt::format_to(o, "# TYPE {} untyped\n{} {}\n", name, name, metric_value(val));
+        } else if (val.is_object() && !val.empty()) {
+            bool all_metrics = true;
+            for (auto& v : val)
+                all_metrics = all_metrics && is_metric(v);
+            if (!all_metrics)
+                continue;
+            auto name = metric_name(key);
+            fmt::format_to(o, "# TYPE {} untyped\n", name);
+            for (auto& [k, v] : val.items())
+                fmt::format_to(o, "{}{{key=\"{}\"}} {}\n", name, label_value(k), metric_value(v));
+        }
+    }
+}
+
+void write_prometheus_locks(std::string& out) {
+    if (!util::lock_profiling())
+        return;
+    auto o = std::back_inserter(out);
+    fmt::format_to(
+            o,
+            "# HELP oxenss_lock_wait_seconds Time spent waiting for contended locks\n"
+            "# TYPE oxenss_lock_wait_seconds histogram\n");
+    util::for_each_lock_profile([&o](const util::lock_profile& p) {
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < util::lock_profile::WAIT_BOUNDS.size(); i++) {
+            cumulative += p.waits[i].load(std::memory_order_relaxed);
+            fmt::format_to(
+                    o,
+                    "oxenss_lock_wait_seconds_bucket{{lock=\"{}\",le=\"{}\"}} {}\n",
+                    p.name,
+                    util::lock_profile::WAIT_BOUNDS[i].count() / 1e6,
+                    cumulative);
+        }
+        cumulative += p.waits.back().load(std::memory_order_relaxed);
+        fmt::format_to(
+                o,
+                "oxenss_lock_wait_seconds_bucket{{lock=\"{}\",le=\"+Inf\"}} {}\n"
+                "oxenss_lock_wait_seconds_sum{{lock=\"{}\"}} {}\n"
+                "oxenss_lock_wait_seconds_count{{lock=\"{}\"}} {}\n",
+                p.name,
+                cumulative,
+                p.name,
+                p.wait_us.load(std::memory_order_relaxed) / 1e6,
+                p.name,
+                cumulative);
+    });
+    fmt::format_to(o, "# TYPE oxenss_lock_acquisitions_total counter\n");
+    util::for_each_lock_profile([&o](const util::lock_profile& p) {
+        fmt::format_to(
+                o,
+                "oxenss_lock_acquisitions_total{{lock=\"{}\"}} {}\n",
+                p.name,
+                p.acquisitions.load(std::memory_order_relaxed));
+    });
+    fmt::format_to(o, "# TYPE oxenss_lock_max_hold_seconds gauge\n");
+    util::for_each_lock_profile([&o](const util::lock_profile& p) {
+        fmt::format_to(
+                o,
+                "oxenss_lock_max_hold_seconds{{lock=\"{}\"}} {}\n",
+                p.name,
+                p.max_hold_us.load(std::memory_order_relaxed) / 1e6);
+    });
+}
+
+}  // namespace oxenss::rpc
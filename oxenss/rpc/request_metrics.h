@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace oxenss::rpc {
+
+using namespace std::literals;
+
+// How a client request reached us.  Onion requests are client requests that arrived (wrapped) in
+// an onion request for which we are the final destination.
+enum class transport : uint8_t { https, omq, quic, onion };
+inline constexpr size_t NUM_TRANSPORTS = 4;
+
+std::string_view to_string(transport t);
+
+// Lock-free request latency histogram: recording is a couple of relaxed atomic increments, so it
+// can be done from any thread without contention.
+struct request_histogram {
+    // Upper bounds of the buckets (the last, implicit bucket is everything beyond these); these
+    // are the usual Prometheus bucket sizes, reaching down to sub-millisecond requests.
+    static constexpr std::array<std::chrono::microseconds, 14> BOUNDS{
+            500us, 1ms, 2500us, 5ms, 10ms, 25ms, 50ms, 100ms, 250ms, 500ms, 1s, 2500ms, 5s, 10s};
+
+    std::array<std::atomic<uint64_t>, BOUNDS.size() + 1> counts{};
+    std::atomic<uint64_t> sum_us{0};
+
+    void add(std::chrono::steady_clock::duration d);
+
+    uint64_t count() const;
+};
+
+// Per-endpoint and per-transport latencies and response counts of client RPC requests.
+class RequestMetrics {
+  public:
+    // The response classes we count: success (anything below 400), client errors (4xx, which
+    // includes rate limiting and wrong swarm responses), and server errors (5xx, which includes
+    // shed requests).
+    enum class result : uint8_t { ok, client_error, server_error };
+    static constexpr size_t NUM_RESULTS = 3;
+
+    // Takes the names of all the endpoints to track; requests for any other name are ignored.
+    explicit RequestMetrics(const std::vector<std::string_view>& endpoints);
+
+    // Records a completed request to `endpoint`, received over `via`, that took `elapsed` from
+    // receipt to response, and got a response with HTTP status code `status`.
+    void record(
+            std::string_view endpoint,
+            transport via,
+            std::chrono::steady_clock::duration elapsed,
+            int status);
+
+    // Appends the metrics, in Prometheus text exposition format, to `out`.  Endpoint/transport
+    // combinations that haven't seen any requests are omitted.
+    void write_prometheus(std::string& out) const;
+
+  private:
+    struct endpoint_metrics {
+        std::array<request_histogram, NUM_TRANSPORTS> latency;
+        std::array<std::array<std::atomic<uint64_t>, NUM_RESULTS>, NUM_TRANSPORTS> results{};
+    };
+
+    // Built at construction, and never modified after that (so lookups need no locking).  The
+    // keys must outlive us: they are the names in RequestHandler::client_rpc_endpoints.
+    std::unordered_map<std::string_view, endpoint_metrics> endpoints_;
+};
+
+// Appends the numeric values of a get_stats() object to `out` as Prometheus "untyped" metrics
+// named oxenss_KEY.  Nested objects of numeric values become one metric with the nested keys
+// as its `key` label; arrays, strings and other nested values are skipped.
+void write_prometheus_stats(std::string& out, const nlohmann::json& stats);
+
+// Appends the lock profiles (see util::profiled_mutex), if lock profiling is enabled, to `out` as
+// Prometheus metrics: the contended acquisition wait times as a histogram, plus acquisition counts
+// and the longest hold time of each lock.
+void write_prometheus_locks(std::string& out);
+
+}  // namespace oxenss::rpc
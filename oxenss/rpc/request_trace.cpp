@@ -0,0 +1,110 @@
+#include "request_trace.h"
+
+#include <oxenss/utils/time.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace oxenss::rpc {
+
+std::string_view to_string(trace_phase p) {
+    switch (p) {
+        case trace_phase::parsed: return "parsed";
+        case trace_phase::verified: return "verified";
+        case trace_phase::forwarded: return "forwarded";
+        case trace_phase::db_start: return "db_start";
+        case trace_phase::db_done: return "db_done";
+        case trace_phase::encoded: return "encoded";
+    }
+    return "unknown";
+}
+
+RequestTrace::RequestTrace(std::string_view endpoint, transport via, bool sampled) :
+        endpoint{endpoint}, via{via}, sampled{sampled} {
+    for (auto& t : at_us_)
+        t.store(-1, std::memory_order_relaxed);
+}
+
+void RequestTrace::mark(trace_phase p) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    int64_t unset = -1;
+    at_us_[static_cast<size_t>(p)].compare_exchange_strong(unset, us, std::memory_order_relaxed);
+}
+
+int64_t RequestTrace::at_us(trace_phase p) const {
+    return at_us_[static_cast<size_t>(p)].load(std::memory_order_relaxed);
+}
+
+// Converts a sample rate into the N of "every Nth request", with 0 meaning none
+static uint64_t sample_period(double rate) {
+    if (!(rate > 0))
+        return 0;
+    return std::max<uint64_t>(1, std::llround(1 / std::min(rate, 1.0)));
+}
+
+RequestTracer::RequestTracer(double sample_rate, std::chrono::milliseconds slow, size_t capacity) :
+        sample_every_{sample_period(sample_rate)},
+        slow_{slow},
+        capacity_{capacity} {}
+
+std::shared_ptr<RequestTrace> RequestTracer::start(std::string_view endpoint, transport via) {
+    bool sampled = sample_every_ &&
+                   counter_.fetch_add(1, std::memory_order_relaxed) % sample_every_ == 0;
+    if (!sampled && slow_ == 0us)
+        return nullptr;
+    return std::make_shared<RequestTrace>(endpoint, via, sampled);
+}
+
+void RequestTracer::finish(const std::shared_ptr<RequestTrace>& trace, int status) {
+    if (!trace)
+        return;
+    auto total = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - trace->start);
+    if (!trace->sampled && (slow_ == 0us || total < slow_))
+        return;
+
+    record r{
+            trace->endpoint,
+            trace->via,
+            status,
+            trace->sampled,
+            total.count(),
+            trace->started_at,
+            {}};
+    for (size_t i = 0; i < NUM_TRACE_PHASES; i++)
+        r.at_us[i] = trace->at_us(static_cast<trace_phase>(i));
+
+    std::lock_guard lock{mutex_};
+    if (capacity_ == 0)
+        return;
+    if (traces_.size() >= capacity_)
+        traces_.pop_front();
+    traces_.push_back(std::move(r));
+    kept_.fetch_add(1, std::memory_order_relaxed);
+}
+
+nlohmann::json RequestTracer::get_traces() const {
+    auto traces = nlohmann::json::array();
+    std::lock_guard lock{mutex_};
+    for (auto& r : traces_) {
+        auto& t = traces.emplace_back();
+        t["endpoint"] = r.endpoint;
+        t["transport"] = to_string(r.via);
+        t["status"] = r.status;
+        t["started"] = to_epoch_ms(r.started_at);
+        t["total_us"] = r.total_us;
+        t["sampled"] = r.sampled;
+        t["slow"] = slow_ > 0us && r.total_us >= slow_.count();
+        auto& phases = t["phases"] = nlohmann::json::object();
+        for (size_t i = 0; i < NUM_TRACE_PHASES; i++)
+            if (r.at_us[i] >= 0)
+                phases[std::string{to_string(static_cast<trace_phase>(i))}] = r.at_us[i];
+    }
+    return traces;
+}
+
+}  // namespace oxenss::rpc
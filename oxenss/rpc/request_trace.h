@@ -0,0 +1,116 @@
+#pragma once
+
+#include "request_metrics.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string_view>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace oxenss::rpc {
+
+using namespace std::literals;
+
+// The points in the handling of a client request that a trace records the time of:
+// - parsed -- the request parameters have been loaded
+// - verified -- the request has passed its swarm, timestamp, and signature checks
+// - forwarded -- a recursive request has been sent off to the rest of the swarm
+// - db_start -- the database job has started (so db_start - verified is the time spent waiting
+//   for a database thread)
+// - db_done -- the database job has finished
+// - encoded -- the response has been serialized and handed to the transport
+enum class trace_phase : uint8_t { parsed, verified, forwarded, db_start, db_done, encoded };
+inline constexpr size_t NUM_TRACE_PHASES = 6;
+
+std::string_view to_string(trace_phase p);
+
+// The phase timestamps of a single request.  Phases get marked from whichever threads reach them
+// (the receiving thread, database threads, etc.); only the first mark of each phase counts.
+class RequestTrace {
+  public:
+    RequestTrace(std::string_view endpoint, transport via, bool sampled);
+
+    // Records the current time for phase `p`, unless it was already recorded.
+    void mark(trace_phase p);
+
+    // Returns the time of phase `p` since the start of the request, or -1 if it wasn't reached.
+    int64_t at_us(trace_phase p) const;
+
+    const std::string_view endpoint;
+    const transport via;
+    const bool sampled;  // true if selected by sampling, false if traced only in case it's slow
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const std::chrono::system_clock::time_point started_at = std::chrono::system_clock::now();
+
+  private:
+    std::array<std::atomic<int64_t>, NUM_TRACE_PHASES> at_us_;
+};
+
+// Marks phase `p` of `trace`, if the request is being traced.
+inline void trace_mark(const std::shared_ptr<RequestTrace>& trace, trace_phase p) {
+    if (trace)
+        trace->mark(p);
+}
+
+// Decides which client requests to trace, and keeps the most recent traces of sampled requests
+// and of slow requests.  Every request is traced (so that a slow one can be kept whether or not
+// it was sampled), unless slow request capturing is disabled, in which case only the sampled ones
+// are.
+class RequestTracer {
+  public:
+    static constexpr auto DEFAULT_SLOW = 1s;
+    static constexpr size_t DEFAULT_CAPACITY = 1000;
+
+    // Samples (roughly) `sample_rate` (from 0 to 1) of requests, and always keeps requests that
+    // take at least `slow` (0 to not treat any as slow).  The ring buffer holds the most recent
+    // `capacity` traces.
+    explicit RequestTracer(
+            double sample_rate = 0,
+            std::chrono::milliseconds slow = DEFAULT_SLOW,
+            size_t capacity = DEFAULT_CAPACITY);
+
+    // Starts tracing a request; returns nullptr if the request isn't being traced.
+    std::shared_ptr<RequestTrace> start(std::string_view endpoint, transport via);
+
+    // Finishes the trace of a request that got a response with HTTP status `status`, keeping it if
+    // it was sampled or slow.  Does nothing if `trace` is nullptr.
+    void finish(const std::shared_ptr<RequestTrace>& trace, int status);
+
+    // Returns the kept traces, oldest first, as a json list of objects with the endpoint,
+    // transport, status, start time (unix epoch milliseconds), total time and the time of each
+    // reached phase (microseconds since the start), and whether it was sampled and/or slow.
+    nlohmann::json get_traces() const;
+
+    // Returns the number of traces kept since startup (including those since dropped from the
+    // ring buffer).
+    uint64_t kept() const { return kept_.load(std::memory_order_relaxed); }
+
+  private:
+    struct record {
+        std::string_view endpoint;
+        transport via;
+        int status;
+        bool sampled;
+        int64_t total_us;
+        std::chrono::system_clock::time_point started_at;
+        std::array<int64_t, NUM_TRACE_PHASES> at_us;
+    };
+
+    const uint64_t sample_every_;  // 0 = don't sample
+    const std::chrono::microseconds slow_;
+    const size_t capacity_;
+
+    std::atomic<uint64_t> counter_{0};
+    std::atomic<uint64_t> kept_{0};
+
+    std::deque<record> traces_;
+    mutable std::mutex mutex_;
+};
+
+}  // namespace oxenss::rpc
@@ -0,0 +1,248 @@
+#include "response_compressor.h"
+
+#include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/string_utils.hpp>
+
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ENABLE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include <ctime>
+#include <memory>
+
+namespace oxenss::rpc {
+
+static auto logcat = log::Cat("rpc");
+
+std::string_view to_string(encoding e) {
+    switch (e) {
+        case encoding::zstd: return "zstd";
+        case encoding::brotli: return "br";
+        case encoding::identity: break;
+    }
+    return "identity";
+}
+
+namespace {
+
+    // CPU time used so far by the calling thread, in microseconds.  (We want the CPU time rather
+    // than the wall time: the latter will include time that the thread spent not running at all
+    // on a busy machine).
+    int64_t thread_cpu_us() {
+        timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+            return 0;
+        return int64_t{ts.tv_sec} * 1'000'000 + ts.tv_nsec / 1000;
+    }
+
+    // Parses the q value of an Accept-Encoding entry into thousandths (so "0.5" gives 500).
+    // Anything invalid is treated as 1.
+    int parse_qvalue(std::string_view q) {
+        if (q.empty() || q.size() > 5 || (q[0] != '0' && q[0] != '1') ||
+            (q.size() > 1 && q[1] != '.'))
+            return 1000;
+        if (q[0] == '1')
+            return 1000;
+        int val = 0, scale = 100;
+        for (size_t i = 2; i < q.size(); i++, scale /= 10) {
+            if (q[i] < '0' || q[i] > '9')
+                return 1000;
+            val += (q[i] - '0') * scale;
+        }
+        return val;
+    }
+
+#ifdef ENABLE_ZSTD
+    struct zstd_cctx_deleter {
+        void operator()(ZSTD_CCtx* c) const { ZSTD_freeCCtx(c); }
+    };
+
+    bool compress_zstd(std::string_view in, std::string& out) {
+        // Reuse a compression context per thread rather than allocating a new one (of a few MB at
+        // our level) for every response:
+        thread_local std::unique_ptr<ZSTD_CCtx, zstd_cctx_deleter> cctx{ZSTD_createCCtx()};
+        if (!cctx)
+            return false;
+        out.resize(ZSTD_compressBound(in.size()));
+        auto size = ZSTD_compressCCtx(
+                cctx.get(),
+                out.data(),
+                out.size(),
+                in.data(),
+                in.size(),
+                ResponseCompressor::ZSTD_LEVEL);
+        if (ZSTD_isError(size)) {
+            log::warning(logcat, "zstd compression failed: {}", ZSTD_getErrorName(size));
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+
+    struct zstd_dctx_deleter {
+        void operator()(ZSTD_DCtx* c) const { ZSTD_freeDCtx(c); }
+    };
+#endif
+
+#ifdef ENABLE_BROTLI
+    bool compress_brotli(std::string_view in, std::string& out) {
+        size_t size = BrotliEncoderMaxCompressedSize(in.size());
+        if (size == 0)
+            return false;
+        out.resize(size);
+        if (!BrotliEncoderCompress(
+                    ResponseCompressor::BROTLI_QUALITY,
+                    BROTLI_DEFAULT_WINDOW,
+                    BROTLI_MODE_TEXT,
+                    in.size(),
+                    reinterpret_cast<const uint8_t*>(in.data()),
+                    &size,
+                    reinterpret_cast<uint8_t*>(out.data()))) {
+            log::warning(logcat, "brotli compression failed");
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+
+}  // namespace
+
+ResponseCompressor::ResponseCompressor(size_t min_size) : min_size_{min_size} {}
+
+bool ResponseCompressor::supported(encoding e) {
+    switch (e) {
+        case encoding::identity: return true;
+#ifdef ENABLE_ZSTD
+        case encoding::zstd: return true;
+#endif
+#ifdef ENABLE_BROTLI
+        case encoding::brotli: return true;
+#endif
+        default: return false;
+    }
+}
+
+encoding ResponseCompressor::negotiate(std::string_view accept_encoding) {
+    // q values of zstd and brotli, and of the "*" wildcard (which covers whichever of them isn't
+    // listed).  -1 means not mentioned.
+    int zstd = -1, brotli = -1, any = -1;
+    for (auto entry : util::split(accept_encoding, ",")) {
+        auto params = util::split(entry, ";");
+        auto name = params[0];
+        util::trim(name);
+        int q = 1000;
+        for (size_t i = 1; i < params.size(); i++) {
+            auto p = params[i];
+            util::trim(p);
+            if (p.size() >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+                q = parse_qvalue(p.substr(2));
+        }
+        if (util::string_iequal(name, "zstd"))
+            zstd = q;
+        else if (util::string_iequal(name, "br"))
+            brotli = q;
+        else if (name == "*")
+            any = q;
+    }
+    if (zstd < 0)
+        zstd = any;
+    if (brotli < 0)
+        brotli = any;
+    if (!supported(encoding::zstd))
+        zstd = 0;
+    if (!supported(encoding::brotli))
+        brotli = 0;
+
+    if (zstd > 0 && zstd >= brotli)
+        return encoding::zstd;
+    if (brotli > 0)
+        return encoding::brotli;
+    return encoding::identity;
+}
+
+encoding ResponseCompressor::compress(encoding e, std::string& body) {
+    if (e == encoding::identity)
+        return e;
+    auto& st = stats_[static_cast<size_t>(e)];
+    if (body.size() < min_size_ || !supported(e)) {
+        st.skipped++;
+        return encoding::identity;
+    }
+
+    auto started = thread_cpu_us();
+    std::string out;
+    bool ok = false;
+#ifdef ENABLE_ZSTD
+    if (e == encoding::zstd)
+        ok = compress_zstd(body, out);
+#endif
+#ifdef ENABLE_BROTLI
+    if (e == encoding::brotli)
+        ok = compress_brotli(body, out);
+#endif
+    st.cpu_us += thread_cpu_us() - started;
+
+    if (!ok || out.size() >= body.size()) {
+        st.skipped++;
+        return encoding::identity;
+    }
+    st.responses++;
+    st.bytes_in += body.size();
+    st.bytes_out += out.size();
+    body = std::move(out);
+    return e;
+}
+
+ResponseCompressor::stats ResponseCompressor::get_stats(encoding e) const {
+    auto& st = stats_[static_cast<size_t>(e)];
+    return {st.responses.load(),
+            st.skipped.load(),
+            st.bytes_in.load(),
+            st.bytes_out.load(),
+            st.cpu_us.load()};
+}
+
+bool zstd_enabled() {
+#ifdef ENABLE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool zstd_compress([[maybe_unused]] std::string_view in, [[maybe_unused]] std::string& out) {
+#ifdef ENABLE_ZSTD
+    return compress_zstd(in, out);
+#else
+    return false;
+#endif
+}
+
+bool zstd_decompress(
+        [[maybe_unused]] std::string_view in,
+        [[maybe_unused]] std::string& out,
+        [[maybe_unused]] size_t max_size) {
+#ifdef ENABLE_ZSTD
+    auto size = ZSTD_getFrameContentSize(in.data(), in.size());
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > max_size)
+        return false;
+    thread_local std::unique_ptr<ZSTD_DCtx, zstd_dctx_deleter> dctx{ZSTD_createDCtx()};
+    if (!dctx)
+        return false;
+    out.resize(size);
+    auto got = ZSTD_decompressDCtx(dctx.get(), out.data(), out.size(), in.data(), in.size());
+    if (ZSTD_isError(got) || got != size) {
+        log::debug(logcat, "zstd decompression failed");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+}  // namespace oxenss::rpc
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace oxenss::rpc {
+
+// The content encodings we can compress responses with.
+enum class encoding { identity, zstd, brotli };
+
+// Returns the name of the encoding as used in HTTP headers ("identity", "zstd", "br").
+std::string_view to_string(encoding e);
+
+// Optional compression of large client responses (mostly retrieves, which can return several MB
+// of base64-encoded message data).  Clients opt in per request: over HTTPS with a regular
+// `Accept-Encoding` header; over OMQ and QUIC with an Accept-Encoding-style flag on the request
+// (see the OMQ and QUIC servers).  Which encodings are available depends on which libraries we
+// were built with; without any of them this never compresses anything.
+//
+// Compressing is done by whichever thread calls `compress`; the servers call it from the worker
+// thread producing the response, never from an event loop thread.
+class ResponseCompressor {
+  public:
+    // Responses smaller than this aren't worth compressing.
+    static constexpr size_t DEFAULT_MIN_SIZE = 1024;
+
+    // We're compressing on the fly, so use fast levels rather than the best compression.
+    static constexpr int ZSTD_LEVEL = 3;
+    static constexpr int BROTLI_QUALITY = 4;
+
+    explicit ResponseCompressor(size_t min_size = DEFAULT_MIN_SIZE);
+
+    // Returns true if we were built with support for the given encoding.  (Identity is always
+    // supported).
+    static bool supported(encoding e);
+
+    // Parses an Accept-Encoding value (e.g. "gzip, br;q=0.8, zstd") and returns the supported
+    // encoding the client most prefers, preferring zstd over brotli when the client gives them
+    // equal priority.  Returns identity if the client accepts nothing we support.
+    static encoding negotiate(std::string_view accept_encoding);
+
+    // Compresses `body` in place with the given encoding, if it is at least the minimum size and
+    // compression actually makes it smaller.  Returns the encoding now used by `body` (i.e. either
+    // `e` or identity).
+    encoding compress(encoding e, std::string& body);
+
+    struct stats {
+        int64_t responses;  // responses compressed
+        int64_t skipped;    // responses we were allowed to compress but didn't (too small, etc.)
+        int64_t bytes_in;   // total size of compressed responses before compression
+        int64_t bytes_out;  // total size of compressed responses after compression
+        int64_t cpu_us;     // total CPU time spent compressing, in microseconds
+    };
+
+    stats get_stats(encoding e) const;
+
+  private:
+    struct counters {
+        std::atomic<int64_t> responses = 0;
+        std::atomic<int64_t> skipped = 0;
+        std::atomic<int64_t> bytes_in = 0;
+        std::atomic<int64_t> bytes_out = 0;
+        std::atomic<int64_t> cpu_us = 0;
+    };
+
+    const size_t min_size_;
+    std::array<counters, 3> stats_;
+};
+
+// Returns true if we were built with zstd, i.e. if zstd_compress and zstd_decompress work.
+bool zstd_enabled();
+
+// Plain zstd compression of `in` into `out` (replacing its contents) at ResponseCompressor's zstd
+// level, for other compressed data such as compact SN-to-SN message batches.  Returns false if we
+// weren't built with zstd or compression failed.
+bool zstd_compress(std::string_view in, std::string& out);
+
+// Decompresses a zstd frame into `out` (replacing its contents).  Returns false if we weren't built
+// with zstd, `in` isn't a valid frame with a known content size, or the content is larger than
+// `max_size`.
+bool zstd_decompress(std::string_view in, std::string& out, size_t max_size);
+
+}  // namespace oxenss::rpc
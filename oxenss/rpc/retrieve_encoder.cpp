@@ -0,0 +1,105 @@
+#include "retrieve_encoder.h"
+
+#include <oxenss/utils/base64.hpp>
+#include <oxenss/utils/time.hpp>
+
+#include <fmt/format.h>
+
+#include <iterator>
+
+namespace oxenss::rpc {
+
+RetrieveEncoder::RetrieveEncoder(bool bt, std::pair<int, int> hf, size_t reserve) : bt_{bt} {
+    // Reserving for the data alone reserves enough for everything when there are only a few
+    // messages; beyond that the buffer grows as usual, but rarely more than once or twice.
+    out_.reserve(64 + (bt ? reserve : (reserve + 2) / 3 * 4));
+    if (bt_) {
+        out_ += "d2:hfl";
+        append_int(hf.first);
+        append_int(hf.second);
+        out_ += "e8:messagesl";
+    } else {
+        fmt::format_to(
+                std::back_inserter(out_), R"({{"hf":[{},{}],"messages":[)", hf.first, hf.second);
+    }
+}
+
+void RetrieveEncoder::append_string(std::string_view s) {
+    if (bt_) {
+        fmt::format_to(std::back_inserter(out_), "{}:", s.size());
+        out_ += s;
+        return;
+    }
+    // Escaped the same way as nlohmann::json::dump() does it:
+    out_ += '"';
+    for (char c : s) {
+        switch (c) {
+            case '"': out_ += "\\\""; break;
+            case '\\': out_ += "\\\\"; break;
+            case '\b': out_ += "\\b"; break;
+            case '\f': out_ += "\\f"; break;
+            case '\n': out_ += "\\n"; break;
+            case '\r': out_ += "\\r"; break;
+            case '\t': out_ += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                    fmt::format_to(std::back_inserter(out_), "\\u{:04x}", static_cast<int>(c));
+                else
+                    out_ += c;
+        }
+    }
+    out_ += '"';
+}
+
+void RetrieveEncoder::append_int(int64_t i) {
+    if (bt_)
+        fmt::format_to(std::back_inserter(out_), "i{}e", i);
+    else
+        fmt::format_to(std::back_inserter(out_), "{}", i);
+}
+
+void RetrieveEncoder::add(const message_view& msg) {
+    // Keys have to be in sorted order for bt; we use the same order for json, which is also the
+    // order nlohmann::json keeps object keys in.
+    if (bt_) {
+        out_ += "d4:data";
+        append_string(msg.data);
+        out_ += "10:expiration";
+        append_int(to_epoch_ms(msg.expiry));
+        out_ += "4:hash";
+        append_string(msg.hash);
+        out_ += "9:timestamp";
+        append_int(to_epoch_ms(msg.timestamp));
+        out_ += 'e';
+    } else {
+        out_ += count_ ? R"(,{"data":")" : R"({"data":")";
+        util::append_base64(out_, msg.data);
+        out_ += R"(","expiration":)";
+        append_int(to_epoch_ms(msg.expiry));
+        out_ += R"(,"hash":)";
+        append_string(msg.hash);
+        out_ += R"(,"timestamp":)";
+        append_int(to_epoch_ms(msg.timestamp));
+        out_ += '}';
+    }
+    count_++;
+}
+
+std::string RetrieveEncoder::finish(bool more, int64_t t) {
+    if (bt_) {
+        out_ += "e4:more";
+        append_int(more);
+        out_ += "1:t";
+        append_int(t);
+        out_ += 'e';
+    } else {
+        out_ += R"(],"more":)";
+        out_ += more ? "true" : "false";
+        out_ += R"(,"t":)";
+        append_int(t);
+        out_ += '}';
+    }
+    return std::move(out_);
+}
+
+}  // namespace oxenss::rpc
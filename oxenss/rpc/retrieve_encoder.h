@@ -0,0 +1,50 @@
+#pragma once
+
+#include <oxenss/common/message.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace oxenss::rpc {
+
+// Writes a retrieve response straight to json or bt-encoded bytes, without building an
+// intermediate nlohmann::json value for it: a full retrieve can return hundreds of messages, and
+// building (and then dumping or converting) a json object for each of them is the bulk of the
+// work of responding.  The result is byte-for-byte the same as what dumping (for json) or
+// `bt_serialize(json_to_bt(...))`-ing (for bt) the json version of the response would produce:
+//
+//     {"hf": [19, 3],
+//      "messages": [{"data": ..., "expiration": ..., "hash": ..., "timestamp": ...}, ...],
+//      "more": false,
+//      "t": 1700000000000}
+//
+// Message data is base64-encoded in json responses and raw bytes in bt-encoded ones.
+class RetrieveEncoder {
+  public:
+    // Starts a response; `reserve` is the amount of message data (before any base64 encoding)
+    // that we expect to add, used to size the output buffer up front.
+    RetrieveEncoder(bool bt, std::pair<int, int> hf, size_t reserve = 0);
+
+    // Appends a message to the response.
+    void add(const message_view& msg);
+
+    // The number of messages added so far.
+    size_t count() const { return count_; }
+
+    // Finishes the response and returns the encoded bytes.  The encoder must not be used again
+    // afterwards.
+    std::string finish(bool more, int64_t t);
+
+  private:
+    bool bt_;
+    size_t count_ = 0;
+    std::string out_;
+
+    void append_string(std::string_view s);
+    void append_int(int64_t i);
+};
+
+}  // namespace oxenss::rpc
@@ -0,0 +1,65 @@
+#include "subrequest_pool.h"
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <algorithm>
+#include <exception>
+
+namespace oxenss::rpc {
+
+static auto logcat = log::Cat("rpc");
+
+SubrequestPool::SubrequestPool(unsigned threads) {
+    threads = std::clamp(std::thread::hardware_concurrency(), 1u, std::max(threads, 1u));
+    threads_.reserve(threads);
+    for (unsigned i = 0; i < threads; i++)
+        threads_.emplace_back([this] { run(); });
+}
+
+SubrequestPool::~SubrequestPool() {
+    shutdown();
+}
+
+void SubrequestPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard lock{mutex_};
+        if (!stopping_) {
+            jobs_.push_back(std::move(job));
+            cv_.notify_one();
+            return;
+        }
+    }
+    job();
+}
+
+void SubrequestPool::shutdown() {
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_)
+        if (t.joinable())
+            t.join();
+    threads_.clear();
+}
+
+void SubrequestPool::run() {
+    std::unique_lock lock{mutex_};
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty())
+            return;  // Stopping, and we've finished off the queue
+        auto job = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+        try {
+            job();
+        } catch (const std::exception& e) {
+            log::error(logcat, "Uncaught exception in batch subrequest: {}", e.what());
+        }
+        lock.lock();
+    }
+}
+
+}  // namespace oxenss::rpc
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace oxenss::rpc {
+
+// A few threads for handling the subrequests of a client `batch` request concurrently.  Handling
+// an authenticated subrequest is dominated by its signature verification (the ed25519 signature
+// of the request, plus the owner's signature of the token for subaccount requests), so a batch of
+// 20 authenticated subrequests handled one after the other on the thread that received it means
+// 20 to 40 back-to-back verifications before the first subrequest even reaches the database.
+// Handing the subrequests to this pool instead verifies them in parallel.
+class SubrequestPool {
+  public:
+    // Default (and maximum) number of threads; we use fewer on machines with fewer cores.
+    static constexpr unsigned DEFAULT_THREADS = 4;
+
+    // Batches with fewer subrequests than this are handled on the calling thread: for those the
+    // handoff isn't worth it.
+    static constexpr size_t MIN_PARALLEL = 4;
+
+    explicit SubrequestPool(unsigned threads = DEFAULT_THREADS);
+
+    // Calls shutdown().
+    ~SubrequestPool();
+
+    SubrequestPool(const SubrequestPool&) = delete;
+    SubrequestPool& operator=(const SubrequestPool&) = delete;
+
+    // Queues a job to run on one of the pool threads.  After shutdown() the job is run
+    // immediately on the calling thread instead.
+    void submit(std::function<void()> job);
+
+    // Runs whatever jobs are still queued, then stops and joins the pool threads.
+    void shutdown();
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+
+    void run();
+};
+
+}  // namespace oxenss::rpc
@@ -9,6 +9,7 @@
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/file.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <nlohmann/json.hpp>
 #include <oxenc/base64.h>
@@ -61,19 +62,18 @@ HTTPS::HTTPS(
         const std::filesystem::path& ssl_cert,
         const std::filesystem::path& ssl_key,
         const std::filesystem::path& ssl_dh,
-        crypto::legacy_keypair legacy_keys) :
+        crypto::legacy_keypair legacy_keys,
+        unsigned threads) :
         service_node_{sn},
         omq_{*service_node_.omq_server()},
         request_handler_{rh},
         rate_limiter_{rl},
         legacy_keys_{std::move(legacy_keys)} {
     // Add a category for handling incoming https requests
-    omq_.add_category(
+    service_node_.omq_server().add_category(
             "https",
             oxenmq::AuthLevel::basic,
-            2,    // minimum # of threads reserved threads for this category
-            1000  // max queued requests
-    );
+            {2 /*reserved threads*/, 1000 /*max queue*/});
 
     // uWS is designed to work from a single thread, which is good (we pull off the requests and
     // then stick them into the LMQ job queue to be scheduled along with other jobs).  But as a
@@ -82,108 +82,155 @@ HTTPS::HTTPS(
     // (injecting a callback into it is one of the few thread-safe things we can do across
     // threads).
     //
-    // Things we need in the owning thread, fulfilled from the http thread:
+    // To spread the TLS and request parsing work across cores we can run several such threads,
+    // each with its own app and event loop, all listening on the same port(s) (via SO_REUSEPORT,
+    // which has the kernel distribute incoming connections between them).  A connection, and
+    // everything done with it, stays on the loop that accepted it.
+    //
+    // Things we need in the owning thread, fulfilled from each http thread:
 
     // - the uWS::Loop* for the event loop thread (which is thread_local).  We can get this
-    // during
-    //   thread startup, after the thread does basic initialization.
-    std::promise<uWS::Loop*> loop_promise;
-    auto loop_future = loop_promise.get_future();
-
+    //   during thread startup, after the thread does basic initialization.
+    //
     // - the us_listen_socket_t* on which the server is listening.  We can't get this until we
     //   actually start listening, so wait until `start()` for it.  (We also double-purpose it
-    //   to send back an exception if one fires during startup).
-    std::promise<std::vector<us_listen_socket_t*>> startup_success_promise;
-    startup_success_ = startup_success_promise.get_future();
-
+    //   to send back an exception if one fires during startup).  This is event_loop::started.
+    //
     // Things we need to send from the owning thread to the event loop thread:
     // - a signal when the thread should bind to the port and start the event loop (when we call
-    //   start()).
-    // startup_promise_
+    //   start()).  This is event_loop::startup.
 
     uWS::SocketContextOptions https_opts{
             .key_file_name = ssl_key.c_str(),
             .cert_file_name = ssl_cert.c_str(),
             .dh_params_file_name = ssl_dh.c_str()};
 
-    server_thread_ = std::thread{
-            [this, bind = std::move(bind), &https_opts](
-                    std::promise<uWS::Loop*> loop_promise,
-                    std::future<bool> startup_future,
-                    std::promise<std::vector<us_listen_socket_t*>> startup_success) {
-                uWS::SSLApp https{https_opts};
-                try {
-                    create_endpoints(https);
-                } catch (...) {
-                    loop_promise.set_exception(std::current_exception());
-                    return;
-                }
-                // We've initialized, signal the calling thread
-                loop_promise.set_value(uWS::Loop::get());
-                // Now wait until we get the signal to go (sent when the caller calls start() call).
-                if (!startup_future.get())
-                    // False means cancel, i.e. we got destroyed/shutdown without start() being
-                    // called
-                    return;
-
-                // we don't currently do cors
-                // cors_ = {...};
-
-                std::vector<us_listen_socket_t*> listening;
-                try {
-                    bool required_bind_failed = false;
-                    for (const auto& [addr, port, required] : bind)
-                        https.listen(
-                                addr,
-                                port,
-                                LIBUS_LISTEN_EXCLUSIVE_PORT,
-                                [&listening,
-                                 req = required,
-                                 &required_bind_failed,
-                                 addr = fmt::format("{}:{}", addr, port)](
-                                        us_listen_socket_t* sock) {
-                                    if (sock) {
-                                        log::info(logcat, "HTTPS server listening at {}", addr);
-                                        listening.push_back(sock);
-                                    } else if (req) {
-                                        required_bind_failed = true;
-                                        log::critical(
-                                                logcat,
-                                                "HTTPS server failed to bind to required address "
-                                                "{}",
-                                                addr);
-                                    } else {
-                                        log::warning(
-                                                logcat,
-                                                "HTTPS server failed to bind to (non-required) "
-                                                "address {}",
-                                                addr);
-                                    }
-                                });
-
-                    if (listening.empty() || required_bind_failed) {
-                        std::ostringstream error;
-                        error << "RPC HTTP server failed to bind; ";
-                        if (listening.empty())
-                            error << "no valid bind address(es) given; ";
-                        error << "tried to bind to:";
-                        for (const auto& [addr, port, required] : bind)
-                            error << ' ' << addr << ':' << port;
-                        throw std::runtime_error{error.str()};
+    bind_ = std::move(bind);
+    loops_.resize(std::max(threads, 1u));
+    listen_opts_ = loops_.size() > 1 ? LIBUS_LISTEN_DEFAULT : LIBUS_LISTEN_EXCLUSIVE_PORT;
+    for (size_t i = 0; i < loops_.size(); i++) {
+        auto& l = *(loops_[i] = std::make_unique<event_loop>());
+
+        std::promise<uWS::Loop*> loop_promise;
+        auto loop_future = loop_promise.get_future();
+        std::promise<std::vector<us_listen_socket_t*>> startup_success_promise;
+        l.started = startup_success_promise.get_future();
+
+        l.thread = std::thread{
+                [this, i, &l = l, &https_opts](
+                        std::promise<uWS::Loop*> loop_promise,
+                        std::future<bool> startup_future,
+                        std::promise<std::vector<us_listen_socket_t*>> startup_success) {
+                    uWS::SSLApp https{https_opts};
+                    try {
+                        tls_tickets_.attach(static_cast<ssl_ctx_st*>(https.getNativeHandle()));
+                        create_endpoints(https);
+                    } catch (...) {
+                        loop_promise.set_exception(std::current_exception());
+                        return;
                     }
-                } catch (...) {
-                    startup_success.set_exception(std::current_exception());
-                    return;
-                }
-                startup_success.set_value(std::move(listening));
+                    // We've initialized, signal the calling thread
+                    current_loop_ = &l;
+                    loop_promise.set_value(uWS::Loop::get());
+                    // Now wait until we get the signal to go (sent when the caller calls start()
+                    // call).
+                    if (!startup_future.get())
+                        // False means cancel, i.e. we got destroyed/shutdown without start()
+                        // being called
+                        return;
 
-                https.run();
-            },
-            std::move(loop_promise),
-            startup_promise_.get_future(),
-            std::move(startup_success_promise)};
+                    // we don't currently do cors
+                    // cors_ = {...};
 
-    loop_ = loop_future.get();
+                    std::vector<us_listen_socket_t*> listening;
+                    try {
+                        listening = listen(https, i);
+                    } catch (...) {
+                        startup_success.set_exception(std::current_exception());
+                        return;
+                    }
+                    bool listening_ok = !listening.empty();
+                    startup_success.set_value(std::move(listening));
+
+                    if (listening_ok)
+                        https.run();
+                },
+                std::move(loop_promise),
+                l.startup.get_future(),
+                std::move(startup_success_promise)};
+
+        try {
+            l.loop = loop_future.get();
+        } catch (...) {
+            // Stops any loops we already started (and joins this one's thread); the later loops
+            // haven't been created yet, so drop their (null) slots first.
+            loops_.resize(i + 1);
+            shutdown(true);
+            throw;
+        }
+    }
+
+    service_node_.set_stats_provider("https", [this](nlohmann::json& val) {
+        auto tls = tls_tickets_.get_stats();
+        val["https_loops"] = loops_.size();
+        val["tls_full_handshakes"] = tls.full_handshakes;
+        val["tls_resumed_handshakes"] = tls.resumed;
+        val["tls_handshake_us"] = tls.handshake_us;
+        val["tls_handshake_max_us"] = tls.handshake_max_us;
+        val["tls_ticket_rotations"] = tls.rotations;
+    });
+}
+
+std::vector<us_listen_socket_t*> HTTPS::listen(uWS::SSLApp& https, size_t index) {
+    std::vector<us_listen_socket_t*> listening;
+    bool required_bind_failed = false;
+    for (const auto& [addr, port, required] : bind_)
+        https.listen(
+                addr,
+                port,
+                listen_opts_,
+                [&listening,
+                 req = required,
+                 &required_bind_failed,
+                 index,
+                 addr = fmt::format("{}:{}", addr, port)](us_listen_socket_t* sock) {
+                    if (sock) {
+                        if (index == 0)
+                            log::info(logcat, "HTTPS server listening at {}", addr);
+                        listening.push_back(sock);
+                    } else if (req) {
+                        required_bind_failed = true;
+                        log::critical(
+                                logcat,
+                                "HTTPS server failed to bind to required address {}",
+                                addr);
+                    } else {
+                        log::warning(
+                                logcat,
+                                "HTTPS server failed to bind to (non-required) address {}",
+                                addr);
+                    }
+                });
+
+    if (listening.empty() || required_bind_failed) {
+        std::ostringstream error;
+        error << "RPC HTTP server failed to bind; ";
+        if (listening.empty())
+            error << "no valid bind address(es) given; ";
+        error << "tried to bind to:";
+        for (const auto& [addr, port, required] : bind_)
+            error << ' ' << addr << ':' << port;
+        if (index == 0)
+            throw std::runtime_error{error.str()};
+
+        // The first loop bound fine, so the port sharing didn't work for this one; carry on with
+        // the loop(s) that we have rather than failing entirely.
+        log::warning(logcat, "{}; HTTPS loop {} will not be used", error.str(), index);
+        for (auto* s : listening)
+            us_listen_socket_close(/*ssl=*/true, s);
+        listening.clear();
+    }
+    return listening;
 }
 
 bool HTTPS::check_ready(HttpResponse& res) {
@@ -196,6 +243,29 @@ bool HTTPS::check_ready(HttpResponse& res) {
     return true;
 }
 
+thread_local HTTPS::event_loop* HTTPS::current_loop_ = nullptr;
+
+std::string HTTPS::take_body_buffer(size_t size) {
+    std::string buf;
+    if (auto* l = current_loop_; l && !l->body_pool.empty()) {
+        buf = std::move(l->body_pool.back());
+        l->body_pool.pop_back();
+        buf.clear();
+    }
+    // We don't trust the declared size enough to allocate more than we would pool up front; larger
+    // bodies grow as their data actually arrives.
+    buf.reserve(std::min(size, BODY_POOL_MAX_CAPACITY));
+    return buf;
+}
+
+void HTTPS::recycle_body_buffer(std::string&& buf) {
+    auto* l = current_loop_;
+    if (!l || buf.capacity() == 0 || buf.capacity() > BODY_POOL_MAX_CAPACITY ||
+        l->body_pool.size() >= BODY_POOL_SIZE)
+        return;
+    l->body_pool.push_back(std::move(buf));
+}
+
 void HTTPS::add_generic_headers(HttpResponse& res) const {
     res.writeHeader("Server", server_header());
 }
@@ -208,7 +278,7 @@ void queue_response_internal(
         r.writeStatus(fmt::format("{} {}", res.status.first, res.status.second));
         https.add_generic_headers(r);
 
-        const bool is_json = std::holds_alternative<json>(res.body);
+        const bool is_json = rpc::is_json_body(res);
         if (std::none_of(begin(res.headers), end(res.headers), [](const auto& h) {
                 return util::string_iequal(h.first, "content-type");
             }))
@@ -218,7 +288,8 @@ void queue_response_internal(
 
         // NB: if the dump() here throws then it means we messed up and put some invalid data
         // (probably binary) into a json value.
-        r.end(is_json ? std::get<json>(res.body).dump() : view_body(res),
+        auto* j = std::get_if<json>(&res.body);
+        r.end(j ? j->dump() : view_body(res),
               force_close || https.closing());
     });
 }
@@ -236,24 +307,33 @@ namespace {
         HTTPS& https;
         oxenmq::OxenMQ& omq;
         HttpResponse& res;
+        // The event loop of the connection; everything done with `res` has to happen there.
+        uWS::Loop* loop;
         Request request;
         std::vector<std::pair<std::string, std::string>> extra_headers;
+        // The encoding to compress the response with, if the client accepts one and it is a
+        // request worth compressing the response of.
+        rpc::encoding accept_encoding{rpc::encoding::identity};
         bool aborted{false};
         bool replied{false};
 
+        // Must be constructed in the connection's event loop thread.
         call_data(HTTPS& https, oxenmq::OxenMQ& omq, HttpResponse& res) :
-                https{https}, omq{omq}, res{res} {}
+                https{https}, omq{omq}, res{res}, loop{uWS::Loop::get()} {}
 
         // If we have to drop the request because we are overloaded we want to reply with an
         // error (so that we close the connection instead of leaking it and leaving it hanging).
         // We don't do this, of course, if the request got aborted and replied to.
+        //
+        // The body buffer goes back to the pool; we are usually destroyed in the loop thread (as
+        // the last owner is typically the callback that sent the reply).
         ~call_data() {
-            if (replied || aborted)
-                return;
-            https.loop_defer([&https = https, &res = res] {
-                https.error_response(
-                        res, http::SERVICE_UNAVAILABLE, "Server busy, try again later");
-            });
+            if (!(replied || aborted))
+                loop->defer([&https = https, &res = res] {
+                    https.error_response(
+                            res, http::SERVICE_UNAVAILABLE, "Server busy, try again later");
+                });
+            https.recycle_body_buffer(std::move(request.body));
         }
 
         call_data(const call_data&) = delete;
@@ -270,19 +350,37 @@ namespace {
         }
     };
 
+    // Compresses the body of the response with the given encoding (if it's big enough to be worth
+    // it), adding the Content-Encoding header if it does.  (string_view bodies are only used for
+    // short, fixed messages, so are left alone).
+    void compress_response(
+            rpc::ResponseCompressor& compressor, rpc::encoding enc, rpc::Response& res) {
+        if (auto* j = std::get_if<json>(&res.body))
+            res.body = rpc::encoded_body{j->dump()};
+        auto* e = std::get_if<rpc::encoded_body>(&res.body);
+        auto* s = std::get_if<std::string>(&res.body);
+        if (!(e || s) || compressor.compress(enc, e ? e->data : *s) == rpc::encoding::identity)
+            return;
+        res.headers.emplace_back("Content-Encoding", rpc::to_string(enc));
+        res.headers.emplace_back("Vary", "Accept-Encoding");
+    }
+
     // Queues a response for the HTTP thread to handle; the response can be in multiple string
-    // pieces to be concatenated together.
+    // pieces to be concatenated together.  Any compression of the response happens here, in the
+    // calling (worker) thread, rather than in the event loop.
     void queue_response(
             std::shared_ptr<call_data> data, rpc::Response res, bool force_close = false) {
         if (!data || data->replied)
             return;
         data->replied = true;
-        data->https.loop_defer(
-                [data = std::move(data), res = std::move(res), force_close]() mutable {
-                    if (data->aborted)
-                        return;
-                    queue_response_internal(data->https, data->res, std::move(res), force_close);
-                });
+        if (data->accept_encoding != rpc::encoding::identity)
+            compress_response(data->https.compressor(), data->accept_encoding, res);
+        auto* loop = data->loop;
+        loop->defer([data = std::move(data), res = std::move(res), force_close]() mutable {
+            if (data->aborted)
+                return;
+            queue_response_internal(data->https, data->res, std::move(res), force_close);
+        });
     }
 
     std::string get_remote_address(HttpResponse& res) {
@@ -352,6 +450,7 @@ namespace {
             HttpResponse& res,
             ReadyCallback ready,
             std::function<void(call_data& c)> prevalidate = nullptr) {
+        uint64_t body_size = 0;
         if (auto len = req.getHeader("content-length"); !len.empty()) {
             if (uint64_t length; !util::parse_int(len, length)) {
                 log::warning(
@@ -375,11 +474,16 @@ namespace {
                         res,
                         rpc::Response{http::PAYLOAD_TOO_LARGE, "Request body too large"sv},
                         true);
+            } else {
+                body_size = length;
             }
         }
 
-        std::shared_ptr<call_data> data{new call_data{https, omq, res}};
+        auto data = std::make_shared<call_data>(https, omq, res);
         auto& request = data->request;
+        // Size the body for the request (up to the pooled buffer size) up front so that appending
+        // the incoming chunks doesn't have to keep reallocating it:
+        request.body = https.take_body_buffer(body_size);
         request.remote_addr = get_remote_address(res);
         request.uri = req.getUrl();
         for (const auto& [header, value] : req)
@@ -453,23 +557,11 @@ void HTTPS::create_endpoints(uWS::SSLApp& https) {
 }
 
 bool HTTPS::should_rate_limit_client(std::string_view addr) {
-    if (addr.size() != 4)
-        return true;
-    uint32_t ip;
-    std::memcpy(&ip, addr.data(), 4);
-    oxenc::big_to_host_inplace(ip);
-    return rate_limiter_.should_rate_limit_client(ip);
+    return rate_limiter_.should_rate_limit_client_addr(addr);
 }
 
 void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
-    auto addr = res.getRemoteAddress();
-    if (addr.size() != 4) {
-        // We don't (currently?) support IPv6 at all (SS published IPs are only IPv4) so if we
-        // somehow get an IPv6 address then it isn't a proper SS request so just drop it.
-        log::warning(logcat, "incoming client request is not IPv4; dropping it");
-        return error_response(res, http::BAD_REQUEST);
-    }
-    if (should_rate_limit_client(addr)) {
+    if (should_rate_limit_client(res.getRemoteAddress())) {
         log::debug(logcat, "Rate limiting client request from {}", get_remote_address(res));
         return error_response(res, http::TOO_MANY_REQUESTS);
     }
@@ -478,6 +570,10 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
         return error_response(
                 res, http::GONE, "long polling is no longer supported, client upgrade required");
     }
+    // We don't know what sort of request this is until we parse the body (at which point it gets
+    // checked again), but if we're shedding even client writes then it doesn't matter:
+    if (!request_handler_.admission().admit(rpc::request_class::client_write))
+        return queue_response_internal(*this, res, rpc::RequestHandler::shed_response());
 
     handle_request(
             *this,
@@ -485,14 +581,23 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
             req,
             res,
             [this,
-             started = std::chrono::steady_clock::now()](std::shared_ptr<call_data> data) mutable {
+             started = std::chrono::steady_clock::now(),
+             accept = rpc::ResponseCompressor::negotiate(req.getHeader("accept-encoding"))](
+                    std::shared_ptr<call_data> data) mutable {
+                data->accept_encoding = accept;
                 auto& omq = data->omq;
                 auto& request = data->request;
                 omq.inject_task(
                         "https",
                         "https:" + request.uri,
                         request.remote_addr,
-                        [this, data = std::move(data), started]() mutable {
+                        [this,
+                         data = std::move(data),
+                         started,
+                         queued = std::chrono::steady_clock::now()]() mutable {
+                            request_handler_.admission().observe_wait(
+                                    std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - queued));
                             if (data->replied || data->aborted)
                                 return;
 
@@ -503,9 +608,11 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
                                             log::debug(
                                                     logcat,
                                                     "Responding to a client request after {}",
-                                                    util::friendly_duration(
-                                                            std::chrono::steady_clock::now() -
-                                                            started));
+                                                    logging::lazy([&started] {
+                                                        return util::friendly_duration(
+                                                                std::chrono::steady_clock::now() -
+                                                                started);
+                                                    }));
                                             queue_response(std::move(data), std::move(response));
                                         });
                             } catch (const std::exception& e) {
@@ -520,6 +627,8 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
 }
 
 void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
+    if (!request_handler_.admission().admit(rpc::request_class::onion))
+        return queue_response_internal(*this, res, rpc::RequestHandler::shed_response());
     handle_request(
             *this,
             omq_,
@@ -533,7 +642,13 @@ void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
                         "https",
                         "https:" + request.uri,
                         request.remote_addr,
-                        [this, data = std::move(data), started]() mutable {
+                        [this,
+                         data = std::move(data),
+                         started,
+                         queued = std::chrono::steady_clock::now()]() mutable {
+                            request_handler_.admission().observe_wait(
+                                    std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - queued));
                             if (data->replied || data->aborted)
                                 return;
 
@@ -546,9 +661,11 @@ void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
                                                 "(after {})",
                                                 res.status.first,
                                                 res.status.second,
-                                                util::friendly_duration(
-                                                        std::chrono::steady_clock::now() -
-                                                        started));
+                                                logging::lazy([&started] {
+                                                    return util::friendly_duration(
+                                                            std::chrono::steady_clock::now() -
+                                                            started);
+                                                }));
                                         queue_response(std::move(data), std::move(res));
                                     },
                                     0,  // hopno
@@ -587,40 +704,66 @@ void HTTPS::start() {
     if (sent_startup_)
         throw std::logic_error{"Cannot call HTTPS::start() more than once"};
 
-    startup_promise_.set_value(true);
+    for (auto& l : loops_)
+        l->startup.set_value(true);
     sent_startup_ = true;
-    listen_socks_ = startup_success_.get();
+
+    // Wait for all of them (even if one fails) so that shutdown() knows which ones are listening
+    std::exception_ptr err;
+    for (auto& l : loops_) {
+        try {
+            l->listen_socks = l->started.get();
+        } catch (...) {
+            if (!err)
+                err = std::current_exception();
+        }
+    }
+    if (err)
+        std::rethrow_exception(err);
+    log::info(
+            logcat,
+            "HTTPS server running {} event loop{}",
+            loops_.size(),
+            loops_.size() == 1 ? "" : "s");
 }
 
 void HTTPS::shutdown(bool join) {
-    if (!server_thread_.joinable())
+    if (std::none_of(loops_.begin(), loops_.end(), [](auto& l) { return l->thread.joinable(); }))
         return;
 
     if (!sent_shutdown_) {
         log::trace(logcat, "initiating shutdown");
         if (!sent_startup_) {
-            startup_promise_.set_value(false);
+            for (auto& l : loops_)
+                l->startup.set_value(false);
             sent_startup_ = true;
-        } else if (!listen_socks_.empty()) {
-            loop_defer([this] {
-                log::trace(logcat, "closing {} listening sockets", listen_socks_.size());
-                for (auto* s : listen_socks_)
-                    us_listen_socket_close(/*ssl=*/true, s);
-                listen_socks_.clear();
-
-                closing_ = true;
-            });
+        } else {
+            for (auto& l : loops_) {
+                if (l->listen_socks.empty())
+                    continue;
+                l->loop->defer([this, &l = *l] {
+                    log::trace(logcat, "closing {} listening sockets", l.listen_socks.size());
+                    for (auto* s : l.listen_socks)
+                        us_listen_socket_close(/*ssl=*/true, s);
+                    l.listen_socks.clear();
+
+                    closing_ = true;
+                });
+            }
         }
         sent_shutdown_ = true;
     }
 
-    log::trace(logcat, "joining https server thread");
+    log::trace(logcat, "joining https server thread(s)");
     if (join)
-        server_thread_.join();
+        for (auto& l : loops_)
+            if (l->thread.joinable())
+                l->thread.join();
     log::trace(logcat, "done shutdown");
 }
 
 HTTPS::~HTTPS() {
+    service_node_.set_stats_provider("https", nullptr);
     shutdown(true);
 }
 
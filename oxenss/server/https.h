@@ -4,11 +4,16 @@
 #include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
 #include <oxenss/version.h>
+#include "tls_session_tickets.h"
 #include "utils.h"
 
+#include <atomic>
 #include <filesystem>
 #include <future>
+#include <memory>
+#include <thread>
 #include <unordered_set>
+#include <vector>
 
 #include <uWebSockets/App.h>
 
@@ -33,6 +38,9 @@ class HTTPS {
     // \param bind {address,port,required} tuples to bind to.  If `required` is set then the
     // constructor will throw if binding fails, if not then the construction will succeed as
     // long as at least one bind address works.
+    //
+    // \param threads the number of event loop threads to run; with more than one they share the
+    // listening port(s) with SO_REUSEPORT and the kernel spreads new connections across them.
     HTTPS(snode::ServiceNode& sn,
           rpc::RequestHandler& rh,
           rpc::RateLimiter& rl,
@@ -40,11 +48,12 @@ class HTTPS {
           const std::filesystem::path& ssl_cert,
           const std::filesystem::path& ssl_key,
           const std::filesystem::path& ssl_dh,
-          crypto::legacy_keypair legacy_keys);
+          crypto::legacy_keypair legacy_keys,
+          unsigned threads = 1);
 
     ~HTTPS();
 
-    /// Starts the event loop in the thread handling http requests.  Core must have been
+    /// Starts the event loop(s) in the thread(s) handling http requests.  Core must have been
     /// initialized and OxenMQ started.  Will propagate an exception from the thread if startup
     /// fails.
     void start();
@@ -52,7 +61,7 @@ class HTTPS {
     /// Closes the http server connection.  Can safely be called multiple times, or to abort a
     /// startup if called before start().
     ///
-    /// \param join - if true, wait for the server thread to exit.  If false then joining will
+    /// \param join - if true, wait for the server thread(s) to exit.  If false then joining will
     /// occur during destruction.
     void shutdown(bool join = false);
 
@@ -69,13 +78,15 @@ class HTTPS {
     /// handles cors headers by adding any needed headers to the given vector
     void handle_cors(HttpRequest& req, http::headers& extra_headers);
 
-    // Posts a callback to the uWebSockets thread loop controlling this connection; all writes
-    // must be done from that thread, and so this method is provided to defer a callback from
-    // another thread into that one.  The function should have signature `void ()`.
-    template <typename Func>
-    void loop_defer(Func&& f) {
-        loop_->defer(std::forward<Func>(f));
-    }
+    // Returns a buffer, recycled from a previous request when possible, with room reserved for
+    // `size` bytes (capped at BODY_POOL_MAX_CAPACITY) of incoming request body.  Must only be
+    // called from a uWS loop thread.
+    std::string take_body_buffer(size_t size);
+
+    // Returns a request body buffer to the current loop's pool for reuse by a later request.  If
+    // not called from a uWS loop thread (or if the pool is full, or the buffer too large to be
+    // worth keeping) then the buffer is simply freed.
+    void recycle_body_buffer(std::string&& buf);
 
     const std::string& server_header() const { return server_header_; }
 
@@ -83,6 +94,8 @@ class HTTPS {
 
     snode::ServiceNode& service_node() { return service_node_; }
 
+    rpc::ResponseCompressor& compressor() { return request_handler_.compressor(); }
+
   private:
     // Checks whether the snode is ready; if not, sets an error message and returns false (the
     // handler should return immediately).
@@ -90,28 +103,54 @@ class HTTPS {
 
     void create_endpoints(uWS::SSLApp& http);
 
+    // Binds the given loop's app to the `bind_` addresses, returning the listening sockets.
+    // Throws on failure for the first loop; for other loops (which are sharing the ports of the
+    // first) logs a warning and returns an empty vector, to leave that loop unused.
+    std::vector<us_listen_socket_t*> listen(uWS::SSLApp& https, size_t index);
+
     bool should_rate_limit_client(std::string_view addr);
 
     void process_storage_rpc_req(HttpRequest& req, HttpResponse& res);
     void process_onion_req_v2(HttpRequest& req, HttpResponse& res);
 
-    // A promise we send from outside into the event loop thread to signal it to start.  We sent
-    // "true" to go ahead with binding + starting the event loop, or false to abort.
-    std::promise<bool> startup_promise_;
-    // A future (promise held by the thread) that delivers us the listening uSockets sockets so
-    // that, when we want to shut down, we can tell uWebSockets to close them (which will then
-    // run off the end of the event loop).  This also doubles to propagate listen exceptions
-    // back to us.
-    std::future<std::vector<us_listen_socket_t*>> startup_success_;
+    // One uWebSockets event loop and the thread running it.
+    struct event_loop {
+        // The thread in which the uWebSockets event listener is running
+        std::thread thread;
+        // The uWebSockets event loop pointer (so that we can inject callbacks into it, e.g. to
+        // shut it down)
+        uWS::Loop* loop{nullptr};
+        // A promise we send from outside into the event loop thread to signal it to start.  We
+        // send "true" to go ahead with binding + starting the event loop, or false to abort.
+        std::promise<bool> startup;
+        // A future (promise held by the thread) that delivers us the listening uSockets sockets
+        // so that, when we want to shut down, we can tell uWebSockets to close them (which will
+        // then run off the end of the event loop).  This also doubles to propagate listen
+        // exceptions back to us.
+        std::future<std::vector<us_listen_socket_t*>> started;
+        // The socket(s) this loop is listening on
+        std::vector<us_listen_socket_t*> listen_socks;
+        // Request body buffers available for reuse; only accessed from this loop's thread.
+        std::vector<std::string> body_pool;
+    };
+    std::vector<std::unique_ptr<event_loop>> loops_;
+    // The event_loop of the current thread, if it is one of our loop threads
+    static thread_local event_loop* current_loop_;
     // Whether we have sent the startup/shutdown signals
     bool sent_startup_{false}, sent_shutdown_{false};
 
-    // The uWebSockets event loop pointer (so that we can inject a callback to shut it down)
-    uWS::Loop* loop_{nullptr};
-    // The socket(s) we are listening on
-    std::vector<us_listen_socket_t*> listen_socks_;
-    // The thread in which the uWebSockets event listener is running
-    std::thread server_thread_;
+    // The addresses to listen on
+    std::vector<std::tuple<std::string, uint16_t, bool>> bind_;
+
+    // The uSockets listen options that every loop listens with: with multiple loops they all have
+    // to allow the (SO_REUSEPORT) sharing of the port, otherwise we claim it exclusively.
+    int listen_opts_ = LIBUS_LISTEN_EXCLUSIVE_PORT;
+
+    // Maximum number of pooled buffers per loop, and the largest buffer capacity we will keep in
+    // the pool (so that a handful of large requests don't pin lots of memory).
+    static constexpr size_t BODY_POOL_SIZE = 64;
+    static constexpr size_t BODY_POOL_MAX_CAPACITY = 256 * 1024;
+
     // Cached string we send for the Server header
     std::string server_header_ =
             "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING};
@@ -120,8 +159,8 @@ class HTTPS {
     // header entirely.
     std::unordered_set<std::string> cors_;
     // Will be set to true when we're trying to shut down which closes any connections as we
-    // reply to them.  Should only be read/write from inside the uWS loop.
-    bool closing_ = false;
+    // reply to them.  Set from inside the uWS loop(s).
+    std::atomic<bool> closing_ = false;
     // If true then always reply with 'Access-Control-Allow-Origin: *' to allow anything.
     bool cors_any_ = false;
     // Our owning service node
@@ -134,6 +173,8 @@ class HTTPS {
     rpc::RateLimiter& rate_limiter_;
     // Keys for signing responses
     crypto::legacy_keypair legacy_keys_;
+    // TLS session ticket keys shared by all of our loops, and handshake stats
+    TlsSessionTickets tls_tickets_;
 
     friend void queue_response_internal(
             HTTPS& https, HttpResponse& r, rpc::Response res, bool force_close);
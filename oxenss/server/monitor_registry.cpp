@@ -0,0 +1,260 @@
+#include "monitor_registry.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+namespace oxenss::server {
+
+namespace {
+    // Merges sorted vectors a and b together, returns the sorted, combined vector (but without any
+    // duplicates).  We avoid reallocating the vectors when possible (i.e. if either is a subset of
+    // the other).
+    std::vector<namespace_id> merge_namespaces(
+            std::vector<namespace_id> a, std::vector<namespace_id> b) {
+        // If the first arg of b comes before a, then our only subset case can be b as a superset of
+        // a, so swap arguments so that the subset case always involves `a` as the superset.
+        if (!b.empty() && (a.empty() || b.front() < a.front()))
+            a.swap(b);
+        // Figure out if a is a superset of b (in which case we can just return a):
+        auto ita = a.begin(), itb = b.begin();
+        while (ita != a.end() && itb != b.end()) {
+            if (*itb > *ita)
+                ita++;  // We have an element only in a, which is fine, skip it
+            else if (*itb == *ita) {
+                ita++;  // The element is in both, which is fine.
+                itb++;
+            } else
+                break;  // We found a b that isn't in a, so we don't have a subset.
+        }
+        if (itb == b.end())
+            return a;  // We hit the end of b without any violations above, which means everything
+                       // in b is already in a.
+
+        // Otherwise we need to merge them into a new sorted container c:
+        std::vector<namespace_id> c;
+        ita = a.begin();
+        itb = b.begin();
+        while (ita != a.end() || itb != b.end()) {
+            if (itb == b.end())
+                c.push_back(*ita++);
+            else if (ita == a.end())
+                c.push_back(*itb++);
+            else if (*ita < *itb)
+                c.push_back(*ita++);
+            else if (*ita == *itb) {
+                c.push_back(*ita++);
+                itb++;  // Value is in both vectors, but we only want it once
+            } else
+                c.push_back(*itb++);
+        }
+        return c;
+    }
+
+    int64_t wheel_tick(std::chrono::steady_clock::time_point t) {
+        return t.time_since_epoch() / MonitorRegistry::WHEEL_TICK;
+    }
+
+}  // namespace
+
+MonitorRegistry::shard& MonitorRegistry::shard_for(const prefixed_pubkey& pubkey) {
+    return shards_[pubkey.hash() % SHARDS];
+}
+const MonitorRegistry::shard& MonitorRegistry::shard_for(const prefixed_pubkey& pubkey) const {
+    return shards_[pubkey.hash() % SHARDS];
+}
+
+std::vector<namespace_id> MonitorRegistry::subscribe(
+        const prefixed_pubkey& pubkey,
+        std::vector<namespace_id> namespaces,
+        bool want_data,
+        bool want_changes,
+        const connection_id& conn,
+        std::chrono::seconds ttl) {
+    ttl = std::min<std::chrono::seconds>(ttl, MonitorData::MONITOR_EXPIRY_TIME);
+    std::vector<namespace_id> result;
+    std::chrono::steady_clock::time_point expiry;
+    {
+        auto& sh = shard_for(pubkey);
+        std::unique_lock lock{sh.mutex};
+        auto& subs = sh.subs[pubkey];
+        auto it = std::find_if(
+                subs.begin(), subs.end(), [&conn](const auto& s) { return s.conn == conn; });
+        if (it != subs.end()) {
+            it->namespaces = merge_namespaces(std::move(it->namespaces), std::move(namespaces));
+            it->reset_expiry(ttl);
+            it->want_data |= want_data;
+            if (want_changes && !it->want_changes) {
+                it->want_changes = true;
+                change_count_++;
+            }
+        } else {
+            it = subs.emplace(
+                    subs.end(), std::move(namespaces), want_data, want_changes, conn, ttl);
+            count_++;
+            if (want_changes)
+                change_count_++;
+            std::lock_guard clock{conns_mutex_};
+            conns_[conn].insert(pubkey);
+        }
+        result = it->namespaces;
+        expiry = it->expiry;
+    }
+
+    std::lock_guard lock{wheel_mutex_};
+    auto tick = wheel_tick(expiry);
+    wheel_[tick % WHEEL_SLOTS].push_back({tick, pubkey, conn});
+    return result;
+}
+
+void MonitorRegistry::find(
+        const prefixed_pubkey& pubkey,
+        namespace_id ns,
+        std::vector<connection_id>& to,
+        std::vector<connection_id>& with_data) const {
+    auto now = std::chrono::steady_clock::now();
+    auto& sh = shard_for(pubkey);
+    std::shared_lock lock{sh.mutex};
+    auto it = sh.subs.find(pubkey);
+    if (it == sh.subs.end())
+        return;
+    for (auto& sub : it->second)
+        if (sub.expiry >= now &&
+            std::binary_search(sub.namespaces.begin(), sub.namespaces.end(), ns))
+            (sub.want_data ? with_data : to).push_back(sub.conn);
+}
+
+void MonitorRegistry::find_changes(
+        const prefixed_pubkey& pubkey, namespace_id ns, std::vector<connection_id>& to) const {
+    auto now = std::chrono::steady_clock::now();
+    auto& sh = shard_for(pubkey);
+    std::shared_lock lock{sh.mutex};
+    auto it = sh.subs.find(pubkey);
+    if (it == sh.subs.end())
+        return;
+    for (auto& sub : it->second)
+        if (sub.want_changes && sub.expiry >= now &&
+            std::binary_search(sub.namespaces.begin(), sub.namespaces.end(), ns))
+            to.push_back(sub.conn);
+}
+
+void MonitorRegistry::unindex(const connection_id& conn, const prefixed_pubkey& pubkey) {
+    if (auto it = conns_.find(conn); it != conns_.end()) {
+        it->second.erase(pubkey);
+        if (it->second.empty())
+            conns_.erase(it);
+    }
+}
+
+size_t MonitorRegistry::remove_connection(const connection_id& conn) {
+    std::unordered_set<prefixed_pubkey> pubkeys;
+    {
+        std::lock_guard lock{conns_mutex_};
+        auto it = conns_.find(conn);
+        if (it == conns_.end())
+            return 0;
+        pubkeys = std::move(it->second);
+        conns_.erase(it);
+    }
+
+    size_t removed = 0;
+    for (auto& pubkey : pubkeys) {
+        auto& sh = shard_for(pubkey);
+        std::unique_lock lock{sh.mutex};
+        auto it = sh.subs.find(pubkey);
+        if (it == sh.subs.end())
+            continue;
+        auto& subs = it->second;
+        auto sub = std::find_if(
+                subs.begin(), subs.end(), [&conn](const auto& s) { return s.conn == conn; });
+        if (sub == subs.end())
+            continue;
+        if (sub->want_changes)
+            change_count_--;
+        if (sub != std::prev(subs.end()))
+            *sub = std::move(subs.back());
+        subs.pop_back();
+        if (subs.empty())
+            sh.subs.erase(it);
+        removed++;
+    }
+    count_ -= removed;
+    // Any wheel entries for these subscriptions will just be skipped when their slot is swept.
+    return removed;
+}
+
+size_t MonitorRegistry::expire(std::chrono::steady_clock::time_point now) {
+    // Every subscription in a slot for a tick before the current tick has expired (unless renewed):
+    std::vector<wheel_entry> due;
+    {
+        std::lock_guard lock{wheel_mutex_};
+        auto current = wheel_tick(now);
+        // (Any older slots that we never swept have since been reused, and get swept as part of
+        // the newer ticks)
+        auto first = std::max<int64_t>(
+                swept_tick_ + 1, current - static_cast<int64_t>(WHEEL_SLOTS) + 1);
+        for (auto tick = first; tick < current; tick++) {
+            auto& slot = wheel_[tick % WHEEL_SLOTS];
+            // Entries for a later tick that reuses this slot have to stay where they are:
+            auto later = std::partition(slot.begin(), slot.end(), [current](const auto& e) {
+                return e.tick < current;
+            });
+            due.insert(due.end(),
+                       std::make_move_iterator(slot.begin()),
+                       std::make_move_iterator(later));
+            slot.erase(slot.begin(), later);
+        }
+        swept_tick_ = std::max(swept_tick_, current - 1);
+    }
+
+    size_t removed = 0;
+    for (auto& [tick, pubkey, conn] : due) {
+        auto& sh = shard_for(pubkey);
+        std::unique_lock lock{sh.mutex};
+        auto it = sh.subs.find(pubkey);
+        if (it == sh.subs.end())
+            continue;
+        auto& subs = it->second;
+        auto sub = std::find_if(subs.begin(), subs.end(), [&c = conn](const auto& s) {
+            return s.conn == c;
+        });
+        // Gone, or renewed (in which case there is a later wheel entry for it):
+        if (sub == subs.end() || sub->expiry >= now)
+            continue;
+        {
+            std::lock_guard clock{conns_mutex_};
+            unindex(conn, pubkey);
+        }
+        if (sub->want_changes)
+            change_count_--;
+        if (sub != std::prev(subs.end()))
+            *sub = std::move(subs.back());
+        subs.pop_back();
+        if (subs.empty())
+            sh.subs.erase(it);
+        removed++;
+    }
+    count_ -= removed;
+    return removed;
+}
+
+size_t MonitorRegistry::connections() const {
+    std::lock_guard lock{conns_mutex_};
+    return conns_.size();
+}
+
+size_t MonitorRegistry::memory_usage() const {
+    // Each subscription has its MonitorData (with, typically, a handful of namespaces), a share of
+    // a `subs` node, an entry in its connection's reverse index set, and an expiry wheel entry;
+    // each connection also has a reverse index node.  Hash nodes cost about two pointers on top of
+    // their value.
+    constexpr size_t node = 2 * sizeof(void*);
+    constexpr size_t per_sub = sizeof(MonitorData) + 4 * sizeof(namespace_id) +
+                               sizeof(prefixed_pubkey) + sizeof(std::vector<MonitorData>) + node +
+                               sizeof(prefixed_pubkey) + node + sizeof(wheel_entry);
+    constexpr size_t per_conn =
+            sizeof(connection_id) + sizeof(std::unordered_set<prefixed_pubkey>) + node;
+    return size() * per_sub + connections() * per_conn;
+}
+
+}  // namespace oxenss::server
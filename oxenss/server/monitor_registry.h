@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <oxen/quic/connection_ids.hpp>
+#include <oxenmq/connections.h>
+
+#include "../common/namespace.h"
+#include "../common/pubkey.h"
+#include "../utils/lock_profiler.hpp"
+
+namespace oxenss::server {
+
+using connection_id = std::variant<oxenmq::ConnectionID, oxen::quic::ConnectionID>;
+
+using namespace std::literals;
+
+struct MonitorData {
+    static constexpr auto MONITOR_EXPIRY_TIME = 65min;
+
+    std::chrono::steady_clock::time_point expiry;  // When this notify reg expires
+    std::vector<namespace_id> namespaces;          // sorted namespace_ids
+    connection_id conn;
+    bool want_data;     // true if the subscriber wants msg data
+    bool want_changes;  // true if the subscriber wants deletion/expiry change events
+
+    MonitorData(
+            std::vector<namespace_id> namespaces,
+            bool data,
+            bool changes,
+            connection_id c,
+            std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) :
+            expiry{std::chrono::steady_clock::now() + ttl},
+            namespaces{std::move(namespaces)},
+            conn{c},
+            want_data{data},
+            want_changes{changes} {}
+
+    void reset_expiry(std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) {
+        expiry = std::chrono::steady_clock::now() + ttl;
+    }
+};
+
+// Tracks the accounts that connections have subscribed to for new message notifications.
+//
+// Subscriptions are spread across SHARDS independently locked shards (by pubkey hash), so that
+// lookups for new messages, which happen for every store, rarely contend with each other or with
+// subscription updates.  We also keep:
+//
+// - a reverse index from each connection to the pubkeys it subscribes to, so that all of a
+//   connection's subscriptions can be dropped (e.g. when it disconnects) without a full scan;
+// - a timer wheel of expiries, with one slot per WHEEL_TICK, so that `expire()` only has to look
+//   at the subscriptions that expired since it last ran instead of leaving stale entries behind.
+class MonitorRegistry {
+  public:
+    static constexpr size_t SHARDS = 16;
+    static constexpr auto WHEEL_TICK = 1min;
+    static constexpr size_t WHEEL_SLOTS = 128;
+    static_assert(
+            WHEEL_SLOTS * WHEEL_TICK > MonitorData::MONITOR_EXPIRY_TIME,
+            "expiry wheel must span the maximum subscription lifetime");
+
+    // Subscribes `conn` to notifications for `pubkey` in the given (sorted) namespaces.  If `conn`
+    // already has a subscription for `pubkey` then the namespaces are added to it, `want_data` and
+    // `want_changes` are enabled if given, and its expiry is renewed.  `ttl` is capped at
+    // MONITOR_EXPIRY_TIME.  Returns the subscription's namespaces (i.e. including any it already
+    // had).
+    std::vector<namespace_id> subscribe(
+            const prefixed_pubkey& pubkey,
+            std::vector<namespace_id> namespaces,
+            bool want_data,
+            bool want_changes,
+            const connection_id& conn,
+            std::chrono::seconds ttl = MonitorData::MONITOR_EXPIRY_TIME);
+
+    // Appends the connections with an unexpired subscription to `pubkey` in namespace `ns` to
+    // `to` or (if they want message data) `with_data`.
+    void find(
+            const prefixed_pubkey& pubkey,
+            namespace_id ns,
+            std::vector<connection_id>& to,
+            std::vector<connection_id>& with_data) const;
+
+    // Appends the connections with an unexpired subscription to change events of `pubkey` in
+    // namespace `ns` to `to`.
+    void find_changes(
+            const prefixed_pubkey& pubkey, namespace_id ns, std::vector<connection_id>& to) const;
+
+    // Removes all of `conn`'s subscriptions; returns the number removed.
+    size_t remove_connection(const connection_id& conn);
+
+    // Removes subscriptions that expired before the current wheel tick; returns the number removed.
+    size_t expire(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Calls `f(pubkey, data)` on each current subscription.  Each shard is (share) locked while its
+    // subscriptions are visited, so `f` must not call back into the registry.
+    template <typename F>
+    void for_each(F&& f) const {
+        for (auto& shard : shards_) {
+            std::shared_lock lock{shard.mutex};
+            for (auto& [pubkey, subs] : shard.subs)
+                for (auto& sub : subs)
+                    f(pubkey, sub);
+        }
+    }
+
+    // Number of current subscriptions (including expired ones not yet removed by `expire()`).
+    size_t size() const { return count_; }
+
+    // Number of current subscriptions (as with size()) that want change events, so that changes
+    // can skip the lookups (and queuing) entirely when nothing is subscribed to them.
+    size_t change_subscriptions() const { return change_count_; }
+
+    // Number of connections with subscriptions.
+    size_t connections() const;
+
+    // Approximate memory used by the subscriptions and their indices, in bytes.
+    size_t memory_usage() const;
+
+  private:
+    struct shard {
+        mutable util::profiled_mutex<std::shared_mutex, "monitor_shard"> mutex;
+        // Subscriptions by pubkey; there is typically only one (or a few) for each pubkey.
+        std::unordered_map<prefixed_pubkey, std::vector<MonitorData>> subs;
+    };
+    std::array<shard, SHARDS> shards_;
+    std::atomic<size_t> count_ = 0;
+    std::atomic<size_t> change_count_ = 0;
+
+    shard& shard_for(const prefixed_pubkey& pubkey);
+    const shard& shard_for(const prefixed_pubkey& pubkey) const;
+
+    // Reverse index; when both are needed a shard mutex is always locked before this one.
+    mutable util::profiled_mutex<std::mutex, "monitor_conns"> conns_mutex_;
+    std::unordered_map<connection_id, std::unordered_set<prefixed_pubkey>> conns_;
+
+    // Removes `pubkey` from `conn`'s reverse index entry.  Must be called with conns_mutex_ held.
+    void unindex(const connection_id& conn, const prefixed_pubkey& pubkey);
+
+    // Each slot holds the subscriptions that were set to expire during a tick with that slot index
+    // (which, since slots are reused, can be a tick that is still to come); entries are only hints,
+    // and get rechecked against the actual subscription (which might have been renewed or removed
+    // since).
+    struct wheel_entry {
+        int64_t tick;
+        prefixed_pubkey pubkey;
+        connection_id conn;
+    };
+    std::mutex wheel_mutex_;
+    std::array<std::vector<wheel_entry>, WHEEL_SLOTS> wheel_;
+    int64_t swept_tick_ = -1;  // Last tick `expire()` has cleared
+};
+
+}  // namespace oxenss::server
@@ -4,17 +4,26 @@
 #include "../rpc/request_handler.h"
 #include "utils.h"
 
+#include <oxenss/utils/file.hpp>
+#include <oxenss/utils/string_utils.hpp>
+
+#include <algorithm>
+
 namespace oxenss::server {
 
 static auto logcat = log::Cat("server");
 
 void MQBase::handle_monitor_message_single(
-        oxenc::bt_dict_consumer d, oxenc::bt_dict_producer& out, std::vector<sub_info>& subs) {
+        oxenc::bt_dict_consumer d,
+        oxenc::bt_dict_producer& out,
+        std::vector<sub_info>& subs,
+        const connection_id& conn) {
 
     // Values we receive, in bt-dict order:
     std::string_view ed_pk;                         // P (ed25519 pubkey only for session ids)
     std::optional<signed_subaccount_token> subacc;  // S (token signature), T (token)
     bool want_data = false;                         // d (given and true if data is desired)
+    bool want_changes = false;                      // e (true if change events are desired)
     using namespace_int = std::underlying_type_t<namespace_id>;
     std::vector<namespace_id> namespaces;  // n (ordered list of numeric namespaces)
     std::string pubkey;                    // p (network id + ed25519 pubkey; not a session id)
@@ -59,6 +68,12 @@ void MQBase::handle_monitor_message_single(
         if (d.skip_until("d"))
             want_data = d.consume_integer<bool>();
 
+        // Flag to also push events when messages are deleted or have their expiries changed
+        // (optional).  This isn't part of the signature: it only asks for more notifications about
+        // messages that the subscription is already allowed to monitor.
+        if (d.skip_until("e"))
+            want_changes = d.consume_integer<bool>();
+
         // List of namespaces to monitor (required)
         auto ns = d.require<oxenc::bt_list_consumer>("n");
         namespaces.push_back(static_cast<namespace_id>(ns.consume_integer<namespace_int>()));
@@ -125,6 +140,21 @@ void MQBase::handle_monitor_message_single(
         ed_pk.remove_prefix(1);
     }
 
+    // If this connection's identity held this subscription before we restarted then it already
+    // proved it is allowed to, so skip the (relatively expensive) verification:
+    if (claim_restored_monitor(conn, pubkey, namespaces, want_data, want_changes)) {
+        auto pubkey_hex = oxenc::to_hex(pubkey);
+        log::debug(logcat, "monitor.messages for {} matches a restored subscription", pubkey_hex);
+        subs.emplace_back(
+                std::move(pubkey),
+                std::move(pubkey_hex),
+                std::move(namespaces),
+                want_data,
+                want_changes);
+        out.append("success", 1);
+        return;
+    }
+
     std::string_view verify_key = ed_pk;
     if (subacc) {
         try {
@@ -160,13 +190,21 @@ void MQBase::handle_monitor_message_single(
         return monitor_error(out, MonitorResponse::BAD_SIG, "Signature verification failed");
     }
 
-    subs.emplace_back(std::move(pubkey), std::move(pubkey_hex), std::move(namespaces), want_data);
+    subs.emplace_back(
+            std::move(pubkey),
+            std::move(pubkey_hex),
+            std::move(namespaces),
+            want_data,
+            want_changes);
     out.append("success", 1);
 }
 
 void MQBase::handle_monitor_message_single(
-        oxenc::bt_dict_consumer d, oxenc::bt_dict_producer&& out, std::vector<sub_info>& subs) {
-    handle_monitor_message_single(d, out, subs);
+        oxenc::bt_dict_consumer d,
+        oxenc::bt_dict_producer&& out,
+        std::vector<sub_info>& subs,
+        const connection_id& conn) {
+    handle_monitor_message_single(d, out, subs, conn);
 }
 
 bool MQBase::handle_client_rpc(
@@ -175,6 +213,25 @@ bool MQBase::handle_client_rpc(
         const std::string& remote_addr,
         std::function<void(http::response_code, std::string_view)> reply,
         bool forwarded) {
+    return handle_client_rpc(
+            name,
+            params,
+            remote_addr,
+            rpc::encoding::identity,
+            [reply = std::move(reply)](
+                    http::response_code status, std::string_view body, rpc::encoding) {
+                reply(status, body);
+            },
+            forwarded);
+}
+
+bool MQBase::handle_client_rpc(
+        std::string_view name,
+        std::string_view params,
+        const std::string& remote_addr,
+        rpc::encoding accept,
+        std::function<void(http::response_code, std::string_view, rpc::encoding)> reply,
+        bool forwarded) {
     // Check client rpc endpoints
     auto it = rpc::RequestHandler::client_rpc_endpoints.find(name);
     if (it == rpc::RequestHandler::client_rpc_endpoints.end())
@@ -182,9 +239,35 @@ bool MQBase::handle_client_rpc(
 
     auto& handler = it->second.mq;
 
+    // Requests forwarded by other swarm members aren't client requests as far as the metrics and
+    // traces go
+    std::shared_ptr<rpc::RequestTrace> trace;
+    if (!forwarded) {
+        trace = request_handler_->tracer().start(it->first, transport());
+        reply = [this, name = it->first, started = std::chrono::steady_clock::now(), trace, reply](
+                        http::response_code status, std::string_view body, rpc::encoding enc) {
+            request_handler_->metrics().record(
+                    name, transport(), std::chrono::steady_clock::now() - started, status.first);
+            reply(status, body, enc);
+            // As for HTTPS requests: the reply serializes the response and hands it off
+            rpc::trace_mark(trace, rpc::trace_phase::encoded);
+            request_handler_->tracer().finish(trace, status.first);
+        };
+    }
+
     if (!forwarded && rate_limiter_->should_rate_limit_client(remote_addr)) {
         log::debug(logcat, "Rate limiting client request from {}", remote_addr);
-        reply(http::TOO_MANY_REQUESTS, "Too many requests, try again later"sv);
+        reply(http::TOO_MANY_REQUESTS,
+              "Too many requests, try again later"sv,
+              rpc::encoding::identity);
+        return true;
+    }
+
+    // Requests forwarded by other swarm members are replication, which we never shed
+    if (!forwarded &&
+        !request_handler_->admission().admit(rpc::AdmissionControl::classify(name))) {
+        auto res = rpc::RequestHandler::shed_response();
+        reply(res.status, rpc::view_body(res), rpc::encoding::identity);
         return true;
     }
 
@@ -192,7 +275,8 @@ bool MQBase::handle_client_rpc(
         handler(*request_handler_,
                 params,
                 forwarded,
-                [this, reply, bt_encoded = !params.empty() && params.front() == 'd'](
+                std::move(trace),
+                [this, reply, accept, bt_encoded = !params.empty() && params.front() == 'd'](
                         rpc::Response res) mutable {
                     std::string_view body;
                     std::string dump;
@@ -204,6 +288,9 @@ bool MQBase::handle_client_rpc(
                         else
                             dump = resp.dump();
                         body = dump;
+                    } else if (auto* e = std::get_if<rpc::encoded_body>(&res.body)) {
+                        dump = wrap_encoded(res.status, std::move(e->data), e->bt);
+                        body = dump;
                     } else {
                         body = view_body(res);
                     }
@@ -218,21 +305,96 @@ bool MQBase::handle_client_rpc(
                             : bt_encoded ? "bt-encoded"
                                          : "json");
 
-                    reply(res.status, body);
+                    // Compress only json/bt responses (raw ones are short error messages).  We are
+                    // running in the worker thread producing the response, so this doesn't tie up
+                    // the quic or omq event loop.
+                    auto enc = rpc::encoding::identity;
+                    if (accept != rpc::encoding::identity && !dump.empty()) {
+                        enc = request_handler_->compressor().compress(accept, dump);
+                        body = dump;
+                    }
+
+                    reply(res.status, body, enc);
                 });
     } catch (const rpc::parse_error& e) {
         // These exceptions carry a failure message to send back to the client
         log::debug(logcat, "Invalid request: {}", e.what());
-        reply(http::BAD_REQUEST, "invalid request: "s + e.what());
+        reply(http::BAD_REQUEST, "invalid request: "s + e.what(), rpc::encoding::identity);
     } catch (const std::exception& e) {
         // Other exceptions might contain something sensitive or irrelevant so warn about it and
         // send back a generic message.
         log::warning(logcat, "Client request raised an exception: {}", e.what());
-        reply(http::INTERNAL_SERVER_ERROR, "request failed");
+        reply(http::INTERNAL_SERVER_ERROR, "request failed", rpc::encoding::identity);
     }
     return true;
 }
 
+void MQBase::handle_client_rpc_batch(
+        std::string_view batch,
+        const std::string& remote_addr,
+        std::function<void(http::response_code status, std::string body)> reply) {
+    std::vector<std::pair<std::string_view, std::string_view>> requests;
+    try {
+        oxenc::bt_list_consumer list{batch};
+        while (!list.is_finished()) {
+            auto req = list.consume_list_consumer();
+            auto method = req.consume_string_view();
+            auto body = req.consume_string_view();
+            if (!req.is_finished())
+                throw std::invalid_argument{"expected [method, body] request pairs"};
+            requests.emplace_back(method, body);
+        }
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Invalid forwarded client request batch: {}", e.what());
+        reply(http::BAD_REQUEST, fmt::format("Invalid request batch: {}", e.what()));
+        return;
+    }
+    log::debug(logcat, "Handling batch of {} forwarded RPC requests", requests.size());
+
+    if (requests.empty())
+        return reply(http::OK, "le");
+
+    struct batch_replies {
+        std::mutex mutex;
+        std::vector<std::pair<int, std::string>> replies;  // status code and body
+        size_t pending;
+        std::function<void(http::response_code, std::string)> reply;
+    };
+    auto b = std::make_shared<batch_replies>();
+    b->replies.resize(requests.size());
+    b->pending = requests.size();
+    b->reply = std::move(reply);
+
+    auto reply_for = [b](size_t i) {
+        return [b, i](http::response_code status, std::string_view body) {
+            std::unique_lock lock{b->mutex};
+            b->replies[i] = {status.first, std::string{body}};
+            if (--b->pending > 0)
+                return;
+            lock.unlock();
+
+            std::string out;
+            out += 'l';
+            for (auto& [code, body] : b->replies) {
+                out += 'l';
+                if (code != http::OK.first)
+                    out += oxenc::bt_serialize(std::to_string(code));
+                out += oxenc::bt_serialize(body);
+                out += 'e';
+            }
+            out += 'e';
+            b->reply(http::OK, std::move(out));
+        };
+    };
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        auto& [method, body] = requests[i];
+        auto reply = reply_for(i);
+        if (!handle_client_rpc(method, body, remote_addr, reply, true))
+            reply(http::BAD_REQUEST, fmt::format("Unknown method '{}'", method));
+    }
+}
+
 void MQBase::handle_monitor(
         std::string_view request, std::function<void(std::string)> reply, connection_id conn) {
     if (request.size() < 2 || !(request.front() == 'd' || request.front() == 'l') ||
@@ -245,18 +407,21 @@ void MQBase::handle_monitor(
         return;
     }
 
+    restore_monitors(conn);
+
     std::string result;
     std::vector<sub_info> subs;
     try {
         if (request.front() == 'd') {
             oxenc::bt_dict_producer out;
-            handle_monitor_message_single(oxenc::bt_dict_consumer{request}, out, subs);
+            handle_monitor_message_single(oxenc::bt_dict_consumer{request}, out, subs, conn);
             result = std::move(out).str();
         } else {
             oxenc::bt_list_producer out;
             oxenc::bt_list_consumer l{request};
             while (!l.is_finished())
-                handle_monitor_message_single(l.consume_dict_consumer(), out.append_dict(), subs);
+                handle_monitor_message_single(
+                        l.consume_dict_consumer(), out.append_dict(), subs, conn);
             result = std::move(out).str();
         }
     } catch (const std::exception& e) {
@@ -272,100 +437,240 @@ void MQBase::handle_monitor(
     reply(result);
 }
 
-namespace {
-    // Merges sorted vectors a and b together, returns the sorted, combined vector (but without any
-    // duplicates).  We avoid reallocating the vectors when possible (i.e. if either is a subset of
-    // the other).
-    std::vector<namespace_id> merge_namespaces(
-            std::vector<namespace_id> a, std::vector<namespace_id> b) {
-        // If the first arg of b comes before a, then our only subset case can be b as a superset of
-        // a, so swap arguments so that the subset case always involves `a` as the superset.
-        if (!b.empty() && (a.empty() || b.front() < a.front()))
-            a.swap(b);
-        // Figure out if a is a superset of b (in which case we can just return a):
-        auto ita = a.begin(), itb = b.begin();
-        while (ita != a.end() && itb != b.end()) {
-            if (*itb > *ita)
-                ita++;  // We have an element only in a, which is fine, skip it
-            else if (*itb == *ita) {
-                ita++;  // The element is in both, which is fine.
-                itb++;
-            } else
-                break;  // We found a b that isn't in a, so we don't have a subset.
-        }
-        if (itb == b.end())
-            return a;  // We hit the end of b without any violations above, which means everything
-                       // in b is already in a.
-
-        // Otherwise we need to merge them into a new sorted container c:
-        std::vector<namespace_id> c;
-        ita = a.begin();
-        itb = b.begin();
-        while (ita != a.end() || itb != b.end()) {
-            if (itb == b.end())
-                c.push_back(*ita++);
-            else if (ita == a.end())
-                c.push_back(*itb++);
-            else if (*ita < *itb)
-                c.push_back(*ita++);
-            else if (*ita == *itb) {
-                c.push_back(*ita++);
-                itb++;  // Value is in both vectors, but we only want it once
-            } else
-                c.push_back(*itb++);
-        }
-        return c;
+void MQBase::update_monitors(std::vector<sub_info>& subs, connection_id conn) {
+    for (auto& [pubkey, pubkey_hex, namespaces, want_data, want_changes] : subs) {
+        auto monitored = monitors_.subscribe(
+                prefixed_pubkey{pubkey}, std::move(namespaces), want_data, want_changes, conn);
+        log::debug(
+                logcat,
+                "subscription for {} monitoring namespace(s) {}",
+                pubkey_hex,
+                fmt::join(monitored, ", "));
     }
+}
 
-}  // namespace
+void MQBase::get_notifiers(
+        const message& m, std::vector<connection_id>& to, std::vector<connection_id>& with_data) {
+    monitors_.find(m.pubkey.key(), m.msg_namespace, to, with_data);
+}
 
-void MQBase::update_monitors(std::vector<sub_info>& subs, connection_id conn) {
-    std::unique_lock lock{monitoring_mutex_};
-    for (auto& [pubkey, pubkey_hex, namespaces, want_data] : subs) {
-        bool found = false;
-        for (auto [it, end] = monitoring_.equal_range(pubkey); it != end; ++it) {
-            auto& mon_data = it->second;
-            if (mon_data.conn == conn) {
-                mon_data.namespaces =
-                        merge_namespaces(std::move(mon_data.namespaces), std::move(namespaces));
-                log::debug(
-                        logcat,
-                        "sub renewed for {} monitoring namespace(s) {}",
-                        pubkey_hex,
-                        fmt::join(mon_data.namespaces, ", "));
-                mon_data.reset_expiry();
-                mon_data.want_data |= want_data;
-                found = true;
-                break;
-            }
+void MQBase::get_change_notifiers(const message_change& c, std::vector<connection_id>& to) {
+    monitors_.find_changes(c.pubkey.key(), c.msg_namespace, to);
+}
+
+void MQBase::remove_monitors(const connection_id& conn) {
+    if (auto removed = monitors_.remove_connection(conn))
+        log::debug(logcat, "removed {} subscription(s) of a closed connection", removed);
+}
+
+void MQBase::expire_monitors() {
+    if (auto removed = monitors_.expire())
+        log::debug(logcat, "removed {} expired subscription(s)", removed);
+
+    auto now = std::chrono::system_clock::now();
+    std::lock_guard lock{restored_mutex_};
+    for (auto it = restored_.begin(); it != restored_.end();) {
+        auto& subs = it->second.subs;
+        for (auto sub = subs.begin(); sub != subs.end();)
+            sub = sub->second.expiry <= now ? subs.erase(sub) : std::next(sub);
+        it = subs.empty() ? restored_.erase(it) : std::next(it);
+    }
+}
+
+std::pair<size_t, size_t> MQBase::monitor_counts() const {
+    return {monitors_.size(), monitors_.connections()};
+}
+
+void MQBase::save_monitors(const std::filesystem::path& file) const {
+    // Each entry is a list: [identity, pubkey, [namespaces...], want_data, expiry, want_changes],
+    // where expiry is in unix epoch seconds.  (want_changes was added later, and so is optional
+    // when loading).
+    oxenc::bt_list_producer out;
+    auto now = std::chrono::steady_clock::now();
+    auto sys_now = std::chrono::system_clock::now();
+    size_t count = 0;
+    auto append = [&](std::string_view identity,
+                      std::string_view pubkey,
+                      const std::vector<namespace_id>& namespaces,
+                      bool want_data,
+                      bool want_changes,
+                      std::chrono::system_clock::time_point expiry) {
+        auto l = out.append_list();
+        l.append(identity);
+        l.append(pubkey);
+        {
+            auto ns = l.append_list();
+            for (auto n : namespaces)
+                ns.append(to_int(n));
         }
-        if (not found) {
-            log::debug(
-                    logcat,
-                    "new subscription for {} monitoring namespace(s) {}",
-                    pubkey_hex,
-                    fmt::join(namespaces, ", "));
-            monitoring_.emplace(
-                    std::piecewise_construct,
-                    std::forward_as_tuple(std::move(pubkey)),
-                    std::forward_as_tuple(std::move(namespaces), want_data, conn));
+        l.append(static_cast<int>(want_data));
+        l.append(std::chrono::duration_cast<std::chrono::seconds>(expiry.time_since_epoch())
+                         .count());
+        l.append(static_cast<int>(want_changes));
+        count++;
+    };
+
+    monitors_.for_each([&](const prefixed_pubkey& pubkey, const MonitorData& sub) {
+        if (sub.expiry <= now)
+            return;
+        if (auto identity = monitor_identity(sub.conn); !identity.empty())
+            append(identity,
+                   pubkey.view(),
+                   sub.namespaces,
+                   sub.want_data,
+                   sub.want_changes,
+                   std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+                           sys_now + (sub.expiry - now)));
+    });
+    {
+        // Also keep any restored subscriptions whose owners haven't come back yet:
+        std::lock_guard lock{restored_mutex_};
+        for (auto& [identity, restored] : restored_)
+            if (!restored.attached)
+                for (auto& [pubkey, sub] : restored.subs)
+                    if (sub.expiry > sys_now)
+                        append(identity,
+                               pubkey,
+                               sub.namespaces,
+                               sub.want_data,
+                               sub.want_changes,
+                               sub.expiry);
+    }
+
+    auto tmp = file;
+    tmp += ".tmp";
+    try {
+        std::lock_guard lock{save_mutex_};
+        util::dump_file(tmp, out.view());
+        std::filesystem::rename(tmp, file);
+    } catch (const std::exception& e) {
+        log::error(
+                logcat,
+                "Failed to save monitor subscriptions to {}: {}",
+                util::to_sv(file.u8string()),
+                e.what());
+        return;
+    }
+    log::debug(
+            logcat,
+            "Saved {} monitor subscription(s) to {}",
+            count,
+            util::to_sv(file.u8string()));
+}
+
+void MQBase::load_monitors(const std::filesystem::path& file) {
+    if (!std::filesystem::exists(file))
+        return;
+
+    using namespace_int = std::underlying_type_t<namespace_id>;
+    auto sys_now = std::chrono::system_clock::now();
+    size_t count = 0;
+    std::unordered_map<std::string, restored_monitors> restored;
+    try {
+        auto data = util::slurp_file(file);
+        oxenc::bt_list_consumer in{data};
+        while (!in.is_finished()) {
+            auto l = in.consume_list_consumer();
+            auto identity = l.consume_string();
+            auto pubkey = l.consume_string();
+            restored_sub sub;
+            auto ns = l.consume_list_consumer();
+            while (!ns.is_finished())
+                sub.namespaces.push_back(
+                        static_cast<namespace_id>(ns.consume_integer<namespace_int>()));
+            sub.want_data = l.consume_integer<bool>();
+            sub.expiry = std::chrono::system_clock::time_point{
+                    std::chrono::seconds{l.consume_integer<int64_t>()}};
+            if (!l.is_finished())
+                sub.want_changes = l.consume_integer<bool>();
+            if (sub.expiry <= sys_now || pubkey.size() != 33 || sub.namespaces.empty() ||
+                !std::is_sorted(sub.namespaces.begin(), sub.namespaces.end()))
+                continue;
+            restored[std::move(identity)].subs[std::move(pubkey)] = std::move(sub);
+            count++;
         }
+    } catch (const std::exception& e) {
+        log::error(
+                logcat,
+                "Failed to load monitor subscriptions from {}: {}",
+                util::to_sv(file.u8string()),
+                e.what());
+        return;
     }
+
+    log::info(
+            logcat,
+            "Restored {} monitor subscription(s) for {} connection(s) from {}",
+            count,
+            restored.size(),
+            util::to_sv(file.u8string()));
+    std::lock_guard lock{restored_mutex_};
+    restored_ = std::move(restored);
 }
 
-void MQBase::get_notifiers(
-        message& m, std::vector<connection_id>& to, std::vector<connection_id>& with_data) {
-    auto now = std::chrono::steady_clock::now();
-    std::shared_lock lock{monitoring_mutex_};
-
-    for (auto [it, end] = monitoring_.equal_range(m.pubkey.prefixed_raw()); it != end; ++it) {
-        const auto& mon_data = it->second;
-        auto& vec = mon_data.want_data ? with_data : to;
-        if (mon_data.expiry >= now &&
-            std::binary_search(
-                    mon_data.namespaces.begin(), mon_data.namespaces.end(), m.msg_namespace))
-            vec.push_back(mon_data.conn);
+void MQBase::restore_monitors(const connection_id& conn) {
+    auto identity = monitor_identity(conn);
+    if (identity.empty())
+        return;
+
+    std::vector<std::pair<std::string, restored_sub>> subs;
+    {
+        std::lock_guard lock{restored_mutex_};
+        auto it = restored_.find(identity);
+        if (it == restored_.end() || it->second.attached)
+            return;
+        it->second.attached = true;
+        for (auto& [pubkey, sub] : it->second.subs)
+            subs.emplace_back(pubkey, sub);
     }
+
+    // Reattach them to the new connection right away, so that notifications resume even before
+    // the subscriber gets around to renewing them:
+    auto now = std::chrono::system_clock::now();
+    for (auto& [pubkey, sub] : subs)
+        if (auto ttl = std::chrono::duration_cast<std::chrono::seconds>(sub.expiry - now);
+            ttl > 0s)
+            monitors_.subscribe(
+                    prefixed_pubkey{pubkey},
+                    sub.namespaces,
+                    sub.want_data,
+                    sub.want_changes,
+                    conn,
+                    ttl);
+    log::debug(logcat, "Reattached {} restored monitor subscription(s)", subs.size());
+}
+
+bool MQBase::claim_restored_monitor(
+        const connection_id& conn,
+        const std::string& pubkey,
+        const std::vector<namespace_id>& namespaces,
+        bool want_data,
+        bool want_changes) {
+    auto identity = monitor_identity(conn);
+    if (identity.empty())
+        return false;
+
+    std::lock_guard lock{restored_mutex_};
+    auto it = restored_.find(identity);
+    if (it == restored_.end())
+        return false;
+    auto& subs = it->second.subs;
+    auto sub = subs.find(pubkey);
+    if (sub == subs.end())
+        return false;
+    auto& r = sub->second;
+    bool covered = r.expiry > std::chrono::system_clock::now() && (r.want_data || !want_data) &&
+                   (r.want_changes || !want_changes) &&
+                   std::includes(
+                           r.namespaces.begin(),
+                           r.namespaces.end(),
+                           namespaces.begin(),
+                           namespaces.end());
+    // Either way, this pubkey now goes through regular verification from here on:
+    subs.erase(sub);
+    if (subs.empty())
+        restored_.erase(it);
+    return covered;
 }
 
 }  // namespace oxenss::server
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <chrono>
+#include <filesystem>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 #include <nlohmann/json_fwd.hpp>
@@ -11,7 +15,10 @@
 #include <shared_mutex>
 
 #include "../common/namespace.h"
+#include "../rpc/request_metrics.h"
+#include "../rpc/response_compressor.h"
 #include "../snode/sn_record.h"
+#include "monitor_registry.h"
 #include "utils.h"
 
 namespace oxenss {
@@ -26,38 +33,12 @@ namespace snode {
 }
 
 struct message;
+struct message_change;
 
 }  // namespace oxenss
 
 namespace oxenss::server {
 
-using connection_id = std::variant<oxenmq::ConnectionID, oxen::quic::ConnectionID>;
-
-using namespace std::literals;
-
-struct MonitorData {
-    static constexpr auto MONITOR_EXPIRY_TIME = 65min;
-
-    std::chrono::steady_clock::time_point expiry;  // When this notify reg expires
-    std::vector<namespace_id> namespaces;          // sorted namespace_ids
-    connection_id conn;
-    bool want_data;  // true if the subscriber wants msg data
-
-    MonitorData(
-            std::vector<namespace_id> namespaces,
-            bool data,
-            connection_id c,
-            std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) :
-            expiry{std::chrono::steady_clock::now() + ttl},
-            namespaces{std::move(namespaces)},
-            conn{c},
-            want_data{data} {}
-
-    void reset_expiry(std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) {
-        expiry = std::chrono::steady_clock::now() + ttl;
-    }
-};
-
 /// Base method for common functionality for message-queue request classes, that is, OxenMQ and
 /// BTRequestStream.
 
@@ -76,6 +57,33 @@ class MQBase {
             std::function<void(http::response_code status, std::string_view body)> reply,
             bool forwarded = false);
 
+    // Same as above, but compresses the response body with `accept` (if not identity, and if the
+    // response is large enough to be worth it), passing the encoding actually used to `reply`.
+    bool handle_client_rpc(
+            std::string_view name,
+            std::string_view params,
+            const std::string& remote_addr,
+            rpc::encoding accept,
+            std::function<
+                    void(http::response_code status, std::string_view body, rpc::encoding enc)>
+                    reply,
+            bool forwarded = false);
+
+    // Handles a batch of forwarded client requests (`sn.storage_cc_batch`): `batch` is a
+    // bt-encoded list of `[method, body]` lists, each of which is handled as a forwarded request.
+    // Once all of them are done, `reply` is called with OK and a bt-encoded list of the individual
+    // replies, in request order: each is a list of `[body]` on success, or `[code, body]` on
+    // failure.  If `batch` itself is invalid, `reply` is instead called with BAD_REQUEST and an
+    // error message.
+    void handle_client_rpc_batch(
+            std::string_view batch,
+            const std::string& remote_addr,
+            std::function<void(http::response_code status, std::string body)> reply);
+
+    // The transport of this server, under which it records its client requests in the
+    // RequestHandler's metrics.
+    virtual rpc::transport transport() const = 0;
+
     // Subclasses may override this to extend a json or bt response with a status code.  The default
     // returns the given response as-is.  This is primarily aimed at the QUIC implementation which
     // combines status code + body into a list (the OMQ version does not, but rather sends them as
@@ -85,6 +93,15 @@ class MQBase {
         return response;
     }
 
+    // Same as wrap_response, but for a response that the handler already serialized (as json, or
+    // as bt-encoded data if `bt` is true).
+    virtual std::string wrap_encoded(
+            [[maybe_unused]] const http::response_code& status,
+            std::string response,
+            [[maybe_unused]] bool bt) const {
+        return response;
+    }
+
     // Called to deal with a monitor request; `reply` is used to respond to the request itself (and
     // will be used during, not after, the method call itself); `conn` is the connection ID used to
     // send notifications back on the connection later.  `conn` is used to uniquely identify the
@@ -98,25 +115,101 @@ class MQBase {
 
     void update_monitors(std::vector<sub_info>& subs, connection_id conn);
 
+    // Returns a stable, authenticated identity for the remote end of `conn` (e.g. its x25519
+    // pubkey) under which its subscriptions can be saved and restored across restarts, or an empty
+    // string if the connection has no such identity (the default).
+    virtual std::string monitor_identity([[maybe_unused]] const connection_id& conn) const {
+        return {};
+    }
+
+    // Reattaches any subscriptions restored (by load_monitors) for the identity of `conn` to
+    // `conn`.  Does nothing if there are none, or if they've already been reattached.
+    void restore_monitors(const connection_id& conn);
+
+    // Returns true if a subscription restored for the identity of `conn` already covers `pubkey`
+    // with the given namespaces, `want_data` and `want_changes`, in which case the subscription
+    // request doesn't need to be verified again.  Each restored subscription is only used for this
+    // once.
+    bool claim_restored_monitor(
+            const connection_id& conn,
+            const std::string& pubkey,
+            const std::vector<namespace_id>& namespaces,
+            bool want_data,
+            bool want_changes);
+
     // Tracks accounts we are monitoring for OMQ push notification messages
-    std::unordered_multimap<std::string, MonitorData> monitoring_;
-    mutable std::shared_mutex monitoring_mutex_;
+    MonitorRegistry monitors_;
+
+    // Subscriptions loaded by load_monitors(), by identity, until their identity reconnects and
+    // renews them (or they expire).
+    struct restored_sub {
+        std::vector<namespace_id> namespaces;
+        bool want_data = false;
+        bool want_changes = false;
+        std::chrono::system_clock::time_point expiry;
+    };
+    struct restored_monitors {
+        bool attached = false;  // true once reattached to a new connection
+        std::unordered_map<std::string, restored_sub> subs;
+    };
+    std::unordered_map<std::string, restored_monitors> restored_;
+    mutable std::mutex restored_mutex_;
+
+    // Held while save_monitors() writes and renames its temporary file, so that concurrent saves
+    // don't write over each other's.
+    mutable std::mutex save_mutex_;
 
   public:
     void get_notifiers(
-            message& m, std::vector<connection_id>& to, std::vector<connection_id>& with_data);
+            const message& m,
+            std::vector<connection_id>& to,
+            std::vector<connection_id>& with_data);
+
+    // Appends the connections that subscribed to change events (deletions and expiry updates) of
+    // the account and namespace of `c` to `to`.
+    void get_change_notifiers(const message_change& c, std::vector<connection_id>& to);
+
+    // Returns true if any connection is currently subscribed to change events.
+    bool has_change_monitors() const { return monitors_.change_subscriptions() > 0; }
 
     virtual void notify(std::vector<connection_id>&, std::string_view notification) = 0;
 
+    // Drops all monitor subscriptions of the given connection (e.g. because it has gone away).
+    void remove_monitors(const connection_id& conn);
+
+    // Drops expired monitor subscriptions; should be called periodically.
+    void expire_monitors();
+
+    // Returns the number of monitor subscriptions and of connections with subscriptions.
+    std::pair<size_t, size_t> monitor_counts() const;
+
+    // Returns the approximate memory used by the monitor subscriptions, in bytes.
+    size_t monitor_memory() const { return monitors_.memory_usage(); }
+
+    // Writes the current subscriptions of connections with an identity (see monitor_identity) to
+    // `file`, so that they can be restored by load_monitors() after a restart.
+    void save_monitors(const std::filesystem::path& file) const;
+
+    // Loads subscriptions saved by save_monitors(), if `file` exists.  They are reattached when a
+    // connection with the same identity makes a monitor request, and renewals of them from that
+    // identity skip signature verification.  This is meant to be called once, at startup.
+    void load_monitors(const std::filesystem::path& file);
+
     virtual void reachability_test(std::shared_ptr<snode::sn_test> test) = 0;
 
     virtual ~MQBase() = default;
 
   private:
     void handle_monitor_message_single(
-            oxenc::bt_dict_consumer d, oxenc::bt_dict_producer& out, std::vector<sub_info>& subs);
+            oxenc::bt_dict_consumer d,
+            oxenc::bt_dict_producer& out,
+            std::vector<sub_info>& subs,
+            const connection_id& conn);
     void handle_monitor_message_single(
-            oxenc::bt_dict_consumer d, oxenc::bt_dict_producer&& out, std::vector<sub_info>& subs);
+            oxenc::bt_dict_consumer d,
+            oxenc::bt_dict_producer&& out,
+            std::vector<sub_info>& subs,
+            const connection_id& conn);
 };
 
 }  // namespace oxenss::server
@@ -8,6 +8,8 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
+#include <oxenss/rpc/response_compressor.h>
+#include <oxenss/snode/serialization.h>
 #include <oxenss/snode/service_node.h>
 #include <oxenss/utils/string_utils.hpp>
 
@@ -16,10 +18,13 @@
 #include <oxenc/hex.h>
 #include <oxenc/bt_producer.h>
 #include <fmt/std.h>
+#include <nlohmann/json.hpp>
 #include <sodium/crypto_sign.h>
 
 #include <chrono>
 #include <exception>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <type_traits>
@@ -47,24 +52,105 @@ std::string OMQ::peer_lookup(std::string_view pubkey_bin) const {
 void OMQ::handle_sn_data(oxenmq::Message& message) {
     log::debug(logcat, "[OMQ] handle_sn_data");
     log::debug(logcat, "[OMQ]   thread id: {}", std::this_thread::get_id());
-    log::debug(logcat, "[OMQ]   from: {}", oxenc::to_hex(message.conn.pubkey()));
+    log::debug(
+            logcat,
+            "[OMQ]   from: {}",
+            logging::lazy([&message] { return oxenc::to_hex(message.conn.pubkey()); }));
+
+    // We are only expecting a single part message, so this is normally just one copy out of the
+    // message frame (which we need because the batch gets stored asynchronously).
+    std::string blob;
+    size_t size = 0;
+    for (auto& part : message.data)
+        size += part.size();
+    blob.reserve(size);
+    for (auto& part : message.data)
+        blob += part;
 
-    std::stringstream ss;
+    // TODO: process push batch should move to "Request handler"
+    //
+    // We acknowledge with "OK", the number of messages that were new to us, and (if we can
+    // decompress compressed batches) snode::SN_DATA_ZSTD, or with "ERR" if we failed to decode or
+    // store them (so that the sender will retry).  Older nodes reply without any parts, which
+    // senders treat as success.
+    service_node_->process_push_batch(
+            std::move(blob), [reply = message.send_later()](std::optional<int> added) mutable {
+                log::debug(logcat, "[OMQ] send reply");
+                if (!added)
+                    reply.reply("ERR");
+                else if (rpc::zstd_enabled())
+                    reply.reply("OK", std::to_string(*added), snode::SN_DATA_ZSTD);
+                else
+                    reply.reply("OK", std::to_string(*added));
+            });
+};
 
-    // We are only expecting a single part message, so consider removing this
-    for (auto& part : message.data) {
-        ss << part;
+void OMQ::handle_sn_range_summary(oxenmq::Message& message) {
+    uint64_t begin, end, n;
+    try {
+        if (message.data.size() != 1)
+            throw std::runtime_error{"expected 1 part, got " + std::to_string(message.data.size())};
+        oxenc::bt_dict_consumer d{message.data[0]};
+        begin = d.require<uint64_t>("b");
+        end = d.require<uint64_t>("e");
+        n = std::min<uint64_t>(d.require<uint64_t>("n"), snode::ServiceNode::RECONCILE_BUCKETS);
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Invalid sn.range_summary request: {}", e.what());
+        return message.send_reply("400", "invalid request");
     }
 
-    // TODO: process push batch should move to "Request handler"
-    service_node_->process_push_batch(ss.str());
+    // A peer only asks us about (parts of) the range that it thinks our swarm owns, so anything
+    // wider than ours is either a different view of the swarms or an attempt to make us scan far
+    // more of the database than we store for our swarm.
+    auto swarm = service_node_->swarm_snapshot();
+    auto ours = swarm ? swarm->our_swarm_space_range() : std::nullopt;
+    if (!ours || end - begin - 1 > ours->second - ours->first - 1) {
+        log::debug(logcat, "Rejecting sn.range_summary request for too large range");
+        return message.send_reply("413", "range too large");
+    }
 
-    log::debug(logcat, "[OMQ] send reply");
+    service_node_->db_executor().read(
+            [begin, end, n, reply = message.send_later()](Database& db) mutable {
+                oxenc::bt_list_producer out;
+                for (auto& s : db.summarize_range(begin, end, n)) {
+                    out.append(s.count);
+                    out.append(s.digest);
+                }
+                reply.reply(out.view());
+            });
+}
 
-    // TODO: Investigate if the above could fail and whether we should report
-    // that to the sending SN
-    message.send_reply();
-};
+void OMQ::handle_sn_range_hashes(oxenmq::Message& message) {
+    uint64_t begin, end;
+    try {
+        if (message.data.size() != 1)
+            throw std::runtime_error{"expected 1 part, got " + std::to_string(message.data.size())};
+        oxenc::bt_dict_consumer d{message.data[0]};
+        begin = d.require<uint64_t>("b");
+        end = d.require<uint64_t>("e");
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Invalid sn.range_hashes request: {}", e.what());
+        return message.send_reply("400", "invalid request");
+    }
+
+    using snode::ServiceNode;
+    if (end - begin - 1 >= ServiceNode::RECONCILE_MAX_HASHES_WIDTH) {
+        log::debug(logcat, "Rejecting sn.range_hashes request for too large range");
+        return message.send_reply("413", "range too large");
+    }
+
+    service_node_->db_executor().read(
+            [begin, end, reply = message.send_later()](Database& db) mutable {
+                auto hashes =
+                        db.hashes_in_range(begin, end, ServiceNode::RECONCILE_MAX_HASHES + 1);
+                if (hashes.size() > static_cast<size_t>(ServiceNode::RECONCILE_MAX_HASHES))
+                    return reply.reply("413", "too many hashes");
+                oxenc::bt_list_producer out;
+                for (auto& h : hashes)
+                    out.append(h);
+                reply.reply(out.view());
+            });
+}
 
 void OMQ::handle_ping(oxenmq::Message& message) {
     log::debug(logcat, "Remote pinged me");
@@ -164,9 +250,10 @@ void OMQ::handle_onion_request(
         rpc::OnionRequestMetadata&& data,
         oxenmq::Message::DeferredSend send) {
     data.cb = [send](rpc::Response res) {
-#ifndef NDEBUG
-        log::trace(logcat, "on response: {}...", to_string(res).substr(0, 100));
-#endif
+        log::trace(
+                logcat,
+                "on response: {}...",
+                logging::lazy([&res] { return to_string(res).substr(0, 100); }));
 
         if (auto* js = std::get_if<nlohmann::json>(&res.body))
             send.reply(std::to_string(res.status.first), js->dump());
@@ -206,12 +293,30 @@ void OMQ::handle_get_stats(oxenmq::Message& message) {
     message.send_reply(payload);
 }
 
+void OMQ::handle_get_metrics(oxenmq::Message& message) {
+    log::debug(logcat, "Received get_metrics request via OMQ");
+
+    std::string metrics;
+    request_handler_->metrics().write_prometheus(metrics);
+    rpc::write_prometheus_stats(metrics, service_node_->get_stats_json());
+    rpc::write_prometheus_locks(metrics);
+
+    message.send_reply(metrics);
+}
+
+void OMQ::handle_get_traces(oxenmq::Message& message) {
+    log::debug(logcat, "Received get_traces request via OMQ");
+
+    message.send_reply(request_handler_->tracer().get_traces().dump());
+}
+
 void OMQ::handle_client_request(std::string_view method, oxenmq::Message& message, bool forwarded) {
     log::debug(logcat, "Handling OMQ RPC request for {}", method);
 
     const size_t full_size = forwarded ? 2 : 1;
     const size_t empty_body = full_size - 1;
-    if (message.data.size() != empty_body && message.data.size() != full_size) {
+    const bool has_accept = !forwarded && message.data.size() == full_size + 1;
+    if (message.data.size() != empty_body && message.data.size() != full_size && !has_accept) {
         log::warning(
                 logcat,
                 "Invalid {}OMQ RPC request for {}: incorrect number of message parts ({})",
@@ -229,10 +334,15 @@ void OMQ::handle_client_request(std::string_view method, oxenmq::Message& messag
 
     [[maybe_unused]] bool found = handle_client_rpc(
             method,
-            message.data.size() == full_size ? message.data.back() : ""sv,
+            message.data.size() >= full_size ? message.data[full_size - 1] : ""sv,
             message.remote,
-            [send = message.send_later()](http::response_code status, std::string_view body) {
-                if (status == http::OK)
+            has_accept ? rpc::ResponseCompressor::negotiate(message.data.back())
+                       : rpc::encoding::identity,
+            [send = message.send_later(), has_accept](
+                    http::response_code status, std::string_view body, rpc::encoding enc) {
+                if (has_accept)
+                    send.reply(std::to_string(status.first), rpc::to_string(enc), body);
+                else if (status == http::OK)
                     send.reply(body);
                 else
                     send.reply(std::to_string(status.first), body);
@@ -243,10 +353,32 @@ void OMQ::handle_client_request(std::string_view method, oxenmq::Message& messag
     assert(found);
 }
 
+void OMQ::handle_client_request_batch(oxenmq::Message& message) {
+    if (message.data.size() != 1) {
+        log::warning(
+                logcat,
+                "Invalid forwarded client request batch: expected 1 message part, received {}",
+                message.data.size());
+        return message.send_reply(
+                std::to_string(http::BAD_REQUEST.first), "Invalid request batch: expected 1 part");
+    }
+    handle_client_rpc_batch(
+            message.data[0],
+            message.remote,
+            [send = message.send_later()](http::response_code status, std::string body) {
+                if (status == http::OK)
+                    send.reply(body);
+                else
+                    send.reply(std::to_string(status.first), body);
+            });
+}
+
 OMQ::OMQ(
         const snode::sn_record& me,
         const crypto::x25519_seckey& privkey,
-        const std::vector<crypto::x25519_pubkey>& stats_access_keys) :
+        const std::vector<crypto::x25519_pubkey>& stats_access_keys,
+        omq_queue_options queues) :
+        queues_{std::move(queues)},
         omq_{std::string{me.pubkey_x25519.view()},
              std::string{privkey.view()},
              true,                                         // is service node
@@ -259,33 +391,38 @@ OMQ::OMQ(
     // clang-format off
 
     // Endpoints invoked by other SNs
-    omq_.add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false}, 2 /*reserved threads*/, 1000 /*max queue*/)
+    add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false}, {2 /*reserved threads*/, 1000 /*max queue*/})
         .add_request_command("data", [this](auto& m) { handle_sn_data(m); })
         .add_request_command("ping", [this](auto& m) { handle_ping(m); })
+        .add_request_command("range_summary", [this](auto& m) { handle_sn_range_summary(m); })
+        .add_request_command("range_hashes", [this](auto& m) { handle_sn_range_hashes(m); })
         .add_request_command("storage_test", [this](auto& m) { handle_storage_test(m); }) // NB: requires a 60s request timeout
         .add_request_command("onion_request", [this](auto& m) { handle_onion_request(m); })
         .add_request_command("storage_cc", [this](auto& m) {
             if (m.data.size() >= 2) return handle_client_request(m.data[0], m, true);
             log::warning(logcat, "Invalid forwarded client request: incorrect number of message parts ({})",  m.data.size());
         })
+        .add_request_command("storage_cc_batch", [this](auto& m) { handle_client_request_batch(m); })
         ;
 
     // storage.WHATEVER (e.g. storage.store, storage.retrieve, etc.) endpoints are invokable by
     // anyone (i.e. clients) and have the same WHATEVER endpoints as the "method" values for the
     // HTTPS /storage_rpc/v1 endpoint.
-    auto st_cat = omq_.add_category("storage", oxenmq::AuthLevel::none, 1 /*reserved threads*/, 200 /*max queue*/);
+    auto st_cat = add_category("storage", oxenmq::AuthLevel::none, {1 /*reserved threads*/, 200 /*max queue*/});
     for (const auto& [name, _cb] : rpc::RequestHandler::client_rpc_endpoints)
         st_cat.add_request_command(std::string{name}, [this, name=name](auto& m) { handle_client_request(name, m); });
 
     // monitor.* endpoints are used to subscribe to events such as new messages arriving for an
     // account.
-    omq_.add_category("monitor", oxenmq::AuthLevel::none, 1 /*reserved threads*/, 500 /*max queue*/)
+    add_category("monitor", oxenmq::AuthLevel::none, {1 /*reserved threads*/, 500 /*max queue*/})
         .add_request_command("messages", [this](auto& m) { handle_monitor_messages(m); })
         ;
 
     // Endpoints invokable by a local admin
     omq_.add_category("service", oxenmq::AuthLevel::admin)
         .add_request_command("get_stats", [this](auto& m) { handle_get_stats(m); })
+        .add_request_command("get_metrics", [this](auto& m) { handle_get_metrics(m); })
+        .add_request_command("get_traces", [this](auto& m) { handle_get_traces(m); })
         ;
 
     // We send a sub.block to oxend to tell it to push new block notifications to us via this
@@ -297,7 +434,14 @@ OMQ::OMQ(
         });
 
     // clang-format on
-    omq_.set_general_threads(1);
+    omq_.set_general_threads(queues_.general_pool_size());
+    if (queues_.general_threads > 0)
+        log::info(logcat, "Using {} general OxenMQ worker threads", queues_.general_threads);
+    else
+        log::info(
+                logcat,
+                "Using up to {} general OxenMQ worker threads (started as needed)",
+                queues_.general_pool_size());
 
     omq_.MAX_MSG_SIZE =
             10 * 1024 * 1024;  // 10 MB (needed by the fileserver, and swarm msg serialization)
@@ -306,6 +450,18 @@ OMQ::OMQ(
     omq_.EPHEMERAL_ROUTING_ID = false;
 }
 
+OMQ::~OMQ() {
+    if (service_node_)
+        service_node_->set_stats_provider("omq", nullptr);
+}
+
+oxenmq::CategoryHandle OMQ::add_category(
+        std::string name, oxenmq::Access access, category_limits def) {
+    auto limits = queues_.limits(name, def);
+    queue_monitor_.add_category(name, limits);
+    return omq_.add_category(std::move(name), access, limits.reserved_threads, limits.max_queue);
+}
+
 void OMQ::connect_oxend(const oxenmq::address& oxend_rpc) {
     // Establish our persistent connection to oxend.
     auto start = std::chrono::steady_clock::now();
@@ -355,6 +511,31 @@ void OMQ::init(
     service_node_ = sn;
     request_handler_ = rh;
     rate_limiter_ = rl;
+
+    // Queue waits of the categories handling client requests feed our admission control (the "sn"
+    // category, with its own reserved threads, isn't affected by client load):
+    queue_monitor_.set_wait_observer([rh](std::string_view category, auto wait) {
+        if (category != "sn")
+            rh->admission().observe_wait(wait);
+    });
+    omq_.add_timer([this] { queue_monitor_.probe(omq_); }, QueueMonitor::PROBE_INTERVAL);
+    service_node_->set_stats_provider("omq", [this](nlohmann::json& val) {
+        val["omq_general_threads"] = queues_.general_pool_size();
+        val["omq_adaptive_threads"] = queues_.general_threads == 0;
+        auto& cats = val["omq_categories"] = nlohmann::json::object();
+        for (auto& c : queue_monitor_.get_stats())
+            cats[c.name] = {
+                    {"reserved_threads", c.reserved_threads},
+                    {"max_queue", c.max_queue},
+                    {"probes", c.probes},
+                    {"saturated", c.saturated},
+                    {"rejected", c.rejected},
+                    {"wait_us", c.wait_us},
+                    {"wait_avg_us", c.wait_avg_us},
+                    {"wait_max_us", c.wait_max_us},
+                    {"backlogged", c.waiting}};
+    });
+
     omq_.start();
     // Block until we are connected to oxend:
     connect_oxend(oxend_rpc);
@@ -397,12 +578,22 @@ void OMQ::init(
 
 std::string OMQ::encode_onion_data(
         std::string_view payload, const rpc::OnionRequestMetadata& data) {
-    return oxenc::bt_serialize<oxenc::bt_dict>({
-            {"data", payload},
-            {"enc_type", to_string(data.enc_type)},
-            {"ephemeral_key", data.ephem_key.view()},
-            {"hop_no", data.hop_no},
-    });
+    // The payload is usually far larger than everything else, so we size the buffer for it up
+    // front and write it straight in, rather than building a bt_dict (which would copy it into the
+    // dict, and then again when serializing).
+    auto enc_type = to_string(data.enc_type);
+    oxenc::bt_dict_producer d;
+    d.reserve(
+            2                            // d...e
+            + 6 + 9 + payload.size()     // 4:data, the payload length prefix, and the payload
+            + 10 + 3 + enc_type.size()   // 8:enc_type and its value
+            + 15 + 3 + 32                // 13:ephemeral_key and its value
+            + 8 + 12);                   // 6:hop_no and i...e
+    d.append("data", payload);
+    d.append("enc_type", enc_type);
+    d.append("ephemeral_key", data.ephem_key.view());
+    d.append("hop_no", data.hop_no);
+    return std::move(d).str();
 }
 
 std::pair<std::string_view, rpc::OnionRequestMetadata> OMQ::decode_onion_data(
@@ -451,12 +642,20 @@ void OMQ::notify(std::vector<connection_id>& conns, std::string_view notificatio
             omq_.send(*id, "notify.message", notification);
 }
 
+std::string OMQ::monitor_identity(const connection_id& conn) const {
+    if (auto* id = std::get_if<oxenmq::ConnectionID>(&conn))
+        return id->pubkey();
+    return {};
+}
+
 void OMQ::reachability_test(std::shared_ptr<snode::sn_test> test) {
     auto xpk = test->sn.pubkey_x25519.view();
     omq_.request(
             xpk,
             "sn.ping",
-            [test = std::move(test)](bool success, const auto&) {
+            [this, test = std::move(test)](bool success, const auto&) {
+                service_node_->record_test_latency(
+                        snode::ReachType::OMQ, std::chrono::steady_clock::now() - test->started);
                 log::debug(
                         logcat,
                         "{} response for OxenMQ ping test of {}",
@@ -1,6 +1,7 @@
 #pragma once
 #include "utils.h"
 #include "mqbase.h"
+#include "omq_queues.h"
 
 #include <cstdint>
 #include <memory>
@@ -35,6 +36,10 @@ namespace snode {
 namespace oxenss::server {
 
 class OMQ : public MQBase {
+    // Declared before omq_ so that it outlives the OxenMQ workers that run its probes.
+    QueueMonitor queue_monitor_;
+    const omq_queue_options queues_;
+
     oxenmq::OxenMQ omq_;
     oxenmq::ConnectionID oxend_conn_;
 
@@ -44,6 +49,16 @@ class OMQ : public MQBase {
     // Handle Session data coming from peer SN
     void handle_sn_data(oxenmq::Message& message);
 
+    // sn.range_summary - returns our Database::summarize_range summaries for a part of swarm
+    // space, so that a peer redistributing data can figure out which parts of it we are missing.
+    // Replies "413" for ranges wider than our own swarm's.
+    void handle_sn_range_summary(oxenmq::Message& message);
+
+    // sn.range_hashes - returns the hashes of our messages in a part of swarm space.  Replies
+    // "413" for ranges wider than ServiceNode::RECONCILE_MAX_HASHES_WIDTH, or that contain more
+    // than ServiceNode::RECONCILE_MAX_HASHES messages.
+    void handle_sn_range_hashes(oxenmq::Message& message);
+
     // Called starting at HF18 for SS-to-SS onion requests
     void handle_onion_request(oxenmq::Message& message);
 
@@ -73,6 +88,11 @@ class OMQ : public MQBase {
     ///
     /// Failure responses are an HTTP error number and a plain text failure string.
     ///
+    /// A (non-forwarded) request can include a second part, after the body, with the response
+    /// encodings the client accepts, in the same format as an HTTP Accept-Encoding header (e.g.
+    /// "zstd, br").  In that case every reply is instead [CODE, ENCODING, BODY], where ENCODING
+    /// is "zstd" or "br" if the BODY got compressed, and "identity" if not.
+    ///
     /// `forwarded` is set if this request was forwarded from another swarm member rather than
     /// being direct from the client; the request is handled identically except that these
     /// forwarded requests are not-reforwarded again, and the method name is prepended on the
@@ -80,6 +100,14 @@ class OMQ : public MQBase {
     void handle_client_request(
             std::string_view method, oxenmq::Message& message, bool forwarded = false);
 
+    /// Handles a batch of client requests forwarded from another swarm member
+    /// (`sn.storage_cc_batch`).  The request is a single part containing a bt-encoded list of
+    /// `[method, body]` lists, each of which is handled as a forwarded request exactly like
+    /// `sn.storage_cc` would have.  Once all of them are done we reply with a single part
+    /// containing a list of the individual replies, in request order: each is a list of `[body]`
+    /// on success, or `[code, body]` on failure.
+    void handle_client_request_batch(oxenmq::Message& message);
+
     /// Handles a subscription request to monitor new messages (OMQ endpoint monitor.messages).  The
     /// message body must be bt-encoded, and can be either a dict, or a list of dicts, containing
     /// the following keys.  Note that keys are case-sensitive and, for proper bt-encoding, must be
@@ -103,6 +131,9 @@ class OMQ : public MQBase {
     ///   through 32767), must be sorted in numeric order, and must contain no duplicates.
     /// - d -- set to 1 if the caller wants the full message data, 0 (or omitted) will omit the data
     ///   from notifications.
+    /// - e -- set to 1 if the caller also wants to be notified when messages are deleted or have
+    ///   their expiries changed (see below); 0 (or omitted) only notifies of new messages.  This is
+    ///   not part of the signature.
     /// - t -- signature timestamp, in integer unix seconds (*not* milliseconds), associated with
     ///   the signature.  This timestamp must be within the last 2 weeks (and no more than 1 day in
     ///   the future) for this request to be valid.
@@ -151,6 +182,25 @@ class OMQ : public MQBase {
     /// - z -- the expiry (milliseconds since unix epoch) of the message.
     /// - ~ -- the message data, if requested.
     ///
+    /// If change events were requested (`e`), then each time messages in the monitored namespaces
+    /// are deleted, or have their expiries updated, through a request to this service node or one
+    /// forwarded from another swarm member, a "notify.message" is also sent with a dict of:
+    ///
+    /// - ! -- the kind of change: "delete" or "expire".  (Notifications of new messages never have
+    ///   this key).
+    /// - @ -- the account pubkey, in bytes (33), as above.
+    /// - h -- the list of affected message hashes, in sorted order.
+    /// - n -- the namespace of the messages.  A request that changes messages in several
+    ///   namespaces (e.g. a deletion by hash) sends one event per namespace, each only to the
+    ///   subscriptions to that namespace.
+    /// - z -- the new expiry (milliseconds since unix epoch) of the messages, for "expire" events.
+    ///
+    /// Events are only sent for messages that the request actually changed on this service node,
+    /// and depend only on the change itself: swarm members applying the same request to the same
+    /// messages send identical events, so a client monitoring several swarm members can drop the
+    /// duplicates by comparing them.  A request that changes nothing (e.g. one already applied)
+    /// sends nothing.
+    ///
     /// Note: if the same connection submits multiple simultaneous subscriptions then the subsequent
     /// subscriptions add to earlier subscriptions.  This has some implications:
     ///
@@ -177,6 +227,13 @@ class OMQ : public MQBase {
 
     void handle_get_stats(oxenmq::Message& message);
 
+    // Replies with the client request metrics and the numeric get_stats values, in Prometheus
+    // text format.
+    void handle_get_metrics(oxenmq::Message& message);
+
+    // Replies with the json list of recent sampled and slow client request traces.
+    void handle_get_traces(oxenmq::Message& message);
+
     // Access pubkeys for the 'service' command category (for access stats & logs), in binary.
     std::unordered_set<std::string> stats_access_keys_;
 
@@ -187,7 +244,16 @@ class OMQ : public MQBase {
   public:
     OMQ(const snode::sn_record& me,
         const crypto::x25519_seckey& privkey,
-        const std::vector<crypto::x25519_pubkey>& stats_access_keys_hex);
+        const std::vector<crypto::x25519_pubkey>& stats_access_keys_hex,
+        omq_queue_options queues = {});
+
+    ~OMQ() override;
+
+    // Adds an OxenMQ category with the configured limits for `name` (or `def` if there aren't
+    // any), and monitors its queue.  Other components adding categories for their injected jobs
+    // (such as HTTPS and QUIC) should add them through this rather than directly.
+    oxenmq::CategoryHandle add_category(
+            std::string name, oxenmq::Access access, category_limits def);
 
     // Initialize oxenmq; return a future that completes once we have connected to and
     // initialized from oxend.
@@ -231,6 +297,12 @@ class OMQ : public MQBase {
     void notify(std::vector<connection_id>&, std::string_view notification) override;
 
     void reachability_test(std::shared_ptr<snode::sn_test> test) override;
+
+    // Subscribers are identified by the x25519 pubkey they connected (i.e. were authenticated)
+    // with.
+    std::string monitor_identity(const connection_id& conn) const override;
+
+    rpc::transport transport() const override { return rpc::transport::omq; }
 };
 
 }  // namespace oxenss::server
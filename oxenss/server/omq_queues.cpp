@@ -0,0 +1,108 @@
+#include "omq_queues.h"
+
+#include <oxenss/utils/string_utils.hpp>
+
+#include <oxenmq/oxenmq.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+namespace oxenss::server {
+
+std::pair<std::string, category_limits> parse_category_limits(std::string_view spec) {
+    auto eq = spec.find('=');
+    if (eq == std::string_view::npos || eq == 0)
+        throw std::invalid_argument{"expected NAME=THREADS,QUEUE"};
+    auto values = util::split(spec.substr(eq + 1), ",");
+    category_limits limits;
+    if (values.size() != 2 || !util::parse_int(values[0], limits.reserved_threads) ||
+        !util::parse_int(values[1], limits.max_queue))
+        throw std::invalid_argument{"expected NAME=THREADS,QUEUE"};
+    if (limits.reserved_threads < 0 || limits.reserved_threads > 64)
+        throw std::invalid_argument{"THREADS must be between 0 and 64"};
+    if (limits.max_queue < 1)
+        throw std::invalid_argument{"QUEUE must be at least 1"};
+    return {std::string{spec.substr(0, eq)}, limits};
+}
+
+category_limits omq_queue_options::limits(const std::string& name, category_limits def) const {
+    if (auto it = categories.find(name); it != categories.end())
+        return it->second;
+    return def;
+}
+
+int omq_queue_options::general_pool_size() const {
+    if (general_threads > 0)
+        return general_threads;
+    return std::max<int>(1, std::thread::hardware_concurrency());
+}
+
+void QueueMonitor::add_category(std::string name, category_limits limits) {
+    std::lock_guard lock{mutex_};
+    categories_[std::move(name)].limits = limits;
+}
+
+void QueueMonitor::probe(oxenmq::OxenMQ& omq, std::chrono::steady_clock::time_point now) {
+    std::lock_guard lock{mutex_};
+    for (auto& [name, c] : categories_) {
+        if (c.pending) {
+            if (now - *c.pending < PROBE_TIMEOUT) {
+                c.saturated++;
+                continue;
+            }
+            c.rejected++;
+        }
+        c.probes++;
+        c.pending = now;
+        omq.inject_task(name, "queue_probe", "", [this, &name, &c, id = ++c.pending_id, now] {
+            probe_done(name, c, id, now);
+        });
+    }
+}
+
+void QueueMonitor::probe_done(
+        const std::string& name,
+        category& c,
+        uint64_t id,
+        std::chrono::steady_clock::time_point sent) {
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - sent);
+    if (wait_observer_)
+        wait_observer_(name, waited);
+    auto wait = waited.count();
+    std::lock_guard lock{mutex_};
+    // A probe we gave up on as rejected can still turn up late; its wait is still a real wait,
+    // but it no longer holds up the next probe.
+    if (id == c.pending_id)
+        c.pending.reset();
+    c.wait_us = wait;
+    c.wait_avg_us = c.window_probes || c.prev_wait_max_us ? (7 * c.wait_avg_us + wait) / 8 : wait;
+    c.wait_max_us = std::max(c.wait_max_us, wait);
+    if (++c.window_probes >= MAX_WAIT_WINDOW) {
+        c.prev_wait_max_us = c.wait_max_us;
+        c.wait_max_us = 0;
+        c.window_probes = 0;
+    }
+}
+
+std::vector<QueueMonitor::category_stats> QueueMonitor::get_stats() const {
+    std::vector<category_stats> result;
+    std::lock_guard lock{mutex_};
+    result.reserve(categories_.size());
+    for (auto& [name, c] : categories_)
+        result.push_back(
+                {name,
+                 c.limits.reserved_threads,
+                 c.limits.max_queue,
+                 c.probes,
+                 c.saturated,
+                 c.rejected,
+                 c.wait_us,
+                 c.wait_avg_us,
+                 std::max(c.wait_max_us, c.prev_wait_max_us),
+                 c.pending.has_value()});
+    return result;
+}
+
+}  // namespace oxenss::server
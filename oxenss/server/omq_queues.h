@@ -0,0 +1,120 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace oxenmq {
+class OxenMQ;
+}
+
+namespace oxenss::server {
+
+using namespace std::literals;
+
+// The worker threads reserved for an OxenMQ category (beyond the general pool, which every
+// category shares), and the most jobs it may have waiting; OxenMQ drops new jobs for a category
+// whose queue is full.
+struct category_limits {
+    int reserved_threads;
+    int max_queue;
+};
+
+// Parses a "NAME=THREADS,QUEUE" category sizing (as given to --omq-category), e.g.
+// "storage=4,1000".  Throws std::invalid_argument if it is malformed.
+std::pair<std::string, category_limits> parse_category_limits(std::string_view spec);
+
+// Configurable sizing of our OxenMQ worker pool and categories.
+struct omq_queue_options {
+    // The size of the general worker pool, or 0 to size it adaptively: OxenMQ only starts a
+    // general worker when there is a job waiting and no idle worker to run it, so in adaptive mode
+    // we let the pool grow as far as the number of cores, and it only gets that big if the queues
+    // back up enough to need it.
+    int general_threads = 0;
+
+    // Overrides of the built-in limits of categories, by category name.
+    std::unordered_map<std::string, category_limits> categories;
+
+    // Returns the configured limits of category `name`, or `def` if it isn't overridden.
+    category_limits limits(const std::string& name, category_limits def) const;
+
+    // Returns the general pool size to give OxenMQ.
+    int general_pool_size() const;
+};
+
+// Tracks how long jobs wait in the OxenMQ category queues (which OxenMQ itself doesn't expose).
+// Every PROBE_INTERVAL we inject a no-op probe job into each monitored category and measure how
+// long it takes to start: it waits behind everything queued in the category, so this is the
+// queue wait of a request arriving at that moment.  A probe still waiting when the next one is due
+// counts the category as saturated; one that never runs within PROBE_TIMEOUT was presumably
+// rejected because the queue was full.
+class QueueMonitor {
+  public:
+    static constexpr auto PROBE_INTERVAL = 1s;
+    static constexpr auto PROBE_TIMEOUT = 10s;
+
+    // The max wait we report is over (roughly) this many of the most recent probes.
+    static constexpr uint64_t MAX_WAIT_WINDOW = 60;
+
+    // Starts monitoring the given category.
+    void add_category(std::string name, category_limits limits);
+
+    // Sets a callback to be invoked (from the worker thread that ran the probe) with the category
+    // and wait of each probe.  Must be set before the first call to probe().
+    void set_wait_observer(
+            std::function<void(std::string_view category, std::chrono::microseconds wait)> f) {
+        wait_observer_ = std::move(f);
+    }
+
+    // Sends a probe to each monitored category; should be called every PROBE_INTERVAL (`now` is
+    // only for testing).
+    void probe(
+            oxenmq::OxenMQ& omq,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    struct category_stats {
+        std::string name;
+        int reserved_threads;
+        int max_queue;
+        uint64_t probes;      // probes sent
+        uint64_t saturated;   // probes that were still waiting when the next one was due
+        uint64_t rejected;    // probes that never ran (presumably dropped because of a full queue)
+        int64_t wait_us;      // wait of the most recent probe to run
+        int64_t wait_avg_us;  // moving average of probe waits
+        int64_t wait_max_us;  // max recent probe wait
+        bool waiting;         // true if a probe is waiting right now
+    };
+    std::vector<category_stats> get_stats() const;
+
+  private:
+    struct category {
+        category_limits limits;
+        uint64_t probes = 0, saturated = 0, rejected = 0;
+        int64_t wait_us = 0, wait_avg_us = 0;
+        int64_t wait_max_us = 0, prev_wait_max_us = 0;  // current and previous MAX_WAIT_WINDOW
+        uint64_t window_probes = 0;
+        std::optional<std::chrono::steady_clock::time_point> pending;  // send time of our probe
+        uint64_t pending_id = 0;
+    };
+
+    void probe_done(
+            const std::string& name,
+            category& c,
+            uint64_t id,
+            std::chrono::steady_clock::time_point sent);
+
+    // std::map so that references to elements (held by probe jobs) stay valid
+    std::map<std::string, category, std::less<>> categories_;
+    mutable std::mutex mutex_;
+    std::function<void(std::string_view category, std::chrono::microseconds wait)> wait_observer_;
+};
+
+}  // namespace oxenss::server
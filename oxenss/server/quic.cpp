@@ -2,10 +2,15 @@
 #include <sodium/crypto_generichash_blake2b.h>
 #include "../rpc/rate_limiter.h"
 #include "../rpc/request_handler.h"
+#include "../rpc/response_compressor.h"
+#include "../snode/serialization.h"
 #include "../snode/service_node.h"
 #include "omq.h"
 #include "utils.h"
 
+#include <oxenss/utils/memory.hpp>
+#include <oxenc/bt_serialize.h>
+
 namespace oxenss::server {
 
 static auto logcat = log::Cat("ssquic");
@@ -36,7 +41,8 @@ QUIC::QUIC(
         rpc::RequestHandler& rh,
         rpc::RateLimiter& rl,
         const Address& bind,
-        const crypto::ed25519_seckey& sk) :
+        const crypto::ed25519_seckey& sk,
+        unsigned threads) :
         local{bind},
         tls_creds{quic::GNUTLSCreds::make_from_ed_seckey(sk.str())},
         ep{network.endpoint(
@@ -52,19 +58,69 @@ QUIC::QUIC(
     request_handler_ = &rh;
     rate_limiter_ = &rl;
 
+    loops_.resize(std::max(threads, 1u));
+    for (size_t i = 0; i < loops_.size(); i++) {
+        auto& l = *(loops_[i] = std::make_unique<loop>());
+        if (i == 0) {
+            l.ep = ep;
+            continue;
+        }
+        l.network.emplace();
+        l.ep = l.network->endpoint(
+                Address{local.host(), 0},
+                make_endpoint_static_secret(sk),
+                quic::opt::outbound_alpns{{uALPN}});
+    }
+
+    service_node_->set_stats_provider("quic", [this](nlohmann::json& val) {
+        auto tests = nlohmann::json::array(), peer_requests = nlohmann::json::array(),
+             connects = nlohmann::json::array();
+        for (auto& l : loops_) {
+            tests.push_back(l->tests.load());
+            peer_requests.push_back(l->peer_requests.load());
+            connects.push_back(l->connects.load());
+        }
+        val["quic_loops"] = loops_.size();
+        val["quic_requests"] = requests_.load();
+        val["quic_loop_tests"] = std::move(tests);
+        val["quic_loop_peer_requests"] = std::move(peer_requests);
+        val["quic_loop_connects"] = std::move(connects);
+    });
+    service_node_->set_peer_request(
+            [this](const crypto::x25519_pubkey& pk,
+                   std::string_view command,
+                   std::string_view body,
+                   snode::peer_reply_callback cb) {
+                return peer_request(pk, command, body, std::move(cb));
+            });
+
     // Add a category to OMQ for handling incoming quic request jobs
-    service_node_->omq_server()->add_category(
+    service_node_->omq_server().add_category(
             "quic",
             oxenmq::AuthLevel::basic,
-            2,    // minimum # of threads reserved threads for this category
-            1000  // max queued requests
-    );
+            {2 /*reserved threads*/, 1000 /*max queue*/});
+}
+
+QUIC::~QUIC() {
+    service_node_->set_peer_request(nullptr);
+    service_node_->set_stats_provider("quic", nullptr);
+}
+
+QUIC::loop& QUIC::test_loop(const crypto::legacy_pubkey& pk) {
+    return *loops_[std::hash<crypto::legacy_pubkey>{}(pk) % loops_.size()];
 }
 
 void QUIC::startup_endpoint() {
-    ep->listen(tls_creds, [&](quic::connection_interface& c) {
-        c.queue_incoming_stream<quic::BTRequestStream>(command_handler);
-    });
+    // Make every stream the client opens a request stream (rather than just the first one), so
+    // that clients can use several to avoid head-of-line blocking.  The first one, stream 0, is
+    // also the one we send monitor notifications on.
+    ep->listen(
+            tls_creds,
+            quic::opt::max_streams{MAX_CLIENT_STREAMS},
+            [this](quic::Connection& c, quic::Endpoint& e, std::optional<int64_t>)
+                    -> std::shared_ptr<quic::Stream> {
+                return e.loop.make_shared<quic::BTRequestStream>(c, e, command_handler);
+            });
 }
 
 void QUIC::handle_monitor_message(std::shared_ptr<quic::message> msg) {
@@ -83,21 +139,70 @@ void QUIC::handle_ping(std::shared_ptr<quic::message> msg) {
     msg->respond("pong");
 }
 
+// Clients can ask for a compressed response to a client rpc request by appending ";" and the
+// encodings they accept, in the same format as an HTTP Accept-Encoding header, to the endpoint name
+// (e.g. "retrieve;zstd, br").  The body of the response (whether a success or an error) is then
+// prefixed with a line containing the encoding used: "zstd", "br", or "identity" if the body is not
+// compressed.
+//
+// Returns the endpoint name and, if given, the negotiated encoding.
+static std::pair<std::string_view, std::optional<rpc::encoding>> parse_endpoint(
+        std::string_view endpoint) {
+    auto pos = endpoint.find(';');
+    if (pos == std::string_view::npos)
+        return {endpoint, std::nullopt};
+    return {endpoint.substr(0, pos), rpc::ResponseCompressor::negotiate(endpoint.substr(pos + 1))};
+}
+
 void QUIC::handle_request(std::shared_ptr<quic::message> msg) {
     auto& omq = *service_node_->omq_server();
     auto remote_host = msg->stream()->remote().host();
+    requests_++;
 
-    auto name = msg->endpoint();
-    if (!(name == "snode_ping" || name == "monitor" || name == "onion_req" ||
-          rpc::RequestHandler::client_rpc_endpoints.count(name)))
+    auto [name, accept] = parse_endpoint(msg->endpoint());
+    if (!(name == "snode_ping" || name == "monitor" || name == "onion_req" || name == "sn.data" ||
+          name == "sn.storage_cc_batch" || rpc::RequestHandler::client_rpc_endpoints.count(name)))
         throw quic::no_such_endpoint{};
 
+    // Service node requests go into the "sn" category, which has reserved threads that client
+    // requests can't use.  Client and onion requests that we would shed anyway we refuse right
+    // away, rather than queueing them first.
+    bool sn_request = name == "snode_ping" || name == "sn.data" || name == "sn.storage_cc_batch";
+    if (!sn_request && name != "monitor" &&
+        !request_handler_->admission().admit(
+                name == "onion_req" ? rpc::request_class::onion
+                                    : rpc::AdmissionControl::classify(name))) {
+        auto res = rpc::RequestHandler::shed_response();
+        return msg->respond(
+                "{} {}\n\n{}"_format(res.status.first, res.status.second, rpc::view_body(res)),
+                true);
+    }
+
+    // Counts the request bodies waiting for a worker, i.e. what a backlog of them is holding.
+    static auto& queued_memory = util::get_memory_counter("quic_queue");
+    auto held = std::make_shared<util::tracked_memory>(queued_memory, msg->body().size());
+
     // We handle everything inside an inject task because if we do *anything* that requires
     // `sn_mutex_` we could deadlock (because the `open_stream` we do in reachability testing is
     // synchronous, but is also called with the `sn_mutex_` held).
     omq.inject_task(
-            "quic", "quic:{}"_format(msg->endpoint()), remote_host, [this, msg, remote_host] {
-                auto name = msg->endpoint();
+            sn_request ? "sn" : "quic",
+            "quic:{}"_format(name),
+            remote_host,
+            [this,
+             msg,
+             held = std::move(held),
+             remote_host,
+             name = name,
+             accept = accept,
+             sn_request,
+             queued = std::chrono::steady_clock::now()] {
+                held->reset();
+                // (The "sn" category's waits don't tell us anything about client load)
+                if (!sn_request)
+                    request_handler_->admission().observe_wait(
+                            std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - queued));
 
                 if (name == "snode_ping")
                     handle_ping(std::move(msg));
@@ -108,11 +213,23 @@ void QUIC::handle_request(std::shared_ptr<quic::message> msg) {
                 if (name == "onion_req")
                     handle_onion_request(std::move(msg));
 
+                if (name == "sn.data" || name == "sn.storage_cc_batch")
+                    return handle_peer_request(std::move(msg), name);
+
                 handle_client_rpc(
                         name,
                         msg->body(),
                         remote_host,
-                        [msg](http::response_code code, std::string_view res_body) {
+                        accept.value_or(rpc::encoding::identity),
+                        [msg, prefix = accept.has_value()](
+                                http::response_code code,
+                                std::string_view res_body,
+                                rpc::encoding enc) {
+                            std::string prefixed;
+                            if (prefix) {
+                                prefixed = "{}\n{}"_format(rpc::to_string(enc), res_body);
+                                res_body = prefixed;
+                            }
                             if (code.first == http::OK.first)
                                 msg->respond(res_body);
                             else
@@ -123,6 +240,60 @@ void QUIC::handle_request(std::shared_ptr<quic::message> msg) {
             });
 }
 
+void QUIC::handle_peer_request(std::shared_ptr<quic::message> msg, std::string_view name) {
+    std::optional<snode::sn_record> sn;
+    if (auto conn = msg->stream()->endpoint.get_conn(msg->conn_rid())) {
+        auto key = conn->remote_key();
+        sn = service_node_->find_node(crypto::ed25519_pubkey::from_bytes(
+                {reinterpret_cast<const char*>(key.data()), key.size()}));
+    }
+    if (!sn) {
+        log::warning(
+                logcat,
+                "Rejecting QUIC {} request from {}: not a registered service node",
+                name,
+                msg->stream()->remote());
+        return msg->respond(
+                "{} {}\n\n{}"_format(
+                        http::FORBIDDEN.first, http::FORBIDDEN.second, "not a service node"),
+                true);
+    }
+
+    // Taken before the calls below, whose callbacks take over `msg`:
+    auto body = msg->body();
+
+    if (name == "sn.data") {
+        // Same as OMQ's sn.data: "OK", the number of new messages and (if we have zstd)
+        // snode::SN_DATA_ZSTD, or "ERR"
+        return service_node_->process_push_batch(
+                std::string{body}, [msg = std::move(msg)](std::optional<int> added) {
+                    oxenc::bt_list reply;
+                    if (added) {
+                        reply.emplace_back("OK");
+                        reply.emplace_back(std::to_string(*added));
+                        if (rpc::zstd_enabled())
+                            reply.emplace_back(std::string{snode::SN_DATA_ZSTD});
+                    } else
+                        reply.emplace_back("ERR");
+                    msg->respond(oxenc::bt_serialize(reply));
+                });
+    }
+
+    handle_client_rpc_batch(
+            body,
+            sn->ip,
+            [msg = std::move(msg)](http::response_code status, std::string body) {
+                // The parts OMQ would reply with: [body] on success, [code, body] on failure
+                std::string out;
+                out += 'l';
+                if (status != http::OK)
+                    out += oxenc::bt_serialize(std::to_string(status.first));
+                out += oxenc::bt_serialize(body);
+                out += 'e';
+                msg->respond(std::move(out));
+            });
+}
+
 void QUIC::handle_onion_request(std::shared_ptr<quic::message> msg) {
 
     auto started = std::chrono::steady_clock::now();
@@ -135,7 +306,10 @@ void QUIC::handle_onion_request(std::shared_ptr<quic::message> msg) {
                             "Got an onion response ({} {}) as edge node (after {})",
                             res.status.first,
                             res.status.second,
-                            util::friendly_duration(std::chrono::steady_clock::now() - started));
+                            logging::lazy([&started] {
+                                return util::friendly_duration(
+                                        std::chrono::steady_clock::now() - started);
+                            }));
 
                     const bool is_json = std::holds_alternative<nlohmann::json>(res.body);
                     std::string json_body;
@@ -195,25 +369,119 @@ nlohmann::json QUIC::wrap_response(
     return res;
 }
 
+std::string QUIC::wrap_encoded(
+        const http::response_code& status, std::string body, bool bt) const {
+    // The same [CODE, BODY] list as above, spliced around the already-encoded body.
+    return bt ? "li{}e{}e"_format(status.first, body) : "[{},{}]"_format(status.first, body);
+}
+
 void QUIC::notify(std::vector<connection_id>& conns, std::string_view notification) {
-    for (const auto& c : conns)
-        if (auto* cid = std::get_if<quic::ConnectionID>(&c))
-            if (auto conn = ep->get_conn(*cid))
-                if (auto str = conn->get_stream<quic::BTRequestStream>(0))
-                    str->command("notify", notification);
+    // Subscribers are incoming connections, so are all on the listening endpoint
+    for (const auto& c : conns) {
+        auto* cid = std::get_if<quic::ConnectionID>(&c);
+        if (!cid)
+            continue;
+        if (auto conn = ep->get_conn(*cid)) {
+            if (auto str = conn->get_stream<quic::BTRequestStream>(0))
+                str->command("notify", notification);
+        } else {
+            // The connection is gone, so its subscriptions are useless:
+            remove_monitors(c);
+        }
+    }
 }
 
-void QUIC::reachability_test(std::shared_ptr<snode::sn_test> test) {
-    if (!service_node_->hf_at_least(snode::QUIC_REACHABILITY_TESTING))
-        return test->add_result(true);
+std::shared_ptr<quic::BTRequestStream> QUIC::peer_stream(loop& l, const snode::sn_record& sn) {
+    {
+        std::lock_guard lock{peer_conns_mutex_};
+        if (auto it = peer_conns_.find(sn.pubkey_legacy); it != peer_conns_.end()) {
+            if (l.ep->get_conn(it->second.cid))
+                return it->second.stream;
+            peer_conns_.erase(it);
+        }
+    }
 
-    auto& sn = test->sn;
-    auto conn = ep->connect(
+    l.connects++;
+    auto conn = l.ep->connect(
             {sn.pubkey_ed25519.view(), sn.ip, sn.omq_quic_port},
             tls_creds,
             quic::opt::handshake_timeout{5s});
     auto s = conn->open_stream<quic::BTRequestStream>();
+
+    std::lock_guard lock{peer_conns_mutex_};
+    if (peer_conns_.size() < MAX_PEER_CONNECTIONS)
+        peer_conns_.insert_or_assign(sn.pubkey_legacy, peer_conn{conn->reference_id(), s});
+    return s;
+}
+
+void QUIC::peer_request_done(const quic::message& m, const crypto::legacy_pubkey& pk, bool ok) {
+    std::lock_guard lock{peer_conns_mutex_};
+    auto it = peer_conns_.find(pk);
+    bool kept = it != peer_conns_.end() && it->second.cid == m.conn_rid();
+    if (ok && kept)
+        return;
+    if (kept)
+        peer_conns_.erase(it);
+    if (auto conn = m.stream()->endpoint.get_conn(m.conn_rid()))
+        conn->close_connection();
+}
+
+bool QUIC::peer_request(
+        const crypto::x25519_pubkey& pk,
+        std::string_view command,
+        std::string_view body,
+        snode::peer_reply_callback cb) {
+    if (!service_node_->hf_at_least(snode::QUIC_PEER_REQUESTS))
+        return false;
+    auto sn = service_node_->find_node(pk);
+    if (!sn || sn->ip.empty() || sn->ip == "0.0.0.0" || !sn->omq_quic_port)
+        return false;
+
+    auto& l = test_loop(sn->pubkey_legacy);
+    l.peer_requests++;
+    peer_stream(l, *sn)->command(
+            std::string{command},
+            std::string{body},
+            [this, cb = std::move(cb), legacy = sn->pubkey_legacy](quic::message m) {
+                std::vector<std::string> parts;
+                bool ok = !m.timed_out && !m.is_error();
+                if (ok) {
+                    try {
+                        oxenc::bt_list_consumer list{m.body()};
+                        while (!list.is_finished())
+                            parts.push_back(list.consume_string());
+                    } catch (const std::exception& e) {
+                        log::warning(
+                                logcat, "Invalid QUIC peer reply from {}: {}", legacy, e.what());
+                        ok = false;
+                    }
+                } else {
+                    log::debug(
+                            logcat,
+                            "QUIC peer request to {} failed: {}",
+                            legacy,
+                            m.timed_out ? "timeout" : m.body());
+                }
+                peer_request_done(m, legacy, ok);
+                if (!ok)
+                    parts.clear();
+                cb(ok, std::move(parts));
+            });
+    return true;
+}
+
+void QUIC::reachability_test(std::shared_ptr<snode::sn_test> test) {
+    if (!service_node_->hf_at_least(snode::QUIC_REACHABILITY_TESTING))
+        return test->add_result(true);
+
+    auto& sn = test->sn;
+    auto& l = test_loop(sn.pubkey_legacy);
+    l.tests++;
+
+    auto s = peer_stream(l, sn);
     s->command("snode_ping", ""s, [test = std::move(test), this](const quic::message& m) mutable {
+        service_node_->record_test_latency(
+                snode::ReachType::QUIC, std::chrono::steady_clock::now() - test->started);
         bool passed;
         if (m.timed_out || m.body() != "pong"sv) {
             log::debug(
@@ -229,8 +497,8 @@ void QUIC::reachability_test(std::shared_ptr<snode::sn_test> test) {
                     test->sn.pubkey_legacy);
             passed = true;
         }
-        if (auto conn = m.stream()->endpoint.get_conn(m.conn_rid()))
-            conn->close_connection();
+        // Keep a working connection around for the next test of (or request to) this node:
+        peer_request_done(m, test->sn.pubkey_legacy, passed);
 
         // Defer this to an omq task; the same deadlock-avoidance logic described in
         // handle_request applies here.
@@ -10,6 +10,11 @@
 
 #include <oxen/quic.hpp>
 
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <vector>
+
 namespace oxenss::rpc {
 class RequestHandler;
 }  // namespace oxenss::rpc
@@ -18,30 +23,18 @@ namespace oxenss::server {
 
 namespace quic = oxen::quic;
 
-using quic_callback = std::function<void(quic::message)>;
 using Address = quic::Address;
 
-struct PendingRequest {
-    std::optional<std::string> name = std::nullopt;
-    std::string body;
-    quic_callback func = nullptr;
-
-    // Constructor
-    PendingRequest(std::string name, std::string body, quic_callback func) :
-            name{std::move(name)}, body{std::move(body)}, func{std::move(func)} {}
-    PendingRequest(std::string_view name, std::string_view body, quic_callback func) :
-            name{name}, body{body}, func{std::move(func)} {}
-};
-
-using RequestQueue = std::deque<PendingRequest>;
-
 class QUIC : public MQBase {
   public:
     QUIC(snode::ServiceNode& snode,
          rpc::RequestHandler& rh,
          rpc::RateLimiter& rl,
          const Address& bind,
-         const crypto::ed25519_seckey& sk);
+         const crypto::ed25519_seckey& sk,
+         unsigned threads = 1);
+
+    ~QUIC() override;
 
     void startup_endpoint();
 
@@ -49,7 +42,20 @@ class QUIC : public MQBase {
 
     void reachability_test(std::shared_ptr<snode::sn_test> test) override;
 
-    oxen::quic::Network& net() { return network; }
+    // Sends an `sn.data` or `sn.storage_cc_batch` request to another service node over QUIC rather
+    // than OMQ (see snode::peer_request_func, for which the service node uses this).  Returns false
+    // (to have the caller use OMQ) before QUIC_PEER_REQUESTS, or if we don't know the node's QUIC
+    // address.  QUIC's per-stream flow control paces large relay batches, so a slow peer holds up
+    // only its own connection.
+    bool peer_request(
+            const crypto::x25519_pubkey& pk,
+            std::string_view command,
+            std::string_view body,
+            snode::peer_reply_callback cb);
+
+    // The event loop for other users of a libquic loop (i.e. the http client): the last of our
+    // loops, so that when we have several the listening loop is left to incoming QUIC traffic.
+    oxen::quic::Network& net() { return loops_.size() > 1 ? *loops_.back()->network : network; }
 
   private:
     const Address local;
@@ -57,11 +63,65 @@ class QUIC : public MQBase {
     std::shared_ptr<quic::GNUTLSCreds> tls_creds;
     std::shared_ptr<quic::Endpoint> ep;
 
+    // One of our libquic event loops (i.e. a quic::Network, each with its own thread) and its
+    // endpoint.  The first is `network` and `ep`, which listens on our public port and so handles
+    // all incoming connections (libquic binds its own sockets, so we can't share the port between
+    // loops with SO_REUSEPORT).  Any others have outgoing-only endpoints (on a random port) which
+    // we spread our outgoing connections (reachability tests and peer requests) across: each node
+    // is always connected to from the same loop, so that the loop's connection to it can be reused.
+    struct loop {
+        std::optional<quic::Network> network;  // nullopt for the first loop, which uses `network`
+        std::shared_ptr<quic::Endpoint> ep;
+
+        std::atomic<int64_t> tests = 0;          // reachability tests sent
+        std::atomic<int64_t> peer_requests = 0;  // requests sent by peer_request
+        std::atomic<int64_t> connects = 0;       // new outgoing connections
+    };
+    std::vector<std::unique_ptr<loop>> loops_;
+
+    // Incoming requests received; these all arrive on the first loop, so this isn't per-loop.
+    std::atomic<int64_t> requests_ = 0;
+
+    // Returns the loop from which to connect to (i.e. test, or send peer requests to) the given
+    // node.
+    loop& test_loop(const crypto::legacy_pubkey& pk);
+
     rpc::RequestHandler& request_handler;
     std::function<void(quic::message m)> command_handler;
 
+    // Concurrent bidirectional streams a client may open on a connection.  Every one of them is a
+    // BTRequestStream handled by `command_handler`, so a client with several requests in flight
+    // can spread them across streams: responses on one stream are sent in order, so a large
+    // response (e.g. a big retrieve) would otherwise hold up every response queued behind it.
+    static constexpr uint64_t MAX_CLIENT_STREAMS = 32;
+
+    // The most outgoing connections to other nodes we keep open for reuse by later reachability
+    // tests and peer requests.
+    static constexpr size_t MAX_PEER_CONNECTIONS = 64;
+
+    // Open connections to other nodes, by legacy pubkey (each on the endpoint of the node's
+    // test_loop), with the request stream that we use for everything we send to it.
+    struct peer_conn {
+        quic::ConnectionID cid;
+        std::shared_ptr<quic::BTRequestStream> stream;
+    };
+    std::unordered_map<crypto::legacy_pubkey, peer_conn> peer_conns_;
+    std::mutex peer_conns_mutex_;
+
+    // Returns the request stream to use for the given node, connecting to it from `l` unless a
+    // connection from an earlier test or request is still open.
+    std::shared_ptr<quic::BTRequestStream> peer_stream(loop& l, const snode::sn_record& sn);
+
+    // Called with the outcome of a request sent on a peer_stream() stream: if it failed or the
+    // connection isn't one we keep (because we already have too many) then the connection is
+    // closed, so that the next request to the node makes a new one.
+    void peer_request_done(const quic::message& m, const crypto::legacy_pubkey& pk, bool ok);
+
     std::shared_ptr<quic::Endpoint> create_endpoint();
 
+    // Handles an incoming request.  The request body stays in the buffer of the message (all the
+    // way through to the rpc handler's parsing of it, which works on views), and `msg` is kept
+    // alive until the response is sent.
     void handle_request(std::shared_ptr<quic::message> msg);
 
     void handle_onion_request(std::shared_ptr<quic::message> msg);
@@ -70,9 +130,19 @@ class QUIC : public MQBase {
 
     void handle_ping(std::shared_ptr<quic::message> msg);
 
+    // Handles `sn.data` and `sn.storage_cc_batch` requests from other service nodes (see
+    // peer_request), which are only accepted from registered service nodes.  The reply is a
+    // bt-encoded list of the parts of the reply that OMQ would have given.
+    void handle_peer_request(std::shared_ptr<quic::message> msg, std::string_view name);
+
     nlohmann::json wrap_response(
             [[maybe_unused]] const http::response_code& status,
             nlohmann::json response) const override;
+
+    std::string wrap_encoded(
+            const http::response_code& status, std::string response, bool bt) const override;
+
+    rpc::transport transport() const override { return rpc::transport::quic; }
 };
 
 }  // namespace oxenss::server
@@ -0,0 +1,174 @@
+#include "tls_session_tickets.h"
+
+extern "C" {
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+}
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace oxenss::server {
+
+static auto logcat = log::Cat("server");
+
+namespace {
+
+    // The SSL_CTX ex_data slot holding the TlsSessionTickets pointer
+    int ctx_index() {
+        static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    // The SSL ex_data slot holding each connection's handshake start time (in microseconds of
+    // the steady clock, plus one so that it's never 0), or HANDSHAKE_DONE after the first
+    // handshake completes.  (TLS 1.3 can fire handshake callbacks again after the handshake, e.g.
+    // when sending new session tickets, which we don't want to count).
+    int ssl_index() {
+        static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+    constexpr auto HANDSHAKE_DONE = UINTPTR_MAX;
+
+    int64_t now_us() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+    }
+
+    template <typename Key>
+    void random_key(Key& k) {
+        if (RAND_bytes(k.name.data(), k.name.size()) != 1 ||
+            RAND_bytes(k.aes.data(), k.aes.size()) != 1 ||
+            RAND_bytes(k.hmac.data(), k.hmac.size()) != 1)
+            throw std::runtime_error{"Failed to generate TLS session ticket key"};
+    }
+
+}  // namespace
+
+TlsSessionTickets::TlsSessionTickets() : rotated_{std::chrono::steady_clock::now()} {
+    random_key(current_);
+}
+
+void TlsSessionTickets::attach(ssl_ctx_st* ctx) {
+    if (ctx_index() < 0 || ssl_index() < 0 || !SSL_CTX_set_ex_data(ctx, ctx_index(), this) ||
+        !SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &TlsSessionTickets::ticket_cb))
+        throw std::runtime_error{"Failed to set up TLS session tickets"};
+
+    // Tickets are usable for up to two rotation intervals, so tell clients that:
+    SSL_CTX_set_timeout(ctx, 2 * ROTATION_INTERVAL.count());
+    SSL_CTX_set_info_callback(ctx, &TlsSessionTickets::info_cb);
+}
+
+void TlsSessionTickets::rotate_if_needed() {
+    auto now = std::chrono::steady_clock::now();
+    auto age = now - rotated_;
+    if (age < ROTATION_INTERVAL)
+        return;
+    // If we've been idle for more than another whole interval then the current key is not only
+    // too old to issue tickets, but too old to accept them either.
+    have_previous_ = age < 2 * ROTATION_INTERVAL;
+    previous_ = current_;
+    random_key(current_);
+    rotated_ = now;
+    rotations_++;
+    log::debug(logcat, "Rotated TLS session ticket key");
+}
+
+int TlsSessionTickets::ticket_cb(
+        ssl_st* ssl,
+        unsigned char* key_name,
+        unsigned char* iv,
+        evp_cipher_ctx_st* cctx,
+        evp_mac_ctx_st* hctx,
+        int enc) {
+    auto* self =
+            static_cast<TlsSessionTickets*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_index()));
+    if (!self)
+        return 0;
+
+    try {
+        std::lock_guard lock{self->mutex_};
+        self->rotate_if_needed();
+
+        const ticket_key* key = nullptr;
+        int result = 1;
+        if (enc) {
+            key = &self->current_;
+            if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1)
+                return -1;
+            std::memcpy(key_name, key->name.data(), key->name.size());
+            if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key->aes.data(), iv))
+                return -1;
+        } else {
+            auto named = [key_name](const ticket_key& k) {
+                return std::memcmp(key_name, k.name.data(), k.name.size()) == 0;
+            };
+            if (named(self->current_))
+                key = &self->current_;
+            else if (self->have_previous_ && named(self->previous_)) {
+                key = &self->previous_;
+                result = 2;  // Accept it, but issue a new ticket with the current key
+            } else
+                return 0;  // Unknown (or expired) key: do a full handshake
+            if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key->aes.data(), iv))
+                return -1;
+        }
+
+        OSSL_PARAM params[] = {
+                OSSL_PARAM_construct_octet_string(
+                        OSSL_MAC_PARAM_KEY,
+                        const_cast<unsigned char*>(key->hmac.data()),
+                        key->hmac.size()),
+                OSSL_PARAM_construct_utf8_string(
+                        OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+                OSSL_PARAM_construct_end()};
+        if (!EVP_MAC_CTX_set_params(hctx, params))
+            return -1;
+        return result;
+    } catch (const std::exception& e) {
+        log::error(logcat, "TLS session ticket failure: {}", e.what());
+        return -1;
+    }
+}
+
+void TlsSessionTickets::info_cb(const ssl_st* ssl, int where, int /*ret*/) {
+    if (!(where & (SSL_CB_HANDSHAKE_START | SSL_CB_HANDSHAKE_DONE)))
+        return;
+    auto state = reinterpret_cast<uintptr_t>(SSL_get_ex_data(ssl, ssl_index()));
+    if (where & SSL_CB_HANDSHAKE_START) {
+        if (state == 0)
+            SSL_set_ex_data(
+                    const_cast<ssl_st*>(ssl),
+                    ssl_index(),
+                    reinterpret_cast<void*>(static_cast<uintptr_t>(now_us() + 1)));
+        return;
+    }
+    if (state == 0 || state == HANDSHAKE_DONE)
+        return;
+    SSL_set_ex_data(const_cast<ssl_st*>(ssl), ssl_index(), reinterpret_cast<void*>(HANDSHAKE_DONE));
+
+    auto* self =
+            static_cast<TlsSessionTickets*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_index()));
+    if (!self)
+        return;
+    (SSL_session_reused(ssl) ? self->resumed_ : self->full_)++;
+    int64_t us = now_us() + 1 - static_cast<int64_t>(state);
+    self->handshake_us_ += us;
+    auto max = self->handshake_max_us_.load();
+    while (us > max && !self->handshake_max_us_.compare_exchange_weak(max, us)) {}
+}
+
+TlsSessionTickets::stats TlsSessionTickets::get_stats() const {
+    return {full_.load(),
+            resumed_.load(),
+            handshake_us_.load(),
+            handshake_max_us_.load(),
+            rotations_.load()};
+}
+
+}  // namespace oxenss::server
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+// Forward declarations of the OpenSSL types (SSL_CTX, SSL, etc.) we use
+struct ssl_ctx_st;
+struct ssl_st;
+struct evp_cipher_ctx_st;
+struct evp_mac_ctx_st;
+
+namespace oxenss::server {
+
+// TLS session resumption for the HTTPS server.  Clients reconnect constantly and, without
+// resumption, each new connection needs a full handshake with its certificate signature and key
+// exchange.  OpenSSL can issue session tickets by itself, but encrypts them with a random key per
+// SSL_CTX: each of our HTTPS event loops has its own context, so a ticket issued by one loop
+// would be useless on a reconnection that lands on another.  This instead encrypts tickets with
+// keys shared by every context it is attached to, rotating to a new key every ROTATION_INTERVAL.
+// Tickets made with the previous key are still accepted (and get replaced with a new ticket), so
+// a ticket remains usable for between one and two intervals.
+//
+// It also counts full versus resumed handshakes, and how long they take.
+class TlsSessionTickets {
+  public:
+    static constexpr std::chrono::seconds ROTATION_INTERVAL{3600};
+
+    TlsSessionTickets();
+
+    TlsSessionTickets(const TlsSessionTickets&) = delete;
+    TlsSessionTickets& operator=(const TlsSessionTickets&) = delete;
+
+    // Sets up the given (server) SSL_CTX to issue and accept our session tickets, and to report
+    // its handshakes to us.  This object must outlive the context.  Throws on failure.
+    void attach(ssl_ctx_st* ctx);
+
+    struct stats {
+        int64_t full_handshakes;   // completed handshakes that did not resume a session
+        int64_t resumed;           // completed handshakes that resumed a session
+        int64_t handshake_us;      // total time of all completed handshakes, in microseconds
+        int64_t handshake_max_us;  // longest completed handshake
+        int64_t rotations;         // number of times we have rotated to a new ticket key
+    };
+
+    stats get_stats() const;
+
+  private:
+    struct ticket_key {
+        std::array<unsigned char, 16> name;
+        std::array<unsigned char, 32> aes;
+        std::array<unsigned char, 32> hmac;
+    };
+
+    std::mutex mutex_;
+    ticket_key current_;
+    ticket_key previous_;
+    bool have_previous_ = false;
+    std::chrono::steady_clock::time_point rotated_;
+
+    std::atomic<int64_t> full_ = 0;
+    std::atomic<int64_t> resumed_ = 0;
+    std::atomic<int64_t> handshake_us_ = 0;
+    std::atomic<int64_t> handshake_max_us_ = 0;
+    std::atomic<int64_t> rotations_ = 0;
+
+    // Generates a new current key once the current one is ROTATION_INTERVAL old.  Must be called
+    // with mutex_ held.
+    void rotate_if_needed();
+
+    static int ticket_cb(
+            ssl_st* ssl,
+            unsigned char* key_name,
+            unsigned char* iv,
+            evp_cipher_ctx_st* cctx,
+            evp_mac_ctx_st* hctx,
+            int enc);
+
+    static void info_cb(const ssl_st* ssl, int where, int ret);
+};
+
+}  // namespace oxenss::server
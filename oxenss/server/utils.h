@@ -23,8 +23,8 @@ using bstring_view = std::basic_string_view<std::byte>;
 // place this here so we can use it in oxenss::*
 using namespace std::literals;
 
-// {pubkey (bytes), pubkey (hex), namespaces, want_data}
-using sub_info = std::tuple<std::string, std::string, std::vector<namespace_id>, bool>;
+// {pubkey (bytes), pubkey (hex), namespaces, want_data, want_changes}
+using sub_info = std::tuple<std::string, std::string, std::vector<namespace_id>, bool, bool>;
 
 oxenc::bt_value json_to_bt(nlohmann::json j);
 
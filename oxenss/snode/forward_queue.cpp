@@ -0,0 +1,232 @@
+#include "forward_queue.h"
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <oxenc/bt_serialize.h>
+#include <oxenmq/oxenmq.h>
+
+namespace oxenss::snode {
+
+static auto logcat = log::Cat("snode");
+
+ForwardQueue::ForwardQueue(oxenmq::OxenMQ& omq) : omq_{omq} {
+    thread_ = std::thread{[this] { run(); }};
+}
+
+ForwardQueue::~ForwardQueue() {
+    shutdown();
+}
+
+void ForwardQueue::push(
+        const crypto::x25519_pubkey& peer,
+        std::string_view cmd,
+        std::string body,
+        reply_callback cb) {
+    bool wake;
+    {
+        std::unique_lock lock{mutex_};
+        if (stopping_) {
+            lock.unlock();
+            cb(false, {});
+            return;
+        }
+        auto& b = pending_[peer];
+        wake = b.commands.empty();
+        if (wake)
+            b.deadline = std::chrono::steady_clock::now() + COALESCE_WINDOW;
+        b.bytes += cmd.size() + body.size();
+        b.commands.push_back(command{std::string{cmd}, std::move(body), std::move(cb)});
+        queued_++;
+        if (b.commands.size() >= MAX_BATCH || b.bytes >= MAX_BATCH_BYTES) {
+            b.deadline = {};
+            wake = true;
+        }
+    }
+    if (wake)
+        cv_.notify_one();
+}
+
+void ForwardQueue::set_peer_request(peer_request_func f) {
+    std::lock_guard lock{mutex_};
+    peer_request_ = std::move(f);
+}
+
+void ForwardQueue::shutdown() {
+    decltype(pending_) dropped;
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+        dropped.swap(pending_);
+        queued_ = 0;
+    }
+    cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+    for (auto& [peer, b] : dropped)
+        for (auto& c : b.commands)
+            c.cb(false, {});
+}
+
+void ForwardQueue::run() {
+    std::vector<std::pair<crypto::x25519_pubkey, std::vector<command>>> ready;
+    std::unique_lock lock{mutex_};
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+        if (stopping_)
+            return;
+
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (auto it = pending_.begin(); it != pending_.end();) {
+            if (it->second.deadline <= now) {
+                queued_ -= it->second.commands.size();
+                ready.emplace_back(it->first, std::move(it->second.commands));
+                it = pending_.erase(it);
+            } else {
+                next = std::min(next, it->second.deadline);
+                ++it;
+            }
+        }
+
+        if (ready.empty()) {
+            // Nothing due yet: sleep until the earliest window closes (or a push fills a batch,
+            // or starts a new one, in which case we rescan).
+            cv_.wait_until(lock, next);
+            continue;
+        }
+
+        lock.unlock();
+        for (auto& [peer, cmds] : ready) {
+            try {
+                send(peer, std::move(cmds));
+            } catch (const std::exception& e) {
+                log::error(logcat, "Failed to forward commands to {}: {}", peer, e.what());
+            }
+        }
+        ready.clear();
+        lock.lock();
+    }
+}
+
+void ForwardQueue::send(const crypto::x25519_pubkey& peer, std::vector<command> cmds) {
+    peer_request_func peer_request;
+    {
+        std::lock_guard lock{mutex_};
+        commands_ += cmds.size();
+        requests_++;
+        if (cmds.size() > 1)
+            batches_++;
+        peer_request = peer_request_;
+    }
+
+    if (cmds.size() == 1 && !peer_request) {
+        auto& c = cmds.front();
+        omq_.request(
+                peer.view(),
+                "sn.storage_cc",
+                std::move(c.cb),
+                c.cmd,
+                std::move(c.body),
+                oxenmq::send_option::request_timeout{REQUEST_TIMEOUT});
+        return;
+    }
+
+    // The batch request is a single part containing a list of [cmd, body] pairs; we encode it
+    // directly, rather than going through a bt_list, to avoid copying the bodies around.
+    size_t size = 2;
+    for (auto& c : cmds)
+        size += c.cmd.size() + c.body.size() + 24;
+    std::string req;
+    req.reserve(size);
+    req += 'l';
+    for (auto& c : cmds) {
+        req += 'l';
+        req += std::to_string(c.cmd.size());
+        req += ':';
+        req += c.cmd;
+        req += std::to_string(c.body.size());
+        req += ':';
+        req += c.body;
+        req += 'e';
+    }
+    req += 'e';
+
+    auto cbs = std::make_shared<std::vector<reply_callback>>();
+    cbs->reserve(cmds.size());
+    for (auto& c : cmds)
+        cbs->push_back(std::move(c.cb));
+    auto on_reply = batch_reply_handler(peer, cbs);
+
+    if (peer_request && peer_request(peer, "sn.storage_cc_batch", req, on_reply)) {
+        std::lock_guard lock{mutex_};
+        quic_++;
+        return;
+    }
+    if (cmds.size() == 1) {
+        // We only built a batch for peer_request, which declined it, so send it the usual way:
+        omq_.request(
+                peer.view(),
+                "sn.storage_cc",
+                std::move(cbs->front()),
+                cmds.front().cmd,
+                std::move(cmds.front().body),
+                oxenmq::send_option::request_timeout{REQUEST_TIMEOUT});
+        return;
+    }
+
+    omq_.request(
+            peer.view(),
+            "sn.storage_cc_batch",
+            std::move(on_reply),
+            std::move(req),
+            oxenmq::send_option::request_timeout{REQUEST_TIMEOUT});
+}
+
+ForwardQueue::reply_callback ForwardQueue::batch_reply_handler(
+        const crypto::x25519_pubkey& peer, std::shared_ptr<std::vector<reply_callback>> cbs) {
+    return [this, cbs = std::move(cbs), peer](bool success, std::vector<std::string> parts) {
+        if (!success) {
+            for (auto& cb : *cbs)
+                cb(false, {});
+            return;
+        }
+
+        // The reply is a single part containing a list of the reply part lists of each command,
+        // in request order.
+        std::vector<std::vector<std::string>> replies;
+        try {
+            if (parts.size() != 1)
+                throw std::invalid_argument{
+                        "expected 1 reply part, got " + std::to_string(parts.size())};
+            oxenc::bt_list_consumer list{parts[0]};
+            while (!list.is_finished()) {
+                auto& r = replies.emplace_back();
+                auto rparts = list.consume_list_consumer();
+                while (!rparts.is_finished())
+                    r.push_back(rparts.consume_string());
+            }
+            if (replies.size() != cbs->size())
+                throw std::invalid_argument{
+                        fmt::format("expected {} replies, got {}", cbs->size(), replies.size())};
+        } catch (const std::exception& e) {
+            log::warning(logcat, "Received invalid batch reply from {}: {}", peer, e.what());
+            bad_reply_++;
+            for (auto& cb : *cbs)
+                cb(true, {});
+            return;
+        }
+
+        for (size_t i = 0; i < cbs->size(); i++)
+            (*cbs)[i](true, std::move(replies[i]));
+    };
+}
+
+ForwardQueue::forward_stats ForwardQueue::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return forward_stats{queued_, commands_, requests_, batches_, bad_reply_.load(), quic_};
+}
+
+}  // namespace oxenss::snode
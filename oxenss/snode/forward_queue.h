@@ -0,0 +1,125 @@
+#pragma once
+
+#include <oxenss/crypto/keys.h>
+#include "peer_requests.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace oxenmq {
+class OxenMQ;
+}
+
+namespace oxenss::snode {
+
+using namespace std::literals;
+
+// Coalesces the recursive client requests (store, delete, expire, ...) that we forward to our swarm
+// peers via `sn.storage_cc`.  Under load a node forwards many small commands to the same handful
+// of peers; rather than sending each one as its own request we hold commands for a peer for up to
+// COALESCE_WINDOW and then send everything collected for it as a single `sn.storage_cc_batch`
+// request, whose reply contains the individual replies in the same order.
+//
+// A batch is sent early once it reaches MAX_BATCH commands or MAX_BATCH_BYTES of request data.  A
+// lone command (the common case on a quiet node) is still sent as a plain `sn.storage_cc`.
+//
+// When a `peer_request` transport (i.e. QUIC) is set and accepts the request then everything,
+// including lone commands, goes out that way as an `sn.storage_cc_batch`.
+class ForwardQueue {
+  public:
+    // How long we hold a command, after it is queued, for more commands to the same peer.
+    static constexpr auto COALESCE_WINDOW = 2ms;
+
+    // Batch size limits at which a batch gets sent without waiting for the window to close.
+    static constexpr size_t MAX_BATCH = 32;
+    static constexpr size_t MAX_BATCH_BYTES = 1'000'000;
+
+    // How long we wait for a (batch) reply before failing the commands in it.
+    static constexpr auto REQUEST_TIMEOUT = 5s;
+
+    // Called with the outcome of a forwarded command: `success` is false if the request failed or
+    // timed out; otherwise `parts` are the reply parts, exactly as a direct `sn.storage_cc` request
+    // would have received (i.e. the bt-encoded response, or an error code and message).  The
+    // parts are left empty if the peer returned an unparseable batch reply.
+    using reply_callback = peer_reply_callback;
+
+    explicit ForwardQueue(oxenmq::OxenMQ& omq);
+
+    // Calls shutdown().
+    ~ForwardQueue();
+
+    // Queues command `cmd` with bt-encoded request `body` for forwarding to `peer`.  `cb` is
+    // invoked from an oxenmq thread once the peer replies or the request fails.
+    void push(
+            const crypto::x25519_pubkey& peer,
+            std::string_view cmd,
+            std::string body,
+            reply_callback cb);
+
+    // Sets (or, with nullptr, clears) the alternative transport to try for sending requests.
+    void set_peer_request(peer_request_func f);
+
+    // Stops the send thread; anything still queued is failed.
+    void shutdown();
+
+    struct forward_stats {
+        size_t queued;       // commands waiting to be sent
+        uint64_t commands;   // commands sent so far
+        uint64_t requests;   // requests the sent commands went out in
+        uint64_t batches;    // ... of which were multi-command `sn.storage_cc_batch` requests
+        uint64_t bad_reply;  // batch replies that didn't parse, or had the wrong number of replies
+        uint64_t quic;       // requests that went via `peer_request` (i.e. QUIC)
+    };
+    forward_stats get_stats() const;
+
+  private:
+    oxenmq::OxenMQ& omq_;
+
+    struct command {
+        std::string cmd;
+        std::string body;
+        reply_callback cb;
+    };
+
+    struct peer_batch {
+        std::vector<command> commands;
+        size_t bytes = 0;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<crypto::x25519_pubkey, peer_batch> pending_;
+    size_t queued_ = 0;
+    uint64_t commands_ = 0;
+    uint64_t requests_ = 0;
+    uint64_t batches_ = 0;
+    std::atomic<uint64_t> bad_reply_ = 0;
+    uint64_t quic_ = 0;
+    peer_request_func peer_request_;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    void run();
+
+    // Sends the given commands to `peer`, as a batch if there is more than one (or if sending via
+    // peer_request).
+    void send(const crypto::x25519_pubkey& peer, std::vector<command> cmds);
+
+    // Returns the callback that splits a batch reply from `peer` into the replies of the
+    // individual commands, and passes each of them on to the corresponding callback in `cbs`.
+    reply_callback batch_reply_handler(
+            const crypto::x25519_pubkey& peer, std::shared_ptr<std::vector<reply_callback>> cbs);
+};
+
+}  // namespace oxenss::snode
@@ -0,0 +1,139 @@
+#include "notify_queue.h"
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <algorithm>
+#include <exception>
+
+namespace oxenss::snode {
+
+static auto logcat = log::Cat("snode");
+
+NotifyQueue::NotifyQueue(deliver_callback deliver, size_t max_queued) :
+        deliver_{std::move(deliver)}, max_queued_{max_queued} {
+    thread_ = std::thread{[this] { run(); }};
+}
+
+NotifyQueue::~NotifyQueue() {
+    shutdown();
+}
+
+void NotifyQueue::push(message msg) {
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_)
+            return;
+        if (queued_bytes_ + msg.data.size() > max_queued_) {
+            if (dropped_++ % 1000 == 0)
+                log::warning(logcat, "Notification queue is full; dropping new notifications");
+            return;
+        }
+        queued_bytes_ += msg.data.size();
+        queue_.emplace_back(std::chrono::steady_clock::now(), std::move(msg));
+    }
+    cv_.notify_one();
+}
+
+void NotifyQueue::push(message_change change) {
+    size_t size = 0;
+    for (auto& h : change.hashes)
+        size += h.size();
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_)
+            return;
+        if (queued_bytes_ + size > max_queued_) {
+            if (dropped_++ % 1000 == 0)
+                log::warning(logcat, "Notification queue is full; dropping new notifications");
+            return;
+        }
+        queued_bytes_ += size;
+        changes_.emplace_back(std::chrono::steady_clock::now(), std::move(change));
+    }
+    cv_.notify_one();
+}
+
+void NotifyQueue::shutdown() {
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+        queue_.clear();
+        changes_.clear();
+        queued_bytes_ = 0;
+    }
+    cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void NotifyQueue::run() {
+    std::vector<message> batch;
+    std::vector<message_change> changes;
+    std::vector<std::chrono::steady_clock::time_point> queued_at;
+    std::unique_lock lock{mutex_};
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !queue_.empty() || !changes_.empty(); });
+        if (stopping_)
+            return;
+
+        // Give other messages stored around the same time a chance to go out with this one:
+        auto first = queue_.empty() ? changes_.front().first : queue_.front().first;
+        if (!queue_.empty() && !changes_.empty())
+            first = std::min(first, changes_.front().first);
+        if (cv_.wait_until(lock, first + COALESCE_WINDOW, [this] { return stopping_; }))
+            return;
+
+        batch.clear();
+        changes.clear();
+        queued_at.clear();
+        batch.reserve(queue_.size());
+        changes.reserve(changes_.size());
+        queued_at.reserve(queue_.size() + changes_.size());
+        for (auto& [when, msg] : queue_) {
+            queued_at.push_back(when);
+            batch.push_back(std::move(msg));
+        }
+        for (auto& [when, change] : changes_) {
+            queued_at.push_back(when);
+            changes.push_back(std::move(change));
+        }
+        queue_.clear();
+        changes_.clear();
+        queued_bytes_ = 0;
+        lock.unlock();
+
+        try {
+            deliver_(batch, changes);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Failed to deliver message notifications: {}", e.what());
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        int64_t total = 0, max = 0;
+        for (auto& when : queued_at) {
+            int64_t delay =
+                    std::chrono::duration_cast<std::chrono::microseconds>(now - when).count();
+            total += delay;
+            max = std::max(max, delay);
+        }
+
+        lock.lock();
+        delivered_ += queued_at.size();
+        batches_++;
+        total_delay_us_ += total;
+        max_delay_us_ = std::max(max_delay_us_, max);
+    }
+}
+
+NotifyQueue::notify_stats NotifyQueue::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return notify_stats{
+            queue_.size() + changes_.size(),
+            delivered_,
+            batches_,
+            dropped_,
+            total_delay_us_,
+            max_delay_us_};
+}
+
+}  // namespace oxenss::snode
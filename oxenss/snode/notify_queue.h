@@ -0,0 +1,88 @@
+#pragma once
+
+#include <oxenss/common/message.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace oxenss::snode {
+
+using namespace std::literals;
+
+// Delivers new message notifications to monitoring connections from a dedicated thread.  Stores
+// just queue the new message here and carry on; building the notifications and sending them to
+// every subscriber happens on the fan-out thread, so a popular account with many monitoring
+// connections no longer holds up other stores.
+//
+// Messages queued within COALESCE_WINDOW of each other are handed to the delivery callback as a
+// single batch, so that subscriber lookup and sending happens once per batch rather than once per
+// store.  Changes to existing messages (deletions and expiry updates) go through the same queue and
+// batches.
+class NotifyQueue {
+  public:
+    // How long we wait, after a message is queued, for more messages to deliver along with it.
+    static constexpr auto COALESCE_WINDOW = 5ms;
+
+    // Default amount of queued message data above which we drop new notifications.
+    static constexpr size_t DEFAULT_MAX_QUEUED = 32'000'000;
+
+    // Called on the fan-out thread with each batch of new messages and message changes to notify
+    // about.
+    using deliver_callback = std::function<void(
+            const std::vector<message>& msgs, const std::vector<message_change>& changes)>;
+
+    explicit NotifyQueue(deliver_callback deliver, size_t max_queued = DEFAULT_MAX_QUEUED);
+
+    // Calls shutdown().
+    ~NotifyQueue();
+
+    // Queues notifications for a new message.  This never blocks on delivery to subscribers; if
+    // the queue is full the notification is dropped (and counted).
+    void push(message msg);
+
+    // Queues notifications for a change to existing messages, as above.
+    void push(message_change change);
+
+    // Drops anything still queued and stops the fan-out thread (after its current batch).
+    void shutdown();
+
+    struct notify_stats {
+        size_t queued;           // messages (and changes) waiting to be delivered
+        uint64_t delivered;      // messages (and changes) delivered so far
+        uint64_t batches;        // batches the delivered messages went out in
+        uint64_t dropped;        // messages dropped because the queue was full
+        int64_t total_delay_us;  // total time between queuing and delivery, in microseconds
+        int64_t max_delay_us;    // longest time between queuing and delivery, in microseconds
+    };
+    notify_stats get_stats() const;
+
+  private:
+    const deliver_callback deliver_;
+    const size_t max_queued_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, message>> queue_;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, message_change>> changes_;
+    size_t queued_bytes_ = 0;
+    bool stopping_ = false;
+
+    uint64_t delivered_ = 0;
+    uint64_t batches_ = 0;
+    uint64_t dropped_ = 0;
+    int64_t total_delay_us_ = 0;
+    int64_t max_delay_us_ = 0;
+
+    std::thread thread_;
+
+    void run();
+};
+
+}  // namespace oxenss::snode
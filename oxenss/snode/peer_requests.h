@@ -0,0 +1,29 @@
+#pragma once
+
+#include <oxenss/crypto/keys.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace oxenss::snode {
+
+// Reply callback for a request to another service node: `success` is false if the request failed
+// or timed out; otherwise `parts` are the parts of the reply.
+using peer_reply_callback = std::function<void(bool success, std::vector<std::string> parts)>;
+
+// An alternative to OxenMQ (namely QUIC; see server::QUIC::peer_request) for the bulk `sn.*`
+// requests that the relay and forward queues send to other service nodes.  It is given the peer,
+// the OxenMQ command the request is equivalent to (e.g. "sn.data"), the (single part) request
+// body, and the callback to call with the outcome, which gets the same values that it would have
+// if the request had gone via OxenMQ.  Returns false, without calling `cb`, if the request can't go
+// this way (for instance because the peer is too old), in which case the caller should send it
+// through OxenMQ instead.  `body` only needs to stay valid for the duration of the call.
+using peer_request_func = std::function<bool(
+        const crypto::x25519_pubkey& peer,
+        std::string_view command,
+        std::string_view body,
+        peer_reply_callback cb)>;
+
+}  // namespace oxenss::snode
@@ -4,6 +4,7 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/utils/random.hpp>
 
+#include <algorithm>
 #include <chrono>
 
 namespace oxenss::snode {
@@ -105,11 +106,12 @@ std::optional<sn_record> reachability_testing::next_random(
 }
 
 std::vector<std::pair<sn_record, int>> reachability_testing::get_failing(
-        const Swarm& swarm, const clock::time_point& now) {
+        const Swarm& swarm, const clock::time_point& now, int max) {
     // Our failing_queue puts the oldest retest times at the top, so pop them off into our
     // result until the top node should be retested sometime in the future
+    const size_t limit = std::clamp(max, 0, MAX_RETESTS_PER_TICK);
     std::vector<std::pair<sn_record, int>> result;
-    while (result.size() < MAX_RETESTS_PER_TICK && !failing_queue.empty()) {
+    while (result.size() < limit && !failing_queue.empty()) {
         auto& [pk, retest_time, failures] = failing_queue.top();
         if (retest_time > now)
             break;
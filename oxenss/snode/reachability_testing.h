@@ -3,7 +3,10 @@
 #include <oxenss/crypto/keys.h>
 #include "sn_record.h"
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <queue>
 #include <random>
 #include <unordered_map>
@@ -36,6 +39,23 @@ class Swarm;
 
 enum class ReachType { HTTPS, OMQ, QUIC };
 
+// Counts of reachability test durations, bucketed by BOUNDS: counts[i] is the number of tests
+// that took less than BOUNDS[i] (and at least BOUNDS[i-1]); the last count is for tests that took
+// longer than all of them (typically timeouts).
+struct latency_histogram {
+    static constexpr std::array<std::chrono::milliseconds, 7> BOUNDS{
+            50ms, 100ms, 250ms, 500ms, 1000ms, 2500ms, 5000ms};
+
+    std::array<std::atomic<uint64_t>, BOUNDS.size() + 1> counts{};
+
+    void add(std::chrono::steady_clock::duration d) {
+        size_t i = 0;
+        while (i < BOUNDS.size() && d >= BOUNDS[i])
+            i++;
+        counts[i]++;
+    }
+};
+
 class reachability_testing {
   public:
     // How often we tick the timer to check whether we need to do any tests.
@@ -62,6 +82,14 @@ class reachability_testing {
     // recommissioned).
     inline static constexpr int MAX_RETESTS_PER_TICK = 4;
 
+    // The maximum number of nodes we start testing per TESTING_TIMER_INTERVAL, so that a burst of
+    // tests that come due at once gets spread out over the next few ticks rather than all opening
+    // connections at the same moment.
+    inline static constexpr int MAX_TESTS_STARTED_PER_TICK = 2;
+
+    // The maximum number of node tests that we will have in progress at once.
+    inline static constexpr int MAX_CONCURRENT_TESTS = 8;
+
     // Maximum time without a ping before we start whining about it.
     //
     // We have a probability of about 0.368* of *not* getting pinged within a ping interval
@@ -117,10 +145,12 @@ class reachability_testing {
     std::optional<sn_record> next_random(
             const Swarm& swarm, const clock::time_point& now = clock::now(), bool requeue = true);
 
-    // Removes and returns up to MAX_RETESTS_PER_TICK nodes that are due to be tested (i.e.
-    // next-testing-time <= now).  Returns [snrecord, #previous-failures] for each.
+    // Removes and returns up to `max` (capped at MAX_RETESTS_PER_TICK) nodes that are due to be
+    // tested (i.e. next-testing-time <= now).  Returns [snrecord, #previous-failures] for each.
     std::vector<std::pair<sn_record, int>> get_failing(
-            const Swarm& swarm, const clock::time_point& now = clock::now());
+            const Swarm& swarm,
+            const clock::time_point& now = clock::now(),
+            int max = MAX_RETESTS_PER_TICK);
 
     // Adds a bad node pubkey to the failing list, to be re-tested soon (with a backoff
     // depending on `failures`; see TESTING_BACKOFF).  `previous_failures` should be the number
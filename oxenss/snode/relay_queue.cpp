@@ -0,0 +1,306 @@
+#include "relay_queue.h"
+#include "serialization.h"
+#include "stats.h"
+
+#include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/memory.hpp>
+#include <oxenss/utils/string_utils.hpp>
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+
+namespace oxenss::snode {
+
+static auto logcat = log::Cat("snode");
+
+RelayQueue::RelayQueue(oxenmq::OxenMQ& omq, all_stats& stats, uint64_t rate, size_t max_queued) :
+        omq_{omq},
+        stats_{stats},
+        rate_{std::max<uint64_t>(rate, 1)},
+        max_queued_{max_queued},
+        tokens_{static_cast<int64_t>(rate_)},
+        refilled_{std::chrono::steady_clock::now()} {
+    timer_ = omq_.add_timer(
+            [this, alive = std::weak_ptr{alive_}] {
+                if (auto a = alive.lock())
+                    send_ready();
+            },
+            SEND_INTERVAL);
+    thread_ = std::thread{[this] { run_tasks(); }};
+}
+
+RelayQueue::~RelayQueue() {
+    shutdown();
+    omq_.cancel_timer(timer_);
+    // Timer jobs and replies hold `alive_` while they use us, so wait for any that are running
+    // right now to finish:
+    std::weak_ptr<const bool> alive = alive_;
+    alive_.reset();
+    while (!alive.expired())
+        std::this_thread::yield();
+}
+
+void RelayQueue::push(const sn_record& sn, std::string blob) {
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_)
+            return;
+        auto [it, inserted] = peers_.try_emplace(sn.pubkey_x25519);
+        if (inserted) {
+            it->second.sn = sn;
+            order_.push_back(sn.pubkey_x25519);
+        }
+        queued_batches_++;
+        queued_bytes_ += blob.size();
+        it->second.batches.push_back(batch{std::move(blob)});
+    }
+    send_ready();
+}
+
+void RelayQueue::set_peer_request(peer_request_func f) {
+    std::lock_guard lock{mutex_};
+    peer_request_ = std::move(f);
+}
+
+void RelayQueue::wait_for_space() {
+    std::unique_lock lock{mutex_};
+    space_cv_.wait(lock, [this] { return stopping_ || queued_bytes_ < max_queued_; });
+}
+
+void RelayQueue::feed(std::function<void()> task) {
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_)
+            return;
+        tasks_.push_back(std::move(task));
+    }
+    tasks_cv_.notify_one();
+}
+
+bool RelayQueue::stopping() const {
+    std::lock_guard lock{mutex_};
+    return stopping_;
+}
+
+void RelayQueue::shutdown() {
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+        tasks_.clear();
+        peers_.clear();
+        order_.clear();
+        queued_batches_ = 0;
+        queued_bytes_ = 0;
+    }
+    space_cv_.notify_all();
+    tasks_cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void RelayQueue::run_tasks() {
+    // Redistribution reads and serializes a lot of messages that it only holds on to briefly.
+    util::use_memory_arena("relay");
+    std::unique_lock lock{mutex_};
+    while (true) {
+        tasks_cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        if (stopping_)
+            return;
+        auto task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        try {
+            task();
+        } catch (const std::exception& e) {
+            log::error(logcat, "Data redistribution failed: {}", e.what());
+        }
+        lock.lock();
+    }
+}
+
+void RelayQueue::send_ready() {
+    struct outgoing {
+        sn_record sn;
+        batch b;
+    };
+    std::vector<outgoing> sends;
+    peer_request_func peer_request;
+    {
+        std::lock_guard lock{mutex_};
+        if (order_.empty())
+            return;
+        peer_request = peer_request_;
+
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::min<std::chrono::steady_clock::duration>(now - refilled_, 1s));
+        refilled_ = now;
+        // Allow at most one second's worth of burst after being idle:
+        tokens_ = std::min<int64_t>(
+                tokens_ + static_cast<int64_t>(rate_ * elapsed.count() / 1'000'000),
+                static_cast<int64_t>(rate_));
+
+        // Go round-robin through the destinations, one batch at a time, until we run out of send
+        // budget or have nothing more that can be sent:
+        size_t idle = 0;
+        while (tokens_ > 0 && idle < order_.size()) {
+            auto pk = order_.front();
+            order_.pop_front();
+            auto it = peers_.find(pk);
+            auto& peer = it->second;
+            if (peer.batches.empty() || peer.in_flight >= MAX_IN_FLIGHT || now < peer.retry_at) {
+                idle++;
+                if (!peer.batches.empty() || peer.in_flight > 0)
+                    order_.push_back(pk);
+                else
+                    peers_.erase(it);
+                continue;
+            }
+            idle = 0;
+            auto& s = sends.emplace_back(outgoing{peer.sn, std::move(peer.batches.front())});
+            peer.batches.pop_front();
+            peer.in_flight++;
+            in_flight_++;
+            queued_batches_--;
+            queued_bytes_ -= s.b.blob.size();
+            tokens_ -= static_cast<int64_t>(s.b.blob.size());
+            order_.push_back(pk);
+        }
+    }
+    if (sends.empty())
+        return;
+    space_cv_.notify_all();
+
+    for (auto& [sn, b] : sends) {
+        log::debug(
+                logcat,
+                "Relaying data to: {} (x25519 pubkey {})",
+                sn.pubkey_legacy,
+                sn.pubkey_x25519);
+        // We hold on to the batch until we get a reply, in case we have to retry it:
+        auto sent = std::make_shared<batch>(std::move(b));
+        auto on_result = [this,
+                          alive = std::weak_ptr{alive_},
+                          pk = sn.pubkey_x25519,
+                          legacy = sn.pubkey_legacy,
+                          sent](bool success, std::vector<std::string> data) {
+            auto a = alive.lock();
+            if (!a)
+                return;  // We got destroyed while the batch was in flight
+            // Nodes that predate acknowledgements reply without any data:
+            bool ok = success && (data.empty() || data[0] == "OK");
+            int64_t added = 0;
+            if (!success)
+                log::error(logcat, "Failed to relay batch data to {}: timeout", legacy);
+            else if (!ok)
+                log::error(logcat, "Failed to relay batch data to {}: not stored", legacy);
+            else if (data.size() >= 2 && !util::parse_int(data[1], added))
+                added = 0;
+            std::optional<bool> zstd;
+            if (success)
+                zstd = ok && data.size() >= 3 && data[2] == SN_DATA_ZSTD;
+            on_reply(pk, legacy, std::move(*sent), ok, added, zstd);
+        };
+        if (sent->attempts == 0 && peer_request &&
+            peer_request(sn.pubkey_x25519, "sn.data", sent->blob, on_result)) {
+            std::lock_guard lock{mutex_};
+            quic_batches_++;
+            continue;
+        }
+        omq_.request(
+                sn.pubkey_x25519.view(),
+                "sn.data",
+                std::move(on_result),
+                std::string_view{sent->blob});
+    }
+}
+
+void RelayQueue::on_reply(
+        const crypto::x25519_pubkey& pk,
+        const crypto::legacy_pubkey& legacy,
+        batch b,
+        bool ok,
+        int64_t added,
+        std::optional<bool> zstd) {
+    bool dropped = false;
+    {
+        std::lock_guard lock{mutex_};
+        in_flight_--;
+        if (zstd && *zstd)
+            zstd_peers_.insert(pk);
+        else if (zstd)
+            zstd_peers_.erase(pk);
+        // The destination is only gone if we've been shut down, in which case there is nothing
+        // left to do.
+        auto it = peers_.find(pk);
+        if (ok) {
+            sent_batches_++;
+            sent_bytes_ += b.blob.size();
+            acked_new_ += added;
+            if (it != peers_.end()) {
+                it->second.in_flight--;
+                it->second.failures = 0;
+                it->second.retry_at = {};
+            }
+        } else {
+            failed_batches_++;
+            if (it != peers_.end()) {
+                auto& peer = it->second;
+                peer.in_flight--;
+                peer.failures++;
+                peer.retry_at = std::chrono::steady_clock::now() +
+                                std::min<std::chrono::seconds>(
+                                        RETRY_BASE * (1 << std::min(peer.failures - 1, 10)),
+                                        RETRY_MAX);
+                if (++b.attempts < MAX_ATTEMPTS) {
+                    retried_batches_++;
+                    queued_batches_++;
+                    queued_bytes_ += b.blob.size();
+                    peer.batches.push_front(std::move(b));
+                } else {
+                    dropped_batches_++;
+                    dropped = true;
+                }
+            }
+        }
+    }
+    if (!ok)
+        stats_.record_push_failed(legacy);
+    if (dropped)
+        log::warning(
+                logcat,
+                "Giving up on relaying batch data to {} after {} attempts",
+                legacy,
+                MAX_ATTEMPTS);
+    send_ready();
+}
+
+bool RelayQueue::accepts_zstd(const crypto::x25519_pubkey& pk) const {
+    std::lock_guard lock{mutex_};
+    return zstd_peers_.count(pk);
+}
+
+RelayQueue::relay_stats RelayQueue::get_stats() const {
+    std::lock_guard lock{mutex_};
+    auto now = std::chrono::steady_clock::now();
+    size_t backoff = 0;
+    for (auto& [pk, peer] : peers_)
+        if (now < peer.retry_at)
+            backoff++;
+    return relay_stats{
+            queued_batches_,
+            queued_bytes_,
+            in_flight_,
+            tasks_.size(),
+            sent_batches_,
+            sent_bytes_,
+            failed_batches_,
+            retried_batches_,
+            dropped_batches_,
+            acked_new_,
+            backoff,
+            quic_batches_};
+}
+
+}  // namespace oxenss::snode
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "peer_requests.h"
+#include "sn_record.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <oxenmq/oxenmq.h>
+
+namespace oxenss::snode {
+
+using namespace std::literals;
+
+class all_stats;
+
+// Paces the `sn.data` message batches that we push to other service nodes when redistributing
+// data (new swarm members, new or dissolved swarms).  Such a redistribution can amount to
+// thousands of batches at once; firing them all off immediately saturates our uplink and the
+// receiving nodes' `sn` request queues, which then drop (and time out) most of them.  Instead we
+// queue the batches here and send them subject to:
+//
+// - a per-destination window of batches awaiting a reply (MAX_IN_FLIGHT);
+// - a global send rate cap, in bytes per second;
+// - round-robin between destinations with queued batches.
+//
+// Receiving nodes acknowledge each batch once it is stored (replying with the number of messages
+// that were new to them, and whether they can take compressed batches; see `accepts_zstd`).
+// Batches that time out or that the receiver failed to store are put back at the front of that
+// destination's queue and retried, with exponential backoff per destination, up to MAX_ATTEMPTS
+// times.
+//
+// Batches go out over QUIC rather than OxenMQ when a `peer_request` transport is set and accepts
+// them: there the stream flow control paces each transfer, and it doesn't tie up (or queue behind)
+// the OxenMQ connection to the peer that also carries its other requests.  Retries of a failed
+// batch always go through OxenMQ.
+//
+// Redistributions themselves are run one at a time on a dedicated thread (see `feed`), where they
+// read batches from the database and call `wait_for_space()` between chunks, so that the amount
+// of data queued in memory stays bounded no matter how much we are redistributing.
+class RelayQueue {
+  public:
+    // Maximum number of batches per destination sent but not yet replied to.
+    static constexpr int MAX_IN_FLIGHT = 4;
+
+    // Default global send rate cap, in bytes per second.
+    static constexpr uint64_t DEFAULT_RATE = 4'000'000;
+
+    // Default amount of queued (not yet sent) data above which `wait_for_space()` blocks.
+    static constexpr size_t DEFAULT_MAX_QUEUED = 64'000'000;
+
+    // How often we check for queued batches that can now be sent under the rate cap.
+    static constexpr auto SEND_INTERVAL = 50ms;
+
+    // How many times we try to send a batch before giving up on it.
+    static constexpr int MAX_ATTEMPTS = 6;
+
+    // Backoff after a failure to a destination; doubled for each consecutive failure, up to
+    // RETRY_MAX.
+    static constexpr auto RETRY_BASE = 5s;
+    static constexpr auto RETRY_MAX = 5min;
+
+    RelayQueue(
+            oxenmq::OxenMQ& omq,
+            all_stats& stats,
+            uint64_t rate = DEFAULT_RATE,
+            size_t max_queued = DEFAULT_MAX_QUEUED);
+
+    // Calls shutdown() and stops the send timer.
+    ~RelayQueue();
+
+    // Queues a batch to be sent to `sn`.  This never blocks.
+    void push(const sn_record& sn, std::string blob);
+
+    // Sets (or, with nullptr, clears) the alternative transport to try for sending batches.
+    void set_peer_request(peer_request_func f);
+
+    // Blocks until the queued (unsent) data drops below the queue limit, or we are shutting down.
+    // Should only be called from a `feed` task.
+    void wait_for_space();
+
+    // Queues a redistribution task to be run on the relay thread once earlier ones have finished.
+    // The task should push its batches, calling `wait_for_space()` as it goes, and should stop
+    // early if `stopping()` becomes true.
+    void feed(std::function<void()> task);
+
+    // True once shutdown() has been called.
+    bool stopping() const;
+
+    // True if the last reply we got from `pk` said that it can decompress zstd-compressed batches
+    // (see SN_DATA_ZSTD).
+    bool accepts_zstd(const crypto::x25519_pubkey& pk) const;
+
+    // Drops anything still queued and stops the relay thread (after its current task returns).
+    void shutdown();
+
+    struct relay_stats {
+        size_t queued_batches;  // batches waiting to be sent
+        size_t queued_bytes;
+        size_t in_flight;      // batches sent but not yet replied to
+        size_t pending_tasks;  // redistribution tasks waiting for the relay thread
+        // Batches (and their bytes) successfully delivered, and send attempts that failed:
+        uint64_t sent_batches;
+        uint64_t sent_bytes;
+        uint64_t failed_batches;
+        uint64_t retried_batches;  // failed batches queued again for another attempt
+        uint64_t dropped_batches;  // batches given up on after MAX_ATTEMPTS failures
+        uint64_t acked_new;        // messages the receivers reported as new to them
+        size_t backoff_peers;      // destinations currently backing off after a failure
+        uint64_t quic_batches;     // send attempts that went via `peer_request` (i.e. QUIC)
+    };
+    relay_stats get_stats() const;
+
+  private:
+    oxenmq::OxenMQ& omq_;
+    all_stats& stats_;
+    const uint64_t rate_;
+    const size_t max_queued_;
+
+    struct batch {
+        std::string blob;
+        int attempts = 0;  // failed send attempts so far
+    };
+
+    struct peer_queue {
+        sn_record sn;
+        std::deque<batch> batches;
+        int in_flight = 0;
+        int failures = 0;  // consecutive failures; reset by a successful send
+        // Nothing is sent to this destination before this time (set after a failure):
+        std::chrono::steady_clock::time_point retry_at{};
+    };
+
+    mutable std::mutex mutex_;
+    std::condition_variable space_cv_;
+    std::unordered_map<crypto::x25519_pubkey, peer_queue> peers_;
+    // Destinations in round-robin send order; a destination is in here iff it is in peers_.
+    std::deque<crypto::x25519_pubkey> order_;
+    size_t queued_batches_ = 0;
+    size_t queued_bytes_ = 0;
+    size_t in_flight_ = 0;
+    uint64_t sent_batches_ = 0;
+    uint64_t sent_bytes_ = 0;
+    uint64_t failed_batches_ = 0;
+    uint64_t retried_batches_ = 0;
+    uint64_t dropped_batches_ = 0;
+    uint64_t acked_new_ = 0;
+    uint64_t quic_batches_ = 0;
+    // Destinations that can decompress compressed batches
+    std::unordered_set<crypto::x25519_pubkey> zstd_peers_;
+    peer_request_func peer_request_;
+
+    // Rate cap token bucket; may go negative (a batch is sent whenever this is positive).
+    int64_t tokens_;
+    std::chrono::steady_clock::time_point refilled_;
+
+    std::condition_variable tasks_cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    oxenmq::TimerID timer_;
+    // Reset on destruction; the timer and reply callbacks hold weak references to it, which they
+    // lock for as long as they use us, so that a timer job or reply that was already queued when
+    // we got destroyed does nothing (and the destructor waits for one that is already running).
+    std::shared_ptr<const bool> alive_ = std::make_shared<bool>(true);
+
+    // Sends whatever the windows and rate cap currently allow.
+    void send_ready();
+
+    // Called with the outcome of sending `b` to `pk`; `added` is the number of new messages the
+    // receiver reported, if it succeeded, and `zstd` whether it said that it accepts compressed
+    // batches, if it replied at all.
+    void on_reply(
+            const crypto::x25519_pubkey& pk,
+            const crypto::legacy_pubkey& legacy,
+            batch b,
+            bool ok,
+            int64_t added,
+            std::optional<bool> zstd);
+
+    void run_tasks();
+};
+
+}  // namespace oxenss::snode
@@ -0,0 +1,83 @@
+#include "retrieve_waiters.h"
+
+#include <vector>
+
+namespace oxenss::snode {
+
+uint64_t RetrieveWaiters::add(
+        const prefixed_pubkey& pubkey,
+        namespace_id ns,
+        std::chrono::steady_clock::time_point deadline,
+        wake_callback wake) {
+    std::lock_guard lock{mutex_};
+    if (waiters_.size() >= MAX_WAITERS || by_account_.count(pubkey) >= MAX_PER_ACCOUNT)
+        return 0;
+    auto id = next_id_++;
+    by_account_.emplace(pubkey, id);
+    auto dl = by_deadline_.emplace(deadline, id);
+    waiters_.emplace(id, waiter{pubkey, ns, dl, std::move(wake)});
+    return id;
+}
+
+RetrieveWaiters::wake_callback RetrieveWaiters::remove(
+        std::unordered_map<uint64_t, waiter>::iterator it) {
+    auto& w = it->second;
+    auto [beg, end] = by_account_.equal_range(w.pubkey);
+    for (auto a = beg; a != end; ++a) {
+        if (a->second == it->first) {
+            by_account_.erase(a);
+            break;
+        }
+    }
+    by_deadline_.erase(w.deadline);
+    auto wake = std::move(w.wake);
+    waiters_.erase(it);
+    return wake;
+}
+
+bool RetrieveWaiters::cancel(uint64_t id) {
+    std::lock_guard lock{mutex_};
+    auto it = waiters_.find(id);
+    if (it == waiters_.end())
+        return false;
+    remove(it);
+    return true;
+}
+
+size_t RetrieveWaiters::wake(const prefixed_pubkey& pubkey, namespace_id ns) {
+    std::vector<wake_callback> woken;
+    {
+        std::lock_guard lock{mutex_};
+        auto [beg, end] = by_account_.equal_range(pubkey);
+        if (beg == end)
+            return 0;
+        std::vector<uint64_t> ids;
+        for (auto a = beg; a != end; ++a)
+            if (waiters_.at(a->second).ns == ns)
+                ids.push_back(a->second);
+        for (auto id : ids)
+            woken.push_back(remove(waiters_.find(id)));
+    }
+    for (auto& wake : woken)
+        wake();
+    return woken.size();
+}
+
+size_t RetrieveWaiters::expire(std::chrono::steady_clock::time_point now) {
+    std::vector<wake_callback> woken;
+    {
+        std::lock_guard lock{mutex_};
+        while (!by_deadline_.empty() && by_deadline_.begin()->first <= now)
+            woken.push_back(remove(waiters_.find(by_deadline_.begin()->second)));
+    }
+    for (auto& wake : woken)
+        wake();
+    return woken.size();
+}
+
+size_t RetrieveWaiters::size() const {
+    std::lock_guard lock{mutex_};
+    return waiters_.size();
+}
+
+}  // namespace oxenss::snode
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <oxenss/common/namespace.h>
+#include <oxenss/common/pubkey.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace oxenss::snode {
+
+using namespace std::literals;
+
+// Tracks long-polling retrieve requests (i.e. retrieves with `wait` set) that found nothing new and
+// are parked until a message arrives for their account and namespace, or until they time out.
+// New messages are checked against this from the same place as monitor subscriptions (i.e. from
+// the notification fan-out), so that both stores and pushes from swarm members wake waiters.
+//
+// Each waiter has a wake callback which is invoked (exactly once, without any lock held) when a
+// matching message arrives or its deadline passes, whichever comes first; the callback is expected
+// to re-run the retrieve and reply with whatever it finds.
+class RetrieveWaiters {
+  public:
+    // Maximum parked requests overall, and for any single account; requests beyond this limit are
+    // answered immediately instead of being parked.
+    static constexpr size_t MAX_WAITERS = 10'000;
+    static constexpr size_t MAX_PER_ACCOUNT = 32;
+
+    // How often `expire()` should be called; this is the precision of a waiter's deadline.
+    static constexpr auto EXPIRE_INTERVAL = 250ms;
+
+    using wake_callback = std::function<void()>;
+
+    // Parks a waiter for messages to `pubkey` in namespace `ns`.  Returns an id that can be given
+    // to `cancel()`, or 0 if the waiter was refused because of the limits.
+    uint64_t add(
+            const prefixed_pubkey& pubkey,
+            namespace_id ns,
+            std::chrono::steady_clock::time_point deadline,
+            wake_callback wake);
+
+    // Removes a waiter without invoking it.  Returns false if it was already woken (or never
+    // existed).
+    bool cancel(uint64_t id);
+
+    // Wakes (and removes) every waiter for `pubkey` in `ns`; returns the number woken.
+    size_t wake(const prefixed_pubkey& pubkey, namespace_id ns);
+
+    // Wakes (and removes) every waiter whose deadline has passed; returns the number woken.
+    size_t expire(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Returns the number of currently parked waiters.
+    size_t size() const;
+
+  private:
+    struct waiter {
+        prefixed_pubkey pubkey;
+        namespace_id ns;
+        std::multimap<std::chrono::steady_clock::time_point, uint64_t>::iterator deadline;
+        wake_callback wake;
+    };
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, waiter> waiters_;
+    std::unordered_multimap<prefixed_pubkey, uint64_t> by_account_;
+    std::multimap<std::chrono::steady_clock::time_point, uint64_t> by_deadline_;
+    uint64_t next_id_ = 1;
+
+    // Removes waiter `it` from all the indices and returns its callback.  Must hold the lock.
+    wake_callback remove(std::unordered_map<uint64_t, waiter>::iterator it);
+};
+
+}  // namespace oxenss::snode
@@ -2,99 +2,413 @@
 
 #include <oxenss/logging/oxen_logger.h>
 #include "service_node.h"
+#include <oxenss/rpc/response_compressor.h>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 
 #include <oxenc/base64.h>
 #include <oxenc/bt_serialize.h>
+#include <fmt/format.h>
 
+#include <algorithm>
+#include <cassert>
 #include <chrono>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace oxenss::snode {
 
 static auto logcat = log::Cat("snode");
 
-std::vector<std::string> serialize_messages(
-        std::function<const message*()> next_msg, uint8_t version) {
-    std::vector<std::string> res;
-
-    if (version == SERIALIZATION_VERSION_BT) {
-        oxenc::bt_list l;
-        size_t counter = 2;
-        while (auto* msg = next_msg()) {
-            size_t ser_size = 1 +                       // version byte
-                              2 +                       // l...e
-                              36 +                      // 33:pubkey
-                              2 * 15 +                  // millisecond epochs (13 digits) + `i...e`
-                              (4 + msg->hash.size()) +  // xxx:HASH
-                              (6 + msg->data.size())    // xxxxx:DATA
-                    ;
-            counter += ser_size;
-            if (!l.empty() && counter > SERIALIZATION_BATCH_SIZE) {
-                // Adding this message would push us over the limit, so finish it off and start
-                // a new serialization piece.
-                std::ostringstream oss;
-                oss << SERIALIZATION_VERSION_BT << oxenc::bt_serializer(l);
-                res.push_back(oss.str());
-                l.clear();
-                counter = 1 + 2 + ser_size;
+namespace {
+
+    // Number of decimal digits (plus the minus sign, if any) of `i`
+    size_t int_digits(int64_t i) {
+        size_t n = i < 0 ? 2 : 1;
+        for (uint64_t u = i < 0 ? -static_cast<uint64_t>(i) : i; u >= 10; u /= 10)
+            n++;
+        return n;
+    }
+
+    // Encoded size of a bt string
+    size_t bt_string_size(size_t len) {
+        return int_digits(len) + 1 + len;
+    }
+
+    // Encoded size of a bt integer
+    size_t bt_int_size(int64_t i) {
+        return int_digits(i) + 2;
+    }
+
+    // Encoded size of a message in a v1 batch: l33:PUBKEY,HASH,iTIMESTAMPe,iEXPIRYe,DATAe
+    size_t bt_message_size(const message& msg) {
+        return 2 + bt_string_size(33) + bt_string_size(msg.hash.size()) +
+               bt_int_size(to_epoch_ms(msg.timestamp)) + bt_int_size(to_epoch_ms(msg.expiry)) +
+               bt_string_size(msg.data.size());
+    }
+
+    void append_bt_string(std::string& out, std::string_view s) {
+        fmt::format_to(std::back_inserter(out), "{}:", s.size());
+        out += s;
+    }
+
+    // Compact batches: flag (in the byte after the version) indicating that the rest of the batch
+    // is zstd-compressed.
+    constexpr uint8_t COMPACT_FLAG_ZSTD = 0x01;
+
+    // Batches smaller than this aren't worth compressing.
+    constexpr size_t COMPACT_COMPRESS_MIN = 1024;
+
+    // Upper limit on the decompressed size of a compact batch that we'll accept.  Batches are at
+    // most SERIALIZATION_BATCH_SIZE, or one (much smaller) message if that is larger.
+    constexpr size_t COMPACT_MAX_DECOMPRESSED = 2 * SERIALIZATION_BATCH_SIZE;
+
+    // Unsigned LEB128 varints, with zigzag encoding for signed values.
+    size_t varint_size(uint64_t v) {
+        size_t n = 1;
+        for (; v >= 0x80; v >>= 7)
+            n++;
+        return n;
+    }
+
+    void append_varint(std::string& out, uint64_t v) {
+        for (; v >= 0x80; v >>= 7)
+            out += static_cast<char>((v & 0x7f) | 0x80);
+        out += static_cast<char>(v);
+    }
+
+    uint64_t zigzag(int64_t v) {
+        return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+    }
+
+    int64_t unzigzag(uint64_t v) {
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+
+    uint64_t consume_varint(std::string_view& in) {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (in.empty())
+                throw std::runtime_error{"truncated varint"};
+            auto byte = static_cast<uint8_t>(in.front());
+            in.remove_prefix(1);
+            v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return v;
+        }
+        throw std::runtime_error{"invalid varint"};
+    }
+
+    std::string_view consume_bytes(std::string_view& in, uint64_t n) {
+        if (n > in.size())
+            throw std::runtime_error{"truncated value"};
+        auto bytes = in.substr(0, n);
+        in.remove_prefix(n);
+        return bytes;
+    }
+
+    // If `hash` is the canonical unpadded base64 encoding of a 32-byte hash (as, in practice,
+    // all message hashes are) this decodes it into `raw` and returns true.  (This is the same test
+    // the database uses to decide whether it can store a hash as a blob).
+    bool raw_hash(std::string_view hash, std::array<char, 32>& raw) {
+        if (hash.size() != 43 || !oxenc::is_base64(hash))
+            return false;
+        oxenc::from_base64(hash.begin(), hash.end(), raw.begin());
+        std::array<char, 44> check;
+        oxenc::to_base64(raw.begin(), raw.end(), check.begin());
+        return std::string_view{check.data(), 43} == hash;
+    }
+
+    // Encodes a raw 32-byte hash into `b64` and returns a view of its unpadded base64 value.
+    std::string_view hash_b64(std::string_view raw, std::array<char, 44>& b64) {
+        oxenc::to_base64(raw.begin(), raw.end(), b64.begin());
+        return {b64.data(), 43};
+    }
+
+    // Encoded size of a message in a compact batch, given its timestamp delta.  See
+    // MessageSerializer::add_compact.  This is an upper bound: it doesn't bother checking whether
+    // the hash can be sent as 32 raw bytes.
+    size_t compact_message_size(const message& msg, int64_t timestamp_delta) {
+        return varint_size(msg.hash.size()) + msg.hash.size() +
+               varint_size(zigzag(static_cast<int64_t>(msg.msg_namespace))) +
+               varint_size(zigzag(timestamp_delta)) +
+               varint_size(zigzag(to_epoch_ms(msg.expiry) - to_epoch_ms(msg.timestamp))) +
+               varint_size(msg.data.size()) + msg.data.size();
+    }
+
+    // Maximum size of a compact batch owner group header: the 33-byte pubkey and message count.
+    constexpr size_t COMPACT_GROUP_OVERHEAD = 33 + 10;
+
+    // One message of a batch being parsed.  The string_views point into the (possibly
+    // decompressed) batch.
+    struct parsed_message {
+        std::string_view pubkey;  // 33-byte network-prefixed pubkey
+        std::string_view hash;    // the hash, or its raw 32 bytes if `raw_hash` is set
+        bool raw_hash;
+        namespace_id msg_namespace;
+        std::chrono::system_clock::time_point timestamp;
+        std::chrono::system_clock::time_point expiry;
+        std::string_view data;
+    };
+
+    template <typename Add>
+    bool parse_bt_messages(std::string_view slice, Add& add) {
+        oxenc::bt_list_consumer l{slice};
+        while (!l.is_finished()) {
+            auto m = l.consume_list_consumer();
+            parsed_message msg{};
+            msg.pubkey = m.consume_string_view();
+            msg.hash = m.consume_string_view();
+            msg.raw_hash = false;
+            msg.msg_namespace = namespace_id::Default;
+            msg.timestamp = from_epoch_ms(m.consume_integer<int64_t>());
+            msg.expiry = from_epoch_ms(m.consume_integer<int64_t>());
+            msg.data = m.consume_string_view();
+            if (!add(msg))
+                return false;
+        }
+        return true;
+    }
+
+    template <typename Add>
+    bool parse_compact_messages(std::string_view in, Add& add) {
+        while (!in.empty()) {
+            parsed_message msg{};
+            msg.pubkey = consume_bytes(in, 33);
+            auto count = consume_varint(in);
+            // Accumulated as unsigned so that garbage deltas wrap rather than overflow:
+            uint64_t timestamp = 0;
+            for (uint64_t i = 0; i < count; i++) {
+                auto hash_size = consume_varint(in);
+                msg.raw_hash = hash_size == 0;
+                msg.hash = consume_bytes(in, msg.raw_hash ? 32 : hash_size);
+                auto ns = unzigzag(consume_varint(in));
+                if (ns < NAMESPACE_MIN || ns > NAMESPACE_MAX)
+                    throw std::runtime_error{"invalid namespace"};
+                msg.msg_namespace = static_cast<namespace_id>(ns);
+                timestamp += static_cast<uint64_t>(unzigzag(consume_varint(in)));
+                auto expiry = timestamp + static_cast<uint64_t>(unzigzag(consume_varint(in)));
+                msg.timestamp = from_epoch_ms(static_cast<int64_t>(timestamp));
+                msg.expiry = from_epoch_ms(static_cast<int64_t>(expiry));
+                msg.data = consume_bytes(in, consume_varint(in));
+                if (!add(msg))
+                    return false;
             }
-            assert(msg->pubkey);
-            l.push_back(oxenc::bt_list{
-                    {msg->pubkey.prefixed_raw(),
-                     msg->hash,
-                     to_epoch_ms(msg->timestamp),
-                     to_epoch_ms(msg->expiry),
-                     msg->data}});
         }
+        return true;
+    }
 
-        std::ostringstream oss;
-        oss << uint8_t{1} /* version*/ << oxenc::bt_serializer(l);
-        res.push_back(oss.str());
-    } else {
-        log::critical(logcat, "Invalid serialization version {}", +version);
-        throw std::logic_error{"Invalid serialization version " + std::to_string(version)};
+    // Parses a serialized batch, calling `add(const parsed_message&)` for each message in it;
+    // `add` returns false if the pubkey is invalid.  Compressed batches are decompressed into
+    // `buffer` (which the parsed_message views then point into).  Returns false (after logging) if
+    // the batch has an unsupported version, can't be decompressed, or has an invalid pubkey;
+    // throws if the batch isn't properly encoded.
+    template <typename Add>
+    bool parse_messages(std::string_view slice, std::string& buffer, Add&& add) {
+        // v0 (now unsupported) didn't send a version at all, and sent things incredibly
+        // inefficiently. v1+ put the version as the first byte (but can't use any of
+        // '0'..'9','a'..'f','A'..'F' because v0 started out with a hex pubkey).
+        uint8_t version = 0;
+        if (!slice.empty() && slice.front() < '0' && slice.front() != 0) {
+            version = slice.front();
+            slice.remove_prefix(1);
+        }
+
+        bool ok;
+        if (version == SERIALIZATION_VERSION_BT)
+            ok = parse_bt_messages(slice, add);
+        else if (version == SERIALIZATION_VERSION_COMPACT) {
+            if (slice.empty())
+                throw std::runtime_error{"missing compact batch flags"};
+            auto flags = static_cast<uint8_t>(slice.front());
+            slice.remove_prefix(1);
+            if (flags & COMPACT_FLAG_ZSTD) {
+                if (!rpc::zstd_decompress(slice, buffer, COMPACT_MAX_DECOMPRESSED)) {
+                    log::error(logcat, "Unable to decompress compact message batch");
+                    return false;
+                }
+                slice = buffer;
+            }
+            ok = parse_compact_messages(slice, add);
+        } else {
+            log::error(logcat, "Invalid deserialization version {}", +version);
+            return false;
+        }
+        if (!ok)
+            log::debug(logcat, "Unable to deserialize(v{}) pubkey", +version);
+        return ok;
     }
 
-    return res;
+}  // namespace
+
+MessageSerializer::MessageSerializer(uint8_t version, size_t batch_size, bool compress) :
+        version_{version}, batch_size_{batch_size}, compress_{compress} {
+    if (version_ != SERIALIZATION_VERSION_BT && version_ != SERIALIZATION_VERSION_COMPACT) {
+        log::critical(logcat, "Invalid serialization version {}", +version_);
+        throw std::logic_error{"Invalid serialization version " + std::to_string(version_)};
+    }
 }
 
-std::vector<message> deserialize_messages(std::string_view slice) {
-    log::trace(logcat, "=== Deserializing ===");
+void MessageSerializer::start_batch(size_t reserve) {
+    current_.clear();
+    current_.reserve(reserve);
+    current_ += static_cast<char>(version_);
+    if (version_ == SERIALIZATION_VERSION_COMPACT)
+        current_ += '\0';  // flags
+    else
+        current_ += 'l';
+}
 
-    // v0 (now unsupported) didn't send a version at all, and sent things incredibly
-    // inefficiently. v1+ put the version as the first byte (but can't use any of
-    // '0'..'9','a'..'f','A'..'F' because v0 started out with a hex pubkey).
-    uint8_t version = 0;
-    if (!slice.empty() && slice.front() < '0' && slice.front() != 0) {
-        version = slice.front();
-        slice.remove_prefix(1);
+void MessageSerializer::finish_group() {
+    if (group_count_ == 0)
+        return;
+    current_ += static_cast<char>(group_owner_.type());
+    current_ += group_owner_.raw();
+    append_varint(current_, group_count_);
+    current_ += group_;
+    group_.clear();
+    group_count_ = 0;
+}
+
+void MessageSerializer::finish_batch() {
+    if (version_ == SERIALIZATION_VERSION_COMPACT) {
+        finish_group();
+        std::string_view payload{current_};
+        payload.remove_prefix(2);
+        if (std::string compressed; compress_ && payload.size() >= COMPACT_COMPRESS_MIN &&
+                                    rpc::zstd_compress(payload, compressed) &&
+                                    compressed.size() < payload.size()) {
+            current_.resize(2);
+            current_[1] = static_cast<char>(COMPACT_FLAG_ZSTD);
+            current_ += compressed;
+        }
+    } else
+        current_ += 'e';
+    batches_.push_back(std::move(current_));
+    current_ = std::string{};
+}
+
+void MessageSerializer::add(const message& msg) {
+    assert(msg.pubkey);
+    if (version_ == SERIALIZATION_VERSION_COMPACT)
+        return add_compact(msg);
+
+    auto size = bt_message_size(msg);
+    if (current_.empty())
+        start_batch(2 + size + 1);
+    else if (current_.size() + size + 1 > batch_size_) {
+        // Adding this message would push us over the limit, so finish it off and start a new
+        // serialization piece.  There's more coming, so reserve a whole batch this time.
+        finish_batch();
+        start_batch(std::max(batch_size_, 2 + size + 1));
     }
 
-    if (version != SERIALIZATION_VERSION_BT) {
-        log::error(logcat, "Invalid deserialization version {}", +version);
-        return {};
+    current_ += "l33:";
+    current_ += static_cast<char>(msg.pubkey.type());
+    current_ += msg.pubkey.raw();
+    append_bt_string(current_, msg.hash);
+    fmt::format_to(
+            std::back_inserter(current_),
+            "i{}ei{}e",
+            to_epoch_ms(msg.timestamp),
+            to_epoch_ms(msg.expiry));
+    append_bt_string(current_, msg.data);
+    current_ += 'e';
+    count_++;
+}
+
+// A compact batch is the version byte, a flags byte, and then (zstd-compressed, if the flags say
+// so) a sequence of owner groups of consecutive messages with the same owner.  Each group is the
+// 33-byte network-prefixed pubkey, a varint message count, and then the messages, each made of:
+// - a varint hash length followed by the hash, except that a length of 0 means the hash is the
+//   base64 encoding of the 32 raw bytes that follow;
+// - the namespace, as a zigzag varint;
+// - the timestamp, as a zigzag varint of the milliseconds since the group's previous message (or
+//   since the epoch, for the first message of the group);
+// - the expiry, as a zigzag varint of the milliseconds since the timestamp;
+// - a varint data length followed by the data.
+void MessageSerializer::add_compact(const message& msg) {
+    auto timestamp = to_epoch_ms(msg.timestamp);
+    bool new_group = group_count_ == 0 || !(msg.pubkey == group_owner_);
+    auto size = compact_message_size(msg, timestamp - (new_group ? 0 : group_timestamp_)) +
+                (new_group ? COMPACT_GROUP_OVERHEAD : 0);
+    if (current_.empty())
+        start_batch(2 + size);
+    else if (current_.size() + group_.size() + COMPACT_GROUP_OVERHEAD + size > batch_size_) {
+        finish_batch();
+        start_batch(std::max(batch_size_, 2 + size));
+        new_group = true;
+    }
+    if (new_group) {
+        finish_group();
+        group_owner_ = msg.pubkey;
+        group_timestamp_ = 0;
     }
 
-    // v1:
+    std::array<char, 32> raw;
+    if (raw_hash(msg.hash, raw)) {
+        append_varint(group_, 0);
+        group_.append(raw.data(), raw.size());
+    } else {
+        append_varint(group_, msg.hash.size());
+        group_ += msg.hash;
+    }
+    append_varint(group_, zigzag(static_cast<int64_t>(msg.msg_namespace)));
+    append_varint(group_, zigzag(timestamp - group_timestamp_));
+    append_varint(group_, zigzag(to_epoch_ms(msg.expiry) - timestamp));
+    append_varint(group_, msg.data.size());
+    group_ += msg.data;
+    group_timestamp_ = timestamp;
+    group_count_++;
+    count_++;
+}
+
+std::vector<std::string> MessageSerializer::finish() && {
+    if (!current_.empty())
+        finish_batch();
+    return std::move(batches_);
+}
+
+std::vector<std::string> serialize_messages(
+        std::function<const message*()> next_msg, uint8_t version, bool compress) {
+    MessageSerializer ser{version, SERIALIZATION_BATCH_SIZE, compress};
+    while (auto* msg = next_msg())
+        ser.add(*msg);
+    auto batches = std::move(ser).finish();
+    if (batches.empty()) {
+        // We've always sent an (empty) batch when there was nothing to serialize:
+        batches.push_back(
+                version == SERIALIZATION_VERSION_COMPACT
+                        ? std::string{static_cast<char>(version), '\0'}
+                        : std::string{static_cast<char>(version)} + "le");
+    }
+    return batches;
+}
+
+std::vector<message> deserialize_messages(std::string_view slice) {
+    log::trace(logcat, "=== Deserializing ===");
+
     std::vector<message> result;
+    std::string buffer;
     try {
-        oxenc::bt_list_consumer l{slice};
-        while (!l.is_finished()) {
+        bool ok = parse_messages(slice, buffer, [&result](const parsed_message& msg) {
             auto& item = result.emplace_back();
-            auto m = l.consume_list_consumer();
-            if (!item.pubkey.load(m.consume_string_view())) {
-                log::debug(logcat, "Unable to deserialize(v1) pubkey");
-                return {};
-            }
-            item.hash = m.consume_string();
-            item.timestamp = from_epoch_ms(m.consume_integer<int64_t>());
-            item.expiry = from_epoch_ms(m.consume_integer<int64_t>());
-            item.data = m.consume_string();
-        }
+            if (!item.pubkey.load(msg.pubkey))
+                return false;
+            std::array<char, 44> b64;
+            item.hash = msg.raw_hash ? hash_b64(msg.hash, b64) : msg.hash;
+            item.msg_namespace = msg.msg_namespace;
+            item.timestamp = msg.timestamp;
+            item.expiry = msg.expiry;
+            item.data = msg.data;
+            return true;
+        });
+        if (!ok)
+            return {};
     } catch (const std::exception& e) {
         throw e;
-        log::debug(logcat, "Failed to deserialize(v1): {}", e.what());
+        log::debug(logcat, "Failed to deserialize: {}", e.what());
         return {};
     }
 
@@ -103,4 +417,26 @@ std::vector<message> deserialize_messages(std::string_view slice) {
     return result;
 }
 
+message_batch::message_batch(std::string blob) : blob_{std::move(blob)} {
+    // Most batches contain many messages for each owner, so we only parse each pubkey once:
+    std::unordered_map<std::string_view, const user_pubkey*> owners;
+    bool ok = parse_messages(blob_, payload_, [this, &owners](const parsed_message& msg) {
+        auto& owner = owners[msg.pubkey];
+        if (!owner) {
+            user_pubkey pk;
+            if (!pk.load(msg.pubkey))
+                return false;
+            owner = &owners_.emplace_back(std::move(pk));
+        }
+        auto hash = msg.hash;
+        if (msg.raw_hash)
+            hash = hash_b64(msg.hash, hashes_.emplace_back());
+        messages_.push_back(
+                {owner, {hash, msg.msg_namespace, msg.timestamp, msg.expiry, msg.data}});
+        return true;
+    });
+    if (!ok)
+        throw std::runtime_error{"message batch can't be decoded"};
+}
+
 }  // namespace oxenss::snode
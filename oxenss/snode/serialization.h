@@ -1,7 +1,10 @@
 #pragma once
 
+#include <array>
+#include <deque>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <oxenss/common/message.h>
 
@@ -12,18 +15,109 @@ inline constexpr size_t SERIALIZATION_BATCH_SIZE = 9'000'000;
 // Newer serialization version based on bt-encoding.
 inline constexpr uint8_t SERIALIZATION_VERSION_BT = 1;
 
+// Compact binary serialization: messages grouped by owner, varint-encoded timestamps, raw hashes,
+// and optional zstd compression of each batch.  Only sent once the network reaches
+// COMPACT_SERIALIZATION (see service_node.h); every node that can run on that hardfork accepts it,
+// but only nodes built with zstd can decompress compressed batches, so we only send those to nodes
+// that have said they can (see SN_DATA_ZSTD).
+inline constexpr uint8_t SERIALIZATION_VERSION_COMPACT = 2;
+
+// Extra part that nodes which can decompress zstd-compressed compact batches append to their "OK"
+// replies to `sn.data` pushes.
+inline constexpr std::string_view SN_DATA_ZSTD = "zstd";
+
+// Serializes messages into batches of at most SERIALIZATION_BATCH_SIZE bytes (unless a single
+// message is larger than that, in which case it gets a batch of its own).  Each message is encoded
+// straight into the batch it goes into: there is no intermediate bt_list or stream.  The first
+// batch grows as needed (so that serializing just a few messages stays cheap), but once a batch
+// fills up the rest are reserved at the full batch size up front.
+//
+// For SERIALIZATION_VERSION_COMPACT, consecutive messages with the same owner share a single copy
+// of the pubkey (so callers should add messages grouped by owner, as database iteration does), the
+// batch size limit applies before compression, and batches are zstd-compressed when `compress` is
+// set, we were built with zstd, and compressing makes the batch smaller.
+class MessageSerializer {
+  public:
+    explicit MessageSerializer(
+            uint8_t version = SERIALIZATION_VERSION_BT,
+            size_t batch_size = SERIALIZATION_BATCH_SIZE,
+            bool compress = true);
+
+    // Appends a message, first finishing the current batch if the message doesn't fit in it.
+    void add(const message& msg);
+
+    // Returns the number of messages added so far.
+    size_t count() const { return count_; }
+
+    // Finishes the current batch and returns all the batches.  Returns no batches if no messages
+    // were added.
+    std::vector<std::string> finish() &&;
+
+  private:
+    const uint8_t version_;
+    const size_t batch_size_;
+    const bool compress_;
+    std::vector<std::string> batches_;
+    std::string current_;
+    size_t count_ = 0;
+
+    // The owner group being built in a compact batch: its owner, its encoded messages, how many
+    // there are, and the timestamp (in epoch milliseconds) of the last one.
+    user_pubkey group_owner_;
+    std::string group_;
+    size_t group_count_ = 0;
+    int64_t group_timestamp_ = 0;
+
+    void start_batch(size_t reserve);
+    void finish_batch();
+    void add_compact(const message& msg);
+    void finish_group();
+};
+
+// Serializes messages with a MessageSerializer; `compress` is as for MessageSerializer.
 std::vector<std::string> serialize_messages(
-        std::function<const message*()> next_msg, uint8_t version);
+        std::function<const message*()> next_msg, uint8_t version, bool compress = true);
 
 template <typename It>
-std::vector<std::string> serialize_messages(It begin, It end, uint8_t version) {
+std::vector<std::string> serialize_messages(
+        It begin, It end, uint8_t version, bool compress = true) {
     return serialize_messages(
             [&begin, &end]() mutable -> const message* {
                 return begin == end ? nullptr : &*begin++;
             },
-            version);
+            version,
+            compress);
 }
 
 std::vector<message> deserialize_messages(std::string_view blob);
 
+// A deserialized batch that owns its serialized blob and references the hashes and data in it,
+// rather than copying each message out of it like `deserialize_messages` does.  Each distinct
+// pubkey is parsed (and stored) only once.  Throws if the blob isn't properly encoded, or if it has
+// an unsupported version, an invalid pubkey, or compression we can't undo (so that we fail, and
+// the sender retries, rather than acknowledging a batch whose messages we didn't store).  Not
+// copyable or movable, since the message views point into the owned blob; share it via a
+// shared_ptr instead.
+class message_batch {
+  public:
+    explicit message_batch(std::string blob);
+
+    message_batch(const message_batch&) = delete;
+    message_batch& operator=(const message_batch&) = delete;
+
+    const std::vector<message_ref>& messages() const { return messages_; }
+
+    size_t size() const { return messages_.size(); }
+
+    // Size of the serialized blob
+    size_t bytes() const { return blob_.size(); }
+
+  private:
+    const std::string blob_;
+    std::string payload_;  // the decompressed contents of a compressed blob
+    std::deque<user_pubkey> owners_;
+    std::deque<std::array<char, 44>> hashes_;  // base64-encoded raw hashes of a compact blob
+    std::vector<message_ref> messages_;
+};
+
 }  // namespace oxenss::snode
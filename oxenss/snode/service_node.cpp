@@ -9,19 +9,25 @@
 #include <oxenss/server/omq.h>
 #include <oxenss/logging/oxen_logger.h>
 #include <numeric>
+#include <oxenss/utils/file.hpp>
+#include <oxenss/utils/memory.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/random.hpp>
 
 #include <chrono>
+#include <future>
 #include <mutex>
 #include <nlohmann/json.hpp>
 #include <oxenc/base32z.h>
 #include <oxenc/base64.h>
+#include <oxenc/bt_producer.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/endian.h>
 #include <oxenc/hex.h>
 #include <oxenmq/oxenmq.h>
 
 #include <algorithm>
+#include <map>
 
 using json = nlohmann::json;
 
@@ -29,11 +35,6 @@ namespace oxenss::snode {
 
 static auto logcat = log::Cat("snode");
 
-// Threshold of missing data records at which we start warning and consult bootstrap nodes
-// (mainly so that we don't bother producing warning spam or going to the bootstrap just for a
-// few new nodes that will often have missing info for a few minutes).
-using MISSING_PUBKEY_THRESHOLD = std::ratio<3, 100>;
-
 /// TODO: there should be config.h to store constants like these
 constexpr std::chrono::seconds OXEND_PING_INTERVAL = 30s;
 
@@ -42,24 +43,73 @@ ServiceNode::ServiceNode(
         const crypto::legacy_seckey& skey,
         server::OMQ& omq_server,
         const std::filesystem::path& db_location,
-        const bool force_start) :
+        const bool force_start,
+        const database_options& db_options,
+        const bool bootstrap) :
         force_start_{force_start},
-        db_{std::make_unique<Database>(db_location)},
+        bootstrap_{bootstrap},
+        swarm_snapshot_path_{db_location / "swarms.json"},
+        db_{std::make_unique<Database>(db_location, db_options)},
+        // Group commit only helps if several stores can be in progress at once:
+        db_executor_{std::make_unique<DatabaseExecutor>(
+                *db_,
+                DatabaseExecutor::DEFAULT_READERS,
+                db_options.group_commit ? 4 : 1,
+                db_options.owner_max_jobs)},
         our_address_{std::move(address)},
         our_seckey_{skey},
         omq_server_{omq_server},
         all_stats_{*omq_server} {
     mq_servers_.push_back(&omq_server);
     swarm_ = std::make_unique<Swarm>(our_address_);
+    publish_swarm();
+    load_swarm_snapshot();
+    relay_queue_ = std::make_unique<RelayQueue>(*omq_server, all_stats_);
+    notify_queue_ = std::make_unique<NotifyQueue>(
+            [this](const std::vector<message>& msgs, const std::vector<message_change>& changes) {
+                deliver_notifies(msgs, changes);
+            });
+    forward_queue_ = std::make_unique<ForwardQueue>(*omq_server);
 
     log::info(logcat, "Requesting initial swarm state");
 
+    // The database does its own locking, and the incremental cleanup releases the database lock
+    // between chunks, so we deliberately don't hold sn_mutex_ here: doing so would stall every
+    // store/retrieve for the duration of the cleanup.  The work itself runs as a database writer
+    // job so that it doesn't tie up an oxenmq worker.
     omq_server->add_timer(
             [this] {
-                std::lock_guard l{sn_mutex_};
-                db_->clean_expired();
+                if (cleanup_queued_.exchange(true))
+                    return;
+                db_executor_->write([this](Database& db) {
+                    db.clean_expired_incremental();
+                    db.evict_excess();
+                    cleanup_queued_ = false;
+                });
             },
             Database::CLEANUP_PERIOD);
+    // Checkpoints the WAL and releases free pages while the database is otherwise idle.
+    omq_server->add_timer(
+            [this] {
+                if (maintenance_queued_.exchange(true))
+                    return;
+                db_executor_->write([this](Database& db) {
+                    db.run_maintenance();
+                    maintenance_queued_ = false;
+                });
+            },
+            Database::MAINTENANCE_PERIOD);
+    omq_server->add_timer(
+            [this] {
+                for (auto* s : mq_servers_)
+                    s->expire_monitors();
+            },
+            server::MonitorRegistry::WHEEL_TICK);
+    omq_server->add_timer([this] { retrieve_waiters_.expire(); }, RetrieveWaiters::EXPIRE_INTERVAL);
+    // Bursts (of onion requests, incoming redistribution, ...) that we don't explicitly release
+    // after otherwise leave the allocator holding on to what they used.
+    omq_server->add_timer(
+            [] { util::release_free_memory(MEMORY_RELEASE_MIN_FREE); }, MEMORY_RELEASE_PERIOD);
 
     // We really want to make sure nodes don't get stuck in "syncing" mode,
     // so if we are still "syncing" after a long time, activate SN regardless
@@ -85,6 +135,12 @@ void ServiceNode::on_oxend_connected() {
     omq_server_->add_timer([this] { oxend_ping(); }, OXEND_PING_INTERVAL);
     omq_server_->add_timer([this] { ping_peers(); }, reachability_testing::TESTING_TIMER_INTERVAL);
 
+    if (provisional_) {
+        // We can already serve requests from the saved swarm state, so don't hold up startup:
+        log::info(logcat, "Using saved swarm state until the initial block update from oxend");
+        return;
+    }
+
     std::unique_lock lock{first_response_mutex_};
     while (true) {
         if (first_response_cv_.wait_for(lock, 5s, [this] { return got_first_response_; })) {
@@ -98,107 +154,6 @@ void ServiceNode::on_oxend_connected() {
     }
 }
 
-template <typename T>
-static T get_or(const json& j, std::string_view key, std::common_type_t<T> default_val) {
-    if (auto it = j.find(key); it != j.end())
-        return it->get<T>();
-    return default_val;
-}
-
-static block_update parse_swarm_update(const std::string& response_body) {
-    if (response_body.empty()) {
-        log::critical(logcat, "Bad oxend rpc response: no response body");
-        throw std::runtime_error("Failed to parse swarm update");
-    }
-
-    // map (not unordered_map) because we need the eventual swarm list to be sorted
-    std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
-    block_update bu;
-
-    log::trace(logcat, "swarm response: <{}>", response_body);
-
-    try {
-        json result = json::parse(response_body, nullptr, true);
-
-        bu.height = result.at("height").get<uint64_t>();
-        bu.block_hash = result.at("block_hash").get<std::string>();
-        bu.hardfork = result.at("hardfork").get<int>();
-        bu.snode_revision = get_or<int>(result, "snode_revision", 0);
-        bu.unchanged = get_or<bool>(result, "unchanged", false);
-        if (bu.unchanged)
-            return bu;
-
-        const json service_node_states = result.at("service_node_states");
-
-        int missing_aux_pks = 0, total = 0;
-
-        for (const auto& sn_json : service_node_states) {
-            /// We want to include (test) decommissioned nodes, but not
-            /// partially funded ones.
-            if (!sn_json.at("funded").get<bool>()) {
-                continue;
-            }
-
-            total++;
-            const auto& pk_hex = sn_json.at("service_node_pubkey").get_ref<const std::string&>();
-
-            const auto pk_x25519_hex = sn_json.value<std::string>("pubkey_x25519", "");
-            const auto pk_ed25519_hex = sn_json.value<std::string>("pubkey_ed25519", "");
-
-            if (pk_x25519_hex.empty() || pk_ed25519_hex.empty()) {
-                // These will always either both be present or neither present.  If they are
-                // missing there isn't much we can do: it means the remote hasn't transmitted
-                // them yet (or our local oxend hasn't received them yet).
-                missing_aux_pks++;
-                log::debug(
-                        logcat,
-                        "ed25519/x25519 pubkeys are missing from service node info {}",
-                        pk_hex);
-                continue;
-            }
-
-            auto sn = sn_record{
-                    sn_json.at("public_ip").get_ref<const std::string&>(),
-                    sn_json.at("storage_port").get<uint16_t>(),
-                    sn_json.at("storage_lmq_port").get<uint16_t>(),
-                    crypto::legacy_pubkey::from_hex(pk_hex),
-                    crypto::ed25519_pubkey::from_hex(pk_ed25519_hex),
-                    crypto::x25519_pubkey::from_hex(pk_x25519_hex)};
-
-            const swarm_id_t swarm_id = sn_json.at("swarm_id").get<swarm_id_t>();
-
-            /// Storing decommissioned nodes (with dummy swarm id) in
-            /// a separate data structure as it seems less error prone
-            if (swarm_id == INVALID_SWARM_ID) {
-                bu.decommissioned_nodes.push_back(std::move(sn));
-            } else {
-                bu.active_x25519_pubkeys.emplace(sn.pubkey_x25519.view());
-
-                swarm_map[swarm_id].push_back(std::move(sn));
-            }
-        }
-
-        if (missing_aux_pks >
-            MISSING_PUBKEY_THRESHOLD::num * total / MISSING_PUBKEY_THRESHOLD::den) {
-            log::warning(
-                    logcat,
-                    "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
-                    "oxend may be out of sync with the network",
-                    missing_aux_pks,
-                    total);
-        }
-    } catch (const std::exception& e) {
-        log::critical(logcat, "Bad oxend rpc response: invalid json ({})", e.what());
-        throw std::runtime_error("Failed to parse swarm update");
-    }
-
-    for (auto const& swarm : swarm_map) {
-        bu.swarms.emplace_back(SwarmInfo{swarm.first, swarm.second});
-    }
-
-    return bu;
-}
-
 void ServiceNode::register_mq_server(server::MQBase* server) {
     mq_servers_.push_back(server);
 }
@@ -329,6 +284,11 @@ void ServiceNode::bootstrap_data() {
 
 void ServiceNode::shutdown() {
     shutting_down_ = true;
+    notify_queue_->shutdown();
+    forward_queue_->shutdown();
+    // The relay thread reads from the database, so has to stop first:
+    relay_queue_->shutdown();
+    db_executor_->shutdown();
 }
 
 bool ServiceNode::snode_ready(std::string* reason) {
@@ -376,17 +336,8 @@ void ServiceNode::send_onion_to_sn(
 }
 
 void ServiceNode::relay_data_reliable(const std::string& blob, const sn_record& sn) const {
-    log::debug(
-            logcat, "Relaying data to: {} (x25519 pubkey {})", sn.pubkey_legacy, sn.pubkey_x25519);
-
-    omq_server_->request(
-            sn.pubkey_x25519.view(),
-            "sn.data",
-            [](bool success, auto&& /*data*/) {
-                if (!success)
-                    log::error(logcat, "Failed to relay batch data: timeout");
-            },
-            blob);
+    log::trace(logcat, "Queuing data for: {}", sn.pubkey_legacy);
+    relay_queue_->push(sn, blob);
 }
 
 void ServiceNode::record_proxy_request() {
@@ -411,86 +362,167 @@ static void write_metadata(
 }
 
 void ServiceNode::send_notifies(message msg) {
-    auto pubkey = msg.pubkey.prefixed_raw();
-    std::vector<server::connection_id> relay_to, relay_to_with_data;
-
-    for (auto* s : mq_servers_)
-        s->get_notifiers(msg, relay_to, relay_to_with_data);
+    notify_queue_->push(std::move(msg));
+}
 
-    if (relay_to.empty() && relay_to_with_data.empty())
-        return;
+std::vector<message_change> split_changes(
+        message_change::type what,
+        const user_pubkey& pubkey,
+        const std::vector<std::pair<namespace_id, std::string>>& affected,
+        std::chrono::system_clock::time_point expiry) {
+    std::map<namespace_id, std::vector<std::string>> by_ns;
+    for (auto& [ns, hash] : affected)
+        by_ns[ns].push_back(hash);
+    std::vector<message_change> changes;
+    changes.reserve(by_ns.size());
+    for (auto& [ns, hashes] : by_ns) {
+        std::sort(hashes.begin(), hashes.end());
+        changes.push_back({what, pubkey, ns, std::move(hashes), expiry});
+    }
+    return changes;
+}
 
+std::string encode_change_event(const message_change& change) {
     // We output a dict with keys (in order):
+    // - ! event type: "delete" or "expire"
     // - @ pubkey
-    // - h msg hash
+    // - h list of the affected msg hashes
     // - n msg namespace
-    // - t msg timestamp
-    // - z msg expiry
-    // - ~ msg data (optional)
-    constexpr size_t metadata_size = 2       // d...e
-                                   + 3 + 36  // 1:@ and 33:[33-byte pubkey]
-                                   + 3 + 46  // 1:h and 43:[43-byte base64 unpadded hash]
-                                   + 3 + 8   // 1:n and i-32768e
-                                   + 3 + 16  // 1:t and i1658784776010e plus a byte to grow
-                                   + 3 + 16  // 1:z and i1658784776010e plus a byte to grow
-                                   + 10;     // safety margin
-
+    // - z new msg expiry (for "expire" only)
+    //
+    // This depends only on the change itself, so every swarm member that applies the change sends
+    // the same event, which lets clients monitoring several of them drop the duplicates.
+    bool expire = change.what == message_change::type::expiry;
     oxenc::bt_dict_producer d;
-    d.reserve(
-            relay_to_with_data.empty() ? metadata_size
-                                       : metadata_size  // all the metadata above
-                                                 + 3    // 1:~
-                                                 + 8    // 76800: plus a couple bytes to grow
-                                                 + msg.data.size());
+    d.append("!", expire ? "expire" : "delete");
+    d.append("@", change.pubkey.key().view());
+    {
+        auto h = d.append_list("h");
+        for (auto& hash : change.hashes)
+            h.append(hash);
+    }
+    d.append("n", to_int(change.msg_namespace));
+    if (expire)
+        d.append("z", to_epoch_ms(change.expiry));
+    return std::move(d).str();
+}
 
-    write_metadata(d, pubkey, msg);
+bool ServiceNode::have_change_monitors() const {
+    return std::any_of(mq_servers_.begin(), mq_servers_.end(), [](auto* s) {
+        return s->has_change_monitors();
+    });
+}
 
-    if (!relay_to.empty())
-        for (auto* s : mq_servers_)
-            s->notify(relay_to, d.view());
+void ServiceNode::send_change_notifies(message_change change) {
+    // Changes are only queued when some connection wants them, so that they don't use up the
+    // notify queue's room for new message notifications otherwise:
+    if (change.hashes.empty() || !have_change_monitors())
+        return;
+    // Sorted, so that the event is the same no matter what order a swarm member found them in:
+    std::sort(change.hashes.begin(), change.hashes.end());
+    notify_queue_->push(std::move(change));
+}
 
-    if (!relay_to_with_data.empty()) {
-        d.append("~", msg.data);
+void ServiceNode::send_change_notifies(
+        message_change::type what,
+        const user_pubkey& pubkey,
+        const std::vector<std::pair<namespace_id, std::string>>& affected,
+        std::chrono::system_clock::time_point expiry) {
+    if (affected.empty() || !have_change_monitors())
+        return;
+    for (auto& change : split_changes(what, pubkey, affected, expiry))
+        notify_queue_->push(std::move(change));
+}
+
+void ServiceNode::deliver_notifies(
+        const std::vector<message>& msgs, const std::vector<message_change>& changes) {
+    std::vector<server::connection_id> relay_to, relay_to_with_data;
+    for (auto& msg : msgs) {
+        auto pubkey = msg.pubkey.key();
+        retrieve_waiters_.wake(pubkey, msg.msg_namespace);
+
+        relay_to.clear();
+        relay_to_with_data.clear();
         for (auto* s : mq_servers_)
-            s->notify(relay_to_with_data, d.view());
+            s->get_notifiers(msg, relay_to, relay_to_with_data);
+
+        if (relay_to.empty() && relay_to_with_data.empty())
+            continue;
+
+        // We output a dict with keys (in order):
+        // - @ pubkey
+        // - h msg hash
+        // - n msg namespace
+        // - t msg timestamp
+        // - z msg expiry
+        // - ~ msg data (optional)
+        constexpr size_t metadata_size = 2       // d...e
+                                       + 3 + 36  // 1:@ and 33:[33-byte pubkey]
+                                       + 3 + 46  // 1:h and 43:[43-byte base64 unpadded hash]
+                                       + 3 + 8   // 1:n and i-32768e
+                                       + 3 + 16  // 1:t and i1658784776010e plus a byte to grow
+                                       + 3 + 16  // 1:z and i1658784776010e plus a byte to grow
+                                       + 10;     // safety margin
+
+        oxenc::bt_dict_producer d;
+        d.reserve(
+                relay_to_with_data.empty() ? metadata_size
+                                           : metadata_size  // all the metadata above
+                                                     + 3    // 1:~
+                                                     + 8    // 76800: plus a couple bytes to grow
+                                                     + msg.data.size());
+
+        write_metadata(d, pubkey.view(), msg);
+
+        if (!relay_to.empty())
+            for (auto* s : mq_servers_)
+                s->notify(relay_to, d.view());
+
+        if (!relay_to_with_data.empty()) {
+            d.append("~", msg.data);
+            for (auto* s : mq_servers_)
+                s->notify(relay_to_with_data, d.view());
+        }
     }
-}
 
-bool ServiceNode::process_store(
-        message msg, bool* new_msg, std::chrono::system_clock::time_point* expiry) {
-    std::lock_guard guard{sn_mutex_};
+    for (auto& change : changes) {
+        relay_to.clear();
+        for (auto* s : mq_servers_)
+            s->get_change_notifiers(change, relay_to);
 
-    /// only accept a message if we are in a swarm
-    if (!swarm_) {
-        // This should never be printed now that we have "snode_ready"
-        log::error(logcat, "error: my swarm in not initialized");
-        return false;
+        if (relay_to.empty())
+            continue;
+
+        auto event = encode_change_event(change);
+        for (auto* s : mq_servers_)
+            s->notify(relay_to, event);
     }
+}
 
+StoreResult ServiceNode::process_store(
+        message msg, std::chrono::system_clock::time_point* expiry) {
     all_stats_.bump_store_requests();
 
     /// store in the database (if not already present)
     const auto result = db_->store(msg, expiry);
-    if (new_msg)
-        *new_msg = result == StoreResult::New;
 
     if (result == StoreResult::New)
         send_notifies(std::move(msg));
 
-    return result != StoreResult::Full;
+    return result;
 }
 
-void ServiceNode::save_bulk(const std::vector<message>& msgs) {
-    std::lock_guard guard(sn_mutex_);
-
+std::optional<int> ServiceNode::save_bulk(const std::vector<message_ref>& msgs) {
+    int added;
     try {
-        db_->bulk_store(msgs);
+        added = db_->bulk_store(msgs);
     } catch (const std::exception& e) {
         log::error(logcat, "failed to save batch to the database: {}", e.what());
-        return;
+        return std::nullopt;
     }
 
-    log::trace(logcat, "saved messages count: {}", msgs.size());
+    log::trace(logcat, "saved messages count: {} ({} new)", msgs.size(), added);
+    return added;
 }
 
 void ServiceNode::on_bootstrap_update(block_update&& bu) {
@@ -498,6 +530,9 @@ void ServiceNode::on_bootstrap_update(block_update&& bu) {
     std::lock_guard guard(sn_mutex_);
 
     swarm_->apply_swarm_changes(std::move(bu.swarms));
+    publish_swarm();
+    // The next oxend update can't be skipped as unchanged, since it isn't what we have now:
+    applied_states_.reset();
     target_height_ = std::max(target_height_, bu.height);
 
     if (syncing_)
@@ -524,7 +559,76 @@ static SnodeStatus derive_snode_status(const block_update& bu, const sn_record&
     return SnodeStatus::UNSTAKED;
 }
 
+void ServiceNode::load_swarm_snapshot() {
+    std::error_code ec;
+    auto saved = std::filesystem::last_write_time(swarm_snapshot_path_, ec);
+    if (ec)
+        return;  // No snapshot
+    if (std::filesystem::file_time_type::clock::now() - saved > SWARM_SNAPSHOT_MAX_AGE) {
+        log::info(logcat, "Ignoring saved swarm state: it is too old");
+        return;
+    }
+
+    block_update bu;
+    try {
+        bu = parse_swarm_update(util::slurp_file(swarm_snapshot_path_));
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Failed to load saved swarm state: {}", e.what());
+        return;
+    }
+    if (bu.unchanged || bu.swarms.empty())
+        return;
+
+    std::lock_guard lock{sn_mutex_};
+    hardfork_ = {bu.hardfork, bu.snode_revision};
+    block_height_ = bu.height;
+    block_hash_ = bu.block_hash;
+    block_hashes_cache_.insert_or_assign(bu.height, std::move(bu.block_hash));
+    status_ = derive_snode_status(bu, our_address_);
+    omq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
+
+    // We already had this data before restarting, so there is nothing to redistribute:
+    auto events = swarm_->derive_swarm_events(bu.swarms);
+    events.dissolved = false;
+    events.new_swarms.clear();
+    events.new_snodes.clear();
+    swarm_->set_swarm_id(events.our_swarm_id);
+    swarm_->update_state(std::move(bu.swarms), bu.decommissioned_nodes, events, true);
+    publish_swarm();
+
+    syncing_ = false;
+    provisional_ = true;
+    log::info(logcat, "Loaded provisional swarm state for height {}", block_height_);
+}
+
+void ServiceNode::save_swarm_snapshot(std::string_view response) const {
+    auto tmp = swarm_snapshot_path_;
+    tmp += ".tmp";
+    try {
+        util::dump_file(tmp, response);
+        std::filesystem::rename(tmp, swarm_snapshot_path_);
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Failed to save swarm state: {}", e.what());
+    }
+}
+
 void ServiceNode::on_swarm_update(block_update&& bu) {
+    if (provisional_) {
+        // If oxend is still syncing it can be behind the state we saved; keep using ours until it
+        // catches up, rather than going back to older swarms.
+        if (bu.height < block_height_) {
+            log::info(
+                    logcat,
+                    "oxend is at height {}, behind our saved swarm state at {}; waiting for it to "
+                    "catch up",
+                    bu.height,
+                    block_height_);
+            return;
+        }
+        log::info(logcat, "Replacing provisional swarm state with oxend's");
+        provisional_ = false;
+    }
+
     hf_revision net_ver{bu.hardfork, bu.snode_revision};
     if (hardfork_ != net_ver) {
         log::info(logcat, "New hardfork: {}.{}", net_ver.first, net_ver.second);
@@ -568,6 +672,13 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
         return;
     }
 
+    if (bu.states_unchanged) {
+        // Same service node list as the last update we applied, so the swarms, our status, and
+        // the active node set are all still current.
+        log::debug(logcat, "Service node list unchanged");
+        return;
+    }
+
     omq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
 
     const SwarmEvents events = swarm_->derive_swarm_events(bu.swarms);
@@ -587,6 +698,8 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
         log::warning(logcat, "Storage server is still not ready: {}", reason);
         swarm_->update_state(
                 std::move(bu.swarms), std::move(bu.decommissioned_nodes), events, false);
+        publish_swarm();
+        applied_states_.reset();
         return;
     } else {
         if (!active_) {
@@ -599,9 +712,24 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
     }
 
     swarm_->update_state(std::move(bu.swarms), std::move(bu.decommissioned_nodes), events, true);
+    publish_swarm();
+    applied_states_ = bu.states_digest;
 
     if (!events.new_snodes.empty()) {
-        relay_messages(db_->retrieve_all(), events.new_snodes);
+        // New members only need the part of swarm space that belongs to our swarm:
+        uint64_t begin = 0, end = 0;
+        const auto& all_swarms = swarm_->all_valid_swarms();
+        for (size_t i = 0; i < all_swarms.size(); i++)
+            if (all_swarms[i].swarm_id == events.our_swarm_id)
+                std::tie(begin, end) = swarm_space_range(all_swarms, i);
+
+        relay_queue_->feed([this, new_snodes = events.new_snodes, begin, end] {
+            for (const auto& sn : new_snodes) {
+                if (relay_queue_->stopping())
+                    break;
+                reconcile_range(sn, begin, end);
+            }
+        });
     }
 
     if (!events.new_swarms.empty()) {
@@ -628,35 +756,89 @@ void ServiceNode::update_swarms() {
 
     log::debug(logcat, "Swarm update triggered");
 
-    json params{
-            {"fields",
-             {{"service_node_pubkey", true},
-              {"swarm_id", true},
-              {"storage_port", true},
-              {"public_ip", true},
-              {"height", true},
-              {"block_hash", true},
-              {"hardfork", true},
-              {"snode_revision", true},
-              {"funded", true},
-              {"pubkey_x25519", true},
-              {"pubkey_ed25519", true},
-              {"storage_lmq_port", true}}},
-            {"active_only", false}};
-    if (got_first_response_ && !block_hash_.empty())
-        params["poll_block_hash"] = block_hash_;
+    constexpr std::array fields{
+            "service_node_pubkey"sv,
+            "swarm_id"sv,
+            "storage_port"sv,
+            "public_ip"sv,
+            "height"sv,
+            "block_hash"sv,
+            "hardfork"sv,
+            "snode_revision"sv,
+            "funded"sv,
+            "pubkey_x25519"sv,
+            "pubkey_ed25519"sv,
+            "storage_lmq_port"sv};
+    const bool poll = got_first_response_ && !block_hash_.empty();
+
+    // We ask for a bt-encoded response if we can: it is a good deal smaller than the json one (the
+    // keys are raw bytes rather than hex), and we can parse it as we read it rather than building
+    // a json document of the entire network first.
+    const bool bt = oxend_bt_updates_;
+    std::string params;
+    if (bt) {
+        oxenc::bt_dict_producer d;
+        d.append("active_only", 0);
+        {
+            auto l = d.append_list("fields");
+            for (auto f : fields)
+                l.append(f);
+        }
+        if (poll)
+            d.append("poll_block_hash", block_hash_);
+        params = d.view();
+    } else {
+        json p{{"active_only", false}};
+        for (auto f : fields)
+            p["fields"][std::string{f}] = true;
+        if (poll)
+            p["poll_block_hash"] = block_hash_;
+        params = p.dump();
+    }
 
     omq_server_.oxend_request(
             "rpc.get_service_nodes",
-            [this](bool success, std::vector<std::string> data) {
+            [this, bt](bool success, std::vector<std::string> data) {
                 updating_swarms_ = false;
                 if (!success || data.size() < 2) {
                     log::critical(logcat, "Failed to contact local oxend for service node list");
                     return;
                 }
+
+                // Parse it without holding sn_mutex_ (which every request needs), letting the
+                // parser skip the service node list entirely if it is the same as the one we
+                // already have.
+                std::optional<sn_states_digest> applied;
+                {
+                    std::lock_guard lock{sn_mutex_};
+                    applied = applied_states_;
+                }
+                block_update bu;
+                try {
+                    if (data[0] != "200")
+                        throw std::runtime_error{"oxend returned status " + data[0]};
+                    bu = parse_swarm_update(data[1], applied);
+                } catch (const std::exception& e) {
+                    if (bt) {
+                        log::warning(
+                                logcat,
+                                "Failed to get a bt-encoded service node list from oxend ({}); "
+                                "switching to json",
+                                e.what());
+                        oxend_bt_updates_ = false;
+                        return update_swarms();
+                    }
+                    log::error(logcat, "Exception caught on swarm update: {}", e.what());
+                    return;
+                }
+
+                bool save = false;
                 try {
                     std::lock_guard lock{sn_mutex_};
-                    block_update bu = parse_swarm_update(data[1]);
+                    // If what we have changed since (e.g. from bootstrapping) then we need the
+                    // list after all:
+                    if (bu.states_unchanged && bu.states_digest != applied_states_)
+                        bu = parse_swarm_update(data[1]);
                     if (!got_first_response_) {
                         log::info(logcat, "Got initial swarm information from local Oxend");
 
@@ -704,9 +886,10 @@ void ServiceNode::update_swarms() {
                         // nodes: but currently we still need this to deal with the lag).
 
                         auto [missing, total] = count_missing_data(bu);
-                        if (total >= (oxenss::is_mainnet ? 100 : 10) &&
-                            missing <= MISSING_PUBKEY_THRESHOLD::num * total /
-                                               MISSING_PUBKEY_THRESHOLD::den) {
+                        if (!bootstrap_ ||
+                            (total >= (oxenss::is_mainnet ? 100 : 10) &&
+                             missing <= MISSING_PUBKEY_THRESHOLD::num * total /
+                                                MISSING_PUBKEY_THRESHOLD::den)) {
                             log::info(
                                     logcat,
                                     "Initialized from oxend with {}/{} SN records",
@@ -727,12 +910,16 @@ void ServiceNode::update_swarms() {
                     if (!bu.unchanged) {
                         log::debug(logcat, "Blockchain updated, rebuilding swarm list");
                         on_swarm_update(std::move(bu));
+                        // Only keep state that we are actually using:
+                        save = !syncing_ && !provisional_;
                     }
                 } catch (const std::exception& e) {
                     log::error(logcat, "Exception caught on swarm update: {}", e.what());
                 }
+                if (save)
+                    save_swarm_snapshot(data[1]);
             },
-            params.dump());
+            params);
 }
 
 void ServiceNode::update_last_ping(ReachType type) {
@@ -761,10 +948,23 @@ void ServiceNode::ping_peers() {
         return;
     }
 
-    /// We always test nodes due to be tested plus one general, non-failing node.
+    /// We test nodes due to be tested plus one general, non-failing node, but limit how many we
+    /// start per tick and how many can be in progress at once.  Anything left over stays due, and
+    /// gets picked up on a later tick: retests in order of when they became due, and general tests
+    /// in a shuffled round through all nodes.
+    int slots = std::min(
+            reachability_testing::MAX_TESTS_STARTED_PER_TICK,
+            reachability_testing::MAX_CONCURRENT_TESTS - tests_in_flight_.load());
+    if (slots <= 0) {
+        log::trace(logcat, "Too many reachability tests in progress; not starting any more");
+        return;
+    }
 
-    auto to_test = reach_records_.get_failing(*swarm_, now);
-    if (auto rando = reach_records_.next_random(*swarm_, now))
+    // The general test (when one is due) gets its slot first: otherwise a steady stream of due
+    // retests could keep us from ever getting to the rest of the round of general tests.
+    auto rando = reach_records_.next_random(*swarm_, now);
+    auto to_test = reach_records_.get_failing(*swarm_, now, slots - (rando ? 1 : 0));
+    if (rando)
         to_test.emplace_back(std::move(*rando), 0);
 
     if (to_test.empty())
@@ -797,10 +997,12 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
         return;
     }
 
+    tests_in_flight_++;
     auto test = std::make_shared<sn_test>(
             sn,
             1 + mq_servers_.size(),
             [this, previous_failures](const sn_record& sn, bool passed) {
+                tests_in_flight_--;
                 report_reachability(sn, passed, previous_failures);
             });
 
@@ -814,7 +1016,9 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
 
     log::debug(logcat, "Sending HTTPS ping to {} @ {}", sn.pubkey_legacy, url);
     http->post(
-            [test](cpr::Response r) {
+            [this, test](cpr::Response r) {
+                record_test_latency(
+                        ReachType::HTTPS, std::chrono::steady_clock::now() - test->started);
                 auto& sn = test->sn;
                 auto& pk = sn.pubkey_legacy;
                 bool success = false;
@@ -853,7 +1057,8 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
             ""s /*body*/,
             SN_PING_TIMEOUT,
             std::move(host),
-            true /*disable https validation*/);
+            true /*disable https validation*/,
+            false /*always use a new connection*/);
 }
 
 void ServiceNode::oxend_ping() {
@@ -1179,62 +1384,228 @@ void ServiceNode::bootstrap_swarms(const std::vector<swarm_id_t>& swarms) const
 
     if (swarms.empty())
         log::info(logcat, "Bootstrapping all swarms");
-    else if (logcat->level() <= log::Level::info)
+    else if (logging::enabled(logcat, log::Level::info))
         log::info(logcat, "Bootstrapping swarms: [{}]", util::join(", ", swarms));
 
     const auto& all_swarms = swarm_->all_valid_swarms();
 
-    std::unordered_map<user_pubkey, swarm_id_t> pk_swarm_cache;
-    std::unordered_map<swarm_id_t, std::vector<message>> to_relay;
-
-    std::vector<message> all_entries = db_->retrieve_all();
-    log::debug(logcat, "We have {} messages", all_entries.size());
-    for (auto& entry : all_entries) {
-        if (!entry.pubkey) {
-            log::error(logcat, "Invalid pubkey in a message while bootstrapping other nodes");
+    // Each swarm owns a contiguous (possibly wrapping) range of swarm space, and the database
+    // indexes owners by swarm space, so we can pull out exactly the messages belonging to each
+    // swarm we are bootstrapping without having to look at (or hash) anything else.
+    struct swarm_range {
+        uint64_t begin, end;
+        std::vector<sn_record> snodes;
+    };
+    std::vector<swarm_range> ranges;
+    for (size_t i = 0; i < all_swarms.size(); i++) {
+        const auto& swarm = all_swarms[i];
+        if (!swarms.empty() &&
+            std::find(swarms.begin(), swarms.end(), swarm.swarm_id) == swarms.end())
             continue;
-        }
 
-        auto [it, ins] = pk_swarm_cache.try_emplace(entry.pubkey);
-        if (ins) {
-            auto swarm = get_swarm_by_pk(all_swarms, entry.pubkey);
-            it->second = swarm ? swarm->swarm_id : INVALID_SWARM_ID;
+        auto [begin, end] = swarm_space_range(all_swarms, i);
+        ranges.push_back({begin, end, swarm.snodes});
+    }
+    if (ranges.empty())
+        return;
+
+    // The actual pushing happens on the relay thread, at whatever pace the relay queue allows:
+    relay_queue_->feed([this, ranges = std::move(ranges)] {
+        for (const auto& [begin, end, snodes] : ranges)
+            for (const auto& sn : snodes) {
+                if (relay_queue_->stopping())
+                    return;
+                reconcile_range(sn, begin, end);
+            }
+        log::debug(logcat, "Bootstrapped {} swarm(s)", ranges.size());
+        util::release_free_memory();
+    });
+}
+
+std::optional<std::vector<std::string>> ServiceNode::request_peer(
+        const sn_record& sn, std::string_view endpoint, std::string body) const {
+    auto promise = std::make_shared<std::promise<std::optional<std::vector<std::string>>>>();
+    auto reply = promise->get_future();
+    omq_server_->request(
+            sn.pubkey_x25519.view(),
+            endpoint,
+            [promise](bool success, std::vector<std::string> data) {
+                if (success)
+                    promise->set_value(std::move(data));
+                else
+                    promise->set_value(std::nullopt);
+            },
+            std::move(body),
+            oxenmq::send_option::request_timeout{RECONCILE_TIMEOUT});
+    return reply.get();
+}
+
+void ServiceNode::reconcile_range(
+        const sn_record& sn, uint64_t begin, uint64_t end, int depth) const {
+    reconcile_ranges_++;
+    const auto now = std::chrono::steady_clock::now();
+    if (auto it = reconcile_failed_.find(sn.pubkey_legacy); it != reconcile_failed_.end()) {
+        if (now - it->second < RECONCILE_RETRY) {
+            reconcile_fallbacks_++;
+            push_range(sn, begin, end, nullptr);
+            return;
         }
-        auto swarm_id = it->second;
+        reconcile_failed_.erase(it);
+    }
 
-        if (swarms.empty() || std::find(swarms.begin(), swarms.end(), swarm_id) != swarms.end())
-            to_relay[swarm_id].push_back(std::move(entry));
+    const auto buckets = Database::split_swarm_space(begin, end, RECONCILE_BUCKETS);
+    const auto ours = db_->summarize_range(begin, end, RECONCILE_BUCKETS);
+
+    std::vector<Database::range_summary> theirs;
+    bool rejected = false;
+    {
+        oxenc::bt_dict_producer req;
+        req.append("b", begin);
+        req.append("e", end);
+        req.append("n", RECONCILE_BUCKETS);
+        auto reply = request_peer(sn, "sn.range_summary", std::string{req.view()});
+        if (reply && reply->size() == 1) {
+            try {
+                oxenc::bt_list_consumer l{reply->front()};
+                while (!l.is_finished()) {
+                    auto& s = theirs.emplace_back();
+                    s.count = l.consume_integer<int64_t>();
+                    s.digest = l.consume_integer<uint64_t>();
+                }
+            } catch (const std::exception& e) {
+                log::warning(
+                        logcat,
+                        "Invalid sn.range_summary reply from {}: {}",
+                        sn.pubkey_legacy,
+                        e.what());
+                theirs.clear();
+            }
+        } else if (reply && reply->size() == 2 && reply->front() == "413") {
+            // The peer supports reconciling, but not for this range (e.g. because it has a
+            // different idea of the range of its swarm), so we don't need to give up on it.
+            rejected = true;
+        }
+    }
+    if (theirs.size() != ours.size()) {
+        log::debug(
+                logcat,
+                "Unable to reconcile with {} ({}); pushing all data",
+                sn.pubkey_legacy,
+                rejected ? "range rejected" : "unsupported or failed");
+        if (!rejected)
+            reconcile_failed_[sn.pubkey_legacy] = now;
+        reconcile_fallbacks_++;
+        push_range(sn, begin, end, nullptr);
+        return;
     }
 
-    log::trace(logcat, "Bootstrapping {} swarms", to_relay.size());
+    for (size_t i = 0; i < buckets.size() && !relay_queue_->stopping(); i++) {
+        if (ours[i].count == 0)
+            continue;
+        if (ours[i] == theirs[i]) {
+            reconcile_skipped_ += ours[i].count;
+            continue;
+        }
+        auto [b, e] = buckets[i];
+        if (depth + 1 < RECONCILE_MAX_DEPTH &&
+            std::max(ours[i].count, theirs[i].count) > RECONCILE_MAX_HASHES) {
+            reconcile_range(sn, b, e, depth + 1);
+            continue;
+        }
 
-    std::unordered_map<swarm_id_t, size_t> swarm_id_to_idx;
-    for (size_t i = 0; i < all_swarms.size(); ++i)
-        swarm_id_to_idx.emplace(all_swarms[i].swarm_id, i);
+        std::optional<std::unordered_set<std::string>> have;
+        if (theirs[i].count == 0)
+            have.emplace();
+        else {
+            oxenc::bt_dict_producer req;
+            req.append("b", b);
+            req.append("e", e);
+            auto reply = request_peer(sn, "sn.range_hashes", std::string{req.view()});
+            if (reply && reply->size() == 1) {
+                try {
+                    have.emplace();
+                    oxenc::bt_list_consumer l{reply->front()};
+                    while (!l.is_finished())
+                        have->insert(l.consume_string());
+                } catch (const std::exception& e) {
+                    log::warning(
+                            logcat,
+                            "Invalid sn.range_hashes reply from {}: {}",
+                            sn.pubkey_legacy,
+                            e.what());
+                    have.reset();
+                }
+            }
+        }
+        push_range(sn, b, e, have ? &*have : nullptr);
+    }
+}
 
-    for (const auto& [swarm_id, items] : to_relay)
-        relay_messages(items, all_swarms[swarm_id_to_idx[swarm_id]].snodes);
+void ServiceNode::push_range(
+        const sn_record& sn,
+        uint64_t begin,
+        uint64_t end,
+        const std::unordered_set<std::string>* skip) const {
+    const std::vector<sn_record> dest{sn};
+    static auto& chunk_memory = util::get_memory_counter("redistribution");
+    db_->for_each_message(
+            begin,
+            end,
+            [&](std::vector<message>& chunk) {
+                int64_t bytes = 0;
+                for (const auto& m : chunk)
+                    bytes += m.data.size();
+                util::tracked_memory held{chunk_memory, bytes};
+                if (skip) {
+                    auto before = chunk.size();
+                    chunk.erase(
+                            std::remove_if(
+                                    chunk.begin(),
+                                    chunk.end(),
+                                    [skip](const message& m) { return skip->count(m.hash); }),
+                            chunk.end());
+                    reconcile_skipped_ += before - chunk.size();
+                }
+                reconcile_pushed_ += chunk.size();
+                if (!chunk.empty())
+                    relay_messages(chunk, dest);
+                relay_queue_->wait_for_space();
+                return !relay_queue_->stopping();
+            },
+            Database::ITERATE_CHUNK_SIZE,
+            SERIALIZATION_BATCH_SIZE);
 }
 
 void ServiceNode::relay_messages(
         const std::vector<message>& messages, const std::vector<sn_record>& snodes) const {
-    std::vector<std::string> batches =
-            serialize_messages(messages.begin(), messages.end(), SERIALIZATION_VERSION_BT);
-
-    if (logcat->level() <= log::Level::debug) {
-        log::debug(logcat, "Relayed messages:");
-        for (auto msg : batches)
-            log::debug(logcat, "    {}", msg);
-        log::debug(logcat, "To Snodes:");
-        for (auto sn : snodes)
-            log::debug(logcat, "    {}", sn.pubkey_legacy);
-
-        log::debug(logcat, "Serialised batches: {}", batches.size());
-    }
-
-    for (const sn_record& sn : snodes)
-        for (auto& batch : batches)
+    const auto version = hf_at_least(COMPACT_SERIALIZATION) ? SERIALIZATION_VERSION_COMPACT
+                                                            : SERIALIZATION_VERSION_BT;
+    // Only nodes that have told us they can decompress them get compressed batches, so we
+    // serialize (at most) once each way:
+    std::optional<std::vector<std::string>> batches[2];
+    for (const sn_record& sn : snodes) {
+        bool compress = version == SERIALIZATION_VERSION_COMPACT &&
+                        relay_queue_->accepts_zstd(sn.pubkey_x25519);
+        auto& b = batches[compress];
+        if (!b) {
+            b = serialize_messages(messages.begin(), messages.end(), version, compress);
+            // The batches are binary (and possibly compressed), so only log their sizes:
+            if (logging::enabled(logcat, log::Level::debug)) {
+                log::debug(
+                        logcat,
+                        "Serialised {} messages into {} v{}{} batch(es):",
+                        messages.size(),
+                        b->size(),
+                        static_cast<int>(version),
+                        compress ? " (compressed)" : "");
+                for (const auto& batch : *b)
+                    log::debug(logcat, "    {} bytes", batch.size());
+            }
+        }
+        log::debug(logcat, "Relaying {} batches to {}", b->size(), sn.pubkey_legacy);
+        for (auto& batch : *b)
             relay_data_reliable(batch, sn);
+    }
 }
 
 void to_json(nlohmann::json& j, const test_result& val) {
@@ -1244,12 +1615,17 @@ void to_json(nlohmann::json& j, const test_result& val) {
 
 static nlohmann::json to_json(const all_stats& stats) {
     json peers;
-    for (const auto& [pk, stats] : stats.peer_report()) {
+    auto report = stats.peer_report();
+    for (const auto& [pk, stats] : *report) {
         auto& p = peers[pk.hex()];
 
         p["requests_failed"] = stats.requests_failed;
-        p["pushes_failed"] = stats.requests_failed;
-        p["storage_tests"] = stats.storage_tests;
+        p["pushes_failed"] = stats.pushes_failed;
+        auto& tests = (p["storage_tests"] = json::array());
+        stats.for_each_storage_test([&tests](const test_result& r) { tests.push_back(r); });
+        auto& counts = (p["storage_test_counts"] = json::object());
+        for (size_t i = 0; i < NUM_RESULT_TYPES; i++)
+            counts[to_str(static_cast<ResultType>(i))] = stats.test_counts[i];
     }
 
     auto [window, recent] = stats.get_recent_requests();
@@ -1272,12 +1648,8 @@ std::string ServiceNode::get_stats_for_session_client() const {
     return json{{"version", STORAGE_SERVER_VERSION_STRING}}.dump();
 }
 
-std::string ServiceNode::get_stats() const {
-    auto val = to_json(all_stats_);
-
-    val["version"] = STORAGE_SERVER_VERSION_STRING;
-    val["height"] = block_height_;
-    val["target_height"] = target_height_;
+ServiceNode::account_msg_stats ServiceNode::compute_account_stats() const {
+    account_msg_stats result;
 
     std::vector<int> counts = db_->get_message_counts();
     int64_t total = std::accumulate(counts.begin(), counts.end(), int64_t{0});
@@ -1315,19 +1687,58 @@ std::string ServiceNode::get_stats() const {
         std::nth_element(std::next(pct_50th), pct_75th, counts.end());
         std::nth_element(std::next(pct_75th), pct_95th, counts.end());
 
-        val["account_msg_count_min"] = *std::min_element(counts.begin(), pct_5th);
-        val["account_msg_count_max"] = *std::max_element(pct_95th, counts.end());
-        val["account_msg_count_5th"] = *pct_5th;
-        val["account_msg_count_25th"] = *pct_25th;
-        val["account_msg_count_median"] = *pct_50th;
-        val["account_msg_count_75th"] = *pct_75th;
-        val["account_msg_count_95th"] = *pct_95th;
+        result.have_percentiles = true;
+        result.min = *std::min_element(counts.begin(), pct_5th);
+        result.max = *std::max_element(pct_95th, counts.end());
+        result.pct_5th = *pct_5th;
+        result.pct_25th = *pct_25th;
+        result.median = *pct_50th;
+        result.pct_75th = *pct_75th;
+        result.pct_95th = *pct_95th;
+    }
+
+    result.accounts = counts.size();
+    result.total = total;
+    return result;
+}
+
+std::string ServiceNode::get_stats() const {
+    return get_stats_json().dump();
+}
+
+nlohmann::json ServiceNode::get_stats_json() const {
+    auto val = to_json(all_stats_);
+
+    val["version"] = STORAGE_SERVER_VERSION_STRING;
+    val["height"] = block_height_;
+    val["target_height"] = target_height_;
+
+    account_msg_stats accts;
+    {
+        std::lock_guard lock{account_stats_mutex_};
+        auto now = std::chrono::steady_clock::now();
+        if (account_stats_updated_ == std::chrono::steady_clock::time_point{} ||
+            now - account_stats_updated_ >= ACCOUNT_STATS_REFRESH) {
+            account_stats_ = compute_account_stats();
+            account_stats_updated_ = now;
+        }
+        accts = account_stats_;
     }
 
-    val["accounts"] = counts.size();
-    val["total_stored"] = total;
-    if (counts.size() > 0)
-        val["account_msg_mean"] = total / (double)counts.size();
+    if (accts.have_percentiles) {
+        val["account_msg_count_min"] = accts.min;
+        val["account_msg_count_max"] = accts.max;
+        val["account_msg_count_5th"] = accts.pct_5th;
+        val["account_msg_count_25th"] = accts.pct_25th;
+        val["account_msg_count_median"] = accts.median;
+        val["account_msg_count_75th"] = accts.pct_75th;
+        val["account_msg_count_95th"] = accts.pct_95th;
+    }
+
+    val["accounts"] = accts.accounts;
+    val["total_stored"] = db_->get_message_count();
+    if (accts.accounts > 0)
+        val["account_msg_mean"] = accts.total / (double)accts.accounts;
 
     auto& ns_stats = (val["namespace_messages"] = nlohmann::json::object());
     for (auto& [ns, count] : db_->get_namespace_counts())
@@ -1336,8 +1747,212 @@ std::string ServiceNode::get_stats() const {
     val["db_used"] = db_->get_used_bytes();
     val["db_total"] = db_->get_total_bytes();
     val["db_max"] = Database::SIZE_LIMIT;
+    val["db_shards"] = db_->shard_count();
+
+    auto cleanup = db_->get_cleanup_stats();
+    val["expiry_backlog"] = cleanup.backlog;
+    val["expiry_deleted"] = cleanup.deleted;
+    val["expiry_chunks"] = cleanup.chunks;
+    val["expiry_chunk_last_us"] = cleanup.last_chunk_us;
+    val["expiry_chunk_max_us"] = cleanup.max_chunk_us;
+    val["evicted"] = db_->get_evicted_count();
+
+    auto maintenance = db_->get_maintenance_stats();
+    val["db_wal"] = maintenance.wal_bytes;
+    val["db_freelist_pages"] = maintenance.freelist_pages;
+    val["db_vacuumed_pages"] = maintenance.vacuumed_pages;
+    val["checkpoints"] = maintenance.checkpoints;
+    val["checkpoint_last_us"] = maintenance.last_checkpoint_us;
+    val["checkpoint_max_us"] = maintenance.max_checkpoint_us;
+
+    auto owner_cache = db_->get_owner_cache_stats();
+    val["owner_cache_hits"] = owner_cache.hits;
+    val["owner_cache_misses"] = owner_cache.misses;
+    val["owner_cache_size"] = owner_cache.size;
+
+    auto tail_cache = db_->get_tail_cache_stats();
+    val["tail_cache_hits"] = tail_cache.hits;
+    val["tail_cache_misses"] = tail_cache.misses;
+    val["tail_cache_bytes"] = tail_cache.bytes;
+
+    auto hash_filter = db_->get_hash_filter_stats();
+    val["hash_filter_size"] = hash_filter.size;
+    val["hash_filter_bytes"] = hash_filter.bytes;
+    val["hash_filter_skipped"] = hash_filter.skipped;
+    val["hash_filter_false_positives"] = hash_filter.false_positives;
+    val["hash_filter_rebuilds"] = hash_filter.rebuilds;
+
+    auto group_commit = db_->get_group_commit_stats();
+    val["group_commit_batches"] = group_commit.batches;
+    val["group_commit_stores"] = group_commit.stores;
+
+    auto write_lock = db_->get_write_lock_stats();
+    val["db_write_locks"] = write_lock.acquisitions;
+    val["db_write_locks_contended"] = write_lock.contended;
+    val["db_write_lock_wait_us"] = write_lock.wait_us;
+    val["db_write_lock_wait_max_us"] = write_lock.max_wait_us;
+
+    auto page_cache = db_->get_page_cache_stats();
+    val["db_page_cache_hits"] = page_cache.hits;
+    val["db_page_cache_misses"] = page_cache.misses;
+    val["db_page_cache_size"] = page_cache.cache_size;
+    val["db_mmap_size"] = page_cache.mmap_size;
+
+    auto pool = db_->get_pool_stats();
+    val["db_connections"] = pool.size;
+    val["db_connections_idle"] = pool.idle;
+    val["db_connections_created"] = pool.created;
+    val["db_connection_waits"] = pool.waits;
+    val["db_connection_wait_us"] = pool.wait_us;
+
+    auto& queries = (val["db_queries"] = nlohmann::json::array());
+    for (auto& q : db_->get_query_stats())
+        queries.push_back(
+                {{"query", q.query},
+                 {"count", q.uses},
+                 {"total_us", q.total_us},
+                 {"max_us", q.max_us},
+                 {"rows", q.rows}});
+
+    if (util::lock_profiling()) {
+        auto& locks = (val["locks"] = nlohmann::json::object());
+        util::for_each_lock_profile([&locks](const util::lock_profile& p) {
+            auto& l = locks[p.name];
+            l["acquisitions"] = p.acquisitions.load(std::memory_order_relaxed);
+            l["contended"] = p.contended.load(std::memory_order_relaxed);
+            l["wait_us"] = p.wait_us.load(std::memory_order_relaxed);
+            l["max_hold_us"] = p.max_hold_us.load(std::memory_order_relaxed);
+            auto& waits = (l["waits"] = nlohmann::json::array());
+            for (auto& w : p.waits)
+                waits.push_back(w.load(std::memory_order_relaxed));
+        });
+    }
+
+    for (auto [prefix, q] :
+         {std::pair{"db_read", db_executor_->get_read_stats()},
+          std::pair{"db_write", db_executor_->get_write_stats()}}) {
+        val[fmt::format("{}_queue", prefix)] = q.queued;
+        val[fmt::format("{}_jobs", prefix)] = q.jobs;
+        val[fmt::format("{}_wait_us", prefix)] = q.wait_us;
+        val[fmt::format("{}_wait_max_us", prefix)] = q.max_wait_us;
+        val[fmt::format("{}_owners", prefix)] = q.owners;
+        val[fmt::format("{}_owner_max", prefix)] = q.owner_max;
+        val[fmt::format("{}_rejected", prefix)] = q.rejected;
+    }
+    val["db_quota_rejected"] = db_->get_quota_rejected_count();
+
+    auto relay = relay_queue_->get_stats();
+    val["relay_queued"] = relay.queued_batches;
+    val["relay_queued_bytes"] = relay.queued_bytes;
+    val["relay_in_flight"] = relay.in_flight;
+    val["relay_pending_tasks"] = relay.pending_tasks;
+    val["relay_sent"] = relay.sent_batches;
+    val["relay_sent_bytes"] = relay.sent_bytes;
+    val["relay_failed"] = relay.failed_batches;
+    val["relay_retried"] = relay.retried_batches;
+    val["relay_dropped"] = relay.dropped_batches;
+    val["relay_acked_new"] = relay.acked_new;
+    val["relay_backoff_peers"] = relay.backoff_peers;
+    val["relay_quic"] = relay.quic_batches;
+
+    size_t monitor_subs = 0, monitor_conns = 0;
+    for (auto* s : mq_servers_) {
+        auto [subs, conns] = s->monitor_counts();
+        monitor_subs += subs;
+        monitor_conns += conns;
+    }
+    val["monitor_subscriptions"] = monitor_subs;
+    val["monitor_connections"] = monitor_conns;
+
+    // Approximate memory held by each subsystem: the counted ones, plus those that know their own
+    // size.  (The peer report is kept twice: the live one and its snapshot, each with a hash node
+    // per peer).
+    auto& memory = (val["memory"] = nlohmann::json::object());
+    auto& memory_peak = (val["memory_peak"] = nlohmann::json::object());
+    util::for_each_memory_counter([&](const util::memory_counter& c) {
+        memory[c.name] = c.bytes.load();
+        memory_peak[c.name] = c.peak.load();
+    });
+    memory["relay_queue"] = relay.queued_bytes;
+    memory["tail_cache"] = tail_cache.bytes;
+    memory["hash_filter"] = hash_filter.bytes;
+    size_t monitor_memory = 0;
+    for (auto* s : mq_servers_)
+        monitor_memory += s->monitor_memory();
+    memory["monitors"] = monitor_memory;
+    memory["peer_report"] =
+            2 * all_stats_.peer_report()->size() *
+            (sizeof(peer_report_t::value_type) + 2 * sizeof(void*));
+
+    auto alloc = util::get_allocator_stats();
+    if (!alloc.allocator.empty()) {
+        val["mem_allocator"] = alloc.allocator;
+        val["mem_allocated"] = alloc.allocated;
+        val["mem_resident"] = alloc.resident;
+        val["mem_free"] = alloc.free;
+        if (!alloc.arenas.empty()) {
+            auto& active = (val["mem_arena_active"] = nlohmann::json::object());
+            auto& dirty = (val["mem_arena_dirty"] = nlohmann::json::object());
+            for (auto& a : alloc.arenas) {
+                active[a.name] = a.active;
+                dirty[a.name] = a.dirty;
+            }
+        }
+    }
+    auto released = util::get_memory_release_stats();
+    val["mem_releases"] = released.releases;
+    val["mem_released_bytes"] = released.bytes;
+
+    val["reachability_tests_in_flight"] = tests_in_flight_.load();
+    auto& latency = val["reachability_latency"];
+    auto& bounds = latency["bounds_ms"] = json::array();
+    for (auto& b : latency_histogram::BOUNDS)
+        bounds.push_back(b.count());
+    for (auto [name, type] :
+         {std::pair{"https", ReachType::HTTPS},
+          std::pair{"omq", ReachType::OMQ},
+          std::pair{"quic", ReachType::QUIC}}) {
+        auto& counts = latency[name] = json::array();
+        for (auto& c : test_latency_[static_cast<size_t>(type)].counts)
+            counts.push_back(c.load());
+    }
+
+    auto notify = notify_queue_->get_stats();
+    val["notify_queued"] = notify.queued;
+    val["notify_delivered"] = notify.delivered;
+    val["notify_batches"] = notify.batches;
+    val["notify_dropped"] = notify.dropped;
+    val["notify_delay_us"] = notify.total_delay_us;
+    val["notify_delay_max_us"] = notify.max_delay_us;
+    val["retrieve_waiting"] = retrieve_waiters_.size();
+    auto forward = forward_queue_->get_stats();
+    val["forward_queued"] = forward.queued;
+    val["forward_commands"] = forward.commands;
+    val["forward_requests"] = forward.requests;
+    val["forward_batches"] = forward.batches;
+    val["forward_bad_replies"] = forward.bad_reply;
+    val["forward_quic"] = forward.quic;
+    val["reconcile_ranges"] = reconcile_ranges_.load();
+    val["reconcile_fallbacks"] = reconcile_fallbacks_.load();
+    val["reconcile_pushed"] = reconcile_pushed_.load();
+    val["reconcile_skipped"] = reconcile_skipped_.load();
+    if (auto http = http_.lock()) {
+        auto hs = http->get_stats();
+        val["http_requests"] = hs.requests;
+        val["http_new_connections"] = hs.new_connections;
+        val["http_reused_connections"] = hs.reused;
+        val["http_http2"] = hs.http2;
+        val["http_connect_us"] = hs.connect_us;
+        val["http_connect_max_us"] = hs.connect_max_us;
+    }
+
+    {
+        std::lock_guard guard(sn_mutex_);
+        for (auto& [name, provider] : stats_providers_)
+            provider(val);
+    }
 
-    return val.dump();
+    return val;
 }
 
 std::string ServiceNode::get_status_line() const {
@@ -1391,50 +2006,94 @@ std::string ServiceNode::get_status_line() const {
     return s.str();
 }
 
-void ServiceNode::process_push_batch(const std::string& blob) {
-    std::lock_guard guard(sn_mutex_);
-
-    if (blob.empty())
+void ServiceNode::process_push_batch(
+        std::string blob, std::function<void(std::optional<int> added)> done) {
+    if (blob.empty()) {
+        if (done)
+            done(0);
         return;
+    }
 
-    std::vector<message> items = deserialize_messages(blob);
+    // Parsed here, on the calling thread, without any lock; the database job only does the
+    // inserts.  The message hashes and data stay in the blob rather than being copied out of it.
+    std::shared_ptr<const message_batch> batch;
+    try {
+        batch = std::make_shared<const message_batch>(std::move(blob));
+    } catch (const std::exception& e) {
+        // Failing (rather than acknowledging a batch we didn't store) lets the sender retry
+        log::error(logcat, "Unable to decode pushed message batch: {}", e.what());
+        if (done)
+            done(std::nullopt);
+        return;
+    }
 
-    log::trace(logcat, "Saving all: begin");
+    log::debug(logcat, "Got {} messages from peers, size: {}", batch->size(), batch->bytes());
 
-    log::debug(logcat, "Got {} messages from peers, size: {}", items.size(), blob.size());
+    static auto& batch_memory = util::get_memory_counter("push_batches");
+    auto held = std::make_shared<util::tracked_memory>(batch_memory, batch->bytes());
+    db_executor_->write([this, batch = std::move(batch), held, done = std::move(done)](Database&) {
+        log::trace(logcat, "Saving all: begin");
+        auto added = save_bulk(batch->messages());
+        log::trace(logcat, "Saving all: end");
+        if (done)
+            done(added);
+    });
+}
 
-    save_bulk(items);
+std::shared_ptr<const Swarm> ServiceNode::swarm_snapshot() const {
+#ifdef __cpp_lib_atomic_shared_ptr
+    return swarm_snapshot_.load();
+#else
+    return std::atomic_load(&swarm_snapshot_);
+#endif
+}
 
-    log::trace(logcat, "Saving all: end");
+void ServiceNode::publish_swarm() {
+    auto snapshot = std::make_shared<const Swarm>(*swarm_);
+#ifdef __cpp_lib_atomic_shared_ptr
+    swarm_snapshot_.store(snapshot);
+#else
+    std::atomic_store(&swarm_snapshot_, snapshot);
+#endif
+    if (swarm_listener_)
+        swarm_listener_(snapshot);
 }
 
-bool ServiceNode::is_pubkey_for_us(const user_pubkey& pk) const {
+void ServiceNode::set_stats_provider(
+        std::string name, std::function<void(nlohmann::json&)> provider) {
     std::lock_guard guard(sn_mutex_);
+    if (provider)
+        stats_providers_[std::move(name)] = std::move(provider);
+    else
+        stats_providers_.erase(name);
+}
 
-    if (!swarm_) {
-        log::error(logcat, "Swarm data missing");
-        return false;
-    }
-    return swarm_->is_pubkey_for_us(pk);
+void ServiceNode::set_peer_request(peer_request_func f) {
+    relay_queue_->set_peer_request(f);
+    forward_queue_->set_peer_request(std::move(f));
 }
 
-std::optional<SwarmInfo> ServiceNode::get_swarm(const user_pubkey& pk) const {
+void ServiceNode::set_swarm_listener(
+        std::function<void(const std::shared_ptr<const Swarm>&)> listener) {
     std::lock_guard guard(sn_mutex_);
+    swarm_listener_ = std::move(listener);
+    if (swarm_listener_)
+        swarm_listener_(swarm_snapshot());
+}
 
-    if (!swarm_) {
-        log::error(logcat, "Swarm data missing");
-        return {};
-    }
+bool ServiceNode::is_pubkey_for_us(const user_pubkey& pk) const {
+    return swarm_snapshot()->is_pubkey_for_us(pk);
+}
 
-    if (auto* swarm = get_swarm_by_pk(swarm_->all_valid_swarms(), pk))
-        return *swarm;
+std::optional<SwarmInfo> ServiceNode::get_swarm(const user_pubkey& pk) const {
+    auto swarm = swarm_snapshot();
+    if (auto* info = swarm->get_swarm(pk))
+        return *info;
     return std::nullopt;
 }
 
 std::vector<sn_record> ServiceNode::get_swarm_peers() const {
-    std::lock_guard guard{sn_mutex_};
-
-    return swarm_->other_nodes();
+    return swarm_snapshot()->other_nodes();
 }
 
 }  // namespace oxenss::snode
@@ -1,21 +1,37 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <functional>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <oxenss/storage/database.hpp>
+#include <oxenss/storage/executor.hpp>
 #include <oxenss/crypto/keys.h>
 #include <oxenss/server/mqbase.h>
 #include <oxenss/http/http_client.h>
+#include <oxenss/utils/lock_profiler.hpp>
+#include "forward_queue.h"
+#include "notify_queue.h"
 #include "reachability_testing.h"
+#include "relay_queue.h"
+#include "retrieve_waiters.h"
 #include "stats.h"
 #include "swarm.h"
 
+#include <nlohmann/json_fwd.hpp>
+
 namespace oxenss::server {
 class OMQ;
 class QUIC;
@@ -38,6 +54,18 @@ inline constexpr auto STORAGE_TEST_TIMEOUT = 15s;
 // Timeout for bootstrap node OMQ requests
 inline constexpr auto BOOTSTRAP_TIMEOUT = 10s;
 
+// Saved swarm state older than this is ignored at startup rather than used as provisional state.
+inline constexpr auto SWARM_SNAPSHOT_MAX_AGE = 2h;
+
+// How often get_stats() recomputes the per-account message count distribution (which requires
+// scanning all stored messages).
+inline constexpr auto ACCOUNT_STATS_REFRESH = 60s;
+
+// How often we check whether the allocator is holding on to enough freed memory (at least
+// MEMORY_RELEASE_MIN_FREE bytes) to be worth returning to the OS.
+inline constexpr auto MEMORY_RELEASE_PERIOD = 1min;
+inline constexpr int64_t MEMORY_RELEASE_MIN_FREE = 64 * 1024 * 1024;
+
 /// We test based on the height a few blocks back to minimise discrepancies between nodes (we
 /// could also use checkpoints, but that is still not bulletproof: swarms are calculated based
 /// on the latest block, so they might be still different and thus derive different pairs)
@@ -55,6 +83,18 @@ inline constexpr hf_revision MULTI_EXPIRY_HARDFORK = {19, 4};
 // The hardfork at which we start testing QUIC reachability
 inline constexpr hf_revision QUIC_REACHABILITY_TESTING = {19, 4};
 
+// The hardfork at which we start coalescing forwarded client requests into `sn.storage_cc_batch`
+// requests (which older nodes don't understand):
+inline constexpr hf_revision FORWARD_BATCHING = {19, 5};
+
+// The hardfork at which we start sending relayed message batches and forwarded client requests to
+// other service nodes over QUIC (rather than OMQ):
+inline constexpr hf_revision QUIC_PEER_REQUESTS = {19, 6};
+
+// The hardfork at which we start sending message batches to other service nodes in the compact
+// serialization format (SERIALIZATION_VERSION_COMPACT):
+inline constexpr hf_revision COMPACT_SERIALIZATION = {19, 7};
+
 class Swarm;
 
 /// WRONG_REQ - request was ignored as not valid (e.g. incorrect tester)
@@ -72,21 +112,59 @@ constexpr std::string_view to_string(SnodeStatus status) {
     return "Unknown"sv;
 }
 
+/// Splits the (namespace, hash) pairs changed by a deletion or expiry update into one change per
+/// namespace (in namespace order), each with its hashes sorted, so that the resulting events are
+/// the same no matter what order a swarm member found the messages in.
+std::vector<message_change> split_changes(
+        message_change::type what,
+        const user_pubkey& pubkey,
+        const std::vector<std::pair<namespace_id, std::string>>& affected,
+        std::chrono::system_clock::time_point expiry = {});
+
+/// Returns the bt-encoded change event that monitoring connections get for `change`.
+std::string encode_change_event(const message_change& change);
+
 /// All service node logic that is not network-specific
 class ServiceNode {
     bool syncing_ = true;
     bool active_ = false;
     bool got_first_response_ = false;
+    // True while our swarm state comes from the snapshot saved before the last restart, rather
+    // than from oxend.
+    bool provisional_ = false;
     std::condition_variable first_response_cv_;
     std::mutex first_response_mutex_;
     bool force_start_ = false;
+    // If false we never fall back to the bootstrap nodes for a sparse service node list.
+    bool bootstrap_ = true;
     std::atomic<bool> shutting_down_ = false;
     hf_revision hardfork_ = {0, 0};
     uint64_t block_height_ = 0;
     uint64_t target_height_ = 0;
     std::string block_hash_;
+    // Where we save the last oxend swarm update, to start from after a restart.
+    const std::filesystem::path swarm_snapshot_path_;
+    // The working swarm state: only accessed (and modified) with sn_mutex_ held.
     std::unique_ptr<Swarm> swarm_;
+    // Immutable copy of `swarm_`, replaced after each swarm state change, for the per-request
+    // lookups (is_pubkey_for_us, get_swarm, etc.) to use without taking sn_mutex_.  Only access via
+    // swarm_snapshot() and publish_swarm().
+#ifdef __cpp_lib_atomic_shared_ptr
+    std::atomic<std::shared_ptr<const Swarm>> swarm_snapshot_;
+#else
+    std::shared_ptr<const Swarm> swarm_snapshot_;
+#endif
+    // Invoked with each new swarm snapshot; see set_swarm_listener().
+    std::function<void(const std::shared_ptr<const Swarm>&)> swarm_listener_;
+    // Add extra fields to get_stats(); see set_stats_provider().
+    std::map<std::string, std::function<void(nlohmann::json&)>> stats_providers_;
     std::unique_ptr<Database> db_;
+    // Runs database work off of the network threads; declared after db_ so that it is destroyed
+    // (which finishes off any queued jobs) first.
+    std::unique_ptr<DatabaseExecutor> db_executor_;
+    // Set while a cleanup or maintenance job is queued or running, so that slow ones don't pile up
+    std::atomic<bool> cleanup_queued_ = false;
+    std::atomic<bool> maintenance_queued_ = false;
     std::weak_ptr<http::Client> http_;
 
     SnodeStatus status_ = SnodeStatus::UNKNOWN;
@@ -108,21 +186,84 @@ class ServiceNode {
     // when syncing when we get tons of block notifications quickly).
     std::atomic<bool> updating_swarms_ = false;
 
+    // Cleared (so that we switch to json requests) if oxend doesn't give us a bt-encoded service
+    // node list.
+    std::atomic<bool> oxend_bt_updates_ = true;
+
+    // The digest of the service node list of the last oxend update that we applied in full (see
+    // `block_update::states_unchanged`), or nullopt if it has to be applied in full next time.
+    std::optional<sn_states_digest> applied_states_;
+
     reachability_testing reach_records_;
+    // Reachability tests currently in progress (see reachability_testing::MAX_CONCURRENT_TESTS)
+    std::atomic<int> tests_in_flight_ = 0;
+    // Reachability test durations, indexed by ReachType
+    std::array<latency_histogram, 3> test_latency_;
 
     mutable all_stats all_stats_;
 
-    mutable std::recursive_mutex sn_mutex_;
+    // Paces the data batches we push to other nodes; declared after all_stats_ (which it uses).
+    std::unique_ptr<RelayQueue> relay_queue_;
+
+    // Fans out new message notifications to monitoring connections off the store path.
+    std::unique_ptr<NotifyQueue> notify_queue_;
+
+    // Coalesces recursive client requests that we forward to the same swarm peer.
+    std::unique_ptr<ForwardQueue> forward_queue_;
+
+    // Long-polling retrieves waiting for a new message to arrive.
+    RetrieveWaiters retrieve_waiters_;
+
+    // Cached per-account message count distribution for get_stats().  Unlike the message, owner,
+    // and namespace totals (which the database's message_stats and owner_stats triggers keep up to
+    // date on every insert and delete), nothing maintains this incrementally: it gets recomputed
+    // from a full `GROUP BY owner` scan when it is more than ACCOUNT_STATS_REFRESH old.
+    struct account_msg_stats {
+        size_t accounts = 0;  // accounts with at least 2 messages
+        int64_t total = 0;
+        bool have_percentiles = false;
+        int min, pct_5th, pct_25th, median, pct_75th, pct_95th, max;
+    };
+    mutable std::mutex account_stats_mutex_;
+    mutable account_msg_stats account_stats_;
+    mutable std::chrono::steady_clock::time_point account_stats_updated_{};
+    account_msg_stats compute_account_stats() const;
+
+    mutable util::profiled_mutex<std::recursive_mutex, "sn"> sn_mutex_;
+
+    // Returns the current (immutable) swarm snapshot; never null.
+    std::shared_ptr<const Swarm> swarm_snapshot() const;
+
+    // Replaces the swarm snapshot with a copy of the current `swarm_`.  Must be called (with
+    // sn_mutex_ held) after modifying `swarm_`.
+    void publish_swarm();
 
+    // Queues notifications of a new message for delivery by notify_queue_.
     void send_notifies(message m);
 
-    // Save multiple messages to the database at once (i.e. in a single transaction)
-    void save_bulk(const std::vector<message>& msgs);
+    // Returns true if any of our servers has connections subscribed to change events.
+    bool have_change_monitors() const;
+
+    // Sends notifications for a batch of new messages and message changes to their monitoring
+    // connections.  Called on the notify_queue_ thread.
+    void deliver_notifies(
+            const std::vector<message>& msgs, const std::vector<message_change>& changes);
+
+    // Save multiple messages to the database at once (i.e. in a single transaction).  Returns the
+    // number of messages that were new, or nullopt if the store failed.
+    std::optional<int> save_bulk(const std::vector<message_ref>& msgs);
 
     void on_bootstrap_update(block_update&& bu);
 
     void on_swarm_update(block_update&& bu);
 
+    // Loads the swarm state saved by save_swarm_snapshot(), if there is one and it is not too old,
+    // as provisional state to serve requests with until oxend catches up with it.
+    void load_swarm_snapshot();
+
+    // Saves an oxend swarm update (the raw rpc.get_service_nodes response).
+    void save_swarm_snapshot(std::string_view response) const;
+
     void bootstrap_data();
 
     void bootstrap_swarms(const std::vector<swarm_id_t>& swarms = {}) const;
@@ -131,7 +272,7 @@ class ServiceNode {
     /// (called when our old node got dissolved)
     void salvage_data() const;  // mutex not needed
 
-    /// Reliably push message/batch to a service node
+    /// Queues a message batch to be pushed to a service node (see RelayQueue)
     void relay_data_reliable(
             const std::string& blob,
             const sn_record& address) const;  // mutex not needed
@@ -140,6 +281,42 @@ class ServiceNode {
             const std::vector<message>& msgs,
             const std::vector<sn_record>& snodes) const;  // mutex not needed
 
+    // Pushes our messages in swarm space [begin, end) to `sn`, skipping the ones that it already
+    // has: we compare range summaries with it (sn.range_summary), recursing into the sub-ranges
+    // that differ until they are small enough to compare hash lists (sn.range_hashes).  Falls back
+    // to pushing everything in the range if the peer doesn't support this.  Blocks waiting for
+    // the peer, so must only be called from a RelayQueue task.
+    void reconcile_range(const sn_record& sn, uint64_t begin, uint64_t end, int depth = 0) const;
+
+    // Pushes our messages in swarm space [begin, end) to `sn`, except for those with hashes in
+    // `skip` (if non-null).  Must only be called from a RelayQueue task.
+    void push_range(
+            const sn_record& sn,
+            uint64_t begin,
+            uint64_t end,
+            const std::unordered_set<std::string>* skip) const;
+
+    // Makes a request to another service node and waits for the reply; returns nullopt on failure
+    // or timeout.  Must only be called from a RelayQueue task.
+    std::optional<std::vector<std::string>> request_peer(
+            const sn_record& sn, std::string_view endpoint, std::string body) const;
+
+    // How many levels of sub-ranges we recurse into before comparing hash lists regardless.
+    static constexpr int RECONCILE_MAX_DEPTH = 3;
+    static constexpr auto RECONCILE_TIMEOUT = 10s;
+    // After a peer fails a summary request (e.g. because it is running an older version that
+    // doesn't have it) we just push everything to it for this long, rather than waiting for
+    // another timeout each time.
+    static constexpr auto RECONCILE_RETRY = 1h;
+    // Peers that recently failed a summary request; only accessed from the relay thread.
+    mutable std::unordered_map<crypto::legacy_pubkey, std::chrono::steady_clock::time_point>
+            reconcile_failed_;
+
+    // Reconciliation stats: ranges compared, fallbacks to full pushes, and messages pushed or
+    // skipped (because the peer already had them).
+    mutable std::atomic<uint64_t> reconcile_ranges_ = 0, reconcile_fallbacks_ = 0,
+                                  reconcile_pushed_ = 0, reconcile_skipped_ = 0;
+
     // Conducts any ping peer tests that are due; (this is designed to be called frequently and
     // does nothing if there are no tests currently due).
     void ping_peers();
@@ -171,16 +348,47 @@ class ServiceNode {
     void report_reachability(const sn_record& sn, bool reachable, int previous_failures);
 
   public:
+    // Records how long a reachability test over the given transport took.
+    void record_test_latency(ReachType type, std::chrono::steady_clock::duration d) {
+        test_latency_[static_cast<size_t>(type)].add(d);
+    }
+
+    // Number of sub-ranges we split a range into when reconciling it with a peer; this is also the
+    // most sub-ranges that we will summarize for a peer's sn.range_summary request.
+    static constexpr size_t RECONCILE_BUCKETS = 64;
+    // Sub-range differences larger than this (by message count) get recursed into rather than
+    // being resolved by comparing hash lists; this is also the most hashes that we will return for
+    // a peer's sn.range_hashes request.
+    static constexpr int64_t RECONCILE_MAX_HASHES = 2000;
+    // The widest range that we return hashes for: peers only ask for the hashes of one of the
+    // RECONCILE_BUCKETS sub-ranges of a range, which is never wider than this.
+    static constexpr uint64_t RECONCILE_MAX_HASHES_WIDTH =
+            std::numeric_limits<uint64_t>::max() / RECONCILE_BUCKETS + RECONCILE_BUCKETS;
+
     ServiceNode(
             sn_record address,
             const crypto::legacy_seckey& skey,
             server::OMQ& omq_server,
             const std::filesystem::path& db_location,
-            bool force_start);
+            bool force_start,
+            const database_options& db_options = {},
+            bool bootstrap = true);
 
     Database& get_db() { return *db_; }
     const Database& get_db() const { return *db_; }
 
+    // Request handling should queue database work here rather than calling get_db() directly
+    // from a network thread.
+    DatabaseExecutor& db_executor() { return *db_executor_; }
+
+    // Recursive client requests should be forwarded to swarm peers through here (once the network
+    // is at FORWARD_BATCHING).
+    ForwardQueue& forward_queue() { return *forward_queue_; }
+
+    // Retrieves with nothing to return yet that want to wait for new messages park here; they are
+    // woken as new messages are delivered to monitors.
+    RetrieveWaiters& retrieve_waiters() { return retrieve_waiters_; }
+
     // Adds a MQ server, i.e. QUIC.  The OMQ server is added automatically during construction and
     // should not be added.
     void register_mq_server(server::MQBase* server);
@@ -226,24 +434,42 @@ class ServiceNode {
     bool snode_ready(std::string* reason = nullptr);
 
     // Puts the storage server into shutdown mode; this operation is irreversible and should
-    // only be used during storage server shutdown.
+    // only be used during storage server shutdown.  This also finishes off any queued database
+    // jobs and stops the database threads.
     void shutdown();
 
     // Returns true if the storage server is currently shutting down.
     bool shutting_down() const { return shutting_down_; }
 
-    /// Process message received from a client, return false if not in a swarm.  If new_msg is not
-    /// nullptr, sets it to true if we stored as a new message, false if we already had it.  If
-    /// `expiry` is non-null it will be set to the message's expiry: for a new message this is the
-    /// given expiry; for existing messages this is the message's new expiry (which might have been
+    /// Process message received from a client, returning the database's StoreResult.  This stores
+    /// to the database directly, and so should be called from a database writer job.  If `expiry`
+    /// is non-null it will be set to the message's expiry: for a new message this is the given
+    /// expiry; for existing messages this is the message's new expiry (which might have been
     /// extended to match the one in `msg`, if later).
-    bool process_store(
-            message msg,
-            bool* new_msg = nullptr,
-            std::chrono::system_clock::time_point* expiry = nullptr);
-
-    /// Process incoming blob of messages: add to DB if new
-    void process_push_batch(const std::string& blob);
+    StoreResult process_store(
+            message msg, std::chrono::system_clock::time_point* expiry = nullptr);
+
+    /// Queues notifications of a change (deletion or expiry update) to existing messages for the
+    /// connections monitoring them for changes.  Does nothing if the change has no hashes, so this
+    /// can be called with whatever a delete or expiry update actually changed locally.
+    void send_change_notifies(message_change change);
+
+    /// Same as above, for changes to messages across namespaces given as (namespace, hash) pairs,
+    /// as returned by the Database methods that can act on several namespaces (such as deletions
+    /// by hash).  Sends one change event per namespace.
+    void send_change_notifies(
+            message_change::type what,
+            const user_pubkey& pubkey,
+            const std::vector<std::pair<namespace_id, std::string>>& affected,
+            std::chrono::system_clock::time_point expiry = {});
+
+    /// Process incoming blob of messages: add to DB if new.  The messages are stored by a database
+    /// writer job, after which `done` (if given) is called from the database thread with the number
+    /// of messages that were new, or nullopt if storing them failed.  If the blob can't be decoded
+    /// `done` gets nullopt right away, on the calling thread.  The blob is parsed in place (the
+    /// messages stored from it are views into it) and kept alive until the store is done.
+    void process_push_batch(
+            std::string blob, std::function<void(std::optional<int> added)> done = nullptr);
 
     // Attempt to find an answer (message body) to the storage test
     std::pair<MessageTestStatus, std::string> process_storage_test_req(
@@ -255,6 +481,20 @@ class ServiceNode {
 
     std::optional<SwarmInfo> get_swarm(const user_pubkey& pk) const;
 
+    // Sets a callback to be invoked with every new swarm snapshot (i.e. after each swarm update),
+    // and immediately with the current one.  The callback is invoked with sn_mutex_ held, so it
+    // must not call back into the ServiceNode.  Pass nullptr to clear it.
+    void set_swarm_listener(std::function<void(const std::shared_ptr<const Swarm>&)> listener);
+
+    // Sets a callback that adds extra fields (e.g. the stats of components not owned by the
+    // service node) to the get_stats() output.  Each component uses its own `name`, replacing any
+    // previous callback of that name; pass nullptr to clear it.
+    void set_stats_provider(std::string name, std::function<void(nlohmann::json&)> provider);
+
+    // Sets (or, with nullptr, clears) the alternative transport that the relay and forward queues
+    // try first for their requests to other service nodes; see peer_request_func.
+    void set_peer_request(peer_request_func f);
+
     std::vector<sn_record> get_swarm_peers() const;
 
     // Stats for session clients that want to know the version number
@@ -262,14 +502,14 @@ class ServiceNode {
 
     std::string get_stats() const;
 
+    // Same as get_stats(), but returns the stats object rather than its json encoding.
+    nlohmann::json get_stats_json() const;
+
     std::string get_status_line() const;
 
     template <typename PubKey>
     std::optional<sn_record> find_node(const PubKey& pk) const {
-        std::lock_guard guard{sn_mutex_};
-        if (swarm_)
-            return swarm_->find_node(pk);
-        return std::nullopt;
+        return swarm_snapshot()->find_node(pk);
     }
 
     // Called once we have established the initial connection to our local oxend to set up
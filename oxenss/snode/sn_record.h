@@ -1,7 +1,9 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <string>
 
 #include <oxenss/crypto/keys.h>
@@ -32,6 +34,8 @@ struct sn_test {
     std::function<void(const snode::sn_record, bool passed)> finished;
     std::atomic<int> remaining;
     std::atomic<bool> failed{false};
+    // When the test started, for test latency stats
+    const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
 
     sn_test(const snode::sn_record& sn,
             int test_count,
@@ -8,17 +8,71 @@
 
 namespace oxenss::snode {
 
-all_stats::all_stats(oxenmq::OxenMQ& omq) {
+void peer_stats::add_storage_test(const test_result& r) {
+    if (num_tests == STORAGE_TEST_HISTORY) {
+        test_counts[static_cast<size_t>(storage_tests[first_test].result)]--;
+        first_test = (first_test + 1) % STORAGE_TEST_HISTORY;
+        num_tests--;
+    }
+    storage_tests[(first_test + num_tests) % STORAGE_TEST_HISTORY] = r;
+    num_tests++;
+    test_counts[static_cast<size_t>(r.result)]++;
+}
+
+void peer_stats::expire_storage_tests(std::chrono::system_clock::time_point cutoff) {
+    while (num_tests > 0 && storage_tests[first_test].timestamp <= cutoff) {
+        test_counts[static_cast<size_t>(storage_tests[first_test].result)]--;
+        first_test = (first_test + 1) % STORAGE_TEST_HISTORY;
+        num_tests--;
+    }
+}
+
+all_stats::all_stats(oxenmq::OxenMQ& omq) :
+        peer_report_snapshot_{std::make_shared<const peer_report_t>()} {
     omq.add_timer([this] { cleanup(); }, STATS_CLEANUP_INTERVAL);
 }
 
-static void cleanup_old(
-        std::deque<test_result>& tests, std::chrono::system_clock::time_point cutoff_time) {
-    while (!tests.empty() && tests.front().timestamp <= cutoff_time)
-        tests.pop_front();
+peer_stats& all_stats::peer_update(const crypto::legacy_pubkey& sn) {
+    auto& stats = peer_report_[sn];
+    stats.last_update = std::chrono::system_clock::now();
+    peer_report_changed_ = true;
+    return stats;
+}
+
+void all_stats::record_request_failed(const crypto::legacy_pubkey& sn) {
+    std::lock_guard lock{peer_report_mutex};
+    peer_update(sn).requests_failed++;
 }
 
-static constexpr auto ROLLING_WINDOW = 120min;
+void all_stats::record_push_failed(const crypto::legacy_pubkey& sn) {
+    std::lock_guard lock{peer_report_mutex};
+    peer_update(sn).pushes_failed++;
+}
+
+void all_stats::record_storage_test_result(const crypto::legacy_pubkey& sn, ResultType result) {
+    std::lock_guard lock{peer_report_mutex};
+    auto& stats = peer_update(sn);
+    stats.add_storage_test({stats.last_update, result});
+}
+
+std::shared_ptr<const peer_report_t> all_stats::peer_report() const {
+    if (peer_report_changed_) {
+        std::lock_guard lock{peer_report_mutex};
+        if (peer_report_changed_.exchange(false)) {
+            auto snapshot = std::make_shared<const peer_report_t>(peer_report_);
+#ifdef __cpp_lib_atomic_shared_ptr
+            peer_report_snapshot_.store(std::move(snapshot));
+#else
+            std::atomic_store(&peer_report_snapshot_, std::move(snapshot));
+#endif
+        }
+    }
+#ifdef __cpp_lib_atomic_shared_ptr
+    return peer_report_snapshot_.load();
+#else
+    return std::atomic_load(&peer_report_snapshot_);
+#endif
+}
 
 void all_stats::cleanup() {
     {
@@ -37,12 +91,19 @@ void all_stats::cleanup() {
     }
 
     {
-        // Clean up old peer report stats
+        // Clean up old peer report stats, and forget peers we haven't heard about in a while
         std::lock_guard lock{peer_report_mutex};
 
-        const auto cutoff = std::chrono::system_clock::now() - ROLLING_WINDOW;
-        for (auto& [kv, stats] : peer_report_)
-            cleanup_old(stats.storage_tests, cutoff);
+        const auto cutoff = std::chrono::system_clock::now() - PEER_STATS_WINDOW;
+        for (auto it = peer_report_.begin(); it != peer_report_.end();) {
+            if (it->second.last_update <= cutoff)
+                it = peer_report_.erase(it);
+            else {
+                it->second.expire_storage_tests(cutoff);
+                ++it;
+            }
+        }
+        peer_report_changed_ = true;
     }
 }
 
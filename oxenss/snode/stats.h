@@ -2,9 +2,13 @@
 
 #include "sn_record.h"
 
+#include <oxenss/utils/lock_profiler.hpp>
+
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 
@@ -24,7 +28,15 @@ inline constexpr std::chrono::seconds STATS_CLEANUP_INTERVAL = 10min;
 // STATS_WINDOWS*STATS_CLEANUP_INTERVAL plus however long since the last cleanup.
 inline constexpr size_t RECENT_STATS_COUNT = 6;
 
+// How long we keep per-peer stats: storage test results older than this are dropped, as are
+// (former) peers we haven't recorded anything about for this long.
+inline constexpr auto PEER_STATS_WINDOW = 120min;
+
+// How many of the most recent storage test results we keep for each peer.
+inline constexpr size_t STORAGE_TEST_HISTORY = 32;
+
 enum class ResultType { OK, MISMATCH, OTHER, REJECTED };
+inline constexpr size_t NUM_RESULT_TYPES = 4;
 
 struct test_result {
     std::chrono::system_clock::time_point timestamp;
@@ -49,9 +61,33 @@ struct peer_stats {
     // causing this node to give up re-transmitting
     uint64_t pushes_failed = 0;
 
-    std::deque<test_result> storage_tests;
+    // The most recent storage test results, in a fixed-size ring buffer: the oldest is at
+    // `first_test`, and there are `num_tests` of them.
+    std::array<test_result, STORAGE_TEST_HISTORY> storage_tests{};
+    size_t first_test = 0;
+    size_t num_tests = 0;
+    // How many of the results currently in `storage_tests` are of each ResultType
+    std::array<uint32_t, NUM_RESULT_TYPES> test_counts{};
+
+    // When we last recorded anything for this peer
+    std::chrono::system_clock::time_point last_update{};
+
+    // Adds a storage test result, replacing the oldest one if the buffer is full.
+    void add_storage_test(const test_result& r);
+
+    // Drops the storage test results from `cutoff` or earlier.
+    void expire_storage_tests(std::chrono::system_clock::time_point cutoff);
+
+    // Calls `f(const test_result&)` on each kept storage test result, oldest first.
+    template <typename F>
+    void for_each_storage_test(F&& f) const {
+        for (size_t i = 0; i < num_tests; i++)
+            f(storage_tests[(first_test + i) % STORAGE_TEST_HISTORY]);
+    }
 };
 
+using peer_report_t = std::unordered_map<crypto::legacy_pubkey, peer_stats>;
+
 struct period_stats {
     uint64_t client_store_requests = 0, client_retrieve_requests = 0, proxy_requests = 0,
              onion_requests = 0;
@@ -72,39 +108,40 @@ class all_stats {
     std::chrono::steady_clock::time_point last_rotate = std::chrono::steady_clock::now();
     mutable std::mutex prev_stats_mutex;
 
-    // stats per every peer in our swarm (including former peers)
-    std::unordered_map<crypto::legacy_pubkey, peer_stats> peer_report_;
-    mutable std::mutex peer_report_mutex;
-
-    // remove old test entries and reset counters, update reset time
+    // stats per every peer in our swarm (including recent former peers)
+    peer_report_t peer_report_;
+    mutable util::profiled_mutex<std::mutex, "peer_report"> peer_report_mutex;
+    // Immutable copy of `peer_report_` for readers, republished (by peer_report()) when it is
+    // requested after something changed.
+    mutable std::atomic<bool> peer_report_changed_ = false;
+#ifdef __cpp_lib_atomic_shared_ptr
+    mutable std::atomic<std::shared_ptr<const peer_report_t>> peer_report_snapshot_;
+#else
+    mutable std::shared_ptr<const peer_report_t> peer_report_snapshot_;
+#endif
+
+    // Returns the stats of `sn`, creating them if needed, and marks them as updated.  Must be
+    // called with peer_report_mutex held.
+    peer_stats& peer_update(const crypto::legacy_pubkey& sn);
+
+    // remove old test entries and former peers, rotate the period counters, update reset time
     void cleanup();
 
   public:
     explicit all_stats(oxenmq::OxenMQ& omq);
 
-    // Returns the number of failed requests for the given pubkey over the last ROLLING_WINDOW
-    void record_request_failed(const crypto::legacy_pubkey& sn) {
-        std::lock_guard lock{peer_report_mutex};
-        peer_report_[sn].requests_failed++;
-    }
+    // Records a failed request to the given peer
+    void record_request_failed(const crypto::legacy_pubkey& sn);
 
-    // Returns the number of failed pushes for the given pubkey over the last ROLLING_WINDOW
-    void record_push_failed(const crypto::legacy_pubkey& sn) {
-        std::lock_guard lock{peer_report_mutex};
-        peer_report_[sn].pushes_failed++;
-    }
+    // Records a series of failed pushes to the given peer
+    void record_push_failed(const crypto::legacy_pubkey& sn);
 
     // Records a storage test result for the given peer
-    void record_storage_test_result(const crypto::legacy_pubkey& sn, ResultType result) {
-        std::lock_guard lock{peer_report_mutex};
-        peer_report_[sn].storage_tests.push_back({std::chrono::system_clock::now(), result});
-    }
+    void record_storage_test_result(const crypto::legacy_pubkey& sn, ResultType result);
 
-    // Returns a copy of the current peer report
-    std::unordered_map<crypto::legacy_pubkey, peer_stats> peer_report() const {
-        std::lock_guard lock{peer_report_mutex};
-        return peer_report_;
-    }
+    // Returns a snapshot of the current peer report.  This is shared (and never modified), so
+    // repeated calls without any new peer stats in between are just an atomic load.
+    std::shared_ptr<const peer_report_t> peer_report() const;
 
     void bump_proxy_requests() {
         total_proxy_requests++;
@@ -3,10 +3,16 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/utils/string_utils.hpp>
 
+#include <algorithm>
 #include <cstdlib>
+#include <map>
 #include <ostream>
 #include <unordered_map>
+#include <nlohmann/json.hpp>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/endian.h>
+#include <oxenc/hex.h>
+#include <sodium/crypto_generichash.h>
 
 namespace oxenss::snode {
 
@@ -141,6 +147,7 @@ void Swarm::apply_swarm_changes(std::vector<SwarmInfo>&& new_swarms) {
 
     preserve_ips(new_swarms, all_valid_swarms_);
     all_valid_swarms_ = std::move(new_swarms);
+    lookup_ = swarm_lookup{all_valid_swarms_};
 }
 
 void Swarm::update_state(
@@ -220,24 +227,26 @@ std::optional<sn_record> Swarm::find_node(const crypto::x25519_pubkey& pk) const
     return std::nullopt;
 }
 
-uint64_t pubkey_to_swarm_space(const user_pubkey& pk) {
-    const auto bytes = pk.raw();
-    assert(bytes.size() == 32);
-
-    uint64_t res = 0;
-    for (size_t i = 0; i < 4; i++) {
-        uint64_t buf;
-        std::memcpy(&buf, bytes.data() + i * 8, 8);
-        res ^= buf;
-    }
-    oxenc::big_to_host_inplace(res);
+bool Swarm::is_pubkey_for_us(const user_pubkey& pk) const {
+    auto* swarm = get_swarm(pk);
+    return swarm && cur_swarm_id_ == swarm->swarm_id;
+}
 
-    return res;
+std::optional<std::pair<uint64_t, uint64_t>> Swarm::our_swarm_space_range() const {
+    auto it = std::lower_bound(
+            all_valid_swarms_.begin(),
+            all_valid_swarms_.end(),
+            cur_swarm_id_,
+            [](const SwarmInfo& s, swarm_id_t id) { return s.swarm_id < id; });
+    if (it == all_valid_swarms_.end() || it->swarm_id != cur_swarm_id_)
+        return std::nullopt;
+    return swarm_space_range(all_valid_swarms_, it - all_valid_swarms_.begin());
 }
 
-bool Swarm::is_pubkey_for_us(const user_pubkey& pk) const {
-    auto* swarm = get_swarm_by_pk(all_valid_swarms_, pk);
-    return swarm && cur_swarm_id_ == swarm->swarm_id;
+const SwarmInfo* Swarm::get_swarm(const user_pubkey& pk) const {
+    if (lookup_.empty())
+        return nullptr;
+    return &all_valid_swarms_[lookup_.index(pubkey_to_swarm_space(pk))];
 }
 
 const SwarmInfo* get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms, const user_pubkey& pk) {
@@ -278,6 +287,281 @@ const SwarmInfo* get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms, const
     return &*(dright < dleft ? right_it : left_it);
 }
 
+std::pair<uint64_t, uint64_t> swarm_space_range(
+        const std::vector<SwarmInfo>& all_swarms, size_t idx) {
+    assert(idx < all_swarms.size());
+    if (all_swarms.size() == 1)
+        return {0, 0};
+
+    // This mirrors the selection in get_swarm_by_pk: a value goes to the closest swarm id (with
+    // wraparound), preferring the lower swarm when exactly in the middle.  All the arithmetic here
+    // is intentionally modulo 2^64.
+    const uint64_t id = all_swarms[idx].swarm_id;
+    const uint64_t left = all_swarms[idx == 0 ? all_swarms.size() - 1 : idx - 1].swarm_id;
+    const uint64_t right = all_swarms[idx + 1 == all_swarms.size() ? 0 : idx + 1].swarm_id;
+
+    return {left + (id - left) / 2 + 1, id + (right - id) / 2 + 1};
+}
+
+swarm_lookup::swarm_lookup(const std::vector<SwarmInfo>& all_swarms) : swarms_{all_swarms.size()} {
+    if (swarms_ < 2)
+        return;
+
+    assert(std::is_sorted(all_swarms.begin(), all_swarms.end()));
+
+    // Each swarm's range begins somewhere between its own swarm id and the previous one, so these
+    // are already sorted except for the first swarm's, which (because it wraps around) might
+    // belong at the end instead.
+    std::vector<std::pair<uint64_t, uint32_t>> bounds;
+    bounds.reserve(swarms_);
+    for (size_t i = 0; i < swarms_; i++)
+        bounds.emplace_back(swarm_space_range(all_swarms, i).first, static_cast<uint32_t>(i));
+    std::sort(bounds.begin(), bounds.end());
+
+    bounds_.reserve(swarms_);
+    owner_.reserve(swarms_);
+    for (auto& [b, i] : bounds) {
+        bounds_.push_back(b);
+        owner_.push_back(i);
+    }
+
+    prefix_.resize((size_t{1} << PREFIX_BITS) + 1);
+    size_t j = 0;
+    for (size_t k = 0; k < prefix_.size() - 1; k++) {
+        const uint64_t start = static_cast<uint64_t>(k) << (64 - PREFIX_BITS);
+        while (j < bounds_.size() && bounds_[j] < start)
+            j++;
+        prefix_[k] = static_cast<uint32_t>(j);
+    }
+    prefix_.back() = static_cast<uint32_t>(bounds_.size());
+}
+
+size_t swarm_lookup::index(uint64_t space) const {
+    assert(swarms_ > 0);
+    if (swarms_ == 1)
+        return 0;
+
+    // We want the last boundary <= space, which must be in bounds_[prefix_[k]-1 ... prefix_[k+1]-1]
+    const size_t k = space >> (64 - PREFIX_BITS);
+    auto it = std::upper_bound(
+            bounds_.begin() + prefix_[k], bounds_.begin() + prefix_[k + 1], space);
+    if (it == bounds_.begin())
+        // Below the first boundary, so we're in the range that wraps around from the top
+        return owner_.back();
+    return owner_[std::distance(bounds_.begin(), it) - 1];
+}
+
+namespace {
+
+    // Collects the service nodes of a swarm update as they are parsed.
+    struct swarm_update_builder {
+        block_update& bu;
+        // map (not unordered_map) because we need the eventual swarm list to be sorted
+        std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
+        int missing_aux_pks = 0, total = 0;
+
+        // Keys are hex in json responses, and raw bytes in bt-encoded ones.
+        template <typename Key>
+        static Key load_key(std::string_view key) {
+            return key.size() == sizeof(Key) ? Key::from_bytes(key) : Key::from_hex(key);
+        }
+
+        // Counts a funded node, and returns true if it has its ed25519 and x25519 pubkeys (and so
+        // should be added).
+        bool has_keys(
+                std::string_view pk, std::string_view pk_ed25519, std::string_view pk_x25519) {
+            total++;
+            if (pk_x25519.empty() || pk_ed25519.empty()) {
+                // These will always either both be present or neither present.  If they are
+                // missing there isn't much we can do: it means the remote hasn't transmitted
+                // them yet (or our local oxend hasn't received them yet).
+                missing_aux_pks++;
+                log::debug(
+                        logcat,
+                        "ed25519/x25519 pubkeys are missing from service node info {}",
+                        logging::lazy([pk] { return load_key<crypto::legacy_pubkey>(pk).hex(); }));
+                return false;
+            }
+            return true;
+        }
+
+        void add(std::string_view pk,
+                 std::string_view pk_ed25519,
+                 std::string_view pk_x25519,
+                 std::string_view ip,
+                 uint16_t port,
+                 uint16_t omq_port,
+                 swarm_id_t swarm_id) {
+            auto sn = sn_record{
+                    std::string{ip},
+                    port,
+                    omq_port,
+                    load_key<crypto::legacy_pubkey>(pk),
+                    load_key<crypto::ed25519_pubkey>(pk_ed25519),
+                    load_key<crypto::x25519_pubkey>(pk_x25519)};
+
+            /// Storing decommissioned nodes (with dummy swarm id) in
+            /// a separate data structure as it seems less error prone
+            if (swarm_id == INVALID_SWARM_ID) {
+                bu.decommissioned_nodes.push_back(std::move(sn));
+            } else {
+                bu.active_x25519_pubkeys.emplace(sn.pubkey_x25519.view());
+
+                swarm_map[swarm_id].push_back(std::move(sn));
+            }
+        }
+
+        void finish() {
+            if (missing_aux_pks >
+                MISSING_PUBKEY_THRESHOLD::num * total / MISSING_PUBKEY_THRESHOLD::den) {
+                log::warning(
+                        logcat,
+                        "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
+                        "oxend may be out of sync with the network",
+                        missing_aux_pks,
+                        total);
+            }
+
+            for (auto& [swarm_id, snodes] : swarm_map)
+                bu.swarms.push_back(SwarmInfo{swarm_id, std::move(snodes)});
+        }
+    };
+
+    template <typename T>
+    T get_or(const nlohmann::json& j, std::string_view key, std::common_type_t<T> default_val) {
+        if (auto it = j.find(key); it != j.end())
+            return it->get<T>();
+        return default_val;
+    }
+
+    void parse_swarm_update_json(std::string_view response, block_update& bu) {
+        auto result = nlohmann::json::parse(response, nullptr, true);
+
+        bu.height = result.at("height").get<uint64_t>();
+        bu.block_hash = result.at("block_hash").get<std::string>();
+        bu.hardfork = result.at("hardfork").get<int>();
+        bu.snode_revision = get_or<int>(result, "snode_revision", 0);
+        bu.unchanged = get_or<bool>(result, "unchanged", false);
+        if (bu.unchanged)
+            return;
+
+        swarm_update_builder nodes{bu};
+        for (const auto& sn_json : result.at("service_node_states")) {
+            /// We want to include (test) decommissioned nodes, but not
+            /// partially funded ones.
+            if (!sn_json.at("funded").get<bool>())
+                continue;
+            const auto& pk = sn_json.at("service_node_pubkey").get_ref<const std::string&>();
+            const auto pk_ed25519 = sn_json.value<std::string>("pubkey_ed25519", "");
+            const auto pk_x25519 = sn_json.value<std::string>("pubkey_x25519", "");
+            if (!nodes.has_keys(pk, pk_ed25519, pk_x25519))
+                continue;
+            nodes.add(
+                    pk,
+                    pk_ed25519,
+                    pk_x25519,
+                    sn_json.at("public_ip").get_ref<const std::string&>(),
+                    sn_json.at("storage_port").get<uint16_t>(),
+                    sn_json.at("storage_lmq_port").get<uint16_t>(),
+                    sn_json.at("swarm_id").get<swarm_id_t>());
+        }
+        nodes.finish();
+    }
+
+    template <typename Int>
+    Int require_int(oxenc::bt_dict_consumer& d, std::string_view key) {
+        if (!d.skip_until(key))
+            throw std::runtime_error{"missing " + std::string{key}};
+        return d.consume_integer<Int>();
+    }
+
+    void parse_swarm_update_bt(
+            std::string_view response,
+            block_update& bu,
+            const std::optional<sn_states_digest>& applied) {
+        // Dict keys come in sorted order, so we have to consume them in that order:
+        oxenc::bt_dict_consumer result{response};
+
+        auto hash = result.require<std::string_view>("block_hash");
+        bu.block_hash = hash.size() == 32 ? oxenc::to_hex(hash) : std::string{hash};
+        bu.hardfork = require_int<int>(result, "hardfork");
+        bu.height = require_int<uint64_t>(result, "height");
+        std::optional<std::string_view> states;
+        if (result.skip_until("service_node_states"))
+            states = result.consume_list_data();
+        bu.snode_revision =
+                result.skip_until("snode_revision") ? result.consume_integer<int>() : 0;
+        bu.unchanged = result.skip_until("unchanged") && result.consume_integer<bool>();
+        if (bu.unchanged)
+            return;
+        if (!states)
+            throw std::runtime_error{"missing service_node_states"};
+
+        auto& digest = bu.states_digest.emplace();
+        crypto_generichash(
+                digest.data(),
+                digest.size(),
+                reinterpret_cast<const unsigned char*>(states->data()),
+                states->size(),
+                nullptr,
+                0);
+        if (applied && *applied == digest) {
+            bu.states_unchanged = true;
+            return;
+        }
+
+        swarm_update_builder nodes{bu};
+        oxenc::bt_list_consumer list{*states};
+        while (!list.is_finished()) {
+            auto sn = list.consume_dict_consumer();
+            if (!require_int<bool>(sn, "funded"))
+                continue;
+            std::string_view pk_ed25519, pk_x25519;
+            if (sn.skip_until("pubkey_ed25519"))
+                pk_ed25519 = sn.consume_string_view();
+            if (sn.skip_until("pubkey_x25519"))
+                pk_x25519 = sn.consume_string_view();
+            auto ip = sn.require<std::string_view>("public_ip");
+            auto pk = sn.require<std::string_view>("service_node_pubkey");
+            if (!nodes.has_keys(pk, pk_ed25519, pk_x25519))
+                continue;
+            auto omq_port = require_int<uint16_t>(sn, "storage_lmq_port");
+            auto port = require_int<uint16_t>(sn, "storage_port");
+            auto swarm_id = require_int<swarm_id_t>(sn, "swarm_id");
+            nodes.add(pk, pk_ed25519, pk_x25519, ip, port, omq_port, swarm_id);
+        }
+        nodes.finish();
+    }
+
+}  // namespace
+
+block_update parse_swarm_update(
+        std::string_view response, const std::optional<sn_states_digest>& applied) {
+    if (response.empty()) {
+        log::critical(logcat, "Bad oxend rpc response: no response body");
+        throw std::runtime_error("Failed to parse swarm update");
+    }
+
+    block_update bu;
+    const bool bt = response.front() == 'd';
+    try {
+        if (bt)
+            parse_swarm_update_bt(response, bu, applied);
+        else {
+            log::trace(logcat, "swarm response: <{}>", response);
+            parse_swarm_update_json(response, bu);
+        }
+    } catch (const std::exception& e) {
+        log::critical(
+                logcat,
+                "Bad oxend rpc response: invalid {} ({})",
+                bt ? "bt-encoded data" : "json",
+                e.what());
+        throw std::runtime_error("Failed to parse swarm update");
+    }
+    return bu;
+}
+
 std::pair<int, int> count_missing_data(const block_update& bu) {
     auto result = std::make_pair(0, 0);
     auto& [missing, total] = result;
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <array>
 #include <iostream>
 #include <oxenmq/auth.h>
 #include <limits>
+#include <optional>
+#include <ratio>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -25,6 +29,10 @@ struct SwarmInfo {
     bool operator<(const SwarmInfo& other) const { return swarm_id < other.swarm_id; }
 };
 
+// Digest of the service node list of a bt-encoded get_service_nodes response, used to recognize
+// block updates that don't change anything but the block.
+using sn_states_digest = std::array<unsigned char, 32>;
+
 struct block_update {
     std::vector<SwarmInfo> swarms;
     std::vector<sn_record> decommissioned_nodes;
@@ -34,8 +42,27 @@ struct block_update {
     int hardfork;
     int snode_revision;
     bool unchanged = false;
+    // The digest of the service node list, if the update was bt-encoded.
+    std::optional<sn_states_digest> states_digest;
+    // Set when the service node list matched the `applied` digest given to parse_swarm_update(),
+    // in which case it wasn't parsed: `swarms`, `decommissioned_nodes`, and
+    // `active_x25519_pubkeys` are left empty.
+    bool states_unchanged = false;
 };
 
+// Threshold of missing data records at which we start warning and consult bootstrap nodes
+// (mainly so that we don't bother producing warning spam or going to the bootstrap just for a
+// few new nodes that will often have missing info for a few minutes).
+using MISSING_PUBKEY_THRESHOLD = std::ratio<3, 100>;
+
+// Parses a rpc.get_service_nodes response, which can be either json or bt-encoded (in which case
+// the keys are raw bytes rather than hex).  A bt-encoded response is parsed as it is read, without
+// building a document of it first; and if `applied` is given and matches the digest of the
+// response's service node list then the list isn't parsed at all (see
+// `block_update::states_unchanged`).  Throws std::runtime_error if the response is malformed.
+block_update parse_swarm_update(
+        std::string_view response, const std::optional<sn_states_digest>& applied = std::nullopt);
+
 // Returns a pointer to the SwarmInfo member of `all_swarms` for the given user pub.  Returns a
 // nullptr on error (which will only happen if there are no swarms at all).  `all_swarms` must be
 // sorted by swarm id.
@@ -56,9 +83,46 @@ std::pair<int, int> count_missing_data(const block_update& bu);
 /// `old_swarms`.
 void preserve_ips(std::vector<SwarmInfo>& new_swarms, const std::vector<SwarmInfo>& old_swarms);
 
-/// Maps a pubkey into a 64-bit "swarm space" value; the swarm you belong to is whichever one
-/// has a swarm id closest to this pubkey-derived value.
-uint64_t pubkey_to_swarm_space(const user_pubkey& pk);
+using oxenss::pubkey_to_swarm_space;
+
+/// Returns the [begin, end) range of swarm space values that map to the swarm at index `idx` of
+/// `all_swarms` (which must be sorted by swarm id), i.e. the values for which get_swarm_by_pk would
+/// select that swarm.  The range wraps around if end <= begin; when there is only one swarm the
+/// returned range is {0, 0}, i.e. the entire swarm space.
+std::pair<uint64_t, uint64_t> swarm_space_range(
+        const std::vector<SwarmInfo>& all_swarms, size_t idx);
+
+/// Precomputed lookup table equivalent to get_swarm_by_pk (which it mirrors exactly), built once
+/// per swarm update so that the per-request lookups don't have to search through the (large)
+/// SwarmInfo elements and redo the distance arithmetic each time.  It stores the first swarm space
+/// value owned by each swarm (i.e. the midpoints between adjacent swarm ids, as in
+/// swarm_space_range) as a flat, sorted array, plus a table indexed by the top PREFIX_BITS bits of
+/// the swarm space value giving the range of that array to search: with a few thousand swarms
+/// this range typically holds at most one or two boundaries, so a lookup touches one or two cache
+/// lines rather than binary searching the whole swarm list.
+class swarm_lookup {
+  public:
+    static constexpr int PREFIX_BITS = 12;
+
+    swarm_lookup() = default;
+
+    /// Builds the lookup for `all_swarms`, which must be sorted by swarm id.
+    explicit swarm_lookup(const std::vector<SwarmInfo>& all_swarms);
+
+    /// Returns the index (into the `all_swarms` given at construction) of the swarm that owns
+    /// swarm space value `space`.  Must not be called when built from an empty swarm list.
+    size_t index(uint64_t space) const;
+
+    bool empty() const { return swarms_ == 0; }
+
+  private:
+    size_t swarms_ = 0;
+    // Sorted first-owned swarm space values, and the swarm index owning each one:
+    std::vector<uint64_t> bounds_;
+    std::vector<uint32_t> owner_;
+    // prefix_[k] is the number of bounds_ elements less than k << (64 - PREFIX_BITS):
+    std::vector<uint32_t> prefix_;
+};
 
 struct SwarmEvents {
     /// our (potentially new) swarm id
@@ -79,6 +143,8 @@ class Swarm {
     swarm_id_t cur_swarm_id_ = INVALID_SWARM_ID;
     /// Note: this excludes the "dummy" swarm
     std::vector<SwarmInfo> all_valid_swarms_;
+    /// Lookup table for `all_valid_swarms_`, rebuilt whenever it changes
+    swarm_lookup lookup_;
     sn_record our_address_;
     std::vector<sn_record> swarm_peers_;
     /// This includes decommissioned nodes
@@ -109,6 +175,10 @@ class Swarm {
 
     bool is_pubkey_for_us(const user_pubkey& pk) const;
 
+    /// Returns the swarm that `pk` belongs to, or nullptr if there are no swarms at all.  This is
+    /// the same as get_swarm_by_pk(all_valid_swarms(), pk), but faster.
+    const SwarmInfo* get_swarm(const user_pubkey& pk) const;
+
     const std::vector<sn_record>& other_nodes() const { return swarm_peers_; }
 
     const std::vector<SwarmInfo>& all_valid_swarms() const { return all_valid_swarms_; }
@@ -117,6 +187,10 @@ class Swarm {
 
     swarm_id_t our_swarm_id() const { return cur_swarm_id_; }
 
+    /// Returns the swarm space range (see swarm_space_range) owned by our swarm, or nullopt if we
+    /// are not in a swarm.
+    std::optional<std::pair<uint64_t, uint64_t>> our_swarm_space_range() const;
+
     bool is_valid() const { return cur_swarm_id_ != INVALID_SWARM_ID; }
 
     void set_swarm_id(swarm_id_t sid);
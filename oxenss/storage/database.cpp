@@ -4,16 +4,19 @@
 #include <SQLiteCpp/Statement.h>
 #include <SQLiteCpp/Transaction.h>
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/random.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/common/format.h>
+#include <oxenc/base64.h>
 #include <oxenc/hex.h>
 
+#include <algorithm>
 #include <array>
 #include <chrono>
 #include <cstdlib>
 #include <exception>
-#include <shared_mutex>
+#include <limits>
 #include <thread>
 #include <type_traits>
 #include <unordered_set>
@@ -60,10 +63,14 @@ namespace {
     // strings (and c strings) use no-copy binding; user_pubkey values use *two* sequential
     // binding slots for pubkey (first) and type (second); integer values are bound by value.
     // You can bind a blob (by reference, like strings) by passing `blob_binder{data}`.
+    // string_views are copied (SQLiteCpp has no no-copy binding of sized text), so should only be
+    // used for short values such as hashes.
     template <typename T>
     void bind_oneshot(SQLite::Statement& st, int& i, const T& val) {
         if constexpr (std::is_same_v<T, std::string> || is_cstr<T>)
             st.bindNoCopy(i++, val);
+        else if constexpr (std::is_same_v<T, std::string_view>)
+            st.bind(i++, std::string{val});
         else if constexpr (std::is_same_v<T, blob_binder>)
             bind_blob_ref(st, i++, val.data);
         else if constexpr (std::is_same_v<T, user_pubkey>) {
@@ -83,13 +90,64 @@ namespace {
         st.bind(j, pk.type());
     }
 
+    // Swarm space values are unsigned 64-bit integers, but sqlite integers are signed, so we store
+    // them with the top bit flipped: that maps the unsigned range onto the signed range while
+    // preserving order, which lets us use ordinary (indexed) range comparisons on the column.
+    int64_t swarm_space_key(uint64_t swarm_space) {
+        return static_cast<int64_t>(swarm_space ^ (uint64_t{1} << 63));
+    }
+
+    // Converts a (possibly wrapping) [begin, end) swarm space range into one or two inclusive
+    // [lo, hi] ranges of swarm_space column values.
+    std::vector<std::pair<int64_t, int64_t>> swarm_space_key_ranges(uint64_t begin, uint64_t end) {
+        std::vector<std::pair<int64_t, int64_t>> ranges;
+        if (begin < end)
+            ranges.emplace_back(swarm_space_key(begin), swarm_space_key(end - 1));
+        else {
+            ranges.emplace_back(
+                    swarm_space_key(begin),
+                    swarm_space_key(std::numeric_limits<uint64_t>::max()));
+            if (end > 0)
+                ranges.emplace_back(swarm_space_key(0), swarm_space_key(end - 1));
+        }
+        return ranges;
+    }
+
+    // The prepared statements in use (i.e. with a live StatementWrapper) on this thread, and the
+    // rows returned or changed by each so far, for the per-statement stats.  This is almost always
+    // just one or two statements.
+    struct statement_rows {
+        const SQLite::Statement* st;
+        int64_t rows;
+    };
+    thread_local std::vector<statement_rows> active_statements;
+
+    void count_rows(const SQLite::Statement& st, int64_t rows) {
+        for (auto it = active_statements.rbegin(); it != active_statements.rend(); ++it) {
+            if (it->st == &st) {
+                it->rows += rows;
+                return;
+            }
+        }
+    }
+
+    // Wrapper around st.executeStep() that counts returned rows.
+    bool step(SQLite::Statement& st) {
+        if (!st.executeStep())
+            return false;
+        count_rows(st, 1);
+        return true;
+    }
+
     // Executes a query that does not expect results.  Optionally binds parameters, if provided.
     // Returns the number of affected rows; throws on error or if results are returned.
     template <typename... T>
     int exec_query(SQLite::Statement& st, const T&... bind) {
         [[maybe_unused]] int i = 1;
         (bind_oneshot(st, i, bind), ...);
-        return st.exec();
+        int changed = st.exec();
+        count_rows(st, changed);
+        return changed;
     }
 
     // Same as above, but prepares a literal query on the fly for use with queries that are only
@@ -177,7 +235,7 @@ namespace {
         [[maybe_unused]] int i = 1;
         (bind_oneshot(st, i, bind), ...);
         std::optional<type_or_tuple<T...>> result;
-        while (st.executeStep()) {
+        while (step(st)) {
             if (result) {
                 log::error(
                         logcat,
@@ -212,7 +270,7 @@ namespace {
         [[maybe_unused]] int i = 1;
         (bind_oneshot(st, i, bind), ...);
         std::vector<type_or_tuple<T...>> results;
-        while (st.executeStep())
+        while (step(st))
             results.push_back(get<T...>(st));
         return results;
     }
@@ -223,11 +281,102 @@ namespace {
         [[maybe_unused]] int i = 1;
         (bind_oneshot(st, i, bind), ...);
         std::map<K, V> results;
-        while (st.executeStep())
+        while (step(st))
             results[static_cast<K>(st.getColumn(0))] = static_cast<V>(st.getColumn(1));
         return results;
     }
 
+    // Compile-time query text, usable as a template argument; see `_sql` below.
+    template <size_t N>
+    struct fixed_query {
+        char sql[N];
+        constexpr fixed_query(const char (&q)[N]) { std::copy_n(q, N, sql); }
+    };
+
+    size_t next_query_slot() {
+        static std::atomic<size_t> next{0};
+        return next++;
+    }
+
+    // One unique slot index per distinct fixed query text, assigned at startup.
+    template <fixed_query Q>
+    inline const size_t query_slot = next_query_slot();
+
+    // A query registered via `_sql`: the query text and its statement slot.
+    struct registered_query {
+        const char* sql;
+        size_t slot;
+    };
+
+    // `"SELECT ..."_sql` registers a fixed query: each distinct query gets a permanent slot in
+    // every connection's prepared statement table, so that looking up its prepared statement is
+    // just an array index rather than constructing, hashing, and comparing a std::string of the
+    // whole query.  Queries with runtime-built text still use the string-keyed `prepared_st`.
+    template <fixed_query Q>
+    registered_query operator""_sql() {
+        return {Q.sql, query_slot<Q>};
+    }
+
+    // The statements that (nearly) every store or retrieve runs.  New connections prepare these
+    // up front (see DatabaseImpl::prepare_hot_statements) rather than on their first request.
+    registered_query owner_id_sql() {
+        return "SELECT id FROM owners WHERE pubkey = ? AND type = ?"_sql;
+    }
+
+    // Returns the id of an owner, inserting the owners row if it doesn't exist yet.  (The update
+    // is a no-op, since swarm_space is derived from the pubkey, but unlike DO NOTHING it makes
+    // the statement return the id of an existing row).
+    registered_query upsert_owner_sql() {
+        return "INSERT INTO owners (pubkey, type, swarm_space) VALUES (?, ?, ?)"
+               " ON CONFLICT(pubkey, type) DO UPDATE SET swarm_space = excluded.swarm_space"
+               " RETURNING id"_sql;
+    }
+
+    // Looks up the id and expiry of a message by hash.  In partitioned mode this has to look at
+    // hidden (expired) messages too: hashes are unique across all of the partition tables.
+    registered_query existing_message_sql(bool partitioned) {
+        return partitioned ? "SELECT id, expiry FROM messages_all WHERE hash = hash_to_db(?)"_sql
+                           : "SELECT id, expiry FROM messages WHERE hash = hash_to_db(?)"_sql;
+    }
+
+    // Sums the message sizes of an owner's namespace, other than the given hash: that is, what a
+    // store to a public outbox namespace frees up.  In partitioned mode this includes hidden
+    // (expired) messages, since the store's delete removes those too.
+    registered_query replaced_bytes_sql(bool partitioned) {
+        return partitioned ? "SELECT COALESCE(SUM(length(data)), 0) FROM messages_all"
+                             " WHERE owner = ? AND namespace = ? AND hash != hash_to_db(?)"_sql
+                           : "SELECT COALESCE(SUM(length(data)), 0) FROM messages"
+                             " WHERE owner = ? AND namespace = ? AND hash != hash_to_db(?)"_sql;
+    }
+
+    // Inserts a message or, if the hash is already stored, extends its expiry if the new one is
+    // later; returns the id and (new) expiry, or nothing if the message already existed with at
+    // least that expiry.  Not used in partitioned mode, where `messages` is a view.
+    registered_query upsert_message_sql() {
+        return "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
+               " VALUES (?, hash_to_db(?), ?, ?, ?, ?)"
+               " ON CONFLICT(hash) DO UPDATE SET expiry = excluded.expiry"
+               " WHERE excluded.expiry > expiry"
+               " RETURNING id, expiry"_sql;
+    }
+
+    // Looks up the id of a retrieve's `last_hash` message.
+    registered_query last_id_sql() {
+        return "SELECT id FROM messages"
+               " WHERE owner = ? AND namespace = ? AND hash = hash_to_db(?)"_sql;
+    }
+
+    // Retrieves (up to a limit) the messages of an owner's namespace, optionally only those after
+    // a given message id.
+    registered_query retrieve_sql(bool after_id) {
+        return after_id ? "SELECT hash_from_db(hash), namespace, timestamp, expiry, data"
+                          " FROM messages WHERE owner = ? AND namespace = ? AND id > ?"
+                          " ORDER BY id LIMIT ?"_sql
+                        : "SELECT hash_from_db(hash), namespace, timestamp, expiry, data"
+                          " FROM messages WHERE owner = ? AND namespace = ?"
+                          " ORDER BY id LIMIT ?"_sql;
+    }
+
 }  // namespace
 
 class DatabaseImpl {
@@ -235,58 +384,262 @@ class DatabaseImpl {
     oxenss::Database& parent;
     SQLite::Database db;
 
-    std::unordered_map<std::string, SQLite::Statement> prepared_sts;
+    struct keyed_statement {
+        SQLite::Statement st;
+        Database::query_counters* stats;
+        keyed_statement(SQLite::Database& db, const std::string& query, Database& parent) :
+                st{db, query}, stats{parent.query_counters_for(query)} {}
+    };
+    std::unordered_map<std::string, keyed_statement> prepared_sts;
+    std::vector<std::unique_ptr<SQLite::Statement>> registered_sts;
 
     int page_size;
 
-    DatabaseImpl(Database& parent, const std::filesystem::path& db_path, bool initialize) :
+    // `initialize` is true for a Database's first connection, which creates or upgrades the
+    // database; the rest of the connections skip that, and the checks that only need doing once.
+    DatabaseImpl(Database& parent, const std::filesystem::path& db_file, bool initialize) :
             parent{parent},
-            db{db_path / u8"storage.db",
+            db{db_file,
                SQLite::OPEN_READWRITE | (initialize ? SQLite::OPEN_CREATE : 0) |
                        SQLite::OPEN_NOMUTEX,
                SQLite_busy_timeout.count()} {
-        // Don't fail on these because we can still work even if they fail
-        if (int rc = db.tryExec("PRAGMA journal_mode = WAL"); rc != SQLITE_OK)
-            log::error(logcat, "Failed to set journal mode to WAL: {}", sqlite3_errstr(rc));
+        // Don't fail on these because we can still work even if they fail.
+        //
+        // auto_vacuum has to come before anything else touches a new database file, and has no
+        // effect on an existing database (which would need a full VACUUM to convert).  It lets
+        // Database::run_maintenance release free pages to the filesystem a few at a time.
+        if (initialize) {
+            if (int rc = db.tryExec("PRAGMA auto_vacuum = INCREMENTAL"); rc != SQLITE_OK)
+                log::error(logcat, "Failed to set auto vacuum mode: {}", sqlite3_errstr(rc));
+        }
+
+        // WAL mode is a persistent property of the database file, so only the first connection
+        // has to set it.
+        if (initialize)
+            if (int rc = db.tryExec("PRAGMA journal_mode = WAL"); rc != SQLITE_OK)
+                log::error(logcat, "Failed to set journal mode to WAL: {}", sqlite3_errstr(rc));
 
         if (int rc = db.tryExec("PRAGMA synchronous = NORMAL"); rc != SQLITE_OK)
             log::error(logcat, "Failed to set synchronous mode to NORMAL: {}", sqlite3_errstr(rc));
 
+        // Checkpointing is normally done by Database::run_maintenance; this is just a backstop.
+        if (int rc = db.tryExec(
+                    "PRAGMA wal_autocheckpoint = {}"_format(Database::WAL_AUTOCHECKPOINT_PAGES));
+            rc != SQLITE_OK)
+            log::error(logcat, "Failed to set WAL autocheckpoint: {}", sqlite3_errstr(rc));
+
         if (int rc = db.tryExec("PRAGMA foreign_keys = ON"); rc != SQLITE_OK) {
             auto m = fmt::format(
                     "Failed to enable foreign keys constraints: {}", sqlite3_errstr(rc));
             log::critical(logcat, "{}", m);
             throw std::runtime_error{m};
         }
-        int fk_enabled = db.execAndGet("PRAGMA foreign_keys").getInt();
-        if (fk_enabled != 1) {
-            log::critical(
-                    logcat,
-                    "Failed to enable foreign key constraints; perhaps this sqlite3 is "
-                    "compiled without it?");
-            throw std::runtime_error{"Foreign key support is required"};
+        if (initialize) {
+            int fk_enabled = db.execAndGet("PRAGMA foreign_keys").getInt();
+            if (fk_enabled != 1) {
+                log::critical(
+                        logcat,
+                        "Failed to enable foreign key constraints; perhaps this sqlite3 is "
+                        "compiled without it?");
+                throw std::runtime_error{"Foreign key support is required"};
+            }
+            parent.page_size_ = db.execAndGet("PRAGMA page_size").getInt();
         }
-
-        page_size = db.execAndGet("PRAGMA page_size").getInt();
+        page_size = parent.page_size_;
         // Would use a placeholder here, but sqlite3 apparently doesn't support them for
         // PRAGMAs.
         if (int rc = db.tryExec(
-                    "PRAGMA max_page_count = {}"_format(Database::SIZE_LIMIT / page_size));
+                    "PRAGMA max_page_count = {}"_format(parent.size_limit_ / page_size));
             rc != SQLITE_OK) {
             auto m = fmt::format("Failed to set max page count: {}", sqlite3_errstr(rc));
             log::critical(logcat, "{}", m);
             throw std::runtime_error{m};
         }
 
+        // A negative cache_size is in KiB, rather than pages.
+        if (parent.cache_size_ > 0) {
+            auto kib = std::max<int64_t>(parent.cache_size_ / 1024, 1);
+            if (int rc = db.tryExec("PRAGMA cache_size = -{}"_format(kib)); rc != SQLITE_OK)
+                log::error(logcat, "Failed to set page cache size: {}", sqlite3_errstr(rc));
+        }
+
+        if (parent.mmap_size_ > 0)
+            if (int rc = db.tryExec("PRAGMA mmap_size = {}"_format(parent.mmap_size_));
+                rc != SQLITE_OK)
+                log::error(logcat, "Failed to set memory map size: {}", sqlite3_errstr(rc));
+
+        for (auto [name, func] : {std::pair{"hash_to_db", &DatabaseImpl::hash_to_db},
+                                  std::pair{"hash_from_db", &DatabaseImpl::hash_from_db}}) {
+            if (int rc = sqlite3_create_function_v2(
+                        db.getHandle(),
+                        name,
+                        1,
+                        SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                        nullptr,
+                        func,
+                        nullptr,
+                        nullptr,
+                        nullptr);
+                rc != SQLITE_OK) {
+                auto m = fmt::format("Failed to register {}(): {}", name, sqlite3_errstr(rc));
+                log::critical(logcat, "{}", m);
+                throw std::runtime_error{m};
+            }
+        }
+
+        // Drop owner id cache entries whenever an owner row goes away (typically via the
+        // owner_autoclean trigger when its last message is deleted).
+        sqlite3_update_hook(db.getHandle(), &DatabaseImpl::update_hook, this);
+        sqlite3_commit_hook(db.getHandle(), &DatabaseImpl::commit_hook, this);
+        sqlite3_rollback_hook(db.getHandle(), &DatabaseImpl::rollback_hook, this);
+
         if (initialize)
             initialize_database();
+        else
+            prepare_hot_statements();
+    }
+
+    // Prepares the statements of the most common requests (see `owner_id_sql` and friends), so
+    // that the first requests to use this connection don't have to.
+    void prepare_hot_statements() {
+        std::vector<registered_query> hot{
+                owner_id_sql(),
+                upsert_owner_sql(),
+                existing_message_sql(partitioned()),
+                last_id_sql(),
+                retrieve_sql(false),
+                retrieve_sql(true)};
+        if (!partitioned())
+            hot.push_back(upsert_message_sql());
+        for (const auto& q : hot)
+            registered_st(q);
+    }
+
+    // Owner ids deleted by the current transaction on this connection, and ones deleted by
+    // transactions that have committed since the connection was checked out.
+    std::vector<int64_t> owners_deleted;
+    std::vector<int64_t> owners_deleted_committed;
+
+    // Owner ids looked up (or inserted) inside the current write transaction on this connection,
+    // and ones from transactions that have committed since the connection was checked out, with
+    // the cache generation of each lookup.  These only go into the owner cache once the
+    // transaction has committed (see ~LockedDBImpl): if it gets rolled back, the rows might never
+    // have existed, or their ids might get reused.
+    struct owner_cache_entry {
+        prefixed_pubkey pubkey;
+        int64_t id;
+        uint64_t generation;
+    };
+    std::vector<owner_cache_entry> owners_cached;
+    std::vector<owner_cache_entry> owners_cached_committed;
+
+    // Caches an owner id: right away, unless there's a write transaction in progress on this
+    // connection, in which case it waits for the commit.
+    void owner_cache_put(const prefixed_pubkey& pubkey, int64_t id, uint64_t generation) {
+        if (sqlite3_txn_state(db.getHandle(), nullptr) == SQLITE_TXN_WRITE)
+            owners_cached.push_back({pubkey, id, generation});
+        else
+            parent.owner_cache_put(pubkey, id, generation);
+    }
+
+    static void update_hook(
+            void* self, int op, const char* /*db*/, const char* table, sqlite3_int64 rowid) {
+        if (op == SQLITE_DELETE && std::string_view{table} == "owners"sv) {
+            auto& impl = *static_cast<DatabaseImpl*>(self);
+            impl.parent.owner_cache_erase(rowid);
+            impl.owners_deleted.push_back(rowid);
+        }
+    }
+
+    // This gets called *before* the commit is visible to other connections, so concurrent readers
+    // can still look up (and cache) the deleted ids until it is; the ids get erased again once the
+    // connection is returned (see ~LockedDBImpl), by which point the commit has completed.
+    static int commit_hook(void* self) {
+        auto& impl = *static_cast<DatabaseImpl*>(self);
+        impl.owners_deleted_committed.insert(
+                impl.owners_deleted_committed.end(),
+                impl.owners_deleted.begin(),
+                impl.owners_deleted.end());
+        impl.owners_deleted.clear();
+        impl.owners_cached_committed.insert(
+                impl.owners_cached_committed.end(),
+                std::make_move_iterator(impl.owners_cached.begin()),
+                std::make_move_iterator(impl.owners_cached.end()));
+        impl.owners_cached.clear();
+        return 0;
+    }
+
+    // Also drops the ids of earlier committed transactions still waiting to be cached, in case the
+    // rollback is of a commit that failed after commit_hook was called; that just costs us a few
+    // cache misses.
+    static void rollback_hook(void* self) {
+        auto& impl = *static_cast<DatabaseImpl*>(self);
+        impl.owners_deleted.clear();
+        impl.owners_cached.clear();
+        impl.owners_cached_committed.clear();
+    }
+
+    // Message hashes are (almost always) the unpadded base64 encoding of a 32-byte hash; rather
+    // than storing the 43-character encoding we store the raw 32 bytes as a blob, which makes the
+    // messages table and (especially) its hash index smaller.  These SQL functions do the
+    // conversion in queries: `hash_to_db(?)` wherever a hash is bound, and `hash_from_db(hash)`
+    // wherever one is returned.  Anything that isn't a canonical base64-encoded 32-byte value
+    // (e.g. from very old messages) is stored as-is, and both functions pass it through unchanged.
+    static void hash_to_db(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+        auto* val = argv[0];
+        if (sqlite3_value_type(val) == SQLITE_TEXT) {
+            auto* text = reinterpret_cast<const char*>(sqlite3_value_text(val));
+            std::string_view b64{text, static_cast<size_t>(sqlite3_value_bytes(val))};
+            if (b64.size() == 43 && oxenc::is_base64(b64)) {
+                std::array<char, 32> raw;
+                oxenc::from_base64(b64.begin(), b64.end(), raw.begin());
+                // Make sure it re-encodes identically (it might not if it uses url-safe base64 or
+                // has garbage in the unused low bits of the last character):
+                std::array<char, 44> check;
+                oxenc::to_base64(raw.begin(), raw.end(), check.begin());
+                if (std::string_view{check.data(), 43} == b64) {
+                    sqlite3_result_blob(ctx, raw.data(), 32, SQLITE_TRANSIENT);
+                    return;
+                }
+            }
+        }
+        sqlite3_result_value(ctx, val);
+    }
+
+    static void hash_from_db(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+        auto* val = argv[0];
+        if (sqlite3_value_type(val) == SQLITE_BLOB && sqlite3_value_bytes(val) == 32) {
+            auto* raw = static_cast<const unsigned char*>(sqlite3_value_blob(val));
+            std::array<char, 44> b64;
+            oxenc::to_base64(raw, raw + 32, b64.begin());
+            sqlite3_result_text(ctx, b64.data(), 43, SQLITE_TRANSIENT);
+            return;
+        }
+        sqlite3_result_value(ctx, val);
     }
 
+    // The `PRAGMA user_version` value of a database that stores message hashes as blobs (see
+    // hash_to_db).  Older databases have hashes stored as text and get converted on startup.
+    static constexpr int SCHEMA_BLOB_HASHES = 1;
+
     void initialize_database() {
         if (!db.tableExists("owners")) {
             create_schema();
         }
 
+        add_owner_bytes();
+
+        if (db.tableExists("message_partition_config")) {
+            SQLite::Statement config{
+                    db, "SELECT expiry_window_ms, parts FROM message_partition_config"};
+            auto [window, parts] = exec_and_get<int64_t, int>(config);
+            if (window == parent.expiry_partition_ms_ && parts == parent.expiry_partitions_) {
+                log::info(logcat, "Database setup complete");
+                return;
+            }
+            unpartition(parts);
+        }
+
         bool have_namespace = false;
         SQLite::Statement msg_cols{db, "PRAGMA main.table_info(messages)"};
         while (msg_cols.executeStep()) {
@@ -304,6 +657,20 @@ ALTER TABLE messages ADD COLUMN namespace INTEGER NOT NULL DEFAULT 0;
             )");
         }
 
+        bool have_swarm_space = false;
+        SQLite::Statement owner_cols{db, "PRAGMA main.table_info(owners)"};
+        while (owner_cols.executeStep()) {
+            auto [cid, name] = get<int64_t, std::string>(owner_cols);
+            if (name == "swarm_space")
+                have_swarm_space = true;
+        }
+
+        if (!have_swarm_space) {
+            log::info(logcat, "Upgrading database schema: adding owner swarm_space column");
+            db.exec("ALTER TABLE owners ADD COLUMN swarm_space INTEGER");
+        }
+        populate_swarm_space();
+
         if (db.tableExists("revoked_subkeys")) {
             log::info(logcat, "Upgrading database schema: dropping revoked_subkeys");
             db.exec("DROP TABLE revoked_subkeys");
@@ -331,27 +698,316 @@ CREATE TRIGGER IF NOT EXISTS revoked_autoclean
     END;
             )");
         }
+        if (!db.tableExists("message_stats")) {
+            log::info(logcat, "Upgrading database schema: adding message and owner counters");
+            SQLite::Transaction transaction{db};
+            db.exec(R"(
+CREATE TABLE message_stats (
+    namespace INTEGER PRIMARY KEY,
+    messages INTEGER NOT NULL
+);
+CREATE TABLE owner_stats (
+    id INTEGER PRIMARY KEY CHECK(id = 0),
+    owners INTEGER NOT NULL
+);
+
+INSERT INTO message_stats (namespace, messages)
+    SELECT namespace, COUNT(*) FROM messages GROUP BY namespace;
+INSERT INTO owner_stats (id, owners) SELECT 0, COUNT(*) FROM owners;
+            )");
+            transaction.commit();
+        }
+
+        if (db.execAndGet("PRAGMA user_version").getInt() < SCHEMA_BLOB_HASHES) {
+            log::info(
+                    logcat,
+                    "Upgrading database schema: converting message hashes to blobs (this may take "
+                    "a while)");
+            SQLite::Transaction transaction{db};
+            db.exec("UPDATE messages SET hash = hash_to_db(hash) WHERE typeof(hash) = 'text'");
+            db.exec("PRAGMA user_version = {}"_format(SCHEMA_BLOB_HASHES));
+            transaction.commit();
+        }
 
         views_triggers_indices();
 
+        if (parent.expiry_partitions_ > 0)
+            partition();
+
         log::info(logcat, "Database setup complete");
     }
 
-    void create_schema() {
+    // The columns of a messages table, in table order (the namespace column of databases that
+    // were upgraded from before namespaces is physically last, so we can't rely on `*`).
+    static constexpr auto MESSAGE_COLUMNS = "id, hash, owner, namespace, timestamp, expiry, data"sv;
+
+    // The current time, in unix epoch milliseconds, as an SQL expression.
+    static constexpr auto SQL_NOW_MS =
+            "CAST((julianday('now') - 2440587.5)*86400000 AS INTEGER)"sv;
+
+    // Returns the DDL of the expiry partition table `table`, including its indices.
+    static std::string partition_table_sql(const std::string& table) {
+        auto sql = messages_table_sql(table);
+        sql += "CREATE INDEX {0}_owner ON {0}(owner, namespace, timestamp);\n"_format(table);
+        // Only the overflow table needs an expiry index: ring tables get dropped as a whole.
+        if (table == "messages_overflow")
+            sql += "CREATE INDEX messages_overflow_expiry ON messages_overflow(expiry);\n";
+        return sql;
+    }
+
+    // Returns the DDL of the triggers of the expiry partition table `table`, which is the ring
+    // table `part`, or the overflow table if `part` is -1.  These do the same as the
+    // owner_autoclean and message_stats triggers of an unpartitioned messages table; ring tables
+    // additionally flag messages whose expiry gets updated to outside of the table's window, so
+    // that relocate_messages() can move them.
+    std::string partition_triggers_sql(const std::string& table, int part) const {
+        auto sql = fmt::format(
+                R"(
+CREATE TRIGGER {0}_autoclean
+    AFTER DELETE ON {0} FOR EACH ROW WHEN NOT EXISTS (SELECT * FROM messages_all WHERE owner = old.owner)
+    BEGIN
+        DELETE FROM owners WHERE id = old.owner;
+    END;
+CREATE TRIGGER {0}_stats_insert AFTER INSERT ON {0} FOR EACH ROW
+    BEGIN
+        INSERT INTO message_stats (namespace, messages) VALUES (NEW.namespace, 1)
+            ON CONFLICT(namespace) DO UPDATE SET messages = messages + 1;
+    END;
+CREATE TRIGGER {0}_stats_delete AFTER DELETE ON {0} FOR EACH ROW
+    BEGIN
+        UPDATE message_stats SET messages = messages - 1 WHERE namespace = OLD.namespace;
+    END;
+)",
+                table);
+        sql += owner_bytes_triggers_sql(table);
+        if (part >= 0)
+            sql += fmt::format(
+                    R"(
+CREATE TRIGGER {0}_relocate AFTER UPDATE OF expiry ON {0} FOR EACH ROW
+    WHEN NEW.expiry / {1} IS NOT (SELECT expiry_window FROM message_partitions WHERE part = {2})
+        OR NEW.expiry <= {3}
+    BEGIN
+        INSERT INTO message_relocations (id, part) VALUES (NEW.id, {2}) ON CONFLICT DO NOTHING;
+    END;
+)",
+                    table,
+                    parent.expiry_partition_ms_,
+                    part,
+                    SQL_NOW_MS);
+        return sql;
+    }
+
+    // Returns the DDL of the views over the expiry partition tables: `messages_all` has every
+    // message, while `messages` (which is what queries normally read from) leaves out messages in
+    // the ring tables that have expired but whose window hasn't ended yet, so that these look
+    // just as if they had been deleted.  (Expired messages in the overflow table get deleted by
+    // clean_expired() as usual, just as in an unpartitioned database).
+    std::string partition_views_sql() const {
+        std::string all = "CREATE VIEW messages_all AS\n", live = "CREATE VIEW messages AS\n";
+        for (size_t i = 0; i < parent.message_tables_.size(); i++) {
+            auto select = "{}    SELECT {} FROM {}"_format(
+                    i > 0 ? "    UNION ALL\n" : "", MESSAGE_COLUMNS, parent.message_tables_[i]);
+            all += select;
+            live += select;
+            if (i > 0)
+                live += " WHERE expiry > {}"_format(SQL_NOW_MS);
+            all += '\n';
+            live += '\n';
+        }
+        all += ";\n";
+        live += ";\n";
+        return all + live;
+    }
+
+    // Converts an unpartitioned database into the expiry partitioned layout configured in
+    // `parent` (see `database_options::expiry_partition`): the messages table gets replaced by
+    // the overflow and ring tables, and the `messages` view over them.
+    void partition() {
+        const int64_t window = parent.expiry_partition_ms_;
+        const int parts = parent.expiry_partitions_;
+        log::info(
+                logcat,
+                "Converting database to {} expiry partitions of {} (this may take a while)",
+                parts,
+                util::short_duration(std::chrono::milliseconds{window}));
         SQLite::Transaction transaction{db};
 
         db.exec(R"(
-CREATE TABLE owners (
-    id INTEGER PRIMARY KEY,
-    type INTEGER NOT NULL,
-    pubkey BLOB NOT NULL,
+DROP VIEW owned_messages;
+ALTER TABLE messages RENAME TO messages_unpartitioned;
 
-    UNIQUE(pubkey, type)
+CREATE TABLE message_partition_config (
+    id INTEGER PRIMARY KEY CHECK(id = 0),
+    expiry_window_ms INTEGER NOT NULL,
+    parts INTEGER NOT NULL
+);
+-- The expiry window (i.e. expiry / expiry_window_ms) of the messages in each ring table, or NULL
+-- if the table is empty.
+CREATE TABLE message_partitions (
+    part INTEGER PRIMARY KEY,
+    expiry_window INTEGER
+);
+-- Messages whose expiry was updated to outside of their ring table's window; see
+-- DatabaseImpl::relocate_messages.
+CREATE TABLE message_relocations (
+    id INTEGER PRIMARY KEY,
+    part INTEGER NOT NULL
 );
+        )");
+        exec_query(db, "INSERT INTO message_partition_config VALUES (0, ?, ?)", window, parts);
+        for (const auto& table : parent.message_tables_)
+            db.exec(partition_table_sql(table));
+        db.exec(partition_views_sql());
+
+        // We give each of the upcoming windows its table right away, and move the messages
+        // expiring in them over; everything else (i.e. already expired, or expiring past the end
+        // of the ring) goes to the overflow table.
+        const int64_t now_window = to_epoch_ms(std::chrono::system_clock::now()) / window;
+        for (int part = 0; part < parts; part++)
+            exec_query(db, "INSERT INTO message_partitions (part) VALUES (?)", part);
+        for (int64_t w = now_window; w < now_window + parts - 1; w++) {
+            const int part = static_cast<int>(w % parts);
+            exec_query(
+                    db,
+                    "UPDATE message_partitions SET expiry_window = ? WHERE part = ?",
+                    w,
+                    part);
+            exec_query(
+                    db,
+                    "INSERT INTO {0} ({1}) SELECT {1} FROM messages_unpartitioned"
+                    " WHERE expiry >= ? AND expiry < ?"_format(
+                            parent.message_tables_[part + 1], MESSAGE_COLUMNS)
+                            .c_str(),
+                    w * window,
+                    (w + 1) * window);
+        }
+        exec_query(
+                db,
+                "INSERT INTO messages_overflow ({0}) SELECT {0} FROM messages_unpartitioned"
+                " WHERE expiry < ? OR expiry >= ?"_format(MESSAGE_COLUMNS)
+                        .c_str(),
+                now_window * window,
+                (now_window + parts - 1) * window);
+
+        // The message_stats counts carry over as they are, so the partition table triggers (which
+        // would count the messages again) only get created now that the messages have moved.
+        db.exec("DROP TABLE messages_unpartitioned");
+        for (size_t i = 0; i < parent.message_tables_.size(); i++)
+            db.exec(partition_triggers_sql(parent.message_tables_[i], static_cast<int>(i) - 1));
+        db.exec(R"(
+CREATE VIEW owned_messages AS
+    SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, namespace, timestamp, expiry, data
+    FROM messages JOIN owners ON messages.owner = owners.id;
+        )");
+
+        transaction.commit();
+    }
+
+    // Converts an expiry partitioned database with `parts` ring tables back into a plain messages
+    // table (after which the usual indices, triggers, and views get created by
+    // views_triggers_indices(), and, if the partition configuration changed, partition() can
+    // partition it again).
+    void unpartition(int parts) {
+        log::info(
+                logcat,
+                "Converting database from expiry partitions to a single messages table (this may "
+                "take a while)");
+        SQLite::Transaction transaction{db};
+
+        db.exec("DROP VIEW owned_messages; DROP VIEW messages;");
+        db.exec(messages_table_sql("messages"));
+        db.exec("INSERT INTO messages ({0}) SELECT {0} FROM messages_all"_format(MESSAGE_COLUMNS));
+        db.exec("DROP VIEW messages_all; DROP TABLE messages_overflow;");
+        for (int part = 0; part < parts; part++)
+            db.exec("DROP TABLE messages_{}"_format(part));
+        db.exec(R"(
+DROP TABLE message_partition_config;
+DROP TABLE message_partitions;
+DROP TABLE message_relocations;
+        )");
+
+        transaction.commit();
+    }
+
+    // Fills in the swarm_space column for any owners that don't have it set (i.e. owners created
+    // before the column existed, or by the old Data table migration).
+    void populate_swarm_space() {
+        int64_t missing =
+                db.execAndGet("SELECT COUNT(*) FROM owners WHERE swarm_space IS NULL").getInt64();
+        if (missing == 0)
+            return;
+
+        log::info(logcat, "Upgrading database schema: computing swarm space for {} owners", missing);
+        SQLite::Transaction transaction{db};
+        SQLite::Statement sel{db, "SELECT id, type, pubkey FROM owners WHERE swarm_space IS NULL"};
+        SQLite::Statement upd{db, "UPDATE owners SET swarm_space = ? WHERE id = ?"};
+        while (sel.executeStep()) {
+            auto [id, type, pk] = get<int64_t, uint8_t, std::string>(sel);
+            if (pk.size() != 32) {
+                log::warning(logcat, "Found invalid owner pubkey (id {}) during upgrade", id);
+                continue;
+            }
+            exec_query(upd, swarm_space_key(pubkey_to_swarm_space(load_pubkey(type, pk))), id);
+            upd.reset();
+        }
+        transaction.commit();
+    }
+
+    // Returns the DDL of the triggers that keep the owners.bytes totals up to date as messages get
+    // inserted into, or deleted from, the messages table `table`.
+    static std::string owner_bytes_triggers_sql(std::string_view table) {
+        return fmt::format(
+                R"(
+CREATE TRIGGER IF NOT EXISTS {0}_bytes_insert AFTER INSERT ON {0} FOR EACH ROW
+    BEGIN
+        UPDATE owners SET bytes = bytes + length(NEW.data) WHERE id = NEW.owner;
+    END;
+CREATE TRIGGER IF NOT EXISTS {0}_bytes_delete AFTER DELETE ON {0} FOR EACH ROW
+    BEGIN
+        UPDATE owners SET bytes = bytes - length(OLD.data) WHERE id = OLD.owner;
+    END;
+)",
+                table);
+    }
+
+    // Adds the owners.bytes column (and the triggers that maintain it) to a database created
+    // before it existed, computing each owner's current total.
+    void add_owner_bytes() {
+        SQLite::Statement owner_cols{db, "PRAGMA main.table_info(owners)"};
+        while (owner_cols.executeStep())
+            if (owner_cols.getColumn(1).getString() == "bytes")
+                return;
+
+        log::info(logcat, "Upgrading database schema: adding owner message size totals");
+        SQLite::Transaction transaction{db};
+        db.exec("ALTER TABLE owners ADD COLUMN bytes INTEGER NOT NULL DEFAULT 0");
+        std::vector<std::string> tables;
+        if (db.tableExists("message_partition_config")) {
+            // The triggers have to go on the partition tables that are on disk, which (if the
+            // configuration has changed) aren't the ones that `parent` is set up for.
+            tables.push_back("messages_overflow");
+            int parts = db.execAndGet("SELECT parts FROM message_partition_config").getInt();
+            for (int part = 0; part < parts; part++)
+                tables.push_back("messages_{}"_format(part));
+        } else {
+            tables.push_back("messages");
+        }
+        for (const auto& table : tables) {
+            db.exec(
+                    "UPDATE owners SET bytes = bytes + COALESCE((SELECT SUM(length(data)) FROM {}"
+                    " WHERE owner = owners.id), 0)"_format(table));
+            db.exec(owner_bytes_triggers_sql(table));
+        }
+        transaction.commit();
+    }
 
-CREATE TABLE messages (
+    // Returns the DDL of a table of messages called `name`.
+    static std::string messages_table_sql(std::string_view name) {
+        return fmt::format(
+                R"(
+CREATE TABLE {} (
     id INTEGER PRIMARY KEY,
-    hash TEXT NOT NULL,
+    hash BLOB NOT NULL, -- see DatabaseImpl::hash_to_db
     owner INTEGER NOT NULL REFERENCES owners(id),
     namespace INTEGER NOT NULL DEFAULT 0,
     timestamp INTEGER NOT NULL,
@@ -360,7 +1016,26 @@ CREATE TABLE messages (
 
     UNIQUE(hash)
 );
+)",
+                name);
+    }
+
+    void create_schema() {
+        SQLite::Transaction transaction{db};
+
+        db.exec(R"(
+CREATE TABLE owners (
+    id INTEGER PRIMARY KEY,
+    type INTEGER NOT NULL,
+    pubkey BLOB NOT NULL,
+    swarm_space INTEGER, -- pubkey_to_swarm_space(pubkey), with the top bit flipped
+    bytes INTEGER NOT NULL DEFAULT 0, -- total size of the owner's message data
+
+    UNIQUE(pubkey, type)
+);
+
         )");
+        db.exec(messages_table_sql("messages"));
 
         if (db.tableExists("Data")) {
             log::warning(logcat, "Old database schema detected; performing migration...");
@@ -412,7 +1087,7 @@ CREATE TABLE messages (
             SQLite::Statement ins_msg{
                     db,
                     "INSERT INTO messages (hash, owner, timestamp, expiry, "
-                    "data) VALUES (?, ?, ?, ?, ?)"};
+                    "data) VALUES (hash_to_db(?), ?, ?, ?, ?)"};
 
             SQLite::Statement sel_msgs{
                     db,
@@ -442,6 +1117,8 @@ CREATE TABLE messages (
             log::warning(logcat, "Data migration complete!");
         }
 
+        db.exec("PRAGMA user_version = {}"_format(SCHEMA_BLOB_HASHES));
+
         transaction.commit();
     }
 
@@ -461,31 +1138,77 @@ CREATE TRIGGER IF NOT EXISTS owner_autoclean
 CREATE INDEX IF NOT EXISTS messages_expiry ON messages(expiry);
 CREATE INDEX IF NOT EXISTS messages_owner ON messages(owner, namespace, timestamp);
 CREATE INDEX IF NOT EXISTS messages_hash ON messages(hash);
+CREATE INDEX IF NOT EXISTS owners_swarm_space ON owners(swarm_space);
 
 CREATE VIEW IF NOT EXISTS owned_messages AS
     SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, namespace, timestamp, expiry, data
     FROM messages JOIN owners ON messages.owner = owners.id;
 
+-- Keep the message_stats and owner_stats counters up to date so that count queries don't have to
+-- scan the tables:
+CREATE TRIGGER IF NOT EXISTS message_stats_insert AFTER INSERT ON messages FOR EACH ROW
+    BEGIN
+        INSERT INTO message_stats (namespace, messages) VALUES (NEW.namespace, 1)
+            ON CONFLICT(namespace) DO UPDATE SET messages = messages + 1;
+    END;
+CREATE TRIGGER IF NOT EXISTS message_stats_delete AFTER DELETE ON messages FOR EACH ROW
+    BEGIN
+        UPDATE message_stats SET messages = messages - 1 WHERE namespace = OLD.namespace;
+    END;
+CREATE TRIGGER IF NOT EXISTS owner_stats_insert AFTER INSERT ON owners FOR EACH ROW
+    BEGIN
+        UPDATE owner_stats SET owners = owners + 1;
+    END;
+CREATE TRIGGER IF NOT EXISTS owner_stats_delete AFTER DELETE ON owners FOR EACH ROW
+    BEGIN
+        UPDATE owner_stats SET owners = owners - 1;
+    END;
+
 DROP TRIGGER IF EXISTS owned_messages_insert;
 DROP TRIGGER IF EXISTS owned_messages_upsert;
 )");
+        db.exec(owner_bytes_triggers_sql("messages"));
 
         transaction.commit();
     }
 
     /** Wrapper around a SQLite::Statement that calls `tryReset()` on destruction of the
-     * wrapper. */
+     * wrapper, and records the statement's execution time and rows in its stats. */
     class StatementWrapper {
         SQLite::Statement& st;
+        Database& parent;
+        Database::query_counters* stats;
+        std::chrono::steady_clock::time_point started;
 
       public:
         /// Whether we should reset on destruction; can be set to false if needed.
         bool reset_on_destruction = true;
 
-        explicit StatementWrapper(SQLite::Statement& st) noexcept : st{st} {}
+        StatementWrapper(
+                SQLite::Statement& st, Database& parent, Database::query_counters* stats) :
+                st{st}, parent{parent}, stats{stats} {
+            if (stats) {
+                active_statements.push_back({&st, 0});
+                started = std::chrono::steady_clock::now();
+            }
+        }
+        StatementWrapper(const StatementWrapper&) = delete;
+        StatementWrapper& operator=(const StatementWrapper&) = delete;
         ~StatementWrapper() noexcept {
             if (reset_on_destruction)
                 st.tryReset();
+            if (!stats)
+                return;
+            auto elapsed = std::chrono::steady_clock::now() - started;
+            int64_t rows = 0;
+            for (auto it = active_statements.rbegin(); it != active_statements.rend(); ++it) {
+                if (it->st == &st) {
+                    rows = it->rows;
+                    active_statements.erase(std::next(it).base());
+                    break;
+                }
+            }
+            parent.record_query(*stats, elapsed, rows);
         }
         SQLite::Statement& operator*() noexcept { return st; }
         SQLite::Statement* operator->() noexcept { return &st; }
@@ -493,378 +1216,2657 @@ DROP TRIGGER IF EXISTS owned_messages_upsert;
     };
 
     StatementWrapper prepared_st(const std::string& query) {
-        if (auto qit = prepared_sts.find(query); qit != prepared_sts.end())
-            return StatementWrapper{qit->second};
-        return StatementWrapper{prepared_sts.try_emplace(query, db, query).first->second};
+        auto qit = prepared_sts.find(query);
+        if (qit == prepared_sts.end())
+            qit = prepared_sts.try_emplace(query, db, query, parent).first;
+        return StatementWrapper{qit->second.st, parent, qit->second.stats};
     }
 
-    template <typename... T>
-    int prepared_exec(const std::string& query, const T&... bind) {
+    // Returns the prepared statement of a registered query, preparing it if we haven't yet.
+    SQLite::Statement& registered_st(const registered_query& query) {
+        if (query.slot >= registered_sts.size())
+            registered_sts.resize(query.slot + 1);
+        auto& st = registered_sts[query.slot];
+        if (!st)
+            st = std::make_unique<SQLite::Statement>(db, query.sql);
+        return *st;
+    }
+
+    StatementWrapper prepared_st(const registered_query& query) {
+        return StatementWrapper{
+                registered_st(query), parent, parent.query_counters_for(query.slot, query.sql)};
+    }
+
+    template <typename Query, typename... T>
+    int prepared_exec(const Query& query, const T&... bind) {
         return exec_query(prepared_st(query), bind...);
     }
 
-    template <typename... T, typename... Bind>
-    auto prepared_get(const std::string& query, const Bind&... bind) {
+    template <typename... T, typename Query, typename... Bind>
+    auto prepared_get(const Query& query, const Bind&... bind) {
         return exec_and_get<T...>(prepared_st(query), bind...);
     }
 
     user_pubkey load_pubkey(uint8_t type, std::string pk) { return {type, std::move(pk)}; }
-};
 
-Database::Database(std::filesystem::path db_path) : db_path_{std::move(db_path)} {
-    impl_pool_.push(std::make_unique<DatabaseImpl>(*this, db_path_, /*initialize=*/true));
+    // Returns the owner id of the given pubkey, if it exists, consulting the owner id cache first.
+    std::optional<int64_t> get_owner(const user_pubkey& pubkey) {
+        auto key = pubkey.key();
+        auto [cached, gen] = parent.owner_cache_get(key);
+        if (cached)
+            return cached;
+        auto id = exec_and_maybe_get<int64_t>(prepared_st(owner_id_sql()), pubkey);
+        if (id)
+            owner_cache_put(key, *id, gen);
+        return id;
+    }
 
-    clean_expired();
-}
+    // Returns the owner id of the given pubkey, consulting the owner id cache first and otherwise
+    // inserting the owner if it doesn't exist yet, in one statement.  Sets `inserted` to whether
+    // the owner was inserted.  Must be called on a write connection.
+    int64_t upsert_owner(const user_pubkey& pubkey, bool& inserted) {
+        auto key = pubkey.key();
+        auto [cached, gen] = parent.owner_cache_get(key);
+        inserted = false;
+        if (cached)
+            return *cached;
+        clear_inserted_rowid();
+        auto id = prepared_get<int64_t>(
+                upsert_owner_sql(), pubkey, swarm_space_key(pubkey_to_swarm_space(pubkey)));
+        inserted = inserted_rowid(id);
+        // Newly inserted owners are deliberately not cached (the next lookup will cache it); an
+        // existing row might still have been inserted earlier in this same (uncommitted)
+        // transaction, so it only gets cached once the transaction commits.
+        if (!inserted)
+            owner_cache_put(key, id, gen);
+        return id;
+    }
 
-Database::~Database() = default;
+    // An upsert's UPDATE doesn't change the last insert rowid, so clearing it beforehand and
+    // calling this afterwards (with the rowid it returned) tells us which way an upsert went.
+    // (Triggers don't get in the way: the rowid reverts to what it was once a trigger finishes).
+    void clear_inserted_rowid() { sqlite3_set_last_insert_rowid(db.getHandle(), 0); }
+    bool inserted_rowid(int64_t rowid) const {
+        return sqlite3_last_insert_rowid(db.getHandle()) == rowid;
+    }
 
-/// RAII class that holds a single database instance exclusively for the owner, returning it to the
-/// database connection pool on destruction.  The general idea is that all database-interacting
-/// implementation methods shall do:
-///
-///     {
-///       auto impl = get_impl(/*write=*/ true);
-///       impl->whatever();
-///       // ...
-///     }
-///
-/// if it needs to write to the database (INSERT/UPDATE/DELETE/etc.), and passing `false` as the
-/// get_impl argument if it only needs to read.  Internally a shared_mutex is used to ensure that a
-/// writer is exclusive; readers may run queries parallel.  (Not using such a mutex invokes sqlite's
-/// painful limitations around being busy/locked when reads and writes happen on different
-/// connections at the same time).
-///
-/// The "..." code must be as minimal as possible (any sort of recursion will very likely deadlock).
-class LockedDBImpl {
-  private:
-    std::unique_ptr<DatabaseImpl> impl_;
-    Database& parent_;
-    bool write_;
+    // True if the database uses expiry partitions; see `database_options::expiry_partition`.
+    bool partitioned() const { return parent.expiry_partitions_ > 0; }
+
+    // Returns the id for a new message in partitioned mode; must be called under the write lock.
+    int64_t next_message_id() const { return parent.next_message_id_; }
+    void used_message_id() { parent.next_message_id_++; }
+
+    // Returns true if storing `msg` (for owner `owner_id`) would put the owner over its quota (see
+    // `database_options::owner_quota`) and the message isn't one we already have.  If `replaces`
+    // is true then the store also deletes the owner's other messages in the namespace (as for a
+    // public outbox namespace), so the bytes of those don't count.
+    bool over_quota(int64_t owner_id, const message& msg, bool replaces) {
+        if (parent.owner_quota_ <= 0)
+            return false;
+        auto bytes = prepared_get<int64_t>("SELECT bytes FROM owners WHERE id = ?"_sql, owner_id);
+        if (replaces)
+            bytes -= prepared_get<int64_t>(
+                    replaced_bytes_sql(partitioned()), owner_id, msg.msg_namespace, msg.hash);
+        if (bytes + static_cast<int64_t>(msg.data.size()) <= parent.owner_quota_ ||
+            exec_and_maybe_get<int64_t, int64_t>(
+                    prepared_st(existing_message_sql(partitioned())), msg.hash))
+            return false;
+        parent.quota_rejected_++;
+        return true;
+    }
 
-    friend LockedDBImpl Database::get_impl(bool);
-    LockedDBImpl(std::unique_ptr<DatabaseImpl> impl, Database& parent, bool write) :
-            impl_{std::move(impl)}, parent_{parent}, write_{write} {
-        if (write_)
-            parent_.access_lock_.lock();
-        else
-            parent_.access_lock_.lock_shared();
+    // For the write path's (i.e. store_one's) updates of the stored message hash filter.
+    void hash_filter_add(std::string_view hash) { parent.hash_filter_add(hash); }
+    void hash_filter_erase(const std::vector<std::string>& hashes) {
+        parent.hash_filter_erase(hashes);
     }
 
-  public:
-    DatabaseImpl& operator*() noexcept { return *impl_; }
-    DatabaseImpl* operator->() noexcept { return impl_.get(); }
+    // Which rows of a message table a retargeted statement touches: all of them, or just those
+    // that are live (i.e. visible through the `messages` view) or hidden (i.e. expired).
+    enum class retarget_rows { all, live, hidden };
+
+    // Returns `sql`, which must be a DELETE FROM or UPDATE of `messages`, modifying `table`
+    // instead, and only the given `rows` of it (see partition_views_sql() for the hidden ones).
+    // For `hidden` it also drops any RETURNING clause, so that the statement returns nothing.
+    static std::string retarget(std::string_view sql, std::string_view table, retarget_rows rows) {
+        auto pos = sql.find("messages"sv);
+        assert(pos == "DELETE FROM "sv.size() || pos == "UPDATE "sv.size());
+        std::string result{sql.substr(0, pos)};
+        result += table;
+        sql.remove_prefix(pos + "messages"sv.size());
+        if (rows != retarget_rows::all) {
+            auto where = sql.find(" WHERE "sv);
+            assert(where != std::string_view::npos);
+            where += " WHERE "sv.size();
+            result += sql.substr(0, where);
+            result += rows == retarget_rows::live ? "expiry > "sv : "expiry <= "sv;
+            result += SQL_NOW_MS;
+            result += " AND ";
+            sql.remove_prefix(where);
+        }
+        if (rows == retarget_rows::hidden)
+            if (auto ret = sql.find(" RETURNING "sv); ret != std::string_view::npos)
+                sql = sql.substr(0, ret);
+        result += sql;
+        return result;
+    }
 
-    ~LockedDBImpl() {
-        {
-            std::lock_guard lock{parent_.impl_lock_};
-            parent_.impl_pool_.push(std::move(impl_));
+    // In expiry partitioned mode `messages` is a view, so statements that delete or update
+    // messages have to be run against each of the tables underneath it.  This calls `f` with the
+    // prepared statement of `query` (a DELETE FROM or UPDATE of `messages`) or, in partitioned
+    // mode, with the statement retargeted (see retarget()) at each message table in turn, all in
+    // one transaction, after which it moves any messages that an update took out of their ring
+    // table's window.  Deletions also remove hidden expired messages (as they would without
+    // partitions, if cleanup hasn't got to them yet), but a deletion's RETURNING rows only
+    // include live ones, as from the view; for that the hidden rows of each ring table get
+    // deleted by a second statement, without the RETURNING clause, that `f` also gets called with.
+    // Updates leave hidden messages alone unless `live_only` is false.  If `cached` is false then
+    // the statements are compiled just for this call (for one-off query text) rather than cached.
+    template <typename Query, typename F>
+    void modify_messages(const Query& query, F&& f, bool cached = true, bool live_only = true) {
+        auto run = [&](const std::string& sql) {
+            if (cached) {
+                auto st = prepared_st(sql);
+                f(*st);
+            } else {
+                SQLite::Statement st{db, sql};
+                f(st);
+            }
+        };
+        if (!partitioned()) {
+            if constexpr (std::is_same_v<Query, registered_query>) {
+                auto st = prepared_st(query);
+                f(*st);
+            } else
+                run(query);
+            return;
         }
-        if (write_)
-            parent_.access_lock_.unlock();
+
+        std::string_view sql;
+        if constexpr (std::is_same_v<Query, registered_query>)
+            sql = query.sql;
         else
-            parent_.access_lock_.unlock_shared();
+            sql = query;
+        const bool update = util::starts_with(sql, "UPDATE "sv);
+        const bool split_delete = !update && sql.find(" RETURNING "sv) != std::string_view::npos;
+        std::optional<SQLite::Transaction> transaction;
+        if (sqlite3_get_autocommit(db.getHandle()))
+            transaction.emplace(db);
+        const auto& tables = parent.message_tables_;
+        for (size_t i = 0; i < tables.size(); i++) {
+            // The overflow table (the first one) gets cleaned up row by row, so never has
+            // anything hidden in it:
+            if (i == 0 || !(update ? live_only : split_delete))
+                run(retarget(sql, tables[i], retarget_rows::all));
+            else {
+                run(retarget(sql, tables[i], retarget_rows::live));
+                if (split_delete)
+                    run(retarget(sql, tables[i], retarget_rows::hidden));
+            }
+        }
+        if (update)
+            relocate_messages();
+        if (transaction)
+            transaction->commit();
     }
-};
 
-LockedDBImpl Database::get_impl(bool write) {
-    // First see if we can find an idle impl connection in the pool, and if so remove it from the
-    // pool and return it.
-    std::unique_ptr<DatabaseImpl> impl;
-    {
-        std::lock_guard lock{impl_lock_};
-        // We found one in the pool, so extract and use it
-        if (!impl_pool_.empty()) {
-            impl = std::move(impl_pool_.top());
-            impl_pool_.pop();
-        }
+    // Wrapper around modify_messages() that binds and executes the statement(s); returns the
+    // total number of changed rows.
+    template <typename Query, typename... Bind>
+    int modify_exec(const Query& query, const Bind&... bind) {
+        int changed = 0;
+        modify_messages(query, [&](SQLite::Statement& st) { changed += exec_query(st, bind...); });
+        return changed;
     }
-    if (!impl)
-        // Otherwise construct a new one
-        impl = std::make_unique<DatabaseImpl>(*this, db_path_, /*initialize=*/false);
+
+    // Wrapper around modify_messages() that binds and executes the statement(s), returning all
+    // of the returned rows (as with get_all()).
+    template <typename... T, typename Query, typename... Bind>
+    std::vector<type_or_tuple<T...>> modify_get_all(const Query& query, const Bind&... bind) {
+        std::vector<type_or_tuple<T...>> results;
+        modify_messages(query, [&](SQLite::Statement& st) {
+            auto rows = get_all<T...>(st, bind...);
+            if (results.empty())
+                results = std::move(rows);
+            else
+                results.insert(
+                        results.end(),
+                        std::make_move_iterator(rows.begin()),
+                        std::make_move_iterator(rows.end()));
+        });
+        return results;
+    }
+
+    // Returns the table that a new message expiring at `expiry` (in unix epoch milliseconds)
+    // goes into in partitioned mode: the ring table of the message's expiry window if it holds
+    // (or can be given) that window, otherwise the overflow table.  Already expired messages
+    // also go into the overflow table, so that cleanup deletes them promptly rather than at the
+    // end of the current window.  Must be called under the write lock.
+    const std::string& message_table_for(int64_t expiry) {
+        const int64_t window = parent.expiry_partition_ms_;
+        const int parts = parent.expiry_partitions_;
+        const int64_t w = expiry / window;
+        const int64_t now_ms = to_epoch_ms(std::chrono::system_clock::now());
+        const int64_t now_window = now_ms / window;
+        // The table of the last window of the ring might still be holding a window that just
+        // ended (if clean_expired() hasn't dropped it yet), so we only hand out the others:
+        if (expiry > now_ms && w < now_window + parts - 1) {
+            const int part = static_cast<int>(w % parts);
+            auto current = exec_and_get<int64_t>(
+                    prepared_st("SELECT COALESCE(expiry_window, -1) FROM message_partitions"
+                                " WHERE part = ?"_sql),
+                    part);
+            if (current == -1)
+                prepared_exec(
+                        "UPDATE message_partitions SET expiry_window = ? WHERE part = ?"_sql,
+                        w,
+                        part);
+            if (current == -1 || current == w)
+                return parent.message_tables_[part + 1];
+        }
+        return parent.message_tables_[0];
+    }
+
+    // Moves the messages that the `_relocate` triggers flagged (because an update gave them an
+    // expiry outside of their ring table's window, or one that has already passed) into the table
+    // they now belong in.
+    void relocate_messages() {
+        auto moved = get_all<int64_t, int>(
+                prepared_st("SELECT id, part FROM message_relocations"_sql));
+        if (moved.empty())
+            return;
+        for (auto [id, part] : moved) {
+            const auto& from = parent.message_tables_[part + 1];
+            auto expiry = exec_and_get<int64_t>(
+                    prepared_st("SELECT expiry FROM {} WHERE id = ?"_format(from)), id);
+            const auto& to = message_table_for(expiry);
+            prepared_exec(
+                    "INSERT INTO {0} ({1}) SELECT {1} FROM {2} WHERE id = ?"_format(
+                            to, MESSAGE_COLUMNS, from),
+                    id);
+            prepared_exec("DELETE FROM {} WHERE id = ?"_format(from), id);
+        }
+        prepared_exec("DELETE FROM message_relocations"_sql);
+    }
+
+    // Returns the ring tables whose windows have ended as of `now_ms`.
+    std::vector<int> expired_partitions(int64_t now_ms) {
+        auto st = prepared_st("SELECT part FROM message_partitions WHERE expiry_window < ?"_sql);
+        return get_all<int>(st, now_ms / parent.expiry_partition_ms_);
+    }
+
+    // Drops (and recreates, empty) ring table `part`, whose window must have ended, and frees up
+    // its window; returns the number of messages that were in it.  Must be called on a write
+    // connection.
+    int64_t drop_partition(int part) {
+        const auto& table = parent.message_tables_[part + 1];
+        SQLite::Transaction transaction{db};
+
+        // Dropping the table doesn't fire its delete triggers, so we have to do their work here:
+        int64_t dropped = 0;
+        for (auto [ns, count] : get_all<int64_t, int64_t>(
+                     prepared_st("SELECT namespace, COUNT(*) FROM {} GROUP BY namespace"_format(
+                             table)))) {
+            prepared_exec(
+                    "UPDATE message_stats SET messages = messages - ? WHERE namespace = ?"_sql,
+                    count,
+                    ns);
+            dropped += count;
+        }
+        auto owners = get_all<int64_t, int64_t>(prepared_st(
+                "SELECT owner, SUM(length(data)) FROM {} GROUP BY owner"_format(table)));
+
+        db.exec("DROP TABLE {}"_format(table));
+        db.exec(partition_table_sql(table) + partition_triggers_sql(table, part));
+        prepared_exec(
+                "UPDATE message_partitions SET expiry_window = NULL WHERE part = ?"_sql, part);
+
+        for (auto [owner, bytes] : owners) {
+            prepared_exec("UPDATE owners SET bytes = bytes - ? WHERE id = ?"_sql, bytes, owner);
+            prepared_exec(
+                    "DELETE FROM owners WHERE id = ?1"
+                    " AND NOT EXISTS (SELECT * FROM messages_all WHERE owner = ?1)"_sql,
+                    owner);
+        }
+
+        transaction.commit();
+        return dropped;
+    }
+};
+
+// Returns the number of ring tables for expiry partitions of the given length (0 if not
+// partitioned): enough for the windows up to EXPIRY_PARTITION_HORIZON away, plus one for a window
+// that has ended but whose table hasn't been dropped yet.
+static int expiry_partitions_for(std::chrono::milliseconds window) {
+    if (window <= 0ms)
+        return 0;
+    int64_t windows = (Database::EXPIRY_PARTITION_HORIZON + window - 1ms) / window + 2;
+    return static_cast<int>(std::min<int64_t>(windows, Database::MAX_EXPIRY_PARTITIONS));
+}
+
+Database::Database(std::filesystem::path db_path, const database_options& options) :
+        pool_min_{std::max(options.pool_min, 1)},
+        pool_max_{options.pool_max > 0 ? std::max(options.pool_max, pool_min_) : 0},
+        db_file_{db_path / u8"storage.db"},
+        size_limit_{options.size_limit > 0 ? options.size_limit : SIZE_LIMIT},
+        set_hash_queries_{options.set_hash_queries},
+        eviction_{options.eviction},
+        owner_quota_{options.owner_quota},
+        expiry_partition_ms_{options.expiry_partition > 0ms ? options.expiry_partition.count() : 0},
+        expiry_partitions_{expiry_partitions_for(options.expiry_partition)},
+        group_commit_{options.group_commit},
+        hash_filter_enabled_{options.hash_filter},
+        slow_query_{options.slow_query},
+        cache_size_{options.cache_size},
+        mmap_size_{options.mmap_size / std::max(options.shards, 1)} {
+    if (options.shards <= 1) {
+        open();
+        for (const auto& file : stale_shard_files(db_path, 1))
+            import_database(file, u8".resharded");
+        return;
+    }
+
+    int n = options.shards;
+    log::info(logcat, "Using {} database shards in {}", n, db_path.string());
+    shards_.reserve(n);
+    for (int i = 0; i < n; i++)
+        shards_.push_back(std::unique_ptr<Database>{new Database{
+                shard_tag{},
+                db_path / fmt::format("storage-{}-of-{}.db", i, n),
+                size_limit_ / n,
+                options}});
+
+    if (std::filesystem::exists(db_file_))
+        import_database(db_file_, u8".unsharded");
+    // Shard files from a different shard count hold owners of swarm space ranges that don't line
+    // up with ours, so get redistributed just like an unsharded database:
+    for (const auto& file : stale_shard_files(db_path, n))
+        import_database(file, u8".resharded");
+}
+
+Database::Database(
+        shard_tag,
+        std::filesystem::path db_file,
+        int64_t size_limit,
+        const database_options& options) :
+        pool_min_{std::max(options.pool_min, 1)},
+        pool_max_{options.pool_max > 0 ? std::max(options.pool_max, pool_min_) : 0},
+        db_file_{std::move(db_file)},
+        size_limit_{size_limit},
+        set_hash_queries_{options.set_hash_queries},
+        eviction_{options.eviction},
+        owner_quota_{options.owner_quota},
+        expiry_partition_ms_{options.expiry_partition > 0ms ? options.expiry_partition.count() : 0},
+        expiry_partitions_{expiry_partitions_for(options.expiry_partition)},
+        group_commit_{options.group_commit},
+        hash_filter_enabled_{options.hash_filter},
+        slow_query_{options.slow_query},
+        cache_size_{options.cache_size},
+        mmap_size_{options.mmap_size / std::max(options.shards, 1)} {
+    open();
+}
+
+std::vector<std::filesystem::path> Database::stale_shard_files(
+        const std::filesystem::path& db_path, int shards) {
+    std::vector<std::filesystem::path> stale;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator{db_path, ec}) {
+        // Shard files are named storage-{i}-of-{n}.db:
+        auto name = entry.path().filename().string();
+        std::string_view sv{name};
+        if (!util::starts_with(sv, "storage-"sv) || !util::ends_with(sv, ".db"sv))
+            continue;
+        sv.remove_prefix("storage-"sv.size());
+        sv.remove_suffix(".db"sv.size());
+        auto of = sv.find("-of-"sv);
+        int i, n;
+        if (of == std::string_view::npos || !util::parse_int(sv.substr(0, of), i) ||
+            !util::parse_int(sv.substr(of + "-of-"sv.size()), n) || i < 0 || i >= n)
+            continue;
+        if (n != shards)
+            stale.push_back(entry.path());
+    }
+    std::sort(stale.begin(), stale.end());
+    return stale;
+}
+
+Database& Database::shard_for(const user_pubkey& pubkey) {
+    // Shards are contiguous, equal-width ranges of swarm space, so that swarm space range queries
+    // (e.g. bootstrapping) only have to look at the shards that overlap the range.
+    const uint64_t width = std::numeric_limits<uint64_t>::max() / shards_.size() + 1;
+    return *shards_[pubkey_to_swarm_space(pubkey) / width];
+}
+
+Database::~Database() = default;
+
+/// RAII class that holds a single database instance exclusively for the owner, returning it to the
+/// database connection pool on destruction.  The general idea is that all database-interacting
+/// implementation methods shall do:
+///
+///     {
+///       auto impl = get_impl(/*write=*/ true);
+///       impl->whatever();
+///       // ...
+///     }
+///
+/// if it needs to write to the database (INSERT/UPDATE/DELETE/etc.), and passing `false` as the
+/// get_impl argument if it only needs to read.  Internally a mutex is used to ensure that a writer
+/// is exclusive (sqlite only allows one writer at a time, and blocking here is much cheaper than
+/// sqlite's busy handler).  Readers don't take any lock: in WAL mode they can run in parallel with
+/// each other and with the writer, seeing the last committed state of the database.
+///
+/// The "..." code must be as minimal as possible (any sort of recursive write will very likely
+/// deadlock).
+class LockedDBImpl {
+  private:
+    std::unique_ptr<DatabaseImpl> impl_;
+    Database& parent_;
+    bool write_;
+
+    friend LockedDBImpl Database::get_impl(bool);
+    LockedDBImpl(std::unique_ptr<DatabaseImpl> impl, Database& parent, bool write) :
+            impl_{std::move(impl)}, parent_{parent}, write_{write} {
+        if (write_)
+            parent_.lock_for_write();
+    }
+
+  public:
+    DatabaseImpl& operator*() noexcept { return *impl_; }
+    DatabaseImpl* operator->() noexcept { return impl_.get(); }
+
+    ~LockedDBImpl() {
+        parent_.page_cache_collect(*impl_);
+        // Any transaction on the connection has completed by now, so the owners it deleted can't
+        // be looked up by a new reader any more; purge whatever got re-cached in the meantime.
+        for (auto id : impl_->owners_deleted_committed)
+            parent_.owner_cache_erase(id);
+        impl_->owners_deleted_committed.clear();
+        // Owners looked up by transactions that have since committed can now be cached (unless
+        // owners got deleted since the lookup, which owner_cache_put checks):
+        for (auto& o : impl_->owners_cached_committed)
+            parent_.owner_cache_put(o.pubkey, o.id, o.generation);
+        impl_->owners_cached_committed.clear();
+        std::unique_ptr<DatabaseImpl> extra;
+        {
+            std::lock_guard lock{parent_.impl_lock_};
+            if (parent_.pool_max_ > 0 && parent_.pool_size_ > parent_.pool_max_) {
+                // One of the extra connections opened after a timed out wait; close it (after
+                // releasing the lock) rather than keeping it.
+                parent_.pool_size_--;
+                extra = std::move(impl_);
+            } else
+                parent_.impl_pool_.push(std::move(impl_));
+        }
+        if (!extra)
+            parent_.impl_returned_.notify_one();
+        if (write_) {
+            parent_.last_write_ = std::chrono::steady_clock::now().time_since_epoch().count();
+            parent_.write_lock_.unlock();
+        }
+    }
+};
+
+void Database::lock_for_write() {
+    write_locks_++;
+    if (write_lock_.try_lock())
+        return;
+    auto started = std::chrono::steady_clock::now();
+    write_lock_.lock();
+    int64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - started)
+                              .count();
+    write_locks_contended_++;
+    write_lock_wait_us_ += wait_us;
+    auto prev_max = write_lock_wait_max_us_.load();
+    while (prev_max < wait_us && !write_lock_wait_max_us_.compare_exchange_weak(prev_max, wait_us))
+        ;
+}
+
+Database::write_lock_stats Database::get_write_lock_stats() const {
+    if (!shards_.empty()) {
+        write_lock_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_write_lock_stats();
+            total.acquisitions += st.acquisitions;
+            total.contended += st.contended;
+            total.wait_us += st.wait_us;
+            total.max_wait_us = std::max(total.max_wait_us, st.max_wait_us);
+        }
+        return total;
+    }
+    return {write_locks_.load(),
+            write_locks_contended_.load(),
+            write_lock_wait_us_.load(),
+            write_lock_wait_max_us_.load()};
+}
+
+void Database::page_cache_collect(DatabaseImpl& impl) {
+    // Take (and reset) the counts accumulated since the connection was last returned:
+    int hits = 0, misses = 0, highwater;
+    sqlite3_db_status(impl.db.getHandle(), SQLITE_DBSTATUS_CACHE_HIT, &hits, &highwater, 1);
+    sqlite3_db_status(impl.db.getHandle(), SQLITE_DBSTATUS_CACHE_MISS, &misses, &highwater, 1);
+    page_cache_hits_ += hits;
+    page_cache_misses_ += misses;
+}
+
+Database::page_cache_stats Database::get_page_cache_stats() {
+    if (!shards_.empty()) {
+        page_cache_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_page_cache_stats();
+            total.hits += st.hits;
+            total.misses += st.misses;
+            total.cache_size = st.cache_size;
+            total.mmap_size += st.mmap_size;
+        }
+        return total;
+    }
+    page_cache_stats st{page_cache_hits_.load(), page_cache_misses_.load(), 0, 0};
+    auto impl = get_impl(false);
+    // These read back what SQLite actually uses, which can be less than what we asked for (the
+    // memory map size is capped at compile time, and SQLite may be built without mmap at all).
+    // cache_size is in pages if positive, KiB if negative.
+    auto cache = impl->prepared_get<int64_t>("PRAGMA cache_size"_sql);
+    st.cache_size = cache >= 0 ? cache * impl->page_size : -cache * 1024;
+    st.mmap_size = impl->prepared_get<int64_t>("PRAGMA mmap_size"_sql);
+    return st;
+}
+
+Database::query_counters* Database::query_counters_for(size_t slot, const char* sql) {
+    if (slot >= MAX_QUERY_SLOTS)
+        return nullptr;
+    auto& q = query_stats_[slot];
+    if (!q.sql.load(std::memory_order_relaxed))
+        q.sql = sql;
+    return &q;
+}
+
+Database::query_counters* Database::query_counters_for(const std::string& sql) {
+    std::lock_guard lock{query_text_stats_mutex_};
+    auto it = query_text_stats_.find(sql);
+    if (it == query_text_stats_.end()) {
+        if (query_text_stats_.size() >= MAX_QUERY_TEXTS)
+            return nullptr;
+        it = query_text_stats_.try_emplace(sql).first;
+        // Map nodes don't move, so the key's storage lives as long as we do:
+        it->second.sql = it->first.c_str();
+    }
+    return &it->second;
+}
+
+void Database::record_query(
+        query_counters& q, std::chrono::steady_clock::duration elapsed, int64_t rows) {
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    q.uses.fetch_add(1, std::memory_order_relaxed);
+    q.total_us.fetch_add(us, std::memory_order_relaxed);
+    q.rows.fetch_add(rows, std::memory_order_relaxed);
+    auto prev_max = q.max_us.load(std::memory_order_relaxed);
+    while (prev_max < us &&
+           !q.max_us.compare_exchange_weak(prev_max, us, std::memory_order_relaxed))
+        ;
+    if (slow_query_ > 0us && elapsed >= slow_query_)
+        log::warning(
+                logcat,
+                "Slow query ({}, {} rows): {}",
+                util::short_duration(elapsed),
+                rows,
+                q.sql.load(std::memory_order_relaxed));
+}
+
+std::vector<Database::query_stats> Database::get_query_stats() {
+    std::vector<query_stats> result;
+    if (!shards_.empty()) {
+        // The shards all run the same statements, so add up each statement's numbers
+        std::unordered_map<std::string, size_t> index;
+        for (auto& shard : shards_) {
+            for (auto& st : shard->get_query_stats()) {
+                auto [it, ins] = index.try_emplace(st.query, result.size());
+                if (ins) {
+                    result.push_back(std::move(st));
+                    continue;
+                }
+                auto& total = result[it->second];
+                total.uses += st.uses;
+                total.total_us += st.total_us;
+                total.max_us = std::max(total.max_us, st.max_us);
+                total.rows += st.rows;
+            }
+        }
+    } else {
+        auto add = [&result](const query_counters& q) {
+            auto uses = q.uses.load(std::memory_order_relaxed);
+            auto sql = q.sql.load(std::memory_order_relaxed);
+            if (uses == 0 || !sql)
+                return;
+            result.push_back(
+                    {sql,
+                     uses,
+                     q.total_us.load(std::memory_order_relaxed),
+                     q.max_us.load(std::memory_order_relaxed),
+                     q.rows.load(std::memory_order_relaxed)});
+        };
+        for (auto& q : query_stats_)
+            add(q);
+        std::lock_guard lock{query_text_stats_mutex_};
+        for (auto& [sql, q] : query_text_stats_)
+            add(q);
+    }
+    std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) {
+        return a.total_us > b.total_us;
+    });
+    return result;
+}
+
+std::pair<std::optional<int64_t>, uint64_t> Database::owner_cache_get(
+        const prefixed_pubkey& pubkey) {
+    std::pair<std::optional<int64_t>, uint64_t> result;
+    {
+        std::lock_guard lock{owner_cache_mutex_};
+        if (auto it = owner_cache_.find(pubkey); it != owner_cache_.end())
+            result.first = it->second;
+        result.second = owner_cache_gen_;
+    }
+    if (result.first)
+        owner_cache_hits_++;
+    else
+        owner_cache_misses_++;
+    return result;
+}
+
+void Database::owner_cache_put(const prefixed_pubkey& pubkey, int64_t id, uint64_t generation) {
+    std::lock_guard lock{owner_cache_mutex_};
+    if (generation != owner_cache_gen_)
+        // Owners were deleted since the caller looked this up, so the id might be stale
+        return;
+    if (owner_cache_.size() >= OWNER_CACHE_SIZE && !owner_cache_.count(pubkey)) {
+        // Full: evict an arbitrary entry to make room
+        auto victim = owner_cache_.begin();
+        owner_cache_ids_.erase(victim->second);
+        owner_cache_.erase(victim);
+    }
+    auto [it, ins] = owner_cache_.try_emplace(pubkey, id);
+    if (!ins) {
+        if (it->second == id)
+            return;
+        owner_cache_ids_.erase(it->second);
+        it->second = id;
+    }
+    auto& id_pk = owner_cache_ids_[id];
+    if (id_pk)
+        // Some other pubkey was cached with this (since reused) id, so it must be stale:
+        owner_cache_.erase(*id_pk);
+    id_pk = &it->first;
+}
+
+void Database::owner_cache_erase(int64_t id) {
+    std::lock_guard lock{owner_cache_mutex_};
+    owner_cache_gen_++;
+    if (auto it = owner_cache_ids_.find(id); it != owner_cache_ids_.end()) {
+        owner_cache_.erase(*it->second);
+        owner_cache_ids_.erase(it);
+    }
+}
+
+Database::owner_cache_stats Database::get_owner_cache_stats() {
+    if (!shards_.empty()) {
+        owner_cache_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_owner_cache_stats();
+            total.hits += st.hits;
+            total.misses += st.misses;
+            total.size += st.size;
+        }
+        return total;
+    }
+    std::lock_guard lock{owner_cache_mutex_};
+    return {owner_cache_hits_.load(),
+            owner_cache_misses_.load(),
+            static_cast<int64_t>(owner_cache_.size())};
+}
+
+LockedDBImpl Database::get_impl(bool write) {
+    // First see if we can find an idle impl connection in the pool, and if so remove it from the
+    // pool and return it.
+    std::unique_ptr<DatabaseImpl> impl;
+    {
+        std::unique_lock lock{impl_lock_};
+        if (impl_pool_.empty() && pool_max_ > 0 && pool_size_ >= pool_max_) {
+            // The pool is at its max, so wait for a connection to come back
+            pool_waits_++;
+            auto started = std::chrono::steady_clock::now();
+            impl_returned_.wait_for(
+                    lock, POOL_WAIT_TIMEOUT, [this] { return !impl_pool_.empty(); });
+            pool_wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now() - started)
+                                     .count();
+        }
+        // We found one in the pool, so extract and use it
+        if (!impl_pool_.empty()) {
+            impl = std::move(impl_pool_.top());
+            impl_pool_.pop();
+        } else
+            pool_size_++;
+    }
+    if (!impl)
+        // Otherwise construct a new one
+        impl = open_connection();
 
     return LockedDBImpl{std::move(impl), *this, write};
 }
 
+std::unique_ptr<DatabaseImpl> Database::open_connection() {
+    try {
+        auto impl = std::make_unique<DatabaseImpl>(*this, db_file_, /*initialize=*/false);
+        pool_created_++;
+        return impl;
+    } catch (...) {
+        std::lock_guard lock{impl_lock_};
+        pool_size_--;
+        throw;
+    }
+}
+
+void Database::import_database(const std::filesystem::path& db_file, std::u8string_view suffix) {
+    log::warning(
+            logcat,
+            "Found database {} of another shard configuration; importing it into the database{}",
+            db_file.string(),
+            shards_.empty() ? "" : " shards");
+    size_t imported = 0, revocations = 0;
+    {
+        database_options opts;
+        Database old{shard_tag{}, db_file, SIZE_LIMIT, opts};
+        imported = old.for_each_message([this](std::vector<message>& chunk) {
+            bulk_store(chunk);
+            return true;
+        });
+
+        // Revoked subaccounts have to come along too, or importing would un-revoke them.  (The
+        // owners all exist by now, except for those without any unexpired messages, whose
+        // revocations don't matter as they can't have anything to retrieve).
+        auto old_impl = old.get_impl(false);
+        auto st = old_impl->prepared_st(
+                "SELECT type, pubkey, token, r.timestamp FROM revoked_subaccounts r"
+                " JOIN owners ON owners.id = r.owner"_sql);
+        while (step(*st)) {
+            auto [type, pk, token, timestamp] =
+                    get<uint8_t, std::string, std::string, int64_t>(*st);
+            auto pubkey = old_impl->load_pubkey(type, std::move(pk));
+            auto& target = shards_.empty() ? *this : shard_for(pubkey);
+            if (target.import_revocation(pubkey, token, timestamp))
+                revocations++;
+        }
+    }
+    if (shards_.empty())
+        revoked_reload(*get_impl(false));
+    else
+        for (auto& shard : shards_)
+            shard->revoked_reload(*shard->get_impl(false));
+
+    // Rename rather than delete it so that it remains available (e.g. for switching back to the
+    // old configuration) with whatever was stored before the switch, and so that we don't
+    // re-import it on the next startup.
+    auto renamed = db_file;
+    renamed += suffix;
+    std::filesystem::rename(db_file, renamed);
+    log::warning(
+            logcat,
+            "Imported {} messages and {} subaccount revocations; moved {} to {}",
+            imported,
+            revocations,
+            db_file.filename().string(),
+            renamed.string());
+}
+
+bool Database::import_revocation(
+        const user_pubkey& pubkey, const std::string& token, int64_t timestamp) {
+    auto impl = get_impl(true);
+    auto ownerid = impl->get_owner(pubkey);
+    if (!ownerid)
+        return false;
+    exec_query(
+            impl->prepared_st(
+                    "INSERT INTO revoked_subaccounts (owner, token, timestamp) VALUES (?, ?, ?)"
+                    " ON CONFLICT(owner, token) DO UPDATE SET timestamp = excluded.timestamp"
+                    " WHERE revoked_subaccounts.timestamp < excluded.timestamp"_sql),
+            *ownerid,
+            blob_binder{token},
+            timestamp);
+    return true;
+}
+
+Database::pool_stats Database::get_pool_stats() {
+    if (!shards_.empty()) {
+        pool_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_pool_stats();
+            total.size += st.size;
+            total.idle += st.idle;
+            total.created += st.created;
+            total.waits += st.waits;
+            total.wait_us += st.wait_us;
+        }
+        return total;
+    }
+    pool_stats st{};
+    {
+        std::lock_guard lock{impl_lock_};
+        st.size = pool_size_;
+        st.idle = static_cast<int64_t>(impl_pool_.size());
+    }
+    st.created = pool_created_;
+    st.waits = pool_waits_;
+    st.wait_us = pool_wait_us_;
+    return st;
+}
+
+void Database::open() {
+    if (expiry_partitions_ > 0) {
+        message_tables_.push_back("messages_overflow");
+        for (int part = 0; part < expiry_partitions_; part++)
+            message_tables_.push_back("messages_{}"_format(part));
+    }
+
+    impl_pool_.push(std::make_unique<DatabaseImpl>(*this, db_file_, /*initialize=*/true));
+    pool_size_ = 1;
+    pool_created_ = 1;
+
+    if (expiry_partitions_ > 0)
+        next_message_id_ = get_impl(false)->prepared_get<int64_t>(
+                "SELECT COALESCE((SELECT id FROM messages_all ORDER BY id DESC LIMIT 1), 0)"
+                " + 1"_sql);
+
+    incremental_vacuum_ = get_impl(false)->prepared_get<int>("PRAGMA auto_vacuum"_sql) == 2;
+    if (!incremental_vacuum_)
+        log::info(
+                logcat,
+                "{} was not created with incremental auto-vacuum; free pages will be reused but "
+                "not released",
+                db_file_.string());
+    last_maintenance_ = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    revoked_reload(*get_impl(true));
+
+    clean_expired();
+
+    if (hash_filter_enabled_)
+        hash_filter_rebuild();
+
+    // Pre-warm the connection pool (see `database_options::pool_min`); the later connections
+    // prepare the hot statements themselves.
+    get_impl(false)->prepare_hot_statements();
+    for (int i = 1; i < pool_min_; i++) {
+        {
+            std::lock_guard lock{impl_lock_};
+            pool_size_++;
+        }
+        auto impl = open_connection();
+        std::lock_guard lock{impl_lock_};
+        impl_pool_.push(std::move(impl));
+    }
+}
+
 void Database::clean_expired() {
-    get_impl(true)->prepared_exec(
-            "DELETE FROM messages WHERE expiry <= ?",
-            to_epoch_ms(std::chrono::system_clock::now()));
+    if (!shards_.empty()) {
+        for (auto& shard : shards_)
+            shard->clean_expired();
+        return;
+    }
+    auto now_ms = to_epoch_ms(std::chrono::system_clock::now());
+    auto impl = get_impl(true);
+    int64_t deleted = 0;
+    if (expiry_partitions_ > 0) {
+        for (int part : impl->expired_partitions(now_ms))
+            deleted += impl->drop_partition(part);
+        deleted += impl->prepared_exec(
+                "DELETE FROM messages_overflow WHERE expiry <= ?"_sql, now_ms);
+    } else
+        deleted = impl->prepared_exec("DELETE FROM messages WHERE expiry <= ?"_sql, now_ms);
+    // With partitions, messages can also have expired (and been hidden) without being deleted:
+    if (deleted > 0 || expiry_partitions_ > 0)
+        tail_cache_expire(now_ms);
+    hash_filter_expired(deleted);
+}
+
+size_t Database::clean_expired_incremental(
+        size_t chunk_size, size_t max_rows, std::chrono::milliseconds max_time) {
+    if (!shards_.empty()) {
+        // The row and time budgets are shared across all the shards.
+        const auto started = std::chrono::steady_clock::now();
+        size_t deleted = 0;
+        for (auto& shard : shards_) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - started);
+            if (deleted >= max_rows || elapsed >= max_time)
+                break;
+            deleted += shard->clean_expired_incremental(
+                    chunk_size, max_rows - deleted, max_time - elapsed);
+        }
+        return deleted;
+    }
+    if (chunk_size < 1)
+        chunk_size = 1;
+    const auto started = std::chrono::steady_clock::now();
+    const auto now_ms = to_epoch_ms(std::chrono::system_clock::now());
+
+    auto record_chunk = [this](std::chrono::steady_clock::duration elapsed) {
+        int64_t chunk_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        cleanup_chunks_++;
+        cleanup_last_chunk_us_ = chunk_us;
+        auto prev_max = cleanup_max_chunk_us_.load();
+        while (prev_max < chunk_us &&
+               !cleanup_max_chunk_us_.compare_exchange_weak(prev_max, chunk_us))
+            ;
+    };
+
+    size_t deleted = 0;
+    bool more = true;
+    if (expiry_partitions_ > 0) {
+        // Expired ring tables get dropped whole, one per write lock acquisition; the row by row
+        // deletion below then only has the overflow table left to do.
+        for (int part : get_impl(false)->expired_partitions(now_ms)) {
+            if (deleted >= max_rows || std::chrono::steady_clock::now() - started >= max_time)
+                break;
+            auto chunk_start = std::chrono::steady_clock::now();
+            deleted += get_impl(true)->drop_partition(part);
+            record_chunk(std::chrono::steady_clock::now() - chunk_start);
+        }
+    }
+    while (more && deleted < max_rows) {
+        auto limit = std::min(chunk_size, max_rows - deleted);
+        auto chunk_start = std::chrono::steady_clock::now();
+        int count;
+        {
+            // We deliberately re-acquire the write lock for each chunk so that other queries can
+            // get in between chunks.
+            auto impl = get_impl(true);
+            count = impl->prepared_exec(
+                    expiry_partitions_ > 0
+                            ? "DELETE FROM messages_overflow WHERE id IN"
+                              " (SELECT id FROM messages_overflow WHERE expiry <= ? LIMIT ?)"_sql
+                            : "DELETE FROM messages WHERE id IN"
+                              " (SELECT id FROM messages WHERE expiry <= ? LIMIT ?)"_sql,
+                    now_ms,
+                    static_cast<int64_t>(limit));
+        }
+        auto chunk_end = std::chrono::steady_clock::now();
+        record_chunk(chunk_end - chunk_start);
+
+        deleted += count;
+        more = static_cast<size_t>(count) == limit;
+        if (chunk_end - started >= max_time)
+            break;
+    }
+    cleanup_deleted_ += deleted;
+    if (deleted > 0 || expiry_partitions_ > 0)
+        tail_cache_expire(now_ms);
+    hash_filter_expired(deleted);
+
+    int64_t backlog = 0;
+    if (more)
+        // We stopped because of the row or time budget, so count what is left for the stats (in
+        // partitioned mode only the overflow table's, since the ring tables have no expiry index
+        // to count with):
+        backlog = get_impl(false)->prepared_get<int64_t>(
+                expiry_partitions_ > 0
+                        ? "SELECT COUNT(*) FROM messages_overflow WHERE expiry <= ?"_sql
+                        : "SELECT COUNT(*) FROM messages WHERE expiry <= ?"_sql,
+                now_ms);
+    cleanup_backlog_ = backlog;
+
+    if (backlog > 0)
+        log::debug(
+                logcat,
+                "Deleted {} expired messages in {}; {} expired messages remain",
+                deleted,
+                logging::lazy([&started] {
+                    return util::short_duration(std::chrono::steady_clock::now() - started);
+                }),
+                backlog);
+    else if (deleted > 0)
+        log::debug(
+                logcat,
+                "Deleted {} expired messages in {}",
+                deleted,
+                logging::lazy([&started] {
+                    return util::short_duration(std::chrono::steady_clock::now() - started);
+                }));
+
+    return deleted;
+}
+
+Database::cleanup_stats Database::get_cleanup_stats() const {
+    if (!shards_.empty()) {
+        cleanup_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_cleanup_stats();
+            total.backlog += st.backlog;
+            total.deleted += st.deleted;
+            total.chunks += st.chunks;
+            total.last_chunk_us = std::max(total.last_chunk_us, st.last_chunk_us);
+            total.max_chunk_us = std::max(total.max_chunk_us, st.max_chunk_us);
+        }
+        return total;
+    }
+    return {cleanup_backlog_.load(),
+            cleanup_deleted_.load(),
+            cleanup_chunks_.load(),
+            cleanup_last_chunk_us_.load(),
+            cleanup_max_chunk_us_.load()};
+}
+
+std::vector<std::pair<int64_t, user_pubkey>> Database::eviction_candidates() {
+    // This has to count every owner's messages, but it's a scan of the messages_owner index and
+    // only needs to happen when we are close to full.
+    auto impl = get_impl(false);
+    auto st = impl->prepared_st(
+            "SELECT o.id, o.type, o.pubkey FROM"
+            " (SELECT owner, COUNT(*) AS n FROM messages GROUP BY owner ORDER BY n DESC LIMIT ?) c"
+            " JOIN owners o ON o.id = c.owner ORDER BY c.n DESC"_sql);
+    st->bind(1, EVICTION_OWNERS);
+    std::vector<std::pair<int64_t, user_pubkey>> owners;
+    while (step(*st)) {
+        auto [id, type, pk] = get<int64_t, uint8_t, std::string>(st);
+        owners.emplace_back(id, impl->load_pubkey(type, std::move(pk)));
+    }
+    return owners;
+}
+
+size_t Database::evict(const std::vector<std::pair<int64_t, user_pubkey>>& owners, size_t limit) {
+    if (owners.empty() || eviction_ == eviction_policy::none)
+        return 0;
+
+    std::string ids = "[";
+    for (const auto& [id, pk] : owners) {
+        if (ids.size() > 1)
+            ids += ',';
+        ids += std::to_string(id);
+    }
+    ids += ']';
+
+    int count;
+    {
+        auto impl = get_impl(true);
+        if (expiry_partitions_ > 0) {
+            // The DELETEs below would pick a fresh set of victims for each partition table, so
+            // pick them once up front instead:
+            auto victims = get_all<int64_t>(
+                    impl->prepared_st(
+                            eviction_ == eviction_policy::oldest
+                                    ? "SELECT id FROM messages"
+                                      " WHERE owner IN (SELECT value FROM json_each(?))"
+                                      " ORDER BY timestamp LIMIT ?"_sql
+                                    : "SELECT id FROM messages"
+                                      " WHERE owner IN (SELECT value FROM json_each(?))"
+                                      " ORDER BY expiry LIMIT ?"_sql),
+                    ids,
+                    static_cast<int64_t>(limit));
+            std::string victim_ids = "[";
+            for (auto id : victims) {
+                if (victim_ids.size() > 1)
+                    victim_ids += ',';
+                victim_ids += std::to_string(id);
+            }
+            victim_ids += ']';
+            count = impl->modify_exec(
+                    "DELETE FROM messages WHERE id IN (SELECT value FROM json_each(?))"_sql,
+                    victim_ids);
+        } else if (eviction_ == eviction_policy::oldest)
+            count = impl->prepared_exec(
+                    "DELETE FROM messages WHERE id IN (SELECT id FROM messages"
+                    " WHERE owner IN (SELECT value FROM json_each(?))"
+                    " ORDER BY timestamp LIMIT ?)"_sql,
+                    ids,
+                    static_cast<int64_t>(limit));
+        else
+            count = impl->prepared_exec(
+                    "DELETE FROM messages WHERE id IN (SELECT id FROM messages"
+                    " WHERE owner IN (SELECT value FROM json_each(?))"
+                    " ORDER BY expiry LIMIT ?)"_sql,
+                    ids,
+                    static_cast<int64_t>(limit));
+        for (const auto& [id, pk] : owners)
+            tail_cache_erase(pk);
+    }
+    evicted_ += count;
+    hash_filter_expired(count);
+    return count;
+}
+
+size_t Database::evict_excess() {
+    if (!shards_.empty()) {
+        size_t evicted = 0;
+        for (auto& shard : shards_)
+            evicted += shard->evict_excess();
+        return evicted;
+    }
+    if (eviction_ == eviction_policy::none ||
+        get_used_bytes() < size_limit_ / 100 * EVICTION_HIGH_WATER)
+        return 0;
+
+    const auto started = std::chrono::steady_clock::now();
+    const int64_t target = size_limit_ / 100 * EVICTION_LOW_WATER;
+    auto owners = eviction_candidates();
+    size_t evicted = 0;
+    while (get_used_bytes() > target &&
+           std::chrono::steady_clock::now() - started < CLEANUP_TIME_BUDGET) {
+        auto count = evict(owners, EVICTION_CHUNK_SIZE);
+        if (count == 0) {
+            // We've emptied out the biggest owners we found, so move on to the next biggest:
+            owners = eviction_candidates();
+            count = evict(owners, EVICTION_CHUNK_SIZE);
+            if (count == 0)
+                break;
+        }
+        evicted += count;
+    }
+
+    if (evicted > 0)
+        log::warning(
+                logcat,
+                "Database is nearly full: evicted {} messages in {}",
+                evicted,
+                util::short_duration(std::chrono::steady_clock::now() - started));
+    return evicted;
+}
+
+int64_t Database::get_evicted_count() const {
+    if (!shards_.empty()) {
+        int64_t total = 0;
+        for (auto& shard : shards_)
+            total += shard->get_evicted_count();
+        return total;
+    }
+    return evicted_.load();
+}
+
+int64_t Database::get_owner_bytes(const user_pubkey& pubkey) {
+    if (!shards_.empty())
+        return shard_for(pubkey).get_owner_bytes(pubkey);
+    auto impl = get_impl(false);
+    auto st = impl->prepared_st("SELECT bytes FROM owners WHERE pubkey = ? AND type = ?"_sql);
+    return exec_and_maybe_get<int64_t>(st, pubkey).value_or(0);
+}
+
+int64_t Database::get_quota_rejected_count() const {
+    if (!shards_.empty()) {
+        int64_t total = 0;
+        for (auto& shard : shards_)
+            total += shard->get_quota_rejected_count();
+        return total;
+    }
+    return quota_rejected_.load();
+}
+
+bool Database::run_maintenance(bool force) {
+    if (!shards_.empty()) {
+        bool ran = false;
+        for (auto& shard : shards_)
+            ran |= shard->run_maintenance(force);
+        return ran;
+    }
+
+    const auto started = std::chrono::steady_clock::now();
+    if (!force) {
+        auto since_write = started.time_since_epoch().count() - last_write_.load();
+        auto since_maint = started.time_since_epoch().count() - last_maintenance_.load();
+        if (std::chrono::steady_clock::duration{since_write} < MAINTENANCE_IDLE_TIME &&
+            std::chrono::steady_clock::duration{since_maint} < MAINTENANCE_MAX_DEFER)
+            return false;
+    }
+    last_maintenance_ = started.time_since_epoch().count();
+
+    bool rebuild_filter = false;
+    if (hash_filter_enabled_) {
+        std::lock_guard lock{hash_filter_mutex_};
+        const auto size = static_cast<int64_t>(hash_filter_.size());
+        rebuild_filter = hash_filter_.saturated() ||
+                         size > static_cast<int64_t>(hash_filter_.capacity()) ||
+                         hash_filter_stale_ * HASH_FILTER_STALE_FRACTION > size;
+    }
+    if (rebuild_filter)
+        hash_filter_rebuild();
+
+    // Vacuum first: the freed pages only actually leave the database file once the WAL frames
+    // that released them get checkpointed.
+    if (incremental_vacuum_) {
+        auto impl = get_impl(true);
+        auto free_pages = impl->prepared_get<int64_t>("PRAGMA freelist_count"_sql);
+        if (free_pages > 0) {
+            impl->db.exec("PRAGMA incremental_vacuum({})"_format(
+                    std::min(free_pages, MAINTENANCE_VACUUM_PAGES)));
+            vacuumed_pages_ +=
+                    free_pages - impl->prepared_get<int64_t>("PRAGMA freelist_count"_sql);
+        }
+    }
+
+    // Checkpoints don't need our write lock: a passive checkpoint runs alongside readers and
+    // writers, copying whatever it can without waiting on anyone.
+    auto checkpoint_start = std::chrono::steady_clock::now();
+    {
+        auto impl = get_impl(false);
+        auto* handle = impl->db.getHandle();
+        int log_frames = 0, checkpointed = 0;
+        int rc = sqlite3_wal_checkpoint_v2(
+                handle, nullptr, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed);
+        if (rc == SQLITE_OK && log_frames > 0 && checkpointed == log_frames) {
+            // Everything made it into the database, so we can also truncate the WAL file.  That
+            // needs to briefly exclude other connections; rather than wait for them we just try
+            // again next time.
+            sqlite3_busy_timeout(handle, 0);
+            rc = sqlite3_wal_checkpoint_v2(
+                    handle, nullptr, SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr);
+            sqlite3_busy_timeout(handle, SQLite_busy_timeout.count());
+        }
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+            log::warning(logcat, "WAL checkpoint failed: {}", sqlite3_errstr(rc));
+    }
+    int64_t checkpoint_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - checkpoint_start)
+                                    .count();
+    checkpoints_++;
+    checkpoint_last_us_ = checkpoint_us;
+    auto prev_max = checkpoint_max_us_.load();
+    while (prev_max < checkpoint_us &&
+           !checkpoint_max_us_.compare_exchange_weak(prev_max, checkpoint_us))
+        ;
+
+    log::debug(
+            logcat,
+            "Database maintenance took {}",
+            logging::lazy([&started] {
+                return util::short_duration(std::chrono::steady_clock::now() - started);
+            }));
+    return true;
+}
+
+Database::maintenance_stats Database::get_maintenance_stats() {
+    if (!shards_.empty()) {
+        maintenance_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_maintenance_stats();
+            total.wal_bytes += st.wal_bytes;
+            total.freelist_pages += st.freelist_pages;
+            total.checkpoints += st.checkpoints;
+            total.last_checkpoint_us = std::max(total.last_checkpoint_us, st.last_checkpoint_us);
+            total.max_checkpoint_us = std::max(total.max_checkpoint_us, st.max_checkpoint_us);
+            total.vacuumed_pages += st.vacuumed_pages;
+        }
+        return total;
+    }
+    maintenance_stats st{};
+    auto wal_file = db_file_;
+    wal_file += u8"-wal";
+    std::error_code ec;
+    if (auto size = std::filesystem::file_size(wal_file, ec); !ec)
+        st.wal_bytes = static_cast<int64_t>(size);
+    st.freelist_pages = get_impl(false)->prepared_get<int64_t>("PRAGMA freelist_count"_sql);
+    st.checkpoints = checkpoints_.load();
+    st.last_checkpoint_us = checkpoint_last_us_.load();
+    st.max_checkpoint_us = checkpoint_max_us_.load();
+    st.vacuumed_pages = vacuumed_pages_.load();
+    return st;
 }
 
 int64_t Database::get_message_count() {
-    return get_impl(false)->prepared_get<int64_t>("SELECT COUNT(*) FROM messages");
+    if (!shards_.empty()) {
+        int64_t count = 0;
+        for (auto& shard : shards_)
+            count += shard->get_message_count();
+        return count;
+    }
+    return get_impl(false)->prepared_get<int64_t>(
+            "SELECT COALESCE(SUM(messages), 0) FROM message_stats"_sql);
+}
+
+int64_t Database::get_message_count(uint64_t swarm_space_begin, uint64_t swarm_space_end) {
+    if (!shards_.empty()) {
+        int64_t count = 0;
+        for (auto& shard : shards_)
+            count += shard->get_message_count(swarm_space_begin, swarm_space_end);
+        return count;
+    }
+    auto impl = get_impl(false);
+    int64_t count = 0;
+    for (auto [lo, hi] : swarm_space_key_ranges(swarm_space_begin, swarm_space_end)) {
+        if (expiry_partitions_ > 0) {
+            // sqlite materializes the whole partition view for an aggregate over this join
+            // (rather than using each table's owner index), but not for the plain join:
+            auto st = impl->prepared_st(
+                    "SELECT 1 FROM messages JOIN owners ON messages.owner = owners.id"
+                    " WHERE owners.swarm_space BETWEEN ? AND ?"_sql);
+            st->bind(1, lo);
+            st->bind(2, hi);
+            while (step(*st))
+                count++;
+        } else
+            count += impl->prepared_get<int64_t>(
+                    "SELECT COUNT(*) FROM messages JOIN owners ON messages.owner = owners.id"
+                    " WHERE owners.swarm_space BETWEEN ? AND ?"_sql,
+                    lo,
+                    hi);
+    }
+    return count;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> Database::split_swarm_space(
+        uint64_t begin, uint64_t end, size_t n) {
+    // len == 0 means the full (2^64) space
+    const uint64_t len = end - begin;
+    if (n < 1)
+        n = 1;
+    if (len != 0 && len < n)
+        n = len;
+    const uint64_t width = len != 0 ? len / n : std::numeric_limits<uint64_t>::max() / n + 1;
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        ranges.emplace_back(begin + width * i, i + 1 == n ? end : begin + width * (i + 1));
+    return ranges;
+}
+
+// FNV-1a; we need something that is the same everywhere (unlike std::hash), but it doesn't have to
+// be cryptographic: the hashes being digested already are.
+static uint64_t hash_digest(std::string_view hash) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : hash) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+std::vector<Database::range_summary> Database::summarize_range(
+        uint64_t begin, uint64_t end, size_t n) {
+    auto buckets = split_swarm_space(begin, end, n);
+    std::vector<range_summary> result(buckets.size());
+    if (!shards_.empty()) {
+        // Counts add and digests XOR, so we can just combine each shard's values:
+        for (auto& shard : shards_) {
+            auto sub = shard->summarize_range(begin, end, n);
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i].count += sub[i].count;
+                result[i].digest ^= sub[i].digest;
+            }
+        }
+        return result;
+    }
+
+    auto impl = get_impl(false);
+    for (size_t i = 0; i < buckets.size(); i++) {
+        auto& summary = result[i];
+        for (auto [lo, hi] : swarm_space_key_ranges(buckets[i].first, buckets[i].second)) {
+            auto st = impl->prepared_st(
+                    "SELECT hash_from_db(hash)"
+                    " FROM messages JOIN owners ON messages.owner = owners.id"
+                    " WHERE owners.swarm_space BETWEEN ? AND ?"_sql);
+            st->bind(1, lo);
+            st->bind(2, hi);
+            while (step(*st)) {
+                summary.count++;
+                summary.digest ^= hash_digest(get<std::string>(st));
+            }
+        }
+    }
+    return result;
+}
+
+std::vector<std::string> Database::hashes_in_range(uint64_t begin, uint64_t end, int64_t limit) {
+    std::vector<std::string> hashes;
+    auto remaining = [&] {
+        return limit < 0 ? limit : limit - static_cast<int64_t>(hashes.size());
+    };
+    if (!shards_.empty()) {
+        for (auto& shard : shards_) {
+            if (remaining() == 0)
+                break;
+            auto sub = shard->hashes_in_range(begin, end, remaining());
+            hashes.insert(
+                    hashes.end(),
+                    std::make_move_iterator(sub.begin()),
+                    std::make_move_iterator(sub.end()));
+        }
+        return hashes;
+    }
+
+    auto impl = get_impl(false);
+    for (auto [lo, hi] : swarm_space_key_ranges(begin, end)) {
+        if (remaining() == 0)
+            break;
+        auto st = impl->prepared_st(
+                "SELECT hash_from_db(hash) FROM messages JOIN owners ON messages.owner = owners.id"
+                " WHERE owners.swarm_space BETWEEN ? AND ? LIMIT ?"_sql);
+        auto more = get_all<std::string>(st, lo, hi, remaining());
+        hashes.insert(
+                hashes.end(),
+                std::make_move_iterator(more.begin()),
+                std::make_move_iterator(more.end()));
+    }
+    return hashes;
 }
 
 int64_t Database::get_owner_count() {
-    return get_impl(false)->prepared_get<int64_t>("SELECT COUNT(*) FROM owners");
+    if (!shards_.empty()) {
+        int64_t count = 0;
+        for (auto& shard : shards_)
+            count += shard->get_owner_count();
+        return count;
+    }
+    return get_impl(false)->prepared_get<int64_t>("SELECT owners FROM owner_stats"_sql);
 }
 
 std::vector<int> Database::get_message_counts() {
+    if (!shards_.empty()) {
+        std::vector<int> counts;
+        for (auto& shard : shards_) {
+            auto c = shard->get_message_counts();
+            counts.insert(counts.end(), c.begin(), c.end());
+        }
+        return counts;
+    }
     auto impl = get_impl(false);
-    auto st = impl->prepared_st("SELECT COUNT(*) FROM messages GROUP BY owner");
+    auto st = impl->prepared_st("SELECT COUNT(*) FROM messages GROUP BY owner"_sql);
     return get_all<int>(st);
 }
 
-std::vector<std::pair<namespace_id, int64_t>> Database::get_namespace_counts() {
-    auto impl = get_impl(false);
-    auto st = impl->prepared_st("SELECT namespace, COUNT(*) FROM messages GROUP BY namespace");
-    return get_all<namespace_id, int64_t>(st);
+std::vector<std::pair<namespace_id, int64_t>> Database::get_namespace_counts() {
+    if (!shards_.empty()) {
+        std::map<namespace_id, int64_t> sums;
+        for (auto& shard : shards_)
+            for (auto& [ns, count] : shard->get_namespace_counts())
+                sums[ns] += count;
+        return {sums.begin(), sums.end()};
+    }
+    auto impl = get_impl(false);
+    auto st = impl->prepared_st(
+            "SELECT namespace, messages FROM message_stats WHERE messages > 0"
+            " ORDER BY namespace"_sql);
+    return get_all<namespace_id, int64_t>(st);
+}
+
+int64_t Database::get_total_bytes() {
+    if (!shards_.empty()) {
+        int64_t bytes = 0;
+        for (auto& shard : shards_)
+            bytes += shard->get_total_bytes();
+        return bytes;
+    }
+    auto impl = get_impl(false);
+    return impl->prepared_get<int64_t>("PRAGMA page_count"_sql) * impl->page_size;
+}
+
+int64_t Database::get_used_bytes() {
+    if (!shards_.empty()) {
+        int64_t bytes = 0;
+        for (auto& shard : shards_)
+            bytes += shard->get_used_bytes();
+        return bytes;
+    }
+    auto impl = get_impl(false);
+    return get_total_bytes() -
+           impl->prepared_get<int64_t>("PRAGMA freelist_count"_sql) * impl->page_size;
+}
+
+static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement& st) {
+    std::optional<message> msg;
+    while (step(st)) {
+        assert(!msg);
+        auto [hash, otype, opubkey, ns, ts, exp, data] =
+                get<std::string, uint8_t, std::string, namespace_id, int64_t, int64_t, std::string>(
+                        st);
+        msg.emplace(
+                impl.load_pubkey(otype, std::move(opubkey)),
+                std::move(hash),
+                ns,
+                from_epoch_ms(ts),
+                from_epoch_ms(exp),
+                std::move(data));
+    }
+    return msg;
+}
+
+std::optional<message> Database::retrieve_random() {
+    if (!shards_.empty()) {
+        // Pick a shard weighted by its message count so that every message is (roughly) equally
+        // likely:
+        std::vector<int64_t> counts;
+        int64_t total = 0;
+        for (auto& shard : shards_)
+            total += counts.emplace_back(shard->get_message_count());
+        if (total <= 0)
+            return std::nullopt;
+        auto r = static_cast<int64_t>(util::uniform_distribution_portable(util::rng(), total));
+        for (size_t i = 0; i < shards_.size(); i++) {
+            if (r < counts[i])
+                return shards_[i]->retrieve_random();
+            r -= counts[i];
+        }
+        return std::nullopt;
+    }
+    // Rather than ORDER BY RANDOM() (which has to scan and sort every message) we pick a random
+    // id between the first and last ids and take the first unexpired message at or after it
+    // (wrapping around to the beginning if there isn't one).  Since ids can have gaps this slightly
+    // favours messages following a gap, but that's fine for testing purposes; the benefit is that
+    // this is just a couple of index seeks.
+    //
+    // (These are all written as ORDER BY ... LIMIT on `messages` itself, rather than as MIN/MAX or
+    // on the owned_messages join, because those forms also let sqlite merge the per-table results
+    // in id order when `messages` is the expiry partition view.)
+    auto impl = get_impl(false);
+    auto [min_id, max_id] = impl->prepared_get<int64_t, int64_t>(
+            "SELECT COALESCE((SELECT id FROM messages ORDER BY id LIMIT 1), 0),"
+            " COALESCE((SELECT id FROM messages ORDER BY id DESC LIMIT 1), 0)"_sql);
+    if (max_id <= 0)
+        return std::nullopt;
+
+    auto now_ms = to_epoch_ms(std::chrono::system_clock::now());
+    auto pick = min_id + static_cast<int64_t>(util::uniform_distribution_portable(
+                                 util::rng(), static_cast<uint64_t>(max_id - min_id) + 1));
+
+    auto st = impl->prepared_st(
+            "SELECT hash_from_db(hash), type, pubkey, namespace, timestamp, expiry, data"
+            " FROM (SELECT * FROM messages WHERE id >= ? AND expiry > ? ORDER BY id LIMIT 1) m"
+            " JOIN owners ON m.owner = owners.id"_sql);
+    st->bind(1, pick);
+    st->bind(2, now_ms);
+    if (auto msg = get_message(*impl, st))
+        return msg;
+
+    auto wrap = impl->prepared_st(
+            "SELECT hash_from_db(hash), type, pubkey, namespace, timestamp, expiry, data"
+            " FROM (SELECT * FROM messages WHERE id < ? AND expiry > ? ORDER BY id LIMIT 1) m"
+            " JOIN owners ON m.owner = owners.id"_sql);
+    wrap->bind(1, pick);
+    wrap->bind(2, now_ms);
+    return get_message(*impl, wrap);
+}
+
+std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
+    if (!shards_.empty()) {
+        for (auto& shard : shards_)
+            if (auto msg = shard->retrieve_by_hash(msg_hash))
+                return msg;
+        return std::nullopt;
+    }
+    auto impl = get_impl(false);
+    auto st = impl->prepared_st(
+            "SELECT hash_from_db(hash), type, pubkey, namespace, timestamp, expiry, data"
+            " FROM owned_messages WHERE hash = hash_to_db(?)"_sql);
+    st->bindNoCopy(1, msg_hash);
+    return get_message(*impl, st);
+}
+
+// Inserts a message, or extends the expiry of (or just finds) an existing one, for store_one.
+static StoreResult store_message(
+        DatabaseImpl& impl,
+        int64_t owner_id,
+        const message& msg,
+        std::chrono::system_clock::time_point* expiry) {
+    StoreResult ret;
+
+    auto new_exp = to_epoch_ms(msg.expiry);
+
+    if (!impl.partitioned()) {
+        // A new message, an expiry extension, and a duplicate all take just this one statement
+        // (plus a lookup of the existing expiry for a duplicate, if the caller wants it).
+        impl.clear_inserted_rowid();
+        auto upserted = exec_and_maybe_get<int64_t, int64_t>(
+                impl.prepared_st(upsert_message_sql()),
+                owner_id,
+                msg.hash,
+                msg.msg_namespace,
+                to_epoch_ms(msg.timestamp),
+                new_exp,
+                blob_binder{msg.data});
+        if (!upserted) {
+            if (expiry)
+                *expiry = from_epoch_ms(std::get<1>(exec_and_get<int64_t, int64_t>(
+                        impl.prepared_st(existing_message_sql(false)), msg.hash)));
+            return StoreResult::Exists;
+        }
+        auto& [id, exp] = *upserted;
+        if (expiry)
+            *expiry = from_epoch_ms(exp);
+        if (!impl.inserted_rowid(id))
+            return StoreResult::Extended;
+        // If the transaction gets rolled back this leaves a stale hash in the filter, which is
+        // harmless.
+        impl.hash_filter_add(msg.hash);
+        return StoreResult::New;
+    }
+
+    if (auto existing = exec_and_maybe_get<int64_t, int64_t>(
+                impl.prepared_st(existing_message_sql(true)), msg.hash)) {
+        auto& [id, exp] = *existing;
+        if (exp < new_exp) {
+            impl.modify_messages(
+                    "UPDATE messages SET expiry = ? WHERE id = ?"_sql,
+                    [&](SQLite::Statement& st) { exec_query(st, new_exp, id); },
+                    /*cached=*/true,
+                    /*live_only=*/false);
+            ret = StoreResult::Extended;
+            exp = new_exp;
+        } else {
+            ret = StoreResult::Exists;
+        }
+        if (expiry)
+            *expiry = from_epoch_ms(exp);
+    } else {
+        impl.prepared_exec(
+                "INSERT INTO {} (id, owner, hash, namespace, timestamp, expiry, data)"
+                " VALUES (?, ?, hash_to_db(?), ?, ?, ?, ?)"_format(
+                        impl.message_table_for(new_exp)),
+                impl.next_message_id(),
+                owner_id,
+                msg.hash,
+                msg.msg_namespace,
+                to_epoch_ms(msg.timestamp),
+                new_exp,
+                blob_binder{msg.data});
+        impl.used_message_id();
+        ret = StoreResult::New;
+        // If the transaction gets rolled back this leaves a stale hash in the filter, which is
+        // harmless.
+        impl.hash_filter_add(msg.hash);
+
+        if (expiry)
+            *expiry = msg.expiry;
+    }
+
+    return ret;
+}
+
+// Performs the store of a single message; must be called from within a transaction on a write
+// connection.  Sets `new_owner` to true if the store had to create a new owner row.
+static StoreResult store_one(
+        DatabaseImpl& impl,
+        const message& msg,
+        std::chrono::system_clock::time_point* expiry,
+        bool& new_owner) {
+    auto owner_id = impl.upsert_owner(msg.pubkey, new_owner);
+
+    // When storing to a public namespace we clear anything else there (but not a duplicate, to
+    // avoid unnecessary storage churn).  The quota check has to come first, counting the bytes
+    // that clearing gives back, so that a rejected store doesn't still wipe the namespace; the
+    // clearing comes after the store, so that it can't remove the owner's last message (and
+    // with it, via the autoclean trigger, the owner row we just looked up).
+    const bool replaces = is_public_outbox_namespace(msg.msg_namespace);
+
+    // A new owner has nothing stored yet, and so can't be over its quota.
+    if (!new_owner && impl.over_quota(owner_id, msg, replaces))
+        return StoreResult::OverQuota;
+
+    auto ret = store_message(impl, owner_id, msg, expiry);
+
+    if (replaces) {
+        impl.hash_filter_erase(impl.modify_get_all<std::string>(
+                "DELETE FROM messages"
+                " WHERE owner = ? AND namespace = ? AND hash != hash_to_db(?)"
+                " RETURNING hash_from_db(hash)"_sql,
+                owner_id,
+                msg.msg_namespace,
+                msg.hash));
+    }
+
+    return ret;
+}
+
+Database::group_commit_stats Database::get_group_commit_stats() const {
+    if (!shards_.empty()) {
+        group_commit_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_group_commit_stats();
+            total.batches += st.batches;
+            total.stores += st.stores;
+        }
+        return total;
+    }
+    return {group_commit_batches_.load(), group_commit_stores_.load()};
+}
+
+StoreResult Database::store(const message& msg, std::chrono::system_clock::time_point* expiry) {
+    if (!shards_.empty())
+        return shard_for(msg.pubkey).store(msg, expiry);
+    if (auto existing = store_existing(msg, expiry))
+        return *existing;
+    if (group_commit_)
+        return store_grouped(msg, expiry);
+    return store_single(msg, expiry);
+}
+
+std::optional<StoreResult> Database::store_existing(
+        const message& msg, std::chrono::system_clock::time_point* expiry) {
+    // Stores to a public outbox namespace also clear out the rest of the namespace, so always
+    // need the write path.
+    if (!hash_filter_enabled_ || is_public_outbox_namespace(msg.msg_namespace) ||
+        !hash_filter_maybe_contains(msg.hash))
+        return std::nullopt;
+
+    auto impl = get_impl(false);
+    auto existing = exec_and_maybe_get<int64_t>(
+            impl->prepared_st(
+                    expiry_partitions_ > 0
+                            ? "SELECT expiry FROM messages_all WHERE hash = hash_to_db(?)"_sql
+                            : "SELECT expiry FROM messages WHERE hash = hash_to_db(?)"_sql),
+            msg.hash);
+    if (!existing) {
+        hash_filter_false_positives_++;
+        return std::nullopt;
+    }
+    if (*existing < to_epoch_ms(msg.expiry))
+        return std::nullopt;  // Needs its expiry extended
+    hash_filter_skipped_++;
+    if (expiry)
+        *expiry = from_epoch_ms(*existing);
+    return StoreResult::Exists;
+}
+
+StoreResult Database::store_single(
+        const message& msg, std::chrono::system_clock::time_point* expiry) {
+
+    for (bool evicted = false;; evicted = true) {
+        {
+            auto impl = get_impl(true);
+            try {
+                SQLite::Transaction transaction{impl->db};
+                bool new_owner;
+                auto ret = store_one(*impl, msg, expiry, new_owner);
+                transaction.commit();
+                // Still holding the write lock here, so cache updates happen in commit order:
+                tail_cache_stored(msg, ret, new_owner);
+                return ret;
+            } catch (const SQLite::Exception& e) {
+                if (e.getErrorCode() != SQLITE_FULL) {
+                    log::critical(logcat, "Failed to store message: {}", e.getErrorStr());
+                    throw;
+                }
+            }
+        }
+
+        // The database is full.  Normally evict_excess() keeps us from getting here at all, but if
+        // it couldn't keep up then make some room right now and try once more.
+        if (evicted || eviction_ == eviction_policy::none ||
+            evict(eviction_candidates(), EVICTION_CHUNK_SIZE) == 0) {
+            if (db_full_counter++ % DB_FULL_FREQUENCY == 0)
+                log::error(logcat, "Failed to store message: database is full");
+            return StoreResult::Full;
+        }
+    }
+}
+
+/// A store() call waiting in the group commit queue.
+struct Database::pending_store {
+    const message& msg;
+    std::chrono::system_clock::time_point* expiry;
+    StoreResult result{};
+    bool new_owner = false;
+    std::exception_ptr error;
+    bool done = false;
+};
+
+StoreResult Database::store_grouped(
+        const message& msg, std::chrono::system_clock::time_point* expiry) {
+    // Group commit works leader/follower style: we queue ourself up and then, if no other thread
+    // is currently committing, become the committer and store everything queued so far (including
+    // our own message) in a single transaction.  Otherwise we wait: either the active committer
+    // picks us up in its next batch, or it finishes and one of the waiting threads takes over.
+    pending_store self{msg, expiry};
+
+    std::unique_lock lock{group_commit_mutex_};
+    group_commit_queue_.push_back(&self);
+    while (!self.done) {
+        if (group_commit_active_) {
+            group_commit_cv_.wait(lock);
+            continue;
+        }
+
+        group_commit_active_ = true;
+        std::vector<pending_store*> batch;
+        if (group_commit_queue_.size() <= GROUP_COMMIT_MAX_BATCH)
+            batch.swap(group_commit_queue_);
+        else {
+            auto end = group_commit_queue_.begin() + GROUP_COMMIT_MAX_BATCH;
+            batch.assign(group_commit_queue_.begin(), end);
+            group_commit_queue_.erase(group_commit_queue_.begin(), end);
+        }
+        lock.unlock();
+
+        store_batch(batch);
+
+        lock.lock();
+        for (auto* p : batch)
+            p->done = true;
+        group_commit_active_ = false;
+        group_commit_cv_.notify_all();
+    }
+    lock.unlock();
+
+    if (self.error)
+        std::rethrow_exception(self.error);
+    return self.result;
+}
+
+void Database::store_batch(const std::vector<pending_store*>& batch) {
+    bool committed = false;
+    if (batch.size() > 1) {
+        try {
+            auto impl = get_impl(true);
+            SQLite::Transaction transaction{impl->db};
+            for (auto* p : batch)
+                p->result = store_one(*impl, p->msg, p->expiry, p->new_owner);
+            transaction.commit();
+            committed = true;
+            for (auto* p : batch)
+                tail_cache_stored(p->msg, p->result, p->new_owner);
+            group_commit_batches_++;
+            group_commit_stores_ += batch.size();
+        } catch (const std::exception& e) {
+            log::debug(
+                    logcat,
+                    "Group commit of {} messages failed ({}); retrying individually",
+                    batch.size(),
+                    e.what());
+        }
+    }
+
+    if (!committed) {
+        // Either a lone store, or the batch failed (e.g. because the database is full): store
+        // each message in its own transaction so that each caller gets its own result.
+        for (auto* p : batch) {
+            try {
+                p->result = store_single(p->msg, p->expiry);
+            } catch (...) {
+                p->error = std::current_exception();
+            }
+        }
+    }
+}
+
+namespace {
+    // Accessors that let bulk_store_impl treat `message`s and `message_ref`s alike.
+    const user_pubkey& owner_of(const message& m) {
+        return m.pubkey;
+    }
+    const user_pubkey& owner_of(const message_ref& m) {
+        return *m.pubkey;
+    }
+    const message& contents_of(const message& m) {
+        return m;
+    }
+    const message_view& contents_of(const message_ref& m) {
+        return m.msg;
+    }
+}  // namespace
+
+int Database::bulk_store(const std::vector<message>& items) {
+    return bulk_store_impl(items);
+}
+
+int Database::bulk_store(const std::vector<message_ref>& items) {
+    return bulk_store_impl(items);
+}
+
+template <typename Msg>
+int Database::bulk_store_impl(const std::vector<Msg>& items) {
+    if (!shards_.empty()) {
+        std::unordered_map<Database*, std::vector<Msg>> by_shard;
+        for (auto& m : items)
+            if (owner_of(m))
+                by_shard[&shard_for(owner_of(m))].push_back(m);
+        int added = 0;
+        for (auto& [shard, msgs] : by_shard)
+            added += shard->bulk_store_impl(msgs);
+        return added;
+    }
+
+    // Pick out the messages that we already have, so that we can skip them (or the whole store, if
+    // it is nothing but messages we already have) without taking the write lock:
+    std::vector<bool> skip(items.size(), false);
+    if (hash_filter_enabled_) {
+        std::vector<size_t> maybe;
+        {
+            std::lock_guard lock{hash_filter_mutex_};
+            for (size_t i = 0; i < items.size(); i++)
+                if (owner_of(items[i]) && hash_filter_.maybe_contains(contents_of(items[i]).hash))
+                    maybe.push_back(i);
+        }
+        if (!maybe.empty()) {
+            auto impl = get_impl(false);
+            auto st = impl->prepared_st(
+                    expiry_partitions_ > 0
+                            ? "SELECT EXISTS(SELECT * FROM messages_all"
+                              " WHERE hash = hash_to_db(?))"_sql
+                            : "SELECT EXISTS(SELECT * FROM messages"
+                              " WHERE hash = hash_to_db(?))"_sql);
+            for (auto i : maybe) {
+                skip[i] = exec_and_get<int64_t>(st, contents_of(items[i]).hash) != 0;
+                st->reset();
+                if (skip[i])
+                    hash_filter_skipped_++;
+                else
+                    hash_filter_false_positives_++;
+            }
+        }
+        bool any_new = false;
+        for (size_t i = 0; i < items.size() && !any_new; i++)
+            any_new = owner_of(items[i]) && !skip[i];
+        if (!any_new)
+            return 0;
+    }
+
+    auto impl = get_impl(true);
+    SQLite::Transaction t{impl->db};
+    // Owner ids (and one of the owner's pubkeys) of the owners we've seen:
+    std::unordered_map<prefixed_pubkey, std::pair<int64_t, const user_pubkey*>> seen;
+    for (size_t i = 0; i < items.size(); i++) {
+        auto& pubkey = owner_of(items[i]);
+        if (!pubkey || skip[i])
+            continue;
+        if (auto [it, ins] = seen.try_emplace(pubkey.key(), 0, &pubkey); ins) {
+            bool inserted;
+            it->second.first = impl->upsert_owner(pubkey, inserted);
+        }
+    }
+
+    int added = 0;
+    std::vector<std::string_view> added_hashes;
+    for (size_t i = 0; i < items.size(); i++) {
+        auto& pubkey = owner_of(items[i]);
+        if (!pubkey || skip[i])
+            continue;
+        auto owner_it = seen.find(pubkey.key());
+        if (owner_it == seen.end())
+            continue;
+
+        auto& m = contents_of(items[i]);
+        if (expiry_partitions_ > 0) {
+            // Each partition table only enforces hash uniqueness within itself, so we have to
+            // check the rest ourselves:
+            auto expiry = to_epoch_ms(m.expiry);
+            int inserted = exec_query(
+                    impl->prepared_st(
+                            "INSERT INTO {} (id, owner, hash, namespace, timestamp, expiry, data)"
+                            " SELECT ?1, ?2, hash_to_db(?3), ?4, ?5, ?6, ?7 WHERE NOT EXISTS"
+                            " (SELECT * FROM messages_all WHERE hash = hash_to_db(?3))"_format(
+                                    impl->message_table_for(expiry))),
+                    next_message_id_,
+                    owner_it->second.first,
+                    m.hash,
+                    m.msg_namespace,
+                    to_epoch_ms(m.timestamp),
+                    expiry,
+                    blob_binder{m.data});
+            next_message_id_ += inserted;
+            added += inserted;
+            if (inserted)
+                added_hashes.push_back(m.hash);
+            continue;
+        }
+        int inserted = impl->prepared_exec(
+                "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
+                " VALUES (?, hash_to_db(?), ?, ?, ?, ?)"
+                " ON CONFLICT DO NOTHING"_sql,
+                owner_it->second.first,
+                m.hash,
+                m.msg_namespace,
+                to_epoch_ms(m.timestamp),
+                to_epoch_ms(m.expiry),
+                blob_binder{m.data});
+        added += inserted;
+        if (inserted)
+            added_hashes.push_back(m.hash);
+    }
+
+    t.commit();
+    for (auto hash : added_hashes)
+        hash_filter_add(hash);
+
+    // We don't know exactly where the new messages landed relative to any cached messages, so just
+    // drop the affected owners from the tail cache:
+    for (auto& [key, owner] : seen)
+        tail_cache_erase(*owner.second);
+
+    return added;
+}
+
+/// Applies the count and aggregate size limits of a `retrieve`.
+struct Database::retrieve_limiter {
+    std::optional<size_t> max_results;
+    std::optional<size_t> max_size;
+    bool size_b64;
+    size_t per_message_overhead;
+    // Optional limits shared with other retrieves (see retrieve_multi), which must also be met.
+    retrieve_limiter* shared = nullptr;
+    size_t count = 0;
+    size_t agg_size = 0;
+
+    size_t message_size(size_t hash_size, size_t data_size) const {
+        return per_message_overhead + hash_size + (size_b64 ? data_size * 4 / 3 : data_size);
+    }
+
+    // `size` is the message's size as counted by the limiter the message was added to (the shared
+    // limits count messages at that size, rather than with their own `size_b64`).
+    bool fits(size_t size) const {
+        if (max_results && count >= *max_results)
+            return false;
+        if (max_size && count > 0 && agg_size + size > *max_size)
+            return false;
+        return !shared || shared->fits(size);
+    }
+
+    // Returns true (and counts the message) if a message with the given hash and data sizes fits
+    // within the limits; returns false if the retrieve has to stop before it.
+    bool add(size_t hash_size, size_t data_size) {
+        auto size = message_size(hash_size, data_size);
+        if (!fits(size))
+            return false;
+        for (auto* l = this; l; l = l->shared) {
+            l->count++;
+            l->agg_size += size;
+        }
+        return true;
+    }
+};
+
+static size_t tail_cache_size(const message& m) {
+    return m.hash.size() + m.data.size();
+}
+
+void Database::tail_cache_stored(const message& msg, StoreResult result, bool new_owner) {
+    std::lock_guard lock{tail_cache_mutex_};
+
+    auto forget = [this](auto& owner_entries, namespace_id ns) {
+        if (auto it = owner_entries.find(ns); it != owner_entries.end()) {
+            for (auto& m : it->second.msgs)
+                tail_cache_bytes_ -= tail_cache_size(*m);
+            owner_entries.erase(it);
+        }
+    };
+
+    // Storing to a public namespace deletes everything else in it:
+    const bool cleared_ns = is_public_outbox_namespace(msg.msg_namespace);
+
+    if (result != StoreResult::New) {
+        auto it = tail_cache_.find(msg.pubkey);
+        if (it == tail_cache_.end())
+            return;
+        if (cleared_ns)
+            forget(it->second, msg.msg_namespace);
+        else if (auto eit = it->second.find(msg.msg_namespace);
+                 result == StoreResult::Extended && eit != it->second.end()) {
+            for (auto& m : eit->second.msgs) {
+                if (m->hash == msg.hash) {
+                    auto updated = std::make_shared<message>(*m);
+                    updated->expiry = from_epoch_ms(to_epoch_ms(msg.expiry));
+                    m = std::move(updated);
+                    break;
+                }
+            }
+        }
+        if (it->second.empty())
+            tail_cache_.erase(it);
+        return;
+    }
+
+    auto& owner_entries = tail_cache_[msg.pubkey];
+    if (new_owner || cleared_ns || tail_cache_size(msg) > TAIL_CACHE_MAX_MESSAGE)
+        forget(owner_entries, msg.msg_namespace);
+    if (tail_cache_size(msg) > TAIL_CACHE_MAX_MESSAGE) {
+        // Don't let a handful of large messages push everything else out; we just dropped the
+        // (owner, ns) entry above since it would otherwise now be missing the newest message.
+        if (owner_entries.empty())
+            tail_cache_.erase(msg.pubkey);
+        return;
+    }
+
+    auto [eit, inserted] = owner_entries.try_emplace(msg.msg_namespace);
+    auto& entry = eit->second;
+    if (inserted)
+        // If we just created the owner, or a public namespace store just cleared out everything
+        // else, then this message is the only one in the namespace.  Otherwise we only know that
+        // it is the newest one.
+        entry.complete = new_owner || cleared_ns;
+
+    // Timestamps are stored (and thus retrieved) with millisecond precision, so make sure that
+    // the cached copy is identical to what a database retrieve would give.
+    auto& m = *entry.msgs.emplace_back(std::make_shared<message>(
+            msg.hash,
+            msg.msg_namespace,
+            from_epoch_ms(to_epoch_ms(msg.timestamp)),
+            from_epoch_ms(to_epoch_ms(msg.expiry)),
+            msg.data));
+    tail_cache_bytes_ += tail_cache_size(m);
+    while (entry.msgs.size() > TAIL_CACHE_MESSAGES) {
+        tail_cache_bytes_ -= tail_cache_size(*entry.msgs.front());
+        entry.msgs.pop_front();
+        entry.complete = false;
+    }
+
+    // Evict arbitrary other owners if we are over the size limit:
+    while (tail_cache_bytes_ > TAIL_CACHE_BYTES && tail_cache_.size() > 1) {
+        auto victim = tail_cache_.begin();
+        if (victim->first == msg.pubkey)
+            ++victim;
+        for (auto& [ns, e] : victim->second)
+            for (auto& vm : e.msgs)
+                tail_cache_bytes_ -= tail_cache_size(*vm);
+        tail_cache_.erase(victim);
+    }
+}
+
+void Database::tail_cache_erase(const user_pubkey& pubkey) {
+    std::lock_guard lock{tail_cache_mutex_};
+    auto it = tail_cache_.find(pubkey);
+    if (it == tail_cache_.end())
+        return;
+    for (auto& [ns, entry] : it->second)
+        for (auto& m : entry.msgs)
+            tail_cache_bytes_ -= tail_cache_size(*m);
+    tail_cache_.erase(it);
+}
+
+void Database::tail_cache_expire(int64_t now_ms) {
+    auto now = from_epoch_ms(now_ms);
+    std::lock_guard lock{tail_cache_mutex_};
+    for (auto it = tail_cache_.begin(); it != tail_cache_.end();) {
+        for (auto eit = it->second.begin(); eit != it->second.end();) {
+            auto& msgs = eit->second.msgs;
+            bool expired = std::any_of(
+                    msgs.begin(), msgs.end(), [&](const auto& m) { return m->expiry <= now; });
+            if (expired) {
+                for (auto& m : msgs)
+                    tail_cache_bytes_ -= tail_cache_size(*m);
+                eit = it->second.erase(eit);
+            } else
+                ++eit;
+        }
+        if (it->second.empty())
+            it = tail_cache_.erase(it);
+        else
+            ++it;
+    }
+}
+
+// Returns the position in a tail cache entry of the first message after `last_hash`, if the entry
+// can answer for it: i.e. if the last hash is in our window (and then everything after it is
+// newer), or if there is no last hash and we know we have every message.
+template <typename Entry>
+static std::optional<size_t> tail_cache_start(const Entry* entry, const std::string& last_hash) {
+    if (!entry)
+        return std::nullopt;
+    if (last_hash.empty()) {
+        if (entry->complete)
+            return 0;
+        return std::nullopt;
+    }
+    for (size_t i = 0; i < entry->msgs.size(); i++)
+        if (entry->msgs[i]->hash == last_hash)
+            return i + 1;
+    return std::nullopt;
+}
+
+std::optional<bool> Database::tail_cache_retrieve(
+        const user_pubkey& pubkey,
+        namespace_id ns,
+        const std::string& last_hash,
+        const std::function<void(const message_view& msg)>& callback,
+        retrieve_limiter& limits) {
+    // Grab references to the messages we need so that we don't hold the lock while the callback
+    // does its thing:
+    std::vector<std::shared_ptr<const message>> msgs;
+    {
+        std::lock_guard lock{tail_cache_mutex_};
+        const tail_cache_entry* entry = nullptr;
+        if (auto it = tail_cache_.find(pubkey); it != tail_cache_.end())
+            if (auto eit = it->second.find(ns); eit != it->second.end())
+                entry = &eit->second;
+
+        auto start = tail_cache_start(entry, last_hash);
+        if (!start) {
+            tail_cache_misses_++;
+            return std::nullopt;
+        }
+        msgs.assign(entry->msgs.begin() + *start, entry->msgs.end());
+    }
+    tail_cache_hits_++;
+
+    for (auto& m : msgs) {
+        if (!limits.add(m->hash.size(), m->data.size()))
+            return true;
+        callback(message_view{m->hash, m->msg_namespace, m->timestamp, m->expiry, m->data});
+    }
+    // Our cached window always ends with the newest message, so there can't be anything more:
+    return false;
+}
+
+std::optional<int64_t> Database::tail_cache_count(
+        const user_pubkey& pubkey, namespace_id ns, const std::string& last_hash) {
+    std::lock_guard lock{tail_cache_mutex_};
+    const tail_cache_entry* entry = nullptr;
+    if (auto it = tail_cache_.find(pubkey); it != tail_cache_.end())
+        if (auto eit = it->second.find(ns); eit != it->second.end())
+            entry = &eit->second;
+
+    auto start = tail_cache_start(entry, last_hash);
+    if (!start) {
+        tail_cache_misses_++;
+        return std::nullopt;
+    }
+    tail_cache_hits_++;
+    return static_cast<int64_t>(entry->msgs.size() - *start);
+}
+
+Database::tail_cache_stats Database::get_tail_cache_stats() {
+    if (!shards_.empty()) {
+        tail_cache_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_tail_cache_stats();
+            total.hits += st.hits;
+            total.misses += st.misses;
+            total.bytes += st.bytes;
+        }
+        return total;
+    }
+    std::lock_guard lock{tail_cache_mutex_};
+    return {tail_cache_hits_.load(),
+            tail_cache_misses_.load(),
+            static_cast<int64_t>(tail_cache_bytes_)};
+}
+
+void Database::hash_filter_add(std::string_view hash) {
+    if (!hash_filter_enabled_)
+        return;
+    std::lock_guard lock{hash_filter_mutex_};
+    if (hash_filter_pending_)
+        hash_filter_pending_->emplace_back(hash);
+    // If this fills the filter up then it saturates (and so is still correct, if useless) until
+    // run_maintenance() rebuilds it.
+    hash_filter_.insert(hash);
+}
+
+void Database::hash_filter_erase(const std::vector<std::string>& hashes) {
+    if (!hash_filter_enabled_ || hashes.empty())
+        return;
+    std::lock_guard lock{hash_filter_mutex_};
+    for (const auto& hash : hashes)
+        hash_filter_.erase(hash);
+}
+
+void Database::hash_filter_erase(const std::vector<std::pair<namespace_id, std::string>>& deleted) {
+    if (!hash_filter_enabled_ || deleted.empty())
+        return;
+    std::lock_guard lock{hash_filter_mutex_};
+    for (const auto& [ns, hash] : deleted)
+        hash_filter_.erase(hash);
 }
 
-int64_t Database::get_total_bytes() {
-    auto impl = get_impl(false);
-    return impl->prepared_get<int64_t>("PRAGMA page_count") * impl->page_size;
+void Database::hash_filter_expired(int64_t count) {
+    if (!hash_filter_enabled_ || count <= 0)
+        return;
+    std::lock_guard lock{hash_filter_mutex_};
+    hash_filter_stale_ += count;
 }
 
-int64_t Database::get_used_bytes() {
-    auto impl = get_impl(false);
-    return get_total_bytes() -
-           impl->prepared_get<int64_t>("PRAGMA freelist_count") * impl->page_size;
+bool Database::hash_filter_maybe_contains(std::string_view hash) {
+    std::lock_guard lock{hash_filter_mutex_};
+    return hash_filter_.maybe_contains(hash);
 }
 
-static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement& st) {
-    std::optional<message> msg;
-    while (st.executeStep()) {
-        assert(!msg);
-        auto [hash, otype, opubkey, ns, ts, exp, data] =
-                get<std::string, uint8_t, std::string, namespace_id, int64_t, int64_t, std::string>(
-                        st);
-        msg.emplace(
-                impl.load_pubkey(otype, std::move(opubkey)),
-                std::move(hash),
-                ns,
-                from_epoch_ms(ts),
-                from_epoch_ms(exp),
-                std::move(data));
+void Database::hash_filter_rebuild() {
+    {
+        std::lock_guard lock{hash_filter_mutex_};
+        if (hash_filter_pending_)
+            return;  // Some other thread is already on it
+        hash_filter_pending_.emplace();
     }
-    return msg;
+
+    // This only needs a read connection: anything stored while we scan gets recorded in
+    // hash_filter_pending_ and added at the end.
+    std::optional<util::cuckoo_filter> filter;
+    try {
+        auto impl = get_impl(false);
+        auto count = impl->prepared_get<int64_t>(
+                "SELECT COALESCE(SUM(messages), 0) FROM message_stats"_sql);
+        filter.emplace(std::max<size_t>(HASH_FILTER_MIN_CAPACITY, 2 * count));
+        auto st = impl->prepared_st(
+                expiry_partitions_ > 0 ? "SELECT hash_from_db(hash) FROM messages_all"_sql
+                                       : "SELECT hash_from_db(hash) FROM messages"_sql);
+        while (step(*st)) {
+            auto hash_col = st->getColumn(0);
+            const char* hash_ptr = hash_col.getText();
+            filter->insert(std::string_view{hash_ptr, static_cast<size_t>(hash_col.getBytes())});
+        }
+    } catch (...) {
+        std::lock_guard lock{hash_filter_mutex_};
+        hash_filter_pending_.reset();
+        throw;
+    }
+
+    std::lock_guard lock{hash_filter_mutex_};
+    for (const auto& hash : *hash_filter_pending_)
+        filter->insert(hash);
+    hash_filter_pending_.reset();
+    hash_filter_ = std::move(*filter);
+    hash_filter_stale_ = 0;
+    hash_filter_rebuilds_++;
+    log::debug(
+            logcat,
+            "Rebuilt message hash filter: {} hashes, {} bytes",
+            hash_filter_.size(),
+            hash_filter_.bytes());
 }
 
-std::optional<message> Database::retrieve_random() {
-    clean_expired();  // *Must* be before the below get_impl because otherwise the read-only impl
-                      // would deadlock with the clean_expired write=true get_impl().
-    auto impl = get_impl(false);
-    auto st = impl->prepared_st(
-            "SELECT hash, type, pubkey, namespace, timestamp, expiry, data"
-            " FROM owned_messages "
-            " WHERE mid = (SELECT id FROM messages ORDER BY RANDOM() LIMIT 1)");
-    return get_message(*impl, st);
+Database::hash_filter_stats Database::get_hash_filter_stats() {
+    if (!shards_.empty()) {
+        hash_filter_stats total{};
+        for (auto& shard : shards_) {
+            auto st = shard->get_hash_filter_stats();
+            total.size += st.size;
+            total.bytes += st.bytes;
+            total.skipped += st.skipped;
+            total.false_positives += st.false_positives;
+            total.rebuilds += st.rebuilds;
+        }
+        return total;
+    }
+    std::lock_guard lock{hash_filter_mutex_};
+    return {static_cast<int64_t>(hash_filter_.size()),
+            static_cast<int64_t>(hash_filter_.bytes()),
+            hash_filter_skipped_.load(),
+            hash_filter_false_positives_.load(),
+            hash_filter_rebuilds_.load()};
 }
 
-std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
-    auto impl = get_impl(false);
-    auto st = impl->prepared_st(
-            "SELECT hash, type, pubkey, namespace, timestamp, expiry, data"
-            " FROM owned_messages WHERE hash = ?");
-    st->bindNoCopy(1, msg_hash);
-    return get_message(*impl, st);
+std::pair<std::vector<message>, bool> Database::retrieve(
+        const user_pubkey& pubkey,
+        namespace_id ns,
+        const std::string& last_hash,
+        std::optional<size_t> max_results,
+        std::optional<size_t> max_size,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+
+    std::pair<std::vector<message>, bool> result{};
+    auto& [results, more] = result;
+    more = retrieve_each(
+            pubkey,
+            ns,
+            last_hash,
+            [&results](const message_view& m) {
+                results.emplace_back(
+                        std::string{m.hash},
+                        m.msg_namespace,
+                        m.timestamp,
+                        m.expiry,
+                        std::string{m.data});
+            },
+            max_results,
+            max_size,
+            size_b64,
+            per_message_overhead);
+    return result;
 }
 
-StoreResult Database::store(const message& msg, std::chrono::system_clock::time_point* expiry) {
+bool Database::retrieve_each(
+        const user_pubkey& pubkey,
+        namespace_id ns,
+        const std::string& last_hash,
+        const std::function<void(const message_view& msg)>& callback,
+        std::optional<size_t> max_results,
+        std::optional<size_t> max_size,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+    if (!shards_.empty())
+        return shard_for(pubkey).retrieve_each(
+                pubkey,
+                ns,
+                last_hash,
+                callback,
+                max_results,
+                max_size,
+                size_b64,
+                per_message_overhead);
 
-    auto impl = get_impl(true);
+    if (max_results && *max_results < 1)
+        max_results = 1;
 
-    StoreResult ret;
-    try {
+    retrieve_limiter limits{max_results, max_size, size_b64, per_message_overhead};
 
-        SQLite::Transaction transaction{impl->db};
+    if (auto more = tail_cache_retrieve(pubkey, ns, last_hash, callback, limits))
+        return *more;
 
-        int64_t owner_id;
-        if (auto maybe = exec_and_maybe_get<int64_t>(
-                    impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"),
-                    msg.pubkey))
-            owner_id = *maybe;
-        else
-            owner_id = impl->prepared_get<int64_t>(
-                    "INSERT INTO owners (pubkey, type) VALUES (?, ?) RETURNING id", msg.pubkey);
-
-        // When storing to a public namespace we clear anything there (except for a duplicate, to
-        // avoid unnecessary storage churn).
-        if (is_public_outbox_namespace(msg.msg_namespace)) {
-            impl->prepared_exec(
-                    "DELETE FROM messages"
-                    " WHERE owner = ? AND namespace = ? AND hash != ?",
-                    owner_id,
-                    msg.msg_namespace,
-                    msg.hash);
-        }
-
-        auto new_exp = to_epoch_ms(msg.expiry);
-
-        if (auto existing = exec_and_maybe_get<int64_t, int64_t>(
-                    impl->prepared_st("SELECT id, expiry FROM messages WHERE hash = ?"),
-                    msg.hash)) {
-            auto& [id, exp] = *existing;
-            if (exp < new_exp) {
-                impl->prepared_exec("UPDATE messages SET expiry = ? WHERE id = ?", new_exp, id);
-                ret = StoreResult::Extended;
-                exp = new_exp;
-            } else {
-                ret = StoreResult::Exists;
-            }
-            if (expiry)
-                *expiry = from_epoch_ms(exp);
-        } else {
-            impl->prepared_exec(
-                    "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
-                    " VALUES (?, ?, ?, ?, ?, ?)",
-                    owner_id,
-                    msg.hash,
-                    msg.msg_namespace,
-                    to_epoch_ms(msg.timestamp),
-                    to_epoch_ms(msg.expiry),
-                    blob_binder{msg.data});
-            ret = StoreResult::New;
+    auto impl = get_impl(false);
+    auto ownerid = impl->get_owner(pubkey);
+    if (!ownerid)
+        return false;
 
-            if (expiry)
-                *expiry = msg.expiry;
-        }
+    return retrieve_db(*impl, *ownerid, ns, last_hash, callback, limits);
+}
 
-        transaction.commit();
+std::vector<bool> Database::retrieve_multi(
+        const user_pubkey& pubkey,
+        const std::vector<retrieve_request>& requests,
+        const std::function<void(size_t index, const message_view& msg)>& callback,
+        std::optional<size_t> total_max_size,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+    if (!shards_.empty())
+        return shard_for(pubkey).retrieve_multi(
+                pubkey, requests, callback, total_max_size, size_b64, per_message_overhead);
 
-    } catch (const SQLite::Exception& e) {
-        if (e.getErrorCode() == SQLITE_FULL) {
-            if (db_full_counter++ % DB_FULL_FREQUENCY == 0)
-                log::error(logcat, "Failed to store message: database is full");
-            return StoreResult::Full;
-        } else {
-            log::critical(logcat, "Failed to store message: {}", e.getErrorStr());
-            throw;
-        }
-    }
-    return ret;
+    auto impl = get_impl(false);
+    std::optional<std::optional<int64_t>> ownerid;  // Outer optional: whether we've looked it up
+    return retrieve_multi_impl(
+            *impl,
+            ownerid,
+            pubkey,
+            requests,
+            callback,
+            total_max_size,
+            size_b64,
+            per_message_overhead);
 }
 
-void Database::bulk_store(const std::vector<message>& items) {
-    auto impl = get_impl(true);
-    SQLite::Transaction t{impl->db};
-    auto get_owner = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto insert_owner = impl->prepared_st(
-            "INSERT INTO owners (pubkey, type) VALUES (?, ?) ON CONFLICT DO NOTHING RETURNING id");
-    std::unordered_map<user_pubkey, int64_t> seen;
-    for (auto& m : items) {
-        if (!m.pubkey)
+std::vector<bool> Database::retrieve_multi_impl(
+        DatabaseImpl& impl,
+        std::optional<std::optional<int64_t>>& ownerid,
+        const user_pubkey& pubkey,
+        const std::vector<retrieve_request>& requests,
+        const std::function<void(size_t index, const message_view& msg)>& callback,
+        std::optional<size_t> total_max_size,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+    std::vector<bool> more(requests.size(), false);
+    retrieve_limiter total{std::nullopt, total_max_size, size_b64, per_message_overhead};
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        const auto& req = requests[i];
+        auto max_results = req.max_results;
+        if (max_results && *max_results < 1)
+            max_results = 1;
+        retrieve_limiter limits{
+                max_results,
+                req.max_size,
+                req.size_b64.value_or(size_b64),
+                per_message_overhead,
+                &total};
+        std::function<void(const message_view&)> cb = [&callback, i](const message_view& msg) {
+            callback(i, msg);
+        };
+
+        if (auto m = tail_cache_retrieve(pubkey, req.ns, req.last_hash, cb, limits)) {
+            more[i] = *m;
             continue;
-        if (auto [it, ins] = seen.emplace(m.pubkey, 0); ins) {
-            auto ownerid = exec_and_maybe_get<int64_t>(get_owner, m.pubkey);
-            get_owner->reset();
-            if (!ownerid) {
-                ownerid = exec_and_maybe_get<int64_t>(insert_owner, m.pubkey);
-                insert_owner->reset();
-            }
-            if (ownerid)
-                it->second = *ownerid;
-            else {
-                log::error(
-                        logcat,
-                        "Failed to insert owner {} for bulk store",
-                        m.pubkey.prefixed_hex());
-                seen.erase(it);
-            }
         }
+        if (!ownerid)
+            ownerid = impl.get_owner(pubkey);
+        if (*ownerid)
+            more[i] = retrieve_db(impl, **ownerid, req.ns, req.last_hash, cb, limits);
+    }
+    return more;
+}
+
+Database::owner_read_results Database::read_owner(
+        const user_pubkey& pubkey,
+        const std::vector<retrieve_request>& retrieves,
+        const std::function<void(size_t index, const message_view& msg)>& callback,
+        const std::vector<std::vector<std::string>>& expiries,
+        std::optional<size_t> total_max_size,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+    if (!shards_.empty())
+        return shard_for(pubkey).read_owner(
+                pubkey,
+                retrieves,
+                callback,
+                expiries,
+                total_max_size,
+                size_b64,
+                per_message_overhead);
+
+    owner_read_results results;
+    auto impl = get_impl(false);
+    SQLite::Transaction transaction{impl->db};
+    std::optional<std::optional<int64_t>> ownerid;  // Outer optional: whether we've looked it up
+    results.more = retrieve_multi_impl(
+            *impl,
+            ownerid,
+            pubkey,
+            retrieves,
+            callback,
+            total_max_size,
+            size_b64,
+            per_message_overhead);
+
+    results.expiries.resize(expiries.size());
+    if (!expiries.empty()) {
+        if (!ownerid)
+            ownerid = impl->get_owner(pubkey);
+        if (*ownerid)
+            for (size_t i = 0; i < expiries.size(); i++)
+                results.expiries[i] = get_expiries_impl(*impl, **ownerid, expiries[i]);
     }
+    transaction.commit();
+    return results;
+}
 
-    auto insert_message = impl->prepared_st(
-            "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
-            " VALUES (?, ?, ?, ?, ?, ?)"
-            " ON CONFLICT DO NOTHING");
+std::vector<int64_t> Database::count_new(
+        const user_pubkey& pubkey, const std::vector<retrieve_request>& requests) {
+    if (!shards_.empty())
+        return shard_for(pubkey).count_new(pubkey, requests);
 
-    for (auto& m : items) {
-        if (!m.pubkey)
+    std::vector<int64_t> counts(requests.size(), 0);
+    auto impl = get_impl(false);
+    std::optional<std::optional<int64_t>> ownerid;  // Outer optional: whether we've looked it up
+    for (size_t i = 0; i < requests.size(); i++) {
+        const auto& req = requests[i];
+        if (auto c = tail_cache_count(pubkey, req.ns, req.last_hash)) {
+            counts[i] = *c;
             continue;
-        auto owner_it = seen.find(m.pubkey);
-        if (owner_it == seen.end())
+        }
+        if (!ownerid)
+            ownerid = impl->get_owner(pubkey);
+        if (!*ownerid)
             continue;
 
-        exec_query(
-                insert_message,
-                owner_it->second,
-                m.hash,
-                m.msg_namespace,
-                to_epoch_ms(m.timestamp),
-                to_epoch_ms(m.expiry),
-                blob_binder{m.data});
-        insert_message->reset();
+        std::optional<int64_t> last_id;
+        if (!req.last_hash.empty()) {
+            auto st = impl->prepared_st(last_id_sql());
+            last_id = exec_and_maybe_get<int64_t>(st, **ownerid, to_int(req.ns), req.last_hash);
+        }
+        // Unpartitioned, the count is covered by the messages_owner index (which includes the
+        // rowid), so it never has to touch the message rows themselves.  In partitioned mode it
+        // probes each table's own owner index instead, and the ring tables also have to read each
+        // matching row's expiry for the `messages` view's filtering of hidden expired messages.
+        if (last_id)
+            counts[i] = exec_and_get<int64_t>(
+                    impl->prepared_st("SELECT COUNT(*) FROM messages"
+                                      " WHERE owner = ? AND namespace = ? AND id > ?"_sql),
+                    **ownerid,
+                    to_int(req.ns),
+                    *last_id);
+        else
+            counts[i] = exec_and_get<int64_t>(
+                    impl->prepared_st(
+                            "SELECT COUNT(*) FROM messages WHERE owner = ? AND namespace = ?"_sql),
+                    **ownerid,
+                    to_int(req.ns));
     }
-
-    t.commit();
+    return counts;
 }
 
-std::pair<std::vector<message>, bool> Database::retrieve(
-        const user_pubkey& pubkey,
+bool Database::retrieve_db(
+        DatabaseImpl& impl,
+        int64_t ownerid,
         namespace_id ns,
         const std::string& last_hash,
-        std::optional<size_t> max_results,
-        std::optional<size_t> max_size,
-        const bool size_b64,
-        const size_t per_message_overhead) {
-
-    auto impl = get_impl(false);
-    auto owner_st = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto ownerid = exec_and_maybe_get<int64_t>(owner_st, pubkey);
-    if (!ownerid)
-        return {};
-
-    if (max_results && *max_results < 1)
-        max_results = 1;
-
+        const std::function<void(const message_view& msg)>& callback,
+        retrieve_limiter& limits) {
     std::optional<int64_t> last_id;
     if (!last_hash.empty()) {
-        auto st = impl->prepared_st(
-                "SELECT id FROM messages WHERE owner = ? AND namespace = ? AND hash = ?");
-        last_id = exec_and_maybe_get<int64_t>(st, *ownerid, to_int(ns), last_hash);
+        auto st = impl.prepared_st(last_id_sql());
+        last_id = exec_and_maybe_get<int64_t>(st, ownerid, to_int(ns), last_hash);
     }
 
-    auto st = impl->prepared_st(
-            last_id ? "SELECT hash, namespace, timestamp, expiry, data FROM messages "
-                      "WHERE owner = ? AND namespace = ? AND id > ? ORDER BY id LIMIT ?"
-                    : "SELECT hash, namespace, timestamp, expiry, data FROM messages "
-                      "WHERE owner = ? AND namespace = ? ORDER BY id LIMIT ?");
+    const auto& max_results = limits.max_results;
+    auto st = impl.prepared_st(retrieve_sql(last_id.has_value()));
     int pos = 1;
-    st->bind(pos++, *ownerid);
+    st->bind(pos++, ownerid);
     st->bind(pos++, to_int(ns));
     if (last_id)
         st->bind(pos++, *last_id);
     st->bind(pos++, max_results ? static_cast<int>(*max_results) + 1 : -1);
 
-    std::pair<std::vector<message>, bool> result{};
-    auto& [results, more] = result;
-
-    size_t agg_size = 0;
-    while (st->executeStep()) {
-        auto [hash, ns, ts, exp, data] =
-                get<std::string, namespace_id, int64_t, int64_t, std::string>(st);
-        if (max_results && results.size() >= *max_results) {
+    bool more = false;
+    while (step(*st)) {
+        // We access the hash and data directly from sqlite's row buffers to avoid copying them;
+        // these remain valid until the next step of the statement.  (Note that the blob pointer
+        // must be fetched before the size, per sqlite's column access rules).
+        auto hash_col = st->getColumn(0);
+        auto data_col = st->getColumn(4);
+        const char* hash_ptr = hash_col.getText();
+        std::string_view hash{hash_ptr, static_cast<size_t>(hash_col.getBytes())};
+        auto* data_ptr = static_cast<const char*>(data_col.getBlob());
+        std::string_view data{data_ptr, static_cast<size_t>(data_col.getBytes())};
+
+        if (!limits.add(hash.size(), data.size())) {
             more = true;
             break;
         }
-        if (max_size) {
-            agg_size += per_message_overhead;
-            agg_size += hash.size();
-            agg_size += size_b64 ? data.size() * 4 / 3 : data.size();
-            if (!results.empty() && agg_size > *max_size) {
-                more = true;
-                break;
-            }
-        }
 
-        results.emplace_back(
-                std::move(hash), ns, from_epoch_ms(ts), from_epoch_ms(exp), std::move(data));
+        callback(message_view{
+                hash,
+                static_cast<namespace_id>(st->getColumn(1).getInt()),
+                from_epoch_ms(st->getColumn(2).getInt64()),
+                from_epoch_ms(st->getColumn(3).getInt64()),
+                data});
     }
 
-    return result;
+    return more;
 }
 
 std::vector<message> Database::retrieve_all() {
+    if (!shards_.empty()) {
+        std::vector<message> results;
+        for (auto& shard : shards_) {
+            auto msgs = shard->retrieve_all();
+            results.insert(
+                    results.end(),
+                    std::make_move_iterator(msgs.begin()),
+                    std::make_move_iterator(msgs.end()));
+        }
+        return results;
+    }
     auto impl = get_impl(false);
 
     std::vector<message> results;
     auto st = impl->prepared_st(
-            "SELECT type, pubkey, hash, namespace, timestamp, expiry, data"
-            " FROM owned_messages ORDER BY mid");
+            "SELECT type, pubkey, hash_from_db(hash), namespace, timestamp, expiry, data"
+            " FROM owned_messages ORDER BY mid"_sql);
 
-    while (st->executeStep()) {
+    while (step(*st)) {
         auto [type, pubkey, hash, ns, ts, exp, data] =
                 get<uint8_t, std::string, std::string, namespace_id, int64_t, int64_t, std::string>(
                         st);
@@ -880,96 +3882,308 @@ std::vector<message> Database::retrieve_all() {
     return results;
 }
 
+// Appends a message loaded from the current row of `st` to `out`.  The row must contain type,
+// pubkey, hash, namespace, timestamp, expiry, and data columns, starting at column index `col`.
+// Returns the size of the loaded hash + data.
+static size_t load_owned_message(
+        DatabaseImpl& impl, SQLite::Statement& st, int col, std::vector<message>& out) {
+    auto& msg = out.emplace_back(
+            impl.load_pubkey(
+                    static_cast<uint8_t>(st.getColumn(col).getInt()),
+                    st.getColumn(col + 1).getString()),
+            st.getColumn(col + 2).getString(),
+            static_cast<namespace_id>(st.getColumn(col + 3).getInt()),
+            from_epoch_ms(st.getColumn(col + 4).getInt64()),
+            from_epoch_ms(st.getColumn(col + 5).getInt64()),
+            st.getColumn(col + 6).getString());
+    return msg.hash.size() + msg.data.size();
+}
+
+size_t Database::for_each_message(
+        const std::function<bool(std::vector<message>& chunk)>& callback,
+        size_t max_count,
+        size_t max_bytes) {
+    if (!shards_.empty()) {
+        size_t visited = 0;
+        bool stopped = false;
+        auto cb = [&](std::vector<message>& chunk) { return !(stopped = !callback(chunk)); };
+        for (auto it = shards_.begin(); it != shards_.end() && !stopped; ++it)
+            visited += (*it)->for_each_message(cb, max_count, max_bytes);
+        return visited;
+    }
+    if (max_count < 1)
+        max_count = 1;
+
+    size_t visited = 0;
+    int64_t last_id = 0;
+    std::vector<message> chunk;
+    while (true) {
+        chunk.clear();
+        bool more;
+        {
+            auto impl = get_impl(false);
+            // (Not on owned_messages, for the same reason as in retrieve_random.)
+            auto st = impl->prepared_st(
+                    "SELECT m.id, type, pubkey, hash_from_db(hash), namespace, timestamp,"
+                    " expiry, data"
+                    " FROM (SELECT * FROM messages WHERE id > ? ORDER BY id LIMIT ?) m"
+                    " JOIN owners ON m.owner = owners.id ORDER BY m.id"_sql);
+            st->bind(1, last_id);
+            st->bind(2, static_cast<int64_t>(max_count));
+
+            size_t chunk_bytes = 0;
+            while (chunk_bytes < max_bytes && step(*st)) {
+                last_id = st->getColumn(0).getInt64();
+                chunk_bytes += load_owned_message(*impl, st, 1, chunk);
+            }
+            more = chunk.size() == max_count || chunk_bytes >= max_bytes;
+        }
+
+        if (chunk.empty())
+            break;
+        visited += chunk.size();
+        if (!callback(chunk) || !more)
+            break;
+    }
+    return visited;
+}
+
+size_t Database::for_each_message(
+        uint64_t swarm_space_begin,
+        uint64_t swarm_space_end,
+        const std::function<bool(std::vector<message>& chunk)>& callback,
+        size_t max_count,
+        size_t max_bytes) {
+    if (!shards_.empty()) {
+        // Visit the shards in swarm space order, starting from the one containing the beginning
+        // of the range:
+        const uint64_t width = std::numeric_limits<uint64_t>::max() / shards_.size() + 1;
+        const size_t first = swarm_space_begin / width;
+        size_t visited = 0;
+        bool stopped = false;
+        auto cb = [&](std::vector<message>& chunk) { return !(stopped = !callback(chunk)); };
+        for (size_t i = 0; i < shards_.size() && !stopped; i++)
+            visited += shards_[(first + i) % shards_.size()]->for_each_message(
+                    swarm_space_begin, swarm_space_end, cb, max_count, max_bytes);
+        return visited;
+    }
+    if (max_count < 1)
+        max_count = 1;
+
+    size_t visited = 0;
+    std::vector<message> chunk;
+    for (auto [lo, hi] : swarm_space_key_ranges(swarm_space_begin, swarm_space_end)) {
+        // Our cursor is the (swarm_space, owner, message id) of the last message we loaded:
+        int64_t last_space = lo, last_owner = 0, last_id = 0;
+        while (true) {
+            chunk.clear();
+            bool more;
+            {
+                auto impl = get_impl(false);
+                auto st = impl->prepared_st(
+                        "SELECT owners.swarm_space, owners.id, messages.id,"
+                        " type, pubkey, hash_from_db(hash), namespace, timestamp, expiry, data"
+                        " FROM messages JOIN owners ON messages.owner = owners.id"
+                        " WHERE owners.swarm_space BETWEEN ? AND ?"
+                        " AND (owners.swarm_space, owners.id, messages.id) > (?, ?, ?)"
+                        " ORDER BY owners.swarm_space, owners.id, messages.id LIMIT ?"_sql);
+                st->bind(1, lo);
+                st->bind(2, hi);
+                st->bind(3, last_space);
+                st->bind(4, last_owner);
+                st->bind(5, last_id);
+                st->bind(6, static_cast<int64_t>(max_count));
+
+                size_t chunk_bytes = 0;
+                while (chunk_bytes < max_bytes && step(*st)) {
+                    std::tie(last_space, last_owner, last_id) =
+                            get<int64_t, int64_t, int64_t>(st);
+                    chunk_bytes += load_owned_message(*impl, st, 3, chunk);
+                }
+                more = chunk.size() == max_count || chunk_bytes >= max_bytes;
+            }
+
+            if (chunk.empty())
+                break;
+            visited += chunk.size();
+            if (!callback(chunk))
+                return visited;
+            if (!more)
+                break;
+        }
+    }
+    return visited;
+}
+
 std::vector<std::pair<namespace_id, std::string>> Database::delete_all(const user_pubkey& pubkey) {
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_all(pubkey);
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
 
-    auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING namespace, hash");
-    return get_all<namespace_id, std::string>(st, pubkey);
+    auto deleted = impl->modify_get_all<namespace_id, std::string>(
+            "DELETE FROM messages WHERE owner = ? RETURNING namespace, hash_from_db(hash)"_sql,
+            *owner);
+    hash_filter_erase(deleted);
+    return deleted;
 }
 
 std::vector<std::string> Database::delete_all(const user_pubkey& pubkey, namespace_id ns) {
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_all(pubkey, ns);
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
 
-    auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND namespace = ?"
-            " RETURNING hash");
-    return get_all<std::string>(st, pubkey, ns);
+    auto deleted = impl->modify_get_all<std::string>(
+            "DELETE FROM messages WHERE owner = ? AND namespace = ?"
+            " RETURNING hash_from_db(hash)"_sql,
+            *owner,
+            ns);
+    hash_filter_erase(deleted);
+    return deleted;
 }
 
 namespace {
-    std::string multi_in_query(std::string_view prefix, size_t count, std::string_view suffix) {
+    // Builds `prefix` + `count` comma-separated copies of `placeholder` + `suffix`.
+    std::string multi_in_query(
+            std::string_view prefix,
+            size_t count,
+            std::string_view suffix,
+            std::string_view placeholder = "?"sv) {
         std::string query;
-        query.reserve(prefix.size() + (count == 0 ? 0 : 2 * count - 1) + suffix.size());
+        query.reserve(
+                prefix.size() + (count == 0 ? 0 : (placeholder.size() + 1) * count - 1) +
+                suffix.size());
         query += prefix;
         for (size_t i = 0; i < count; i++) {
             if (i > 0)
                 query += ',';
-            query += '?';
+            query += placeholder;
         }
         query += suffix;
         return query;
     }
+
+    // Encodes a list of strings as a JSON array so that the whole list can be bound to a single
+    // `json_each(?)` parameter.
+    std::string json_array(const std::vector<std::string>& values) {
+        std::string json;
+        size_t size = 2;
+        for (const auto& v : values)
+            size += v.size() + 3;
+        json.reserve(size);
+        json += '[';
+        for (const auto& v : values) {
+            if (json.size() > 1)
+                json += ',';
+            json += '"';
+            for (char c : v) {
+                if (c == '"' || c == '\\') {
+                    json += '\\';
+                    json += c;
+                } else if (static_cast<unsigned char>(c) < 0x20)
+                    json += fmt::format("\\u{:04x}", static_cast<int>(c));
+                else
+                    json += c;
+            }
+            json += '"';
+        }
+        json += ']';
+        return json;
+    }
 }  // namespace
 
-std::vector<std::string> Database::delete_by_hash(
+std::vector<std::pair<namespace_id, std::string>> Database::delete_by_hash(
         const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes) {
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_by_hash(pubkey, msg_hashes);
 
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
 
+    std::vector<std::pair<namespace_id, std::string>> deleted;
     if (msg_hashes.size() == 1) {
         // Use an optimized prepared statement for very common single-hash deletions
-        auto st = impl->prepared_st(
-                "DELETE FROM messages"
-                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " AND hash = ?"
-                " RETURNING hash");
-        return get_all<std::string>(st, pubkey, msg_hashes[0]);
+        deleted = impl->modify_get_all<namespace_id, std::string>(
+                "DELETE FROM messages WHERE owner = ? AND hash = hash_to_db(?)"
+                " RETURNING namespace, hash_from_db(hash)"_sql,
+                *owner,
+                msg_hashes[0]);
+    } else if (set_hash_queries_) {
+        deleted = impl->modify_get_all<namespace_id, std::string>(
+                "DELETE FROM messages WHERE owner = ?"
+                " AND hash IN (SELECT hash_to_db(value) FROM json_each(?))"
+                " RETURNING namespace, hash_from_db(hash)"_sql,
+                *owner,
+                json_array(msg_hashes));
+    } else {
+        impl->modify_messages(
+                multi_in_query(
+                        "DELETE FROM messages WHERE owner = ? AND hash IN ("sv,  // ?,?,?,...,?
+                        msg_hashes.size(),
+                        ") RETURNING namespace, hash_from_db(hash)"sv,
+                        "hash_to_db(?)"sv),
+                [&](SQLite::Statement& st) {
+                    st.bind(1, *owner);
+                    for (size_t i = 0; i < msg_hashes.size(); i++)
+                        st.bindNoCopy(2 + i, msg_hashes[i]);
+                    for (auto& row : get_all<namespace_id, std::string>(st))
+                        deleted.push_back(std::move(row));
+                },
+                /*cached=*/false);
     }
-
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "DELETE FROM messages"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND hash IN ("sv,  // ?,?,?,...,?
-                    msg_hashes.size(),
-                    ") RETURNING hash"sv)};
-
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(3 + i, msg_hashes[i]);
-    return get_all<std::string>(st);
+    hash_filter_erase(deleted);
+    return deleted;
 }
 
 std::vector<std::pair<namespace_id, std::string>> Database::delete_by_timestamp(
         const user_pubkey& pubkey, std::chrono::system_clock::time_point timestamp) {
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_by_timestamp(pubkey, timestamp);
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
 
-    auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND timestamp <= ?"
-            " RETURNING hash");
-    return get_all<namespace_id, std::string>(st, pubkey, to_epoch_ms(timestamp));
+    auto deleted = impl->modify_get_all<namespace_id, std::string>(
+            "DELETE FROM messages WHERE owner = ? AND timestamp <= ?"
+            " RETURNING namespace, hash_from_db(hash)"_sql,
+            *owner,
+            to_epoch_ms(timestamp));
+    hash_filter_erase(deleted);
+    return deleted;
 }
 
 std::vector<std::string> Database::delete_by_timestamp(
         const user_pubkey& pubkey,
         namespace_id ns,
         std::chrono::system_clock::time_point timestamp) {
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_by_timestamp(pubkey, ns, timestamp);
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
 
-    auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND timestamp <= ? AND namespace = ?"
-            " RETURNING hash");
-    return get_all<std::string>(st, pubkey, to_epoch_ms(timestamp), ns);
+    auto deleted = impl->modify_get_all<std::string>(
+            "DELETE FROM messages WHERE owner = ? AND timestamp <= ? AND namespace = ?"
+            " RETURNING hash_from_db(hash)"_sql,
+            *owner,
+            to_epoch_ms(timestamp),
+            ns);
+    hash_filter_erase(deleted);
+    return deleted;
 }
 
 static constexpr auto ins_revoke_prefix = "INSERT INTO revoked_subaccounts (owner, token) "sv;
@@ -979,93 +4193,136 @@ static constexpr auto ins_revoke_suffix =
 
 void Database::revoke_subaccounts(
         const user_pubkey& pubkey, const std::vector<subaccount_token>& subaccounts) {
+    if (!shards_.empty())
+        return shard_for(pubkey).revoke_subaccounts(pubkey, subaccounts);
     if (subaccounts.empty())
         return;
 
     auto impl = get_impl(true);
-
-    if (subaccounts.size() == 1) {
-        auto insert_token = impl->prepared_st(fmt::format(
-                "{} VALUES ((SELECT id FROM owners WHERE pubkey = ? AND type = ?), ?) {}",
-                ins_revoke_prefix,
-                ins_revoke_suffix));
-        exec_query(insert_token, pubkey, blob_binder{subaccounts[0].view()});
-        return;
-    }
-
-    SQLite::Transaction transaction{impl->db};
-
-    auto get_owner = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto ownerid = exec_and_maybe_get<int64_t>(get_owner, pubkey);
+    auto ownerid = impl->get_owner(pubkey);
     if (!ownerid)
         return;
 
+    // These have to go into the revoked set before the database so that there is no window in
+    // which a token is revoked in the database but not in the set.
+    bool reload;
+    {
+        std::lock_guard lock{revoked_mutex_};
+        for (const auto& sa : subaccounts)
+            revoked_tokens_.emplace(sa.sview());
+        reload = revoked_tokens_.size() >
+                 2 * std::max<size_t>(revoked_reload_size_, MAX_SUBACCOUNT_TOKENS);
+    }
+
     auto insert_token = impl->prepared_st(
             fmt::format("{} VALUES (?, ?) {}", ins_revoke_prefix, ins_revoke_suffix));
 
-    for (const auto& sa : subaccounts) {
-        exec_query(insert_token, *ownerid, blob_binder{sa.view()});
-        insert_token->reset();
+    if (subaccounts.size() == 1) {
+        exec_query(insert_token, *ownerid, blob_binder{subaccounts[0].view()});
+    } else {
+        SQLite::Transaction transaction{impl->db};
+
+        for (const auto& sa : subaccounts) {
+            exec_query(insert_token, *ownerid, blob_binder{sa.view()});
+            insert_token->reset();
+        }
+
+        transaction.commit();
     }
 
-    transaction.commit();
+    if (reload)
+        revoked_reload(*impl);
 }
 
 int Database::unrevoke_subaccounts(
         const user_pubkey& pubkey, const std::vector<subaccount_token>& subaccounts) {
+    if (!shards_.empty())
+        return shard_for(pubkey).unrevoke_subaccounts(pubkey, subaccounts);
     if (subaccounts.empty())
         return 0;
 
     auto impl = get_impl(true);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return 0;
 
+    int removed;
     if (subaccounts.size() == 1) {
         auto remove_token = impl->prepared_st(
-                "DELETE FROM revoked_subaccounts"
-                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " AND token = ?");
-        return exec_query(remove_token, pubkey, blob_binder{subaccounts[0].view()});
+                "DELETE FROM revoked_subaccounts WHERE owner = ? AND token = ?"_sql);
+        removed = exec_query(remove_token, *owner, blob_binder{subaccounts[0].view()});
+    } else {
+        SQLite::Statement st{
+                impl->db,
+                multi_in_query(
+                        "DELETE FROM revoked_subaccounts WHERE owner = ? AND token IN ("sv,
+                        subaccounts.size(),
+                        ")"sv)};
+
+        st.bind(1, *owner);
+        for (size_t i = 0; i < subaccounts.size(); i++) {
+            auto sa = subaccounts[i].sview();
+            st.bindNoCopy(2 + i, static_cast<const void*>(sa.data()), sa.size());
+        }
+
+        removed = exec_query(st);
     }
 
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "DELETE FROM revoked_subaccounts"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND token IN ("sv,  // ?,?,?,...,?
-                    subaccounts.size(),
-                    ")"sv)};
+    if (removed > 0)
+        revoked_reload(*impl);
+    return removed;
+}
 
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < subaccounts.size(); i++) {
-        auto sa = subaccounts[i].sview();
-        st.bindNoCopy(3 + i, static_cast<const void*>(sa.data()), sa.size());
-    }
+void Database::revoked_reload(DatabaseImpl& impl) {
+    std::unordered_set<std::string> tokens;
+    auto st = impl.prepared_st("SELECT DISTINCT token FROM revoked_subaccounts"_sql);
+    while (step(*st))
+        tokens.insert(st->getColumn(0).getString());
 
-    return exec_query(st);
+    std::lock_guard lock{revoked_mutex_};
+    revoked_tokens_ = std::move(tokens);
+    revoked_reload_size_ = revoked_tokens_.size();
 }
 
 bool Database::subaccount_revoked(const user_pubkey& pubkey, const subaccount_token& subaccount) {
+    if (!shards_.empty())
+        return shard_for(pubkey).subaccount_revoked(pubkey, subaccount);
+    {
+        std::lock_guard lock{revoked_mutex_};
+        if (!revoked_tokens_.count(std::string{subaccount.sview()}))
+            return false;
+    }
     auto impl = get_impl(false);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return false;
 
     auto count = exec_and_get<int64_t>(
-            impl->prepared_st("SELECT COUNT(*) FROM revoked_subaccounts WHERE token = ? AND "
-                              "owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"),
+            impl->prepared_st(
+                    "SELECT COUNT(*) FROM revoked_subaccounts WHERE token = ? AND owner = ?"_sql),
             blob_binder{subaccount.view()},
-            pubkey);
+            *owner);
     return count > 0;
 }
 
-std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> Database::update_expiry(
+std::vector<Database::updated_expiry> Database::update_expiry(
         const user_pubkey& pubkey,
         const std::vector<std::string>& msg_hashes,
         const std::vector<std::chrono::system_clock::time_point> new_exp,
         bool extend_only,
         bool shorten_only) {
+    if (!shards_.empty())
+        return shard_for(pubkey).update_expiry(
+                pubkey,
+                msg_hashes,
+                new_exp,
+                extend_only,
+                shorten_only);
 
     if (new_exp.size() != 1 && new_exp.size() != msg_hashes.size())
         throw std::logic_error{"update_expiry: new_exp must be 1 or N"};
 
-    std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> result;
+    std::vector<updated_expiry> result;
 
     if (msg_hashes.empty())
         return result;
@@ -1075,50 +4332,69 @@ std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> Datab
                                           : ""s;
 
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return result;
 
     if (msg_hashes.size() == 1) {
         // Pre-prepared version for the common single hash case
-        if (impl->prepared_exec(
-                    "UPDATE messages SET expiry = ? WHERE hash = ?"s + expiry_constraint +
-                            " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)",
-                    to_epoch_ms(new_exp[0]),
-                    msg_hashes[0],
-                    pubkey) > 0)
-            result.emplace_back(msg_hashes[0], new_exp[0]);
-
+        for (auto ns : impl->modify_get_all<namespace_id>(
+                     "UPDATE messages SET expiry = ? WHERE hash = hash_to_db(?)"s +
+                             expiry_constraint + " AND owner = ? RETURNING namespace",
+                     to_epoch_ms(new_exp[0]),
+                     msg_hashes[0],
+                     *owner))
+            result.push_back({msg_hashes[0], new_exp[0], ns});
+
+    } else if (new_exp.size() == 1 && set_hash_queries_) {
+        for (auto& [ns, hash] : impl->modify_get_all<namespace_id, std::string>(
+                     "UPDATE messages SET expiry = ? WHERE owner = ?"s + expiry_constraint +
+                             " AND hash IN (SELECT hash_to_db(value) FROM json_each(?))"
+                             " RETURNING namespace, hash_from_db(hash)",
+                     to_epoch_ms(new_exp[0]),
+                     *owner,
+                     json_array(msg_hashes)))
+            result.push_back({std::move(hash), new_exp[0], ns});
     } else if (new_exp.size() == 1) {
-        SQLite::Statement st{
-                impl->db,
+        impl->modify_messages(
                 multi_in_query(
-                        "UPDATE messages SET expiry = ?"
-                        " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"s +
-                                expiry_constraint + " AND hash IN (",  // ?,?,?,...,?
+                        "UPDATE messages SET expiry = ? WHERE owner = ?"s + expiry_constraint +
+                                " AND hash IN (",  // ?,?,?,...,?
                         msg_hashes.size(),
-                        ") RETURNING hash"sv)};
-        st.bind(1, to_epoch_ms(new_exp[0]));
-        bind_pubkey(st, 2, 3, pubkey);
+                        ") RETURNING namespace, hash_from_db(hash)"sv,
+                        "hash_to_db(?)"sv),
+                [&](SQLite::Statement& st) {
+                    st.bind(1, to_epoch_ms(new_exp[0]));
+                    st.bind(2, *owner);
+                    for (size_t i = 0; i < msg_hashes.size(); i++)
+                        st.bindNoCopy(3 + i, msg_hashes[i]);
+
+                    for (auto& [ns, hash] : get_all<namespace_id, std::string>(st))
+                        result.push_back({std::move(hash), new_exp[0], ns});
+                },
+                /*cached=*/false);
+    } else if (expiry_partitions_ > 0) {
+        // Each of these is a statement per message table, so we do them all in one transaction
+        // rather than one each:
+        SQLite::Transaction transaction{impl->db};
+        auto query = "UPDATE messages SET expiry = ? WHERE hash = hash_to_db(?)"s +
+                     expiry_constraint + " AND owner = ? RETURNING namespace";
         for (size_t i = 0; i < msg_hashes.size(); i++)
-            st.bindNoCopy(4 + i, msg_hashes[i]);
-
-        for (auto& hash : get_all<std::string>(st))
-            result.emplace_back(hash, new_exp[0]);
+            for (auto ns : impl->modify_get_all<namespace_id>(
+                         query, to_epoch_ms(new_exp[i]), msg_hashes[i], *owner))
+                result.push_back({msg_hashes[i], new_exp[i], ns});
+        transaction.commit();
     } else {
-        int64_t owner;
-        if (auto maybe = exec_and_maybe_get<int64_t>(
-                    impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"),
-                    pubkey))
-            owner = *maybe;
-        else
-            return result;
-
         auto st = impl->prepared_st(
-                "UPDATE messages SET expiry = ? WHERE hash = ?"s + expiry_constraint +
-                " AND owner = ?");
+                "UPDATE messages SET expiry = ? WHERE hash = hash_to_db(?)"s +
+                expiry_constraint + " AND owner = ? RETURNING namespace");
         for (size_t i = 0; i < msg_hashes.size(); i++) {
             if (i > 0)
                 st->tryReset();
-            if (exec_query(st, to_epoch_ms(new_exp[i]), msg_hashes[i], owner) > 0)
-                result.emplace_back(msg_hashes[i], new_exp[i]);
+            for (auto ns :
+                 get_all<namespace_id>(st, to_epoch_ms(new_exp[i]), msg_hashes[i], *owner))
+                result.push_back({msg_hashes[i], new_exp[i], ns});
         }
     }
     return result;
@@ -1126,59 +4402,122 @@ std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> Datab
 
 std::map<std::string, int64_t> Database::get_expiries(
         const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes) {
+    if (!shards_.empty())
+        return shard_for(pubkey).get_expiries(pubkey, msg_hashes);
     auto impl = get_impl(false);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
+    return get_expiries_impl(*impl, *owner, msg_hashes);
+}
 
+std::map<std::string, int64_t> Database::get_expiries_impl(
+        DatabaseImpl& impl, int64_t owner, const std::vector<std::string>& msg_hashes) {
     if (msg_hashes.size() == 1) {
         // Pre-prepared version for the common single hash case
-        auto st = impl->prepared_st(
-                "SELECT hash, expiry FROM messages WHERE hash = ?"
-                " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)");
-        return get_map<std::string, int64_t>(st, msg_hashes[0], pubkey);
+        auto st = impl.prepared_st(
+                "SELECT hash_from_db(hash), expiry FROM messages"
+                " WHERE hash = hash_to_db(?) AND owner = ?"_sql);
+        return get_map<std::string, int64_t>(st, msg_hashes[0], owner);
+    }
+
+    if (set_hash_queries_) {
+        auto st = impl.prepared_st(
+                "SELECT hash_from_db(hash), expiry FROM messages WHERE owner = ?"
+                " AND hash IN (SELECT hash_to_db(value) FROM json_each(?))"_sql);
+        return get_map<std::string, int64_t>(st, owner, json_array(msg_hashes));
     }
 
     SQLite::Statement st{
-            impl->db,
+            impl.db,
             multi_in_query(
-                    "SELECT hash, expiry FROM messages"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND hash IN ("sv,  // ?,?,?,...,?
+                    "SELECT hash_from_db(hash), expiry FROM messages"
+                    " WHERE owner = ? AND hash IN ("sv,  // ?,...
                     msg_hashes.size(),
-                    ")"sv)};
-    bind_pubkey(st, 1, 2, pubkey);
+                    ")"sv,
+                    "hash_to_db(?)"sv)};
+    st.bind(1, owner);
     for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(3 + i, msg_hashes[i]);
+        st.bindNoCopy(2 + i, msg_hashes[i]);
 
     return get_map<std::string, int64_t>(st);
 }
 
 std::vector<std::pair<namespace_id, std::string>> Database::update_all_expiries(
         const user_pubkey& pubkey, std::chrono::system_clock::time_point new_exp) {
+    if (!shards_.empty())
+        return shard_for(pubkey).update_all_expiries(pubkey, new_exp);
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
 
     auto new_exp_ms = to_epoch_ms(new_exp);
-    auto st = impl->prepared_st(
-            "UPDATE messages SET expiry = ?"
-            " WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING namespace, hash");
-    return get_all<namespace_id, std::string>(st, new_exp_ms, new_exp_ms, pubkey);
+    return impl->modify_get_all<namespace_id, std::string>(
+            "UPDATE messages SET expiry = ? WHERE expiry > ? AND owner = ?"
+            " RETURNING namespace, hash_from_db(hash)"_sql,
+            new_exp_ms,
+            new_exp_ms,
+            *owner);
 }
 
 std::vector<std::string> Database::update_all_expiries(
         const user_pubkey& pubkey, namespace_id ns, std::chrono::system_clock::time_point new_exp) {
+    if (!shards_.empty())
+        return shard_for(pubkey).update_all_expiries(pubkey, ns, new_exp);
     auto impl = get_impl(true);
+    tail_cache_erase(pubkey);
+    auto owner = impl->get_owner(pubkey);
+    if (!owner)
+        return {};
 
     auto new_exp_ms = to_epoch_ms(new_exp);
-    auto st = impl->prepared_st(
-            "UPDATE messages SET expiry = ?"
-            " WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND namespace = ?"
-            " RETURNING hash");
-    return get_all<std::string>(st, new_exp_ms, new_exp_ms, pubkey, ns);
+    return impl->modify_get_all<std::string>(
+            "UPDATE messages SET expiry = ? WHERE expiry > ? AND owner = ? AND namespace = ?"
+            " RETURNING hash_from_db(hash)"_sql,
+            new_exp_ms,
+            new_exp_ms,
+            *owner,
+            ns);
 }
 
-// Hack used by the test suite to simulate a blocking/busy thread:
-void oxenss::Database::test_suite_block_for(std::chrono::milliseconds duration) {
+// Used by the test suite to compare the per-call cost of string-keyed and registered statement
+// lookups; returns the average time per lookup of each.
+std::pair<std::chrono::nanoseconds, std::chrono::nanoseconds>
+oxenss::Database::test_suite_statement_lookup(int iterations) {
     auto impl = get_impl(false);
+    auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
+    auto keyed_done = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"_sql);
+    auto registered_done = std::chrono::steady_clock::now();
+    return {(keyed_done - started) / iterations, (registered_done - keyed_done) / iterations};
+}
+
+// Runs the given stores as one group commit batch, as if they had been queued up together.
+std::vector<oxenss::StoreResult> oxenss::Database::test_suite_store_batch(
+        const std::vector<message>& msgs) {
+    std::vector<pending_store> pending;
+    pending.reserve(msgs.size());
+    std::vector<pending_store*> batch;
+    for (auto& m : msgs)
+        batch.push_back(&pending.emplace_back(pending_store{m, nullptr}));
+    store_batch(batch);
+    std::vector<StoreResult> results;
+    for (auto& p : pending) {
+        if (p.error)
+            std::rethrow_exception(p.error);
+        results.push_back(p.result);
+    }
+    return results;
+}
+
+// Hack used by the test suite to simulate a blocking/busy thread:
+void oxenss::Database::test_suite_block_for(std::chrono::milliseconds duration, bool write) {
+    auto impl = get_impl(write);
     std::this_thread::sleep_for(duration);
 }
 
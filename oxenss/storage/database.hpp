@@ -3,18 +3,25 @@
 #include <oxenss/common/subaccount_token.h>
 #include <oxenss/common/message.h>
 #include <oxenss/common/pubkey.h>
+#include <oxenss/utils/cuckoo_filter.hpp>
+#include <oxenss/utils/lock_profiler.hpp>
 
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
-#include <shared_mutex>
 #include <stack>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace oxenss {
@@ -26,10 +33,103 @@ class LockedDBImpl;
 
 /// Possible return values of a `store()`:
 enum class StoreResult {
-    New,       // Message did not exist and was inserted.
-    Extended,  // Message existed, but the expiry was extended to match the stored timestamp.
-    Exists,    // Message exists and already has an expiry >= the stored one.
-    Full,      // Can't insert right now because the database is full.
+    New,        // Message did not exist and was inserted.
+    Extended,   // Message existed, but the expiry was extended to match the stored timestamp.
+    Exists,     // Message exists and already has an expiry >= the stored one.
+    Full,       // Can't insert right now because the database is full.
+    OverQuota,  // Message is new, but its owner is at its storage quota (see
+                // `database_options::owner_quota`).
+};
+
+/// What to do when the database is (nearly) full; see `database_options::eviction`.
+enum class eviction_policy {
+    none,            // Reject new stores (with StoreResult::Full) until expiry frees up space.
+    soonest_expiry,  // Evict the messages that are closest to expiring anyway.
+    oldest,          // Evict the messages with the oldest timestamps.
+};
+
+/// Optional tuning parameters for a `Database`.
+struct database_options {
+    /// If true then concurrent `store()` calls are coalesced into shared write transactions
+    /// ("group commit"), which improves store throughput under concurrent load at the cost of a
+    /// little extra latency for individual stores.
+    bool group_commit = false;
+
+    /// If greater than 1 then owners are split across this many separate database files (each with
+    /// its own connections and write lock) by contiguous ranges of swarm space.  Per-owner
+    /// operations only touch the owner's shard; aggregate operations visit every shard.  The total
+    /// size limit is divided evenly between the shards.
+    int shards = 1;
+
+    /// If true (the default) then deletions, expiry updates, and expiry lookups of multiple hashes
+    /// bind the whole hash list as a single JSON array parameter of one cached statement (via
+    /// `json_each`).  If false they instead build, compile, and then discard a new
+    /// `IN (?,?,...,?)` statement for each request, as older versions did.
+    bool set_hash_queries = true;
+
+    /// What to do as the database approaches its size limit.  With anything other than `none`,
+    /// once used space passes EVICTION_HIGH_WATER percent of the limit, messages belonging to the
+    /// owners with the most messages are evicted (in the order given by the policy) until it is
+    /// back under EVICTION_LOW_WATER percent.  This is normally done in the background by
+    /// `evict_excess()`, but a store that finds the database full will also evict to make room.
+    eviction_policy eviction = eviction_policy::none;
+
+    /// Database size limit, in bytes; 0 means Database::SIZE_LIMIT.  In sharded mode this is
+    /// divided evenly between the shards.
+    int64_t size_limit = 0;
+
+    /// Statement executions taking at least this long are logged, with their query text, at
+    /// warning level.  0 disables the slow query log.
+    std::chrono::milliseconds slow_query = 500ms;
+
+    /// If non-zero then messages are stored in a ring of tables ("expiry partitions") that each
+    /// hold the messages expiring within one window of this length, plus an overflow table for
+    /// expiries that don't fit into the ring.  Expiry cleanup then drops a whole table once its
+    /// window has passed, rather than deleting its messages one at a time, and the partition
+    /// tables don't need an expiry index at all.  The cost is that reads have to look at every
+    /// table, and that an expired message stays on disk (though hidden from reads) until the end
+    /// of its window.  Changing this converts the existing messages on startup.
+    std::chrono::milliseconds expiry_partition = 0ms;
+
+    /// If true (the default) then an in-memory filter of the stored message hashes lets store()
+    /// and bulk_store() recognize messages that are already stored (as happens a lot with swarm
+    /// replication) with a read-only lookup, without taking the write lock.  It costs 2-5 bytes
+    /// of memory per stored message.
+    bool hash_filter = true;
+
+    /// Size, in bytes, of each database connection's page cache; 0 leaves SQLite's default (2MiB).
+    /// Every connection has a cache of its own (there is one connection per concurrent database
+    /// job), so this can use up to this much memory per connection.
+    int64_t cache_size = 0;
+
+    /// If non-zero then up to this many bytes of the database file are memory-mapped, so that
+    /// reads get pages straight from the OS page cache (which all the connections share) rather
+    /// than copying them into each connection's own page cache with a read() call each.  In
+    /// sharded mode this is divided evenly between the shards.
+    int64_t mmap_size = 0;
+
+    /// The number of database connections to open at startup (at least 1), so that the first
+    /// requests after a restart (or a burst of concurrent ones) don't have to wait for new
+    /// connections to be set up.  More are opened on demand, up to `pool_max`.  In sharded mode
+    /// this is per shard.
+    int pool_min = 1;
+
+    /// If non-zero then a job that needs a database connection when this many are open and all
+    /// in use waits (up to Database::POOL_WAIT_TIMEOUT) for one to be returned, rather than
+    /// opening another.  The extra connections opened after waiting that long anyway (which keeps
+    /// a job that holds one connection while getting another from deadlocking) are closed again
+    /// once they are returned.  In sharded mode this is per shard.
+    int pool_max = 0;
+
+    /// If non-zero then a client store() of a new message is refused (with StoreResult::OverQuota)
+    /// when its owner already has this many bytes of message data stored, so that a single very
+    /// active owner can't take up the space of everyone else.  Messages received from other swarm
+    /// members (bulk_store) aren't subject to the quota.
+    int64_t owner_quota = 0;
+
+    /// If non-zero then no single owner may have more than this many client request jobs waiting
+    /// in the DatabaseExecutor queues at once; see DatabaseExecutor.
+    int owner_max_jobs = 0;
 };
 
 // Storage database class.
@@ -37,39 +137,373 @@ class Database {
     std::stack<std::unique_ptr<DatabaseImpl>> impl_pool_;
     friend class DatabaseImpl;
     friend class LockedDBImpl;
-    std::mutex impl_lock_;
-    std::shared_mutex access_lock_;
+    util::profiled_mutex<std::mutex, "db_pool"> impl_lock_;
+    // Connection pool limits and statistics (see `database_options::pool_min`).  pool_size_ is
+    // the number of open connections, both idle and in use, and is guarded by impl_lock_.
+    const int pool_min_, pool_max_;
+    int pool_size_ = 0;
+    std::condition_variable_any impl_returned_;
+    std::atomic<int64_t> pool_created_ = 0;
+    std::atomic<int64_t> pool_waits_ = 0;
+    std::atomic<int64_t> pool_wait_us_ = 0;
+    // Opens a non-initial connection for `get_impl`, which must already have counted it in
+    // pool_size_.
+    std::unique_ptr<DatabaseImpl> open_connection();
+    // The page size of the database, read by the first connection.
+    int page_size_ = 0;
+    // Held by whichever connection is currently writing.  Readers don't take it at all: the
+    // database is in WAL mode, so readers see a consistent snapshot while a write is in progress.
+    util::profiled_mutex<std::mutex, "db_write"> write_lock_;
     LockedDBImpl get_impl(bool write);
 
-    const std::filesystem::path db_path_;
+    std::filesystem::path db_file_;
+    int64_t size_limit_;
+
+    // In sharded mode (see `database_options::shards`) this instance holds no connections of its
+    // own and instead forwards each call to the appropriate shard(s).
+    std::vector<std::unique_ptr<Database>> shards_;
+    Database& shard_for(const user_pubkey& pubkey);
+
+    struct shard_tag {};
+    Database(
+            shard_tag,
+            std::filesystem::path db_file,
+            int64_t size_limit,
+            const database_options& options);
+    void open();
+    // Returns the shard files (storage-{i}-of-{n}.db) in `db_path` that don't belong to a database
+    // with `shards` shards.
+    static std::vector<std::filesystem::path> stale_shard_files(
+            const std::filesystem::path& db_path, int shards);
+    // Imports the messages and subaccount revocations of the single database file `db_file` (an
+    // unsharded database, or a shard of a different shard count) and then renames the file by
+    // appending `suffix`.
+    void import_database(const std::filesystem::path& db_file, std::u8string_view suffix);
+    bool import_revocation(const user_pubkey& pubkey, const std::string& token, int64_t timestamp);
 
     friend class TestSuiteHacks;
-    void test_suite_block_for(std::chrono::milliseconds duration);
+    void test_suite_block_for(std::chrono::milliseconds duration, bool write = false);
+    std::pair<std::chrono::nanoseconds, std::chrono::nanoseconds> test_suite_statement_lookup(
+            int iterations);
+    std::vector<StoreResult> test_suite_store_batch(const std::vector<message>& msgs);
+
+    // See `database_options::set_hash_queries`.
+    const bool set_hash_queries_;
+
+    // See `database_options::eviction`.
+    const eviction_policy eviction_;
+    std::atomic<int64_t> evicted_ = 0;
+
+    // See `database_options::owner_quota`.
+    const int64_t owner_quota_;
+    std::atomic<int64_t> quota_rejected_ = 0;
+    // Returns the [id, pubkey] of the EVICTION_OWNERS owners with the most messages, largest first.
+    std::vector<std::pair<int64_t, user_pubkey>> eviction_candidates();
+    // Evicts up to `limit` messages of the given owners; returns the number evicted.
+    size_t evict(const std::vector<std::pair<int64_t, user_pubkey>>& owners, size_t limit);
+
+    // Expiry partitioning state (see `database_options::expiry_partition`): the window length in
+    // milliseconds and the number of tables in the ring (both 0 if not partitioned), and the
+    // names of all the message tables: the overflow table followed by the ring, in ring order.
+    const int64_t expiry_partition_ms_;
+    const int expiry_partitions_;
+    std::vector<std::string> message_tables_;
+    // The id to give the next inserted message.  Ids have to be unique across all of the
+    // partition tables, so in partitioned mode we assign them ourselves (under the write lock).
+    int64_t next_message_id_ = 1;
+
+    // Implementation of the bulk_store overloads.
+    template <typename Msg>
+    int bulk_store_impl(const std::vector<Msg>& items);
 
     // keep track of db full errors so we don't print them on every store
     std::atomic<int> db_full_counter = 0;
 
+    // Group commit state; see `database_options::group_commit`.
+    struct pending_store;
+    const bool group_commit_;
+    std::mutex group_commit_mutex_;
+    std::condition_variable group_commit_cv_;
+    std::vector<pending_store*> group_commit_queue_;
+    bool group_commit_active_ = false;
+    std::atomic<int64_t> group_commit_batches_ = 0;
+    std::atomic<int64_t> group_commit_stores_ = 0;
+
+    StoreResult store_single(const message& msg, std::chrono::system_clock::time_point* expiry);
+    StoreResult store_grouped(const message& msg, std::chrono::system_clock::time_point* expiry);
+    void store_batch(const std::vector<pending_store*>& batch);
+
+    // Cache of owner pubkey -> owners.id values, shared by all connections.  Entries are dropped
+    // (via an sqlite update hook on each connection) whenever an owner row is deleted, including
+    // deletions made by the owner_autoclean trigger.
+    //
+    // Because readers can run concurrently with a writer, a reader may look up an owner id from a
+    // snapshot that a writer is in the middle of deleting; to avoid caching such a stale id, each
+    // owner deletion bumps the generation, and a lookup is only cached if the generation did not
+    // change since before the SELECT.  Lookups that start after the deletion but before its commit
+    // is visible still see the old row, so the deleted ids get erased (and the generation bumped)
+    // once more after the commit completes.
+    std::mutex owner_cache_mutex_;
+    std::unordered_map<prefixed_pubkey, int64_t> owner_cache_;
+    std::unordered_map<int64_t, const prefixed_pubkey*> owner_cache_ids_;
+    uint64_t owner_cache_gen_ = 0;
+    std::atomic<int64_t> owner_cache_hits_ = 0;
+    std::atomic<int64_t> owner_cache_misses_ = 0;
+
+    // Returns the cached id in the first value if found; otherwise returns nullopt and the current
+    // cache generation which must be passed to owner_cache_put.
+    std::pair<std::optional<int64_t>, uint64_t> owner_cache_get(const prefixed_pubkey& pubkey);
+    void owner_cache_put(const prefixed_pubkey& pubkey, int64_t id, uint64_t generation);
+    void owner_cache_erase(int64_t id);
+
+    // Cache of the newest messages of recently stored-to (owner, namespace) pairs, used to answer
+    // the very common "anything new since <last hash>?" polling retrieves without touching the
+    // database.  It is only updated from the write path (while holding the write lock, after
+    // committing) so that it stays in step with the database; deletes, expiry changes, and bulk
+    // stores drop the affected owners' entries.
+    struct tail_cache_entry {
+        // The newest messages, in storage order: always a suffix of the (owner, ns)'s messages.
+        std::deque<std::shared_ptr<const message>> msgs;
+        // True if `msgs` holds *all* of the (owner, ns)'s messages, in which case we can also
+        // answer retrieves without a last hash.
+        bool complete = false;
+    };
+    std::mutex tail_cache_mutex_;
+    std::unordered_map<user_pubkey, std::map<namespace_id, tail_cache_entry>> tail_cache_;
+    size_t tail_cache_bytes_ = 0;
+    std::atomic<int64_t> tail_cache_hits_ = 0;
+    std::atomic<int64_t> tail_cache_misses_ = 0;
+
+    struct retrieve_limiter;
+    // The database part of a retrieve, for when the tail cache couldn't answer it.
+    bool retrieve_db(
+            DatabaseImpl& impl,
+            int64_t ownerid,
+            namespace_id ns,
+            const std::string& last_hash,
+            const std::function<void(const message_view& msg)>& callback,
+            retrieve_limiter& limits);
+    void tail_cache_stored(const message& msg, StoreResult result, bool new_owner);
+    void tail_cache_erase(const user_pubkey& pubkey);
+    void tail_cache_expire(int64_t now_ms);
+    // Same as tail_cache_retrieve, but only counts the messages (see count_new).
+    std::optional<int64_t> tail_cache_count(
+            const user_pubkey& pubkey, namespace_id ns, const std::string& last_hash);
+    // Attempts to answer a retrieve from the tail cache.  Returns nullopt if it can't, otherwise
+    // the `more` value of the retrieve.
+    std::optional<bool> tail_cache_retrieve(
+            const user_pubkey& pubkey,
+            namespace_id ns,
+            const std::string& last_hash,
+            const std::function<void(const message_view& msg)>& callback,
+            retrieve_limiter& limits);
+
+    // Every revoked subaccount token (of any owner) in the database, so that subaccount_revoked()
+    // can skip the database query for the (vastly more common) tokens that were never revoked.
+    // This may be a superset: revoke_subaccounts adds tokens (under the write lock, before they
+    // are inserted) but nothing removes them one at a time, since tokens also disappear through
+    // the revoked_autoclean trigger and owner deletions.  Instead the whole set is reloaded, under
+    // the write lock, after unrevoking and whenever it has doubled in size since the last reload.
+    std::mutex revoked_mutex_;
+    std::unordered_set<std::string> revoked_tokens_;
+    size_t revoked_reload_size_ = 0;
+    void revoked_reload(DatabaseImpl& impl);
+
+    // Approximate set of the stored message hashes (see `database_options::hash_filter`).  A store
+    // of a hash that is (probably) in here first looks it up on a read connection, and only takes
+    // the write lock if the message doesn't exist or needs its expiry extended.  Since it is only a
+    // hint (a false positive costs a lookup, and a false negative a trip through the normal write
+    // path) it doesn't have to be exactly in step with the database: stores add hashes after
+    // inserting them and deletions remove the hashes they return, but expiry and eviction, which
+    // don't return hashes, just count as stale entries.  run_maintenance() rebuilds the filter
+    // from the database once too much of it is stale, or if it fills up.
+    const bool hash_filter_enabled_;
+    std::mutex hash_filter_mutex_;
+    util::cuckoo_filter hash_filter_;
+    // Hashes added while a rebuild is scanning the database, to be added to the new filter.
+    std::optional<std::vector<std::string>> hash_filter_pending_;
+    int64_t hash_filter_stale_ = 0;
+    std::atomic<int64_t> hash_filter_skipped_ = 0;
+    std::atomic<int64_t> hash_filter_false_positives_ = 0;
+    std::atomic<int64_t> hash_filter_rebuilds_ = 0;
+    void hash_filter_add(std::string_view hash);
+    void hash_filter_erase(const std::vector<std::string>& hashes);
+    void hash_filter_erase(const std::vector<std::pair<namespace_id, std::string>>& deleted);
+    void hash_filter_expired(int64_t count);
+    bool hash_filter_maybe_contains(std::string_view hash);
+    // (Re)builds the filter from the hashes in the database.
+    void hash_filter_rebuild();
+    // Returns the result of storing `msg` if the hash filter and a lookup show that it would
+    // just be StoreResult::Exists; nullopt if it has to go through the write path.
+    std::optional<StoreResult> store_existing(
+            const message& msg, std::chrono::system_clock::time_point* expiry);
+
+    // Statistics from incremental expiry cleanup (see clean_expired_incremental).
+    std::atomic<int64_t> cleanup_backlog_ = 0;
+    std::atomic<int64_t> cleanup_deleted_ = 0;
+    std::atomic<int64_t> cleanup_chunks_ = 0;
+    std::atomic<int64_t> cleanup_last_chunk_us_ = 0;
+    std::atomic<int64_t> cleanup_max_chunk_us_ = 0;
+
+    // Background maintenance state and statistics (see run_maintenance).  The times are
+    // steady_clock tick counts.
+    bool incremental_vacuum_ = false;
+    std::atomic<int64_t> last_write_ = 0;
+    std::atomic<int64_t> last_maintenance_ = 0;
+    std::atomic<int64_t> checkpoints_ = 0;
+    std::atomic<int64_t> checkpoint_last_us_ = 0;
+    std::atomic<int64_t> checkpoint_max_us_ = 0;
+    std::atomic<int64_t> vacuumed_pages_ = 0;
+
+    // Execution statistics of a single statement (see get_query_stats).
+    struct query_counters {
+        std::atomic<const char*> sql = nullptr;
+        std::atomic<int64_t> uses = 0;
+        std::atomic<int64_t> total_us = 0;
+        std::atomic<int64_t> max_us = 0;
+        std::atomic<int64_t> rows = 0;
+    };
+    // "..."_sql statements are counted by their statement slot, with no locking; the few
+    // statements with runtime-built query text are looked up by text (once per connection).
+    static constexpr size_t MAX_QUERY_SLOTS = 128;
+    static constexpr size_t MAX_QUERY_TEXTS = 128;
+    std::array<query_counters, MAX_QUERY_SLOTS> query_stats_;
+    std::mutex query_text_stats_mutex_;
+    std::unordered_map<std::string, query_counters> query_text_stats_;
+    // See `database_options::slow_query`
+    const std::chrono::microseconds slow_query_;
+    // Returns the counters for the statement in slot `slot` (nullptr if beyond MAX_QUERY_SLOTS).
+    query_counters* query_counters_for(size_t slot, const char* sql);
+    // Returns the counters for a statement with runtime-built query text (nullptr if we are
+    // already tracking MAX_QUERY_TEXTS of them).
+    query_counters* query_counters_for(const std::string& sql);
+    void record_query(
+            query_counters& q, std::chrono::steady_clock::duration elapsed, int64_t rows);
+
+    // See `database_options::cache_size` and `database_options::mmap_size`
+    const int64_t cache_size_;
+    const int64_t mmap_size_;
+    // Page cache hits and misses of the connections, collected as they go back into the pool.
+    std::atomic<int64_t> page_cache_hits_ = 0;
+    std::atomic<int64_t> page_cache_misses_ = 0;
+    void page_cache_collect(DatabaseImpl& impl);
+
+    // Write lock acquisition statistics (see get_write_lock_stats).
+    std::atomic<int64_t> write_locks_ = 0;
+    std::atomic<int64_t> write_locks_contended_ = 0;
+    std::atomic<int64_t> write_lock_wait_us_ = 0;
+    std::atomic<int64_t> write_lock_wait_max_us_ = 0;
+    void lock_for_write();
+
   public:
     // Recommended period for calling clean_expired()
     static constexpr auto CLEANUP_PERIOD = 10s;
 
+    // Number of expired rows deleted per write lock acquisition in clean_expired_incremental().
+    static constexpr size_t CLEANUP_CHUNK_SIZE = 1000;
+
+    // Default per-call budgets for clean_expired_incremental(): we stop after deleting this many
+    // rows, or after spending this long deleting, whichever comes first.  Anything left over is
+    // picked up by the next call.
+    static constexpr size_t CLEANUP_MAX_ROWS = 50'000;
+    static constexpr auto CLEANUP_TIME_BUDGET = 500ms;
+
+    // Recommended period for calling run_maintenance().
+    static constexpr auto MAINTENANCE_PERIOD = 5s;
+
+    // run_maintenance() skips its work if anything was written within the last
+    // MAINTENANCE_IDLE_TIME, unless it has already been put off for MAINTENANCE_MAX_DEFER.
+    static constexpr auto MAINTENANCE_IDLE_TIME = 1s;
+    static constexpr auto MAINTENANCE_MAX_DEFER = 1min;
+
+    // Maximum number of free pages released back to the filesystem per run_maintenance() call.
+    static constexpr int64_t MAINTENANCE_VACUUM_PAGES = 2048;
+
+    // WAL size (in pages) at which sqlite checkpoints by itself, inline in whichever write commit
+    // crosses it.  This is set well above what run_maintenance() normally lets the WAL grow to, so
+    // that it only kicks in as a backstop.
+    static constexpr int WAL_AUTOCHECKPOINT_PAGES = 10'000;
+
+    // Eviction high- and low-water marks, as percentages of the size limit; see
+    // `database_options::eviction`.
+    static constexpr int64_t EVICTION_HIGH_WATER = 95;
+    static constexpr int64_t EVICTION_LOW_WATER = 90;
+
+    // Evicted messages are taken from this many of the owners with the most messages, in chunks of
+    // at most EVICTION_CHUNK_SIZE messages per write lock acquisition.
+    static constexpr int EVICTION_OWNERS = 10;
+    static constexpr size_t EVICTION_CHUNK_SIZE = 250;
+
+    // Maximum number of messages stored in a single group commit transaction.
+    static constexpr size_t GROUP_COMMIT_MAX_BATCH = 250;
+
+    // Maximum number of entries in the in-memory owner id cache.
+    static constexpr size_t OWNER_CACHE_SIZE = 20'000;
+
+    // Limits of the in-memory cache of recent messages used to answer polling retrieves: the
+    // number of messages kept per (owner, namespace), the total hash + data bytes kept, and the
+    // largest individual message that will be cached.
+    static constexpr size_t TAIL_CACHE_MESSAGES = 16;
+    static constexpr size_t TAIL_CACHE_BYTES = 64 * 1024 * 1024;
+    static constexpr size_t TAIL_CACHE_MAX_MESSAGE = 16 * 1024;
+
+    // In expiry partitioned mode the ring has enough tables to hold expiries up to
+    // EXPIRY_PARTITION_HORIZON in the future (anything further out goes to the overflow table),
+    // but never more than MAX_EXPIRY_PARTITIONS tables.
+    static constexpr auto EXPIRY_PARTITION_HORIZON = 31 * 24h;
+    static constexpr int MAX_EXPIRY_PARTITIONS = 64;
+
+    // The stored message hash filter is sized for twice the number of stored messages (but at
+    // least HASH_FILTER_MIN_CAPACITY), and gets rebuilt once more than 1/HASH_FILTER_STALE_FRACTION
+    // of its entries are for messages that expired or were evicted.
+    static constexpr size_t HASH_FILTER_MIN_CAPACITY = 64 * 1024;
+    static constexpr int64_t HASH_FILTER_STALE_FRACTION = 4;
+
     static constexpr int64_t SIZE_LIMIT = int64_t(3584) * 1024 * 1024;  // 3.5 GB
 
+    // How long a job waits for a connection to be returned to a full pool (see
+    // `database_options::pool_max`) before opening an extra one.
+    static constexpr auto POOL_WAIT_TIMEOUT = 100ms;
+
     // Constructor.  Note that you *must* also set up a timer that runs periodically (every
-    // CLEANUP_PERIOD is recommended) and calls clean_expired().
-    explicit Database(std::filesystem::path db_path);
+    // CLEANUP_PERIOD is recommended) and calls clean_expired_incremental(), and should set up one
+    // that calls run_maintenance() (every MAINTENANCE_PERIOD).
+    explicit Database(std::filesystem::path db_path, const database_options& options = {});
 
     ~Database();
 
+    // Returns the number of database files that messages are split across (1 if not sharded).
+    size_t shard_count() const { return shards_.empty() ? 1 : shards_.size(); }
+
+    // Returns the number of expiry partition tables in the ring (0 if not partitioned).
+    int expiry_partition_count() const { return expiry_partitions_; }
+
     // if the database is full then print an error only once ever N errors
     static constexpr int DB_FULL_FREQUENCY = 100;
 
     // Stores a message in the database.  Returns an enum value indicating the result -- see
     // StoreResult for a description.  `expiry` can be set to a pointer into which the message's
     // expiry (existing, if longer; otherwise the one from `msg`) will be copied.
+    //
+    // In group commit mode this may store the message in a transaction shared with other
+    // concurrent store() calls; it still only returns once the message has been committed.
     StoreResult store(const message& msg, std::chrono::system_clock::time_point* expiry = nullptr);
 
-    void bulk_store(const std::vector<message>& items);
+    struct group_commit_stats {
+        int64_t batches;  // number of multi-message transactions committed
+        int64_t stores;   // number of messages stored via multi-message transactions
+    };
+
+    // Returns group commit statistics (which will be all 0 if group commit is not enabled).
+    group_commit_stats get_group_commit_stats() const;
+
+    // Stores multiple messages in a single transaction, ignoring any that we already have.  Returns
+    // the number of messages that were new.
+    int bulk_store(const std::vector<message>& items);
+
+    // Same as above, but stores messages that reference their owner and contents (e.g. in a
+    // received batch) rather than copies of them.
+    int bulk_store(const std::vector<message_ref>& items);
 
     // Default value for message overhead calculations in `retrieve`.  In practice, overhead for the
     // message itself (i.e. the json keys, etc.) seems to be in the 75-80 character range (depending
@@ -97,12 +531,145 @@ class Database {
                     DEFAULT_MSG_OVERHEAD  // how much overhead per message to allow for
     );
 
-    // Retrieves all messages.
+    // Same as `retrieve`, but rather than building a vector of messages this invokes `callback` for
+    // each retrieved row while the query is being stepped.  The message_view passed to the callback
+    // points directly at sqlite's row buffers, and so is only valid until the callback returns.
+    // The callback is invoked with the database connection held, so it should not do anything
+    // expensive beyond encoding the row.
+    //
+    // Returns true if there are more results to retrieve.
+    bool retrieve_each(
+            const user_pubkey& pubkey,
+            namespace_id ns,
+            const std::string& last_hash,
+            const std::function<void(const message_view& msg)>& callback,
+            std::optional<size_t> num_results = std::nullopt,
+            std::optional<size_t> max_size = std::nullopt,
+            bool size_b64 = true,
+            size_t per_message_overhead = DEFAULT_MSG_OVERHEAD);
+
+    // One namespace's part of a `retrieve_multi` call.
+    struct retrieve_request {
+        namespace_id ns;
+        std::string last_hash;
+        std::optional<size_t> max_results;
+        std::optional<size_t> max_size;
+        // Whether this request's data will get b64-encoded; if not set, the call's `size_b64`.
+        std::optional<bool> size_b64;
+    };
+
+    // Retrieves from several namespaces of the same owner at once, using a single connection and
+    // owner lookup.  Each request has its own limits, as in `retrieve_each`; `total_max_size`, if
+    // given, additionally limits the combined size of everything returned (though at least one
+    // message is always returned, if there are any), with each message counted at its size in the
+    // request that returns it.  Requests are processed in order, so when the total limit is reached
+    // it is the later requests that get truncated.  `callback` is invoked with the index of the
+    // request and each message, as in `retrieve_each`.
+    //
+    // Returns a vector of the same length as `requests` of whether each has more results.
+    std::vector<bool> retrieve_multi(
+            const user_pubkey& pubkey,
+            const std::vector<retrieve_request>& requests,
+            const std::function<void(size_t index, const message_view& msg)>& callback,
+            std::optional<size_t> total_max_size = std::nullopt,
+            bool size_b64 = true,
+            size_t per_message_overhead = DEFAULT_MSG_OVERHEAD);
+
+    // Returns, for each request, the number of messages in the namespace stored after the message
+    // with the request's last hash (or all of the namespace's messages if the last hash is empty or
+    // no longer exists): i.e. how many messages a retrieve with the same arguments would return,
+    // were it unlimited.  The requests' limits are ignored.  This is answered from the tail cache
+    // or from the owner index of the message table(s), without loading any message data (though
+    // with expiry partitions, the ring tables' expiries still have to be read).
+    std::vector<int64_t> count_new(
+            const user_pubkey& pubkey, const std::vector<retrieve_request>& requests);
+
+    // The results of a `read_owner` call.
+    struct owner_read_results {
+        std::vector<bool> more;                                // One per retrieve request
+        std::vector<std::map<std::string, int64_t>> expiries;  // One per expiries request
+    };
+
+    // Performs several reads for the same owner at once, within a single read transaction (and so
+    // against one consistent snapshot of the database) using a single connection and owner
+    // lookup.  `retrieves` are handled as in `retrieve_multi` (with the same callback and limits),
+    // and each element of `expiries` is a list of message hashes looked up as in `get_expiries`.
+    owner_read_results read_owner(
+            const user_pubkey& pubkey,
+            const std::vector<retrieve_request>& retrieves,
+            const std::function<void(size_t index, const message_view& msg)>& callback,
+            const std::vector<std::vector<std::string>>& expiries,
+            std::optional<size_t> total_max_size = std::nullopt,
+            bool size_b64 = true,
+            size_t per_message_overhead = DEFAULT_MSG_OVERHEAD);
+
+    // Retrieves all messages.  Note that this loads the entire database into memory; prefer
+    // `for_each_message` when the messages can be processed incrementally.
     std::vector<message> retrieve_all();
 
+    // Default chunk limits for `for_each_message`.
+    static constexpr size_t ITERATE_CHUNK_SIZE = 1000;
+    static constexpr size_t ITERATE_CHUNK_BYTES = 8'000'000;
+
+    // Iterates through all stored messages (in storage order) in chunks of at most `max_count`
+    // messages and approximately `max_bytes` of message hash + data, invoking `callback` with each
+    // chunk.  The callback may move values out of the chunk, and returns true to continue
+    // iterating or false to stop.
+    //
+    // The database lock is only held while loading each chunk, *not* while the callback runs, so
+    // messages that are stored or deleted during the iteration may or may not be visited.
+    //
+    // Returns the number of messages passed to the callback.
+    size_t for_each_message(
+            const std::function<bool(std::vector<message>& chunk)>& callback,
+            size_t max_count = ITERATE_CHUNK_SIZE,
+            size_t max_bytes = ITERATE_CHUNK_BYTES);
+
+    // Like the above, but only visits messages whose owner pubkey maps into the swarm space range
+    // [swarm_space_begin, swarm_space_end) (see `pubkey_to_swarm_space`).  The range wraps around
+    // if end <= begin, and thus begin == end visits all messages.  Messages are visited grouped by
+    // owner, in swarm space order, rather than in storage order.
+    size_t for_each_message(
+            uint64_t swarm_space_begin,
+            uint64_t swarm_space_end,
+            const std::function<bool(std::vector<message>& chunk)>& callback,
+            size_t max_count = ITERATE_CHUNK_SIZE,
+            size_t max_bytes = ITERATE_CHUNK_BYTES);
+
     // Return the total number of messages stored
     int64_t get_message_count();
 
+    // Returns the number of messages whose owner maps into the swarm space range
+    // [swarm_space_begin, swarm_space_end), with the same wrapping semantics as the range version
+    // of `for_each_message`.
+    int64_t get_message_count(uint64_t swarm_space_begin, uint64_t swarm_space_end);
+
+    // Splits the swarm space range [begin, end) (wrapping, as in `for_each_message`) into at most
+    // `n` consecutive, non-empty sub-ranges of nearly equal width, in order.  This is deterministic
+    // so that two nodes summarizing the same range with `summarize_range` get the same buckets.
+    static std::vector<std::pair<uint64_t, uint64_t>> split_swarm_space(
+            uint64_t begin, uint64_t end, size_t n);
+
+    // Order-independent summary of the messages stored in some part of swarm space: the number of
+    // messages and the XOR of a (stable, 64-bit) digest of each message hash.  Two nodes with the
+    // same summary (almost certainly) store the same set of messages in that part of swarm space.
+    struct range_summary {
+        int64_t count = 0;
+        uint64_t digest = 0;
+
+        bool operator==(const range_summary& o) const {
+            return count == o.count && digest == o.digest;
+        }
+        bool operator!=(const range_summary& o) const { return !(*this == o); }
+    };
+
+    // Returns the summaries of each of the sub-ranges of `split_swarm_space(begin, end, n)`.
+    std::vector<range_summary> summarize_range(uint64_t begin, uint64_t end, size_t n);
+
+    // Returns the hashes of all messages whose owner maps into swarm space [begin, end), or just
+    // the first `limit` of them if `limit` is non-negative.
+    std::vector<std::string> hashes_in_range(uint64_t begin, uint64_t end, int64_t limit = -1);
+
     // Returns the per-owner counts of stored messages, for storage statistics purposes.
     std::vector<int> get_message_counts();
 
@@ -122,17 +689,152 @@ class Database {
     // bound on actual stored size as there may be partially filled pages.
     int64_t get_used_bytes();
 
-    // Get random message. Returns nullopt if there are no messages.
+    // Get random unexpired message. Returns nullopt if there are no (unexpired) messages.  This is
+    // cheap (a few index lookups) but not perfectly uniform when there are gaps in the message ids.
     std::optional<message> retrieve_random();
 
     // Get message by `msg_hash`, return true if found.  Note that this does *not* filter by
     // pubkey or namespace!
     std::optional<message> retrieve_by_hash(const std::string& msg_hash);
 
-    // Removes expired messages from the database; the `Database` instance owner should call
-    // this periodically.
+    // Removes expired messages from the database.  This deletes everything expired in a single
+    // statement, holding the write lock until done; for periodic cleanup you generally want
+    // clean_expired_incremental() instead.
     void clean_expired();
 
+    // Removes expired messages in chunks of at most `chunk_size` rows, re-acquiring the write lock
+    // for each chunk so that other queries can interleave with the cleanup.  Stops once there is
+    // nothing left to delete, `max_rows` rows have been deleted, or `max_time` has elapsed.
+    // Returns the number of deleted messages.  The `Database` instance owner should call this
+    // periodically (every CLEANUP_PERIOD is recommended).
+    size_t clean_expired_incremental(
+            size_t chunk_size = CLEANUP_CHUNK_SIZE,
+            size_t max_rows = CLEANUP_MAX_ROWS,
+            std::chrono::milliseconds max_time = CLEANUP_TIME_BUDGET);
+
+    struct cleanup_stats {
+        int64_t backlog;        // expired messages left after the last incremental cleanup
+        int64_t deleted;        // total messages deleted by incremental cleanup
+        int64_t chunks;         // total number of delete chunks executed
+        int64_t last_chunk_us;  // duration of the most recent chunk, in microseconds
+        int64_t max_chunk_us;   // longest chunk duration seen, in microseconds
+    };
+
+    // Returns statistics about incremental expiry cleanup.
+    cleanup_stats get_cleanup_stats() const;
+
+    // If an eviction policy is set (see `database_options::eviction`) and the database is above
+    // its high-water mark then this evicts messages until it is below the low-water mark, or until
+    // CLEANUP_TIME_BUDGET has elapsed.  Returns the number of evicted messages.  This should be
+    // called periodically, typically right after clean_expired_incremental().
+    size_t evict_excess();
+
+    // Returns the total number of messages evicted to make room since startup.
+    int64_t get_evicted_count() const;
+
+    // Returns the total size of the message data stored for the given pubkey (which is what
+    // `database_options::owner_quota` limits).
+    int64_t get_owner_bytes(const user_pubkey& pubkey);
+
+    // Returns the number of stores refused since startup because of the owner quota.
+    int64_t get_quota_rejected_count() const;
+
+    // Performs background database upkeep so that it doesn't happen inline in client requests:
+    // releases up to MAINTENANCE_VACUUM_PAGES free pages (if the database was created with
+    // incremental auto-vacuum), checkpoints the write-ahead log, truncating it once fully
+    // checkpointed, and rebuilds the stored message hash filter if it has become too stale or full.
+    // Unless `force` is given this does nothing while the database is busy with writes (see
+    // MAINTENANCE_IDLE_TIME).  Returns true if maintenance ran.
+    bool run_maintenance(bool force = false);
+
+    struct maintenance_stats {
+        int64_t wal_bytes;           // current size of the write-ahead log file
+        int64_t freelist_pages;      // unused pages in the database file
+        int64_t checkpoints;         // number of checkpoints performed by run_maintenance
+        int64_t last_checkpoint_us;  // duration of the most recent checkpoint, in microseconds
+        int64_t max_checkpoint_us;   // longest checkpoint duration seen, in microseconds
+        int64_t vacuumed_pages;      // total free pages released by incremental vacuum
+    };
+
+    // Returns statistics about background maintenance, and the current WAL and freelist sizes.
+    maintenance_stats get_maintenance_stats();
+
+    struct owner_cache_stats {
+        int64_t hits;    // owner id lookups answered from the cache
+        int64_t misses;  // owner id lookups that had to query the database
+        int64_t size;    // current number of cached owner ids
+    };
+
+    // Returns statistics about the owner id cache.
+    owner_cache_stats get_owner_cache_stats();
+
+    struct tail_cache_stats {
+        int64_t hits;    // retrieves answered from the recent message cache
+        int64_t misses;  // retrieves that had to query the database
+        int64_t bytes;   // current hash + data bytes held in the cache
+    };
+
+    // Returns statistics about the recent message (tail) cache.
+    tail_cache_stats get_tail_cache_stats();
+
+    struct hash_filter_stats {
+        int64_t size;             // hashes currently in the filter (including stale ones)
+        int64_t bytes;            // memory used by the filter
+        int64_t skipped;          // stored messages recognized as existing without a write
+        int64_t false_positives;  // filter hits that turned out not to be stored
+        int64_t rebuilds;         // number of times the filter was rebuilt from the database
+    };
+
+    // Returns statistics about the stored message hash filter.
+    hash_filter_stats get_hash_filter_stats();
+
+    struct query_stats {
+        std::string query;  // the statement's query text
+        int64_t uses;       // number of times the statement was executed
+        int64_t total_us;   // total execution time, in microseconds
+        int64_t max_us;     // longest single execution, in microseconds
+        int64_t rows;       // total rows returned plus rows changed
+    };
+
+    // Returns execution statistics of each statement that has been executed, most total time
+    // first.  The execution time of a statement is the time from looking up its prepared statement
+    // until it is reset (so it includes binding and reading the results, but not waiting for the
+    // write lock: that is in get_write_lock_stats).  One-off statements (and those of
+    // `database_options::set_hash_queries = false`) aren't tracked.
+    std::vector<query_stats> get_query_stats();
+
+    struct write_lock_stats {
+        int64_t acquisitions;  // number of times the write lock was taken
+        int64_t contended;     // acquisitions that had to wait for another writer
+        int64_t wait_us;       // total time spent waiting for the lock, in microseconds
+        int64_t max_wait_us;   // longest wait for the lock, in microseconds
+    };
+
+    // Returns statistics about how long writers have waited to acquire the write lock.
+    write_lock_stats get_write_lock_stats() const;
+
+    struct page_cache_stats {
+        int64_t hits;        // page reads answered from a connection's page cache
+        int64_t misses;      // page reads that had to go to the database file (or memory map)
+        int64_t cache_size;  // the page cache size of each connection, in bytes
+        int64_t mmap_size;   // the number of bytes of the database file(s) that can be mapped
+    };
+
+    // Returns the page cache hit and miss counts of the database connections (as of when each
+    // connection was last returned to the pool), and the cache and memory map sizes in use.
+    page_cache_stats get_page_cache_stats();
+
+    struct pool_stats {
+        int64_t size;     // connections currently open, idle or in use
+        int64_t idle;     // open connections not currently in use
+        int64_t created;  // connections opened since startup (including the startup ones)
+        int64_t waits;    // jobs that had to wait for a connection because the pool was at its max
+        int64_t wait_us;  // total time spent waiting for a connection, in microseconds
+    };
+
+    // Returns statistics about the database connection pool.
+    pool_stats get_pool_stats();
+
     // Deletes all messages owned by the given pubkey.  Returns the [namespace, hash] pairs of any
     // deleted messages.
     std::vector<std::pair<namespace_id, std::string>> delete_all(const user_pubkey& pubkey);
@@ -141,9 +843,9 @@ class Database {
     // of any deleted messages.
     std::vector<std::string> delete_all(const user_pubkey& pubkey, namespace_id ns);
 
-    // Delete messages owned by the given pubkey having the given hashes.  Returns the hashes of any
-    // deleted messages.
-    std::vector<std::string> delete_by_hash(
+    // Delete messages owned by the given pubkey having the given hashes.  Returns the [namespace,
+    // hash] pairs of any deleted messages.
+    std::vector<std::pair<namespace_id, std::string>> delete_by_hash(
             const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes);
 
     // Deletes all messages owned by the given pubkey with a timestamp <= timestamp.  Returns the
@@ -170,19 +872,27 @@ class Database {
             const user_pubkey& pubkey, const std::vector<subaccount_token>& subaccount);
 
     // Checks if a subaccount token exists in the revoked subaccount database. Returns true if the
-    // subaccount has been revoked, false otherwise.
+    // subaccount has been revoked, false otherwise.  Tokens that have never been revoked (by any
+    // owner) are answered from memory without a database query.
     bool subaccount_revoked(const user_pubkey& pubkey, const subaccount_token& subaccount);
 
-    // Updates the expiry time of the given messages owned by the given pubkey.  Returns a vector of
-    // pairs of hashes of updated messages to the new expiry of the messages.  Hashes that don't
-    // exist, or were not updated, are not returned.
+    // A message whose expiry was changed by update_expiry.
+    struct updated_expiry {
+        std::string hash;
+        std::chrono::system_clock::time_point expiry;  // the new expiry
+        namespace_id ns;
+    };
+
+    // Updates the expiry time of the given messages owned by the given pubkey.  Returns the hashes,
+    // new expiries, and namespaces of updated messages.  Hashes that don't exist, or were not
+    // updated, are not returned.
     //
     // extend_only and shorten_only allow message expiries to only be adjusted in one way or the
     // other.  They are mutually exclusive.
     //
     // new_exp can be length one to apply the same timestamp to all messages, or the same length as
     // msg_hashes to apply a different timestamp to each.
-    std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> update_expiry(
+    std::vector<updated_expiry> update_expiry(
             const user_pubkey& pubkey,
             const std::vector<std::string>& msg_hashes,
             const std::vector<std::chrono::system_clock::time_point> new_exp,
@@ -207,6 +917,23 @@ class Database {
     // found are not included).
     std::map<std::string, int64_t> get_expiries(
             const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes);
+
+  private:
+    // The work of retrieve_multi (and of read_owner's retrieves) on an already held connection.
+    // `ownerid` is looked up on first use if not already set.
+    std::vector<bool> retrieve_multi_impl(
+            DatabaseImpl& impl,
+            std::optional<std::optional<int64_t>>& ownerid,
+            const user_pubkey& pubkey,
+            const std::vector<retrieve_request>& requests,
+            const std::function<void(size_t index, const message_view& msg)>& callback,
+            std::optional<size_t> total_max_size,
+            bool size_b64,
+            size_t per_message_overhead);
+
+    // The work of get_expiries for an already looked up owner.
+    std::map<std::string, int64_t> get_expiries_impl(
+            DatabaseImpl& impl, int64_t owner, const std::vector<std::string>& msg_hashes);
 };
 
 }  // namespace oxenss
@@ -0,0 +1,135 @@
+#include "executor.hpp"
+#include "database.hpp"
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <algorithm>
+#include <exception>
+
+namespace oxenss {
+
+static auto logcat = log::Cat("db");
+
+DatabaseExecutor::DatabaseExecutor(Database& db, int readers, int writers, int max_owner_jobs) :
+        db_{db}, max_owner_jobs_{max_owner_jobs} {
+    start(read_q_, std::max(readers, 1));
+    start(write_q_, std::max(writers, 1));
+}
+
+DatabaseExecutor::~DatabaseExecutor() {
+    shutdown();
+}
+
+void DatabaseExecutor::start(job_queue& q, int threads) {
+    q.threads.reserve(threads);
+    for (int i = 0; i < threads; i++)
+        q.threads.emplace_back([this, &q] { run(q); });
+}
+
+void DatabaseExecutor::run(job_queue& q) {
+    std::unique_lock lock{q.mutex};
+    while (true) {
+        q.cv.wait(lock, [&q] { return q.stopping || !q.jobs.empty(); });
+        if (q.jobs.empty())
+            return;  // Stopping, and we've finished off the queue
+        auto it = q.jobs.begin();
+        q.vtime = std::max(q.vtime, it->first);
+        auto [queued_at, owner, job] = std::move(it->second);
+        q.jobs.erase(it);
+        bool owned = owner != prefixed_pubkey{};
+        if (owned)
+            q.owners[owner].queued--;
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        int64_t waited =
+                std::chrono::duration_cast<std::chrono::microseconds>(start - queued_at).count();
+        q.started++;
+        q.wait_us += waited;
+        auto max = q.max_wait_us.load();
+        while (waited > max && !q.max_wait_us.compare_exchange_weak(max, waited)) {}
+
+        try {
+            job(db_);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Uncaught exception in database job: {}", e.what());
+        }
+        job = nullptr;  // Release anything the job holds before we retake the lock
+
+        lock.lock();
+        if (owned) {
+            // Charge the owner for the time the job actually took, in place of the estimate it was
+            // queued with.  Once it has nothing left waiting or running it starts afresh.
+            auto o = q.owners.find(owner);
+            if (--o->second.active == 0)
+                q.owners.erase(o);
+            else
+                o->second.finish += std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - start -
+                                            JOB_COST_ESTIMATE)
+                                            .count();
+        }
+    }
+}
+
+bool DatabaseExecutor::submit(
+        job_queue& q, std::function<void(Database&)> job, const prefixed_pubkey& owner) {
+    {
+        std::lock_guard lock{q.mutex};
+        if (!q.stopping) {
+            int64_t start = q.vtime;
+            if (owner != prefixed_pubkey{}) {
+                auto& o = q.owners[owner];
+                if (max_owner_jobs_ > 0 && o.queued >= max_owner_jobs_) {
+                    q.rejected++;
+                    return false;
+                }
+                start = std::max(start, o.finish);
+                o.finish = start + JOB_COST_ESTIMATE.count();
+                o.queued++;
+                o.active++;
+            }
+            q.jobs.emplace(
+                    start, queued_job{std::chrono::steady_clock::now(), owner, std::move(job)});
+            q.cv.notify_one();
+            return true;
+        }
+    }
+    job(db_);
+    return true;
+}
+
+void DatabaseExecutor::shutdown() {
+    for (auto* q : {&read_q_, &write_q_}) {
+        {
+            std::lock_guard lock{q->mutex};
+            q->stopping = true;
+        }
+        q->cv.notify_all();
+    }
+    for (auto* q : {&read_q_, &write_q_}) {
+        for (auto& t : q->threads)
+            if (t.joinable())
+                t.join();
+        q->threads.clear();
+    }
+}
+
+DatabaseExecutor::queue_stats DatabaseExecutor::get_stats(const job_queue& q) const {
+    queue_stats st;
+    {
+        std::lock_guard lock{q.mutex};
+        st.queued = q.jobs.size();
+        st.owners = q.owners.size();
+        st.owner_max = 0;
+        for (auto& [owner, o] : q.owners)
+            st.owner_max = std::max<size_t>(st.owner_max, o.queued);
+    }
+    st.jobs = q.started;
+    st.wait_us = q.wait_us;
+    st.max_wait_us = q.max_wait_us;
+    st.rejected = q.rejected;
+    return st;
+}
+
+}  // namespace oxenss
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <oxenss/common/pubkey.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace oxenss {
+
+class Database;
+
+// Runs Database work on dedicated threads, so that the threads handling network requests (oxenmq
+// category workers, https and quic handlers) never block on sqlite themselves: they queue a job
+// and go back to handling requests, and the job delivers its result (typically by invoking a
+// response callback) from a database thread once it has run.
+//
+// Reads and writes have separate queues and threads: writes serialize on the database write lock
+// anyway, so giving them their own threads means that a slow write (expiry cleanup, eviction, a
+// large bulk store) only holds up other writes while reads carry on.
+//
+// Jobs done on behalf of a particular owner (pubkey) are fair queued against the jobs of other
+// owners: each owner's jobs get virtual start times that advance by the database time its previous
+// jobs took (see JOB_COST_ESTIMATE), and jobs start in order of virtual start time.  An owner
+// with only a job or two in flight thus gets its jobs started right away, while one with a deep
+// backlog only holds up its own jobs rather than everyone queued behind it.  Jobs without an owner
+// (replication, cleanup, etc.) start at the current virtual time, i.e. in the order they were
+// queued.  `max_owner_jobs`, if non-zero, additionally limits how many jobs any single owner may
+// have waiting at once: further jobs of that owner are refused until some of them have started.
+class DatabaseExecutor {
+  public:
+    // Default number of threads running read jobs.
+    static constexpr int DEFAULT_READERS = 4;
+
+    // The database time charged to an owner for each of its jobs when it is queued; once the job
+    // has run this gets corrected to the time it actually took.
+    static constexpr std::chrono::microseconds JOB_COST_ESTIMATE = std::chrono::microseconds{500};
+
+    DatabaseExecutor(
+            Database& db, int readers = DEFAULT_READERS, int writers = 1, int max_owner_jobs = 0);
+
+    // Calls shutdown().
+    ~DatabaseExecutor();
+
+    DatabaseExecutor(const DatabaseExecutor&) = delete;
+    DatabaseExecutor& operator=(const DatabaseExecutor&) = delete;
+
+    // Queues a job that only reads from the database.  If `owner` is given then the job is fair
+    // queued as being done for that owner; returns false, without queuing (or running) the job,
+    // if the owner already has `max_owner_jobs` jobs waiting.  Jobs without an owner are always
+    // queued.
+    bool read(std::function<void(Database&)> job, const prefixed_pubkey& owner = {}) {
+        return submit(read_q_, std::move(job), owner);
+    }
+
+    // Queues a job that (potentially) modifies the database; `owner` is as in `read()`.
+    bool write(std::function<void(Database&)> job, const prefixed_pubkey& owner = {}) {
+        return submit(write_q_, std::move(job), owner);
+    }
+
+    // Same as read() and write(), but returns a future for the value returned by (or exception
+    // thrown from) `f(db)`.
+    template <typename F>
+    auto read_future(F&& f) {
+        return submit_future(read_q_, std::forward<F>(f));
+    }
+    template <typename F>
+    auto write_future(F&& f) {
+        return submit_future(write_q_, std::forward<F>(f));
+    }
+
+    // Runs any jobs that are still queued, then stops and joins the database threads.  Jobs queued
+    // after this get run immediately on the calling thread.  Must not be called from a job.
+    void shutdown();
+
+    struct queue_stats {
+        size_t queued;        // jobs currently waiting for a thread
+        int64_t jobs;         // jobs started so far
+        int64_t wait_us;      // total time that started jobs spent waiting, in microseconds
+        int64_t max_wait_us;  // longest time any job spent waiting, in microseconds
+        size_t owners;        // distinct owners with jobs currently waiting or running
+        size_t owner_max;     // the most jobs that any one owner has waiting right now
+        int64_t rejected;     // owner jobs refused because of `max_owner_jobs`
+    };
+
+    queue_stats get_read_stats() const { return get_stats(read_q_); }
+    queue_stats get_write_stats() const { return get_stats(write_q_); }
+
+  private:
+    Database& db_;
+    const int max_owner_jobs_;
+
+    struct queued_job {
+        std::chrono::steady_clock::time_point queued_at;
+        prefixed_pubkey owner;  // all-zero for a job without an owner
+        std::function<void(Database&)> job;
+    };
+
+    // Fair queuing state of an owner with jobs waiting or running.
+    struct owner_state {
+        int64_t finish = 0;  // virtual time at which the owner's last queued job will be done
+        int queued = 0;      // jobs waiting to start
+        int active = 0;      // jobs waiting or running
+    };
+
+    struct job_queue {
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        // Waiting jobs, by virtual start time (in microseconds of database time); jobs with the
+        // same start time are kept in the order they were queued.
+        std::multimap<int64_t, queued_job> jobs;
+        // The virtual start time of the most recently started job.
+        int64_t vtime = 0;
+        std::unordered_map<prefixed_pubkey, owner_state> owners;
+        bool stopping = false;
+        std::vector<std::thread> threads;
+        std::atomic<int64_t> started = 0;
+        std::atomic<int64_t> wait_us = 0;
+        std::atomic<int64_t> max_wait_us = 0;
+        std::atomic<int64_t> rejected = 0;
+    };
+    job_queue read_q_;
+    job_queue write_q_;
+
+    void start(job_queue& q, int threads);
+    void run(job_queue& q);
+    bool submit(
+            job_queue& q, std::function<void(Database&)> job, const prefixed_pubkey& owner = {});
+    queue_stats get_stats(const job_queue& q) const;
+
+    template <typename F>
+    auto submit_future(job_queue& q, F&& f) {
+        using R = std::invoke_result_t<std::decay_t<F>&, Database&>;
+        auto promise = std::make_shared<std::promise<R>>();
+        auto fut = promise->get_future();
+        submit(q, [promise, f = std::forward<F>(f)](Database& db) mutable {
+            try {
+                if constexpr (std::is_void_v<R>) {
+                    f(db);
+                    promise->set_value();
+                } else
+                    promise->set_value(f(db));
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return fut;
+    }
+};
+
+}  // namespace oxenss
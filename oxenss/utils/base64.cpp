@@ -0,0 +1,305 @@
+#include "base64.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define OXENSS_BASE64_X86 1
+#include <immintrin.h>
+#endif
+
+namespace oxenss::util {
+
+namespace {
+
+    constexpr std::string_view alphabet =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    // Decoding also accepts the URL-safe alphabet's '-' and '_' (in place of '+' and '/'), as
+    // oxenc does.
+    constexpr auto decode_table = [] {
+        std::array<uint8_t, 256> t{};
+        for (size_t i = 0; i < alphabet.size(); i++)
+            t[static_cast<unsigned char>(alphabet[i])] = static_cast<uint8_t>(i);
+        t['-'] = 62;
+        t['_'] = 63;
+        return t;
+    }();
+
+    // Each kernel consumes as much of the input as it can handle, writing to `out` and advancing
+    // both pointers; the scalar code then deals with whatever is left.
+    using encode_kernel = void (*)(const unsigned char*& in, size_t& n, char*& out);
+    using decode_kernel = void (*)(const unsigned char*& in, size_t& n, unsigned char*& out);
+
+    void encode_scalar(const unsigned char* in, size_t n, char* out) {
+        for (; n >= 3; n -= 3, in += 3) {
+            uint32_t v = (uint32_t{in[0]} << 16) | (uint32_t{in[1]} << 8) | in[2];
+            *out++ = alphabet[v >> 18];
+            *out++ = alphabet[(v >> 12) & 0x3f];
+            *out++ = alphabet[(v >> 6) & 0x3f];
+            *out++ = alphabet[v & 0x3f];
+        }
+        if (n) {
+            uint32_t v = uint32_t{in[0]} << 16;
+            if (n == 2)
+                v |= uint32_t{in[1]} << 8;
+            *out++ = alphabet[v >> 18];
+            *out++ = alphabet[(v >> 12) & 0x3f];
+            *out++ = n == 2 ? alphabet[(v >> 6) & 0x3f] : '=';
+            *out++ = '=';
+        }
+    }
+
+    // Returns the number of bytes written.
+    size_t decode_scalar(const unsigned char* in, size_t n, unsigned char* out) {
+        while (n && in[n - 1] == '=')
+            n--;
+        unsigned char* start = out;
+        uint32_t acc = 0;
+        int bits = 0;
+        for (size_t i = 0; i < n; i++) {
+            acc = (acc << 6) | decode_table[in[i]];
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                *out++ = static_cast<unsigned char>(acc >> bits);
+            }
+        }
+        return out - start;
+    }
+
+#ifdef OXENSS_BASE64_X86
+
+    // The SIMD kernels follow the approach of Wojciech Muła's and Alfred Klomp's vectorized base64
+    // codecs: shuffle 3-byte groups into 32-bit lanes, split them into four 6-bit values with a
+    // pair of multiplies, then map those to (or from) ASCII with a nibble-indexed lookup.
+
+    __attribute__((target("ssse3"))) __m128i enc_translate_ssse3(__m128i in) {
+        const __m128i lut =
+                _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+        __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+        __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+        indices = _mm_sub_epi8(indices, mask);
+        return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+    }
+
+    __attribute__((target("ssse3"))) __m128i enc_reshuffle_ssse3(__m128i in) {
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        return _mm_or_si128(t1, t3);
+    }
+
+    __attribute__((target("ssse3"))) void encode_ssse3(
+            const unsigned char*& in, size_t& n, char*& out) {
+        // Each round reads 16 bytes but only consumes 12 of them:
+        for (; n >= 16; n -= 12, in += 12, out += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+            v = enc_translate_ssse3(enc_reshuffle_ssse3(v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), v);
+        }
+    }
+
+    __attribute__((target("avx2"))) void encode_avx2(
+            const unsigned char*& in, size_t& n, char*& out) {
+        const __m256i shuf = _mm256_setr_epi8(
+                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+        const __m256i lut = _mm256_setr_epi8(
+                65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+        // Each round consumes 24 bytes (12 per 128-bit lane), but reads 28:
+        for (; n >= 28; n -= 24, in += 24, out += 32) {
+            __m256i v = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in))),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12)),
+                    1);
+            v = _mm256_shuffle_epi8(v, shuf);
+            const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+            const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+            const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+            const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+            v = _mm256_or_si256(t1, t3);
+
+            __m256i indices = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+            __m256i mask = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25));
+            indices = _mm256_sub_epi8(indices, mask);
+            v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, indices));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v);
+        }
+        // Finish off with SSSE3 rounds, if there is enough left for any:
+        encode_ssse3(in, n, out);
+    }
+
+    // Replaces the URL-safe alphabet's '-' and '_' with '+' and '/', which the lookups below
+    // expect.
+    __attribute__((target("ssse3"))) __m128i dec_url_safe_ssse3(__m128i in) {
+        const __m128i dash = _mm_cmpeq_epi8(in, _mm_set1_epi8('-'));
+        const __m128i underscore = _mm_cmpeq_epi8(in, _mm_set1_epi8('_'));
+        in = _mm_add_epi8(in, _mm_and_si128(dash, _mm_set1_epi8('+' - '-')));
+        return _mm_add_epi8(in, _mm_and_si128(underscore, _mm_set1_epi8('/' - '_')));
+    }
+
+    // Decodes the 6-bit values of 16 base64 characters; returns false (and leaves `in` untouched)
+    // if any of them isn't in the base64 (or URL-safe base64) alphabet.
+    __attribute__((target("ssse3"))) bool dec_translate_ssse3(__m128i& in) {
+        const __m128i lut_lo = _mm_setr_epi8(
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+        const __m128i lut_hi = _mm_setr_epi8(
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m128i lut_roll =
+                _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+        const __m128i v = dec_url_safe_ssse3(in);
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(v, mask_2f);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+            return false;
+        const __m128i eq_2f = _mm_cmpeq_epi8(v, mask_2f);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        in = _mm_add_epi8(v, roll);
+        return true;
+    }
+
+    // Packs 16 6-bit values into the low 12 bytes.
+    __attribute__((target("ssse3"))) __m128i dec_reshuffle_ssse3(__m128i in) {
+        const __m128i merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+        const __m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        return _mm_shuffle_epi8(
+                out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    }
+
+    __attribute__((target("ssse3"))) void decode_ssse3(
+            const unsigned char*& in, size_t& n, unsigned char*& out) {
+        // We leave at least the last 4 characters (which might involve padding) to the scalar
+        // code.  Each round writes 16 bytes but only 12 of them are output; the caller leaves room
+        // for the excess.
+        for (; n >= 20; n -= 16, in += 16, out += 12) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+            if (!dec_translate_ssse3(v))
+                return;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), dec_reshuffle_ssse3(v));
+        }
+    }
+
+    __attribute__((target("avx2"))) void decode_avx2(
+            const unsigned char*& in, size_t& n, unsigned char*& out) {
+        const __m256i lut_lo = _mm256_setr_epi8(
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+        const __m256i lut_hi = _mm256_setr_epi8(
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m256i lut_roll = _mm256_setr_epi8(
+                0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+        const __m256i pack = _mm256_setr_epi8(
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+        // As above: the last 4 characters are left to the scalar code, and each round writes 32
+        // bytes, of which only 24 are output.
+        for (; n >= 36; n -= 32, in += 32, out += 24) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+            // URL-safe '-' and '_' become '+' and '/' (see dec_url_safe_ssse3):
+            const __m256i dash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'));
+            const __m256i underscore = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+            v = _mm256_add_epi8(v, _mm256_and_si256(dash, _mm256_set1_epi8('+' - '-')));
+            v = _mm256_add_epi8(v, _mm256_and_si256(underscore, _mm256_set1_epi8('/' - '_')));
+            const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+            const __m256i lo_nibbles = _mm256_and_si256(v, mask_2f);
+            const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+            const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+            if (!_mm256_testz_si256(lo, hi))
+                break;
+            const __m256i eq_2f = _mm256_cmpeq_epi8(v, mask_2f);
+            v = _mm256_add_epi8(
+                    v, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+            v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+            v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+            v = _mm256_shuffle_epi8(v, pack);
+            v = _mm256_permutevar8x32_epi32(v, lanes);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v);
+        }
+        decode_ssse3(in, n, out);
+    }
+
+#endif
+
+    struct kernels {
+        encode_kernel encode = nullptr;
+        decode_kernel decode = nullptr;
+        std::string_view name = "scalar";
+    };
+
+    const kernels& get_kernels() {
+        static const kernels k = [] {
+            kernels k;
+#ifdef OXENSS_BASE64_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                k = {encode_avx2, decode_avx2, "avx2"};
+            else if (__builtin_cpu_supports("ssse3"))
+                k = {encode_ssse3, decode_ssse3, "ssse3"};
+#endif
+            return k;
+        }();
+        return k;
+    }
+
+    // Extra output space the decode kernels may write beyond the decoded data.
+    constexpr size_t DECODE_SLACK = 8;
+
+}  // namespace
+
+void append_base64(std::string& out, std::string_view data) {
+    size_t start = out.size();
+    out.resize(start + (data.size() + 2) / 3 * 4);
+    auto* in = reinterpret_cast<const unsigned char*>(data.data());
+    size_t n = data.size();
+    char* o = out.data() + start;
+    if (auto* enc = get_kernels().encode)
+        enc(in, n, o);
+    encode_scalar(in, n, o);
+}
+
+std::string to_base64(std::string_view data) {
+    std::string out;
+    append_base64(out, data);
+    return out;
+}
+
+std::string from_base64(std::string_view b64) {
+    std::string out;
+    out.resize(b64.size() / 4 * 3 + 3 + DECODE_SLACK);
+    auto* in = reinterpret_cast<const unsigned char*>(b64.data());
+    size_t n = b64.size();
+    auto* start = reinterpret_cast<unsigned char*>(out.data());
+    auto* o = start;
+    if (auto* dec = get_kernels().decode)
+        dec(in, n, o);
+    o += decode_scalar(in, n, o);
+    out.resize(o - start);
+    return out;
+}
+
+std::string_view base64_kernel() {
+    return get_kernels().name;
+}
+
+}  // namespace oxenss::util
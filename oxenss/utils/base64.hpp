@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace oxenss::util {
+
+/// Base64 encoding and decoding (standard alphabet, with padding) for the hot paths: retrieved
+/// message bodies, incoming store bodies, onion responses, and response signatures.  The output
+/// is identical to oxenc's to_base64/from_base64, but the bulk of the input is handled with SIMD
+/// kernels (AVX2 or SSSE3, chosen at runtime based on what the CPU supports) before finishing
+/// off with the scalar code, which is also used on other platforms.
+
+/// Appends the base64 encoding of `data` to `out`.
+void append_base64(std::string& out, std::string_view data);
+
+/// Returns the base64 encoding of `data`.
+std::string to_base64(std::string_view data);
+
+/// Decodes base64 (padded or unpadded, and with either the standard or the URL-safe alphabet)
+/// `b64`.  The input must already have been validated (e.g. with oxenc::is_base64); like
+/// oxenc::from_base64, the result for invalid input is unspecified.
+std::string from_base64(std::string_view b64);
+
+/// Returns the name of the kernel in use: "avx2", "ssse3", or "scalar".
+std::string_view base64_kernel();
+
+}  // namespace oxenss::util
@@ -0,0 +1,121 @@
+#include "cuckoo_filter.hpp"
+
+#include <functional>
+#include <utility>
+
+namespace oxenss::util {
+
+namespace {
+    // Four-way buckets can generally be filled to about 95% before an insert fails; we size the
+    // table so that it is at most 90% full at the requested capacity.
+    constexpr double MAX_LOAD = 0.9;
+
+    // The splitmix64 finalizer, to spread std::hash's output (which for some standard libraries
+    // is weak in the high bits) over all 64 bits.
+    uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+}  // namespace
+
+cuckoo_filter::cuckoo_filter(size_t capacity) : capacity_{capacity} {
+    size_t buckets = 1;
+    while (static_cast<double>(buckets * BUCKET_SIZE) * MAX_LOAD < static_cast<double>(capacity))
+        buckets <<= 1;
+    table_.assign(buckets * BUCKET_SIZE, 0);
+    bucket_mask_ = buckets - 1;
+}
+
+std::pair<size_t, uint16_t> cuckoo_filter::locate(std::string_view key) const {
+    uint64_t h = mix(std::hash<std::string_view>{}(key));
+    uint16_t fp = static_cast<uint16_t>(h >> 48);
+    if (fp == 0)
+        fp = 1;
+    return {static_cast<size_t>(h) & bucket_mask_, fp};
+}
+
+size_t cuckoo_filter::alt_bucket(size_t bucket, uint16_t fp) const {
+    // XORing with a function of the fingerprint alone means that applying this to either bucket
+    // gives the other, without needing the key.
+    return (bucket ^ static_cast<size_t>(mix(fp))) & bucket_mask_;
+}
+
+bool cuckoo_filter::bucket_add(size_t bucket, uint16_t fp) {
+    auto* slots = &table_[bucket * BUCKET_SIZE];
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        if (slots[i] == 0) {
+            slots[i] = fp;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cuckoo_filter::bucket_remove(size_t bucket, uint16_t fp) {
+    auto* slots = &table_[bucket * BUCKET_SIZE];
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        if (slots[i] == fp) {
+            slots[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cuckoo_filter::bucket_has(size_t bucket, uint16_t fp) const {
+    auto* slots = &table_[bucket * BUCKET_SIZE];
+    for (size_t i = 0; i < BUCKET_SIZE; i++)
+        if (slots[i] == fp)
+            return true;
+    return false;
+}
+
+bool cuckoo_filter::insert(std::string_view key) {
+    if (saturated_)
+        return false;
+    auto [bucket, fp] = locate(key);
+    if (bucket_add(bucket, fp) || bucket_add(alt_bucket(bucket, fp), fp)) {
+        size_++;
+        return true;
+    }
+
+    // Both buckets are full: put it in place of one of the fingerprints already there, then move
+    // that one to its other bucket, and so on until something lands in a free slot.
+    for (int kick = 0; kick < MAX_KICKS; kick++) {
+        kick_state_ = mix(kick_state_ + 1);
+        if (kick == 0 && (kick_state_ & 4))
+            bucket = alt_bucket(bucket, fp);
+        std::swap(fp, table_[bucket * BUCKET_SIZE + kick_state_ % BUCKET_SIZE]);
+        bucket = alt_bucket(bucket, fp);
+        if (bucket_add(bucket, fp)) {
+            size_++;
+            return true;
+        }
+    }
+
+    // We are now holding some other key's fingerprint with nowhere to put it, so the filter can no
+    // longer rule anything out.
+    saturated_ = true;
+    return false;
+}
+
+void cuckoo_filter::erase(std::string_view key) {
+    if (saturated_)
+        return;
+    auto [bucket, fp] = locate(key);
+    if (bucket_remove(bucket, fp) || bucket_remove(alt_bucket(bucket, fp), fp))
+        size_--;
+}
+
+bool cuckoo_filter::maybe_contains(std::string_view key) const {
+    if (saturated_)
+        return true;
+    auto [bucket, fp] = locate(key);
+    return bucket_has(bucket, fp) || bucket_has(alt_bucket(bucket, fp), fp);
+}
+
+}  // namespace oxenss::util
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace oxenss::util {
+
+// Approximate set membership of strings, with deletion: a cuckoo filter (Fan et al., "Cuckoo
+// Filter: Practically Better Than Bloom", 2014) of 16-bit fingerprints in buckets of 4, which
+// takes 2.2 to 4.5 bytes per key of capacity (the number of buckets is a power of two).
+//
+// maybe_contains() is always true for a key that has been inserted (and not erased since), and is
+// true for roughly 0.01% of other keys.  Since only fingerprints are stored, erasing a key that
+// was never inserted can erase some other key with the same fingerprint instead: only erase keys
+// that were inserted.  Inserting a key twice stores it twice (and so it takes two erases).
+//
+// Not thread-safe.
+class cuckoo_filter {
+  public:
+    // Constructs a filter with room for (at least) `capacity` keys.
+    explicit cuckoo_filter(size_t capacity = 0);
+
+    // Adds a key.  Returns false if the filter is too full to fit it, in which case the filter is
+    // now saturated: from then on maybe_contains() is true for everything, and insert() and erase()
+    // do nothing.
+    bool insert(std::string_view key);
+
+    // Removes (one copy of) a key that was added with insert().
+    void erase(std::string_view key);
+
+    // Returns false if `key` is definitely not in the filter, true if it probably is.
+    bool maybe_contains(std::string_view key) const;
+
+    // The number of keys in the filter.
+    size_t size() const { return size_; }
+
+    // The number of keys the filter was constructed to hold.
+    size_t capacity() const { return capacity_; }
+
+    // True if an insert() has failed; see insert().
+    bool saturated() const { return saturated_; }
+
+    // The memory used by the fingerprint table, in bytes.
+    size_t bytes() const { return table_.size() * sizeof(uint16_t); }
+
+  private:
+    static constexpr size_t BUCKET_SIZE = 4;
+    // How many fingerprints insert() moves around looking for a free slot before giving up.
+    static constexpr int MAX_KICKS = 500;
+
+    // BUCKET_SIZE fingerprints per bucket; 0 is an empty slot.
+    std::vector<uint16_t> table_;
+    size_t bucket_mask_;
+    size_t capacity_;
+    size_t size_ = 0;
+    bool saturated_ = false;
+    // State of the (cheap, deterministic) generator for picking which fingerprint to move.
+    uint64_t kick_state_ = 0;
+
+    // Returns the first bucket and the fingerprint of a key.
+    std::pair<size_t, uint16_t> locate(std::string_view key) const;
+    // Returns the other of the two buckets that can hold fingerprint `fp` found in `bucket`.
+    size_t alt_bucket(size_t bucket, uint16_t fp) const;
+    bool bucket_add(size_t bucket, uint16_t fp);
+    bool bucket_remove(size_t bucket, uint16_t fp);
+    bool bucket_has(size_t bucket, uint16_t fp) const;
+};
+
+}  // namespace oxenss::util
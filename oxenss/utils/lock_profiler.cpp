@@ -0,0 +1,52 @@
+#include "lock_profiler.hpp"
+
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+namespace oxenss::util {
+
+namespace {
+
+    // Not a profiled_mutex itself: profiles are only created once per lock name.
+    std::mutex profiles_mutex;
+    std::deque<lock_profile> profiles;
+
+    void update_max(std::atomic<uint64_t>& max, uint64_t val) {
+        auto prev = max.load(std::memory_order_relaxed);
+        while (prev < val && !max.compare_exchange_weak(prev, val, std::memory_order_relaxed))
+            ;
+    }
+
+}  // namespace
+
+void lock_profile::record_wait(std::chrono::steady_clock::duration wait) {
+    size_t i = 0;
+    while (i < WAIT_BOUNDS.size() && wait > WAIT_BOUNDS[i])
+        i++;
+    waits[i].fetch_add(1, std::memory_order_relaxed);
+    contended.fetch_add(1, std::memory_order_relaxed);
+    wait_us.fetch_add(
+            std::chrono::duration_cast<std::chrono::microseconds>(wait).count(),
+            std::memory_order_relaxed);
+}
+
+void lock_profile::record_hold(std::chrono::steady_clock::duration hold) {
+    update_max(max_hold_us, std::chrono::duration_cast<std::chrono::microseconds>(hold).count());
+}
+
+lock_profile& get_lock_profile(const char* name) {
+    std::lock_guard lock{profiles_mutex};
+    for (auto& p : profiles)
+        if (std::strcmp(p.name, name) == 0)
+            return p;
+    return profiles.emplace_back(name);
+}
+
+void for_each_lock_profile(const std::function<void(const lock_profile&)>& f) {
+    std::lock_guard lock{profiles_mutex};
+    for (auto& p : profiles)
+        f(p);
+}
+
+}  // namespace oxenss::util
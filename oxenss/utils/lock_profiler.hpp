@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace oxenss::util {
+
+using namespace std::literals;
+
+namespace detail {
+    // Whether profiled_mutex records anything; see set_lock_profiling().
+    inline std::atomic<bool> lock_profiling_enabled{false};
+}  // namespace detail
+
+// Turns lock profiling on or off (it starts off).  While off, a profiled_mutex costs a relaxed
+// atomic load per lock and unlock on top of the underlying mutex.
+inline void set_lock_profiling(bool enabled) {
+    detail::lock_profiling_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+inline bool lock_profiling() {
+    return detail::lock_profiling_enabled.load(std::memory_order_relaxed);
+}
+
+// Contention statistics of one named lock, shared by every profiled_mutex with that name (so, for
+// instance, all the shards of a sharded structure, or all the instances of a per-request lock, are
+// counted together).
+struct lock_profile {
+    // Upper bounds of the wait time histogram buckets (the last, implicit bucket is everything
+    // beyond these).
+    static constexpr std::array<std::chrono::microseconds, 7> WAIT_BOUNDS{
+            1us, 10us, 100us, 1ms, 10ms, 100ms, 1s};
+
+    explicit lock_profile(const char* name) : name{name} {}
+
+    const char* const name;
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};  // acquisitions that had to wait
+    std::atomic<uint64_t> wait_us{0};    // total time spent waiting
+    std::atomic<uint64_t> max_hold_us{0};
+    // Wait times of contended acquisitions
+    std::array<std::atomic<uint64_t>, WAIT_BOUNDS.size() + 1> waits{};
+
+    void record_wait(std::chrono::steady_clock::duration wait);
+
+    void record_hold(std::chrono::steady_clock::duration hold);
+};
+
+// Returns the (permanent) profile for the lock called `name`, creating it on first use.
+lock_profile& get_lock_profile(const char* name);
+
+// Calls `f` on each lock profile, in order of creation.
+void for_each_lock_profile(const std::function<void(const lock_profile&)>& f);
+
+// Lock name usable as a template argument, e.g. `profiled_mutex<std::mutex, "db_write">`.
+template <size_t N>
+struct lock_name {
+    char str[N];
+    constexpr lock_name(const char (&s)[N]) { std::copy_n(s, N, str); }
+};
+
+// Drop-in replacement for a std::mutex, std::recursive_mutex, or std::shared_mutex that (when
+// lock profiling is enabled) counts acquisitions, contended acquisitions and their wait times, and
+// the longest time the lock was held, into the lock_profile of `Name`.  Hold times are only
+// tracked for exclusive locks (for recursive mutexes, from the outermost lock to the matching
+// unlock).
+template <typename Mutex, lock_name Name>
+class profiled_mutex {
+  public:
+    void lock() {
+        if (!lock_profiling()) {
+            mutex_.lock();
+            held(false);
+            return;
+        }
+        auto& prof = profile();
+        prof.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (!mutex_.try_lock()) {
+            auto started = std::chrono::steady_clock::now();
+            mutex_.lock();
+            prof.record_wait(std::chrono::steady_clock::now() - started);
+        }
+        held(true);
+    }
+
+    bool try_lock() {
+        if (!mutex_.try_lock())
+            return false;
+        bool profiling = lock_profiling();
+        if (profiling)
+            profile().acquisitions.fetch_add(1, std::memory_order_relaxed);
+        held(profiling);
+        return true;
+    }
+
+    void unlock() {
+        if (--depth_ == 0 && locked_at_ != std::chrono::steady_clock::time_point{})
+            profile().record_hold(std::chrono::steady_clock::now() - locked_at_);
+        mutex_.unlock();
+    }
+
+    void lock_shared() {
+        if (!lock_profiling()) {
+            mutex_.lock_shared();
+            return;
+        }
+        auto& prof = profile();
+        prof.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (!mutex_.try_lock_shared()) {
+            auto started = std::chrono::steady_clock::now();
+            mutex_.lock_shared();
+            prof.record_wait(std::chrono::steady_clock::now() - started);
+        }
+    }
+
+    bool try_lock_shared() {
+        if (!mutex_.try_lock_shared())
+            return false;
+        if (lock_profiling())
+            profile().acquisitions.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock_shared() { mutex_.unlock_shared(); }
+
+  private:
+    static lock_profile& profile() {
+        static lock_profile& prof = get_lock_profile(Name.str);
+        return prof;
+    }
+
+    // Called with the (exclusive) lock newly acquired.  These members are only touched by the
+    // thread holding the lock.
+    void held(bool profiling) {
+        if (depth_++ == 0)
+            locked_at_ = profiling ? std::chrono::steady_clock::now()
+                                   : std::chrono::steady_clock::time_point{};
+    }
+
+    Mutex mutex_;
+    int depth_ = 0;
+    std::chrono::steady_clock::time_point locked_at_{};
+};
+
+}  // namespace oxenss::util
@@ -0,0 +1,178 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// jemalloc's control interface.  This is declared weak, rather than coming from jemalloc's header,
+// so that the same code works whether or not the binary is linked against jemalloc (which only
+// the daemon is, and only when it is found at build time): without it, `mallctl` is null.
+extern "C" int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen)
+        __attribute__((weak));
+
+namespace oxenss::util {
+
+namespace {
+
+    struct counters {
+        // Not a profiled_mutex: counters are only created once per name.
+        std::mutex mutex;
+        std::deque<memory_counter> list;
+    };
+
+    // Function-local so that counters can be created during static initialization of other files.
+    counters& all_counters() {
+        static counters c;
+        return c;
+    }
+
+    struct arenas {
+        std::mutex mutex;
+        std::vector<std::pair<const char*, unsigned>> list;
+    };
+
+    arenas& all_arenas() {
+        static arenas a;
+        return a;
+    }
+
+    template <typename T>
+    bool je_read(const char* name, T& val) {
+        size_t size = sizeof(T);
+        return mallctl(name, &val, &size, nullptr, 0) == 0;
+    }
+
+    // Updates jemalloc's stats, which are otherwise only refreshed when the "epoch" is bumped.
+    void je_refresh() {
+        uint64_t epoch = 1;
+        size_t size = sizeof(epoch);
+        mallctl("epoch", &epoch, &size, &epoch, size);
+    }
+
+    std::mutex release_mutex;
+    std::chrono::steady_clock::time_point last_release;
+    std::atomic<int64_t> releases{0};
+    std::atomic<int64_t> released_bytes{0};
+
+}  // namespace
+
+void memory_counter::add(int64_t n) {
+    auto now = bytes.fetch_add(n, std::memory_order_relaxed) + n;
+    auto prev = peak.load(std::memory_order_relaxed);
+    while (prev < now && !peak.compare_exchange_weak(prev, now, std::memory_order_relaxed))
+        ;
+}
+
+memory_counter& get_memory_counter(const char* name) {
+    auto& c = all_counters();
+    std::lock_guard lock{c.mutex};
+    for (auto& m : c.list)
+        if (std::strcmp(m.name, name) == 0)
+            return m;
+    return c.list.emplace_back(name);
+}
+
+void for_each_memory_counter(const std::function<void(const memory_counter&)>& f) {
+    auto& c = all_counters();
+    std::lock_guard lock{c.mutex};
+    for (auto& m : c.list)
+        f(m);
+}
+
+allocator_stats get_allocator_stats() {
+    allocator_stats st;
+    if (mallctl) {
+        je_refresh();
+        size_t allocated = 0, resident = 0, page = 0;
+        if (!je_read("stats.allocated", allocated) || !je_read("stats.resident", resident))
+            return st;  // jemalloc built without stats
+        st.allocator = "jemalloc";
+        st.allocated = allocated;
+        st.resident = resident;
+
+        je_read("arenas.page", page);
+        auto& a = all_arenas();
+        std::lock_guard lock{a.mutex};
+        for (auto& [name, index] : a.list) {
+            size_t active = 0, dirty = 0;
+            auto prefix = "stats.arenas." + std::to_string(index);
+            je_read((prefix + ".pactive").c_str(), active);
+            je_read((prefix + ".pdirty").c_str(), dirty);
+            st.arenas.push_back(
+                    {name, static_cast<int64_t>(active * page), static_cast<int64_t>(dirty * page)});
+        }
+    } else {
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+        // All zeros means that malloc isn't actually glibc's (e.g. under a sanitizer).
+        if (auto mi = mallinfo2(); mi.arena + mi.hblkhd > 0) {
+            st.allocator = "glibc";
+            st.allocated = mi.uordblks + mi.hblkhd;
+            st.resident = mi.arena + mi.hblkhd;
+        }
+#endif
+#endif
+    }
+    st.free = std::max<int64_t>(st.resident - st.allocated, 0);
+    return st;
+}
+
+void use_memory_arena(const char* name) {
+    if (!mallctl)
+        return;
+    unsigned arena = 0;
+    {
+        auto& a = all_arenas();
+        std::lock_guard lock{a.mutex};
+        auto it = a.list.begin();
+        while (it != a.list.end() && std::strcmp(it->first, name) != 0)
+            ++it;
+        if (it != a.list.end())
+            arena = it->second;
+        else if (je_read("arenas.create", arena))
+            a.list.emplace_back(name, arena);
+        else
+            return;
+    }
+    mallctl("thread.arena", nullptr, nullptr, &arena, sizeof(arena));
+}
+
+bool release_free_memory(int64_t min_free) {
+    std::unique_lock lock{release_mutex, std::try_to_lock};
+    if (!lock)
+        return false;  // Someone else is releasing right now
+    auto now = std::chrono::steady_clock::now();
+    if (releases > 0 && now - last_release < MEMORY_RELEASE_INTERVAL)
+        return false;
+
+    auto before = get_allocator_stats();
+    if (before.allocator.empty() || before.free < min_free)
+        return false;
+    if (mallctl) {
+        // 4096 is MALLCTL_ARENAS_ALL, i.e. every arena
+        mallctl("arena.4096.purge", nullptr, nullptr, nullptr, 0);
+    } else {
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+    }
+    auto after = get_allocator_stats();
+
+    last_release = now;
+    releases++;
+    released_bytes += std::max<int64_t>(before.resident - after.resident, 0);
+    return true;
+}
+
+memory_release_stats get_memory_release_stats() {
+    return {releases.load(), released_bytes.load()};
+}
+
+}  // namespace oxenss::util
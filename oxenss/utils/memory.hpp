@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+namespace oxenss::util {
+
+using namespace std::literals;
+
+// Bytes held by one subsystem, as counted by the subsystem itself, so that memory growth can be
+// attributed to whatever is holding on to it (which the allocator's totals can't tell us).  The
+// counts are approximate: subsystems count their big buffers (message data, request bodies, ...)
+// rather than every allocation.
+struct memory_counter {
+    explicit memory_counter(const char* name) : name{name} {}
+
+    const char* const name;
+    std::atomic<int64_t> bytes{0};
+    std::atomic<int64_t> peak{0};  // the most that `bytes` has been
+
+    void add(int64_t n);
+    void sub(int64_t n) { bytes.fetch_sub(n, std::memory_order_relaxed); }
+};
+
+// Returns the (permanent) counter called `name`, creating it on first use.
+memory_counter& get_memory_counter(const char* name);
+
+// Calls `f` on each memory counter, in order of creation.
+void for_each_memory_counter(const std::function<void(const memory_counter&)>& f);
+
+// Counts some bytes against a memory_counter for as long as it is alive, e.g. alongside a
+// transient buffer, or captured (via a shared_ptr, since it is move-only) in a queued job.
+class tracked_memory {
+  public:
+    tracked_memory() = default;
+    tracked_memory(memory_counter& counter, int64_t bytes) : counter_{&counter}, bytes_{bytes} {
+        counter.add(bytes);
+    }
+    tracked_memory(tracked_memory&& other) noexcept :
+            counter_{other.counter_}, bytes_{other.bytes_} {
+        other.counter_ = nullptr;
+    }
+    tracked_memory& operator=(tracked_memory&& other) noexcept {
+        if (this != &other) {
+            reset();
+            counter_ = other.counter_;
+            bytes_ = other.bytes_;
+            other.counter_ = nullptr;
+        }
+        return *this;
+    }
+    tracked_memory(const tracked_memory&) = delete;
+    tracked_memory& operator=(const tracked_memory&) = delete;
+
+    ~tracked_memory() { reset(); }
+
+    // Stops counting the bytes.
+    void reset() {
+        if (counter_)
+            counter_->sub(bytes_);
+        counter_ = nullptr;
+    }
+
+  private:
+    memory_counter* counter_ = nullptr;
+    int64_t bytes_ = 0;
+};
+
+// Memory usage as seen by the allocator: jemalloc's, when we are linked against it, otherwise
+// glibc malloc's.
+struct allocator_stats {
+    std::string_view allocator;  // "jemalloc" or "glibc"; empty (and all 0) if unsupported
+    int64_t allocated = 0;       // bytes in live allocations
+    int64_t resident = 0;        // bytes the allocator holds in memory, including free ones
+    // Bytes of `resident` not allocated: what a release could return to the OS (at best, since
+    // some of it is in partially used pages).
+    int64_t free = 0;
+
+    // One of the arenas created by use_memory_arena() (jemalloc only).
+    struct arena {
+        const char* name;
+        int64_t active;  // bytes in pages with live allocations
+        int64_t dirty;   // bytes in freed pages not yet returned to the OS
+    };
+    std::vector<arena> arenas;
+};
+
+allocator_stats get_allocator_stats();
+
+// Makes the calling thread allocate from a dedicated jemalloc arena called `name` (shared by all
+// the threads that call this with the same name) rather than from the default arenas, so that the
+// memory of a subsystem with large transient allocations (e.g. the redistribution thread) shows
+// up separately in the allocator stats and doesn't fragment the arenas used by everything else.
+// Does nothing without jemalloc.
+void use_memory_arena(const char* name);
+
+// How often release_free_memory() actually releases anything; calls in between are skipped, since
+// releasing isn't free and the large operations that call it tend to come in bursts.
+inline constexpr auto MEMORY_RELEASE_INTERVAL = 10s;
+
+// Returns the allocator's free memory to the OS (purging all jemalloc arenas, or trimming the glibc
+// heap), which otherwise keeps a process's RSS at its peak after large transient operations such
+// as redistribution.  Does nothing if the allocator has less than `min_free` bytes free, or if
+// memory was released less than MEMORY_RELEASE_INTERVAL ago.  Returns true if it released.
+bool release_free_memory(int64_t min_free = 0);
+
+struct memory_release_stats {
+    int64_t releases;  // times memory was released
+    int64_t bytes;     // total drop in allocator resident memory from the releases
+};
+
+memory_release_stats get_memory_release_stats();
+
+}  // namespace oxenss::util
@@ -0,0 +1,61 @@
+#include <oxenss/rpc/admission_control.h>
+
+#include <catch2/catch.hpp>
+
+using oxenss::rpc::AdmissionControl;
+using oxenss::rpc::request_class;
+using namespace std::literals;
+
+TEST_CASE("admission control - classification", "[admission]") {
+    CHECK(AdmissionControl::classify("store") == request_class::client_write);
+    CHECK(AdmissionControl::classify("delete_all") == request_class::client_write);
+    CHECK(AdmissionControl::classify("sequence") == request_class::client_write);
+    CHECK(AdmissionControl::classify("retrieve") == request_class::client_read);
+    CHECK(AdmissionControl::classify("get_swarm") == request_class::client_read);
+    CHECK(AdmissionControl::classify("info") == request_class::client_read);
+
+    CHECK(to_string(request_class::sn_critical) == "sn");
+    CHECK(to_string(request_class::onion) == "onion");
+}
+
+TEST_CASE("admission control - shedding by priority", "[admission]") {
+    AdmissionControl ac{100ms};
+    for (auto c :
+         {request_class::sn_critical,
+          request_class::client_write,
+          request_class::client_read,
+          request_class::onion})
+        CHECK(ac.admit(c));
+
+    // Drive the average delay up to just over 2x the target: onion and reads get shed
+    for (int i = 0; i < 100; i++)
+        ac.observe_wait(250ms);
+    CHECK(ac.queue_delay() > 200ms);
+    CHECK(ac.queue_delay() <= 250ms);
+    CHECK(ac.admit(request_class::sn_critical));
+    CHECK(ac.admit(request_class::client_write));
+    CHECK_FALSE(ac.admit(request_class::client_read));
+    CHECK_FALSE(ac.admit(request_class::onion));
+    CHECK_FALSE(ac.admit(request_class::onion));
+
+    // Way over: everything but SN traffic gets shed
+    for (int i = 0; i < 100; i++)
+        ac.observe_wait(2s);
+    CHECK(ac.admit(request_class::sn_critical));
+    CHECK_FALSE(ac.admit(request_class::client_write));
+
+    CHECK(ac.shed(request_class::sn_critical) == 0);
+    CHECK(ac.shed(request_class::client_write) == 1);
+    CHECK(ac.shed(request_class::client_read) == 1);
+    CHECK(ac.shed(request_class::onion) == 2);
+
+    // Recovers once the queues drain
+    for (int i = 0; i < 100; i++)
+        ac.observe_wait(1ms);
+    CHECK(ac.admit(request_class::onion));
+
+    // A target of 0 never sheds
+    AdmissionControl off{0ms};
+    off.observe_wait(10s);
+    CHECK(off.admit(request_class::onion));
+}
@@ -0,0 +1,53 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/base64.hpp>
+
+#include <oxenc/base64.h>
+
+#include <random>
+#include <string>
+
+using namespace oxenss;
+
+TEST_CASE("base64 - matches oxenc", "[base64]") {
+    INFO("base64 kernel: " << util::base64_kernel());
+
+    std::mt19937_64 rng{42};
+    // Sizes around and well beyond the SIMD block sizes, so that we cover the kernels, the scalar
+    // tails, and every padding case:
+    for (size_t n = 0; n < 300; n++) {
+        std::string data(n, '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng());
+
+        auto b64 = util::to_base64(data);
+        REQUIRE(b64 == oxenc::to_base64(data));
+        REQUIRE(util::from_base64(b64) == data);
+
+        std::string unpadded = b64;
+        while (!unpadded.empty() && unpadded.back() == '=')
+            unpadded.pop_back();
+        REQUIRE(util::from_base64(unpadded) == data);
+
+        std::string appended = "abc";
+        util::append_base64(appended, data);
+        REQUIRE(appended == "abc" + b64);
+    }
+}
+
+TEST_CASE("base64 - URL-safe alphabet", "[base64]") {
+    INFO("base64 kernel: " << util::base64_kernel());
+
+    std::mt19937_64 rng{43};
+    for (size_t n = 0; n < 300; n++) {
+        std::string data(n, '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng());
+
+        std::string url = oxenc::to_base64(data);
+        for (auto& c : url)
+            c = c == '+' ? '-' : c == '/' ? '_' : c;
+        REQUIRE(util::from_base64(url) == oxenc::from_base64(url));
+        REQUIRE(util::from_base64(url) == data);
+    }
+}
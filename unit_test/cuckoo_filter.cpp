@@ -0,0 +1,66 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/cuckoo_filter.hpp>
+
+#include <string>
+
+using namespace oxenss;
+
+static std::string key(const char* prefix, int i) {
+    return prefix + std::to_string(i);
+}
+
+TEST_CASE("cuckoo filter - membership", "[cuckoo-filter]") {
+    util::cuckoo_filter filter{10000};
+    CHECK(filter.capacity() == 10000);
+    CHECK(filter.bytes() < 10000 * 5);
+    CHECK_FALSE(filter.maybe_contains("anything"));
+
+    for (int i = 0; i < 10000; i++)
+        REQUIRE(filter.insert(key("in", i)));
+    CHECK(filter.size() == 10000);
+    CHECK_FALSE(filter.saturated());
+
+    // No false negatives, and only rare false positives:
+    int missing = 0, false_positives = 0;
+    for (int i = 0; i < 10000; i++)
+        missing += !filter.maybe_contains(key("in", i));
+    for (int i = 0; i < 100000; i++)
+        false_positives += filter.maybe_contains(key("out", i));
+    CHECK(missing == 0);
+    CHECK(false_positives < 100);
+
+    // Erasing half leaves the other half alone:
+    for (int i = 0; i < 10000; i += 2)
+        filter.erase(key("in", i));
+    CHECK(filter.size() == 5000);
+    int erased_found = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (i % 2)
+            missing += !filter.maybe_contains(key("in", i));
+        else
+            erased_found += filter.maybe_contains(key("in", i));
+    }
+    CHECK(missing == 0);
+    CHECK(erased_found < 10);
+
+    // Duplicates are counted:
+    REQUIRE(filter.insert("dup"));
+    REQUIRE(filter.insert("dup"));
+    filter.erase("dup");
+    CHECK(filter.maybe_contains("dup"));
+    filter.erase("dup");
+    CHECK(filter.size() == 5000);
+}
+
+TEST_CASE("cuckoo filter - saturation", "[cuckoo-filter]") {
+    util::cuckoo_filter filter{100};
+    int inserted = 0;
+    while (filter.insert(key("in", inserted)))
+        inserted++;
+    // It should fill most of the way up before anything fails:
+    CHECK(inserted >= 100);
+    CHECK(filter.saturated());
+    CHECK(filter.maybe_contains("anything"));
+    CHECK_FALSE(filter.insert("more"));
+}
@@ -0,0 +1,235 @@
+#include <oxenss/snode/forward_queue.h>
+
+#include <catch2/catch.hpp>
+#include <oxenmq/oxenmq.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace oxenss;
+using namespace oxenss::snode;
+using namespace std::literals;
+
+namespace {
+
+crypto::x25519_pubkey make_pk(char c) {
+    return crypto::x25519_pubkey::from_hex(std::string(64, c));
+}
+
+// Stands in for the QUIC transport: records the requests sent, keeping their reply callbacks so
+// that the test can answer them when it wants to.  While `hold` is set requests block until it is
+// cleared, which lets the test keep the send thread busy.
+struct fake_transport {
+    struct request {
+        crypto::x25519_pubkey peer;
+        std::string command;
+        std::string body;
+        peer_reply_callback cb;
+    };
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<request> requests;
+    bool hold = false;
+
+    peer_request_func func() {
+        return [this](const crypto::x25519_pubkey& peer,
+                      std::string_view command,
+                      std::string_view body,
+                      peer_reply_callback cb) {
+            std::unique_lock lock{mutex};
+            requests.push_back({peer, std::string{command}, std::string{body}, std::move(cb)});
+            cv.notify_all();
+            cv.wait(lock, [this] { return !hold; });
+            return true;
+        };
+    }
+
+    // Waits (for up to a second) for there to be at least `n` requests, and returns how many there
+    // are.
+    size_t wait_for(size_t n) {
+        std::unique_lock lock{mutex};
+        cv.wait_for(lock, 1s, [&] { return requests.size() >= n; });
+        return requests.size();
+    }
+
+    void set_hold(bool h) {
+        {
+            std::lock_guard lock{mutex};
+            hold = h;
+        }
+        cv.notify_all();
+    }
+
+    request& at(size_t i) {
+        std::lock_guard lock{mutex};
+        return requests.at(i);
+    }
+
+    // Returns the index of the request sent to `peer`.
+    size_t find(const crypto::x25519_pubkey& peer) {
+        std::lock_guard lock{mutex};
+        for (size_t i = 0; i < requests.size(); i++)
+            if (requests[i].peer == peer)
+                return i;
+        throw std::out_of_range{"no request for peer"};
+    }
+
+    // Replies to the `i`th request.
+    void reply(size_t i, bool success, std::vector<std::string> parts) {
+        peer_reply_callback cb;
+        {
+            std::lock_guard lock{mutex};
+            cb = std::move(requests.at(i).cb);
+        }
+        cb(success, std::move(parts));
+    }
+};
+
+// Collects the outcomes of forwarded commands, by command number.
+struct outcomes {
+    std::mutex mutex;
+    std::map<int, std::pair<bool, std::vector<std::string>>> got;
+
+    ForwardQueue::reply_callback cb(int i) {
+        return [this, i](bool success, std::vector<std::string> parts) {
+            std::lock_guard lock{mutex};
+            got.emplace(i, std::pair{success, std::move(parts)});
+        };
+    }
+
+    std::map<int, std::pair<bool, std::vector<std::string>>> get() {
+        std::lock_guard lock{mutex};
+        return got;
+    }
+};
+
+}  // namespace
+
+TEST_CASE("forward queue - commands to a peer are coalesced", "[forward]") {
+    oxenmq::OxenMQ omq;
+    fake_transport quic;
+    outcomes out;
+    ForwardQueue queue{omq};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_pk('a'), b = make_pk('b');
+    // Keep the send thread busy with b's request while we queue up a's:
+    quic.set_hold(true);
+    queue.push(b, "store", "b0", out.cb(0));
+    REQUIRE(quic.wait_for(1) == 1);
+    queue.push(a, "store", "a1", out.cb(1));
+    queue.push(a, "delete", "a2", out.cb(2));
+    queue.push(a, "expire", "a3", out.cb(3));
+    CHECK(queue.get_stats().queued == 3);
+    quic.set_hold(false);
+    REQUIRE(quic.wait_for(2) == 2);
+
+    // Even a lone command goes as a batch when sending via peer_request:
+    auto& rb = quic.at(0);
+    CHECK(rb.peer == b);
+    CHECK(rb.command == "sn.storage_cc_batch");
+    CHECK(rb.body == "ll5:store2:b0ee");
+    auto& ra = quic.at(1);
+    CHECK(ra.peer == a);
+    CHECK(ra.command == "sn.storage_cc_batch");
+    CHECK(ra.body == "ll5:store2:a1el6:delete2:a2el6:expire2:a3ee");
+
+    // The send thread counts the requests that went via peer_request once they return:
+    for (int i = 0; i < 1000 && queue.get_stats().quic < 2; i++)
+        std::this_thread::sleep_for(1ms);
+    auto st = queue.get_stats();
+    CHECK(st.queued == 0);
+    CHECK(st.commands == 4);
+    CHECK(st.requests == 2);
+    CHECK(st.batches == 1);
+    CHECK(st.quic == 2);
+
+    // The batch reply gets split up into the replies of its commands:
+    quic.reply(1, true, {"ll1:ael3:4042:noel1:cee"});
+    quic.reply(0, true, {"ll2:b0ee"});
+    REQUIRE(out.get().size() == 4);
+    auto got = out.get();
+    CHECK(got[0] == std::pair{true, std::vector<std::string>{"b0"}});
+    CHECK(got[1] == std::pair{true, std::vector<std::string>{"a"}});
+    CHECK(got[2] == std::pair{true, std::vector<std::string>{"404", "no"}});
+    CHECK(got[3] == std::pair{true, std::vector<std::string>{"c"}});
+    CHECK(queue.get_stats().bad_reply == 0);
+}
+
+TEST_CASE("forward queue - failed and bad batch replies", "[forward]") {
+    oxenmq::OxenMQ omq;
+    fake_transport quic;
+    outcomes out;
+    ForwardQueue queue{omq};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_pk('a'), b = make_pk('b'), c = make_pk('c');
+    quic.set_hold(true);
+    queue.push(c, "store", "c0", out.cb(0));
+    REQUIRE(quic.wait_for(1) == 1);
+    queue.push(a, "store", "a1", out.cb(1));
+    queue.push(a, "store", "a2", out.cb(2));
+    queue.push(b, "store", "b3", out.cb(3));
+    queue.push(b, "store", "b4", out.cb(4));
+    quic.set_hold(false);
+    REQUIRE(quic.wait_for(3) == 3);
+
+    // A failed request fails all of its commands:
+    quic.reply(quic.find(c), false, {});
+    // A reply with the wrong number of replies succeeds, but without any reply parts:
+    quic.reply(quic.find(a), true, {"ll2:OKee"});
+    // As does one that doesn't parse:
+    quic.reply(quic.find(b), true, {"garbage"});
+
+    auto got = out.get();
+    REQUIRE(got.size() == 5);
+    CHECK(got[0] == std::pair{false, std::vector<std::string>{}});
+    for (int i : {1, 2, 3, 4})
+        CHECK(got[i] == std::pair{true, std::vector<std::string>{}});
+    CHECK(queue.get_stats().bad_reply == 2);
+}
+
+TEST_CASE("forward queue - shutdown fails queued commands", "[forward]") {
+    oxenmq::OxenMQ omq;
+    fake_transport quic;
+    outcomes out;
+    ForwardQueue queue{omq};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_pk('a'), b = make_pk('b');
+    quic.set_hold(true);
+    queue.push(b, "store", "b0", out.cb(0));
+    REQUIRE(quic.wait_for(1) == 1);
+    queue.push(a, "store", "a1", out.cb(1));
+    queue.push(a, "store", "a2", out.cb(2));
+
+    // Shutting down drops whatever hasn't been sent yet, but has to wait for the send in progress:
+    std::thread stopper{[&] { queue.shutdown(); }};
+    for (int i = 0; i < 1000 && queue.get_stats().queued > 0; i++)
+        std::this_thread::sleep_for(1ms);
+    CHECK(queue.get_stats().queued == 0);
+    quic.set_hold(false);
+    stopper.join();
+
+    CHECK(quic.wait_for(1) == 1);
+    auto got = out.get();
+    REQUIRE(got.size() == 2);
+    CHECK(got[1] == std::pair{false, std::vector<std::string>{}});
+    CHECK(got[2] == std::pair{false, std::vector<std::string>{}});
+
+    // Anything pushed after shutdown fails right away:
+    queue.push(a, "store", "a3", out.cb(3));
+    got = out.get();
+    REQUIRE(got.size() == 3);
+    CHECK(got[3] == std::pair{false, std::vector<std::string>{}});
+
+    // The request that was already sent still gets its reply:
+    quic.reply(0, true, {"ll2:OKee"});
+    CHECK(out.get()[0] == std::pair{true, std::vector<std::string>{"OK"}});
+}
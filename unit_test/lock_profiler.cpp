@@ -0,0 +1,101 @@
+#include <oxenss/utils/lock_profiler.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+using namespace oxenss::util;
+using namespace std::literals;
+
+TEST_CASE("lock profiling - disabled", "[lock-profiler]") {
+    set_lock_profiling(false);
+    profiled_mutex<std::mutex, "test_disabled"> m;
+    {
+        std::lock_guard lock{m};
+    }
+    CHECK(m.try_lock());
+    m.unlock();
+
+    auto& prof = get_lock_profile("test_disabled");
+    CHECK(prof.acquisitions == 0);
+    CHECK(prof.max_hold_us == 0);
+}
+
+TEST_CASE("lock profiling - contention and hold times", "[lock-profiler]") {
+    set_lock_profiling(true);
+    profiled_mutex<std::mutex, "test_contended"> a;
+    profiled_mutex<std::mutex, "test_contended"> b;  // same name, so the same profile
+    auto& prof = get_lock_profile("test_contended");
+
+    {
+        std::lock_guard lock{a};
+    }
+    {
+        std::lock_guard lock{b};
+    }
+    CHECK(prof.acquisitions == 2);
+    CHECK(prof.contended == 0);
+
+    std::thread holder;
+    {
+        std::unique_lock lock{a};
+        holder = std::thread{[&] {
+            std::lock_guard lock{a};
+        }};
+        std::this_thread::sleep_for(50ms);
+    }
+    holder.join();
+    set_lock_profiling(false);
+
+    CHECK(prof.acquisitions == 4);
+    CHECK(prof.contended == 1);
+    CHECK(prof.wait_us >= 10'000);
+    CHECK(prof.max_hold_us >= 50'000);
+    // The wait was somewhere between 10ms and 100ms (it can't be less than the holder's remaining
+    // sleep, and we shouldn't be anywhere near that slow):
+    uint64_t waits = 0;
+    for (auto& w : prof.waits)
+        waits += w;
+    CHECK(waits == 1);
+    CHECK(prof.waits[5] == 1);
+
+    bool found = false;
+    for_each_lock_profile([&](const lock_profile& p) {
+        if (std::string_view{p.name} == "test_contended")
+            found = true;
+    });
+    CHECK(found);
+}
+
+TEST_CASE("lock profiling - recursive and shared locks", "[lock-profiler]") {
+    set_lock_profiling(true);
+    auto& rprof = get_lock_profile("test_recursive");
+    profiled_mutex<std::recursive_mutex, "test_recursive"> r;
+    {
+        std::lock_guard outer{r};
+        {
+            std::lock_guard inner{r};
+        }
+        std::this_thread::sleep_for(20ms);
+    }
+    CHECK(rprof.acquisitions == 2);
+    CHECK(rprof.contended == 0);
+    // The hold time covers the outermost lock, not just the inner one:
+    CHECK(rprof.max_hold_us >= 20'000);
+
+    auto& sprof = get_lock_profile("test_shared");
+    profiled_mutex<std::shared_mutex, "test_shared"> s;
+    {
+        std::shared_lock l1{s};
+        std::shared_lock l2{s};
+        CHECK_FALSE(s.try_lock());
+    }
+    {
+        std::unique_lock lock{s};
+    }
+    set_lock_profiling(false);
+    CHECK(sprof.acquisitions == 3);
+    CHECK(sprof.contended == 0);
+}
@@ -0,0 +1,82 @@
+#include <oxenss/utils/memory.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+using namespace oxenss::util;
+
+TEST_CASE("memory accounting - counters", "[memory]") {
+    auto& c = get_memory_counter("test_counter");
+    CHECK(&get_memory_counter("test_counter") == &c);
+    CHECK(c.bytes == 0);
+
+    {
+        tracked_memory a{c, 100};
+        CHECK(c.bytes == 100);
+        {
+            tracked_memory b{c, 50};
+            CHECK(c.bytes == 150);
+        }
+        CHECK(c.bytes == 100);
+
+        tracked_memory moved{std::move(a)};
+        CHECK(c.bytes == 100);
+        a.reset();  // Moved-from, so doesn't count anything any more
+        CHECK(c.bytes == 100);
+
+        tracked_memory other{c, 10};
+        other = std::move(moved);
+        CHECK(c.bytes == 100);
+    }
+    CHECK(c.bytes == 0);
+    CHECK(c.peak == 150);
+
+    // Shared in a queued job:
+    std::vector<std::function<void()>> jobs;
+    jobs.push_back([held = std::make_shared<tracked_memory>(c, 1000)] {});
+    auto copy = jobs.front();
+    CHECK(c.bytes == 1000);
+    jobs.clear();
+    CHECK(c.bytes == 1000);
+    copy = nullptr;
+    CHECK(c.bytes == 0);
+    CHECK(c.peak == 1000);
+
+    bool found = false;
+    for_each_memory_counter([&](const memory_counter& m) {
+        if (&m == &c)
+            found = true;
+    });
+    CHECK(found);
+}
+
+TEST_CASE("memory accounting - allocator stats and release", "[memory]") {
+    // Without jemalloc this is glibc malloc (where supported), which isn't aware of arenas.
+    use_memory_arena("test_arena");
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    for (int i = 0; i < 1000; i++)
+        blocks.emplace_back(new char[1000]);
+    auto st = get_allocator_stats();
+    if (st.allocator.empty())
+        return;
+    CHECK(st.allocated >= 1'000'000);
+    CHECK(st.resident >= st.allocated);
+    CHECK(st.free == st.resident - st.allocated);
+    if (st.allocator == "glibc")
+        CHECK(st.arenas.empty());
+    blocks.clear();
+
+    auto before = get_memory_release_stats();
+    CHECK_FALSE(release_free_memory(int64_t{1} << 50));  // Far more than we have free
+    CHECK(get_memory_release_stats().releases == before.releases);
+    if (release_free_memory()) {
+        CHECK(get_memory_release_stats().releases == before.releases + 1);
+        // Too soon after the last one:
+        CHECK_FALSE(release_free_memory());
+        CHECK(get_memory_release_stats().releases == before.releases + 1);
+    }
+}
@@ -0,0 +1,188 @@
+#include <oxenss/server/monitor_registry.h>
+#include <oxenss/server/mqbase.h>
+#include <oxenss/utils/file.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+using oxenss::namespace_id;
+using oxenss::server::connection_id;
+using oxenss::server::MonitorRegistry;
+using namespace std::literals;
+
+TEST_CASE("monitor registry - subscriptions", "[monitor]") {
+    MonitorRegistry reg;
+    connection_id a{oxenmq::ConnectionID{std::string(32, 'a')}};
+    connection_id b{oxenmq::ConnectionID{std::string(32, 'b')}};
+    const oxenss::prefixed_pubkey pk1{"\x05" + std::string(32, '1')};
+    const oxenss::prefixed_pubkey pk2{"\x05" + std::string(32, '2')};
+
+    CHECK(reg.subscribe(pk1, {namespace_id{0}, namespace_id{5}}, false, false, a) ==
+          std::vector{namespace_id{0}, namespace_id{5}});
+    // Resubscribing merges the namespaces into the existing subscription:
+    CHECK(reg.subscribe(pk1, {namespace_id{-3}, namespace_id{5}}, false, false, a) ==
+          std::vector{namespace_id{-3}, namespace_id{0}, namespace_id{5}});
+    reg.subscribe(pk2, {namespace_id{0}}, false, false, a);
+    reg.subscribe(pk1, {namespace_id{0}}, true, false, b);
+    CHECK(reg.size() == 3);
+    CHECK(reg.connections() == 2);
+
+    std::vector<connection_id> to, with_data;
+    reg.find(pk1, namespace_id{0}, to, with_data);
+    CHECK(to == std::vector{a});
+    CHECK(with_data == std::vector{b});
+
+    to.clear();
+    with_data.clear();
+    reg.find(pk1, namespace_id{5}, to, with_data);
+    CHECK(to == std::vector{a});
+    CHECK(with_data.empty());
+
+    CHECK(reg.remove_connection(a) == 2);
+    CHECK(reg.remove_connection(a) == 0);
+    CHECK(reg.size() == 1);
+    CHECK(reg.connections() == 1);
+
+    to.clear();
+    with_data.clear();
+    reg.find(pk2, namespace_id{0}, to, with_data);
+    CHECK(to.empty());
+    CHECK(with_data.empty());
+}
+
+TEST_CASE("monitor registry - expiry", "[monitor]") {
+    MonitorRegistry reg;
+    connection_id a{oxenmq::ConnectionID{std::string(32, 'a')}};
+    const oxenss::prefixed_pubkey pk1{"\x05" + std::string(32, '1')};
+    const oxenss::prefixed_pubkey pk2{"\x05" + std::string(32, '2')};
+
+    auto now = std::chrono::steady_clock::now();
+    reg.subscribe(pk1, {namespace_id{0}}, false, false, a, 5min);
+    reg.subscribe(pk2, {namespace_id{0}}, false, false, a, 5min);
+    // Renewing pushes the expiry back:
+    reg.subscribe(pk2, {namespace_id{0}}, false, false, a);
+
+    CHECK(reg.expire(now) == 0);
+    CHECK(reg.expire(now + 3min) == 0);
+    CHECK(reg.expire(now + 10min) == 1);
+    CHECK(reg.size() == 1);
+    CHECK(reg.expire(now + 60min) == 0);
+    CHECK(reg.expire(now + 70min) == 1);
+    CHECK(reg.size() == 0);
+    CHECK(reg.connections() == 0);
+}
+
+TEST_CASE("monitor registry - change subscriptions", "[monitor]") {
+    MonitorRegistry reg;
+    connection_id a{oxenmq::ConnectionID{std::string(32, 'a')}};
+    connection_id b{oxenmq::ConnectionID{std::string(32, 'b')}};
+    const oxenss::prefixed_pubkey pk1{"\x05" + std::string(32, '1')};
+
+    CHECK(reg.change_subscriptions() == 0);
+    reg.subscribe(pk1, {namespace_id{0}, namespace_id{5}}, false, true, a);
+    reg.subscribe(pk1, {namespace_id{0}}, true, false, b);
+    CHECK(reg.change_subscriptions() == 1);
+
+    // Only subscriptions that opted in get change events:
+    std::vector<connection_id> to;
+    reg.find_changes(pk1, namespace_id{0}, to);
+    CHECK(to == std::vector{a});
+    to.clear();
+    reg.find_changes(pk1, namespace_id{1}, to);
+    CHECK(to.empty());
+    reg.find_changes(pk1, namespace_id{5}, to);
+    CHECK(to == std::vector{a});
+
+    // New message lookups are unaffected:
+    std::vector<connection_id> msg_to, with_data;
+    reg.find(pk1, namespace_id{0}, msg_to, with_data);
+    CHECK(msg_to == std::vector{a});
+    CHECK(with_data == std::vector{b});
+
+    // Resubscribing can turn change events on, but not off:
+    reg.subscribe(pk1, {namespace_id{0}}, false, true, b);
+    reg.subscribe(pk1, {namespace_id{0}}, false, false, a);
+    to.clear();
+    reg.find_changes(pk1, namespace_id{0}, to);
+    CHECK(to.size() == 2);
+    CHECK(std::count(to.begin(), to.end(), a) == 1);
+    CHECK(std::count(to.begin(), to.end(), b) == 1);
+    CHECK(reg.change_subscriptions() == 2);
+
+    // Removed and expired subscriptions stop counting:
+    CHECK(reg.remove_connection(a) == 1);
+    CHECK(reg.change_subscriptions() == 1);
+    reg.expire(std::chrono::steady_clock::now() + 70min);
+    CHECK(reg.size() == 0);
+    CHECK(reg.change_subscriptions() == 0);
+}
+
+namespace {
+
+// Minimal server for testing the saving and restoring of subscriptions: every connection has the
+// same identity, and notifications go nowhere.
+struct test_server : oxenss::server::MQBase {
+    oxenss::rpc::transport transport() const override { return oxenss::rpc::transport::omq; }
+    void notify(std::vector<connection_id>&, std::string_view) override {}
+    void reachability_test(std::shared_ptr<oxenss::snode::sn_test>) override {}
+    std::string monitor_identity(const connection_id&) const override { return "identity"; }
+
+    using MQBase::restore_monitors;
+    const MonitorRegistry& registry() const { return monitors_; }
+};
+
+}  // namespace
+
+TEST_CASE("monitor registry - saved subscriptions", "[monitor]") {
+    connection_id a{oxenmq::ConnectionID{std::string(32, 'a')}};
+    const std::string pk1 = "\x05" + std::string(32, '1');
+    const std::string pk2 = "\x05" + std::string(32, '2');
+    auto expiry = std::chrono::duration_cast<std::chrono::seconds>(
+                          (std::chrono::system_clock::now() + 1h).time_since_epoch())
+                          .count();
+    auto dir = std::filesystem::temp_directory_path();
+    auto file = dir / "oxenss-test-monitors.bt";
+    auto file2 = dir / "oxenss-test-monitors2.bt";
+
+    // The trailing want_changes field was added later, so an entry without it (pk1) is still
+    // loaded, without change events:
+    oxenss::util::dump_file(
+            file,
+            "l"
+            "l8:identity33:" + pk1 + "li0ei5eei1ei" + std::to_string(expiry) + "ee"
+            "l8:identity33:" + pk2 + "li0eei0ei" + std::to_string(expiry) + "ei1ee"
+            "e");
+    test_server s;
+    s.load_monitors(file);
+    CHECK(s.registry().size() == 0);
+    s.restore_monitors(a);
+    CHECK(s.registry().size() == 2);
+    CHECK(s.registry().change_subscriptions() == 1);
+    CHECK(s.has_change_monitors());
+
+    std::vector<connection_id> to, with_data;
+    s.registry().find(oxenss::prefixed_pubkey{pk1}, namespace_id{5}, to, with_data);
+    CHECK(with_data == std::vector{a});
+    to.clear();
+    s.registry().find_changes(oxenss::prefixed_pubkey{pk1}, namespace_id{0}, to);
+    CHECK(to.empty());
+    s.registry().find_changes(oxenss::prefixed_pubkey{pk2}, namespace_id{0}, to);
+    CHECK(to == std::vector{a});
+
+    // Saving writes the field, so it survives another round trip:
+    s.save_monitors(file2);
+    test_server s2;
+    s2.load_monitors(file2);
+    s2.restore_monitors(a);
+    CHECK(s2.registry().size() == 2);
+    CHECK(s2.registry().change_subscriptions() == 1);
+
+    std::filesystem::remove(file);
+    std::filesystem::remove(file2);
+}
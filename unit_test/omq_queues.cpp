@@ -0,0 +1,79 @@
+#include <oxenss/server/omq_queues.h>
+
+#include <catch2/catch.hpp>
+#include <oxenmq/oxenmq.h>
+
+#include <future>
+#include <stdexcept>
+#include <thread>
+
+using oxenss::server::category_limits;
+using oxenss::server::omq_queue_options;
+using oxenss::server::QueueMonitor;
+using namespace std::literals;
+
+TEST_CASE("omq queues - category limits", "[omq][queues]") {
+    auto [name, limits] = oxenss::server::parse_category_limits("storage=4,1000");
+    CHECK(name == "storage");
+    CHECK(limits.reserved_threads == 4);
+    CHECK(limits.max_queue == 1000);
+
+    for (auto bad :
+         {"storage", "=1,2", "storage=4", "storage=4,", "storage=a,10", "storage=-1,10",
+          "storage=1,0", "storage=1,2,3"})
+        CHECK_THROWS_AS(oxenss::server::parse_category_limits(bad), std::invalid_argument);
+
+    omq_queue_options opts;
+    opts.categories["storage"] = limits;
+    CHECK(opts.limits("storage", {1, 200}).reserved_threads == 4);
+    CHECK(opts.limits("sn", {2, 1000}).max_queue == 1000);
+
+    CHECK(opts.general_pool_size() >= 1);
+    opts.general_threads = 3;
+    CHECK(opts.general_pool_size() == 3);
+}
+
+TEST_CASE("omq queues - queue monitor", "[omq][queues]") {
+    oxenmq::OxenMQ omq;
+    omq.set_general_threads(1);
+    omq.add_category("test", oxenmq::AuthLevel::none, 0, 10);
+    QueueMonitor monitor;
+    monitor.add_category("test", {0, 10});
+    omq.start();
+
+    // Tie up the only worker so that probes have to wait:
+    std::promise<void> started, unblock;
+    auto unblocked = unblock.get_future();
+    omq.inject_task("test", "block", "", [&] {
+        started.set_value();
+        unblocked.wait();
+    });
+    started.get_future().wait();
+
+    auto t0 = std::chrono::steady_clock::now() - 12s;
+    monitor.probe(omq, t0);
+    monitor.probe(omq, t0 + QueueMonitor::PROBE_INTERVAL);
+    auto st = monitor.get_stats();
+    REQUIRE(st.size() == 1);
+    CHECK(st[0].name == "test");
+    CHECK(st[0].max_queue == 10);
+    CHECK(st[0].probes == 1);
+    CHECK(st[0].saturated == 1);
+    CHECK(st[0].rejected == 0);
+    CHECK(st[0].waiting);
+
+    // After PROBE_TIMEOUT we give up on the first probe, and send another:
+    monitor.probe(omq, t0 + QueueMonitor::PROBE_TIMEOUT + 1s);
+    st = monitor.get_stats();
+    CHECK(st[0].probes == 2);
+    CHECK(st[0].rejected == 1);
+
+    unblock.set_value();
+    for (int i = 0; i < 100 && monitor.get_stats()[0].waiting; i++)
+        std::this_thread::sleep_for(10ms);
+    st = monitor.get_stats();
+    CHECK_FALSE(st[0].waiting);
+    // The first probe did run eventually, after (at least) 12s:
+    CHECK(st[0].wait_max_us >= 12'000'000);
+    CHECK(st[0].wait_avg_us > 0);
+}
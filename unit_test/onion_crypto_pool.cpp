@@ -0,0 +1,65 @@
+#include <oxenss/rpc/onion_crypto_pool.h>
+
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <future>
+#include <thread>
+
+using oxenss::rpc::OnionCryptoPool;
+using stage = OnionCryptoPool::stage;
+
+TEST_CASE("onion crypto pool - load shedding", "[onion][crypto-pool]") {
+    OnionCryptoPool pool{1, 2};
+
+    // Occupy the (single) pool thread until we release it:
+    std::promise<void> release;
+    std::promise<void> started;
+    pool.submit(stage::decrypt, [&, f = release.get_future().share()] {
+        started.set_value();
+        f.wait();
+    });
+    started.get_future().wait();
+
+    std::atomic<int> ran = 0;
+    pool.submit(stage::decrypt, [&] { ran++; });
+    pool.submit(stage::encrypt, [&] { ran++; });
+    CHECK(pool.queued() == 2);
+
+    // The queue is full, so a decrypt with a shed callback gets shed:
+    bool shed = false;
+    pool.submit(stage::decrypt, [&] { FAIL("shed job should not run"); }, [&] { shed = true; });
+    CHECK(shed);
+
+    // ... while one without (like an encrypt) runs right here instead:
+    auto caller = std::this_thread::get_id();
+    std::thread::id ran_on;
+    pool.submit(stage::encrypt, [&] { ran_on = std::this_thread::get_id(); });
+    CHECK(ran_on == caller);
+
+    release.set_value();
+    pool.shutdown();
+    CHECK(ran == 2);
+    CHECK(pool.queued() == 0);
+
+    auto dec = pool.get_stats(stage::decrypt), enc = pool.get_stats(stage::encrypt);
+    CHECK(dec.jobs == 2);
+    CHECK(dec.shed == 1);
+    CHECK(enc.jobs == 2);
+    CHECK(enc.shed == 0);
+    CHECK(dec.max_wait_us <= dec.wait_us);
+
+    // After shutdown jobs run on the calling thread:
+    ran_on = {};
+    pool.submit(stage::decrypt, [&] { ran_on = std::this_thread::get_id(); }, [] {});
+    CHECK(ran_on == caller);
+}
+
+TEST_CASE("onion crypto pool - no threads", "[onion][crypto-pool]") {
+    OnionCryptoPool pool{0};
+    auto caller = std::this_thread::get_id();
+    std::thread::id ran_on;
+    pool.submit(stage::decrypt, [&] { ran_on = std::this_thread::get_id(); }, [] {});
+    CHECK(ran_on == caller);
+    CHECK(pool.get_stats(stage::decrypt).jobs == 1);
+}
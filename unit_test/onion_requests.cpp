@@ -3,6 +3,12 @@
 #include <ostream>
 
 #include <oxenss/rpc/onion_processing.h>
+#include <oxenss/rpc/request_handler.h>
+#include <oxenss/server/omq.h>
+
+#include <oxenc/bt_serialize.h>
+#include <oxenc/endian.h>
+#include <nlohmann/json.hpp>
 
 using namespace oxenss::rpc;
 using namespace oxenss::crypto;
@@ -26,6 +32,22 @@ TEST_CASE("onion request - final destination", "[onion][final]") {
     CHECK(*std::get_if<FinalDestinationInfo>(&res) == expected);
 }
 
+TEST_CASE("onion request - final destination response format", "[onion][final]") {
+    auto data = prefix + R"#({
+        "headers": "",
+        "json": true,
+        "base64": false,
+        "bt": true
+    })#";
+
+    auto res = process_inner_request(data);
+
+    auto expected = FinalDestinationInfo{ciphertext, true, false, true};
+
+    REQUIRE(std::holds_alternative<FinalDestinationInfo>(res));
+    CHECK(*std::get_if<FinalDestinationInfo>(&res) == expected);
+}
+
 // Provided "host", so the request should go
 // to an external server. Default values will
 // be used for port and protocol.
@@ -89,6 +111,48 @@ TEST_CASE("onion request - relay to snode", "[onion][snode]") {
     CHECK(*std::get_if<RelayToNodeInfo>(&res) == expected);
 }
 
+TEST_CASE("onion request - relay to snode, large ciphertext", "[onion][snode]") {
+    // Large enough that the ciphertext can't be in a small-string buffer:
+    std::string big(20'000, 'c');
+    auto size = oxenc::host_to_little(static_cast<uint32_t>(big.size()));
+    std::string data(reinterpret_cast<const char*>(&size), 4);
+    data += big;
+    data += R"#({
+        "destination": "ffffeeeeddddccccbbbbaaaa9999888877776666555544443333222211110000",
+        "ephemeral_key": "0000111122223333444455556666777788889999000011112222333344445555"
+    })#";
+
+    auto res = process_inner_request(data);
+
+    REQUIRE(std::holds_alternative<RelayToNodeInfo>(res));
+    CHECK(std::get<RelayToNodeInfo>(res).ciphertext == big);
+}
+
+TEST_CASE("onion request - relay data encoding", "[onion][snode]") {
+    OnionRequestMetadata meta{
+            x25519_pubkey::from_hex(
+                    "0000111122223333444455556666777788889999000011112222333344445555"),
+            nullptr,
+            3,
+            EncryptType::xchacha20};
+    std::string payload(5000, 'p');
+
+    auto encoded = oxenss::server::OMQ::encode_onion_data(payload, meta);
+    CHECK(encoded ==
+          oxenc::bt_serialize<oxenc::bt_dict>({
+                  {"data", payload},
+                  {"enc_type", to_string(meta.enc_type)},
+                  {"ephemeral_key", meta.ephem_key.view()},
+                  {"hop_no", meta.hop_no},
+          }));
+
+    auto [decoded_payload, decoded] = oxenss::server::OMQ::decode_onion_data(encoded);
+    CHECK(decoded_payload == payload);
+    CHECK(decoded.ephem_key == meta.ephem_key);
+    CHECK(decoded.enc_type == meta.enc_type);
+    CHECK(decoded.hop_no == 3);
+}
+
 TEST_CASE("onion request - url target filtering", "[onion][relay]") {
     CHECK(is_onion_url_target_allowed("/loki/v3/lsrpc"));
     CHECK(is_onion_url_target_allowed("/loki/oxen/v4/lsrpc"));
@@ -98,3 +162,58 @@ TEST_CASE("onion request - url target filtering", "[onion][relay]") {
     CHECK_FALSE(is_onion_url_target_allowed("/loki/v3"));
     CHECK_FALSE(is_onion_url_target_allowed("/loki/v3/lsrpc?foo=bar"));
 }
+
+TEST_CASE("onion request - bt-encoded response", "[onion][final]") {
+    const auto snode_pubkey = x25519_pubkey::from_hex(
+            "01c7391664840b2ef7126b3709dbac178ba5f3ef2335a62343d5df7da4a11c30");
+    const auto snode_seckey = x25519_seckey::from_hex(
+            "7d446468c186d6fb3c83365ab77a37b1f9fa3e59eb9788a40ae2e9560f196f30");
+    const auto client_pubkey = x25519_pubkey::from_hex(
+            "f7b99da2e25e3c399902641c707ae20ad72b63ed0cc487730ff0b3bcecf18609");
+    const auto client_seckey = x25519_seckey::from_hex(
+            "f512f68e81a932aa2ff6d8723baa260a43a6f789d61c91b71f73e4f284e3600a");
+    ChannelEncryption snode{snode_seckey, snode_pubkey};
+    ChannelEncryption client{client_seckey, client_pubkey, false};
+
+    // The bt response is never base64-encoded, even though base64 defaults to true:
+    auto decrypt = [&](const Response& res) {
+        REQUIRE(res.status == oxenss::http::OK);
+        REQUIRE(std::holds_alternative<std::string>(res.body));
+        return client.decrypt(
+                EncryptType::xchacha20, std::get<std::string>(res.body), snode_pubkey);
+    };
+
+    SECTION("json body") {
+        auto res = wrap_proxy_response(
+                {oxenss::http::OK, nlohmann::json{{"hello", "world"}}},
+                snode,
+                client_pubkey,
+                EncryptType::xchacha20,
+                /*json=*/true,
+                /*base64=*/true,
+                /*bt=*/true);
+        auto plaintext = decrypt(res);
+        oxenc::bt_dict_consumer d{plaintext};
+        CHECK(d.require<std::string_view>("b") == R"({"hello":"world"})");
+        CHECK(d.require<int>("s") == 200);
+        CHECK(d.is_finished());
+    }
+
+    SECTION("string body") {
+        // The body goes in as is, without any escaping:
+        auto body = "not \"json\"\0\xff"s;
+        auto res = wrap_proxy_response(
+                {oxenss::http::BAD_REQUEST, body},
+                snode,
+                client_pubkey,
+                EncryptType::xchacha20,
+                /*json=*/false,
+                /*base64=*/true,
+                /*bt=*/true);
+        auto plaintext = decrypt(res);
+        oxenc::bt_dict_consumer d{plaintext};
+        CHECK(d.require<std::string_view>("b") == body);
+        CHECK(d.require<int>("s") == 400);
+        CHECK(d.is_finished());
+    }
+}
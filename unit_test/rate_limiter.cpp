@@ -118,3 +118,112 @@ TEST_CASE("rate limiter - client - max client limit", "[ratelim][client]") {
     const auto delta = 1'000'000us / RateLimiter::TOKEN_RATE;
     CHECK_FALSE(rate_limiter.should_rate_limit_client(overflow_ip, now + delta));
 }
+
+TEST_CASE("rate limiter - client - IPv6 /64", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq};
+    const auto now = std::chrono::steady_clock::now();
+
+    // Every address in a /64 shares the one bucket
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(
+                "2001:db8:1:2::" + std::to_string(i % 100 + 1), now));
+    CHECK(rate_limiter.should_rate_limit_client("2001:db8:1:2:ffff::1", now));
+    CHECK(rate_limiter.should_rate_limit_client("[2001:db8:1:2::1]", now));
+    CHECK(rate_limiter.client_count() == 1);
+
+    // ... but the neighbouring /64 doesn't
+    CHECK_FALSE(rate_limiter.should_rate_limit_client("2001:db8:1:3::1", now));
+    CHECK(rate_limiter.client_count() == 2);
+
+    // Packed addresses, as we get from the HTTPS server
+    std::string packed(16, '\0');
+    packed[0] = 0x20;
+    packed[1] = 0x01;
+    packed[2] = 0x0d;
+    packed[3] = static_cast<char>(0xb8);
+    packed[5] = 1;
+    packed[7] = 2;
+    packed[15] = 42;
+    CHECK(rate_limiter.should_rate_limit_client_addr(packed, now));
+    CHECK(rate_limiter.should_rate_limit_client_addr("bad", now));
+}
+
+TEST_CASE("rate limiter - client - IPv4 address forms", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq};
+    const auto now = std::chrono::steady_clock::now();
+    uint32_t identifier = (10 << 24) + (1 << 16) + (1 << 8) + 13;
+
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(identifier, now));
+
+    // The dotted quad, packed, and IPv4-mapped IPv6 forms are all the same client
+    CHECK(rate_limiter.should_rate_limit_client("10.1.1.13"s, now));
+    CHECK(rate_limiter.should_rate_limit_client_addr("\x0a\x01\x01\x0d"sv, now));
+    CHECK(rate_limiter.should_rate_limit_client("::ffff:10.1.1.13"s, now));
+    CHECK(rate_limiter.client_count() == 1);
+
+    // Not an IP at all: not something we can rate limit
+    CHECK_FALSE(rate_limiter.should_rate_limit_client("not an ip"s, now));
+}
+
+TEST_CASE("rate limiter - client - configured limits", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    oxenss::rpc::rate_limit_config config = RateLimiter::DEFAULT_CONFIG;
+    config.bucket_size = 10;
+    config.token_rate = 5;
+    config.max_clients = 50;
+    RateLimiter rate_limiter{omq, config};
+    const auto now = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < 10; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(1, now));
+    CHECK(rate_limiter.should_rate_limit_client(1, now));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(1, now + 200ms));
+    CHECK(rate_limiter.should_rate_limit_client(1, now + 200ms));
+
+    // Service nodes keep the default burst
+    auto sn = legacy_pubkey::from_hex(
+            "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abc000");
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit(sn, now));
+
+    // Fill up the client limit (spread across every shard)
+    for (uint32_t ip = 2; ip <= 50; ++ip)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(ip, now));
+    CHECK(rate_limiter.client_count() == 50);
+    CHECK(rate_limiter.should_rate_limit_client(1000, now));
+    // Once the buckets are full again a new client pushes out idle ones from its shard
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(1000, now + 1s));
+    CHECK(rate_limiter.client_count() < 50);
+}
+
+TEST_CASE("rate limiter - client - inline cleanup goes around the shard", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    oxenss::rpc::rate_limit_config config = RateLimiter::DEFAULT_CONFIG;
+    config.bucket_size = 10;
+    config.token_rate = 5;
+    config.max_clients = 2 * RateLimiter::MAX_INLINE_CLEANUP;
+    RateLimiter rate_limiter{omq, config};
+    const auto now = std::chrono::steady_clock::now();
+
+    // Multiples of SHARDS all go into the same shard.  Half of the clients are idle, and the
+    // other half are busy:
+    const uint32_t n = RateLimiter::MAX_INLINE_CLEANUP;
+    for (uint32_t i = 1; i <= n; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(i * RateLimiter::SHARDS, now));
+    for (uint32_t i = n + 1; i <= 2 * n; ++i)
+        for (int j = 0; j < 10; ++j)
+            CHECK_FALSE(rate_limiter.should_rate_limit_client(i * RateLimiter::SHARDS, now));
+    CHECK(rate_limiter.client_count() == 2 * n);
+
+    // Once the idle ones are full again a new client gets in within a couple of tries, even if
+    // the first cleanup only happens to look at busy buckets:
+    const uint32_t newcomer = 1000 * RateLimiter::SHARDS;
+    bool admitted = false;
+    for (int i = 0; i < 2 && !admitted; ++i)
+        admitted = !rate_limiter.should_rate_limit_client(newcomer, now + 500ms);
+    CHECK(admitted);
+    CHECK(rate_limiter.client_count() <= 2 * n);
+}
@@ -0,0 +1,256 @@
+#include <oxenss/snode/relay_queue.h>
+#include <oxenss/snode/serialization.h>
+#include <oxenss/snode/stats.h>
+
+#include <catch2/catch.hpp>
+#include <oxenmq/oxenmq.h>
+
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace oxenss;
+using namespace oxenss::snode;
+using namespace std::literals;
+
+namespace {
+
+sn_record make_sn(char c) {
+    sn_record sn;
+    sn.pubkey_legacy = crypto::legacy_pubkey::from_hex(std::string(64, c));
+    sn.pubkey_x25519 = crypto::x25519_pubkey::from_hex(std::string(64, c));
+    return sn;
+}
+
+// Stands in for the QUIC transport: records the batches sent, keeping their reply callbacks so
+// that the test can answer them when it wants to.
+struct fake_transport {
+    struct request {
+        crypto::x25519_pubkey peer;
+        std::string command;
+        std::string body;
+        peer_reply_callback cb;
+    };
+    std::mutex mutex;
+    std::vector<request> requests;
+
+    peer_request_func func() {
+        return [this](const crypto::x25519_pubkey& peer,
+                      std::string_view command,
+                      std::string_view body,
+                      peer_reply_callback cb) {
+            std::lock_guard lock{mutex};
+            requests.push_back({peer, std::string{command}, std::string{body}, std::move(cb)});
+            return true;
+        };
+    }
+
+    size_t size() {
+        std::lock_guard lock{mutex};
+        return requests.size();
+    }
+
+    std::string body(size_t i) {
+        std::lock_guard lock{mutex};
+        return requests.at(i).body;
+    }
+
+    std::string command(size_t i) {
+        std::lock_guard lock{mutex};
+        return requests.at(i).command;
+    }
+
+    // Replies to the `i`th request (not under the lock, since the reply sends more batches).
+    void reply(size_t i, bool success, std::vector<std::string> parts) {
+        peer_reply_callback cb;
+        {
+            std::lock_guard lock{mutex};
+            cb = std::move(requests.at(i).cb);
+        }
+        cb(success, std::move(parts));
+    }
+};
+
+}  // namespace
+
+TEST_CASE("relay queue - in-flight window", "[relay]") {
+    oxenmq::OxenMQ omq;
+    all_stats stats{omq};
+    omq.start();
+    fake_transport quic;
+    RelayQueue queue{omq, stats};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_sn('a'), b = make_sn('b');
+    for (int i = 0; i < RelayQueue::MAX_IN_FLIGHT + 2; i++)
+        queue.push(a, "a" + std::to_string(i));
+    queue.push(b, "b0");
+
+    // Only MAX_IN_FLIGHT of a's batches go out before a replies, but that doesn't hold up b:
+    REQUIRE(quic.size() == RelayQueue::MAX_IN_FLIGHT + 1);
+    CHECK(quic.command(0) == "sn.data");
+    CHECK(quic.body(0) == "a0");
+    CHECK(quic.body(RelayQueue::MAX_IN_FLIGHT) == "b0");
+    auto st = queue.get_stats();
+    CHECK(st.queued_batches == 2);
+    CHECK(st.queued_bytes == 4);
+    CHECK(st.in_flight == RelayQueue::MAX_IN_FLIGHT + 1);
+    CHECK(st.quic_batches == RelayQueue::MAX_IN_FLIGHT + 1);
+
+    // Each reply frees up a slot for the next of a's batches:
+    quic.reply(0, true, {"OK", "3"});
+    REQUIRE(quic.size() == RelayQueue::MAX_IN_FLIGHT + 2);
+    CHECK(quic.body(RelayQueue::MAX_IN_FLIGHT + 1) ==
+          "a" + std::to_string(RelayQueue::MAX_IN_FLIGHT));
+    // Old nodes reply without any data:
+    quic.reply(1, true, {});
+    REQUIRE(quic.size() == RelayQueue::MAX_IN_FLIGHT + 3);
+
+    st = queue.get_stats();
+    CHECK(st.queued_batches == 0);
+    CHECK(st.sent_batches == 2);
+    CHECK(st.sent_bytes == 4);
+    CHECK(st.acked_new == 3);
+    CHECK(st.failed_batches == 0);
+}
+
+TEST_CASE("relay queue - peers that accept compressed batches", "[relay]") {
+    oxenmq::OxenMQ omq;
+    all_stats stats{omq};
+    omq.start();
+    fake_transport quic;
+    RelayQueue queue{omq, stats};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_sn('a'), b = make_sn('b');
+    queue.push(a, "a0");
+    queue.push(b, "b0");
+    REQUIRE(quic.size() == 2);
+    CHECK_FALSE(queue.accepts_zstd(a.pubkey_x25519));
+
+    // Nodes that can decompress say so in their "OK" replies:
+    quic.reply(0, true, {"OK", "1", std::string{SN_DATA_ZSTD}});
+    quic.reply(1, true, {"OK", "1"});
+    CHECK(queue.accepts_zstd(a.pubkey_x25519));
+    CHECK_FALSE(queue.accepts_zstd(b.pubkey_x25519));
+
+    // A later reply without the marker (e.g. once a restarts without zstd) stops compressed
+    // batches going to it:
+    queue.push(a, "a1");
+    REQUIRE(quic.size() == 3);
+    quic.reply(2, true, {"OK", "1"});
+    CHECK_FALSE(queue.accepts_zstd(a.pubkey_x25519));
+}
+
+TEST_CASE("relay queue - rate cap", "[relay]") {
+    oxenmq::OxenMQ omq;
+    all_stats stats{omq};
+    omq.start();
+    fake_transport quic;
+    // With a 1 byte/s rate the send budget doesn't recover during the test:
+    RelayQueue queue{omq, stats, 1};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_sn('a'), b = make_sn('b');
+    queue.push(a, std::string(600, 'x'));
+    queue.push(b, std::string(600, 'y'));
+    queue.push(b, std::string(600, 'z'));
+
+    // A batch goes out whenever there is any budget left, after which we are over budget:
+    CHECK(quic.size() == 1);
+    auto st = queue.get_stats();
+    CHECK(st.queued_batches == 2);
+    CHECK(st.queued_bytes == 1200);
+    quic.reply(0, true, {"OK", "1"});
+    CHECK(quic.size() == 1);
+    CHECK(queue.get_stats().sent_batches == 1);
+}
+
+TEST_CASE("relay queue - failed batches are retried after a backoff", "[relay]") {
+    oxenmq::OxenMQ omq;
+    all_stats stats{omq};
+    omq.start();
+    fake_transport quic;
+    RelayQueue queue{omq, stats};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_sn('a'), b = make_sn('b');
+    queue.push(a, "a0");
+    queue.push(b, "b0");
+    REQUIRE(quic.size() == 2);
+
+    // A timeout and a reply that the batch wasn't stored both count as failures:
+    quic.reply(0, false, {});
+    quic.reply(1, true, {"FAILED"});
+    auto st = queue.get_stats();
+    CHECK(st.failed_batches == 2);
+    CHECK(st.retried_batches == 2);
+    CHECK(st.dropped_batches == 0);
+    CHECK(st.sent_batches == 0);
+    CHECK(st.in_flight == 0);
+    // The batches are queued again, but not sent while their destinations back off:
+    CHECK(st.queued_batches == 2);
+    CHECK(st.backoff_peers == 2);
+    queue.push(a, "a1");
+    CHECK(quic.size() == 2);
+    CHECK(queue.get_stats().queued_batches == 3);
+
+    // Shutting down drops whatever is queued:
+    queue.shutdown();
+    st = queue.get_stats();
+    CHECK(st.queued_batches == 0);
+    CHECK(st.queued_bytes == 0);
+    CHECK(queue.stopping());
+}
+
+TEST_CASE("relay queue - feed tasks wait for space", "[relay]") {
+    oxenmq::OxenMQ omq;
+    all_stats stats{omq};
+    omq.start();
+    fake_transport quic;
+    std::promise<void> waited;
+    auto done = waited.get_future();
+    RelayQueue queue{omq, stats, RelayQueue::DEFAULT_RATE, 100};
+    queue.set_peer_request(quic.func());
+
+    auto a = make_sn('a');
+    queue.feed([&] {
+        for (int i = 0; i < RelayQueue::MAX_IN_FLIGHT; i++)
+            queue.push(a, "a" + std::to_string(i));
+        // The window is full, so this one stays queued, and takes us over the queue limit:
+        queue.push(a, std::string(150, 'x'));
+        queue.wait_for_space();
+        waited.set_value();
+    });
+
+    CHECK(done.wait_for(100ms) == std::future_status::timeout);
+    CHECK(queue.get_stats().queued_bytes == 150);
+    for (int i = 0; i < 100 && quic.size() < RelayQueue::MAX_IN_FLIGHT; i++)
+        std::this_thread::sleep_for(1ms);
+    REQUIRE(quic.size() == RelayQueue::MAX_IN_FLIGHT);
+
+    // Once a reply lets the big batch go out the task can carry on:
+    quic.reply(0, true, {"OK", "1"});
+    CHECK(done.wait_for(5s) == std::future_status::ready);
+    CHECK(queue.get_stats().queued_bytes == 0);
+}
+
+TEST_CASE("relay queue - replies and timers after destruction", "[relay]") {
+    oxenmq::OxenMQ omq;
+    all_stats stats{omq};
+    omq.start();
+    fake_transport quic;
+    {
+        RelayQueue queue{omq, stats};
+        queue.set_peer_request(quic.func());
+        queue.push(make_sn('a'), "a0");
+        REQUIRE(quic.size() == 1);
+    }
+    // A late reply to a batch sent by a destroyed queue, or its send timer firing after, must not
+    // touch the queue:
+    quic.reply(0, true, {"OK", "1"});
+    std::this_thread::sleep_for(3 * RelayQueue::SEND_INTERVAL);
+    SUCCEED();
+}
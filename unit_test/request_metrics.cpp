@@ -0,0 +1,68 @@
+#include <oxenss/rpc/request_metrics.h>
+
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+
+using oxenss::rpc::RequestMetrics;
+using oxenss::rpc::transport;
+using namespace std::literals;
+
+TEST_CASE("request metrics - histograms", "[metrics]") {
+    RequestMetrics metrics{{"store"sv, "retrieve"sv}};
+
+    metrics.record("store", transport::https, 300us, 200);
+    metrics.record("store", transport::https, 20ms, 200);
+    metrics.record("store", transport::https, 20s, 503);
+    metrics.record("store", transport::quic, 1ms, 421);
+    metrics.record("no_such_endpoint", transport::omq, 1ms, 200);
+
+    std::string out;
+    metrics.write_prometheus(out);
+
+    auto has = [&](std::string_view line) { return out.find(line) != std::string::npos; };
+    CHECK(has("# TYPE oxenss_rpc_request_duration_seconds histogram\n"));
+    CHECK(has("oxenss_rpc_request_duration_seconds_bucket"
+              "{endpoint=\"store\",transport=\"https\",le=\"0.0005\"} 1\n"));
+    CHECK(has("oxenss_rpc_request_duration_seconds_bucket"
+              "{endpoint=\"store\",transport=\"https\",le=\"0.025\"} 2\n"));
+    CHECK(has("oxenss_rpc_request_duration_seconds_bucket"
+              "{endpoint=\"store\",transport=\"https\",le=\"10\"} 2\n"));
+    CHECK(has("oxenss_rpc_request_duration_seconds_bucket"
+              "{endpoint=\"store\",transport=\"https\",le=\"+Inf\"} 3\n"));
+    CHECK(has("oxenss_rpc_request_duration_seconds_sum"
+              "{endpoint=\"store\",transport=\"https\"} 20.0203\n"));
+    CHECK(has("oxenss_rpc_request_duration_seconds_count"
+              "{endpoint=\"store\",transport=\"quic\"} 1\n"));
+    CHECK(has("oxenss_rpc_responses_total"
+              "{endpoint=\"store\",transport=\"https\",result=\"ok\"} 2\n"));
+    CHECK(has("oxenss_rpc_responses_total"
+              "{endpoint=\"store\",transport=\"https\",result=\"server_error\"} 1\n"));
+    CHECK(has("oxenss_rpc_responses_total"
+              "{endpoint=\"store\",transport=\"quic\",result=\"client_error\"} 1\n"));
+
+    // Nothing for combinations without requests, or for unknown endpoints
+    CHECK_FALSE(has("transport=\"omq\""));
+    CHECK_FALSE(has("endpoint=\"retrieve\""));
+    CHECK_FALSE(has("no_such_endpoint"));
+}
+
+TEST_CASE("request metrics - stats export", "[metrics]") {
+    auto stats = nlohmann::json{
+            {"version", "2.6.0"},
+            {"total_stored", 123},
+            {"db_used", 4.5},
+            {"syncing", false},
+            {"namespace_messages", {{"0", 10}, {"-10", 2}}},
+            {"reachability_latency", {{"bounds_ms", {50, 100}}}},
+            {"peers", {1, 2, 3}}};
+    std::string out;
+    oxenss::rpc::write_prometheus_stats(out, stats);
+
+    CHECK(out ==
+          "# TYPE oxenss_db_used untyped\noxenss_db_used 4.5\n"
+          "# TYPE oxenss_namespace_messages untyped\n"
+          "oxenss_namespace_messages{key=\"-10\"} 2\n"
+          "oxenss_namespace_messages{key=\"0\"} 10\n"
+          "# TYPE oxenss_syncing untyped\noxenss_syncing 0\n"
+          "# TYPE oxenss_total_stored untyped\noxenss_total_stored 123\n");
+}
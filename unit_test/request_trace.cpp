@@ -0,0 +1,74 @@
+#include <oxenss/rpc/request_trace.h>
+
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+
+#include <thread>
+
+using oxenss::rpc::RequestTracer;
+using oxenss::rpc::trace_phase;
+using oxenss::rpc::transport;
+using namespace std::literals;
+
+TEST_CASE("request tracing - sampling", "[trace]") {
+    RequestTracer off{0, 0ms};
+    CHECK(off.start("store", transport::https) == nullptr);
+
+    RequestTracer tracer{0.25, 0ms, 3};
+    int traced = 0;
+    for (int i = 0; i < 20; i++) {
+        if (auto t = tracer.start("retrieve", transport::omq)) {
+            CHECK(t->sampled);
+            traced++;
+            t->mark(trace_phase::parsed);
+            tracer.finish(t, 200);
+        }
+    }
+    CHECK(traced == 5);
+    CHECK(tracer.kept() == 5);
+
+    // Only the most recent 3 are kept
+    auto traces = tracer.get_traces();
+    REQUIRE(traces.size() == 3);
+    CHECK(traces[0]["endpoint"] == "retrieve");
+    CHECK(traces[0]["transport"] == "omq");
+    CHECK(traces[0]["status"] == 200);
+    CHECK(traces[0]["sampled"] == true);
+    CHECK(traces[0]["slow"] == false);
+    CHECK(traces[0]["phases"].contains("parsed"));
+    CHECK_FALSE(traces[0]["phases"].contains("db_start"));
+
+    // Finishing an untraced request is harmless
+    tracer.finish(nullptr, 200);
+}
+
+TEST_CASE("request tracing - slow requests", "[trace]") {
+    RequestTracer tracer{0, 20ms};
+
+    auto fast = tracer.start("store", transport::quic);
+    REQUIRE(fast);
+    CHECK_FALSE(fast->sampled);
+    tracer.finish(fast, 200);
+    CHECK(tracer.kept() == 0);
+
+    auto slow = tracer.start("store", transport::quic);
+    REQUIRE(slow);
+    slow->mark(trace_phase::parsed);
+    slow->mark(trace_phase::verified);
+    std::this_thread::sleep_for(25ms);
+    slow->mark(trace_phase::db_start);
+    // Only the first mark of a phase counts
+    auto v = slow->at_us(trace_phase::verified);
+    slow->mark(trace_phase::verified);
+    CHECK(slow->at_us(trace_phase::verified) == v);
+    tracer.finish(slow, 500);
+
+    auto traces = tracer.get_traces();
+    REQUIRE(traces.size() == 1);
+    CHECK(traces[0]["slow"] == true);
+    CHECK(traces[0]["sampled"] == false);
+    CHECK(traces[0]["status"] == 500);
+    CHECK(traces[0]["total_us"].get<int64_t>() >= 20'000);
+    CHECK(traces[0]["phases"]["db_start"].get<int64_t>() >= 20'000);
+    CHECK(traces[0]["phases"]["verified"].get<int64_t>() < 20'000);
+}
@@ -0,0 +1,68 @@
+#include <oxenss/rpc/response_compressor.h>
+
+#include <catch2/catch.hpp>
+
+#include <string>
+
+using oxenss::rpc::encoding;
+using oxenss::rpc::ResponseCompressor;
+
+TEST_CASE("response compression - negotiation", "[compression]") {
+    const bool zstd = ResponseCompressor::supported(encoding::zstd);
+    const bool br = ResponseCompressor::supported(encoding::brotli);
+    const auto zstd_or = [zstd](encoding e) { return zstd ? encoding::zstd : e; };
+    const auto br_or = [br](encoding e) { return br ? encoding::brotli : e; };
+
+    CHECK(ResponseCompressor::negotiate("") == encoding::identity);
+    CHECK(ResponseCompressor::negotiate("gzip, deflate") == encoding::identity);
+    CHECK(ResponseCompressor::negotiate("gzip, br") == br_or(encoding::identity));
+    CHECK(ResponseCompressor::negotiate("zstd") == zstd_or(encoding::identity));
+    CHECK(ResponseCompressor::negotiate("BR, ZSTD") == zstd_or(br_or(encoding::identity)));
+    CHECK(ResponseCompressor::negotiate("*") == zstd_or(br_or(encoding::identity)));
+
+    // q values: the client's preference wins over ours, and q=0 refuses an encoding:
+    CHECK(ResponseCompressor::negotiate("zstd;q=0.5, br") == br_or(zstd_or(encoding::identity)));
+    CHECK(ResponseCompressor::negotiate("br;q=0.9, zstd;q=0.1") ==
+          br_or(zstd_or(encoding::identity)));
+    CHECK(ResponseCompressor::negotiate("zstd;q=0, br;q=0") == encoding::identity);
+    CHECK(ResponseCompressor::negotiate("*, zstd;q=0") == br_or(encoding::identity));
+    CHECK(ResponseCompressor::negotiate("*;q=0") == encoding::identity);
+
+    CHECK(oxenss::rpc::to_string(encoding::zstd) == "zstd");
+    CHECK(oxenss::rpc::to_string(encoding::brotli) == "br");
+    CHECK(oxenss::rpc::to_string(encoding::identity) == "identity");
+}
+
+TEST_CASE("response compression - compressing", "[compression]") {
+    ResponseCompressor compressor{100};
+
+    std::string body;
+    for (int i = 0; body.size() < 10000; i++)
+        body += R"({"data":"aGVsbG8gd29ybGQ=","hash":")" + std::to_string(i) + R"("},)";
+    const auto original = body;
+
+    CHECK(compressor.compress(encoding::identity, body) == encoding::identity);
+    CHECK(body == original);
+
+    for (auto e : {encoding::zstd, encoding::brotli}) {
+        body = original;
+        std::string small = "[200, {}]";
+        CHECK(compressor.compress(e, small) == encoding::identity);
+        CHECK(small == "[200, {}]");
+
+        if (!ResponseCompressor::supported(e)) {
+            CHECK(compressor.compress(e, body) == encoding::identity);
+            CHECK(body == original);
+            CHECK(compressor.get_stats(e).skipped == 2);
+            continue;
+        }
+        REQUIRE(compressor.compress(e, body) == e);
+        CHECK(body.size() < original.size() / 4);
+
+        auto st = compressor.get_stats(e);
+        CHECK(st.responses == 1);
+        CHECK(st.skipped == 1);
+        CHECK(st.bytes_in == static_cast<int64_t>(original.size()));
+        CHECK(st.bytes_out == static_cast<int64_t>(body.size()));
+    }
+}
@@ -0,0 +1,82 @@
+#include <oxenss/snode/retrieve_waiters.h>
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using oxenss::namespace_id;
+using oxenss::snode::RetrieveWaiters;
+using namespace std::literals;
+
+TEST_CASE("retrieve waiters - wake on message", "[retrieve][wait]") {
+    RetrieveWaiters waiters;
+    const oxenss::prefixed_pubkey pk1{"\x05" + std::string(32, '1')};
+    const oxenss::prefixed_pubkey pk2{"\x05" + std::string(32, '2')};
+    auto deadline = std::chrono::steady_clock::now() + 1min;
+
+    std::vector<int> woken;
+    auto a = waiters.add(pk1, namespace_id{0}, deadline, [&] { woken.push_back(1); });
+    auto b = waiters.add(pk1, namespace_id{3}, deadline, [&] { woken.push_back(2); });
+    auto c = waiters.add(pk2, namespace_id{0}, deadline, [&] { woken.push_back(3); });
+    auto d = waiters.add(pk1, namespace_id{0}, deadline, [&] { woken.push_back(4); });
+    CHECK(a != 0);
+    CHECK(b != a);
+    CHECK(c != 0);
+    CHECK(d != 0);
+    CHECK(waiters.size() == 4);
+
+    CHECK(waiters.wake(pk1, namespace_id{5}) == 0);
+    CHECK(waiters.wake(pk1, namespace_id{0}) == 2);
+    CHECK(woken.size() == 2);
+    CHECK(std::count(woken.begin(), woken.end(), 1) == 1);
+    CHECK(std::count(woken.begin(), woken.end(), 4) == 1);
+    CHECK(waiters.size() == 2);
+
+    // Already woken, so nothing happens a second time:
+    CHECK(waiters.wake(pk1, namespace_id{0}) == 0);
+    CHECK_FALSE(waiters.cancel(a));
+
+    // Cancelling removes without calling:
+    CHECK(waiters.cancel(b));
+    CHECK(waiters.wake(pk1, namespace_id{3}) == 0);
+    CHECK(waiters.wake(pk2, namespace_id{0}) == 1);
+    CHECK(woken.size() == 3);
+    CHECK(woken.back() == 3);
+    CHECK(waiters.size() == 0);
+}
+
+TEST_CASE("retrieve waiters - expiry", "[retrieve][wait]") {
+    RetrieveWaiters waiters;
+    const oxenss::prefixed_pubkey pk{"\x05" + std::string(32, '1')};
+    auto now = std::chrono::steady_clock::now();
+
+    std::vector<int> woken;
+    waiters.add(pk, namespace_id{0}, now + 10s, [&] { woken.push_back(1); });
+    waiters.add(pk, namespace_id{0}, now + 5s, [&] { woken.push_back(2); });
+    waiters.add(pk, namespace_id{1}, now + 20s, [&] { woken.push_back(3); });
+
+    CHECK(waiters.expire(now) == 0);
+    CHECK(waiters.expire(now + 10s) == 2);
+    CHECK(woken == std::vector{2, 1});
+    CHECK(waiters.size() == 1);
+    CHECK(waiters.expire(now + 1min) == 1);
+    CHECK(woken == std::vector{2, 1, 3});
+    CHECK(waiters.size() == 0);
+}
+
+TEST_CASE("retrieve waiters - limits", "[retrieve][wait]") {
+    RetrieveWaiters waiters;
+    const oxenss::prefixed_pubkey pk{"\x05" + std::string(32, '1')};
+    auto deadline = std::chrono::steady_clock::now() + 1min;
+
+    for (size_t i = 0; i < RetrieveWaiters::MAX_PER_ACCOUNT; i++)
+        CHECK(waiters.add(pk, namespace_id{0}, deadline, [] {}) != 0);
+    CHECK(waiters.add(pk, namespace_id{1}, deadline, [] {}) == 0);
+    // Other accounts are unaffected:
+    const oxenss::prefixed_pubkey other{"\x05" + std::string(32, '2')};
+    CHECK(waiters.add(other, namespace_id{0}, deadline, [] {}) != 0);
+    CHECK(waiters.size() == RetrieveWaiters::MAX_PER_ACCOUNT + 1);
+}
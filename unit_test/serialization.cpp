@@ -1,11 +1,23 @@
 #include <oxenss/snode/serialization.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/rpc/cached_responses.h>
+#include <oxenss/rpc/response_compressor.h>
+#include <oxenss/rpc/retrieve_encoder.h>
+#include <oxenss/server/utils.h>
+#include <oxenss/utils/time.hpp>
+#include <oxenss/version.h>
+#include <oxenc/base64.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/hex.h>
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
 
 #include <catch2/catch.hpp>
 
 #include <chrono>
+#include <sstream>
 #include <string>
+#include <unordered_set>
 
 using namespace oxenss::snode;
 
@@ -68,3 +80,383 @@ TEST_CASE("v1 serialization - batch serialization", "[serialization]") {
     serialized = serialize_messages(msgs.begin(), msgs.end(), 1);
     CHECK(serialized.size() == 2);
 }
+
+namespace {
+
+// The previous way of serializing a batch: build a bt_list of all the messages, then serialize it
+// through a stream.
+std::string dom_serialize_messages(const std::vector<oxenss::message>& msgs) {
+    oxenc::bt_list l;
+    for (auto& msg : msgs)
+        l.push_back(oxenc::bt_list{
+                {msg.pubkey.prefixed_raw(),
+                 msg.hash,
+                 oxenss::to_epoch_ms(msg.timestamp),
+                 oxenss::to_epoch_ms(msg.expiry),
+                 msg.data}});
+    std::ostringstream oss;
+    oss << SERIALIZATION_VERSION_BT << oxenc::bt_serializer(l);
+    return oss.str();
+}
+
+std::vector<oxenss::message> batch_test_messages(size_t n, size_t size) {
+    std::vector<oxenss::message> msgs;
+    auto now = std::chrono::system_clock::now();
+    for (size_t i = 0; i < n; i++) {
+        oxenss::user_pubkey pk;
+        pk.load(fmt::format("05{:064x}", i % 7));
+        std::string data(size + i % 13, '\0');
+        for (size_t j = 0; j < data.size(); j++)
+            data[j] = static_cast<char>(i * 7 + j);
+        msgs.emplace_back(
+                pk,
+                "hash" + std::to_string(i),
+                oxenss::namespace_id::Default,
+                now - std::chrono::seconds(i),
+                now + std::chrono::hours(i),
+                std::move(data));
+    }
+    return msgs;
+}
+
+}  // namespace
+
+TEST_CASE("v1 serialization - direct serializer matches bt_list", "[serialization]") {
+    auto msgs = batch_test_messages(50, 100);
+    auto batches = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT);
+    REQUIRE(batches.size() == 1);
+    CHECK(batches[0] == dom_serialize_messages(msgs));
+
+    std::vector<oxenss::message> none;
+    CHECK(serialize_messages(none.begin(), none.end(), SERIALIZATION_VERSION_BT) ==
+          std::vector{dom_serialize_messages(none)});
+
+    // With a small batch size, every batch must be a valid batch of the messages that went into it,
+    // and no larger than the batch size.
+    MessageSerializer ser{SERIALIZATION_VERSION_BT, 2000};
+    for (auto& m : msgs)
+        ser.add(m);
+    CHECK(ser.count() == msgs.size());
+    batches = std::move(ser).finish();
+    CHECK(batches.size() > 1);
+    size_t i = 0;
+    for (auto& b : batches) {
+        CHECK(b.size() <= 2000);
+        auto deserialized = deserialize_messages(b);
+        REQUIRE_FALSE(deserialized.empty());
+        std::vector<oxenss::message> expected{
+                msgs.begin() + i, msgs.begin() + i + deserialized.size()};
+        CHECK(b == dom_serialize_messages(expected));
+        i += deserialized.size();
+    }
+    CHECK(i == msgs.size());
+}
+
+TEST_CASE("v1 serialization - message batch views", "[serialization]") {
+    auto msgs = batch_test_messages(50, 100);
+    auto batches = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT);
+    REQUIRE(batches.size() == 1);
+    auto expected = deserialize_messages(batches[0]);
+    REQUIRE(expected.size() == msgs.size());
+
+    auto size = batches[0].size();
+    message_batch batch{std::move(batches[0])};
+    CHECK(batch.bytes() == size);
+    REQUIRE(batch.size() == expected.size());
+    std::unordered_set<const oxenss::user_pubkey*> owners;
+    for (size_t i = 0; i < batch.size(); i++) {
+        auto& m = batch.messages()[i];
+        REQUIRE(m.pubkey);
+        CHECK(*m.pubkey == expected[i].pubkey);
+        CHECK(m.msg.hash == expected[i].hash);
+        CHECK(m.msg.msg_namespace == expected[i].msg_namespace);
+        CHECK(m.msg.timestamp == expected[i].timestamp);
+        CHECK(m.msg.expiry == expected[i].expiry);
+        CHECK(m.msg.data == expected[i].data);
+        owners.insert(m.pubkey);
+    }
+    // Messages with the same owner share a single parsed pubkey:
+    CHECK(owners.size() == 7);
+
+    // An invalid pubkey invalidates the whole batch, just like with deserialize_messages:
+    auto bad = dom_serialize_messages(msgs);
+    auto pos = bad.find("33:");
+    bad[pos + 1] = '2';  // Shorten the first pubkey to 32 bytes, keeping the encoding valid
+    bad.erase(pos + 3, 1);
+    CHECK(deserialize_messages(bad).empty());
+    CHECK_THROWS(message_batch{std::move(bad)});
+}
+
+namespace {
+
+// Messages of a few owners, with some of each owner's messages consecutive, canonical base64
+// hashes (except every 10th), and millisecond timestamps (which is all any serialization keeps).
+std::vector<oxenss::message> compact_test_messages(size_t n, size_t size) {
+    auto msgs = batch_test_messages(n, size);
+    std::sort(msgs.begin(), msgs.begin() + n / 2, [](const auto& a, const auto& b) {
+        return a.pubkey.raw() < b.pubkey.raw();
+    });
+    for (size_t i = 0; i < msgs.size(); i++) {
+        auto& m = msgs[i];
+        if (i % 10 != 0) {
+            std::array<unsigned char, 32> raw{};
+            for (size_t j = 0; j < raw.size(); j++)
+                raw[j] = static_cast<unsigned char>(i * 31 + j);
+            m.hash = oxenc::to_base64(raw.begin(), raw.end());
+            m.hash.resize(43);
+        }
+        m.msg_namespace = static_cast<oxenss::namespace_id>(static_cast<int>(i % 5) - 2);
+        m.timestamp = std::chrono::time_point_cast<std::chrono::milliseconds>(m.timestamp);
+        m.expiry = std::chrono::time_point_cast<std::chrono::milliseconds>(m.expiry);
+    }
+    return msgs;
+}
+
+void check_same_messages(
+        const std::vector<oxenss::message>& a, const std::vector<oxenss::message>& b) {
+    REQUIRE(a.size() == b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        CHECK(a[i].pubkey == b[i].pubkey);
+        CHECK(a[i].hash == b[i].hash);
+        CHECK(a[i].msg_namespace == b[i].msg_namespace);
+        CHECK(a[i].timestamp == b[i].timestamp);
+        CHECK(a[i].expiry == b[i].expiry);
+        CHECK(a[i].data == b[i].data);
+    }
+}
+
+}  // namespace
+
+TEST_CASE("compact serialization - round trip", "[serialization]") {
+    auto msgs = compact_test_messages(100, 200);
+    bool have_zstd = oxenss::rpc::zstd_enabled();
+
+    for (bool compress : {false, true}) {
+        MessageSerializer ser{SERIALIZATION_VERSION_COMPACT, SERIALIZATION_BATCH_SIZE, compress};
+        for (auto& m : msgs)
+            ser.add(m);
+        auto batches = std::move(ser).finish();
+        REQUIRE(batches.size() == 1);
+        CHECK(batches[0][0] == SERIALIZATION_VERSION_COMPACT);
+        CHECK(batches[0][1] == (compress && have_zstd ? 1 : 0));
+        check_same_messages(deserialize_messages(batches[0]), msgs);
+
+        // Smaller than v1, even uncompressed:
+        auto v1 = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT);
+        CHECK(batches[0].size() < v1[0].size());
+
+        message_batch batch{std::move(batches[0])};
+        REQUIRE(batch.size() == msgs.size());
+        for (size_t i = 0; i < msgs.size(); i++) {
+            auto& m = batch.messages()[i];
+            CHECK(*m.pubkey == msgs[i].pubkey);
+            CHECK(m.msg.hash == msgs[i].hash);
+            CHECK(m.msg.msg_namespace == msgs[i].msg_namespace);
+            CHECK(m.msg.timestamp == msgs[i].timestamp);
+            CHECK(m.msg.expiry == msgs[i].expiry);
+            CHECK(m.msg.data == msgs[i].data);
+        }
+    }
+
+    // Batches for peers that can't decompress them:
+    auto plain = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_COMPACT, false);
+    REQUIRE(plain.size() == 1);
+    CHECK(plain[0][1] == 0);
+
+    std::vector<oxenss::message> none;
+    auto empty = serialize_messages(none.begin(), none.end(), SERIALIZATION_VERSION_COMPACT);
+    CHECK(empty == std::vector{"\x02\x00"s});
+    CHECK(deserialize_messages(empty[0]).empty());
+}
+
+TEST_CASE("compact serialization - batch limits and bad input", "[serialization]") {
+    auto msgs = compact_test_messages(50, 100);
+    MessageSerializer ser{SERIALIZATION_VERSION_COMPACT, 2000, false};
+    for (auto& m : msgs)
+        ser.add(m);
+    CHECK(ser.count() == msgs.size());
+    auto batches = std::move(ser).finish();
+    CHECK(batches.size() > 1);
+    std::vector<oxenss::message> all;
+    for (auto& b : batches) {
+        CHECK(b.size() <= 2000);
+        auto deserialized = deserialize_messages(b);
+        REQUIRE_FALSE(deserialized.empty());
+        all.insert(all.end(), deserialized.begin(), deserialized.end());
+    }
+    check_same_messages(all, msgs);
+
+    // Truncated or garbage batches throw:
+    auto& b = batches.front();
+    CHECK_THROWS(deserialize_messages(b.substr(0, b.size() - 1)));
+    CHECK_THROWS(message_batch{b.substr(0, 40)});
+    CHECK_THROWS(deserialize_messages("\x02\x00"s + std::string(33, 'x') + "\xff"));
+    // A compressed batch that isn't valid zstd gets no messages, and isn't a batch we can store:
+    CHECK(deserialize_messages("\x02\x01garbage"s).empty());
+    CHECK_THROWS(message_batch{"\x02\x01garbage"s});
+}
+
+// Not run by default; run with `Test "[benchmark]"` to compare with the bt_list serialization.
+TEST_CASE("v1 serialization - benchmark", "[.][benchmark][serialization]") {
+    auto msgs = batch_test_messages(20'000, 1000);
+    constexpr int ROUNDS = 10;
+
+    std::chrono::steady_clock::duration dom{0}, direct{0};
+    size_t bytes = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        auto start = std::chrono::steady_clock::now();
+        bytes += dom_serialize_messages(msgs).size();
+        auto mid = std::chrono::steady_clock::now();
+        for (auto& b : serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT))
+            bytes -= b.size();
+        dom += mid - start;
+        direct += std::chrono::steady_clock::now() - mid;
+    }
+    CHECK(bytes == 0);
+    WARN(fmt::format(
+            "serializing {} messages: bt_list {}us, direct {}us",
+            msgs.size(),
+            std::chrono::duration_cast<std::chrono::microseconds>(dom).count() / ROUNDS,
+            std::chrono::duration_cast<std::chrono::microseconds>(direct).count() / ROUNDS));
+}
+
+namespace {
+
+// Builds a retrieve response the json way, as the handler does for batch subrequests.
+std::string json_retrieve_response(
+        const std::vector<oxenss::message_view>& msgs, bool bt, bool more, int64_t t) {
+    auto messages = nlohmann::json::array();
+    for (auto& m : msgs)
+        messages.push_back(nlohmann::json{
+                {"hash", std::string{m.hash}},
+                {"timestamp", oxenss::to_epoch_ms(m.timestamp)},
+                {"expiration", oxenss::to_epoch_ms(m.expiry)},
+                {"data", bt ? std::string{m.data} : oxenc::to_base64(m.data)}});
+    nlohmann::json res{{"messages", std::move(messages)}, {"more", more}};
+    res["t"] = t;
+    res["hf"] = std::pair{19, 3};
+    return bt ? oxenc::bt_serialize(oxenss::json_to_bt(std::move(res))) : res.dump();
+}
+
+std::string encoded_retrieve_response(
+        const std::vector<oxenss::message_view>& msgs, bool bt, bool more, int64_t t) {
+    oxenss::rpc::RetrieveEncoder enc{bt, {19, 3}};
+    for (auto& m : msgs)
+        enc.add(m);
+    return enc.finish(more, t);
+}
+
+std::vector<oxenss::message_view> test_messages(
+        std::vector<std::string>& hashes, std::vector<std::string>& datas, size_t n, size_t size) {
+    auto now = std::chrono::system_clock::now();
+    std::vector<oxenss::message_view> msgs;
+    for (size_t i = 0; i < n; i++) {
+        hashes.push_back("hash" + std::to_string(i) + "+/=\"\\\n");
+        std::string data(size, '\0');
+        for (size_t j = 0; j < size; j++)
+            data[j] = static_cast<char>(i * 7 + j);
+        datas.push_back(std::move(data));
+    }
+    for (size_t i = 0; i < n; i++)
+        msgs.push_back(
+                {hashes[i],
+                 oxenss::namespace_id::Default,
+                 now - std::chrono::seconds(i),
+                 now + std::chrono::hours(i),
+                 datas[i]});
+    return msgs;
+}
+
+}  // namespace
+
+TEST_CASE("retrieve encoder - matches json responses", "[serialization][retrieve]") {
+    std::vector<std::string> hashes, datas;
+    auto msgs = test_messages(hashes, datas, 5, 100);
+    int64_t t = 1700000000123;
+
+    for (bool bt : {false, true}) {
+        for (bool more : {false, true}) {
+            CHECK(encoded_retrieve_response(msgs, bt, more, t) ==
+                  json_retrieve_response(msgs, bt, more, t));
+            CHECK(encoded_retrieve_response({}, bt, more, t) ==
+                  json_retrieve_response({}, bt, more, t));
+        }
+    }
+}
+
+// Not run by default; run with `Test "[benchmark]"` to compare the two ways of building a
+// retrieve response.
+TEST_CASE("retrieve encoder - benchmark", "[.][benchmark][retrieve]") {
+    std::vector<std::string> hashes, datas;
+    auto msgs = test_messages(hashes, datas, 300, 1000);
+    constexpr int ROUNDS = 200;
+
+    for (bool bt : {false, true}) {
+        std::chrono::steady_clock::duration dom{0}, direct{0};
+        size_t bytes = 0;
+        for (int i = 0; i < ROUNDS; i++) {
+            auto start = std::chrono::steady_clock::now();
+            bytes += json_retrieve_response(msgs, bt, false, 0).size();
+            auto mid = std::chrono::steady_clock::now();
+            bytes -= encoded_retrieve_response(msgs, bt, false, 0).size();
+            dom += mid - start;
+            direct += std::chrono::steady_clock::now() - mid;
+        }
+        CHECK(bytes == 0);
+        WARN(fmt::format(
+                "{} retrieve of {} messages: json DOM {}us, direct {}us",
+                bt ? "bt" : "json",
+                msgs.size(),
+                std::chrono::duration_cast<std::chrono::microseconds>(dom).count() / ROUNDS,
+                std::chrono::duration_cast<std::chrono::microseconds>(direct).count() / ROUNDS));
+    }
+}
+
+TEST_CASE("cached responses - match json responses", "[serialization][cached]") {
+    using oxenss::rpc::swarm_to_json;
+    using nlohmann::json;
+    const std::pair<int, int> hf{19, 3};
+    const int64_t t = 1700000000123;
+
+    auto expected = [&](json j, bool bt) {
+        j["t"] = t;
+        j["hf"] = hf;
+        return bt ? oxenc::bt_serialize(oxenss::json_to_bt(std::move(j))) : j.dump();
+    };
+
+    std::vector<SwarmInfo> swarms;
+    for (swarm_id_t id : {100, 200, 300}) {
+        auto& s = swarms.emplace_back();
+        s.swarm_id = id;
+        for (int i = 0; i < 3; i++) {
+            auto& sn = s.snodes.emplace_back();
+            sn.ip = fmt::format("10.0.{}.{}", id / 100, i);
+            sn.port = 22021;
+            sn.omq_quic_port = 22020 + i;
+            auto hex = fmt::format("{:04x}{:060x}", id, i);
+            sn.pubkey_legacy = oxenss::crypto::legacy_pubkey::from_hex(hex);
+            sn.pubkey_ed25519 = oxenss::crypto::ed25519_pubkey::from_hex(hex);
+            sn.pubkey_x25519 = oxenss::crypto::x25519_pubkey::from_hex(hex);
+        }
+    }
+    auto swarm = std::make_shared<Swarm>(sn_record{});
+    swarm->apply_swarm_changes(std::vector<SwarmInfo>{swarms});
+
+    oxenss::user_pubkey pk;
+    REQUIRE(pk.load("0500000000000000000000000000000000000000000000000000000000000000c8"s));
+
+    oxenss::rpc::CachedResponses cache;
+    for (bool bt : {false, true}) {
+        // No swarms yet:
+        CHECK(cache.get_swarm(pk, bt, hf, t) == expected(swarm_to_json(nullptr), bt));
+        CHECK(cache.info(bt, hf, t) ==
+              expected(json{{"version", oxenss::STORAGE_SERVER_VERSION}, {"timestamp", t}}, bt));
+    }
+
+    cache.update_swarms(swarm);
+    for (bool bt : {false, true})
+        CHECK(cache.get_swarm(pk, bt, hf, t) == expected(swarm_to_json(&swarms[1]), bt));
+
+    cache.update_swarms(nullptr);
+    CHECK(cache.get_swarm(pk, false, hf, t) == expected(swarm_to_json(nullptr), false));
+}
@@ -3,10 +3,15 @@
 
 #include <oxenss/crypto/keys.h>
 #include <oxenss/rpc/request_handler.h>
+#include <oxenss/snode/service_node.h>
 #include <oxenss/snode/swarm.h>
 #include <oxenss/utils/time.hpp>
 
 #include <oxenc/base64.h>
+#include <fmt/format.h>
+#include <sodium/crypto_generichash.h>
+
+#include <chrono>
 
 using namespace std::literals;
 using namespace oxenss::crypto;
@@ -81,4 +86,112 @@ TEST_CASE("service nodes - message hashing", "[service-nodes][messages]") {
     auto expected = "4sMyAuaZlMwww3oFvfhazfw7ASx/7TDtO+TVc8aAjHs";
     CHECK(oxenss::rpc::computeMessageHash(pk, oxenss::namespace_id::Default, data) == expected);
     CHECK(oxenss::rpc::compute_hash_blake2b_b64({pk.prefixed_raw() + data}) == expected);
+
+    std::array<char, oxenss::rpc::MESSAGE_HASH_B64_SIZE + 1> b64;
+    CHECK(oxenss::rpc::message_hash_b64(
+                  oxenss::rpc::compute_message_hash(pk, oxenss::namespace_id::Default, data),
+                  b64) == expected);
+
+    // Non-default namespaces get hashed (as a decimal string) between the pubkey and data:
+    const auto ns = static_cast<oxenss::namespace_id>(-42);
+    CHECK(oxenss::rpc::computeMessageHash(pk, ns, data) ==
+          oxenss::rpc::compute_hash_blake2b_b64({pk.prefixed_raw() + "-42" + data}));
+}
+
+namespace {
+
+// The message hash computation as it used to be done, for comparison in the benchmark below.
+std::string legacy_message_hash(
+        const oxenss::user_pubkey& pubkey, oxenss::namespace_id ns, std::string_view data) {
+    char netid = static_cast<char>(pubkey.type());
+    std::string ns_str = ns != oxenss::namespace_id::Default ? std::to_string(to_int(ns)) : "";
+    std::vector<std::string_view> parts{std::string_view{&netid, 1}, pubkey.raw(), ns_str, data};
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, 32);
+    for (const auto& s : parts)
+        crypto_generichash_update(
+                &state, reinterpret_cast<const unsigned char*>(s.data()), s.size());
+    std::array<unsigned char, 32> hash;
+    crypto_generichash_final(&state, hash.data(), hash.size());
+    std::string b64hash = oxenc::to_base64(hash.begin(), hash.end());
+    while (!b64hash.empty() && b64hash.back() == '=')
+        b64hash.pop_back();
+    return b64hash;
+}
+
+}  // namespace
+
+// Not run by default; run with `Test "[benchmark]"` to compare the message hash computations.
+TEST_CASE("service nodes - message hashing benchmark", "[.][benchmark][messages]") {
+    oxenss::user_pubkey pk;
+    REQUIRE(pk.load("05ffba630924aa1224bb930dde21c0d11bf004608f2812217f8ac812d6c7e3ad48"));
+    const auto ns = static_cast<oxenss::namespace_id>(3);
+    constexpr int ROUNDS = 200'000;
+
+    for (size_t size : {100, 1000}) {
+        const std::string data(size, 'x');
+        REQUIRE(legacy_message_hash(pk, ns, data) ==
+                oxenss::rpc::computeMessageHash(pk, ns, data));
+
+        unsigned char sink = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < ROUNDS; i++)
+            sink ^= legacy_message_hash(pk, ns, data)[0];
+        auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < ROUNDS; i++)
+            sink ^= oxenss::rpc::computeMessageHash(pk, ns, data)[0];
+        auto t2 = std::chrono::steady_clock::now();
+        for (int i = 0; i < ROUNDS; i++)
+            sink ^= oxenss::rpc::compute_message_hash(pk, ns, data)[0];
+        auto t3 = std::chrono::steady_clock::now();
+        auto per_round = [](auto d) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / ROUNDS;
+        };
+        WARN(fmt::format(
+                "{}-byte message hash: legacy {}ns, b64 {}ns, raw {}ns (sink {})",
+                size,
+                per_round(t1 - t0),
+                per_round(t2 - t1),
+                per_round(t3 - t2),
+                sink));
+    }
+}
+
+TEST_CASE("service nodes - change events", "[service-nodes][monitor]") {
+    using oxenss::message_change;
+    using oxenss::namespace_id;
+    oxenss::user_pubkey pk;
+    REQUIRE(pk.load("05ffba630924aa1224bb930dde21c0d11bf004608f2812217f8ac812d6c7e3ad48"));
+    const std::chrono::system_clock::time_point expiry{1616650862026ms};
+
+    // Split into one change per namespace, in namespace order, with sorted hashes:
+    auto changes = oxenss::snode::split_changes(
+            message_change::type::expiry,
+            pk,
+            {{namespace_id{3}, "c"},
+             {namespace_id::Default, "z"},
+             {namespace_id{-5}, "b"},
+             {namespace_id{3}, "a"},
+             {namespace_id::Default, "y"}},
+            expiry);
+    REQUIRE(changes.size() == 3);
+    CHECK(changes[0].msg_namespace == namespace_id{-5});
+    CHECK(changes[0].hashes == std::vector<std::string>{"b"});
+    CHECK(changes[1].msg_namespace == namespace_id::Default);
+    CHECK(changes[1].hashes == std::vector<std::string>{"y", "z"});
+    CHECK(changes[2].msg_namespace == namespace_id{3});
+    CHECK(changes[2].hashes == std::vector<std::string>{"a", "c"});
+    for (auto& c : changes) {
+        CHECK(c.what == message_change::type::expiry);
+        CHECK(c.pubkey == pk);
+        CHECK(c.expiry == expiry);
+    }
+    CHECK(oxenss::snode::split_changes(message_change::type::deleted, pk, {}).empty());
+
+    // Events are dicts with keys !, @, h, n, and (for expiry updates only) z:
+    CHECK(oxenss::snode::encode_change_event(changes[1]) ==
+          "d1:!6:expire1:@33:" + pk.prefixed_raw() + "1:hl1:y1:ze1:ni0e1:zi1616650862026ee");
+    CHECK(oxenss::snode::encode_change_event(
+                  {message_change::type::deleted, pk, namespace_id{-5}, {"b", "d"}}) ==
+          "d1:!6:delete1:@33:" + pk.prefixed_raw() + "1:hl1:b1:de1:ni-5ee");
 }
@@ -0,0 +1,71 @@
+#include <oxenss/snode/stats.h>
+
+#include <catch2/catch.hpp>
+#include <oxenmq/oxenmq.h>
+
+using namespace oxenss;
+using namespace oxenss::snode;
+using namespace std::literals;
+
+TEST_CASE("peer stats - storage test ring buffer", "[stats]") {
+    peer_stats stats;
+    auto now = std::chrono::system_clock::now();
+
+    for (size_t i = 0; i < STORAGE_TEST_HISTORY + 5; i++)
+        stats.add_storage_test({now + i * 1s, i < 10 ? ResultType::MISMATCH : ResultType::OK});
+
+    // Only the most recent STORAGE_TEST_HISTORY are kept, and the counts only include those:
+    CHECK(stats.num_tests == STORAGE_TEST_HISTORY);
+    CHECK(stats.test_counts[static_cast<size_t>(ResultType::MISMATCH)] == 5);
+    CHECK(stats.test_counts[static_cast<size_t>(ResultType::OK)] == STORAGE_TEST_HISTORY - 5);
+
+    std::vector<std::chrono::system_clock::time_point> times;
+    stats.for_each_storage_test([&](const test_result& r) { times.push_back(r.timestamp); });
+    REQUIRE(times.size() == STORAGE_TEST_HISTORY);
+    CHECK(times.front() == now + 5s);
+    CHECK(times.back() == now + (STORAGE_TEST_HISTORY + 4) * 1s);
+    CHECK(std::is_sorted(times.begin(), times.end()));
+
+    stats.expire_storage_tests(now + 11s);
+    CHECK(stats.num_tests == STORAGE_TEST_HISTORY - 7);
+    CHECK(stats.test_counts[static_cast<size_t>(ResultType::MISMATCH)] == 0);
+    CHECK(stats.test_counts[static_cast<size_t>(ResultType::OK)] == STORAGE_TEST_HISTORY - 7);
+
+    stats.expire_storage_tests(now + 1h);
+    CHECK(stats.num_tests == 0);
+    CHECK(stats.test_counts[static_cast<size_t>(ResultType::OK)] == 0);
+    stats.add_storage_test({now, ResultType::REJECTED});
+    CHECK(stats.num_tests == 1);
+    CHECK(stats.test_counts[static_cast<size_t>(ResultType::REJECTED)] == 1);
+}
+
+TEST_CASE("peer stats - published snapshots", "[stats]") {
+    oxenmq::OxenMQ omq;
+    all_stats stats{omq};
+
+    auto pk1 = crypto::legacy_pubkey::from_hex(
+            "0000000000000000000000000000000000000000000000000000000000000001");
+    auto pk2 = crypto::legacy_pubkey::from_hex(
+            "0000000000000000000000000000000000000000000000000000000000000002");
+
+    auto empty = stats.peer_report();
+    REQUIRE(empty);
+    CHECK(empty->empty());
+
+    stats.record_storage_test_result(pk1, ResultType::OK);
+    stats.record_request_failed(pk2);
+    auto report = stats.peer_report();
+    CHECK(empty->empty());  // Old snapshots don't change
+    REQUIRE(report->size() == 2);
+    CHECK(report->at(pk1).num_tests == 1);
+    CHECK(report->at(pk2).requests_failed == 1);
+
+    // Nothing changed, so we get the same snapshot back
+    CHECK(stats.peer_report() == report);
+
+    stats.record_push_failed(pk2);
+    auto report2 = stats.peer_report();
+    CHECK(report2 != report);
+    CHECK(report->at(pk2).pushes_failed == 0);
+    CHECK(report2->at(pk2).pushes_failed == 1);
+}
@@ -1,7 +1,13 @@
 #include <oxenss/storage/database.hpp>
+#include <oxenss/storage/executor.hpp>
 
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/time.hpp>
 
+#include <oxenc/base64.h>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <iostream>
@@ -10,6 +16,7 @@
 #include <future>
 
 #include <catch2/catch.hpp>
+#include <fmt/format.h>
 
 using namespace oxenss;
 
@@ -248,6 +255,886 @@ TEST_CASE("storage - remove expired entries", "[storage]") {
     CHECK(storage.get_message_count() == 2);
 }
 
+TEST_CASE("storage - random message", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    Database storage{"."};
+    CHECK_FALSE(storage.retrieve_random());
+
+    auto now = std::chrono::system_clock::now();
+    // Interleave expired and live messages, and then punch some holes into the ids:
+    std::vector<std::string> deleted;
+    for (int i = 0; i < 20; i++) {
+        auto hash = "hash" + std::to_string(i);
+        bool expired = i % 3 == 0;
+        CHECK(storage.store(
+                      {pubkey,
+                       hash,
+                       namespace_id::Default,
+                       now,
+                       expired ? now - 1s : now + 1h,
+                       "data"}) == StoreResult::New);
+        if (i % 5 == 1)
+            deleted.push_back(std::move(hash));
+    }
+    CHECK(storage.delete_by_hash(pubkey, deleted).size() == deleted.size());
+
+    for (int i = 0; i < 100; i++) {
+        auto msg = storage.retrieve_random();
+        REQUIRE(msg);
+        CHECK(msg->expiry > now);
+        CHECK(std::find(deleted.begin(), deleted.end(), msg->hash) == deleted.end());
+    }
+    // Sampling doesn't clean up expired messages:
+    CHECK(storage.get_message_count() == 16);
+}
+
+TEST_CASE("storage - multi-hash queries", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey, other;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(other.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    database_options opts;
+    opts.set_hash_queries = GENERATE(true, false);
+    Database storage{".", opts};
+
+    auto now = std::chrono::system_clock::now();
+    now = std::chrono::time_point_cast<std::chrono::milliseconds>(now);
+    // hash3 is in another namespace, since updates and deletions by hash apply to all of them:
+    for (int i = 0; i < 10; i++)
+        CHECK(storage.store(
+                      {pubkey,
+                       "hash" + std::to_string(i),
+                       i == 3 ? namespace_id{5} : namespace_id::Default,
+                       now,
+                       now + 1h,
+                       "data"}) == StoreResult::New);
+    CHECK(storage.store({other, "hash0x", namespace_id::Default, now, now + 1h, "data"}) ==
+          StoreResult::New);
+
+    // Includes hashes that don't exist, belong to someone else, or need escaping in JSON:
+    std::vector<std::string> hashes{"hash1", "hash2", "hash3", "nope", "hash0x", "a\"b\\c"};
+
+    auto expiries = storage.get_expiries(pubkey, hashes);
+    CHECK(expiries.size() == 3);
+    CHECK(expiries["hash2"] == to_epoch_ms(now + 1h));
+
+    auto updated = storage.update_expiry(pubkey, hashes, {now + 30min}, false, true);
+    REQUIRE(updated.size() == 3);
+    std::sort(updated.begin(), updated.end(), [](const auto& a, const auto& b) {
+        return a.hash < b.hash;
+    });
+    CHECK(updated[0].hash == "hash1");
+    CHECK(updated[0].ns == namespace_id::Default);
+    CHECK(updated[2].hash == "hash3");
+    CHECK(updated[2].ns == namespace_id{5});
+    CHECK(updated[2].expiry == now + 30min);
+    // With extend_only nothing changes because everything's already later:
+    CHECK(storage.update_expiry(pubkey, hashes, {now + 10min}, true, false).empty());
+    CHECK(storage.get_expiries(pubkey, hashes)["hash3"] == to_epoch_ms(now + 30min));
+    // As with one expiry per hash, or a single hash:
+    updated = storage.update_expiry(pubkey, {"hash2", "hash3"}, {now + 20min, now + 25min});
+    REQUIRE(updated.size() == 2);
+    CHECK(updated[1].hash == "hash3");
+    CHECK(updated[1].expiry == now + 25min);
+    CHECK(updated[1].ns == namespace_id{5});
+    updated = storage.update_expiry(pubkey, {"hash3"}, {now + 15min});
+    REQUIRE(updated.size() == 1);
+    CHECK(updated[0].ns == namespace_id{5});
+
+    auto deleted = storage.delete_by_hash(pubkey, hashes);
+    std::sort(deleted.begin(), deleted.end());
+    CHECK(deleted == std::vector<std::pair<namespace_id, std::string>>{
+                             {namespace_id::Default, "hash1"},
+                             {namespace_id::Default, "hash2"},
+                             {namespace_id{5}, "hash3"}});
+    CHECK(storage.delete_by_hash(pubkey, {"hash4"}) ==
+          std::vector<std::pair<namespace_id, std::string>>{{namespace_id::Default, "hash4"}});
+    CHECK(storage.get_message_count() == 7);
+    CHECK(storage.retrieve_by_hash("hash0x"));
+}
+
+TEST_CASE("storage - binary message hashes", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    database_options opts;
+    opts.set_hash_queries = GENERATE(true, false);
+    Database storage{".", opts};
+
+    // Real hashes get stored as 32-byte blobs; anything else is stored as-is.  The last two here
+    // decode to the same bytes as the first hash, but aren't its canonical encoding, so must not
+    // be treated as the same hash:
+    std::vector<std::string> hashes;
+    for (char c : {'\0', '\x01', '\xff'}) {
+        auto& h = hashes.emplace_back(oxenc::to_base64(std::string(32, c)));
+        h.pop_back();  // Remove the = padding
+    }
+    std::string zeros = hashes[0];
+    hashes.push_back(zeros.substr(0, 42) + "B");
+    hashes.push_back(hashes[2]);
+    std::replace(hashes.back().begin(), hashes.back().end(), '/', '_');
+    REQUIRE(hashes.back() != hashes[2]);
+    hashes.push_back("not-a-real-hash");
+
+    auto now = std::chrono::system_clock::now();
+    now = std::chrono::time_point_cast<std::chrono::milliseconds>(now);
+    for (auto& h : hashes)
+        CHECK(storage.store({pubkey, h, namespace_id::Default, now, now + 1h, "data"}) ==
+              StoreResult::New);
+    CHECK(storage.store({pubkey, hashes[0], namespace_id::Default, now, now + 1h, "data"}) ==
+          StoreResult::Exists);
+
+    auto msgs = storage.retrieve(pubkey, namespace_id::Default, "").first;
+    REQUIRE(msgs.size() == hashes.size());
+    for (size_t i = 0; i < hashes.size(); i++)
+        CHECK(msgs[i].hash == hashes[i]);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, hashes[3]).first.size() == 2);
+
+    for (auto& h : hashes) {
+        auto msg = storage.retrieve_by_hash(h);
+        REQUIRE(msg);
+        CHECK(msg->hash == h);
+    }
+
+    auto expiries = storage.get_expiries(pubkey, hashes);
+    CHECK(expiries.size() == hashes.size());
+    CHECK(expiries.count(hashes[4]));
+    CHECK(storage.update_expiry(pubkey, {hashes[1]}, {now + 30min}).size() == 1);
+    CHECK(storage.get_expiries(pubkey, {hashes[1]})[hashes[1]] == to_epoch_ms(now + 30min));
+
+    auto deleted = storage.delete_by_hash(pubkey, {hashes[0], hashes[3]});
+    std::sort(deleted.begin(), deleted.end());
+    std::vector<std::pair<namespace_id, std::string>> expected{
+            {namespace_id::Default, hashes[0]}, {namespace_id::Default, hashes[3]}};
+    std::sort(expected.begin(), expected.end());
+    CHECK(deleted == expected);
+    CHECK(storage.get_message_count() == hashes.size() - 2);
+}
+
+TEST_CASE("storage - maintained counters", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    using ns_counts = std::vector<std::pair<namespace_id, int64_t>>;
+    {
+        Database storage{"."};
+        CHECK(storage.get_message_count() == 0);
+        CHECK(storage.get_owner_count() == 0);
+        CHECK(storage.get_namespace_counts().empty());
+
+        for (int i = 0; i < 5; i++)
+            storage.store(
+                    {pubkey1,
+                     "a" + std::to_string(i),
+                     static_cast<namespace_id>(i % 2),
+                     now,
+                     now + 1h,
+                     "x"});
+        storage.store({pubkey2, "b0", namespace_id::Default, now, now - 1s, "x"});
+        // Duplicates shouldn't count:
+        storage.store({pubkey1, "a0", namespace_id::Default, now, now + 2h, "x"});
+        // Only b1 is new:
+        CHECK(storage.bulk_store({{pubkey1, "a1", namespace_id{1}, now, now + 1h, "x"},
+                                  {pubkey2, "b1", namespace_id{1}, now, now + 1h, "x"}}) == 1);
+
+        CHECK(storage.get_message_count() == 7);
+        CHECK(storage.get_owner_count() == 2);
+        CHECK(storage.get_namespace_counts() == ns_counts{{namespace_id{0}, 4}, {namespace_id{1}, 3}});
+
+        storage.clean_expired();
+        CHECK(storage.delete_all(pubkey2).size() == 1);
+        CHECK(storage.delete_by_hash(pubkey1, {"a1", "a2"}).size() == 2);
+
+        CHECK(storage.get_message_count() == 3);
+        CHECK(storage.get_owner_count() == 1);
+        CHECK(storage.get_namespace_counts() == ns_counts{{namespace_id{0}, 2}, {namespace_id{1}, 1}});
+    }
+    {
+        Database storage{"."};
+        CHECK(storage.get_message_count() == 3);
+        CHECK(storage.get_owner_count() == 1);
+    }
+}
+
+TEST_CASE("storage - bulk store of message refs", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    // One canonical base64 hash (stored as a blob) and ones that get stored as-is:
+    const std::string hash1 = "AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8";
+    const std::string hash2 = "not-base64";
+    const std::string hash3 = "also-not-base64";
+    const std::string data = "data\0data"s;
+
+    Database storage{"."};
+    storage.store({pubkey1, hash2, namespace_id::Default, now, now + 1h, data});
+
+    std::vector<message_ref> refs{
+            {&pubkey1, {hash1, namespace_id::Default, now, now + 1h, data}},
+            {&pubkey1, {hash2, namespace_id::Default, now, now + 1h, data}},
+            {&pubkey2, {hash3, namespace_id::Default, now, now + 2h, data}}};
+    CHECK(storage.bulk_store(refs) == 2);
+    CHECK(storage.bulk_store(refs) == 0);
+    CHECK(storage.get_owner_count() == 2);
+
+    auto [items, more] = storage.retrieve(pubkey1, namespace_id::Default, "");
+    REQUIRE(items.size() == 2);
+    CHECK(items[0].hash == hash2);
+    CHECK(items[1].hash == hash1);
+    CHECK(items[1].data == data);
+
+    auto [items2, more2] = storage.retrieve(pubkey2, namespace_id::Default, "");
+    REQUIRE(items2.size() == 1);
+    CHECK(items2[0].hash == hash3);
+    CHECK(items2[0].data == data);
+    CHECK(items2[0].expiry == std::chrono::time_point_cast<std::chrono::milliseconds>(now + 2h));
+}
+
+TEST_CASE("storage - incremental expiry cleanup", "[storage][expiry]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    Database storage{"."};
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 25; i++)
+        CHECK(storage.store(
+                      {pubkey1,
+                       "expired" + std::to_string(i),
+                       namespace_id::Default,
+                       now - 1min,
+                       now - 1s,
+                       "bytesasstring"}) == StoreResult::New);
+    CHECK(storage.store({pubkey2, "live", namespace_id::Default, now, now + 1min, "data"}) ==
+          StoreResult::New);
+    CHECK(storage.get_message_count() == 26);
+
+    // Row budget of 20 in chunks of 7: should stop after 20, leaving 5 behind
+    CHECK(storage.clean_expired_incremental(7, 20, 10s) == 20);
+    auto stats = storage.get_cleanup_stats();
+    CHECK(stats.backlog == 5);
+    CHECK(stats.deleted == 20);
+    CHECK(stats.chunks == 3);
+    CHECK(stats.max_chunk_us >= stats.last_chunk_us);
+    CHECK(storage.get_message_count() == 6);
+    CHECK(storage.get_owner_count() == 2);
+
+    CHECK(storage.clean_expired_incremental(7, 20, 10s) == 5);
+    stats = storage.get_cleanup_stats();
+    CHECK(stats.backlog == 0);
+    CHECK(stats.deleted == 25);
+    CHECK(stats.chunks == 4);
+    CHECK(storage.get_message_count() == 1);
+    // The owner_autoclean trigger must still fire for chunked deletions:
+    CHECK(storage.get_owner_count() == 1);
+
+    CHECK(storage.clean_expired_incremental() == 0);
+    CHECK(storage.retrieve_by_hash("live"));
+}
+
+TEST_CASE("storage - expiry partitions", "[storage][expiry]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    {
+        // Start out unpartitioned, so that opening with partitions has to convert:
+        Database storage{"."};
+        CHECK(storage.expiry_partition_count() == 0);
+        CHECK(storage.store({pubkey1, "old", namespace_id::Default, now, now + 1min, "data"}) ==
+              StoreResult::New);
+    }
+
+    database_options opts;
+    // 200ms windows would need far more than the maximum number of tables to cover the horizon:
+    opts.expiry_partition = 200ms;
+    {
+        Database storage{".", opts};
+        CHECK(storage.expiry_partition_count() == Database::MAX_EXPIRY_PARTITIONS);
+        CHECK(storage.get_message_count() == 1);
+        CHECK(storage.retrieve_by_hash("old"));
+
+        // The ring covers the next 12.6s; expiries further out than that go into the overflow
+        // table:
+        CHECK(storage.store({pubkey1, "soon", namespace_id::Default, now, now + 300ms, "a"}) ==
+              StoreResult::New);
+        CHECK(storage.store({pubkey1, "mid", namespace_id::Default, now, now + 5s, "b"}) ==
+              StoreResult::New);
+        CHECK(storage.store({pubkey2, "later", namespace_id::Default, now, now + 1min, "c"}) ==
+              StoreResult::New);
+        CHECK(storage.store({pubkey2, "brief", namespace_id::Default, now, now + 400ms, "c"}) ==
+              StoreResult::New);
+        CHECK(storage.get_message_count() == 5);
+        CHECK(storage.get_owner_count() == 2);
+
+        // Hashes have to be unique across all of the tables, including for bulk stores:
+        CHECK(storage.store({pubkey2, "mid", namespace_id::Default, now, now + 1min, "b"}) ==
+              StoreResult::Extended);
+        CHECK(storage.bulk_store(std::vector<message>{
+                      {pubkey1, "later", namespace_id::Default, now, now + 5s, "c"},
+                      {pubkey1, "new", namespace_id::Default, now, now + 5s, "d"}}) == 1);
+        CHECK(storage.get_message_count() == 6);
+
+        // Expiry updates move messages out of ring tables that no longer match:
+        auto updated = storage.update_expiry(pubkey1, {"soon"}, {now + 4s});
+        REQUIRE(updated.size() == 1);
+        updated = storage.update_expiry(pubkey2, {"later"}, {now + 600ms});
+        REQUIRE(updated.size() == 1);
+        auto later = storage.retrieve_by_hash("later");
+        REQUIRE(later);
+        CHECK(later->expiry == std::chrono::time_point_cast<std::chrono::milliseconds>(
+                                       now + 600ms));
+
+        std::this_thread::sleep_for(now + 1s - std::chrono::system_clock::now());
+
+        // Expired messages in the ring are hidden straight away, but only removed with their
+        // window; expired overflow messages stay until they are cleaned up, as without partitions:
+        CHECK_FALSE(storage.retrieve_by_hash("brief"));
+        CHECK(storage.retrieve_by_hash("later"));
+        CHECK(storage.retrieve_all().size() == 5);
+        CHECK(storage.get_owner_count() == 2);
+        // Deleting a hidden message removes it, but (as with a retrieve) doesn't report it:
+        CHECK(storage.delete_by_hash(pubkey2, {"brief"}).empty());
+        CHECK(storage.get_owner_count() == 2);
+        storage.clean_expired();
+        CHECK(storage.get_message_count() == 4);
+        CHECK(storage.get_owner_count() == 1);
+
+        auto [msgs, more] = storage.retrieve(pubkey1, namespace_id::Default, "");
+        CHECK(msgs.size() == 4);
+        CHECK(storage.delete_by_hash(pubkey1, {"mid", "new"}).size() == 2);
+        CHECK(storage.get_message_count() == 2);
+        CHECK(storage.retrieve_by_hash("soon"));
+        CHECK(storage.retrieve_random());
+    }
+
+    // Turning partitions off again puts everything back into one table:
+    {
+        Database storage{"."};
+        CHECK(storage.expiry_partition_count() == 0);
+        CHECK(storage.get_message_count() == 2);
+        CHECK(storage.retrieve_by_hash("soon"));
+        CHECK(storage.retrieve_by_hash("old"));
+        CHECK(storage.store({pubkey2, "unpart", namespace_id::Default, now, now + 10s, "e"}) ==
+              StoreResult::New);
+    }
+    {
+        Database storage{".", opts};
+        CHECK(storage.get_message_count() == 3);
+        CHECK(storage.get_owner_count() == 2);
+        CHECK(storage.delete_all(pubkey1).size() == 2);
+        CHECK(storage.get_owner_count() == 1);
+    }
+}
+
+TEST_CASE("storage - background maintenance", "[storage][maintenance]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    Database storage{"."};
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 1000; i++)
+        msgs.push_back(
+                {pubkey,
+                 "hash" + std::to_string(i),
+                 namespace_id::Default,
+                 now,
+                 now - 1ms,
+                 std::string(2000, 'x')});
+    storage.bulk_store(msgs);
+
+    // We just wrote, so an unforced call should put it off:
+    CHECK_FALSE(storage.run_maintenance());
+
+    CHECK(storage.clean_expired_incremental() == 1000);
+    CHECK(storage.get_maintenance_stats().freelist_pages > 0);
+    CHECK(storage.get_maintenance_stats().wal_bytes > 0);
+
+    CHECK(storage.run_maintenance(/*force=*/true));
+    auto stats = storage.get_maintenance_stats();
+    CHECK(stats.checkpoints == 1);
+    CHECK(stats.vacuumed_pages > 0);
+    CHECK(stats.freelist_pages == 0);
+    CHECK(stats.wal_bytes == 0);
+}
+
+TEST_CASE("storage - eviction when full", "[storage][eviction]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    database_options opts;
+    opts.size_limit = 1024 * 1024;
+
+    auto now = std::chrono::system_clock::now();
+    auto msg = [&](const user_pubkey& pk, int i) {
+        return message{
+                pk,
+                "hash" + std::to_string(i),
+                namespace_id::Default,
+                now + 1ms * i,
+                now + 1h + 1s * i,
+                std::string(2000, 'x')};
+    };
+
+    SECTION("no eviction") {
+        Database storage{".", opts};
+        int full = 0;
+        for (int i = 0; i < 1000; i++)
+            if (storage.store(msg(pubkey1, i)) == StoreResult::Full)
+                full++;
+        CHECK(full > 0);
+        CHECK(storage.evict_excess() == 0);
+        CHECK(storage.get_evicted_count() == 0);
+        CHECK(storage.retrieve_by_hash("hash0"));
+    }
+
+    SECTION("soonest expiry") {
+        opts.eviction = eviction_policy::soonest_expiry;
+        Database storage{".", opts};
+        // Expires after everything else, so shouldn't get evicted:
+        CHECK(storage.store(
+                      {pubkey2, "other", namespace_id::Default, now, now + 2h, "data"}) ==
+              StoreResult::New);
+        for (int i = 0; i < 1000; i++)
+            REQUIRE(storage.store(msg(pubkey1, i)) == StoreResult::New);
+        CHECK(storage.get_evicted_count() > 0);
+        CHECK(storage.get_message_count() < 1001);
+        CHECK_FALSE(storage.retrieve_by_hash("hash0"));
+        CHECK(storage.retrieve_by_hash("hash999"));
+        CHECK(storage.retrieve_by_hash("other"));
+
+        storage.evict_excess();
+        CHECK(storage.get_used_bytes() < opts.size_limit / 100 * Database::EVICTION_HIGH_WATER);
+    }
+}
+
+TEST_CASE("storage - revoked subaccounts", "[storage][subaccount]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey, other;
+    REQUIRE(pubkey.load("030123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(other.load("030123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    for (auto& pk : {pubkey, other})
+        storage.store({pk, "hash" + pk.hex(), namespace_id::Default, now, now + 1h, "data"});
+
+    std::vector<subaccount_token> tokens(60);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        tokens[i].token[0] = 0x03;
+        tokens[i].token.back() = static_cast<uint8_t>(i);
+    }
+
+    CHECK_FALSE(storage.subaccount_revoked(pubkey, tokens[0]));
+    storage.revoke_subaccounts(pubkey, {tokens[0]});
+    CHECK(storage.subaccount_revoked(pubkey, tokens[0]));
+    CHECK_FALSE(storage.subaccount_revoked(other, tokens[0]));
+    CHECK_FALSE(storage.subaccount_revoked(pubkey, tokens[1]));
+
+    CHECK(storage.unrevoke_subaccounts(pubkey, {tokens[0], tokens[1]}) == 1);
+    CHECK_FALSE(storage.subaccount_revoked(pubkey, tokens[0]));
+
+    // Only the most recent MAX_SUBACCOUNT_TOKENS are kept:
+    for (size_t i = 0; i < tokens.size(); i++) {
+        storage.revoke_subaccounts(pubkey, {tokens[i]});
+        std::this_thread::sleep_for(2ms);  // Make sure the timestamps differ
+    }
+    const size_t dropped = tokens.size() - MAX_SUBACCOUNT_TOKENS;
+    for (size_t i = 0; i < tokens.size(); i++)
+        CHECK(storage.subaccount_revoked(pubkey, tokens[i]) == (i >= dropped));
+
+    storage.revoke_subaccounts(other, {tokens[0], tokens[1]});
+    CHECK(storage.subaccount_revoked(other, tokens[0]));
+    CHECK_FALSE(storage.subaccount_revoked(other, tokens[2]));
+    CHECK_FALSE(storage.subaccount_revoked(pubkey, tokens[0]));
+}
+
+TEST_CASE("storage - owner id cache", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    Database storage{"."};
+
+    auto now = std::chrono::system_clock::now();
+    CHECK(storage.store({pubkey1, "hash0", namespace_id::Default, now, now + 1min, "a"}) ==
+          StoreResult::New);
+    CHECK(storage.store({pubkey1, "hash1", namespace_id::Default, now, now + 1min, "b"}) ==
+          StoreResult::New);
+    CHECK(storage.store({pubkey2, "hash2", namespace_id::Default, now, now + 1min, "c"}) ==
+          StoreResult::New);
+
+    auto stats = storage.get_owner_cache_stats();
+    CHECK(stats.size == 1);  // pubkey1 got cached by the second store
+    CHECK(stats.hits == 0);
+    CHECK(stats.misses == 3);
+
+    // (Not retrieves: those are answered from the tail cache without looking up the owner)
+    CHECK(storage.get_expiries(pubkey1, {"hash0", "hash1"}).size() == 2);
+    CHECK(storage.get_expiries(pubkey2, {"hash2"}).size() == 1);
+    stats = storage.get_owner_cache_stats();
+    CHECK(stats.size == 2);
+    CHECK(stats.hits == 1);
+    CHECK(stats.misses == 4);
+
+    // Deleting the last message of an owner removes the owner (via the trigger), which must also
+    // evict it from the cache:
+    CHECK(storage.delete_all(pubkey1).size() == 2);
+    CHECK(storage.get_owner_count() == 1);
+    CHECK(storage.get_owner_cache_stats().size == 1);
+    CHECK(storage.retrieve(pubkey1, namespace_id::Default, "").first.empty());
+
+    // Same thing, but via expiry:
+    CHECK(storage.update_all_expiries(pubkey2, now - 1s).size() == 1);
+    storage.clean_expired();
+    CHECK(storage.get_owner_count() == 0);
+    CHECK(storage.get_owner_cache_stats().size == 0);
+
+    // The owners get recreated (quite possibly with reused ids), and everything still works:
+    CHECK(storage.store({pubkey2, "hash3", namespace_id::Default, now, now + 1min, "d"}) ==
+          StoreResult::New);
+    CHECK(storage.store({pubkey1, "hash4", namespace_id::Default, now, now + 1min, "e"}) ==
+          StoreResult::New);
+    auto [items1, more1] = storage.retrieve(pubkey1, namespace_id::Default, "");
+    REQUIRE(items1.size() == 1);
+    CHECK(items1[0].hash == "hash4");
+    auto [items2, more2] = storage.retrieve(pubkey2, namespace_id::Default, "");
+    REQUIRE(items2.size() == 1);
+    CHECK(items2[0].hash == "hash3");
+}
+
+TEST_CASE("storage - stored message hash filter", "[storage][hash-filter]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    {
+        Database storage{"."};
+        CHECK(storage.store({pubkey1, "hash0", namespace_id::Default, now, now + 1min, "a"}) ==
+              StoreResult::New);
+    }
+
+    {
+        // The filter gets loaded from the database on startup:
+        Database storage{"."};
+        auto stats = storage.get_hash_filter_stats();
+        CHECK(stats.size == 1);
+        CHECK(stats.bytes > 0);
+        CHECK(stats.rebuilds == 1);
+
+        // Re-storing messages we already have doesn't need to write anything:
+        auto locks = storage.get_write_lock_stats().acquisitions;
+        std::chrono::system_clock::time_point expiry;
+        CHECK(storage.store(
+                      {pubkey1, "hash0", namespace_id::Default, now, now + 30s, "a"}, &expiry) ==
+              StoreResult::Exists);
+        CHECK(expiry == std::chrono::time_point_cast<std::chrono::milliseconds>(now + 1min));
+        CHECK(storage.bulk_store(std::vector<message>{
+                      {pubkey1, "hash0", namespace_id::Default, now, now + 1min, "a"}}) == 0);
+        CHECK(storage.get_write_lock_stats().acquisitions == locks);
+        CHECK(storage.get_hash_filter_stats().skipped == 2);
+
+        // ... but extending one does:
+        CHECK(storage.store({pubkey1, "hash0", namespace_id::Default, now, now + 2min, "a"}) ==
+              StoreResult::Extended);
+        CHECK(storage.get_write_lock_stats().acquisitions == locks + 1);
+
+        // Bulk stores only write the new messages:
+        CHECK(storage.bulk_store(std::vector<message>{
+                      {pubkey1, "hash0", namespace_id::Default, now, now + 1min, "a"},
+                      {pubkey2, "hash1", namespace_id::Default, now, now + 1min, "b"},
+                      {pubkey2, "hash2", namespace_id::Default, now, now + 1min, "c"}}) == 2);
+        stats = storage.get_hash_filter_stats();
+        CHECK(stats.size == 3);
+        CHECK(stats.skipped == 3);
+
+        // Deleted messages leave the filter, so storing them again is a plain insert:
+        CHECK(storage.delete_by_hash(pubkey2, {"hash1"}).size() == 1);
+        CHECK(storage.get_hash_filter_stats().size == 2);
+        CHECK(storage.store({pubkey2, "hash1", namespace_id::Default, now, now + 1min, "b"}) ==
+              StoreResult::New);
+        CHECK(storage.get_hash_filter_stats().false_positives == 0);
+
+        // Expired messages stay in the filter (as false positives, if stored again) until enough of
+        // them pile up for maintenance to rebuild it:
+        CHECK(storage.update_all_expiries(pubkey2, now - 1s).size() == 2);
+        storage.clean_expired();
+        CHECK(storage.get_hash_filter_stats().size == 3);
+        CHECK(storage.run_maintenance(true));
+        stats = storage.get_hash_filter_stats();
+        CHECK(stats.size == 1);
+        CHECK(stats.rebuilds == 2);
+    }
+
+    // With the filter turned off, everything goes through the write path:
+    database_options opts;
+    opts.hash_filter = false;
+    Database unfiltered{".", opts};
+    auto locks = unfiltered.get_write_lock_stats().acquisitions;
+    CHECK(unfiltered.store({pubkey1, "hash0", namespace_id::Default, now, now + 1min, "a"}) ==
+          StoreResult::Exists);
+    CHECK(unfiltered.get_write_lock_stats().acquisitions == locks + 1);
+    auto stats = unfiltered.get_hash_filter_stats();
+    CHECK(stats.size == 0);
+    CHECK(stats.skipped == 0);
+    CHECK(stats.rebuilds == 0);
+}
+
+TEST_CASE("storage - group commit", "[storage][group-commit]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    database_options opts;
+    opts.group_commit = true;
+    Database storage{".", opts};
+
+    // Rounded to milliseconds so that we can compare with expiries loaded from the db:
+    auto now = std::chrono::time_point_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now());
+    constexpr int n_threads = 8, per_thread = 50;
+    std::vector<std::thread> threads;
+    // NB: Catch assertions aren't thread-safe, so we just count things in the threads
+    std::atomic<int> new_count = 0, exists_count = 0, bad_expiry = 0;
+    for (int t = 0; t < n_threads; t++)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < per_thread; i++) {
+                // Every thread also re-stores one common hash to make sure duplicates within a
+                // batch are handled properly:
+                auto hash = i == 0 ? "common"s : fmt::format("hash-{}-{}", t, i);
+                std::chrono::system_clock::time_point exp;
+                auto res = storage.store(
+                        {pubkey, hash, namespace_id::Default, now, now + 1min, "data"}, &exp);
+                if (res == StoreResult::New)
+                    new_count++;
+                else if (res == StoreResult::Exists)
+                    exists_count++;
+                if (exp != now + 1min)
+                    bad_expiry++;
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+
+    CHECK(new_count == n_threads * (per_thread - 1) + 1);
+    CHECK(exists_count == n_threads - 1);
+    CHECK(bad_expiry == 0);
+    CHECK(storage.get_message_count() == n_threads * (per_thread - 1) + 1);
+    CHECK(storage.get_owner_count() == 1);
+
+    auto stats = storage.get_group_commit_stats();
+    CHECK(stats.stores <= n_threads * per_thread);
+}
+
+TEST_CASE("storage - database executor", "[storage][executor]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    Database storage{"."};
+    DatabaseExecutor executor{storage, 2, 1};
+
+    auto now = std::chrono::system_clock::now();
+    auto stored = executor.write_future([&](Database& db) {
+        return db.store({pubkey, "hash", namespace_id::Default, now, now + 1min, "data"});
+    });
+    CHECK(stored.get() == StoreResult::New);
+
+    // A blocked writer job must not hold up reads:
+    std::promise<void> unblock;
+    auto blocked = unblock.get_future().share();
+    auto write_done = executor.write_future([blocked](Database&) { blocked.wait(); });
+    auto count = executor.read_future([&](Database& db) { return db.get_message_count(); });
+    REQUIRE(count.wait_for(5s) == std::future_status::ready);
+    CHECK(count.get() == 1);
+    CHECK(write_done.wait_for(0s) == std::future_status::timeout);
+    unblock.set_value();
+    write_done.get();
+
+    auto failed = executor.read_future(
+            [](Database&) -> int { throw std::runtime_error{"job failed"}; });
+    CHECK_THROWS_AS(failed.get(), std::runtime_error);
+
+    CHECK(executor.get_read_stats().jobs == 2);
+    CHECK(executor.get_write_stats().jobs == 2);
+    CHECK(executor.get_read_stats().queued == 0);
+
+    // After shutdown, jobs get run right away by the caller:
+    executor.shutdown();
+    bool ran = false;
+    auto caller = std::this_thread::get_id();
+    executor.read([&](Database&) { ran = std::this_thread::get_id() == caller; });
+    CHECK(ran);
+}
+
+TEST_CASE("storage - database executor owner fair queuing", "[storage][executor]") {
+    StorageDeleter fixture;
+
+    user_pubkey heavy, light;
+    REQUIRE(heavy.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(light.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    Database storage{"."};
+    DatabaseExecutor executor{storage, 1, 1, 4};
+
+    // Hold up the only reader while we queue a backlog for one owner and then a couple of jobs for
+    // another:
+    std::promise<void> unblock;
+    auto blocked = unblock.get_future().share();
+    auto started = std::make_shared<std::promise<void>>();
+    executor.read([blocked, started](Database&) {
+        started->set_value();
+        blocked.wait();
+    });
+    started->get_future().wait();
+
+    std::mutex order_mutex;
+    std::vector<std::string> order;
+    auto job = [&](std::string name) {
+        return [&, name = std::move(name)](Database&) {
+            std::lock_guard lock{order_mutex};
+            order.push_back(name);
+        };
+    };
+    for (int i = 0; i < 4; i++)
+        CHECK(executor.read(job("heavy" + std::to_string(i)), heavy.key()));
+    // The heavy owner is at its limit of waiting jobs:
+    CHECK_FALSE(executor.read(job("refused"), heavy.key()));
+    CHECK(executor.read(job("light0"), light.key()));
+    CHECK(executor.read(job("light1"), light.key()));
+    CHECK(executor.read(job("unowned")));
+
+    auto st = executor.get_read_stats();
+    CHECK(st.queued == 7);
+    CHECK(st.owners == 2);
+    CHECK(st.owner_max == 4);
+    CHECK(st.rejected == 1);
+
+    // (We can't wait with another job here: an unowned one would get to go ahead of the heavy
+    // owner's last jobs)
+    unblock.set_value();
+    auto done = [&] {
+        std::lock_guard lock{order_mutex};
+        return order.size() == 7 && executor.get_read_stats().owners == 0;
+    };
+    for (int i = 0; i < 500 && !done(); i++)
+        std::this_thread::sleep_for(10ms);
+
+    // The light owner's jobs (and the unowned one) get interleaved with the heavy owner's backlog
+    // rather than waiting for all of it:
+    REQUIRE(order.size() == 7);
+    auto pos = [&](std::string_view name) {
+        return std::find(order.begin(), order.end(), name) - order.begin();
+    };
+    CHECK(pos("light0") < pos("heavy1"));
+    CHECK(pos("light1") < pos("heavy2"));
+    CHECK(pos("unowned") < pos("heavy1"));
+    CHECK(pos("heavy0") < pos("heavy1"));
+    CHECK(pos("heavy1") < pos("heavy2"));
+    CHECK(pos("heavy2") < pos("heavy3"));
+    CHECK(std::find(order.begin(), order.end(), "refused") == order.end());
+
+    st = executor.get_read_stats();
+    CHECK(st.queued == 0);
+    CHECK(st.owners == 0);
+}
+
+TEST_CASE("storage - owner storage quota", "[storage][quota]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    auto data = std::string(60, 'x');
+
+    database_options opts;
+    opts.owner_quota = 100;
+    SECTION("unpartitioned") {}
+    SECTION("expiry partitions") { opts.expiry_partition = 10min; }
+
+    Database storage{".", opts};
+    CHECK(storage.store({pubkey1, "a", namespace_id::Default, now, now + 1min, data}) ==
+          StoreResult::New);
+    CHECK(storage.get_owner_bytes(pubkey1) == 60);
+    CHECK(storage.store({pubkey1, "b", namespace_id::Default, now, now + 1min, data}) ==
+          StoreResult::OverQuota);
+    // Messages we already have are fine, as are other owners:
+    CHECK(storage.store({pubkey1, "a", namespace_id::Default, now, now + 2min, data}) ==
+          StoreResult::Extended);
+    CHECK(storage.store({pubkey2, "c", namespace_id::Default, now, now + 1min, data}) ==
+          StoreResult::New);
+    CHECK(storage.get_quota_rejected_count() == 1);
+    CHECK(storage.get_owner_bytes(pubkey1) == 60);
+    CHECK(storage.get_owner_bytes(pubkey2) == 60);
+
+    // Replicated messages aren't subject to the quota (but do count towards it):
+    CHECK(storage.bulk_store(std::vector<message>{
+                  {pubkey2, "d", namespace_id::Default, now, now + 1min, data}}) == 1);
+    CHECK(storage.get_owner_bytes(pubkey2) == 120);
+
+    // Deletions free up the owner's quota again:
+    CHECK(storage.delete_by_hash(pubkey1, {"a"}).size() == 1);
+    CHECK(storage.get_owner_bytes(pubkey1) == 0);
+    CHECK(storage.store({pubkey1, "b", namespace_id::Default, now, now + 1min, data}) ==
+          StoreResult::New);
+    CHECK(storage.get_owner_bytes(pubkey1) == 60);
+
+    // A store to a public outbox namespace replaces what's there, so the replaced bytes don't
+    // count against it; but a store that gets rejected must leave the outbox alone.
+    const auto outbox = namespace_id{-1};
+    CHECK(storage.delete_by_hash(pubkey1, {"b"}).size() == 1);
+    CHECK(storage.store({pubkey1, "o1", outbox, now, now + 1min, data}) == StoreResult::New);
+    CHECK(storage.store({pubkey1, "o2", outbox, now, now + 1min, data}) == StoreResult::New);
+    CHECK(storage.get_owner_bytes(pubkey1) == 60);
+    CHECK(storage.store({pubkey1, "o3", outbox, now, now + 1min, std::string(101, 'x')}) ==
+          StoreResult::OverQuota);
+    CHECK(storage.get_quota_rejected_count() == 2);
+    CHECK(storage.get_owner_bytes(pubkey1) == 60);
+    auto [outbox_msgs, more] = storage.retrieve(pubkey1, outbox, "");
+    REQUIRE(outbox_msgs.size() == 1);
+    CHECK(outbox_msgs[0].hash == "o2");
+}
+
 TEST_CASE("storage - bulk data storage", "[storage]") {
     StorageDeleter fixture;
 
@@ -335,6 +1222,375 @@ TEST_CASE("storage - bulk storage with overlap", "[storage]") {
     }
 }
 
+TEST_CASE("storage - chunked iteration", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    Database storage{"."};
+
+    auto now = std::chrono::system_clock::now();
+    const size_t num_items = 23;
+    for (size_t i = 0; i < num_items; i++)
+        CHECK(storage.store(
+                      {i % 2 ? pubkey1 : pubkey2,
+                       "hash" + std::to_string(i),
+                       namespace_id::Default,
+                       now,
+                       now + 1min,
+                       "0123456789"}) == StoreResult::New);
+
+    std::vector<size_t> chunk_sizes;
+    std::vector<message> seen;
+    auto visitor = [&](std::vector<message>& chunk) {
+        chunk_sizes.push_back(chunk.size());
+        for (auto& m : chunk)
+            seen.push_back(std::move(m));
+        return true;
+    };
+
+    CHECK(storage.for_each_message(visitor, 5) == num_items);
+    CHECK(chunk_sizes == std::vector<size_t>{5, 5, 5, 5, 3});
+    REQUIRE(seen.size() == num_items);
+    for (size_t i = 0; i < num_items; i++) {
+        CHECK(seen[i].hash == "hash" + std::to_string(i));
+        CHECK(seen[i].pubkey == (i % 2 ? pubkey1 : pubkey2));
+        CHECK(seen[i].data == "0123456789");
+    }
+
+    // Byte limit: each message is 15 bytes of hash + data (or 16 for the two-digit ones), so a
+    // limit of 40 bytes gives us chunks of 3 messages.
+    chunk_sizes.clear();
+    seen.clear();
+    CHECK(storage.for_each_message(visitor, 100, 40) == num_items);
+    CHECK(chunk_sizes.front() == 3);
+    CHECK(seen.size() == num_items);
+
+    // Stopping early:
+    size_t calls = 0;
+    CHECK(storage.for_each_message(
+                  [&](std::vector<message>&) {
+                      calls++;
+                      return false;
+                  },
+                  10) == 10);
+    CHECK(calls == 1);
+}
+
+TEST_CASE("storage - swarm space ranges", "[storage]") {
+    StorageDeleter fixture;
+
+    // Pubkeys with all-0 except for the last 8 bytes map to swarm space equal to those 8 bytes:
+    auto pk_for = [](std::string_view last8) {
+        user_pubkey pk;
+        REQUIRE(pk.load("05" + std::string(48, '0') + std::string{last8}));
+        return pk;
+    };
+    auto pk_5 = pk_for("0000000000000005");
+    auto pk_100 = pk_for("0000000000000064");
+    auto pk_mid = pk_for("8000000000000000");
+    auto pk_max = pk_for("ffffffffffffffff");
+    REQUIRE(pubkey_to_swarm_space(pk_max) == (uint64_t)-1);
+
+    Database storage{"."};
+
+    auto now = std::chrono::system_clock::now();
+    for (auto& [pk, hash] : std::vector<std::pair<user_pubkey, std::string>>{
+                 {pk_100, "h100a"},
+                 {pk_max, "hmax"},
+                 {pk_5, "h5"},
+                 {pk_mid, "hmid"},
+                 {pk_100, "h100b"}})
+        CHECK(storage.store({pk, hash, namespace_id::Default, now, now + 1min, "data"}) ==
+              StoreResult::New);
+
+    CHECK(storage.get_message_count(0, 0) == 5);
+    CHECK(storage.get_message_count(50, 200) == 2);
+    CHECK(storage.get_message_count(100, 101) == 2);
+    CHECK(storage.get_message_count(101, 1ULL << 63) == 0);
+    CHECK(storage.get_message_count(1ULL << 63, 0) == 2);
+    // Wrapping around:
+    CHECK(storage.get_message_count(200, 50) == 3);
+    CHECK(storage.get_message_count(200, 5) == 2);
+
+    std::vector<std::string> hashes;
+    auto visitor = [&](std::vector<message>& chunk) {
+        for (auto& m : chunk)
+            hashes.push_back(m.hash);
+        return true;
+    };
+    CHECK(storage.for_each_message(200, 50, visitor, 1) == 3);
+    CHECK(hashes == std::vector<std::string>{"hmid", "hmax", "h5"});
+
+    hashes.clear();
+    CHECK(storage.for_each_message(0, 0, visitor, 2) == 5);
+    CHECK(hashes == std::vector<std::string>{"h5", "h100a", "h100b", "hmid", "hmax"});
+}
+
+TEST_CASE("storage - swarm space summaries", "[storage][reconcile]") {
+    StorageDeleter fixture;
+    const std::filesystem::path peer_dir{"summary-peer"};
+    std::filesystem::remove_all(peer_dir);
+    std::filesystem::create_directories(peer_dir);
+
+    using ranges = std::vector<std::pair<uint64_t, uint64_t>>;
+    constexpr uint64_t Q = 1ULL << 62;
+    CHECK(Database::split_swarm_space(0, 0, 4) ==
+          ranges{{0, Q}, {Q, 2 * Q}, {2 * Q, 3 * Q}, {3 * Q, 0}});
+    CHECK(Database::split_swarm_space(10, 13, 64) == ranges{{10, 11}, {11, 12}, {12, 13}});
+    const uint64_t half = (50 - 200ULL) / 2;
+    CHECK(Database::split_swarm_space(200, 50, 2) == ranges{{200, 200 + half}, {200 + half, 50}});
+
+    auto pk_for = [](std::string_view last8) {
+        user_pubkey pk;
+        REQUIRE(pk.load("05" + std::string(48, '0') + std::string{last8}));
+        return pk;
+    };
+    auto pk_5 = pk_for("0000000000000005");
+    auto pk_mid = pk_for("8000000000000000");
+    auto pk_max = pk_for("ffffffffffffffff");
+
+    {
+        Database ours{"."};
+        Database peer{peer_dir};
+
+        auto now = std::chrono::system_clock::now();
+        for (auto& [pk, hash] : std::vector<std::pair<user_pubkey, std::string>>{
+                     {pk_5, "h5"}, {pk_max, "hmax"}, {pk_mid, "hmid"}}) {
+            message m{pk, hash, namespace_id::Default, now, now + 1min, "data"};
+            CHECK(ours.store(m) == StoreResult::New);
+            // The peer is missing one of the messages:
+            if (hash != "hmid")
+                CHECK(peer.store(m) == StoreResult::New);
+        }
+
+        auto a = ours.summarize_range(0, 0, 4);
+        auto b = peer.summarize_range(0, 0, 4);
+        REQUIRE(a.size() == 4);
+        REQUIRE(b.size() == 4);
+        CHECK(a[0].count == 1);
+        CHECK(a[0] == b[0]);
+        CHECK(a[1].count == 0);
+        CHECK(a[1] == b[1]);
+        CHECK(a[2].count == 1);
+        CHECK(b[2].count == 0);
+        CHECK(a[2] != b[2]);
+        CHECK(a[3].count == 1);
+        CHECK(a[3] == b[3]);
+
+        // Hash lists for the top half, which covers the differing range:
+        auto ours_h = ours.hashes_in_range(2 * Q, 0);
+        auto peer_h = peer.hashes_in_range(2 * Q, 0);
+        std::sort(ours_h.begin(), ours_h.end());
+        CHECK(ours_h == std::vector<std::string>{"hmax", "hmid"});
+        CHECK(peer_h == std::vector<std::string>{"hmax"});
+        // Limited hash lists stop at the limit:
+        CHECK(ours.hashes_in_range(0, 0).size() == 3);
+        CHECK(ours.hashes_in_range(0, 0, 2).size() == 2);
+        CHECK(ours.hashes_in_range(2 * Q, 0, 1).size() == 1);
+        CHECK(ours.hashes_in_range(0, 0, 0).empty());
+
+        // Once the peer has it too, the summaries agree:
+        CHECK(peer.store({pk_mid, "hmid", namespace_id::Default, now, now + 1min, "data"}) ==
+              StoreResult::New);
+        CHECK(peer.summarize_range(0, 0, 4)[2] == a[2]);
+    }
+    std::filesystem::remove_all(peer_dir);
+}
+
+TEST_CASE("storage - recent message cache", "[storage][tail-cache]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    auto store = [&](int i, namespace_id ns = namespace_id::Default) {
+        return storage.store(
+                {pubkey,
+                 "hash" + std::to_string(i),
+                 ns,
+                 now,
+                 now + 100s,
+                 "data" + std::to_string(i)});
+    };
+    auto hashes = [](const std::vector<message>& msgs) {
+        std::vector<std::string> h;
+        for (auto& m : msgs)
+            h.push_back(m.hash);
+        return h;
+    };
+
+    for (int i = 0; i < 3; i++)
+        REQUIRE(store(i) == StoreResult::New);
+
+    // A brand new owner's messages are all cached, so even a retrieve without a last hash can be
+    // answered from the cache:
+    auto stats = storage.get_tail_cache_stats();
+    std::vector<message> all;
+    bool more;
+    std::tie(all, more) = storage.retrieve(pubkey, namespace_id::Default, "");
+    CHECK(hashes(all) == std::vector<std::string>{"hash0", "hash1", "hash2"});
+    CHECK_FALSE(more);
+    CHECK(all[1].data == "data1");
+    CHECK(all[1].expiry == std::chrono::time_point_cast<std::chrono::milliseconds>(now + 100s));
+    CHECK(storage.get_tail_cache_stats().hits == stats.hits + 1);
+
+    // Polling with the newest hash:
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "hash2").first.empty());
+    CHECK(storage.get_tail_cache_stats().hits == stats.hits + 2);
+
+    // Count limits are still applied:
+    std::tie(all, more) = storage.retrieve(pubkey, namespace_id::Default, "hash0", 1);
+    CHECK(hashes(all) == std::vector<std::string>{"hash1"});
+    CHECK(more);
+
+    // Fill the window so that the oldest cached messages get dropped; a last hash that is no
+    // longer in the window has to go to the database, but gives the same result:
+    for (int i = 3; i < 3 + (int)Database::TAIL_CACHE_MESSAGES; i++)
+        REQUIRE(store(i) == StoreResult::New);
+    stats = storage.get_tail_cache_stats();
+    std::tie(all, more) = storage.retrieve(pubkey, namespace_id::Default, "hash1");
+    CHECK(all.size() == Database::TAIL_CACHE_MESSAGES + 1);
+    CHECK(storage.get_tail_cache_stats().misses == stats.misses + 1);
+    std::tie(all, more) = storage.retrieve(pubkey, namespace_id::Default, "hash10");
+    CHECK(all.size() == Database::TAIL_CACHE_MESSAGES + 2 - 10);
+    CHECK(storage.get_tail_cache_stats().hits == stats.hits + 1);
+
+    // Deletes must not leave stale cached messages behind:
+    CHECK(storage.delete_by_hash(pubkey, {"hash18"}).size() == 1);
+    std::tie(all, more) = storage.retrieve(pubkey, namespace_id::Default, "hash16");
+    CHECK(hashes(all) == std::vector<std::string>{"hash17"});
+
+    // A different namespace is tracked separately:
+    REQUIRE(store(100, namespace_id{42}) == StoreResult::New);
+    std::tie(all, more) = storage.retrieve(pubkey, namespace_id{42}, "");
+    CHECK(hashes(all) == std::vector<std::string>{"hash100"});
+    std::tie(all, more) = storage.retrieve(pubkey, namespace_id::Default, "hash17");
+    CHECK(all.empty());
+}
+
+TEST_CASE("storage - sharded database", "[storage][shards]") {
+    const std::filesystem::path dir{"sharded-test"};
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+
+    // Start with some messages in an unsharded database, which should get imported:
+    auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey> pubkeys;
+    for (int i = 0; i < 16; i++) {
+        auto& pk = pubkeys.emplace_back();
+        REQUIRE(pk.load(fmt::format("05{:02x}{:062x}", i * 16, i)));
+    }
+    subaccount_token revoked;
+    revoked.token[0] = 0x03;
+    revoked.token.back() = 0x42;
+    {
+        Database storage{dir};
+        for (int i = 0; i < 8; i++)
+            CHECK(storage.store(
+                          {pubkeys[i],
+                           "old" + std::to_string(i),
+                           namespace_id::Default,
+                           now,
+                           now + 100s,
+                           "data"}) == StoreResult::New);
+        storage.revoke_subaccounts(pubkeys[5], {revoked});
+    }
+
+    database_options opts;
+    opts.shards = 4;
+    {
+        Database storage{dir, opts};
+        CHECK(storage.shard_count() == 4);
+        CHECK(std::filesystem::exists(dir / "storage-3-of-4.db"));
+        CHECK_FALSE(std::filesystem::exists(dir / "storage.db"));
+        CHECK(storage.get_message_count() == 8);
+        // Revocations get imported along with the messages:
+        CHECK(storage.subaccount_revoked(pubkeys[5], revoked));
+        CHECK_FALSE(storage.subaccount_revoked(pubkeys[4], revoked));
+
+        for (int i = 0; i < 16; i++)
+            CHECK(storage.store(
+                          {pubkeys[i],
+                           "new" + std::to_string(i),
+                           namespace_id::Default,
+                           now,
+                           now + 100s,
+                           "data"}) == StoreResult::New);
+        // Expired rows, to be cleaned up:
+        for (int i = 0; i < 16; i++)
+            storage.store(
+                    {pubkeys[i],
+                     "exp" + std::to_string(i),
+                     namespace_id::Default,
+                     now - 10s,
+                     now - 1s,
+                     "data"});
+
+        CHECK(storage.clean_expired_incremental() == 16);
+        CHECK(storage.get_message_count() == 24);
+        CHECK(storage.get_owner_count() == 16);
+        CHECK(storage.retrieve_all().size() == 24);
+        CHECK(storage.retrieve_by_hash("new15"));
+        CHECK(storage.retrieve_random());
+
+        for (int i = 0; i < 16; i++) {
+            auto [msgs, more] = storage.retrieve(pubkeys[i], namespace_id::Default, "");
+            CHECK(msgs.size() == (i < 8 ? 2 : 1));
+        }
+
+        // Iterating over half of the swarm space should only see the first half of the owners:
+        size_t visited = storage.for_each_message(
+                0, uint64_t{1} << 63, [&](std::vector<message>& chunk) {
+                    for (auto& m : chunk)
+                        CHECK(pubkey_to_swarm_space(m.pubkey) < uint64_t{1} << 63);
+                    return true;
+                });
+        CHECK(visited == storage.get_message_count(0, uint64_t{1} << 63));
+
+        CHECK(storage.delete_all(pubkeys[3]).size() == 2);
+        CHECK(storage.get_message_count() == 22);
+    }
+
+    // Re-opening shouldn't import anything again:
+    {
+        Database storage{dir, opts};
+        CHECK(storage.get_message_count() == 22);
+    }
+
+    // Changing the number of shards redistributes the old shards' contents:
+    opts.shards = 2;
+    {
+        Database storage{dir, opts};
+        CHECK(storage.shard_count() == 2);
+        CHECK_FALSE(std::filesystem::exists(dir / "storage-0-of-4.db"));
+        CHECK(std::filesystem::exists(dir / "storage-0-of-4.db.resharded"));
+        CHECK(storage.get_message_count() == 22);
+        CHECK(storage.get_owner_count() == 15);
+        CHECK(storage.subaccount_revoked(pubkeys[5], revoked));
+        for (int i = 0; i < 16; i++) {
+            auto [msgs, more] = storage.retrieve(pubkeys[i], namespace_id::Default, "");
+            CHECK(msgs.size() == (i == 3 ? 0 : i < 8 ? 2 : 1));
+        }
+    }
+
+    // As does going back to a single, unsharded database:
+    {
+        Database storage{dir};
+        CHECK(storage.shard_count() == 1);
+        CHECK_FALSE(std::filesystem::exists(dir / "storage-1-of-2.db"));
+        CHECK(storage.get_message_count() == 22);
+        CHECK(storage.subaccount_revoked(pubkeys[5], revoked));
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
 TEST_CASE("storage - retrieve limit", "[storage]") {
     StorageDeleter fixture;
 
@@ -370,19 +1626,271 @@ TEST_CASE("storage - retrieve limit", "[storage]") {
     CHECK(storage.retrieve(pubkey2, namespace_id::Default, "", 10).first.size() == 5);
 }
 
+TEST_CASE("storage - retrieve with row callback", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 20; i++)
+        storage.store(
+                {pubkey,
+                 "hash" + std::to_string(i),
+                 namespace_id::Default,
+                 now,
+                 now + 100s,
+                 std::string(1000 + i, 'a' + i)});
+
+    std::vector<message> expected;
+    bool expected_more;
+    std::tie(expected, expected_more) =
+            storage.retrieve(pubkey, namespace_id::Default, "hash4", std::nullopt, 5000);
+    REQUIRE(expected.size() == 3);
+    CHECK(expected_more);
+
+    std::vector<std::pair<std::string, std::string>> got;
+    bool more = storage.retrieve_each(
+            pubkey,
+            namespace_id::Default,
+            "hash4",
+            [&got](const message_view& m) {
+                CHECK(m.msg_namespace == namespace_id::Default);
+                got.emplace_back(m.hash, m.data);
+            },
+            std::nullopt,
+            5000);
+    CHECK(more == expected_more);
+    REQUIRE(got.size() == expected.size());
+    for (size_t i = 0; i < got.size(); i++) {
+        CHECK(got[i].first == expected[i].hash);
+        CHECK(got[i].second == expected[i].data);
+    }
+
+    user_pubkey unknown;
+    REQUIRE(unknown.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    CHECK_FALSE(storage.retrieve_each(
+            unknown, namespace_id::Default, "", [](const message_view&) { FAIL(); }));
+}
+
+TEST_CASE("storage - multi-namespace retrieve", "[storage][namespace]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    const auto ns2 = static_cast<namespace_id>(2), ns3 = static_cast<namespace_id>(3);
+    auto now = std::chrono::system_clock::now();
+    const std::vector<std::pair<std::string, namespace_id>> prefixes{
+            {"d", namespace_id::Default}, {"a", ns2}, {"b", ns3}};
+    for (int i = 0; i < 5; i++)
+        for (auto& [prefix, ns] : prefixes)
+            storage.store(
+                    {pubkey,
+                     prefix + std::to_string(i),
+                     ns,
+                     now,
+                     now + 100s,
+                     std::string(1000, 'x')});
+
+    std::vector<Database::retrieve_request> reqs{
+            {namespace_id::Default, "d1", std::nullopt, std::nullopt},
+            {ns2, "", 2, std::nullopt},
+            {ns3, "b3", std::nullopt, std::nullopt}};
+
+    std::vector<std::vector<std::string>> got(reqs.size());
+    auto collect = [&](size_t i, const message_view& m) {
+        CHECK(m.msg_namespace == reqs[i].ns);
+        got[i].emplace_back(m.hash);
+    };
+
+    auto more = storage.retrieve_multi(pubkey, reqs, collect);
+    CHECK(more == std::vector<bool>{false, true, false});
+    CHECK(got[0] == std::vector<std::string>{"d2", "d3", "d4"});
+    CHECK(got[1] == std::vector<std::string>{"a0", "a1"});
+    CHECK(got[2] == std::vector<std::string>{"b4"});
+
+    // Each message counts as about 1435 bytes (overhead + hash + b64-encoded data), so a total
+    // limit of 3000 allows only the first two:
+    for (auto& g : got)
+        g.clear();
+    more = storage.retrieve_multi(pubkey, reqs, collect, 3000);
+    CHECK(more == std::vector<bool>{true, true, true});
+    CHECK(got[0] == std::vector<std::string>{"d2", "d3"});
+    CHECK(got[1].empty());
+    CHECK(got[2].empty());
+
+    // A request without b64 counts its messages (against the total, too) at about 1102 bytes:
+    for (auto& g : got)
+        g.clear();
+    reqs[0].size_b64 = false;
+    more = storage.retrieve_multi(pubkey, reqs, collect, 4000);
+    CHECK(more == std::vector<bool>{false, true, true});
+    CHECK(got[0] == std::vector<std::string>{"d2", "d3", "d4"});
+    CHECK(got[1].empty());
+    CHECK(got[2].empty());
+}
+
+TEST_CASE("storage - combined owner reads", "[storage][namespace]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    const auto ns2 = static_cast<namespace_id>(2);
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 3; i++) {
+        auto n = std::to_string(i);
+        storage.store({pubkey, "d" + n, namespace_id::Default, now, now + 100s, "x"});
+        storage.store({pubkey, "a" + n, ns2, now, now + 200s, "y"});
+    }
+
+    std::vector<Database::retrieve_request> reqs{
+            {namespace_id::Default, "d0", std::nullopt, std::nullopt},
+            {ns2, "", 1, std::nullopt}};
+    std::vector<std::vector<std::string>> got(reqs.size());
+    auto collect = [&](size_t i, const message_view& m) { got[i].emplace_back(m.hash); };
+
+    auto res = storage.read_owner(pubkey, reqs, collect, {{"d1", "a2", "nope"}, {}, {"a0"}});
+    CHECK(res.more == std::vector<bool>{false, true});
+    CHECK(got[0] == std::vector<std::string>{"d1", "d2"});
+    CHECK(got[1] == std::vector<std::string>{"a0"});
+    REQUIRE(res.expiries.size() == 3);
+    CHECK(res.expiries[0] ==
+          std::map<std::string, int64_t>{
+                  {"d1", to_epoch_ms(now + 100s)}, {"a2", to_epoch_ms(now + 200s)}});
+    CHECK(res.expiries[1].empty());
+    CHECK(res.expiries[2] == storage.get_expiries(pubkey, {"a0"}));
+
+    // The expiries alone, and an unknown owner:
+    CHECK(storage.read_owner(pubkey, {}, collect, {{"d0"}}).expiries[0] ==
+          std::map<std::string, int64_t>{{"d0", to_epoch_ms(now + 100s)}});
+    user_pubkey nobody;
+    REQUIRE(nobody.load("05ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"));
+    auto none = storage.read_owner(nobody, reqs, collect, {{"d0"}});
+    CHECK(none.more == std::vector<bool>{false, false});
+    CHECK(none.expiries[0].empty());
+}
+
+TEST_CASE("storage - new message counts", "[storage][namespace][tail-cache]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    const int n = Database::TAIL_CACHE_MESSAGES + 4;
+    for (int i = 0; i < n; i++)
+        REQUIRE(storage.store(
+                        {pubkey,
+                         "hash" + std::to_string(i),
+                         namespace_id::Default,
+                         now,
+                         now + 100s,
+                         "data"}) == StoreResult::New);
+    for (int i = 0; i < 2; i++)
+        REQUIRE(storage.store(
+                        {pubkey,
+                         "other" + std::to_string(i),
+                         namespace_id{42},
+                         now,
+                         now + 100s,
+                         "data"}) == StoreResult::New);
+
+    auto stats = storage.get_tail_cache_stats();
+    auto counts = storage.count_new(
+            pubkey,
+            {{namespace_id::Default, "hash1", std::nullopt, std::nullopt},
+             {namespace_id::Default, "hash" + std::to_string(n - 3), std::nullopt, std::nullopt},
+             {namespace_id::Default, "", std::nullopt, std::nullopt},
+             {namespace_id::Default, "nosuchhash", std::nullopt, std::nullopt},
+             {namespace_id{42}, "", std::nullopt, std::nullopt},
+             {namespace_id{42}, "other1", std::nullopt, std::nullopt},
+             {namespace_id{7}, "", std::nullopt, std::nullopt}});
+    CHECK(counts == std::vector<int64_t>{n - 2, 2, n, n, 2, 0, 0});
+    // Only the requests with a recent last hash can be answered from the cache; the rest have to
+    // count in the database:
+    auto after = storage.get_tail_cache_stats();
+    CHECK(after.hits == stats.hits + 2);
+    CHECK(after.misses == stats.misses + 5);
+
+    // Counts match what a retrieve would return:
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "hash1").first.size() == n - 2);
+
+    user_pubkey nobody;
+    REQUIRE(nobody.load("05ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"));
+    CHECK(storage.count_new(nobody, {{namespace_id::Default, "", std::nullopt, std::nullopt}}) ==
+          std::vector<int64_t>{0});
+}
+
 namespace oxenss {
 class TestSuiteHacks {
   public:
-    static void db_block(Database& db, std::chrono::milliseconds duration) {
-        db.test_suite_block_for(duration);
+    static void db_block(Database& db, std::chrono::milliseconds duration, bool write = false) {
+        db.test_suite_block_for(duration, write);
+    }
+    static auto db_statement_lookup(Database& db, int iterations) {
+        return db.test_suite_statement_lookup(iterations);
     }
     static int db_pool_size(Database& db) {
         std::lock_guard lock{db.impl_lock_};
         return db.impl_pool_.size();
     }
+    static std::vector<StoreResult> db_store_batch(Database& db, const std::vector<message>& msgs) {
+        return db.test_suite_store_batch(msgs);
+    }
 };
 }  // namespace oxenss
 
+TEST_CASE("storage - group commit rollback", "[storage][group-commit]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    database_options opts;
+    opts.group_commit = true;
+    opts.size_limit = 1024 * 1024;
+    Database storage{".", opts};
+
+    auto now = std::chrono::system_clock::now();
+    // Two stores for a new owner, the second of which finds the (uncommitted) owner row that the
+    // first inserted, and then one that doesn't fit, which rolls the whole batch back:
+    auto results = oxenss::TestSuiteHacks::db_store_batch(
+            storage,
+            {{pubkey1, "a1", namespace_id::Default, now, now + 1h, "x"},
+             {pubkey1, "a2", namespace_id::Default, now, now + 1h, "y"},
+             {pubkey2, "big", namespace_id::Default, now, now + 1h, std::string(2'000'000, 'z')}});
+    // Each store then gets retried on its own:
+    CHECK(results == std::vector{StoreResult::New, StoreResult::New, StoreResult::Full});
+    auto [items, more] = storage.retrieve(pubkey1, namespace_id::Default, "");
+    CHECK(items.size() == 2);
+
+    // Same again, but with the retries having an owner row in between, so that pubkey1's retried
+    // stores can't reuse the rolled back owner id.  A cached rolled back id would fail these, or
+    // store them for the wrong owner:
+    results = oxenss::TestSuiteHacks::db_store_batch(
+            storage,
+            {{pubkey2, "b1", namespace_id::Default, now, now + 1h, "x"},
+             {pubkey2, "b2", namespace_id::Default, now, now + 1h, "y"},
+             {pubkey1, "big", namespace_id::Default, now, now + 1h, std::string(2'000'000, 'z')}});
+    CHECK(results == std::vector{StoreResult::New, StoreResult::New, StoreResult::Full});
+    CHECK(storage.get_owner_count() == 2);
+    std::tie(items, more) = storage.retrieve(pubkey2, namespace_id::Default, "");
+    CHECK(items.size() == 2);
+    std::tie(items, more) = storage.retrieve(pubkey1, namespace_id::Default, "");
+    CHECK(items.size() == 2);
+}
+
 TEST_CASE("storage - connection pool", "[storage][pool]") {
     StorageDeleter fixture;
 
@@ -427,3 +1935,311 @@ TEST_CASE("storage - connection pool", "[storage][pool]") {
     // returned to the pool:
     CHECK(oxenss::TestSuiteHacks::db_pool_size(storage) == 1 + n_blocked_threads);
 }
+
+TEST_CASE("storage - connection pool pre-warming and limits", "[storage][pool][stats]") {
+    StorageDeleter fixture;
+
+    database_options opts;
+    opts.pool_min = 3;
+    opts.pool_max = 3;
+    Database storage{".", opts};
+
+    auto st = storage.get_pool_stats();
+    CHECK(st.size == 3);
+    CHECK(st.idle == 3);
+    CHECK(st.created == 3);
+    CHECK(st.waits == 0);
+    CHECK(oxenss::TestSuiteHacks::db_pool_size(storage) == 3);
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    REQUIRE(storage.store({pubkey, "hash0", namespace_id::Default, now, now + 100s, "data"}) ==
+            StoreResult::New);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == 1);
+    CHECK(storage.get_pool_stats().created == 3);
+
+    // With every connection in use, the next job waits for one to be returned rather than opening
+    // another:
+    std::vector<std::thread> busy;
+    for (int i = 0; i < 3; i++)
+        busy.emplace_back([&] { oxenss::TestSuiteHacks::db_block(storage, 50ms); });
+    std::this_thread::sleep_for(10ms);
+    CHECK(storage.retrieve_by_hash("hash0"));
+    for (auto& b : busy)
+        b.join();
+    st = storage.get_pool_stats();
+    CHECK(st.size == 3);
+    CHECK(st.created == 3);
+    CHECK(st.waits == 1);
+    CHECK(st.wait_us > 0);
+    busy.clear();
+
+    // ... but not forever: after POOL_WAIT_TIMEOUT it opens an extra one, which gets closed once
+    // it is returned.
+    for (int i = 0; i < 3; i++)
+        busy.emplace_back([&] {
+            oxenss::TestSuiteHacks::db_block(storage, Database::POOL_WAIT_TIMEOUT + 200ms);
+        });
+    std::this_thread::sleep_for(10ms);
+    CHECK(storage.retrieve_by_hash("hash0"));
+    st = storage.get_pool_stats();
+    CHECK(st.size == 3);
+    CHECK(st.idle == 0);
+    CHECK(st.created == 4);
+    CHECK(st.waits == 2);
+    for (auto& b : busy)
+        b.join();
+    CHECK(storage.get_pool_stats().idle == 3);
+}
+
+TEST_CASE("storage - reads don't wait for writers", "[storage][pool]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    REQUIRE(storage.store({pubkey, "hash0", namespace_id::Default, now, now + 100s, "data"}) ==
+            StoreResult::New);
+
+    // Hold the write connection for a while; reads should still go through immediately.
+    std::thread writer{[&] { oxenss::TestSuiteHacks::db_block(storage, 500ms, true); }};
+    std::this_thread::sleep_for(20ms);
+
+    auto started = std::chrono::steady_clock::now();
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == 1);
+    CHECK(storage.retrieve_by_hash("hash0"));
+    CHECK(storage.get_message_count() == 1);
+    auto elapsed = std::chrono::steady_clock::now() - started;
+    writer.join();
+
+    CHECK(elapsed < 250ms);
+}
+
+TEST_CASE("storage - query and write lock stats", "[storage][stats]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 3; i++)
+        REQUIRE(storage.store(
+                        {pubkey,
+                         "hash" + std::to_string(i),
+                         namespace_id::Default,
+                         now,
+                         now + 100s,
+                         "data"}) == StoreResult::New);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == 3);
+    CHECK(storage.delete_by_hash(pubkey, {"hash0", "hash1"}).size() == 2);
+
+    auto queries = storage.get_query_stats();
+    REQUIRE_FALSE(queries.empty());
+    CHECK(std::is_sorted(queries.begin(), queries.end(), [](const auto& a, const auto& b) {
+        return a.total_us > b.total_us;
+    }));
+    auto find = [&](std::string_view prefix) -> const Database::query_stats* {
+        for (auto& q : queries)
+            if (q.query.substr(0, prefix.size()) == prefix)
+                return &q;
+        return nullptr;
+    };
+    auto* insert = find("INSERT INTO messages");
+    REQUIRE(insert);
+    CHECK(insert->uses == 3);
+    CHECK(insert->rows == 3);
+    CHECK(insert->max_us <= insert->total_us);
+    auto* del = find("DELETE FROM messages WHERE owner = ? AND hash IN (SELECT");
+    REQUIRE(del);
+    CHECK(del->uses == 1);
+    CHECK(del->rows == 2);
+
+    auto locks = storage.get_write_lock_stats();
+    CHECK(locks.acquisitions > 0);
+    CHECK(locks.contended == 0);
+
+    // Hold the write lock for a while; a store in the meantime has to wait for it, which should
+    // show up as lock wait rather than as time spent in the insert.
+    std::thread writer{[&] { oxenss::TestSuiteHacks::db_block(storage, 200ms, true); }};
+    std::this_thread::sleep_for(20ms);
+    CHECK(storage.store({pubkey, "hash3", namespace_id::Default, now, now + 100s, "data"}) ==
+          StoreResult::New);
+    writer.join();
+
+    locks = storage.get_write_lock_stats();
+    CHECK(locks.contended == 1);
+    CHECK(locks.wait_us >= 100'000);
+    CHECK(locks.max_wait_us == locks.wait_us);
+    queries = storage.get_query_stats();
+    insert = find("INSERT INTO messages");
+    REQUIRE(insert);
+    CHECK(insert->uses == 4);
+    CHECK(insert->max_us < 100'000);
+}
+
+TEST_CASE("storage - single statement stores", "[storage][stats]") {
+    StorageDeleter fixture;
+
+    // Without the hash filter every store goes through the write path:
+    database_options opts;
+    opts.hash_filter = false;
+    Database storage{".", opts};
+
+    user_pubkey pubkey, pubkey2;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("05fedcba9876543210fedcba9876543210fedcba9876543210fedcba9876543210"));
+    auto now = std::chrono::system_clock::now();
+    now = std::chrono::time_point_cast<std::chrono::milliseconds>(now);
+
+    auto statements = [&] {
+        int64_t uses = 0;
+        for (auto& q : storage.get_query_stats())
+            uses += q.uses;
+        return uses;
+    };
+
+    // Stores also upsert the owner until its id gets cached (which a store that inserted the
+    // owner doesn't do, since the transaction could still be rolled back):
+    REQUIRE(storage.store({pubkey, "hash0", namespace_id::Default, now, now + 100s, "data"}) ==
+            StoreResult::New);
+    REQUIRE(storage.store({pubkey, "hashx", namespace_id::Default, now, now + 100s, "data"}) ==
+            StoreResult::New);
+    CHECK(storage.get_owner_count() == 1);
+
+    auto before = statements();
+    CHECK(storage.store({pubkey, "hash1", namespace_id::Default, now, now + 100s, "data"}) ==
+          StoreResult::New);
+    CHECK(statements() == before + 1);
+
+    before = statements();
+    CHECK(storage.store({pubkey, "hash1", namespace_id::Default, now, now + 50s, "data"}) ==
+          StoreResult::Exists);
+    CHECK(statements() == before + 1);
+
+    before = statements();
+    std::chrono::system_clock::time_point expiry;
+    CHECK(storage.store(
+                  {pubkey, "hash1", namespace_id::Default, now, now + 200s, "data"}, &expiry) ==
+          StoreResult::Extended);
+    CHECK(statements() == before + 1);
+    CHECK(expiry == now + 200s);
+
+    // The existing expiry of a duplicate takes a second statement, but only if asked for:
+    CHECK(storage.store(
+                  {pubkey, "hash1", namespace_id::Default, now, now + 100s, "data"}, &expiry) ==
+          StoreResult::Exists);
+    CHECK(expiry == now + 200s);
+
+    // A store of an existing hash by another owner gets the other owner its owner row, but only
+    // extends the expiry of the existing message, which stays with its original owner:
+    CHECK(storage.store({pubkey2, "hash1", namespace_id::Default, now, now + 300s, "data"}) ==
+          StoreResult::Extended);
+    CHECK(storage.store({pubkey2, "hash2", namespace_id::Default, now, now + 100s, "data"}) ==
+          StoreResult::New);
+    CHECK(storage.get_owner_count() == 2);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == 3);
+    CHECK(storage.retrieve(pubkey2, namespace_id::Default, "").first.size() == 1);
+
+    CHECK(storage.bulk_store(std::vector<message>{
+                  {pubkey, "hash1", namespace_id::Default, now, now + 100s, "data"},
+                  {pubkey2, "hash3", namespace_id::Default, now, now + 100s, "data"}}) == 1);
+    CHECK(storage.get_message_count() == 5);
+}
+
+TEST_CASE("storage - page cache and memory map", "[storage][stats]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    {
+        // SQLite's defaults: a 2000KiB cache, and no memory map
+        Database storage{"."};
+        auto st = storage.get_page_cache_stats();
+        CHECK(st.cache_size == 2000 * 1024);
+        CHECK(st.mmap_size == 0);
+    }
+
+    database_options opts;
+    opts.cache_size = 8 * 1024 * 1024;
+    opts.mmap_size = 64 * 1024 * 1024;
+    Database storage{".", opts};
+    auto st = storage.get_page_cache_stats();
+    CHECK(st.cache_size == 8 * 1024 * 1024);
+    CHECK(st.mmap_size == 64 * 1024 * 1024);
+
+    for (int i = 0; i < 10; i++)
+        REQUIRE(storage.store(
+                        {pubkey,
+                         "hash" + std::to_string(i),
+                         namespace_id::Default,
+                         now,
+                         now + 100s,
+                         "data"}) == StoreResult::New);
+    for (int i = 0; i < 10; i++)
+        CHECK(storage.retrieve_by_hash("hash" + std::to_string(i)));
+
+    auto st2 = storage.get_page_cache_stats();
+    CHECK(st2.hits > st.hits);
+    CHECK(st2.misses >= st.misses);
+}
+
+TEST_CASE("storage - prepared statement lookup benchmark", "[.][benchmark]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    // Warm up (so that both statements have been prepared):
+    oxenss::TestSuiteHacks::db_statement_lookup(storage, 10);
+
+    auto [keyed, registered] = oxenss::TestSuiteHacks::db_statement_lookup(storage, 1'000'000);
+    WARN(fmt::format(
+            "prepared statement lookup: string-keyed {}ns/call, registered {}ns/call",
+            keyed.count(),
+            registered.count()));
+    CHECK(registered <= keyed);
+}
+
+TEST_CASE("storage - multi-hash query benchmark", "[.][benchmark]") {
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    // Times repeated expiry lookups and updates of batches of various sizes with each approach.
+    auto run = [&](bool set_queries) {
+        StorageDeleter fixture;
+        database_options opts;
+        opts.set_hash_queries = set_queries;
+        Database storage{".", opts};
+
+        auto now = std::chrono::system_clock::now();
+        std::vector<std::string> hashes;
+        for (int i = 0; i < 200; i++) {
+            hashes.push_back(fmt::format("hash{:03d}", i));
+            storage.store({pubkey, hashes.back(), namespace_id::Default, now, now + 1h, "data"});
+        }
+
+        auto started = std::chrono::steady_clock::now();
+        for (int rep = 0; rep < 100; rep++) {
+            for (size_t n : {2, 10, 37, 100, 200}) {
+                std::vector<std::string> batch{hashes.begin(), hashes.begin() + n};
+                CHECK(storage.get_expiries(pubkey, batch).size() == n);
+                CHECK(storage.update_expiry(pubkey, batch, {now + 1h + 1ms * rep}).size() == n);
+            }
+        }
+        return std::chrono::steady_clock::now() - started;
+    };
+
+    auto per_size = std::chrono::duration_cast<std::chrono::microseconds>(run(false));
+    auto set_based = std::chrono::duration_cast<std::chrono::microseconds>(run(true));
+    WARN(fmt::format(
+            "multi-hash queries: IN (?,...) {}us, json_each {}us",
+            per_size.count(),
+            set_based.count()));
+}
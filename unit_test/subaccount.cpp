@@ -0,0 +1,59 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/crypto/subaccount.h>
+
+#include <oxenc/hex.h>
+#include <sodium/crypto_sign.h>
+
+using namespace oxenss;
+
+TEST_CASE("subaccount cache", "[subaccount]") {
+    std::array<unsigned char, 32> owner_pk, other_pk, sub_pk;
+    std::array<unsigned char, 64> owner_sk, other_sk, sub_sk;
+    crypto_sign_keypair(owner_pk.data(), owner_sk.data());
+    crypto_sign_keypair(other_pk.data(), other_sk.data());
+    crypto_sign_keypair(sub_pk.data(), sub_sk.data());
+
+    user_pubkey owner;
+    REQUIRE(owner.load("03" + oxenc::to_hex(owner_pk.begin(), owner_pk.end())));
+
+    signed_subaccount_token sa;
+    sa.token.token[SUBACCOUNT_TOKEN_PREFIX_INDEX] = 0x03;
+    sa.token.set_flags(subaccount_access::Read);
+    std::copy(sub_pk.begin(), sub_pk.end(), sa.token.token.begin() + SUBACCOUNT_TOKEN_PUBKEY_INDEX);
+    crypto_sign_detached(
+            sa.signature.data(),
+            nullptr,
+            sa.token.token.data(),
+            sa.token.token.size(),
+            owner_sk.data());
+
+    SubaccountCache cache;
+    CHECK_NOTHROW(cache.verify(sa, owner, subaccount_access::Read));
+    CHECK_NOTHROW(cache.verify(sa, owner, subaccount_access::Read));
+    auto st = cache.get_stats();
+    CHECK(st.size == 1);
+    CHECK(st.hits == 1);
+    CHECK(st.misses == 1);
+
+    // Permissions are still checked on a hit:
+    CHECK_THROWS_AS(
+            cache.verify(sa, owner, subaccount_access::Write),
+            subaccount_verification_bad_permissions);
+
+    // A cached token doesn't help a different owner key or a different signature:
+    CHECK_THROWS_AS(
+            cache.verify(sa, owner, subaccount_access::Read, other_pk.data()),
+            subaccount_verification_bad_signature);
+    auto forged = sa;
+    forged.signature[0] ^= 1;
+    CHECK_THROWS_AS(
+            cache.verify(forged, owner, subaccount_access::Read),
+            subaccount_verification_bad_signature);
+    CHECK(cache.get_stats().size == 1);
+
+    cache.forget({sa.token});
+    CHECK(cache.get_stats().size == 0);
+    CHECK_NOTHROW(cache.verify(sa, owner, subaccount_access::Read));
+    CHECK(cache.get_stats().misses == 4);
+}
@@ -1,12 +1,19 @@
 #include <catch2/catch.hpp>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <random>
 
 #include <oxenss/crypto/keys.h>
 #include <oxenss/rpc/request_handler.h>
 #include <oxenss/snode/swarm.h>
 #include <oxenss/utils/time.hpp>
 
+#include <nlohmann/json.hpp>
 #include <oxenc/base64.h>
+#include <oxenc/bt_producer.h>
+#include <oxenc/hex.h>
+#include <fmt/format.h>
 
 using namespace std::literals;
 
@@ -38,6 +45,29 @@ TEST_CASE("swarm - pubkey to swarm space", "[swarm]") {
     CHECK(oxenss::snode::pubkey_to_swarm_space(pk) == 0x0123456789abcdefULL);
 }
 
+TEST_CASE("swarm - fixed-size pubkey keys", "[swarm]") {
+    oxenss::user_pubkey pk;
+    REQUIRE(pk.load("053506f4a71324b7dd114eddbf4e311f39dde243e1f2cb97c40db1961f70ebaae8"));
+    auto key = pk.key();
+    static_assert(std::is_trivially_copyable_v<oxenss::prefixed_pubkey>);
+    CHECK(key.view() == pk.prefixed_raw());
+    CHECK(key.raw() == pk.raw());
+    CHECK(key.type() == 5);
+    CHECK(key == oxenss::prefixed_pubkey{pk.prefixed_raw()});
+    std::hash<oxenss::prefixed_pubkey> hash;
+    CHECK(hash(key) == hash(oxenss::prefixed_pubkey{pk.prefixed_raw()}));
+
+    oxenss::user_pubkey other;
+    REQUIRE(other.load("033506f4a71324b7dd114eddbf4e311f39dde243e1f2cb97c40db1961f70ebaae8"));
+    CHECK_FALSE(other.key() == key);
+    CHECK(hash(other.key()) != hash(key));
+
+    // Invalid pubkeys (and values of the wrong size) give the all-zero key:
+    CHECK(oxenss::user_pubkey{}.key() == oxenss::prefixed_pubkey{});
+    CHECK(oxenss::prefixed_pubkey{"too short"} == oxenss::prefixed_pubkey{});
+    CHECK(oxenss::prefixed_pubkey{}.view() == std::string(33, '\0'));
+}
+
 TEST_CASE("service nodes - pubkey to swarm id") {
     std::vector<oxenss::snode::SwarmInfo> swarms{
             {100, {}}, {200, {}}, {300, {}}, {399, {}}, {498, {}}, {596, {}}, {694, {}}};
@@ -150,3 +180,232 @@ TEST_CASE("service nodes - pubkey to swarm id") {
     REQUIRE(pk.load("05000000000000000000000000000000000000000000000000fffffffffffffffe"));
     CHECK(get_swarm_by_pk(swarms, pk)->swarm_id == 0);
 }
+
+TEST_CASE("service nodes - swarm space ranges", "[swarm]") {
+    std::vector<oxenss::snode::SwarmInfo> swarms{
+            {100, {}}, {200, {}}, {300, {}}, {399, {}}, {498, {}}, {596, {}}, {694, {}}};
+
+    auto pk_for = [](uint64_t space) {
+        oxenss::user_pubkey pk;
+        REQUIRE(pk.load("05" + std::string(48, '0') + fmt::format("{:016x}", space)));
+        REQUIRE(oxenss::snode::pubkey_to_swarm_space(pk) == space);
+        return pk;
+    };
+    auto in_range = [](uint64_t x, std::pair<uint64_t, uint64_t> r) {
+        auto [begin, end] = r;
+        return begin < end ? begin <= x && x < end : begin <= x || x < end;
+    };
+
+    auto check_all = [&] {
+        std::vector<uint64_t> points{0, 1, (uint64_t)-1, (uint64_t)-2, 1ULL << 63, (1ULL << 63) + 1};
+        for (auto& s : swarms)
+            for (uint64_t d : {0, 1, 2, 47, 48, 49, 50, 51})
+                points.insert(points.end(), {s.swarm_id + d, s.swarm_id - d});
+        for (uint64_t d : {0x18bULL, 0x18cULL, 0x18dULL, 0x18eULL})
+            points.push_back((1ULL << 63) + d);
+
+        for (auto x : points) {
+            auto* expected = get_swarm_by_pk(swarms, pk_for(x));
+            REQUIRE(expected);
+            for (size_t i = 0; i < swarms.size(); i++) {
+                INFO("swarm space " << x << ", swarm " << swarms[i].swarm_id);
+                CHECK(in_range(x, swarm_space_range(swarms, i)) ==
+                      (expected->swarm_id == swarms[i].swarm_id));
+            }
+        }
+    };
+
+    check_all();
+
+    // Wraparound cases, as in the pubkey to swarm id test above:
+    swarms.push_back({(uint64_t)-20, {}});
+    check_all();
+    swarms.insert(swarms.begin(), {0, {}});
+    check_all();
+
+    // A single swarm owns everything:
+    std::vector<oxenss::snode::SwarmInfo> one{{12345, {}}};
+    CHECK(swarm_space_range(one, 0) == std::pair<uint64_t, uint64_t>{0, 0});
+}
+
+TEST_CASE("service nodes - swarm lookup table", "[swarm]") {
+    using oxenss::snode::swarm_lookup;
+
+    // Includes the cases from the ranges test above, plus a more realistic network size:
+    std::mt19937_64 rng{12345};
+    std::vector<std::vector<oxenss::snode::SwarmInfo>> networks{
+            {{100, {}}, {200, {}}, {300, {}}, {399, {}}, {498, {}}, {596, {}}, {694, {}}},
+            {{0, {}}, {100, {}}, {200, {}}, {(uint64_t)-20, {}}},
+            {{12345, {}}},
+            {}};
+    auto& big = networks.back();
+    for (int i = 0; i < 2500; i++)
+        big.push_back({rng(), {}});
+    std::sort(big.begin(), big.end());
+
+    std::vector<uint64_t> points{0, 1, (uint64_t)-1, (uint64_t)-2, 1ULL << 63};
+    for (int i = 0; i < 20000; i++)
+        points.push_back(rng());
+
+    for (auto& swarms : networks) {
+        swarm_lookup lookup{swarms};
+        auto check_points = points;
+        for (auto& s : swarms)
+            for (uint64_t d : {0, 1, 2, 49, 50, 51})
+                check_points.insert(check_points.end(), {s.swarm_id + d, s.swarm_id - d});
+        for (auto x : check_points) {
+            oxenss::user_pubkey pk;
+            REQUIRE(pk.load("05" + std::string(48, '0') + fmt::format("{:016x}", x)));
+            auto* expected = get_swarm_by_pk(swarms, pk);
+            REQUIRE(expected);
+            INFO("swarm space " << x << " with " << swarms.size() << " swarms");
+            CHECK(lookup.index(x) == static_cast<size_t>(expected - swarms.data()));
+        }
+    }
+}
+
+TEST_CASE("service nodes - swarm lookup table benchmark", "[.][benchmark]") {
+    using oxenss::snode::swarm_lookup;
+
+    // Rough timing comparison against the plain search:
+    std::mt19937_64 rng{12345};
+    std::vector<oxenss::snode::SwarmInfo> big;
+    for (int i = 0; i < 2500; i++)
+        big.push_back({rng(), {}});
+    std::sort(big.begin(), big.end());
+    std::vector<oxenss::user_pubkey> pks(20000);
+    for (auto& pk : pks)
+        REQUIRE(pk.load("05" + std::string(48, '0') + fmt::format("{:016x}", rng())));
+
+    swarm_lookup lookup{big};
+    size_t sum_search = 0, sum_lookup = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (int round = 0; round < 10; round++)
+        for (auto& pk : pks)
+            sum_search += get_swarm_by_pk(big, pk) - big.data();
+    auto searched = std::chrono::steady_clock::now();
+    for (int round = 0; round < 10; round++)
+        for (auto& pk : pks)
+            sum_lookup += lookup.index(oxenss::snode::pubkey_to_swarm_space(pk));
+    auto looked_up = std::chrono::steady_clock::now();
+    CHECK(sum_search == sum_lookup);
+    WARN(fmt::format(
+            "swarm lookup ({} swarms, {} lookups): search {}us, table {}us",
+            big.size(),
+            10 * pks.size(),
+            (searched - started) / 1us,
+            (looked_up - searched) / 1us));
+}
+
+TEST_CASE("service nodes - swarm update parsing", "[swarm][updates]") {
+    using oxenss::snode::INVALID_SWARM_ID;
+    struct node {
+        bool funded;
+        std::string pk, ed, x, ip;
+        uint16_t port, omq_port;
+        uint64_t swarm_id;
+    };
+    auto key = [](char c) { return std::string(64, c); };
+    std::vector<node> nodes{
+            {true, key('1'), key('a'), key('b'), "1.2.3.4", 22021, 22020, 5},
+            {true, key('2'), key('c'), key('d'), "1.2.3.5", 22021, 22020, 5},
+            {true, key('3'), key('e'), key('f'), "1.2.3.6", 22021, 22020, 7},
+            {true, key('4'), key('a'), key('a'), "1.2.3.7", 22021, 22020, INVALID_SWARM_ID},
+            {false, key('5'), key('b'), key('b'), "1.2.3.8", 22021, 22020, 7},
+            {true, key('6'), "", "", "1.2.3.9", 22021, 22020, 7}};
+    const auto block_hash = key('9');
+
+    nlohmann::json states = nlohmann::json::array();
+    for (auto& n : nodes) {
+        nlohmann::json sn{
+                {"funded", n.funded},
+                {"service_node_pubkey", n.pk},
+                {"public_ip", n.ip},
+                {"storage_port", n.port},
+                {"storage_lmq_port", n.omq_port},
+                {"swarm_id", n.swarm_id}};
+        if (!n.ed.empty()) {
+            sn["pubkey_ed25519"] = n.ed;
+            sn["pubkey_x25519"] = n.x;
+        }
+        states.push_back(std::move(sn));
+    }
+    auto json_update = nlohmann::json{
+            {"height", 1234},
+            {"block_hash", block_hash},
+            {"hardfork", 19},
+            {"snode_revision", 3},
+            {"service_node_states", std::move(states)}}
+                               .dump();
+
+    // The same thing bt-encoded, as oxend sends it: dict keys sorted, and keys as raw bytes.
+    auto bt_update = [&](uint64_t height, bool change) {
+        oxenc::bt_dict_producer d;
+        d.append("block_hash", oxenc::from_hex(block_hash));
+        d.append("hardfork", 19);
+        d.append("height", height);
+        {
+            auto l = d.append_list("service_node_states");
+            for (auto& n : nodes) {
+                auto sn = l.append_dict();
+                sn.append("funded", n.funded);
+                if (!n.ed.empty()) {
+                    sn.append("pubkey_ed25519", oxenc::from_hex(n.ed));
+                    sn.append("pubkey_x25519", oxenc::from_hex(n.x));
+                }
+                sn.append("public_ip", change && n.pk == key('1') ? "4.3.2.1" : n.ip);
+                sn.append("service_node_pubkey", oxenc::from_hex(n.pk));
+                sn.append("storage_lmq_port", n.omq_port);
+                sn.append("storage_port", n.port);
+                sn.append("swarm_id", n.swarm_id);
+            }
+        }
+        d.append("snode_revision", 3);
+        return std::string{d.view()};
+    };
+
+    auto from_json = oxenss::snode::parse_swarm_update(json_update);
+    auto from_bt = oxenss::snode::parse_swarm_update(bt_update(1234, false));
+
+    for (auto* bu : {&from_json, &from_bt}) {
+        CHECK(bu->height == 1234);
+        CHECK(bu->block_hash == block_hash);
+        CHECK(bu->hardfork == 19);
+        CHECK(bu->snode_revision == 3);
+        CHECK_FALSE(bu->unchanged);
+        CHECK_FALSE(bu->states_unchanged);
+        REQUIRE(bu->swarms.size() == 2);
+        CHECK(bu->swarms[0].swarm_id == 5);
+        REQUIRE(bu->swarms[0].snodes.size() == 2);
+        CHECK(bu->swarms[0].snodes[1].pubkey_legacy.hex() == key('2'));
+        CHECK(bu->swarms[0].snodes[1].pubkey_ed25519.hex() == key('c'));
+        CHECK(bu->swarms[0].snodes[1].pubkey_x25519.hex() == key('d'));
+        CHECK(bu->swarms[0].snodes[1].ip == "1.2.3.5");
+        CHECK(bu->swarms[0].snodes[1].port == 22021);
+        CHECK(bu->swarms[0].snodes[1].omq_quic_port == 22020);
+        CHECK(bu->swarms[1].swarm_id == 7);
+        CHECK(bu->swarms[1].snodes.size() == 1);
+        REQUIRE(bu->decommissioned_nodes.size() == 1);
+        CHECK(bu->decommissioned_nodes[0].pubkey_legacy.hex() == key('4'));
+        CHECK(bu->active_x25519_pubkeys.size() == 3);
+    }
+    CHECK_FALSE(from_json.states_digest);
+    REQUIRE(from_bt.states_digest);
+
+    // The next block, with the same service node list, skips parsing the list:
+    auto next = oxenss::snode::parse_swarm_update(bt_update(1235, false), from_bt.states_digest);
+    CHECK(next.height == 1235);
+    CHECK(next.states_unchanged);
+    CHECK(next.states_digest == from_bt.states_digest);
+    CHECK(next.swarms.empty());
+
+    // ... but not if anything in it changed:
+    auto changed = oxenss::snode::parse_swarm_update(bt_update(1236, true), from_bt.states_digest);
+    CHECK_FALSE(changed.states_unchanged);
+    CHECK(changed.states_digest != from_bt.states_digest);
+    REQUIRE(changed.swarms.size() == 2);
+    CHECK(changed.swarms[0].snodes[0].ip == "4.3.2.1");
+
+    CHECK_THROWS(oxenss::snode::parse_swarm_update("d5:hello5:worlde"));
+    CHECK_THROWS(oxenss::snode::parse_swarm_update("{}"));
+}
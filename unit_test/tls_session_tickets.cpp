@@ -0,0 +1,112 @@
+#include <oxenss/server/server_certificates.h>
+#include <oxenss/server/tls_session_tickets.h>
+
+extern "C" {
+#include <openssl/ssl.h>
+}
+
+#include <catch2/catch.hpp>
+
+#include <filesystem>
+#include <memory>
+
+using oxenss::server::TlsSessionTickets;
+
+namespace {
+
+struct ssl_ctx_deleter {
+    void operator()(SSL_CTX* c) const { SSL_CTX_free(c); }
+};
+using ssl_ctx_ptr = std::unique_ptr<SSL_CTX, ssl_ctx_deleter>;
+
+struct CertFiles {
+    std::filesystem::path cert = "tls-test.crt", key = "tls-test.key";
+    CertFiles() { oxenss::generate_cert(cert, key); }
+    ~CertFiles() {
+        std::filesystem::remove(cert);
+        std::filesystem::remove(key);
+    }
+};
+
+ssl_ctx_ptr server_ctx(const CertFiles& files, TlsSessionTickets& tickets) {
+    ssl_ctx_ptr ctx{SSL_CTX_new(TLS_server_method())};
+    REQUIRE(ctx);
+    REQUIRE(SSL_CTX_use_certificate_file(ctx.get(), files.cert.c_str(), SSL_FILETYPE_PEM) == 1);
+    REQUIRE(SSL_CTX_use_PrivateKey_file(ctx.get(), files.key.c_str(), SSL_FILETYPE_PEM) == 1);
+    tickets.attach(ctx.get());
+    return ctx;
+}
+
+// Does a handshake over an in-memory BIO pair, resuming `session` if given.  Returns whether the
+// session got resumed, and sets `session` to the client's new session.
+bool connect(SSL_CTX* sctx, SSL_CTX* cctx, SSL_SESSION*& session) {
+    SSL* server = SSL_new(sctx);
+    SSL* client = SSL_new(cctx);
+    BIO *sbio, *cbio;
+    REQUIRE(BIO_new_bio_pair(&sbio, 0, &cbio, 0) == 1);
+    SSL_set_bio(server, sbio, sbio);
+    SSL_set_bio(client, cbio, cbio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+    if (session)
+        SSL_set_session(client, session);
+
+    bool server_done = false, client_done = false;
+    for (int i = 0; i < 20 && !(server_done && client_done); i++) {
+        if (!client_done)
+            client_done = SSL_do_handshake(client) == 1;
+        if (!server_done)
+            server_done = SSL_do_handshake(server) == 1;
+    }
+    REQUIRE(client_done);
+    REQUIRE(server_done);
+
+    // With TLS 1.3 the tickets arrive after the handshake, so let the client read them:
+    char buf;
+    CHECK(SSL_read(client, &buf, 1) <= 0);
+
+    bool reused = SSL_session_reused(client);
+    CHECK(SSL_session_reused(server) == reused);
+    if (session)
+        SSL_SESSION_free(session);
+    // (The client won't reuse a session from a connection that wasn't shut down cleanly)
+    SSL_shutdown(client);
+    SSL_shutdown(server);
+    session = SSL_get1_session(client);
+    SSL_free(client);
+    SSL_free(server);
+    return reused;
+}
+
+}  // namespace
+
+TEST_CASE("TLS session tickets - resumption across contexts", "[https][tls]") {
+    CertFiles files;
+    TlsSessionTickets tickets;
+    // Two contexts sharing tickets (as our HTTPS loops do):
+    auto loop1 = server_ctx(files, tickets);
+    auto loop2 = server_ctx(files, tickets);
+
+    ssl_ctx_ptr client{SSL_CTX_new(TLS_client_method())};
+    SSL_CTX_set_verify(client.get(), SSL_VERIFY_NONE, nullptr);
+
+    SSL_SESSION* session = nullptr;
+    CHECK_FALSE(connect(loop1.get(), client.get(), session));
+    REQUIRE(session);
+    CHECK(connect(loop2.get(), client.get(), session));
+    CHECK(connect(loop1.get(), client.get(), session));
+
+    auto st = tickets.get_stats();
+    CHECK(st.full_handshakes == 1);
+    CHECK(st.resumed == 2);
+    CHECK(st.handshake_max_us <= st.handshake_us);
+    CHECK(st.rotations == 0);
+
+    // A context with different ticket keys can't resume it:
+    TlsSessionTickets other_tickets;
+    auto other = server_ctx(files, other_tickets);
+    CHECK_FALSE(connect(other.get(), client.get(), session));
+    CHECK(other_tickets.get_stats().full_handshakes == 1);
+
+    SSL_SESSION_free(session);
+}